@@ -0,0 +1,307 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <sys/mman.h>
+
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "xwrapper.h"
+
+#define ARENA_ALIGN	16
+#define ARENA_MINCHUNK	(16 * 1024)
+#define ARENA_MAXCHUNK	(1024 * 1024)
+#define ARENA_HUGEPAGE	(2 * 1024 * 1024)
+#define ARENA_SPILLCHUNK (16 * 1024 * 1024)
+#define ARENA_SPILLTMP	"/tmp/telescope.spill.XXXXXXXXXX"
+
+struct arena_chunk {
+	struct arena_chunk	*next;
+	size_t			 len;
+	size_t			 cap;
+	size_t			 maplen;	/* if mapped from the file */
+	/* followed by the data */
+};
+
+/*
+ * Map a chunk from the spill file, once the arena is past spill_at.
+ * Returns NULL if it's not the time or it fails, the heap is used
+ * then and for the rest of the page.  The blocks are allocated
+ * before mapping them: a hole in the file would be filled only on
+ * the first write, and a full /tmp would then raise SIGBUS.
+ */
+static struct arena_chunk *
+arena_grow_file(struct arena *a, size_t size)
+{
+	struct arena_chunk	*c;
+	char			 path[sizeof(ARENA_SPILLTMP)];
+	void			*p;
+	size_t			 cap;
+	int			 r;
+
+	if (a->spill_at == 0 || a->total < a->spill_at)
+		return NULL;
+
+	if (a->spilled == 0) {
+		strlcpy(path, ARENA_SPILLTMP, sizeof(path));
+		if ((a->spill_fd = mkstemp(path)) == -1) {
+			a->spill_at = 0;
+			return NULL;
+		}
+		unlink(path);
+		fcntl(a->spill_fd, F_SETFD, FD_CLOEXEC);
+	}
+
+	cap = ARENA_SPILLCHUNK;
+	while (cap < sizeof(*c) + size)
+		cap *= 2;
+
+#if HAVE_POSIX_FALLOCATE
+	r = posix_fallocate(a->spill_fd, a->spilled, cap);
+#else
+	r = ftruncate(a->spill_fd, a->spilled + cap);
+#endif
+	if (r != 0 || (p = mmap(NULL, cap, PROT_READ|PROT_WRITE, MAP_SHARED,
+	    a->spill_fd, a->spilled)) == MAP_FAILED) {
+		if (a->spilled == 0)
+			close(a->spill_fd);
+		a->spill_at = 0;
+		return NULL;
+	}
+
+	c = p;
+	c->len = 0;
+	c->cap = cap - sizeof(*c);
+	c->maplen = cap;
+	c->next = a->chunks;
+	a->chunks = c;
+	a->spilled += cap;
+	return c;
+}
+
+static void
+arena_chunk_free(struct arena *a, struct arena_chunk *c)
+{
+	/* the spill file goes away as a whole, see arena_unspill */
+	if (c->maplen != 0)
+		munmap(c, c->maplen);
+	else {
+		a->total -= sizeof(*c) + c->cap;
+		free(c);
+	}
+}
+
+static struct arena_chunk *
+arena_grow(struct arena *a, size_t size)
+{
+	struct arena_chunk	*c;
+	size_t			 cap;
+
+	if ((c = arena_grow_file(a, size)) != NULL)
+		return c;
+
+	cap = ARENA_MINCHUNK;
+	if (a->chunks != NULL && a->chunks->cap < ARENA_MAXCHUNK)
+		cap = a->chunks->cap * 2;
+	else if (a->chunks != NULL)
+		cap = ARENA_MAXCHUNK;
+	while (cap < size)
+		cap *= 2;
+
+	c = xmalloc(sizeof(*c) + cap);
+	c->len = 0;
+	c->cap = cap;
+	c->maplen = 0;
+	c->next = a->chunks;
+	a->chunks = c;
+	a->total += sizeof(*c) + cap;
+	return c;
+}
+
+/*
+ * Make sure that the next size bytes come from the same chunk.  A
+ * chunk that big is aligned to, and where possible backed by, huge
+ * pages, so that filling it faults once every 2MB, not every page.
+ */
+void
+arena_reserve(struct arena *a, size_t size)
+{
+	struct arena_chunk	*c;
+	void			*p;
+	size_t			 cap;
+
+	if ((c = a->chunks) != NULL && c->cap - c->len >= size + ARENA_ALIGN)
+		return;
+
+	if (arena_grow_file(a, size + ARENA_ALIGN) != NULL)
+		return;
+
+	if (size < ARENA_HUGEPAGE) {
+		arena_grow(a, size + ARENA_ALIGN);
+		return;
+	}
+
+	if (size > SIZE_MAX - sizeof(*c) - ARENA_HUGEPAGE)
+		errx(1, "arena_reserve: overflow");
+	cap = (sizeof(*c) + size + ARENA_HUGEPAGE - 1) & ~(ARENA_HUGEPAGE - 1);
+	if (posix_memalign(&p, ARENA_HUGEPAGE, cap) != 0)
+		err(1, "posix_memalign");
+#ifdef MADV_HUGEPAGE
+	madvise(p, cap, MADV_HUGEPAGE);
+#endif
+
+	c = p;
+	c->len = 0;
+	c->cap = cap - sizeof(*c);
+	c->maplen = 0;
+	c->next = a->chunks;
+	a->chunks = c;
+	a->total += cap;
+}
+
+/*
+ * Returns zeroed memory; like the xwrapper functions, never fails.
+ */
+void *
+arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk	*c;
+	size_t			 off;
+	void			*ptr;
+
+	if (size == 0)
+		errx(1, "arena_alloc: zero size");
+
+	c = a->chunks;
+	if (c != NULL) {
+		off = (c->len + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+		if (off >= c->len && off <= c->cap && c->cap - off >= size) {
+			c->len = off;
+			goto done;
+		}
+	}
+
+	c = arena_grow(a, size);
+
+done:
+	ptr = (char *)(c + 1) + c->len;
+	c->len += size;
+	memset(ptr, 0, size);
+	return ptr;
+}
+
+void *
+arena_calloc(struct arena *a, size_t nmemb, size_t size)
+{
+	if (size != 0 && nmemb > SIZE_MAX / size)
+		errx(1, "arena_calloc: overflow");
+	return arena_alloc(a, nmemb * size);
+}
+
+char *
+arena_strdup(struct arena *a, const char *str)
+{
+	return arena_strndup(a, str, strlen(str));
+}
+
+char *
+arena_strndup(struct arena *a, const char *str, size_t maxlen)
+{
+	char	*cp;
+	size_t	 len;
+
+	len = strnlen(str, maxlen);
+	cp = arena_alloc(a, len + 1);
+	memcpy(cp, str, len);
+	return cp;
+}
+
+/*
+ * Once the arena holds more than size bytes, take the next chunks
+ * from a temporary file, so that the kernel can write them out and
+ * read them back as needed instead of keeping them all in memory.
+ * Zero turns it off.  It lasts until the next arena_reset.
+ */
+void
+arena_spill_at(struct arena *a, size_t size)
+{
+	a->spill_at = size;
+}
+
+static void
+arena_unspill(struct arena *a)
+{
+	a->spill_at = 0;
+	if (a->spilled != 0)
+		close(a->spill_fd);
+	a->spilled = 0;
+}
+
+/*
+ * Release everything but the most recent (and biggest) chunk, which
+ * is kept around for reuse if it's not in the spill file.
+ */
+void
+arena_reset(struct arena *a)
+{
+	struct arena_chunk	*c, *n;
+
+	if ((c = a->chunks) != NULL) {
+		for (n = c->next; n != NULL; n = c->next) {
+			c->next = n->next;
+			arena_chunk_free(a, n);
+		}
+		c->len = 0;
+		if (c->maplen != 0) {
+			arena_chunk_free(a, c);
+			a->chunks = NULL;
+		}
+	}
+
+	arena_unspill(a);
+}
+
+void
+arena_free(struct arena *a)
+{
+	struct arena_chunk	*c, *n;
+
+	for (c = a->chunks; c != NULL; c = n) {
+		n = c->next;
+		arena_chunk_free(a, c);
+	}
+	a->chunks = NULL;
+	arena_unspill(a);
+}
+
+/* the memory held by the arena, the spilled chunks aside */
+size_t
+arena_size(struct arena *a)
+{
+	return a->total;
+}
+
+/* the bytes mapped from the spill file */
+size_t
+arena_spilled(struct arena *a)
+{
+	return a->spilled;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef ARENA_H
+#define ARENA_H
+
+/*
+ * A simple bump allocator.  Memory is handed out from big chunks and
+ * released all at once with arena_reset or arena_free.  Past a size
+ * set with arena_spill_at, the chunks are mapped from a temporary
+ * file instead.
+ */
+
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk	*chunks;
+	size_t			 total;		/* on the heap */
+	size_t			 spill_at;
+	size_t			 spilled;	/* in the file */
+	int			 spill_fd;	/* if spilled != 0 */
+};
+
+void	 arena_reserve(struct arena *, size_t);
+void	*arena_alloc(struct arena *, size_t);
+void	*arena_calloc(struct arena *, size_t, size_t);
+char	*arena_strdup(struct arena *, const char *);
+char	*arena_strndup(struct arena *, const char *, size_t);
+void	 arena_spill_at(struct arena *, size_t);
+void	 arena_reset(struct arena *);
+void	 arena_free(struct arena *);
+size_t	 arena_size(struct arena *);
+size_t	 arena_spilled(struct arena *);
+
+#endif /* ARENA_H */
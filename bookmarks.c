@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * The bookmarks file is read once, and again only if it changes on
+ * disk, into its lines and an hash of the URLs of its links: adding a
+ * bookmark already there is a no-op, and the new ones are appended
+ * to the file.  A link found twice in the file is indexed only once,
+ * but the file itself is never rewritten.  about:bookmarks is made of
+ * the same lines, so whatever else the user wrote in the file is kept.
+ */
+
+#include "compat.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bookmarks.h"
+#include "fs.h"
+#include "pages.h"
+#include "parser.h"
+#include "telescope.h"
+#include "utils.h"
+#include "xwrapper.h"
+
+static struct ohash	  bookmarks;
+static struct bookmark	**order;	/* NULL-terminated, in file order */
+static size_t		  nbookmarks, ordercap;
+static char		**lines;
+static size_t		  nlines, linescap;
+static int		  initialized, exists;
+static struct stat	  seen;		/* of the file when it was read */
+
+static void
+bookmarks_clear(void)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct bookmark, url),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+	size_t		 i;
+
+	if (initialized)
+		ohash_delete(&bookmarks);
+	ohash_init(&bookmarks, 5, &info);
+	initialized = 1;
+
+	for (i = 0; i < nbookmarks; ++i) {
+		free(order[i]->label);
+		free(order[i]);
+	}
+	nbookmarks = 0;
+
+	for (i = 0; i < nlines; ++i)
+		free(lines[i]);
+	nlines = 0;
+}
+
+static void
+push_line(const char *line)
+{
+	if (nlines == linescap) {
+		linescap = linescap == 0 ? 64 : linescap * 2;
+		lines = xreallocarray(lines, linescap, sizeof(*lines));
+	}
+	lines[nlines++] = xstrdup(line);
+}
+
+/* index the link in line, if it's one not seen yet */
+static void
+index_line(const char *line)
+{
+	struct bookmark	*b;
+	unsigned int	 slot;
+	const char	*url, *end, *label;
+	size_t		 len;
+
+	if (strncmp(line, "=>", 2) != 0)
+		return;
+
+	url = line + 2;
+	url += strspn(url, " \t");
+	if ((len = strcspn(url, " \t")) == 0)
+		return;
+	label = url + len;
+	label += strspn(label, " \t");
+
+	end = url + len;
+	slot = ohash_qlookupi(&bookmarks, url, &end);
+	if (ohash_find(&bookmarks, slot) != NULL)
+		return;
+
+	b = xcalloc(1, sizeof(*b) + len + 1);
+	memcpy(b->url, url, len);
+	b->label = xstrdup(label);
+	ohash_insert(&bookmarks, slot, b);
+
+	if (nbookmarks + 1 >= ordercap) {
+		ordercap = ordercap == 0 ? 64 : ordercap * 2;
+		order = xreallocarray(order, ordercap, sizeof(*order));
+	}
+	order[nbookmarks++] = b;
+	order[nbookmarks] = NULL;
+}
+
+static int
+same_stat(const struct stat *a, const struct stat *b)
+{
+	return a->st_ino == b->st_ino && a->st_size == b->st_size &&
+	    a->st_mtime == b->st_mtime;
+}
+
+/* (re)load the file if it changed since the last time */
+static void
+bookmarks_load(void)
+{
+	FILE		*fp;
+	struct stat	 sb;
+	char		*line = NULL;
+	size_t		 linesize = 0;
+	ssize_t		 linelen;
+
+	if (stat(bookmark_file, &sb) == -1) {
+		if (initialized && !exists)
+			return;
+		bookmarks_clear();
+		exists = 0;
+		return;
+	}
+	if (initialized && exists && same_stat(&sb, &seen))
+		return;
+
+	bookmarks_clear();
+	exists = 1;
+	seen = sb;
+	if ((fp = fopen(bookmark_file, "r")) == NULL)
+		return;
+
+	while ((linelen = getline(&line, &linesize, fp)) != -1) {
+		if (linelen > 0 && line[linelen - 1] == '\n')
+			line[--linelen] = '\0';
+		index_line(line);
+		push_line(line);
+	}
+	free(line);
+	fclose(fp);
+}
+
+/*
+ * Add url to the bookmarks.  Returns -1 on error, 1 if it already
+ * was there and 0 otherwise.
+ */
+int
+bookmark_page(const char *url)
+{
+	FILE		*fp;
+	struct stat	 sb;
+	char		*line;
+
+	bookmarks_load();
+	if (bookmark_has(url))
+		return 1;
+
+	if ((fp = fopen(bookmark_file, "a")) == NULL)
+		return -1;
+	fprintf(fp, "=> %s\n", url);
+	if (fclose(fp) == EOF)
+		return -1;
+
+	xasprintf(&line, "=> %s", url);
+	index_line(line);
+	push_line(line);
+	free(line);
+
+	/* don't read again what's already known */
+	if (stat(bookmark_file, &sb) == 0) {
+		exists = 1;
+		seen = sb;
+	}
+	return 0;
+}
+
+int
+bookmark_has(const char *url)
+{
+	bookmarks_load();
+	return bookmark_known(url);
+}
+
+/*
+ * Like bookmark_has, but without looking whether the file changed, so
+ * the array from bookmarks_all stays valid.
+ */
+int
+bookmark_known(const char *url)
+{
+	return ohash_find(&bookmarks, ohash_qlookup(&bookmarks, url)) != NULL;
+}
+
+/* the bookmarks in the order of the file, NULL-terminated */
+struct bookmark **
+bookmarks_all(void)
+{
+	static struct bookmark	*none = NULL;
+
+	bookmarks_load();
+	return nbookmarks != 0 ? order : &none;
+}
+
+void
+bookmarks_about(struct tab *tab)
+{
+	size_t		 i;
+
+	bookmarks_load();
+	if (!exists) {
+		/* the bundled page explains how to start */
+		if (!gemtext_load_lines(tab, &bookmarks_lines))
+			abort();
+		return;
+	}
+
+	parser_init(&tab->buffer, &gemtext_parser);
+	for (i = 0; i < nlines; ++i)
+		parser_parsef(&tab->buffer, "%s\n", lines[i]);
+	parser_free(tab);
+}
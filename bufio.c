@@ -25,7 +25,8 @@
 
 #include "compat.h"
 
-#include <assert.h>
+#include <sys/uio.h>
+
 #include <errno.h>
 #include <stdarg.h>
 #include <stdint.h>
@@ -43,31 +44,97 @@ buf_init(struct buf *buf)
 	const size_t	 cap = BIO_CHUNK;
 
 	memset(buf, 0, sizeof(*buf));
-	if ((buf->buf = malloc(cap)) == NULL)
+	if ((buf->base = malloc(cap)) == NULL)
 		return (-1);
+	buf->buf = buf->base;
 	buf->cap = cap;
 	return (0);
 }
 
+/*
+ * Make room for at least len more bytes after the data.  The space
+ * of what was drained is reclaimed when it's cheap to do so, that is
+ * when there's less to move than what's reclaimed; otherwise the
+ * buffer doubles in size.
+ */
 static int
-buf_grow(struct buf *buf)
+buf_reserve(struct buf *buf, size_t len)
 {
-	size_t		 newcap;
+	size_t		 off, newcap;
 	void		*t;
 
-	newcap = buf->cap + BIO_CHUNK;
-	t = realloc(buf->buf, newcap);
+	off = buf->buf - buf->base;
+	if (buf->cap - off - buf->len >= len)
+		return (0);
+
+	if (off != 0 && buf->len <= off) {
+		memmove(buf->base, buf->buf, buf->len);
+		buf->buf = buf->base;
+		off = 0;
+		if (buf->cap - buf->len >= len)
+			return (0);
+	}
+
+	newcap = buf->cap;
+	while (newcap - off - buf->len < len) {
+		if (newcap > SIZE_MAX / 2) {
+			errno = ENOMEM;
+			return (-1);
+		}
+		newcap *= 2;
+	}
+
+	t = realloc(buf->base, newcap);
 	if (t == NULL)
 		return (-1);
-	buf->buf = t;
+	buf->base = t;
+	buf->buf = buf->base + off;
 	buf->cap = newcap;
 	return (0);
 }
 
+int
+buf_append(struct buf *buf, const void *d, size_t len)
+{
+	if (buf_reserve(buf, len) == -1)
+		return (-1);
+	memcpy(buf->buf + buf->len, d, len);
+	buf->len += len;
+	return (0);
+}
+
+/*
+ * Find the delimiter in the buffer with memchr on its first byte,
+ * starting from where the previous search stopped.
+ */
+static uint8_t *
+buf_find(struct buf *buf, const char *nl, size_t nlen)
+{
+	uint8_t		*p, *end;
+
+	if (nlen == 0 || buf->len < nlen)
+		return (NULL);
+
+	p = buf->buf + buf->scan;
+	end = buf->buf + buf->len - nlen + 1;
+	while (p < end) {
+		if ((p = memchr(p, nl[0], end - p)) == NULL)
+			break;
+		if (!memcmp(p + 1, nl + 1, nlen - 1)) {
+			buf->scan = p - buf->buf;
+			return (p);
+		}
+		p++;
+	}
+
+	buf->scan = end - buf->buf;
+	return (NULL);
+}
+
 int
 buf_has_line(struct buf *buf, const char *nl)
 {
-	return (memmem(buf->buf, buf->len, nl, strlen(nl)) != NULL);
+	return (buf_find(buf, nl, strlen(nl)) != NULL);
 }
 
 char *
@@ -79,7 +146,7 @@ buf_getdelim(struct buf *buf, const char *nl, size_t *len)
 	*len = 0;
 
 	nlen = strlen(nl);
-	if ((endl = memmem(buf->buf, buf->len, nl, nlen)) == NULL)
+	if ((endl = buf_find(buf, nl, nlen)) == NULL)
 		return (NULL);
 	*len = endl + nlen - buf->buf;
 	*endl = '\0';
@@ -92,12 +159,15 @@ buf_drain(struct buf *buf, size_t l)
 	buf->cur = 0;
 
 	if (l >= buf->len) {
+		buf->buf = buf->base;
 		buf->len = 0;
+		buf->scan = 0;
 		return;
 	}
 
-	memmove(buf->buf, buf->buf + l, buf->len - l);
+	buf->buf += l;
 	buf->len -= l;
+	buf->scan = buf->scan > l ? buf->scan - l : 0;
 }
 
 void
@@ -107,7 +177,7 @@ buf_drain_line(struct buf *buf, const char *nl)
 	size_t		 nlen;
 
 	nlen = strlen(nl);
-	if ((endln = memmem(buf->buf, buf->len, nl, nlen)) == NULL)
+	if ((endln = buf_find(buf, nl, nlen)) == NULL)
 		return;
 	buf_drain(buf, endln + nlen - buf->buf);
 }
@@ -115,7 +185,7 @@ buf_drain_line(struct buf *buf, const char *nl)
 void
 buf_free(struct buf *buf)
 {
-	free(buf->buf);
+	free(buf->base);
 	memset(buf, 0, sizeof(*buf));
 }
 
@@ -185,37 +255,13 @@ bufio_set_fd(struct bufio *bio, int fd)
 }
 
 int
-bufio_starttls(struct bufio *bio, const char *host, int insecure,
-    const uint8_t *cert, size_t certlen, const uint8_t *key, size_t keylen)
+bufio_starttls(struct bufio *bio, const char *host, struct tls_config *conf)
 {
-	struct tls_config	*conf;
-
-	if ((conf = tls_config_new()) == NULL)
-		return (-1);
-
-	if (insecure) {
-		tls_config_insecure_noverifycert(conf);
-		tls_config_insecure_noverifyname(conf);
-		tls_config_insecure_noverifytime(conf);
-	}
-
-	if (cert && tls_config_set_keypair_mem(conf, cert, certlen,
-	    key, keylen) == -1) {
-		tls_config_free(conf);
-		return (-1);
-	}
-
-	if ((bio->ctx = tls_client()) == NULL) {
-		tls_config_free(conf);
+	if ((bio->ctx = tls_client()) == NULL)
 		return (-1);
-	}
 
-	if (tls_configure(bio->ctx, conf) == -1) {
-		tls_config_free(conf);
+	if (tls_configure(bio->ctx, conf) == -1)
 		return (-1);
-	}
-
-	tls_config_free(conf);
 
 	if (tls_connect_socket(bio->ctx, bio->fd, host) == -1)
 		return (-1);
@@ -265,18 +311,18 @@ bufio_handshake(struct bufio *bio)
 ssize_t
 bufio_read(struct bufio *bio)
 {
+	static uint8_t	 spill[65536];
 	struct buf	*rbuf = &bio->rbuf;
+	struct iovec	 iov[2];
+	size_t		 avail;
 	ssize_t		 r;
 
-	assert(rbuf->cap >= rbuf->len);
-	if (rbuf->cap - rbuf->len < BIO_CHUNK) {
-		if (buf_grow(rbuf) == -1)
+	if (bio->ctx) {
+		if (buf_reserve(rbuf, BIO_TLS_READ) == -1)
 			return (-1);
-	}
 
-	if (bio->ctx) {
-		r = tls_read(bio->ctx, rbuf->buf + rbuf->len,
-		    rbuf->cap - rbuf->len);
+		avail = rbuf->cap - (rbuf->buf - rbuf->base) - rbuf->len;
+		r = tls_read(bio->ctx, rbuf->buf + rbuf->len, avail);
 		switch (r) {
 		case TLS_WANT_POLLIN:
 			errno = EAGAIN;
@@ -295,10 +341,29 @@ bufio_read(struct bufio *bio)
 		}
 	}
 
-	r = read(bio->fd, rbuf->buf + rbuf->len, rbuf->cap - rbuf->len);
+	/*
+	 * Read in what's left of the buffer and in the spill area
+	 * at once, so the buffer only grows by what was received.
+	 */
+	if (buf_reserve(rbuf, BIO_CHUNK) == -1)
+		return (-1);
+	avail = rbuf->cap - (rbuf->buf - rbuf->base) - rbuf->len;
+	iov[0].iov_base = rbuf->buf + rbuf->len;
+	iov[0].iov_len = avail;
+	iov[1].iov_base = spill;
+	iov[1].iov_len = sizeof(spill);
+
+	r = readv(bio->fd, iov, 2);
 	if (r == -1)
 		return (-1);
-	rbuf->len += r;
+	if ((size_t)r <= avail) {
+		rbuf->len += r;
+		return (r);
+	}
+
+	rbuf->len += avail;
+	if (buf_append(rbuf, spill, r - avail) == -1)
+		return (-1);
 	return (r);
 }
 
@@ -314,6 +379,17 @@ bufio_drain(struct bufio *bio, void *d, size_t len)
 	return (len);
 }
 
+/*
+ * Return the data read so far without copying it.  It stays valid
+ * until the next read, and has to be consumed with buf_drain.
+ */
+const void *
+bufio_peek(struct bufio *bio, size_t *len)
+{
+	*len = bio->rbuf.len;
+	return (bio->rbuf.buf);
+}
+
 ssize_t
 bufio_write(struct bufio *bio)
 {
@@ -340,8 +416,12 @@ bufio_write(struct bufio *bio)
 	}
 
 	w = write(bio->fd, wbuf->buf, wbuf->len);
-	if (w == -1)
+	if (w == -1) {
+		/* a TCP Fast Open socket still connecting */
+		if (errno == EINPROGRESS)
+			errno = EAGAIN;
 		return (-1);
+	}
 	buf_drain(wbuf, w);
 	return (w);
 }
@@ -358,16 +438,7 @@ bufio_io_err(struct bufio *bio)
 int
 bufio_compose(struct bufio *bio, const void *d, size_t len)
 {
-	struct buf	*wbuf = &bio->wbuf;
-
-	while (wbuf->cap - wbuf->len < len) {
-		if (buf_grow(wbuf) == -1)
-			return (-1);
-	}
-
-	memcpy(wbuf->buf + wbuf->len, d, len);
-	wbuf->len += len;
-	return (0);
+	return (buf_append(&bio->wbuf, d, len));
 }
 
 int
@@ -24,13 +24,24 @@
  */
 
 struct tls;
+struct tls_config;
 
 #define BIO_CHUNK	128
+#define BIO_TLS_READ	16384	/* max size of a TLS record */
+
+/*
+ * The data is in buf[0..len], which points inside the allocation at
+ * base: draining just moves buf forward.  No delimiter starts in the
+ * first scan bytes, so a search resumes from there when more data
+ * arrives.
+ */
 struct buf {
+	uint8_t		*base;
 	uint8_t		*buf;
 	size_t		 len;
 	size_t		 cap;
 	size_t		 cur;
+	size_t		 scan;
 };
 
 struct bufio {
@@ -45,6 +56,7 @@ struct bufio {
 #define	BUFIO_WANT_WRITE	0x2
 
 int		 buf_init(struct buf *);
+int		 buf_append(struct buf *, const void *, size_t);
 int		 buf_has_line(struct buf *, const char *);
 char		*buf_getdelim(struct buf *, const char *, size_t *);
 void		 buf_drain(struct buf *, size_t);
@@ -56,12 +68,13 @@ void		 bufio_free(struct bufio *);
 int		 bufio_close(struct bufio *);
 int		 bufio_reset(struct bufio *);
 void		 bufio_set_fd(struct bufio *, int);
-int		 bufio_starttls(struct bufio *, const char *, int,
-		    const uint8_t *, size_t, const uint8_t *, size_t);
+int		 bufio_starttls(struct bufio *, const char *,
+		    struct tls_config *);
 int		 bufio_ev(struct bufio *);
 int		 bufio_handshake(struct bufio *);
 ssize_t		 bufio_read(struct bufio *);
 size_t		 bufio_drain(struct bufio *, void *, size_t);
+const void	*bufio_peek(struct bufio *, size_t *);
 ssize_t		 bufio_write(struct bufio *);
 const char	*bufio_io_err(struct bufio *);
 int		 bufio_compose(struct bufio *, const void *, size_t);
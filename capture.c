@@ -0,0 +1,469 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Recording the replies of the servers and serving them again, for
+ * the net process.  A capture file is a magic line followed by
+ * records, in the byte order of the machine that wrote them:
+ *
+ *	CAP_REQ		the key of the request, see req_key in net.c
+ *	CAP_CERT	the hash of the certificate, after the handshake
+ *	CAP_DATA	bytes read from the server
+ *	CAP_EOF		the server is done
+ *
+ * each with the id of the request and the usec since it started.
+ * Only the replies that got to the end are replayed.  They're written
+ * to a socketpair that the request reads as if it were connected to
+ * the server, right away or with the original pacing.
+ */
+
+#include "compat.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "ev.h"
+#include "perf.h"
+#include "utils.h"
+#include "xwrapper.h"
+
+#define CAPTURE_MAGIC	"telescope capture 1\n"
+
+enum {
+	CAP_REQ = 1,
+	CAP_CERT,
+	CAP_DATA,
+	CAP_EOF,
+};
+
+struct cap_rec {
+	uint32_t	 type;
+	uint32_t	 id;
+	uint64_t	 usec;
+	uint64_t	 len;
+};
+
+struct cap_chunk {
+	uint64_t	 usec;
+	const uint8_t	*data;
+	size_t		 len;
+};
+
+struct cap_resp {
+	uint32_t	 id;
+	const char	*key;
+	const char	*hash;
+	uint64_t	 cert_usec;
+	struct cap_chunk *chunks;
+	size_t		 nchunks;
+	size_t		 cap;
+	struct cap_resp	*next;
+};
+
+/* the replies to the same request, replayed in turn */
+struct cap_entry {
+	struct cap_resp	*first;
+	struct cap_resp	*last;
+	struct cap_resp	*cur;
+	char		 key[];
+};
+
+/* a reply being written to the request */
+struct cap_job {
+	int		 fd;
+	int		 polling;
+	unsigned int	 timer;
+	uint64_t	 start;
+	struct cap_resp	*resp;
+	size_t		 i;
+	size_t		 off;
+};
+
+int			 capture_mode = CAPTURE_NONE;
+
+static int		 cap_fd = -1;
+static int		 cap_paced;
+static char		*cap_buf;
+static struct ohash	 entries;
+
+static void	 job_run(int, int, void *);
+static void	 job_drain(int, int, void *);
+
+int
+capture_record(int fd)
+{
+	if (capture_mode != CAPTURE_NONE) {
+		close(fd);
+		return (-1);
+	}
+
+	cap_fd = fd;
+	capture_mode = CAPTURE_RECORD;
+	if (write(fd, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1) == -1) {
+		capture_mode = CAPTURE_NONE;
+		return (-1);
+	}
+	return (0);
+}
+
+/* a record is one writev, so the file stays sane on a crash */
+static void
+cap_write(uint32_t type, uint32_t id, uint64_t usec, const void *data,
+    size_t len)
+{
+	struct cap_rec	 rec;
+	struct iovec	 iov[2];
+
+	if (capture_mode != CAPTURE_RECORD)
+		return;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.id = id;
+	rec.usec = usec;
+	rec.len = len;
+
+	iov[0].iov_base = &rec;
+	iov[0].iov_len = sizeof(rec);
+	iov[1].iov_base = (void *)data;
+	iov[1].iov_len = len;
+	if (writev(cap_fd, iov, 2) == -1) {
+		/* the disk is full or so: stop here */
+		capture_mode = CAPTURE_NONE;
+		close(cap_fd);
+		cap_fd = -1;
+	}
+}
+
+void
+capture_req(uint32_t id, const char *key)
+{
+	cap_write(CAP_REQ, id, 0, key, strlen(key) + 1);
+}
+
+void
+capture_cert(uint32_t id, uint64_t usec, const char *hash)
+{
+	cap_write(CAP_CERT, id, usec, hash, strlen(hash) + 1);
+}
+
+void
+capture_data(uint32_t id, uint64_t usec, const void *data, size_t len)
+{
+	cap_write(CAP_DATA, id, usec, data, len);
+}
+
+void
+capture_eof(uint32_t id, uint64_t usec)
+{
+	cap_write(CAP_EOF, id, usec, NULL, 0);
+}
+
+static void
+resp_free(struct cap_resp *resp)
+{
+	free(resp->chunks);
+	free(resp);
+}
+
+static void
+entry_add(struct cap_resp *resp)
+{
+	struct cap_entry	*e;
+	unsigned int		 slot;
+	size_t			 len;
+
+	slot = ohash_qlookup(&entries, resp->key);
+	if ((e = ohash_find(&entries, slot)) == NULL) {
+		len = strlen(resp->key) + 1;
+		e = xcalloc(1, sizeof(*e) + len);
+		memcpy(e->key, resp->key, len);
+		ohash_insert(&entries, slot, e);
+	}
+
+	if (e->last != NULL)
+		e->last->next = resp;
+	else
+		e->first = e->cur = resp;
+	e->last = resp;
+}
+
+static int
+read_all(int fd, char **buf, size_t *len)
+{
+	struct stat	 sb;
+	ssize_t		 n;
+
+	if (fstat(fd, &sb) == -1 || sb.st_size < 0)
+		return (-1);
+
+	*buf = xmalloc(sb.st_size + 1);
+	*len = 0;
+	while (*len < (size_t)sb.st_size) {
+		if ((n = read(fd, *buf + *len, sb.st_size - *len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			free(*buf);
+			return (-1);
+		}
+		if (n == 0)
+			break;
+		*len += n;
+	}
+	return (0);
+}
+
+/*
+ * Load the capture in fd to replay it.  A truncated file, like one
+ * from a crashed session, is used up to there.  Even if it can't be
+ * read at all the requests are answered only from the capture, so
+ * that they fail instead of going to the network.
+ */
+int
+capture_replay(int fd, int paced)
+{
+	struct ohash_info	 info = {
+		.key_offset = offsetof(struct cap_entry, key),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+	struct ohash		 open;
+	struct cap_rec		 rec;
+	struct cap_resp		*resp;
+	struct cap_chunk	*c;
+	const char		*data;
+	unsigned int		 slot;
+	size_t			 off, len;
+	int			 ret = -1;
+
+	if (capture_mode != CAPTURE_NONE) {
+		close(fd);
+		return (-1);
+	}
+
+	capture_mode = CAPTURE_REPLAY;
+	cap_paced = paced;
+	ohash_init(&entries, 5, &info);
+
+	if (read_all(fd, &cap_buf, &len) == -1) {
+		close(fd);
+		return (-1);
+	}
+	close(fd);
+
+	off = sizeof(CAPTURE_MAGIC) - 1;
+	if (len < off || memcmp(cap_buf, CAPTURE_MAGIC, off) != 0)
+		return (-1);
+
+	idmap_init(&open, offsetof(struct cap_resp, id));
+	for (;;) {
+		if (off == len) {
+			ret = 0;
+			break;
+		}
+		if (len - off < sizeof(rec))
+			break;
+		memcpy(&rec, cap_buf + off, sizeof(rec));
+		off += sizeof(rec);
+		if (rec.len > len - off)
+			break;
+		data = cap_buf + off;
+		off += rec.len;
+
+		if ((rec.type == CAP_REQ || rec.type == CAP_CERT) &&
+		    (rec.len == 0 || data[rec.len - 1] != '\0'))
+			break;
+
+		resp = idmap_get(&open, rec.id);
+		if (resp == NULL && rec.type != CAP_REQ)
+			continue;
+
+		switch (rec.type) {
+		case CAP_REQ:
+			if (resp != NULL) {
+				/* it never got to the end */
+				idmap_del(&open, rec.id, resp);
+				resp_free(resp);
+			}
+			resp = xcalloc(1, sizeof(*resp));
+			resp->id = rec.id;
+			resp->key = data;
+			idmap_put(&open, rec.id, resp);
+			break;
+		case CAP_CERT:
+			resp->hash = data;
+			resp->cert_usec = rec.usec;
+			break;
+		case CAP_DATA:
+			if (resp->nchunks == resp->cap) {
+				resp->cap = resp->cap == 0 ? 8 : resp->cap * 2;
+				resp->chunks = xreallocarray(resp->chunks,
+				    resp->cap, sizeof(*resp->chunks));
+			}
+			c = &resp->chunks[resp->nchunks++];
+			c->usec = rec.usec;
+			c->data = (const uint8_t *)data;
+			c->len = rec.len;
+			break;
+		case CAP_EOF:
+			idmap_del(&open, rec.id, resp);
+			entry_add(resp);
+			break;
+		default:
+			goto done;
+		}
+	}
+
+ done:
+	for (resp = ohash_first(&open, &slot); resp != NULL;
+	    resp = ohash_next(&open, &slot))
+		resp_free(resp);
+	ohash_delete(&open);
+	return (ret);
+}
+
+static void
+job_free(struct cap_job *job)
+{
+	if (job->timer != 0)
+		ev_timer_cancel(job->timer);
+	if (job->polling)
+		ev_del(job->fd);
+	close(job->fd);
+	free(job);
+}
+
+static void
+job_run(int fd, int ev, void *d)
+{
+	struct cap_job		*job = d;
+	struct cap_chunk	*c;
+	struct timeval		 tv;
+	uint64_t		 now;
+	ssize_t			 n;
+
+	job->timer = 0;
+	while (job->i < job->resp->nchunks) {
+		c = &job->resp->chunks[job->i];
+
+		now = perf_usec() - job->start;
+		if (cap_paced && now < c->usec) {
+			if (job->polling) {
+				ev_del(job->fd);
+				job->polling = 0;
+			}
+			tv.tv_sec = (c->usec - now) / 1000000;
+			tv.tv_usec = (c->usec - now) % 1000000;
+			if ((job->timer = ev_timer(&tv, job_run, job)) == 0)
+				job_free(job);
+			return;
+		}
+
+		n = write(job->fd, c->data + job->off, c->len - job->off);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN) {
+			if (!job->polling &&
+			    ev_add(job->fd, EV_WRITE, job_run, job) == -1) {
+				job_free(job);
+				return;
+			}
+			job->polling = 1;
+			return;
+		}
+		if (n == -1) {
+			/* the request is gone */
+			job_free(job);
+			return;
+		}
+
+		job->off += n;
+		if (job->off == c->len) {
+			job->i++;
+			job->off = 0;
+		}
+	}
+
+	/*
+	 * Closing with the request still unread would reset the
+	 * connection, so only signal the end and wait for the other
+	 * side to go away.
+	 */
+	shutdown(job->fd, SHUT_WR);
+	if (ev_add(job->fd, EV_READ, job_drain, job) == -1) {
+		job_free(job);
+		return;
+	}
+	job->polling = 1;
+}
+
+static void
+job_drain(int fd, int ev, void *d)
+{
+	struct cap_job	*job = d;
+	char		 buf[1024];
+	ssize_t		 n;
+
+	while ((n = read(job->fd, buf, sizeof(buf))) > 0)
+		;
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	job_free(job);
+}
+
+/*
+ * Start writing the reply to the request with the given key on fd,
+ * and set hash to the certificate, if any, that the server presented
+ * and cert_usec to when, if paced, the handshake has to end.
+ */
+int
+capture_start(const char *key, int fd, uint64_t *cert_usec,
+    const char **hash)
+{
+	struct cap_entry	*e;
+	struct cap_resp		*resp;
+	struct cap_job		*job;
+
+	e = ohash_find(&entries, ohash_qlookup(&entries, key));
+	if (e == NULL)
+		return (-1);
+
+	/* the last one is replayed over again */
+	resp = e->cur;
+	if (resp->next != NULL)
+		e->cur = resp->next;
+
+	*cert_usec = cap_paced ? resp->cert_usec : 0;
+	*hash = resp->hash;
+
+	job = xcalloc(1, sizeof(*job));
+	job->fd = fd;
+	job->start = perf_usec();
+	job->resp = resp;
+	job_run(fd, 0, job);
+	return (0);
+}
@@ -0,0 +1,36 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+extern int	 capture_mode;
+
+#define CAPTURE_NONE	0
+#define CAPTURE_RECORD	1
+#define CAPTURE_REPLAY	2
+
+int	 capture_record(int);
+int	 capture_replay(int, int);
+
+void	 capture_req(uint32_t, const char *);
+void	 capture_cert(uint32_t, uint64_t, const char *);
+void	 capture_data(uint32_t, uint64_t, const void *, size_t);
+void	 capture_eof(uint32_t, uint64_t);
+
+int	 capture_start(const char *, int, uint64_t *, const char **);
+
+#endif
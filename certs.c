@@ -31,6 +31,9 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -46,12 +49,34 @@
 #include "certs.h"
 #include "fs.h"
 #include "iri.h"
+#include "utils.h"
 
 struct cstore cert_store;
 
 char		**identities;
 static size_t	  id_len, id_cap;
 
+/*
+ * The identities and the mappings are read on first use, not in
+ * certs_init(), to keep large certificate directories off startup.
+ */
+static const char	*certs_path;
+static int		 certs_loaded;
+static int		 certs_status;
+
+/* the identities as they were when they were last opened */
+struct cstamp {
+	dev_t		 dev;
+	ino_t		 ino;
+	off_t		 size;
+	time_t		 mtime;
+	unsigned int	 sent;		/* bitmap of the net workers */
+	char		 name[];
+};
+
+static struct ohash	 cstamps;
+static int		 cstamps_ready;
+
 /*
  * Default number of bits when creating a new RSA key.
  */
@@ -60,7 +85,9 @@ static size_t	  id_len, id_cap;
 static int
 identities_cmp(const void *a, const void *b)
 {
-	return (strcmp(a, b));
+	const char	*const *x = a, *const *y = b;
+
+	return (strcmp(*x, *y));
 }
 
 static inline int
@@ -68,14 +95,9 @@ push_identity(const char *n)
 {
 	char	*name;
 	void	*t;
-	size_t	 newcap, i;
+	size_t	 newcap;
 
-	for (i = 0; i < id_len; ++i) {
-		if (!strcmp(identities[i], n))
-			return (0);
-	}
-
-	/* id_cap is initilized to 8 in certs_init() */
+	/* readdir() doesn't return duplicates; id_cap starts at 8 */
 	if (id_len >= id_cap - 1) {
 		newcap = id_cap + 8;
 		t = recallocarray(identities, id_cap, newcap,
@@ -144,6 +166,7 @@ certs_store_add(struct cstore *cstore, const char *host, const char *port,
 		free(c->path);
 		free(c->cert);
 		memset(c, 0, sizeof(*c));
+		return (-1);
 	}
 	cstore->len++;
 
@@ -191,6 +214,14 @@ certs_store_parse_line(struct cstore *cstore, char *line)
 
 int
 certs_init(const char *certfile)
+{
+	certs_path = certfile;
+	certs_loaded = 0;
+	return (0);
+}
+
+static int
+certs_read(void)
 {
 	struct dirent *dp;
 	DIR	*certdir;
@@ -217,7 +248,7 @@ certs_init(const char *certfile)
 	closedir(certdir);
 	qsort(identities, id_len, sizeof(*identities), identities_cmp);
 
-	if ((fp = fopen(certfile, "r")) == NULL) {
+	if ((fp = fopen(certs_path, "r")) == NULL) {
 		if (errno == ENOENT)
 			return (0);
 		return (-1);
@@ -248,17 +279,34 @@ certs_init(const char *certfile)
 	return (0);
 }
 
+/*
+ * Read the identities and the certificate mappings if it wasn't done
+ * yet.  A failure is remembered: the store is left with what could be
+ * read and won't be written back.
+ */
+int
+certs_load(void)
+{
+	if (certs_loaded)
+		return (certs_status);
+
+	certs_loaded = 1;
+	certs_status = certs_read();
+	return (certs_status);
+}
+
 const char *
 ccert(const char *name)
 {
-	size_t		 i;
+	char		**id;
 
-	for (i = 0; i < id_len; ++i) {
-		if (!strcmp(name, identities[i]))
-			return (identities[i]);
-	}
+	certs_load();
+	if (id_len == 0)
+		return (NULL);
 
-	return (NULL);
+	id = bsearch(&name, identities, id_len, sizeof(*identities),
+	    identities_cmp);
+	return (id != NULL ? *id : NULL);
 }
 
 /*
@@ -284,18 +332,36 @@ path_under(const char *cpath, const char *tpath)
 	return (cpath[-1] == '/');
 }
 
+/*
+ * The store is sorted, so the certificates for a host and port are
+ * next to each other and the first one is found with a binary search.
+ * Among them the first whose path is a prefix of the iri wins.
+ */
 static struct ccert *
 find_cert_for(struct cstore *cstore, struct iri *iri, size_t *n)
 {
 	struct ccert	*c;
-	size_t		 i;
+	size_t		 lo = 0, hi = cstore->len, mid, i;
+	int		 r;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		c = &cstore->certs[mid];
+		if ((r = strcmp(c->host, iri->iri_host)) == 0)
+			r = strcmp(c->port, iri->iri_portstr);
+		if (r < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
 
-	for (i = 0; i < cstore->len; ++i) {
+	for (i = lo; i < cstore->len; ++i) {
 		c = &cstore->certs[i];
+		if (strcmp(c->host, iri->iri_host) != 0 ||
+		    strcmp(c->port, iri->iri_portstr) != 0)
+			break;
 
-		if (!strcmp(c->host, iri->iri_host) &&
-		    !strcmp(c->port, iri->iri_portstr) &&
-		    path_under(c->path, iri->iri_path)) {
+		if (path_under(c->path, iri->iri_path)) {
 			if (n)
 				*n = i;
 			return (c);
@@ -312,6 +378,7 @@ cert_for(struct iri *iri, int *temporary)
 
 	*temporary = 0;
 
+	certs_load();
 	if ((c = find_cert_for(&cert_store, iri, NULL)) == NULL)
 		return (NULL);
 	if (c->flags & CERT_TEMP_DEL)
@@ -396,6 +463,36 @@ certs_delete(struct cstore *cstore, size_t n)
 	memset(&cstore->certs[cstore->len], 0, sizeof(*cstore->certs));
 }
 
+/* the memory held by the identities and the certificates mappings */
+size_t
+certs_memory(void)
+{
+	struct ccert	*c;
+	struct cstamp	*cs;
+	unsigned int	 slot;
+	size_t		 i, size;
+
+	size = id_cap * sizeof(*identities);
+	for (i = 0; i < id_len; ++i)
+		size += strlen(identities[i]) + 1;
+
+	size += cert_store.cap * sizeof(*cert_store.certs);
+	for (i = 0; i < cert_store.len; ++i) {
+		c = &cert_store.certs[i];
+		size += strlen(c->host) + strlen(c->port) + strlen(c->path) +
+		    strlen(c->cert) + 4;
+	}
+
+	if (!cstamps_ready)
+		return (size);
+
+	size += hash_memory(&cstamps);
+	for (cs = ohash_first(&cstamps, &slot); cs != NULL;
+	    cs = ohash_next(&cstamps, &slot))
+		size += sizeof(*cs) + strlen(cs->name) + 1;
+	return (size);
+}
+
 int
 cert_save_for(const char *cert, struct iri *i, int persist)
 {
@@ -403,6 +500,9 @@ cert_save_for(const char *cert, struct iri *i, int persist)
 	char		*d;
 	int		 flags;
 
+	if (certs_load() == -1)
+		return (-1);
+
 	flags = persist ? 0 : CERT_TEMP;
 
 	if ((c = find_cert_for(&cert_store, i, NULL)) != NULL) {
@@ -433,6 +533,9 @@ cert_delete_for(const char *cert, struct iri *iri, int persist)
 	struct ccert	*c;
 	size_t		 i;
 
+	if (certs_load() == -1)
+		return (-1);
+
 	if ((c = find_cert_for(&cert_store, iri, &i)) == NULL)
 		return (-1);
 
@@ -467,6 +570,74 @@ cert_open(const char *cert)
 	return (fd);
 }
 
+/*
+ * Like cert_open, but the file is opened only if it changed since the
+ * last time it was returned by this function for the given net
+ * worker, as each one keeps a copy of the identities it was given.
+ * Otherwise *fd is -1.
+ */
+int
+cert_open_changed(const char *cert, int net, int *fd)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct cstamp, name),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+	struct cstamp	*cs;
+	struct stat	 sb;
+	char		 path[PATH_MAX];
+	unsigned int	 slot;
+	size_t		 len;
+
+	*fd = -1;
+
+	if (!cstamps_ready) {
+		ohash_init(&cstamps, 4, &info);
+		cstamps_ready = 1;
+	}
+
+	strlcpy(path, cert_dir, sizeof(path));
+	strlcat(path, "/", sizeof(path));
+	strlcat(path, cert, sizeof(path));
+	if (stat(path, &sb) == -1)
+		return (-1);
+
+	slot = ohash_qlookup(&cstamps, cert);
+	if ((cs = ohash_find(&cstamps, slot)) != NULL &&
+	    cs->dev == sb.st_dev && cs->ino == sb.st_ino &&
+	    cs->size == sb.st_size && cs->mtime == sb.st_mtime &&
+	    (cs->sent & (1U << net)))
+		return (0);
+
+	if ((*fd = cert_open(cert)) == -1)
+		return (-1);
+
+	if (fstat(*fd, &sb) == -1) {
+		close(*fd);
+		*fd = -1;
+		return (-1);
+	}
+
+	if (cs == NULL) {
+		len = strlen(cert) + 1;
+		if ((cs = malloc(sizeof(*cs) + len)) == NULL)
+			return (0);	/* it'll be just sent again */
+		memcpy(cs->name, cert, len);
+		cs->sent = 0;
+		ohash_insert(&cstamps, slot, cs);
+	} else if (cs->dev != sb.st_dev || cs->ino != sb.st_ino ||
+	    cs->size != sb.st_size || cs->mtime != sb.st_mtime)
+		cs->sent = 0;	/* the workers have an old copy */
+	cs->sent |= 1U << net;
+	cs->dev = sb.st_dev;
+	cs->ino = sb.st_ino;
+	cs->size = sb.st_size;
+	cs->mtime = sb.st_mtime;
+	return (0);
+}
+
 static EVP_PKEY *
 rsa_key_create(FILE *f)
 {
@@ -503,13 +674,13 @@ rsa_key_create(FILE *f)
 }
 
 static EVP_PKEY *
-ec_key_create(FILE *f)
+ec_key_create(FILE *f, int nid)
 {
 	EC_KEY		*eckey = NULL;
 	EVP_PKEY	*pkey = NULL;
 	int		 ret = -1;
 
-	if ((eckey = EC_KEY_new_by_curve_name(NID_secp384r1)) == NULL)
+	if ((eckey = EC_KEY_new_by_curve_name(nid)) == NULL)
 		goto done;
 
 	if (!EC_KEY_generate_key(eckey))
@@ -537,7 +708,7 @@ ec_key_create(FILE *f)
 }
 
 int
-cert_new(const char *common_name, const char *path, int eckey)
+cert_new(const char *common_name, const char *path, int keytype)
 {
 	EVP_PKEY	*pkey = NULL;
 	X509		*x509 = NULL;
@@ -549,10 +720,17 @@ cert_new(const char *common_name, const char *path, int eckey)
 	if ((fp = fopen(path, "wx")) == NULL)
 		goto done;
 
-	if (eckey)
-		pkey = ec_key_create(fp);
-	else
+	switch (keytype) {
+	case CERT_KEY_EC:
+		pkey = ec_key_create(fp, NID_secp384r1);
+		break;
+	case CERT_KEY_P256:
+		pkey = ec_key_create(fp, NID_X9_62_prime256v1);
+		break;
+	default:
 		pkey = rsa_key_create(fp);
+		break;
+	}
 	if (pkey == NULL)
 		goto done;
 
@@ -594,9 +772,11 @@ cert_new(const char *common_name, const char *path, int eckey)
 		X509_free(x509);
 	if (name)
 		X509_NAME_free(name);
-	if (fp)
+	/* don't remove an identity that was already there */
+	if (fp) {
 		fclose(fp);
-	if (ret == -1)
-		(void) unlink(path);
+		if (ret == -1)
+			(void) unlink(path);
+	}
 	return (ret);
 }
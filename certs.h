@@ -43,9 +43,15 @@ extern struct cstore	 cert_store;
 extern char		**identities;
 
 int		 certs_init(const char *);
+int		 certs_load(void);
 const char	*ccert(const char *);
 const char	*cert_for(struct iri *, int *);
 int		 cert_save_for(const char *, struct iri *, int);
 int		 cert_delete_for(const char *, struct iri *, int);
 int		 cert_open(const char *);
+int		 cert_open_changed(const char *, int, int *);
+#define CERT_KEY_RSA	0
+#define CERT_KEY_EC	1	/* secp384r1 */
+#define CERT_KEY_P256	2
 int		 cert_new(const char *, const char *, int);
+size_t		 certs_memory(void);
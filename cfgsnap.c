@@ -0,0 +1,299 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A snapshot of the configuration, so that it doesn't need to be
+ * parsed again when it hasn't changed.  While parse.y goes through
+ * the config it records what it resolved every rule to: the colour
+ * and attribute names are already numbers, and the bindings are by
+ * command name.  It's saved together with the size, the mtime and a
+ * hash of the files read, and replayed at the next start if they're
+ * unchanged and the snapshot was written by the same version.
+ *
+ * Like session.bin it's in host byte order, as it's just a cache.
+ */
+
+#include "compat.h"
+
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "cfgsnap.h"
+#include "utils.h"
+#include "xwrapper.h"
+
+#define CFGSNAP_MAGIC	"TLSCCONF"
+#define CFGSNAP_VERSION	1
+#define CFGSNAP_NULL	UINT32_MAX
+
+struct cfgsnap_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 nfiles;
+	uint32_t	 nops;
+	uint32_t	 strslen;
+	uint64_t	 hash;		/* of what follows the header */
+	char		 package[32];	/* VERSION that wrote it */
+};
+
+struct cfgsnap_file {
+	uint32_t	 path;		/* offset in the strings */
+	uint32_t	 exists;
+	int64_t		 size;
+	int64_t		 mtime;
+	uint64_t	 hash;		/* of the content */
+};
+
+struct cfgsnap_op {
+	uint32_t	 op;
+	int32_t		 num[CFG_NNUM];
+	uint32_t	 str[CFG_NSTR];	/* offsets, or CFGSNAP_NULL */
+};
+
+static struct cfgsnap_file	*files;
+static size_t			 nfiles, filescap;
+static struct cfgsnap_op	*ops;
+static size_t			 nops, opscap;
+static char			*strs;
+static size_t			 strslen, strscap;
+
+static uint32_t
+add_str(const char *s)
+{
+	size_t	 len, off;
+
+	if (s == NULL)
+		return CFGSNAP_NULL;
+
+	len = strlen(s) + 1;
+	while (strslen + len > strscap) {
+		strscap = strscap == 0 ? 1024 : strscap * 2;
+		strs = xrealloc(strs, strscap);
+	}
+	off = strslen;
+	memcpy(strs + off, s, len);
+	strslen += len;
+	return off;
+}
+
+/* fill f with what path is now; f->path isn't touched */
+static void
+file_id(struct cfgsnap_file *f, const char *path)
+{
+	struct stat	 sb;
+	char		 buf[BUFSIZ];
+	ssize_t		 r;
+	int		 fd;
+
+	f->exists = 0;
+	f->size = f->mtime = 0;
+	f->hash = FNV1A_INIT;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return;
+	if (fstat(fd, &sb) == -1) {
+		close(fd);
+		return;
+	}
+
+	f->exists = 1;
+	f->size = sb.st_size;
+	f->mtime = sb.st_mtime;
+	while ((r = read(fd, buf, sizeof(buf))) > 0)
+		f->hash = fnv1a(f->hash, buf, r);
+	if (r == -1)
+		f->exists = 0;
+	close(fd);
+}
+
+/* path is going to be read, or doesn't exist */
+void
+cfgsnap_file(const char *path)
+{
+	struct cfgsnap_file	*f;
+
+	if (nfiles == filescap) {
+		filescap = filescap == 0 ? 4 : filescap * 2;
+		files = xreallocarray(files, filescap, sizeof(*files));
+	}
+	f = &files[nfiles++];
+	file_id(f, path);
+	f->path = add_str(path);
+}
+
+void
+cfgsnap_add(const struct cfgop *op)
+{
+	struct cfgsnap_op	*o;
+	int			 i;
+
+	if (nops == opscap) {
+		opscap = opscap == 0 ? 64 : opscap * 2;
+		ops = xreallocarray(ops, opscap, sizeof(*ops));
+	}
+	o = &ops[nops++];
+	o->op = op->op;
+	for (i = 0; i < CFG_NNUM; ++i)
+		o->num[i] = op->num[i];
+	for (i = 0; i < CFG_NSTR; ++i)
+		o->str[i] = add_str(op->str[i]);
+}
+
+static uint64_t
+body_hash(const void *f, size_t nf, const void *o, size_t no,
+    const char *s, size_t slen)
+{
+	uint64_t	 h;
+
+	h = fnv1a(FNV1A_INIT, f, nf * sizeof(struct cfgsnap_file));
+	h = fnv1a(h, o, no * sizeof(struct cfgsnap_op));
+	return fnv1a(h, s, slen);
+}
+
+/* write what was recorded to path, through the mkstemp template tmp */
+void
+cfgsnap_save(const char *path, const char *tmp)
+{
+	struct cfgsnap_header	 hdr;
+	FILE			*fp;
+	char			 t[PATH_MAX];
+	int			 fd, bad;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CFGSNAP_MAGIC, sizeof(hdr.magic));
+	hdr.version = CFGSNAP_VERSION;
+	hdr.nfiles = nfiles;
+	hdr.nops = nops;
+	hdr.strslen = strslen;
+	hdr.hash = body_hash(files, nfiles, ops, nops, strs, strslen);
+	strlcpy(hdr.package, VERSION, sizeof(hdr.package));
+
+	strlcpy(t, tmp, sizeof(t));
+	if ((fd = mkstemp(t)) == -1)
+		return;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(t);
+		return;
+	}
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(files, sizeof(*files), nfiles, fp);
+	fwrite(ops, sizeof(*ops), nops, fp);
+	fwrite(strs, 1, strslen, fp);
+
+	bad = ferror(fp);
+	if (fclose(fp) == EOF || bad || rename(t, path) == -1)
+		unlink(t);
+}
+
+static inline const char *
+snap_str(const char *s, size_t slen, uint32_t off)
+{
+	if (off == CFGSNAP_NULL || off >= slen)
+		return NULL;
+	return s + off;
+}
+
+/*
+ * Replay the snapshot at path if it was taken reading the given files
+ * and they didn't change since.  Returns -1 if it's not valid, or if
+ * apply failed on one of the rules, and the config has to be parsed.
+ */
+int
+cfgsnap_load(const char *path, const char **paths, size_t npaths,
+    int (*apply)(const struct cfgop *))
+{
+	struct cfgsnap_header	 hdr;
+	struct cfgsnap_file	 cur;
+	const struct cfgsnap_file *f;
+	const struct cfgsnap_op	*o;
+	struct cfgop		 op;
+	struct stat		 sb;
+	const char		*s, *p;
+	char			*buf = NULL;
+	size_t			 i, left;
+	ssize_t			 r;
+	int			 fd, j, ret = -1;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(hdr) ||
+	    sb.st_size > 16 * 1024 * 1024)
+		goto done;
+
+	buf = xmalloc(sb.st_size);
+	if ((r = read(fd, buf, sb.st_size)) != sb.st_size)
+		goto done;
+
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (memcmp(hdr.magic, CFGSNAP_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != CFGSNAP_VERSION ||
+	    strncmp(hdr.package, VERSION, sizeof(hdr.package)) != 0 ||
+	    hdr.nfiles != npaths)
+		goto done;
+
+	left = sb.st_size - sizeof(hdr);
+	if (hdr.nfiles > left / sizeof(*f))
+		goto done;
+	f = (const struct cfgsnap_file *)(buf + sizeof(hdr));
+	left -= hdr.nfiles * sizeof(*f);
+	if (hdr.nops > left / sizeof(*o))
+		goto done;
+	o = (const struct cfgsnap_op *)(f + hdr.nfiles);
+	left -= hdr.nops * sizeof(*o);
+
+	/* so that every offset in the strings gives a string */
+	s = (const char *)(o + hdr.nops);
+	if (hdr.strslen != left || (left != 0 && s[left - 1] != '\0'))
+		goto done;
+	if (hdr.hash != body_hash(f, hdr.nfiles, o, hdr.nops, s, left))
+		goto done;
+
+	for (i = 0; i < npaths; ++i) {
+		if ((p = snap_str(s, left, f[i].path)) == NULL ||
+		    strcmp(p, paths[i]) != 0)
+			goto done;
+		file_id(&cur, paths[i]);
+		if (cur.exists != f[i].exists || cur.size != f[i].size ||
+		    cur.mtime != f[i].mtime || cur.hash != f[i].hash)
+			goto done;
+	}
+
+	for (i = 0; i < hdr.nops; ++i) {
+		op.op = o[i].op;
+		for (j = 0; j < CFG_NNUM; ++j)
+			op.num[j] = o[i].num[j];
+		for (j = 0; j < CFG_NSTR; ++j)
+			op.str[j] = snap_str(s, left, o[i].str[j]);
+		if (!apply(&op))
+			goto done;
+	}
+
+	ret = 0;
+ done:
+	free(buf);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,47 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef CFGSNAP_H
+#define CFGSNAP_H
+
+/* what parse.y did with every rule of the configuration */
+enum {
+	CFG_VARI,	/* str[0] = num[0] */
+	CFG_VARS,	/* str[0] = str[1] */
+	CFG_VARB,	/* str[0] = num[0] */
+	CFG_PRFX,	/* style str[0] prefix str[1] str[2] */
+	CFG_COLOR,	/* style str[0], background if num[3] */
+	CFG_ATTR,	/* style str[0] */
+	CFG_PROXY,	/* proxy str[0] via str[1]:str[2] */
+	CFG_BIND,	/* bind str[0] str[1] str[2] */
+};
+
+#define CFG_NSTR	3
+#define CFG_NNUM	4
+
+struct cfgop {
+	int		 op;
+	int		 num[CFG_NNUM];
+	const char	*str[CFG_NSTR];
+};
+
+void	 cfgsnap_file(const char *);
+void	 cfgsnap_add(const struct cfgop *);
+void	 cfgsnap_save(const char *, const char *);
+int	 cfgsnap_load(const char *, const char **, size_t,
+	    int (*)(const struct cfgop *));
+
+#endif
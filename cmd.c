@@ -28,7 +28,9 @@
 #include "defaults.h"
 #include "ev.h"
 #include "exec.h"
+#include "feeds.h"
 #include "hist.h"
+#include "imsgev.h"
 #include "keymap.h"
 #include "mcache.h"
 #include "minibuffer.h"
@@ -37,6 +39,7 @@
 #include "ui.h"
 #include "utf8.h"
 #include "utils.h"
+#include "watch.h"
 
 #define GUARD_RECURSIVE_MINIBUFFER()				\
 	do {							\
@@ -55,6 +58,27 @@
 		}					\
 	} while(0)
 
+/* find a command or alias by name, with a binary search */
+struct cmd *
+cmd_lookup(const char *name)
+{
+	size_t	 lo = 0, hi = cmds_len, mid;
+	int	 r;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		r = strcmp(name, cmds[cmds_byname[mid]].cmd);
+		if (r == 0)
+			return &cmds[cmds_byname[mid]];
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return NULL;
+}
+
 /* return 1 if moved, 0 otherwise */
 static inline int
 forward_line(struct buffer *buffer, int n)
@@ -69,19 +93,15 @@ forward_line(struct buffer *buffer, int n)
 	did = 0;
 	while (n != 0) {
 		if (n > 0) {
-			vl = TAILQ_NEXT(vl, vlines);
+			vl = vline_next_visible(buffer, vl);
 			if (vl == NULL)
 				return did;
-			if (vl->parent->flags & L_HIDDEN)
-				continue;
 			buffer->current_line = vl;
 			n--;
 		} else {
-			vl = TAILQ_PREV(vl, vhead, vlines);
+			vl = vline_prev_visible(buffer, vl);
 			if (vl == NULL)
 				return did;
-			if (vl->parent->flags & L_HIDDEN)
-				continue;
 			if (buffer->current_line == buffer->top_line) {
 				buffer->line_off--;
 				buffer->top_line = vl;
@@ -176,22 +196,10 @@ cmd_scroll_line_up(struct buffer *buffer)
 {
 	struct vline	*vl;
 
-	for (;;) {
-		if (buffer->top_line == NULL)
-			return;
-
-		if ((vl = TAILQ_PREV(buffer->top_line, vhead, vlines))
-		    == NULL)
-			return;
-
-		buffer->top_line = vl;
-
-		if (vl->parent->flags & L_HIDDEN)
-			continue;
-
-		break;
-	}
+	if ((vl = vline_prev_visible(buffer, buffer->top_line)) == NULL)
+		return;
 
+	buffer->top_line = vl;
 	buffer->line_off--;
 
 	forward_line(buffer, -1);
@@ -200,19 +208,15 @@ cmd_scroll_line_up(struct buffer *buffer)
 void
 cmd_scroll_line_down(struct buffer *buffer)
 {
+	struct vline	*vl;
+
 	if (!forward_line(buffer, +1))
 		return;
 
-	for (;;) {
-		if (buffer->top_line == NULL)
-			return;
-
-		buffer->top_line = TAILQ_NEXT(buffer->top_line, vlines);
-		if (buffer->top_line->parent->flags & L_HIDDEN)
-			continue;
-		break;
-	}
+	if ((vl = vline_next_visible(buffer, buffer->top_line)) == NULL)
+		return;
 
+	buffer->top_line = vl;
 	buffer->line_off++;
 }
 
@@ -226,7 +230,7 @@ cmd_scroll_up(struct buffer *buffer)
 		return;
 
 	for (i = 0; i < body_lines; ++i) {
-		vl = TAILQ_PREV(buffer->top_line, vhead, vlines);
+		vl = vline_prev(buffer, buffer->top_line);
 		if (vl == NULL)
 			break;
 		buffer->line_off--;
@@ -247,8 +251,7 @@ cmd_scroll_down(struct buffer *buffer)
 		if (!forward_line(buffer, +1))
 			break;
 
-		buffer->top_line = TAILQ_NEXT(buffer->top_line,
-		    vlines);
+		buffer->top_line = vline_next(buffer, buffer->top_line);
 		buffer->line_off++;
 	}
 }
@@ -256,7 +259,7 @@ cmd_scroll_down(struct buffer *buffer)
 void
 cmd_beginning_of_buffer(struct buffer *buffer)
 {
-	buffer->current_line = TAILQ_FIRST(&buffer->vhead);
+	buffer->current_line = vline_first(buffer);
 	buffer->cpoff = 0;
 	buffer->top_line = buffer->current_line;
 	buffer->line_off = 0;
@@ -265,7 +268,8 @@ cmd_beginning_of_buffer(struct buffer *buffer)
 void
 cmd_end_of_buffer(struct buffer *buffer)
 {
-	buffer->current_line = TAILQ_LAST(&buffer->vhead, vhead);
+	wrap_page_finish(buffer);
+	buffer->current_line = vline_last(buffer);
 
 	if (buffer->current_line == NULL)
 		return;
@@ -292,6 +296,39 @@ cmd_kill_telescope(struct buffer *buffer)
 	yornp("really quit?", kill_telescope_cb, NULL);
 }
 
+/*
+ * Open or close the hunks of a folded patch: the one starting at l if
+ * it's a hunk header, or all the ones of the file if it's a file
+ * header.  The first line of the body decides what to do.
+ */
+static void
+toggle_hunks(struct buffer *buffer, struct line *l)
+{
+	struct line	*first, *last = NULL;
+	int		 file, hide = -1;
+
+	file = l->type == LINE_PATCH_HDR;
+	for (first = l; l != NULL; l = TAILQ_NEXT(l, lines)) {
+		if (l != first && l->type == LINE_PATCH_HDR &&
+		    (!file || last != NULL))
+			break;
+		if (!file && l->type == LINE_PATCH_HUNK_HDR && l != first)
+			break;
+		if (!LINE_HUNK_BODY(l->type))
+			continue;
+		if (hide == -1)
+			hide = !(l->flags & L_HIDDEN);
+		if (hide)
+			l->flags |= L_HIDDEN;
+		else
+			l->flags &= ~L_HIDDEN;
+		last = l;
+	}
+
+	if (last != NULL)
+		wrap_hidden_changed(buffer, first, last);
+}
+
 void
 cmd_push_button(struct buffer *buffer)
 {
@@ -305,8 +342,8 @@ cmd_push_button(struct buffer *buffer)
 
 	switch (vl->parent->type) {
 	case LINE_LINK:
-		load_url_in_tab(current_tab, vl->parent->alt, NULL,
-		    LU_MODE_NOCACHE);
+		load_url_in_tab(current_tab, line_url(current_tab, vl->parent),
+		    NULL, LU_MODE_NOCACHE);
 		break;
 	case LINE_PRE_START:
 		l = TAILQ_NEXT(vl->parent, lines);
@@ -319,6 +356,11 @@ cmd_push_button(struct buffer *buffer)
 			else
 				buffer->line_max++;
 		}
+		vline_hidden_changed(buffer);
+		break;
+	case LINE_PATCH_HDR:
+	case LINE_PATCH_HUNK_HDR:
+		toggle_hunks(buffer, vl->parent);
 		break;
 	default:
 		break;
@@ -334,79 +376,78 @@ cmd_push_button_new_tab(struct buffer *buffer)
 	if (vl == NULL || vl->parent->type != LINE_LINK)
 		return;
 
-	new_tab(vl->parent->alt, hist_cur(current_tab->hist), current_tab);
+	new_tab(line_url(current_tab, vl->parent), hist_cur(current_tab->hist),
+	    current_tab);
 }
 
-void
-cmd_previous_button(struct buffer *buffer)
+/*
+ * Move the cursor to l, found in one of the buffer indexes.  The
+ * screen is scrolled up if l is above it; otherwise the redisplay
+ * takes care of showing it.
+ */
+static void
+move_to_line(struct buffer *buffer, struct line *l)
 {
-	struct excursion place;
+	struct vline	*vl;
 
-	save_excursion(&place, buffer);
+	if (line_vline(buffer, l) == NULL)
+		wrap_page_finish(buffer);
+	if ((vl = line_vline(buffer, l)) == NULL)
+		return;
 
-	do {
-		if (!forward_line(buffer, -1)) {
-			restore_excursion(&place, buffer);
-			message("No previous link");
-			return;
-		}
-	} while (buffer->current_line->parent->type != LINE_LINK);
+	if (vline_index(buffer, vl) < vline_index(buffer, buffer->top_line)) {
+		buffer->top_line = vl;
+		buffer->line_off = vline_visible_index(buffer, vl);
+	}
+	buffer->current_line = vl;
 }
 
-void
-cmd_next_button(struct buffer *buffer)
+/*
+ * Move to the previous or next line of the index, or return 0 if
+ * there's none.
+ */
+static int
+move_in_index(struct buffer *buffer, struct lineidx *idx, int backward)
 {
-	struct excursion place;
+	struct lineref	*ref;
 
-	save_excursion(&place, buffer);
+	if (buffer->current_line == NULL)
+		return 0;
 
-	do {
-		if (!forward_line(buffer, +1)){
-			restore_excursion(&place, buffer);
-			message("No next link");
-			return;
-		}
-	} while (buffer->current_line->parent->type != LINE_LINK);
+	ref = lineidx_near(buffer, idx,
+	    vline_index(buffer, buffer->current_line), backward);
+	if (ref == NULL)
+		return 0;
+	move_to_line(buffer, ref->line);
+	return 1;
 }
 
-static inline int
-is_heading(const struct line *l)
+void
+cmd_previous_button(struct buffer *buffer)
 {
-	return l->type == LINE_TITLE_1 ||
-		l->type == LINE_TITLE_2 ||
-		l->type == LINE_TITLE_3;
+	if (!move_in_index(buffer, &buffer->links, 1))
+		message("No previous link");
 }
 
 void
-cmd_previous_heading(struct buffer *buffer)
+cmd_next_button(struct buffer *buffer)
 {
-	struct excursion place;
-
-	save_excursion(&place, buffer);
+	if (!move_in_index(buffer, &buffer->links, 0))
+		message("No next link");
+}
 
-	do {
-		if (!forward_line(buffer, -1)) {
-			restore_excursion(&place, buffer);
-			message("No previous heading");
-			return;
-		}
-	} while (!is_heading(buffer->current_line->parent));
+void
+cmd_previous_heading(struct buffer *buffer)
+{
+	if (!move_in_index(buffer, &buffer->headings, 1))
+		message("No previous heading");
 }
 
 void
 cmd_next_heading(struct buffer *buffer)
 {
-	struct excursion place;
-
-	save_excursion(&place, buffer);
-
-	do {
-		if (!forward_line(buffer, +1)) {
-			restore_excursion(&place, buffer);
-			message("No next heading");
-			return;
-		}
-	} while (!is_heading(buffer->current_line->parent));
+	if (!move_in_index(buffer, &buffer->headings, 0))
+		message("No next heading");
 }
 
 void
@@ -426,6 +467,11 @@ cmd_next_page(struct buffer *buffer)
 void
 cmd_clear_minibuf(struct buffer *buffer)
 {
+	if (write_buffer_abort() != 0) {
+		message("Stopped saving the page");
+		return;
+	}
+
 	message(NULL);
 }
 
@@ -462,6 +508,23 @@ cmd_tab_close(struct buffer *buffer)
 
 }
 
+void
+cmd_tab_close_heaviest(struct buffer *buffer)
+{
+	struct tab	*tab;
+	char		 fmt[FMT_SCALED_STRSIZE];
+
+	if ((tab = heaviest_tab(0)) == NULL) {
+		message("No hidden tab to close");
+		return;
+	}
+
+	if (fmt_scaled(buffer_memory(&tab->buffer, NULL), fmt) == -1)
+		strlcpy(fmt, "?", sizeof(fmt));
+	message("Closed %s, %s released", tab->buffer.title, fmt);
+	kill_tab(tab, 0);
+}
+
 void
 cmd_tab_close_other(struct buffer *buffer)
 {
@@ -475,6 +538,23 @@ cmd_tab_close_other(struct buffer *buffer)
 	}
 }
 
+void
+cmd_tab_hibernate_heaviest(struct buffer *buffer)
+{
+	struct tab	*tab;
+	char		 fmt[FMT_SCALED_STRSIZE];
+
+	if ((tab = heaviest_tab(1)) == NULL) {
+		message("No hidden tab to hibernate");
+		return;
+	}
+
+	if (fmt_scaled(buffer_memory(&tab->buffer, NULL), fmt) == -1)
+		strlcpy(fmt, "?", sizeof(fmt));
+	message("Hibernated %s, %s released", tab->buffer.title, fmt);
+	hibernate_tab(tab);
+}
+
 void
 cmd_tab_undo_close(struct buffer *buffer)
 {
@@ -596,8 +676,10 @@ cmd_load_current_url(struct buffer *buffer)
 void
 cmd_reload_page(struct buffer *buffer)
 {
+	if (revalidate_page(current_tab))
+		return;
 	load_url_in_tab(current_tab, hist_cur(current_tab->hist), NULL,
-	    LU_MODE_NOHIST|LU_MODE_NOCACHE);
+	    LU_MODE_NOHIST|LU_MODE_NOCACHE|LU_MODE_NOMIRROR);
 }
 
 void
@@ -620,6 +702,40 @@ cmd_list_bookmarks(struct buffer *buffer)
 	load_url_in_tab(current_tab, "about:bookmarks", NULL, LU_MODE_NONE);
 }
 
+void
+cmd_feeds(struct buffer *buffer)
+{
+	load_url_in_tab(current_tab, "about:feeds", NULL, LU_MODE_NONE);
+}
+
+void
+cmd_feeds_refresh(struct buffer *buffer)
+{
+	int	 n;
+
+	if ((n = feeds_refresh()) == 0)
+		message("No feeds to refresh");
+	else
+		message("Refreshing %d feeds...", n);
+}
+
+void
+cmd_feeds_subscribe(struct buffer *buffer)
+{
+	const char	*url;
+
+	url = hist_cur(current_tab->hist);
+	if (url == NULL || strncmp(url, "gemini://", 9) != 0) {
+		message("Only gemini pages can be subscribed to");
+		return;
+	}
+
+	if (feeds_toggle(url))
+		message("Subscribed to %s", url);
+	else
+		message("Unsubscribed from %s", url);
+}
+
 void
 cmd_toggle_help(struct buffer *buffer)
 {
@@ -629,7 +745,6 @@ cmd_toggle_help(struct buffer *buffer)
 void
 cmd_link_select(struct buffer *buffer)
 {
-	struct line *l;
 	struct minibuffer m = {
 		.self_insert = sensible_self_insert,
 		.done = ls_select,
@@ -640,16 +755,12 @@ cmd_link_select(struct buffer *buffer)
 
 	GUARD_RECURSIVE_MINIBUFFER();
 
-	l = TAILQ_FIRST(&buffer->head);
-	while (l != NULL && l->type != LINE_LINK)
-		l = TAILQ_NEXT(l, lines);
-
-	if (l == NULL) {
+	if (buffer->links.len == 0) {
 		message("No links found");
 		return;
 	}
 
-	m.compldata = l;
+	m.compldata = buffer->links.refs;
 	enter_minibuffer(&m, "Select link: ");
 }
 
@@ -669,10 +780,44 @@ cmd_swiper(struct buffer *buffer)
 	enter_minibuffer(&m, "Select line: ");
 }
 
+void
+cmd_swiper_all(struct buffer *buffer)
+{
+	struct minibuffer m = {
+		.self_insert = sensible_self_insert,
+		.done = swa_start,
+	};
+
+	GUARD_RECURSIVE_MINIBUFFER();
+
+	enter_minibuffer(&m, "Search all tabs: ");
+}
+
+void
+cmd_isearch_backward(struct buffer *buffer)
+{
+	if (isearch_repeat(1))
+		return;
+
+	GUARD_RECURSIVE_MINIBUFFER();
+
+	isearch_start(buffer, 1);
+}
+
+void
+cmd_isearch_forward(struct buffer *buffer)
+{
+	if (isearch_repeat(0))
+		return;
+
+	GUARD_RECURSIVE_MINIBUFFER();
+
+	isearch_start(buffer, 0);
+}
+
 void
 cmd_toc(struct buffer *buffer)
 {
-	struct line *l;
 	struct minibuffer m = {
 		.self_insert = sensible_self_insert,
 		.done = toc_select,
@@ -683,19 +828,12 @@ cmd_toc(struct buffer *buffer)
 
 	GUARD_RECURSIVE_MINIBUFFER();
 
-	l = TAILQ_FIRST(&buffer->head);
-	while (l != NULL &&
-	    l->type != LINE_TITLE_1 &&
-	    l->type != LINE_TITLE_2 &&
-	    l->type != LINE_TITLE_3)
-		l = TAILQ_NEXT(l, lines);
-
-	if (l == NULL) {
+	if (buffer->headings.len == 0) {
 		message("No headings found");
 		return;
 	}
 
-	m.compldata = l;
+	m.compldata = buffer->headings.refs;
 	enter_minibuffer(&m, "Select heading: ");
 }
 
@@ -705,6 +843,7 @@ cmd_inc_fill_column(struct buffer *buffer)
 	if (fill_column == INT_MAX)
 		return;
 
+	wrap_join_all();
 	fill_column += 2;
 	message("fill-column: %d", fill_column);
 
@@ -717,6 +856,7 @@ cmd_dec_fill_column(struct buffer *buffer)
 	if (fill_column == INT_MAX || fill_column < 8)
 		return;
 
+	wrap_join_all();
 	fill_column -= 2;
 	message("fill-column: %d", fill_column);
 
@@ -936,6 +1076,7 @@ cmd_suspend_telescope(struct buffer *buffer)
 void
 cmd_toggle_pre_wrap(struct buffer *buffer)
 {
+	wrap_join_all();
 	dont_wrap_pre = !dont_wrap_pre;
 
 	if (dont_wrap_pre)
@@ -960,6 +1101,27 @@ cmd_toggle_styling(struct buffer *buffer)
 	    LU_MODE_NOHIST);
 }
 
+void
+cmd_toggle_watch(struct buffer *buffer)
+{
+	struct tab	*tab = current_tab;
+
+	tab->flags ^= TAB_WATCH;
+	if (!(tab->flags & TAB_WATCH)) {
+		unwatch_tab(tab);
+		message("Stopped watching the page");
+		return;
+	}
+
+	if (watch_tab(tab) == -1) {
+		tab->flags &= ~TAB_WATCH;
+		message("Can't watch %s", hist_cur(tab->hist));
+		return;
+	}
+
+	message("Reloading the page when the file changes");
+}
+
 void
 cmd_mini_goto_beginning(struct buffer *buffer)
 {
@@ -973,9 +1135,9 @@ cmd_mini_goto_beginning(struct buffer *buffer)
 	if ((vl = buffer->current_line) != NULL)
 		vl->parent->type = LINE_COMPL;
 
-	vl = TAILQ_FIRST(&buffer->vhead);
-	while (vl != NULL && vl->parent->flags & L_HIDDEN)
-		vl = TAILQ_NEXT(vl, vlines);
+	vl = vline_first(buffer);
+	if (vl != NULL && vl->parent->flags & L_HIDDEN)
+		vl = vline_next_visible(buffer, vl);
 
 	if (vl == NULL)
 		return;
@@ -998,9 +1160,10 @@ cmd_mini_goto_end(struct buffer *buffer)
 	if ((vl = buffer->current_line) != NULL)
 		vl->parent->type = LINE_COMPL;
 
-	vl = TAILQ_LAST(&buffer->vhead, vhead);
-	while (vl != NULL && vl->parent->flags & L_HIDDEN)
-		vl = TAILQ_PREV(vl, vhead, vlines);
+	wrap_page_finish(buffer);
+	vl = vline_last(buffer);
+	if (vl != NULL && vl->parent->flags & L_HIDDEN)
+		vl = vline_prev_visible(buffer, vl);
 
 	if (vl == NULL)
 		return;
@@ -1054,15 +1217,24 @@ cmd_toggle_downloads(struct buffer *buffer)
 void
 cmd_cache_info(struct buffer *buffer)
 {
-	size_t	npages, tot;
-	char	fmt[FMT_SCALED_STRSIZE];
+	size_t	npages, tot, rawtot;
+	char	fmt[FMT_SCALED_STRSIZE], rawfmt[FMT_SCALED_STRSIZE];
 
-	mcache_info(&npages, &tot);
+	mcache_info(&npages, &tot, &rawtot);
 
-	if (fmt_scaled(tot, fmt) == 0)
-		message("pages: %zu, total: %s", npages, fmt);
+	if (fmt_scaled(tot, fmt) == 0 && fmt_scaled(rawtot, rawfmt) == 0)
+		message("pages: %zu, total: %s (%s uncompressed)", npages,
+		    fmt, rawfmt);
 	else
-		message("pages: %zu, total: %zu", npages, tot);
+		message("pages: %zu, total: %zu (%zu uncompressed)", npages,
+		    tot, rawtot);
+}
+
+void
+cmd_dns_flush(struct buffer *buffer)
+{
+	ui_send_net(IMSG_DNS_FLUSH, 0, -1, NULL, 0);
+	message("DNS cache flushed");
 }
 
 void
@@ -1122,7 +1294,7 @@ cmd_home(struct buffer *buffer)
 	char path[GEMINI_URL_LEN];
 	char *tilde, *t;
 
-	strlcpy(path, current_tab->iri.iri_path, sizeof(path));
+	strlcpy(path, current_tab->iri->iri_path, sizeof(path));
 
 	if ((tilde = strstr(path, "/~")) != NULL &&
 	    tilde[2] != '\0' && tilde[2] != '/') {
@@ -1175,7 +1347,7 @@ unload_certificate_cb(int r, void *data)
 	struct tab	*tab = data;
 
 	message("Won't use %s for this site.", tab->client_cert);
-	cert_delete_for(tab->client_cert, &tab->iri, r);
+	cert_delete_for(tab->client_cert, tab->iri, r);
 }
 
 void
@@ -1192,7 +1364,7 @@ cmd_unload_certificate(struct buffer *buffer)
 
 	if (tab->client_cert_temp) {
 		message("Won't use %s for this site.", tab->client_cert);
-		cert_delete_for(tab->client_cert, &tab->iri, 0);
+		cert_delete_for(tab->client_cert, tab->iri, 0);
 		return;
 	}
 
@@ -1219,6 +1391,19 @@ cmd_search(struct buffer *buffer)
 	enter_minibuffer(&m, "Search: ");
 }
 
+void
+cmd_search_visited(struct buffer *buffer)
+{
+	struct minibuffer m = {
+		.self_insert = sensible_self_insert,
+		.done = sv_select,
+	};
+
+	GUARD_RECURSIVE_MINIBUFFER();
+
+	enter_minibuffer(&m, "Search visited pages: ");
+}
+
 void
 cmd_mini_edit_external(struct buffer *buffer)
 {
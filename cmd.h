@@ -6,6 +6,10 @@ struct cmd {
 	const char	*descr;
 };
 extern struct cmd cmds[];
+extern const unsigned short cmds_byname[];
+extern const size_t cmds_len;
+
+struct cmd	*cmd_lookup(const char *);
 
 #define CMD(fnname, descr)	void fnname(struct buffer *)
 #define DEFALIAS(s, d)		/* nothing */
@@ -26,13 +30,19 @@ CMD(cmd_cache_info,		"Show cache stats.");
 CMD(cmd_clear_minibuf,		"Clear the echo area.");
 CMD(cmd_client_certificate_info,"Show the active client certificate.");
 CMD(cmd_dec_fill_column,	"Decrement fill-column by two.");
+CMD(cmd_dns_flush,		"Forget the cached addresses of the hosts.");
 CMD(cmd_end_of_buffer,		"Move the point to the end of the buffer.");
 CMD(cmd_execute_extended_command, "Execute an internal command.");
+CMD(cmd_feeds,			"Show the entries of the subscribed feeds.");
+CMD(cmd_feeds_refresh,		"Fetch all the subscribed feeds again.");
+CMD(cmd_feeds_subscribe,	"Subscribe to or unsubscribe from the page.");
 CMD(cmd_forward_char,		"Move point one character forward.");
 CMD(cmd_forward_paragraph,	"Move point one paragraph forward.");
 CMD(cmd_home,			"Go to the home directory.");
 CMD(cmd_inc_fill_column,	"Increment fill-column by two");
 CMD(cmd_insert_current_candidate, "Copy the current selection text as minibuffer input.");
+CMD(cmd_isearch_backward,	"Search backward incrementally.");
+CMD(cmd_isearch_forward,	"Search forward incrementally.");
 CMD(cmd_kill_telescope,		"Quit Telescope.");
 CMD(cmd_link_select,		"Select and visit a link using the minibuffer.");
 CMD(cmd_list_bookmarks,		"Load the bookmarks page.");
@@ -76,10 +86,14 @@ CMD(cmd_scroll_line_down,	"Scroll down by one line");
 CMD(cmd_scroll_line_up,		"Scroll up by one line.");
 CMD(cmd_scroll_up,		"Scroll up by one visual page");
 CMD(cmd_search,			"Search using the preferred search engine");
+CMD(cmd_search_visited,		"Search the text of the visited pages.");
 CMD(cmd_suspend_telescope,	"Suspend the current Telescope session.");
 CMD(cmd_swiper,			"Jump to a line using the minibuffer.");
+CMD(cmd_swiper_all,		"Jump to a line of any tab or cached page.");
 CMD(cmd_tab_close,		"Close the current tab.");
+CMD(cmd_tab_close_heaviest,	"Close the hidden tab using the most memory.");
 CMD(cmd_tab_close_other,	"Close all tabs but the current one.");
+CMD(cmd_tab_hibernate_heaviest,	"Release the hidden tab using the most memory.");
 CMD(cmd_tab_move,		"Move the current tab to the right.");
 CMD(cmd_tab_move_to,		"Move the current tab to the left.");
 CMD(cmd_tab_new,		"Open a new tab.");
@@ -92,6 +106,7 @@ CMD(cmd_toggle_downloads,	"Toggle the downloads side window.");
 CMD(cmd_toggle_help,		"Toggle side window with help.");
 CMD(cmd_toggle_pre_wrap,	"Toggle the wrapping of preformatted blocks.");
 CMD(cmd_toggle_styling,		"Toggle the page styling.");
+CMD(cmd_toggle_watch,		"Toggle reloading the page when its file changes.");
 CMD(cmd_unload_certificate,	"Forget the certificate on this page.");
 CMD(cmd_up,			"Go up one level.");
 CMD(cmd_use_certificate,	"Use a certificate for the current page.");
@@ -18,29 +18,48 @@
 
 #include <stdlib.h>
 
+#include "bookmarks.h"
 #include "certs.h"
 #include "cmd.h"
 #include "compl.h"
+#include "ftindex.h"
 #include "hist.h"
 #include "telescope.h"
 #include "session.h"
 
 /*
- * Provide completions for load-url (lu).
+ * Provide completions for load-url (lu): the bookmarks, then the rest
+ * of the history, the most frecent first.  The bookmarks file is read
+ * only once, as a reload would free the array being walked.
  */
 const char *
 compl_lu(void **data, void **ret, const char **descr)
 {
-	struct history_item **state = (struct history_item **)data;
+	static struct {
+		struct bookmark		**bookmarks;
+		struct history_item	**history;
+	} state;
+	const char			 *url;
 
 	/* first time: init the state */
-	if (*state == NULL)
-		*state = history.items;
-
-	if (*state == history.items + history.len)
-		return NULL;
-
-	return (*state)++->uri;
+	if (*data == NULL) {
+		state.bookmarks = bookmarks_all();
+		state.history = history_by_frecency();
+		*data = &state;
+	}
+
+	if (*state.bookmarks != NULL) {
+		*descr = *(*state.bookmarks)->label != '\0' ?
+		    (*state.bookmarks)->label : "bookmark";
+		return (*state.bookmarks++)->url;
+	}
+
+	while (*state.history != NULL) {
+		url = (*state.history++)->uri;
+		if (!bookmark_known(url))
+			return url;
+	}
+	return NULL;
 }
 
 /*
@@ -90,16 +109,12 @@ compl_ts(void **data, void **ret, const char **descr)
 const char *
 compl_ls(void **data, void **ret, const char **descr)
 {
-	struct line	**line = (struct line **)data;
+	struct lineref	**ref = (struct lineref **)data;
 	struct line	*l;
 	const char	*link;
 
-	l = *line;
-	while (l != NULL && l->type != LINE_LINK)
-		l = TAILQ_NEXT(l, lines);
-
-	/* end of buffer */
-	if (l == NULL)
+	/* the index ends with a NULL line */
+	if ((l = (*ref)->line) == NULL)
 		return NULL;
 
 	if ((link = l->line) == NULL) {
@@ -109,7 +124,7 @@ compl_ls(void **data, void **ret, const char **descr)
 		*descr = l->alt;
 
 	*ret = l;
-	*line = TAILQ_NEXT(l, lines);
+	(*ref)++;
 	return link;
 }
 
@@ -140,25 +155,19 @@ compl_swiper(void **data, void **ret, const char **descr)
 const char *
 compl_toc(void **data, void **ret, const char **descr)
 {
-	struct line	**line = (struct line **)data;
+	struct lineref	**ref = (struct lineref **)data;
 	struct line	*l;
-	const char	*text;
 
-	l = *line;
-	while (l != NULL && (l->line == NULL ||
-	    (l->type != LINE_TITLE_1 &&
-	    l->type != LINE_TITLE_2 &&
-	    l->type != LINE_TITLE_3)))
-		l = TAILQ_NEXT(l, lines);
+	/* the index ends with a NULL line */
+	while ((l = (*ref)->line) != NULL && l->line == NULL)
+		(*ref)++;
 
-	/* end of buffer */
 	if (l == NULL)
 		return NULL;
 
-	text = l->line;
 	*ret = l;
-	*line = TAILQ_NEXT(l, lines);
-	return text;
+	(*ref)++;
+	return l->line;
 }
 
 /*
@@ -170,8 +179,12 @@ compl_uc(void **data, void **ret, const char **descr)
 	const char	***state = (const char ***)data;
 
 	/* first time: init the state */
-	if (*state == NULL)
+	if (*state == NULL) {
+		certs_load();
+		if (identities == NULL)
+			return NULL;
 		*state = (const char **)identities;
+	}
 
 	if (**state == NULL)
 		return NULL;
@@ -179,3 +192,21 @@ compl_uc(void **data, void **ret, const char **descr)
 	/* XXX filling descr too would be nice */
 	return *((*state)++);
 }
+
+/*
+ * Provide completions for the results of search-visited.
+ */
+const char *
+compl_sv(void **data, void **ret, const char **descr)
+{
+	struct ft_result	**res = (struct ft_result **)data;
+
+	if ((*res)->url == NULL)
+		return NULL;
+
+	*ret = (void *)(*res)->url;
+	if (*(*res)->title == '\0')
+		return (*res)++->url;
+	*descr = (*res)->url;
+	return (*res)++->title;
+}
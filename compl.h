@@ -24,5 +24,6 @@ const char	*compl_ls(void **, void **, const char **);
 const char	*compl_swiper(void **, void **, const char **);
 const char	*compl_toc(void **, void **, const char **);
 const char	*compl_uc(void **, void **, const char **);
+const char	*compl_sv(void **, void **, const char **);
 
 #endif
@@ -25,14 +25,19 @@
 #include <sys/un.h>
 
 #include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #include "control.h"
 #include "ev.h"
+#include "hist.h"
 #include "imsgev.h"
+#include "mcache.h"
 #include "minibuffer.h"
+#include "perf.h"
+#include "session.h"
 #include "telescope.h"
 #include "utils.h"
 #include "ui.h"
@@ -113,6 +118,8 @@ control_listen(int fd)
 	}
 
 	ev_add(control_state.fd, EV_READ, control_accept, NULL);
+	ev_name(control_accept, "control accept");
+	ev_name(control_dispatch_imsg, "control");
 	return (0);
 }
 
@@ -220,6 +227,124 @@ control_close(int fd)
 	free(c);
 }
 
+static const char *
+tab_state(struct tab *tab)
+{
+	if (tab->loading_anim)
+		return "loading";
+	if (tab->flags & TAB_LAZY)
+		return "lazy";
+	return "loaded";
+}
+
+static void
+report_tab(FILE *fp, struct tab *tab)
+{
+	const char	*url;
+
+	if ((url = hist_cur(tab->hist)) == NULL)
+		url = "";
+	fprintf(fp, "%u\t%s\t%s\t%s\n", tab->id, tab_state(tab), url,
+	    tab->buffer.title);
+}
+
+static void
+report_cache(FILE *fp)
+{
+	size_t		 npages, tot, rawtot;
+
+	mcache_info(&npages, &tot, &rawtot);
+	fprintf(fp, "pages\t%zu\ntotal\t%zu\nuncompressed\t%zu\n",
+	    npages, tot, rawtot);
+}
+
+/*
+ * Open every NUL-terminated URL in the message in a new tab and print
+ * their ids, or 0 for the ones that couldn't be opened.
+ */
+static void
+open_urls(FILE *fp, struct imsg *imsg, int lazy)
+{
+	struct tab	*tab;
+	const char	*data = imsg->data, *uri;
+	size_t		 len = IMSG_DATA_SIZE(*imsg), off, n;
+	int		 opened = 0;
+
+	if (len == 0 || data[len - 1] != '\0')
+		return;
+
+	for (off = 0; off < len; off += n + 1) {
+		uri = data + off;
+		n = strlen(uri);
+		tab = NULL;
+		if (n != 0 && n < GEMINI_URL_LEN) {
+			if (lazy)
+				tab = new_lazy_tab(uri);
+			else
+				tab = new_tab(uri, NULL, NULL);
+		}
+		fprintf(fp, "%u\n", tab != NULL ? tab->id : 0);
+		if (tab != NULL)
+			opened = 1;
+	}
+
+	if (!opened)
+		return;
+	if (lazy) {
+		/* new_lazy_tab leaves it to the caller, for the session */
+		ui_schedule_redraw();
+		autosave_hook();
+	} else
+		ui_remotely_opened();
+}
+
+/*
+ * Handle a request and send what it prints as the reply, of the same
+ * type and in as many chunks as needed, followed by an IMSG_CTL_END.
+ */
+static void
+control_reply(struct ctl_conn *c, struct imsg *imsg)
+{
+	FILE		*fp;
+	struct tab	*tab;
+	char		*str = NULL;
+	size_t		 len = 0, off, n;
+	int		 type = imsg->hdr.type;
+
+	if ((fp = open_memstream(&str, &len)) != NULL) {
+		switch (type) {
+		case IMSG_CTL_OPEN_URLS:
+		case IMSG_CTL_LAZY_URLS:
+			open_urls(fp, imsg, type == IMSG_CTL_LAZY_URLS);
+			break;
+		case IMSG_CTL_PERF:
+			perf_report(fp, NULL);
+			break;
+		case IMSG_CTL_TABS:
+			TAILQ_FOREACH(tab, &tabshead, tabs)
+				report_tab(fp, tab);
+			break;
+		case IMSG_CTL_CURRENT:
+			if (current_tab != NULL)
+				report_tab(fp, current_tab);
+			break;
+		case IMSG_CTL_CACHE:
+			report_cache(fp);
+			break;
+		}
+		fclose(fp);
+
+		for (off = 0; off < len; off += n) {
+			n = MIN(len - off, MAX_IMSGSIZE - IMSG_HEADER_SIZE);
+			imsg_compose_event(&c->iev, type, 0, 0, -1,
+			    str + off, n);
+		}
+		free(str);
+	}
+
+	imsg_compose_event(&c->iev, IMSG_CTL_END, 0, 0, -1, NULL, 0);
+}
+
 void
 control_dispatch_imsg(int fd, int event, void *bula)
 {
@@ -268,6 +393,14 @@ control_dispatch_imsg(int fd, int event, void *bula)
 			ui_remotely_open_link(uri);
 			break;
 		}
+		case IMSG_CTL_OPEN_URLS:
+		case IMSG_CTL_LAZY_URLS:
+		case IMSG_CTL_PERF:
+		case IMSG_CTL_TABS:
+		case IMSG_CTL_CURRENT:
+		case IMSG_CTL_CACHE:
+			control_reply(c, &imsg);
+			break;
 		default:
 			message("%s: error handling imsg %d", __func__,
 			    imsg.hdr.type);
@@ -36,20 +36,51 @@ char	*new_tab_url = NULL;
 char	*default_search_engine = NULL;
 
 int autosave = 20;
+int binary_session = 0;
+int cache_size = 64 * 1024 * 1024;
+int connect_timeout = 10;
+int disk_cache = 0;
+int dns_cache_ttl = 60;
 int dont_wrap_pre = 0;
 int dont_apply_styling = 0;
 int emojify_link = 1;
 int enable_colors = 1;
 int fill_column = 120;
 int fringe_ignore_offset = 1;
+int fulltext_index = 0;
+int fuzzy_completion = 0;
+int handshake_timeout = 5;
+int hibernate_after = 30;
+int hibernate_budget = 0;
 int hide_pre_blocks = 0;
 int hide_pre_closing_line = 0;
 int hide_pre_context = 0;
+int idle_timeout = 30;
 int load_url_use_heuristic = 1;
+int long_line_size = 64 * 1024;
+int max_history = 10000;
 int max_killed_tabs = 10;
+int max_tab_history = 1000;
+int memory_limit = 0;
+int net_workers = 1;
 int olivetti_mode = 1;
+int parse_in_net = 0;
+int patch_fold_size = 1024 * 1024;
+int preconnect_delay = 0;
+int prefetch = 0;
+int redirect_cache_ttl = 30 * 24 * 60 * 60;
 int set_title = 1;
+int shm_ring = 0;
+int slow_frame = 50;
+int spill_size = 64 * 1024 * 1024;
 int tab_bar_show = 1;
+int tcp_fastopen = 0;
+int tcp_nodelay = 1;
+int tcp_rcvbuf = 0;
+int total_timeout = 0;
+int warmup_rate = 64 * 1024;
+int warmup_tabs = 0;
+int wrap_threads = 0;
 
 static struct line fringe_line = {
 	.type = LINE_FRINGE,
@@ -412,6 +443,9 @@ load_default_keys(void)
 
 	global_set_key("C-z",		cmd_suspend_telescope);
 
+	global_set_key("C-s",		cmd_isearch_forward);
+	global_set_key("C-r",		cmd_isearch_backward);
+
 	/* vi/vi-like */
 	global_set_key("k",		cmd_previous_line);
 	global_set_key("j",		cmd_next_line);
@@ -532,6 +566,9 @@ load_default_keys(void)
 	minibuffer_set_key("M->",	cmd_mini_goto_end);
 
 	minibuffer_set_key("tab",	cmd_insert_current_candidate);
+
+	minibuffer_set_key("C-s",	cmd_isearch_forward);
+	minibuffer_set_key("C-r",	cmd_isearch_backward);
 }
 
 void
@@ -582,12 +619,69 @@ config_setvari(const char *var, int val)
 {
 	if (!strcmp(var, "autosave")) {
 		autosave = val;
+	} else if (!strcmp(var, "cache-size")) {
+		if (val >= 0)
+			cache_size = val;
+	} else if (!strcmp(var, "connect-timeout")) {
+		if (val >= 0)
+			connect_timeout = val;
+	} else if (!strcmp(var, "dns-cache-ttl")) {
+		if (val >= 0)
+			dns_cache_ttl = val;
 	} else if (!strcmp(var, "fill-column")) {
 		if ((fill_column = val) <= 0)
 			fill_column = INT_MAX;
+	} else if (!strcmp(var, "hibernate-after")) {
+		if (val >= 0)
+			hibernate_after = val;
+	} else if (!strcmp(var, "hibernate-budget")) {
+		if (val >= 0)
+			hibernate_budget = val;
+	} else if (!strcmp(var, "handshake-timeout")) {
+		if (val >= 0)
+			handshake_timeout = val;
+	} else if (!strcmp(var, "idle-timeout")) {
+		if (val >= 0)
+			idle_timeout = val;
+	} else if (!strcmp(var, "long-line-size")) {
+		if (val >= 0)
+			long_line_size = val;
+	} else if (!strcmp(var, "max-history")) {
+		if (val >= 0)
+			max_history = val;
 	} else if (!strcmp(var, "max-killed-tabs")) {
 		if (val >= 0)
 			max_killed_tabs = MIN(val, 128);
+	} else if (!strcmp(var, "max-tab-history")) {
+		if (val >= 0)
+			max_tab_history = val;
+	} else if (!strcmp(var, "memory-limit")) {
+		if (val >= 0)
+			memory_limit = val;
+	} else if (!strcmp(var, "net-workers")) {
+		if (val >= 1)
+			net_workers = val;
+	} else if (!strcmp(var, "patch-fold-size")) {
+		if (val >= 0)
+			patch_fold_size = val;
+	} else if (!strcmp(var, "preconnect-delay")) {
+		if (val >= 0)
+			preconnect_delay = val;
+	} else if (!strcmp(var, "prefetch")) {
+		if (val >= 0)
+			prefetch = val;
+	} else if (!strcmp(var, "redirect-cache-ttl")) {
+		if (val >= 0)
+			redirect_cache_ttl = val;
+	} else if (!strcmp(var, "shm-ring")) {
+		if (val >= 0)
+			shm_ring = val;
+	} else if (!strcmp(var, "slow-frame")) {
+		if (val >= 0)
+			slow_frame = val;
+	} else if (!strcmp(var, "spill-size")) {
+		if (val >= 0)
+			spill_size = val;
 	} else if (!strcmp(var, "tab-bar-show")) {
 		if (val < 0)
 			tab_bar_show = -1;
@@ -595,6 +689,21 @@ config_setvari(const char *var, int val)
 			tab_bar_show = 0;
 		else
 			tab_bar_show = 1;
+	} else if (!strcmp(var, "tcp-rcvbuf")) {
+		if (val >= 0)
+			tcp_rcvbuf = val;
+	} else if (!strcmp(var, "total-timeout")) {
+		if (val >= 0)
+			total_timeout = val;
+	} else if (!strcmp(var, "warmup-rate")) {
+		if (val >= 0)
+			warmup_rate = val;
+	} else if (!strcmp(var, "warmup-tabs")) {
+		if (val >= 0)
+			warmup_tabs = val;
+	} else if (!strcmp(var, "wrap-threads")) {
+		if (val >= 0)
+			wrap_threads = MIN(val, 16);
 	} else {
 		return 0;
 	}
@@ -657,6 +766,16 @@ int
 config_setvarb(const char *var, int val) {
 	val = !!val;
 
+	if (!strcmp(var, "binary-session")) {
+		binary_session = val;
+		return 1;
+	}
+
+	if (!strcmp(var, "disk-cache")) {
+		disk_cache = val;
+		return 1;
+	}
+
 	if (!strcmp(var, "dont-wrap-pre")) {
 		dont_wrap_pre = val;
 		return 1;
@@ -677,6 +796,16 @@ config_setvarb(const char *var, int val) {
 		return 1;
 	}
 
+	if (!strcmp(var, "fulltext-index")) {
+		fulltext_index = val;
+		return 1;
+	}
+
+	if (!strcmp(var, "fuzzy-completion")) {
+		fuzzy_completion = val;
+		return 1;
+	}
+
 	if (!strcmp(var, "hide-pre-blocks")) {
 		hide_pre_blocks = val;
 		return 1;
@@ -702,6 +831,21 @@ config_setvarb(const char *var, int val) {
 		return 1;
 	}
 
+	if (!strcmp(var, "parse-in-net")) {
+		parse_in_net = val;
+		return 1;
+	}
+
+	if (!strcmp(var, "tcp-fastopen")) {
+		tcp_fastopen = val;
+		return 1;
+	}
+
+	if (!strcmp(var, "tcp-nodelay")) {
+		tcp_nodelay = val;
+		return 1;
+	}
+
 	if (!strcmp(var, "update-title") ||
 	    !strcmp(var, "set-title")) {
 		set_title = val;
@@ -23,20 +23,51 @@ extern char	*download_path;
 extern char	*new_tab_url;
 
 extern int	 autosave;
+extern int	 binary_session;
+extern int	 cache_size;
+extern int	 connect_timeout;
+extern int	 disk_cache;
+extern int	 dns_cache_ttl;
 extern int	 dont_wrap_pre;
 extern int	 dont_apply_styling;
 extern int	 emojify_link;
 extern int	 enable_colors;
 extern int	 fill_column;
 extern int	 fringe_ignore_offset;
+extern int	 fulltext_index;
+extern int	 fuzzy_completion;
+extern int	 handshake_timeout;
+extern int	 hibernate_after;
+extern int	 hibernate_budget;
 extern int	 hide_pre_blocks;
 extern int	 hide_pre_closing_line;
 extern int	 hide_pre_context;
+extern int	 idle_timeout;
 extern int	 load_url_use_heuristic;
+extern int	 long_line_size;
+extern int	 max_history;
 extern int	 max_killed_tabs;
+extern int	 max_tab_history;
+extern int	 memory_limit;
+extern int	 net_workers;
 extern int	 olivetti_mode;
+extern int	 parse_in_net;
+extern int	 patch_fold_size;
+extern int	 preconnect_delay;
+extern int	 prefetch;
+extern int	 redirect_cache_ttl;
 extern int	 set_title;
+extern int	 shm_ring;
+extern int	 slow_frame;
+extern int	 spill_size;
 extern int	 tab_bar_show;
+extern int	 tcp_fastopen;
+extern int	 tcp_nodelay;
+extern int	 tcp_rcvbuf;
+extern int	 total_timeout;
+extern int	 warmup_rate;
+extern int	 warmup_tabs;
+extern int	 wrap_threads;
 
 extern struct vline fringe;
 
@@ -16,38 +16,86 @@
 
 #include "compat.h"
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "telescope.h"
 #include "ui.h"
+#include "utils.h"
 #include "xwrapper.h"
 
 struct downloads downloads = STAILQ_HEAD_INITIALIZER(downloads);
 
+static struct ohash downloadids;
+
+/* whether the pane has to be built again */
+static int changed = 1;
+
 static void
 no_downloads(void)
 {
 	struct line	*l;
 
-	l = xcalloc(1, sizeof(*l));
+	l = arena_calloc(&downloadwin.line_arena, 1, sizeof(*l));
 
 	l->type = LINE_DOWNLOAD_INFO;
-	l->line = xstrdup("No downloads");
+	l->line = arena_strdup(&downloadwin.line_arena, "No downloads");
 
 	TAILQ_INSERT_TAIL(&downloadwin.head, l, lines);
 }
 
+/*
+ * The rate of a download is averaged over roughly the last couple of
+ * seconds; the one of a finished download is over all of it.
+ */
+#define RATE_WINDOW	2.0
+
+/* the text of a line of the pane, in a buffer that's always this big */
+#define STATUS_MAX	64
+
+static void
+download_status(struct download *d, char *buf, size_t len,
+    enum line_type *type)
+{
+	struct timespec	 now, diff;
+	char		 bytes[FMT_SCALED_STRSIZE], rate[FMT_SCALED_STRSIZE];
+	long long	 secs;
+
+	if (d->fd == -1) {
+		*type = LINE_DOWNLOAD_DONE;
+		secs = d->elapsed / 1000000;
+	} else {
+		*type = LINE_DOWNLOAD;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		timespecsub(&now, &d->start, &diff);
+		secs = diff.tv_sec;
+	}
+
+	fmt_scaled(d->bytes, bytes);
+	fmt_scaled(d->rate, rate);
+
+	if (secs >= 3600)
+		snprintf(buf, len, "%s %s/s %lld:%02lld:%02lld", bytes, rate,
+		    secs / 3600, secs / 60 % 60, secs % 60);
+	else
+		snprintf(buf, len, "%s %s/s %lld:%02lld", bytes, rate,
+		    secs / 60, secs % 60);
+}
+
 void
 recompute_downloads(void)
 {
 	struct download *d;
 	struct line	*l;
-	char		 buf[FMT_SCALED_STRSIZE];
+	enum line_type	 type;
 
 	downloadwin.mode = "*Downloads*";
 	erase_buffer(&downloadwin);
+	changed = 0;
 
 	if (STAILQ_EMPTY(&downloads)) {
 		no_downloads();
@@ -55,30 +103,53 @@ recompute_downloads(void)
 	}
 
 	STAILQ_FOREACH(d, &downloads, entries) {
-		l = xcalloc(1, sizeof(*l));
-
-		fmt_scaled(d->bytes, buf);
+		l = arena_calloc(&downloadwin.line_arena, 1, sizeof(*l));
 
-		l->type = LINE_DOWNLOAD;
-		if (d->fd == -1)
-			l->type = LINE_DOWNLOAD_DONE;
-
-		l->line = xstrdup(buf);
-		l->alt = xstrdup(d->path);
+		l->line = arena_alloc(&downloadwin.line_arena, STATUS_MAX);
+		download_status(d, l->line, STATUS_MAX, &type);
+		l->type = type;
+		l->alt = arena_strdup(&downloadwin.line_arena, d->path);
 
 		TAILQ_INSERT_TAIL(&downloadwin.head, l, lines);
+		d->line = l;
 	}
 
 end:
 	/*
 	 * The exact value doesn't matter, as wrap_page only considers
-	 * l->line, which is the human representation of the byte
-	 * counter, and we know for sure is < FMT_SCALED_STRSIZE so it
-	 * fits.
+	 * l->line, which is the human representation of the counters,
+	 * and we know for sure is short so it fits.
 	 */
 	wrap_page(&downloadwin, download_cols);
 }
 
+/*
+ * Bring the pane up to date.  Unless downloads were added only the
+ * lines whose text changed are rewritten and wrapped again.
+ */
+void
+refresh_downloads(void)
+{
+	struct download	*d;
+	char		 buf[STATUS_MAX];
+	enum line_type	 type;
+
+	if (changed) {
+		recompute_downloads();
+		return;
+	}
+
+	STAILQ_FOREACH(d, &downloads, entries) {
+		download_status(d, buf, sizeof(buf), &type);
+		if (d->line->type == type && !strcmp(d->line->line, buf))
+			continue;
+
+		d->line->type = type;
+		strlcpy(d->line->line, buf, STATUS_MAX);
+		wrap_line_update(&downloadwin, d->line);
+	}
+}
+
 struct download *
 enqueue_download(uint32_t id, const char *path, const char *mime_type)
 {
@@ -92,29 +163,71 @@ enqueue_download(uint32_t id, const char *path, const char *mime_type)
 	d->mime_type = xstrdup(mime_type);
 
 	STAILQ_INSERT_HEAD(&downloads, d, entries);
+	idmap_put(&downloadids, d->id, d);
+	changed = 1;
 
 	return d;
 }
 
+void
+downloads_init(void)
+{
+	idmap_init(&downloadids, offsetof(struct download, id));
+}
+
 struct download *
 download_by_id(uint32_t id)
 {
-	struct download *d;
+	return idmap_get(&downloadids, id);
+}
 
-	STAILQ_FOREACH(d, &downloads, entries) {
-		if (d->id == id)
-			return d;
+/*
+ * The net process saved this much so far.  Until the averaging window
+ * is filled the rate is the average since the start, otherwise the
+ * first burst, of what the server sent before the download was
+ * accepted, would weigh too much.
+ */
+void
+download_progress(struct download *d, size_t bytes)
+{
+	struct timespec	 now, diff;
+	double		 dt, inst;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	timespecsub(&now, &d->start, &diff);
+	dt = diff.tv_sec + diff.tv_nsec / 1e9;
+	if (dt < RATE_WINDOW) {
+		if (dt > 0)
+			d->rate = bytes / dt;
+	} else {
+		timespecsub(&now, &d->last, &diff);
+		dt = diff.tv_sec + diff.tv_nsec / 1e9;
+		if (dt > 0) {
+			inst = (bytes - d->bytes) / dt;
+			d->rate += (inst - d->rate) * dt / (dt + RATE_WINDOW);
+		}
 	}
 
-	return NULL;
+	d->last = now;
+	d->bytes = bytes;
+	ui_on_download_refresh();
 }
 
 void
 download_finished(struct download *d)
 {
+	struct timespec	 now, diff;
+
 	if (d == NULL)
 		return;
 
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &d->start, &diff);
+	d->elapsed = diff.tv_sec * 1000000LL + diff.tv_nsec / 1000;
+	if (d->elapsed > 0)
+		d->rate = d->bytes * 1e6 / d->elapsed;
+
 	close(d->fd);
 	d->fd = -1;
 
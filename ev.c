@@ -26,12 +26,18 @@
 #include "compat.h"
 
 #include <sys/time.h>
+#if HAVE_EPOLL_CREATE1
+# include <sys/epoll.h>
+#elif HAVE_KQUEUE
+# include <sys/event.h>
+#endif
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
 #include <poll.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -39,42 +45,120 @@
 
 #include "ev.h"
 
+/*
+ * The backend used to wait for the file descriptors: epoll on linux,
+ * kqueue on the BSDs and poll as a fallback.  Only poll needs to
+ * look at every descriptor after each wakeup.
+ */
+#if HAVE_EPOLL_CREATE1
+# define EV_EPOLL
+#elif HAVE_KQUEUE
+# define EV_KQUEUE
+#else
+# define EV_POLL
+#endif
+
+#define EV_NEVENTS	64
+
+/* how long the idle callbacks may run before polling again, in usec */
+#define EV_IDLE_BUDGET	5000
+
 struct evcb {
 	void		(*cb)(int, int, void *);
 	void		*udata;
+	int		 ev;		/* what's registered */
+	size_t		 site;		/* for the stats */
+};
+
+/* the longest iteration of the loop in a given second */
+struct evstall {
+	uint64_t	 sec;
+	uint64_t	 usec;
+};
+
+struct evready {
+	int		 fd;
+	int		 ev;
 };
 
 struct evtimer {
+	unsigned int	 id;		/* 0 if the slot is free */
+	size_t		 pos;		/* in the heap, or next free slot */
+	uint64_t	 deadline;	/* monotonic, in microseconds */
+	unsigned int	 tick;		/* when it was added */
+	struct evcb	 cb;
+};
+
+struct evidle {
 	unsigned int	 id;
-	struct timeval	 tv;
+	unsigned int	 tick;		/* when it was added */
 	struct evcb	 cb;
 };
 
+/* maps the timers id to their slot */
+struct evtimer_id {
+	unsigned int	 id;		/* 0 if empty */
+	size_t		 slot;
+};
+
 struct evbase {
 	size_t		 len;
 
+#ifdef EV_POLL
 	struct pollfd	*pfds;
 	size_t		 pfdlen;
+#else
+	int		 backend_fd;
+#endif
 
 	struct evcb	*cbs;
 	size_t		 cblen;
 
+	struct evready	*ready;
+	size_t		 nready;
+	size_t		 readycap;
+
 	int		 sigpipe[2];
 	struct evcb	 sigcb;
 
 	unsigned int	 tid;
+	unsigned int	 tick;
 
 	/*
-	 * Binary heap of timers.  At runtime, new timers are added in
-	 * the ``reserve'', a space after the caninocal end of the
-	 * array, and at the end of every tick they're added to the
-	 * heap.
+	 * The timers live in slots that don't move, so their id can be
+	 * mapped to them.  The heap, ordered by deadline, holds the slot
+	 * indices and each slot knows its position in it, so looking up
+	 * and cancelling a timer is O(1) plus the heap fix up.
 	 */
 	struct evtimer	*timers;
-	size_t		 ntimers;
-	size_t		 reserve_from;
-	size_t		 reserve_till;
 	size_t		 timerscap;
+	size_t		 freeslot;
+	size_t		*heap;
+	size_t		 ntimers;
+
+	struct evtimer_id *ids;
+	size_t		 idscap;	/* a power of two */
+
+	/* FIFO of the callbacks to run when there's nothing else to do */
+	struct evidle	*idles;
+	size_t		 nidles;
+	size_t		 idlescap;
+	unsigned int	 iid;
+
+	struct ev_site	*sites;
+	size_t		 nsites;
+	size_t		 sitescap;
+
+	/* the user typing; the idle work makes way for it */
+	int		 input_fd;
+	uint64_t	 last_input;
+	uint64_t	 idle_start;	/* 0 when not running the idles */
+
+	uint64_t	 started;
+	uint64_t	 iterations;
+	uint64_t	 polling;
+	uint64_t	 handling;
+	struct evstall	 stalls[EV_STALL_WINDOW];
 };
 
 static struct evbase	*base;
@@ -84,6 +168,7 @@ static int
 ev_resize(size_t len)
 {
 	void	*t;
+#ifdef EV_POLL
 	size_t	 i;
 
 	t = recallocarray(base->pfds, base->pfdlen, len, sizeof(*base->pfds));
@@ -94,6 +179,7 @@ ev_resize(size_t len)
 
 	for (i = base->len; i < len; ++i)
 		base->pfds[i].fd = -1;
+#endif
 
 	t = recallocarray(base->cbs, base->cblen, len, sizeof(*base->cbs));
 	if (t == NULL)
@@ -105,31 +191,169 @@ ev_resize(size_t len)
 	return 0;
 }
 
-int
-ev_init(void)
+static int
+ev_ready(int fd, int ev)
 {
-	if (base != NULL) {
-		errno = EINVAL;
+	void	*t;
+	size_t	 newcap;
+
+	if (base->nready == base->readycap) {
+		newcap = base->readycap + EV_NEVENTS;
+		t = recallocarray(base->ready, base->readycap, newcap,
+		    sizeof(*base->ready));
+		if (t == NULL)
+			return -1;
+		base->ready = t;
+		base->readycap = newcap;
+	}
+
+	base->ready[base->nready].fd = fd;
+	base->ready[base->nready].ev = ev;
+	base->nready++;
+	return 0;
+}
+
+#if defined(EV_EPOLL)
+
+static int
+backend_init(void)
+{
+	if ((base->backend_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
 		return -1;
+	return 0;
+}
+
+static int
+backend_set(int fd, int old, int ev)
+{
+	struct epoll_event	 e;
+	int			 op;
+
+	if (ev == 0) {
+		/* might have been closed already */
+		epoll_ctl(base->backend_fd, EPOLL_CTL_DEL, fd, NULL);
+		return 0;
 	}
 
-	if ((base = calloc(1, sizeof(*base))) == NULL)
+	memset(&e, 0, sizeof(e));
+	if (ev & EV_READ)
+		e.events |= EPOLLIN;
+	if (ev & EV_WRITE)
+		e.events |= EPOLLOUT;
+	e.data.fd = fd;
+
+	/*
+	 * A descriptor closed without ev_del is dropped from the
+	 * epoll set, and its number may be reused.
+	 */
+	op = old == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if (epoll_ctl(base->backend_fd, op, fd, &e) == 0)
+		return 0;
+	if (errno == EEXIST)
+		op = EPOLL_CTL_MOD;
+	else if (errno == ENOENT)
+		op = EPOLL_CTL_ADD;
+	else
 		return -1;
+	return epoll_ctl(base->backend_fd, op, fd, &e);
+}
 
-	base->sigpipe[0] = -1;
-	base->sigpipe[1] = -1;
+static int
+backend_wait(int msec)
+{
+	struct epoll_event	 evs[EV_NEVENTS];
+	int			 i, n, ev, fd;
 
-	if (ev_resize(16) == -1) {
-		free(base->pfds);
-		free(base->cbs);
-		free(base);
-		base = NULL;
+	if ((n = epoll_wait(base->backend_fd, evs, EV_NEVENTS, msec)) == -1)
 		return -1;
+
+	for (i = 0; i < n; ++i) {
+		fd = evs[i].data.fd;
+		ev = 0;
+		if (evs[i].events & EPOLLIN)
+			ev |= EV_READ;
+		if (evs[i].events & EPOLLOUT)
+			ev |= EV_WRITE;
+		/* let the callback find out about the error */
+		if (evs[i].events & (EPOLLERR|EPOLLHUP))
+			ev |= base->cbs[fd].ev;
+		if (ev_ready(fd, ev) == -1)
+			return -1;
 	}
 
+	return n;
+}
+
+#elif defined(EV_KQUEUE)
+
+static int
+backend_init(void)
+{
+	if ((base->backend_fd = kqueue()) == -1)
+		return -1;
 	return 0;
 }
 
+static int
+backend_set(int fd, int old, int ev)
+{
+	struct kevent	 kev[2];
+	int		 n = 0;
+
+	/* the filters are dropped when the descriptor is closed */
+	if ((old & EV_READ) && !(ev & EV_READ)) {
+		EV_SET(&kev[0], fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+		kevent(base->backend_fd, kev, 1, NULL, 0, NULL);
+	}
+	if ((old & EV_WRITE) && !(ev & EV_WRITE)) {
+		EV_SET(&kev[0], fd, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+		kevent(base->backend_fd, kev, 1, NULL, 0, NULL);
+	}
+
+	if (ev & EV_READ)
+		EV_SET(&kev[n++], fd, EVFILT_READ, EV_ADD, 0, 0, NULL);
+	if (ev & EV_WRITE)
+		EV_SET(&kev[n++], fd, EVFILT_WRITE, EV_ADD, 0, 0, NULL);
+	if (n == 0)
+		return 0;
+	return kevent(base->backend_fd, kev, n, NULL, 0, NULL);
+}
+
+static int
+backend_wait(int msec)
+{
+	struct kevent	 evs[EV_NEVENTS];
+	struct timespec	 ts, *tsp = NULL;
+	int		 i, n, ev;
+
+	if (msec != -1) {
+		ts.tv_sec = msec / 1000;
+		ts.tv_nsec = (msec % 1000) * 1000000;
+		tsp = &ts;
+	}
+
+	if ((n = kevent(base->backend_fd, NULL, 0, evs, EV_NEVENTS,
+	    tsp)) == -1)
+		return -1;
+
+	for (i = 0; i < n; ++i) {
+		if (evs[i].flags & EV_ERROR)
+			ev = base->cbs[evs[i].ident].ev;
+		else if (evs[i].filter == EVFILT_READ)
+			ev = EV_READ;
+		else if (evs[i].filter == EVFILT_WRITE)
+			ev = EV_WRITE;
+		else
+			continue;
+		if (ev_ready(evs[i].ident, ev) == -1)
+			return -1;
+	}
+
+	return n;
+}
+
+#else /* EV_POLL */
+
 static inline int
 ev2poll(int ev)
 {
@@ -143,6 +367,139 @@ ev2poll(int ev)
 	return (ret);
 }
 
+static inline int
+poll2ev(int ev)
+{
+	int r = 0;
+
+	if (ev & (POLLIN|POLLHUP))
+		r |= EV_READ;
+	if (ev & (POLLOUT|POLLWRNORM|POLLWRBAND))
+		r |= EV_WRITE;
+
+	return (r);
+}
+
+static int
+backend_init(void)
+{
+	return 0;
+}
+
+static int
+backend_set(int fd, int old, int ev)
+{
+	base->pfds[fd].fd = ev != 0 ? fd : -1;
+	base->pfds[fd].events = ev2poll(ev);
+	base->pfds[fd].revents = 0;
+	return 0;
+}
+
+static int
+backend_wait(int msec)
+{
+	size_t	 i;
+	int	 n, r;
+
+	if ((n = poll(base->pfds, base->len, msec)) == -1)
+		return -1;
+
+	for (i = 0, r = n; i < base->len && r > 0; ++i) {
+		if (base->pfds[i].fd == -1)
+			continue;
+		if (base->pfds[i].revents & (POLLIN|POLLOUT|POLLHUP)) {
+			r--;
+			if (ev_ready(i, poll2ev(base->pfds[i].revents)) == -1)
+				return -1;
+		}
+	}
+
+	return n;
+}
+
+#endif
+
+/*
+ * Return the stats slot for the callback, creating it if needed.  There
+ * are only a handful of different callbacks, so a linear scan at
+ * registration time is fine; the dispatch just uses the index.
+ */
+static int
+site_get(void (*cb)(int, int, void *), int kind, size_t *site)
+{
+	void		*t;
+	size_t		 i, newcap;
+
+	for (i = 0; i < base->nsites; ++i) {
+		if (base->sites[i].cb == cb) {
+			/* may have been named before being used */
+			if (base->sites[i].kind == 0)
+				base->sites[i].kind = kind;
+			*site = i;
+			return 0;
+		}
+	}
+
+	if (base->nsites == base->sitescap) {
+		newcap = base->sitescap + 16;
+		t = recallocarray(base->sites, base->sitescap, newcap,
+		    sizeof(*base->sites));
+		if (t == NULL)
+			return -1;
+		base->sites = t;
+		base->sitescap = newcap;
+	}
+
+	base->sites[base->nsites].cb = cb;
+	base->sites[base->nsites].kind = kind;
+	*site = base->nsites++;
+	return 0;
+}
+
+static void
+site_account(size_t site, uint64_t usec)
+{
+	struct ev_site	*s = &base->sites[site];
+	size_t		 b;
+
+	for (b = 0; b < EV_HIST - 1 && usec >= (1ULL << b); ++b)
+		/* nop */ ;
+
+	s->calls++;
+	s->total += usec;
+	s->hist[b]++;
+	if (usec > s->max)
+		s->max = usec;
+}
+
+int
+ev_init(void)
+{
+	if (base != NULL) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if ((base = calloc(1, sizeof(*base))) == NULL)
+		return -1;
+
+	base->sigpipe[0] = -1;
+	base->sigpipe[1] = -1;
+	base->input_fd = -1;
+
+	if (ev_resize(16) == -1 || backend_init() == -1) {
+#ifdef EV_POLL
+		free(base->pfds);
+#endif
+		free(base->cbs);
+		free(base);
+		base = NULL;
+		return -1;
+	}
+
+	return 0;
+}
+
 int
 ev_add(int fd, int ev, void (*cb)(int, int, void *), void *udata)
 {
@@ -156,12 +513,16 @@ ev_add(int fd, int ev, void (*cb)(int, int, void *), void *udata)
 			return -1;
 	}
 
-	base->pfds[fd].fd = fd;
-	base->pfds[fd].events = ev2poll(ev);
-	base->pfds[fd].revents = 0;
+	if (site_get(cb, EV_READ, &base->cbs[fd].site) == -1)
+		return -1;
+
+	ev &= EV_READ|EV_WRITE;
+	if (backend_set(fd, base->cbs[fd].ev, ev) == -1)
+		return -1;
 
 	base->cbs[fd].cb = cb;
 	base->cbs[fd].udata = udata;
+	base->cbs[fd].ev = ev;
 
 	return 0;
 }
@@ -198,6 +559,7 @@ ev_sigdispatch(int fd, int ev, void *data)
 int
 ev_signal(int sig, void (*cb)(int, int, void *), void *udata)
 {
+	size_t		 site;
 	int		 flags;
 
 	if (base->sigpipe[0] == -1) {
@@ -209,6 +571,10 @@ ev_signal(int sig, void (*cb)(int, int, void *), void *udata)
 		    fcntl(base->sigpipe[1], F_SETFL, flags | O_NONBLOCK) == -1)
 			return -1;
 
+		if (site_get(ev_sigdispatch, EV_SIGNAL, &site) == -1)
+			return -1;
+		base->sites[site].name = "signals";
+
 		if (ev_add(base->sigpipe[0], EV_READ, ev_sigdispatch, NULL)
 		    == -1)
 			return -1;
@@ -221,79 +587,120 @@ ev_signal(int sig, void (*cb)(int, int, void *), void *udata)
 	return 0;
 }
 
-unsigned int
-ev_timer(const struct timeval *tv, void (*cb)(int, int, void*), void *udata)
+static uint64_t
+ev_now(void)
 {
-	struct evtimer	*evt;
-	void		*t;
-	size_t		 newcap;
-	unsigned int	 nextid;
+	struct timespec	 ts;
 
-	if (tv == NULL) {
-		errno = EINVAL;
-		return 0;
-	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
 
-	if (base->reserve_till == base->timerscap) {
-		newcap = base->timerscap + 8;
-		t = recallocarray(base->timers, base->timerscap, newcap,
-		    sizeof(*base->timers));
-		if (t == NULL)
-			return 0;
-		base->timers = t;
-		base->timerscap = newcap;
-	}
+static inline size_t
+id_hash(unsigned int id)
+{
+	return ((id * 2654435761U) & (base->idscap - 1));
+}
 
-	if ((nextid = ++base->tid) == 0)
-		nextid = ++base->tid;
+static int
+id_grow(void)
+{
+	struct evtimer_id *old = base->ids;
+	size_t		 i, j, oldcap = base->idscap;
 
-	evt = &base->timers[base->reserve_till];
-	evt->id = nextid;
-	memcpy(&evt->tv, tv, sizeof(*tv));
-	evt->cb.cb = cb;
-	evt->cb.udata = udata;
+	base->idscap = oldcap == 0 ? 16 : oldcap * 2;
+	if ((base->ids = calloc(base->idscap, sizeof(*base->ids))) == NULL) {
+		base->ids = old;
+		base->idscap = oldcap;
+		return (-1);
+	}
 
-	base->reserve_till++;
-	return (nextid);
+	for (i = 0; i < oldcap; ++i) {
+		if (old[i].id == 0)
+			continue;
+		j = id_hash(old[i].id);
+		while (base->ids[j].id != 0)
+			j = (j + 1) & (base->idscap - 1);
+		base->ids[j] = old[i];
+	}
+	free(old);
+	return (0);
 }
 
-static int
-find_timer(unsigned int id, size_t *pos)
+static struct evtimer *
+find_timer(unsigned int id)
 {
 	size_t		 i;
 
-	if (id == 0)
-		return (0);
+	if (id == 0 || base->idscap == 0)
+		return (NULL);
 
-	for (i = 0; i < base->ntimers; ++i) {
-		if (base->timers[i].id == id) {
-			*pos = i;
-			return (1);
-		}
+	for (i = id_hash(id); base->ids[i].id != 0;
+	    i = (i + 1) & (base->idscap - 1)) {
+		if (base->ids[i].id == id)
+			return (&base->timers[base->ids[i].slot]);
 	}
 
-	for (i = base->reserve_from; i < base->reserve_till; ++i) {
-		if (base->timers[i].id == id) {
-			*pos = i;
-			return (1);
+	return (NULL);
+}
+
+static void
+id_remove(unsigned int id)
+{
+	size_t		 i, j, h, mask = base->idscap - 1;
+
+	for (i = id_hash(id); base->ids[i].id != id; i = (i + 1) & mask)
+		if (base->ids[i].id == 0)
+			return;
+
+	/* shift back the entries that would become unreachable */
+	for (j = (i + 1) & mask; base->ids[j].id != 0; j = (j + 1) & mask) {
+		h = id_hash(base->ids[j].id);
+		if (((j - h) & mask) >= ((j - i) & mask)) {
+			base->ids[i] = base->ids[j];
+			i = j;
 		}
 	}
+	base->ids[i].id = 0;
+}
 
-	return (0);
+static inline int
+timer_before(size_t a, size_t b)
+{
+	return (base->timers[base->heap[a]].deadline <
+	    base->timers[base->heap[b]].deadline);
 }
 
-int
-ev_timer_pending(unsigned int id)
+static inline void
+heap_swap(size_t a, size_t b)
 {
-	size_t		 i;
+	size_t		 t;
+
+	t = base->heap[a];
+	base->heap[a] = base->heap[b];
+	base->heap[b] = t;
 
-	return (find_timer(id, &i));
+	base->timers[base->heap[a]].pos = a;
+	base->timers[base->heap[b]].pos = b;
+}
+
+static void
+bubbleup(size_t i)
+{
+	size_t		 p;
+
+	while (i > 0) {
+		p = (i - 1) / 2;
+		if (!timer_before(i, p))
+			return;
+		heap_swap(i, p);
+		i = p;
+	}
 }
 
 static void
 bubbledown(size_t i)
 {
-	struct evtimer	 tmp;
 	size_t		 l, r, s;
 
 	for (;;) {
@@ -306,54 +713,289 @@ bubbledown(size_t i)
 
 		/* find the smaller child */
 		s = r;
-		if (r >= base->ntimers ||
-		    timercmp(&base->timers[l].tv, &base->timers[r].tv, <))
+		if (r >= base->ntimers || timer_before(l, r))
 			s = l;
 
 		/* other base case: it's at the right place */
-		if (timercmp(&base->timers[i].tv, &base->timers[s].tv, <))
+		if (!timer_before(s, i))
 			return;
 
-		/* swap */
-		memcpy(&tmp, &base->timers[s], sizeof(tmp));
-		memcpy(&base->timers[s], &base->timers[i], sizeof(tmp));
-		memcpy(&base->timers[i], &tmp, sizeof(tmp));
-
+		heap_swap(i, s);
 		i = s;
 	}
 }
 
-static inline void
-cancel_timer(size_t i)
+static int
+timers_grow(void)
+{
+	void		*t;
+	size_t		 i, newcap;
+
+	newcap = base->timerscap == 0 ? 8 : base->timerscap * 2;
+
+	t = recallocarray(base->heap, base->timerscap, newcap,
+	    sizeof(*base->heap));
+	if (t == NULL)
+		return (-1);
+	base->heap = t;
+
+	t = recallocarray(base->timers, base->timerscap, newcap,
+	    sizeof(*base->timers));
+	if (t == NULL)
+		return (-1);
+	base->timers = t;
+
+	/* it's only called when all the slots are used */
+	for (i = base->timerscap; i < newcap; ++i)
+		base->timers[i].pos = i + 1;
+	base->freeslot = base->timerscap;
+	base->timerscap = newcap;
+	return (0);
+}
+
+/* remove the timer from the heap and free its slot */
+static void
+timer_remove(struct evtimer *evt)
 {
+	size_t		 i = evt->pos, slot;
+
+	slot = base->heap[i];
 	base->ntimers--;
 	if (i != base->ntimers) {
-		memcpy(&base->timers[i], &base->timers[base->ntimers],
-		    sizeof(*base->timers));
+		heap_swap(i, base->ntimers);
 		bubbledown(i);
+		bubbleup(i);
 	}
+
+	id_remove(evt->id);
+	evt->id = 0;
+	evt->pos = base->freeslot;
+	base->freeslot = slot;
+}
+
+unsigned int
+ev_timer(const struct timeval *tv, void (*cb)(int, int, void*), void *udata)
+{
+	struct evtimer	*evt;
+	size_t		 slot, site, i;
+	unsigned int	 nextid;
+
+	if (tv == NULL) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	if (site_get(cb, EV_TIMEOUT, &site) == -1)
+		return 0;
+
+	if (base->ntimers == base->timerscap && timers_grow() == -1)
+		return 0;
+	if ((base->ntimers + 1) * 2 > base->idscap && id_grow() == -1)
+		return 0;
+
+	if ((nextid = ++base->tid) == 0)
+		nextid = ++base->tid;
+
+	slot = base->freeslot;
+	evt = &base->timers[slot];
+	base->freeslot = evt->pos;
+
+	evt->id = nextid;
+	evt->deadline = ev_now() + tv->tv_sec * 1000000ULL + tv->tv_usec;
+	evt->tick = base->tick;
+	evt->cb.cb = cb;
+	evt->cb.udata = udata;
+	evt->cb.site = site;
+
+	evt->pos = base->ntimers;
+	base->heap[base->ntimers++] = slot;
+	bubbleup(evt->pos);
+
+	for (i = id_hash(nextid); base->ids[i].id != 0;
+	    i = (i + 1) & (base->idscap - 1))
+		/* nop */ ;
+	base->ids[i].id = nextid;
+	base->ids[i].slot = slot;
+
+	return (nextid);
+}
+
+int
+ev_timer_pending(unsigned int id)
+{
+	return (find_timer(id) != NULL);
 }
 
 int
 ev_timer_cancel(unsigned int id)
 {
-	size_t		 i;
+	struct evtimer	*evt;
 
-	if (!find_timer(id, &i))
+	if ((evt = find_timer(id)) == NULL)
 		return (-1);
 
-	if (i < base->ntimers) {
-		cancel_timer(i);
-		return (0);
+	timer_remove(evt);
+	return (0);
+}
+
+unsigned int
+ev_idle(void (*cb)(int, int, void *), void *udata)
+{
+	struct evidle	*evi;
+	void		*t;
+	size_t		 newcap, site;
+	unsigned int	 nextid;
+
+	if (site_get(cb, EV_IDLE, &site) == -1)
+		return 0;
+
+	if (base->nidles == base->idlescap) {
+		newcap = base->idlescap + EV_NEVENTS;
+		t = recallocarray(base->idles, base->idlescap, newcap,
+		    sizeof(*base->idles));
+		if (t == NULL)
+			return 0;
+		base->idles = t;
+		base->idlescap = newcap;
 	}
 
-	base->reserve_till--;
-	if (i != base->reserve_till)
-		memcpy(&base->timers[i], &base->timers[base->reserve_till],
-		    sizeof(*base->timers));
+	if ((nextid = ++base->iid) == 0)
+		nextid = ++base->iid;
+
+	evi = &base->idles[base->nidles++];
+	evi->id = nextid;
+	evi->tick = base->tick;
+	evi->cb.cb = cb;
+	evi->cb.udata = udata;
+	evi->cb.site = site;
+
+	return (nextid);
+}
+
+static struct evidle *
+find_idle(unsigned int id)
+{
+	size_t		 i;
+
+	if (id == 0)
+		return (NULL);
+
+	for (i = 0; i < base->nidles; ++i)
+		if (base->idles[i].id == id)
+			return (&base->idles[i]);
+	return (NULL);
+}
+
+static void
+idle_remove(struct evidle *evi)
+{
+	size_t		 i = evi - base->idles;
+
+	base->nidles--;
+	memmove(&base->idles[i], &base->idles[i + 1],
+	    (base->nidles - i) * sizeof(*base->idles));
+}
+
+int
+ev_idle_pending(unsigned int id)
+{
+	return (find_idle(id) != NULL);
+}
+
+int
+ev_idle_cancel(unsigned int id)
+{
+	struct evidle	*evi;
+
+	if ((evi = find_idle(id)) == NULL)
+		return (-1);
+
+	idle_remove(evi);
 	return (0);
 }
 
+/* run a callback keeping track of how long it took */
+static void
+ev_call(const struct evcb *evcb, int fd, int ev)
+{
+	struct evcb	 cb;
+	uint64_t	 start;
+
+	/* the callback may change or free it */
+	memcpy(&cb, evcb, sizeof(cb));
+
+	start = ev_now();
+	cb.cb(fd, ev, cb.udata);
+	site_account(cb.site, ev_now() - start);
+}
+
+/* the descriptor the user types on, -1 to forget it */
+void
+ev_input(int fd)
+{
+	base->input_fd = fd;
+}
+
+static int
+input_pending(void)
+{
+	struct pollfd	 pfd;
+
+	if (base->input_fd == -1)
+		return 0;
+
+	pfd.fd = base->input_fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	return poll(&pfd, 1, 0) == 1;
+}
+
+/*
+ * For the idle callbacks that loop over their work: return 1 when
+ * they should stop and come back later, either because the budget
+ * is spent or because they ran for a slice and there's some input
+ * waiting.  Outside of the idle callbacks it's always 0.
+ */
+int
+ev_yield(void)
+{
+	uint64_t	 elapsed;
+
+	if (base->idle_start == 0)
+		return 0;
+
+	elapsed = ev_now() - base->idle_start;
+	if (elapsed >= EV_IDLE_BUDGET)
+		return 1;
+	return elapsed >= EV_YIELD_SLICE && input_pending();
+}
+
+/*
+ * Run the idle callbacks in order until the budget is spent, or
+ * earlier if the user typed something.  The ones added in this
+ * tick, even by another idle callback that wants to continue its
+ * work later, wait for the next round.
+ */
+static void
+run_idles(void)
+{
+	struct evcb	 cb;
+
+	base->idle_start = ev_now();
+	while (base->nidles > 0 && !ev_stop) {
+		if (base->idles[0].tick == base->tick)
+			break;
+
+		memcpy(&cb, &base->idles[0].cb, sizeof(cb));
+		idle_remove(&base->idles[0]);
+		ev_call(&cb, -1, EV_IDLE);
+
+		if (ev_yield())
+			break;
+	}
+	base->idle_start = 0;
+}
+
 int
 ev_del(int fd)
 {
@@ -367,123 +1009,148 @@ ev_del(int fd)
 		return -1;
 	}
 
-	base->pfds[fd].fd = -1;
-	base->pfds[fd].events = 0;
+	if (base->cbs[fd].ev != 0)
+		backend_set(fd, base->cbs[fd].ev, 0);
 
 	base->cbs[fd].cb = NULL;
 	base->cbs[fd].udata = NULL;
+	base->cbs[fd].ev = 0;
 
 	return 0;
 }
 
 static void
-timerheapify(void)
+stall_account(uint64_t wake, uint64_t now)
 {
-	size_t		 i, reserve, gap;
+	struct evstall	*st;
+	uint64_t	 sec, usec = now - wake;
 
-	reserve = base->reserve_till - base->reserve_from;
-	if (reserve == 0)
-		return;
+	base->iterations++;
+	base->handling += usec;
 
-	gap = base->reserve_from - base->ntimers;
-	if (gap != 0) {
-		memmove(&base->timers[base->ntimers],
-		    &base->timers[base->reserve_from],
-		    reserve * sizeof(*base->timers));
-		base->reserve_from -= gap;
-		base->reserve_till -= gap;
+	sec = wake / 1000000;
+	st = &base->stalls[sec % EV_STALL_WINDOW];
+	if (st->sec != sec) {
+		st->sec = sec;
+		st->usec = 0;
 	}
+	if (usec > st->usec)
+		st->usec = usec;
+}
 
-	base->ntimers = base->reserve_till;
-
-	if (base->ntimers < 2)
-		return;
+int
+ev_name(void (*cb)(int, int, void *), const char *name)
+{
+	size_t		 site;
 
-	i = base->ntimers / 2 - 1;
-	for (;;) {
-		bubbledown(i);
-		if (i == 0)
-			break;
-		i--;
-	}
+	if (site_get(cb, 0, &site) == -1)
+		return -1;
+	base->sites[site].name = name;
+	return 0;
 }
 
-static inline int
-poll2ev(int ev)
+void
+ev_stats(struct ev_stats *stats)
 {
-	int r = 0;
-
-	if (ev & (POLLIN|POLLHUP))
-		r |= EV_READ;
-	if (ev & (POLLOUT|POLLWRNORM|POLLWRBAND))
-		r |= EV_WRITE;
+	uint64_t	 now, sec;
+	size_t		 i;
 
-	return (r);
+	now = ev_now();
+	sec = now / 1000000;
+
+	memset(stats, 0, sizeof(*stats));
+	if (base->started != 0)
+		stats->uptime = now - base->started;
+	stats->iterations = base->iterations;
+	stats->polling = base->polling;
+	stats->handling = base->handling;
+	stats->sites = base->sites;
+	stats->nsites = base->nsites;
+	if (base->last_input != 0)
+		stats->since_input = now - base->last_input;
+
+	for (i = 0; i < EV_STALL_WINDOW; ++i) {
+		if (base->stalls[i].sec + EV_STALL_WINDOW <= sec)
+			continue;
+		if (base->stalls[i].usec > stats->stall)
+			stats->stall = base->stalls[i].usec;
+	}
 }
 
 int
 ev_loop(void)
 {
-	struct timespec	 elapsed, beg, end;
-	struct timeval	 tv, sub, *min;
+	struct evtimer	*evt;
 	struct evcb	 cb;
-	int		 n, msec;
+	uint64_t	 deadline, now, wake;
+	int		 fd, ev, msec, busy;
 	size_t		 i;
 
+	if (base->started == 0)
+		base->started = ev_now();
+
 	while (!ev_stop) {
-		timerheapify();
-		base->reserve_from = base->ntimers;
-		base->reserve_till = base->ntimers;
+		base->tick++;
 
-		min = NULL;
 		msec = -1;
 		if (base->ntimers) {
-			min = &base->timers[0].tv;
-			msec = min->tv_sec * 1000 + (min->tv_usec + 999) / 1000;
+			deadline = base->timers[base->heap[0]].deadline;
+			now = ev_now();
+			msec = 0;
+			if (deadline > now)
+				msec = (deadline - now + 999) / 1000;
 		}
 
-		clock_gettime(CLOCK_MONOTONIC, &beg);
-		if ((n = poll(base->pfds, base->len, msec)) == -1) {
+		/* just check for events if there's idle work to do */
+		if (base->nidles > 0)
+			msec = 0;
+
+		base->nready = 0;
+		wake = ev_now();
+		if (backend_wait(msec) == -1) {
 			if (errno != EINTR)
 				return -1;
 		}
-
-		if (n == 0 && min)
-			memcpy(&tv, min, sizeof(tv));
-		else {
-			clock_gettime(CLOCK_MONOTONIC, &end);
-			timespecsub(&end, &beg, &elapsed);
-			TIMESPEC_TO_TIMEVAL(&tv, &elapsed);
+		now = ev_now();
+		base->polling += now - wake;
+		wake = now;
+
+		/*
+		 * Timers added by the callbacks in this tick have to
+		 * wait for the next one.
+		 */
+		busy = base->nready > 0;
+		while (base->ntimers > 0 && !ev_stop) {
+			evt = &base->timers[base->heap[0]];
+			if (evt->deadline > now || evt->tick == base->tick)
+				break;
+
+			/*
+			 * delete the timer before calling its callback;
+			 * protects from timer that attempt to delete
+			 * themselves.
+			 */
+			memcpy(&cb, &evt->cb, sizeof(cb));
+			timer_remove(evt);
+			ev_call(&cb, -1, EV_TIMEOUT);
+			busy = 1;
 		}
 
-		for (i = 0; i < base->ntimers && !ev_stop; /* nop */) {
-			timersub(&base->timers[i].tv, &tv, &sub);
-			if (sub.tv_sec <= 0) {
-				/*
-				 * delete the timer before calling its
-				 * callback; protects from timer that
-				 * attempt to delete themselves.
-				 */
-				memcpy(&cb, &base->timers[i].cb, sizeof(cb));
-				cancel_timer(i);
-				cb.cb(-1, EV_TIMEOUT, cb.udata);
+		for (i = 0; i < base->nready && !ev_stop; ++i) {
+			fd = base->ready[i].fd;
+			/* may have been changed by a previous callback */
+			ev = base->ready[i].ev & base->cbs[fd].ev;
+			if (ev == 0 || base->cbs[fd].cb == NULL)
 				continue;
-			}
-
-			memcpy(&base->timers[i].tv, &sub, sizeof(sub));
-			i++;
+			if (fd == base->input_fd)
+				base->last_input = wake;
+			ev_call(&base->cbs[fd], fd, ev);
 		}
 
-		for (i = 0; i < base->len && n > 0 && !ev_stop; ++i) {
-			if (base->pfds[i].fd == -1)
-				continue;
-			if (base->pfds[i].revents & (POLLIN|POLLOUT|POLLHUP)) {
-				n--;
-				base->cbs[i].cb(base->pfds[i].fd,
-				    poll2ev(base->pfds[i].revents),
-				    base->cbs[i].udata);
-			}
-		}
+		if (!busy)
+			run_idles();
+
+		stall_account(wake, ev_now());
 	}
 
 	return 0;
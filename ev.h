@@ -29,6 +29,38 @@ struct timeval;
 #define EV_WRITE	0x2
 #define EV_SIGNAL	0x4
 #define EV_TIMEOUT	0x8
+#define EV_IDLE		0x10
+
+/* the histograms have a bucket for each power of two usec up to ~1s */
+#define EV_HIST		21
+
+/* how long the idle work runs at most once there's input, in usec */
+#define EV_YIELD_SLICE	2000
+
+/* how far back the longest stall is remembered, in seconds */
+#define EV_STALL_WINDOW	10
+
+/* what a callback costed, keyed by the function */
+struct ev_site {
+	void		(*cb)(int, int, void *);
+	const char	*name;
+	int		 kind;		/* EV_READ, EV_TIMEOUT, ... */
+	uint64_t	 calls;
+	uint64_t	 total;		/* usec */
+	uint64_t	 max;		/* usec */
+	uint64_t	 hist[EV_HIST];	/* calls in [2^(i-1), 2^i) usec */
+};
+
+struct ev_stats {
+	uint64_t	 uptime;	/* usec since ev_loop started */
+	uint64_t	 iterations;
+	uint64_t	 polling;	/* usec spent waiting for events */
+	uint64_t	 handling;	/* usec spent in the callbacks */
+	uint64_t	 stall;		/* longest iteration in the window */
+	uint64_t	 since_input;	/* usec, 0 if there was none yet */
+	const struct ev_site *sites;
+	size_t		 nsites;
+};
 
 int		ev_init(void);
 int		ev_add(int, int, void(*)(int, int, void *), void *);
@@ -37,6 +69,13 @@ unsigned int	ev_timer(const struct timeval *, void(*)(int, int, void *),
 		    void *);
 int		ev_timer_pending(unsigned int);
 int		ev_timer_cancel(unsigned int);
+unsigned int	ev_idle(void(*)(int, int, void *), void *);
+int		ev_idle_pending(unsigned int);
+int		ev_idle_cancel(unsigned int);
 int		ev_del(int);
+void		ev_input(int);
+int		ev_yield(void);
+int		ev_name(void(*)(int, int, void *), const char *);
+void		ev_stats(struct ev_stats *);
 int		ev_loop(void);
 void		ev_break(void);
@@ -29,6 +29,7 @@
 #include "exec.h"
 #include "minibuffer.h"
 #include "ui.h"
+#include "utils.h"
 
 #define TMPFILE "/tmp/telescope.XXXXXXXXXX"
 
@@ -95,6 +96,54 @@ exec_cmd(char **argv, enum exec_mode mode)
 	return (0);
 }
 
+/*
+ * Run the command in background with its output, and its errors,
+ * going to a pipe and return the non-blocking read end of it.
+ */
+int
+exec_pipe(char **argv)
+{
+	int	 p[2], fd;
+
+	if (argv == NULL)
+		return (-1);
+
+	if (pipe(p) == -1) {
+		message("failed to create a pipe: %s", strerror(errno));
+		return (-1);
+	}
+
+	switch (fork()) {
+	case -1:
+		message("failed to fork: %s", strerror(errno));
+		close(p[0]);
+		close(p[1]);
+		return (-1);
+	case 0:
+		if ((fd = open("/dev/null", O_RDONLY)) != -1) {
+			(void)dup2(fd, 0);
+			if (fd > 2)
+				close(fd);
+		}
+		(void)dup2(p[1], 1);
+		(void)dup2(p[1], 2);
+		close(p[0]);
+		if (p[1] > 2)
+			close(p[1]);
+		execvp(argv[0], argv);
+		warn("can't exec \"%s\"", argv[0]);
+		_exit(1);
+	}
+
+	close(p[1]);
+	if (mark_nonblock_cloexec(p[0]) == -1) {
+		message("failed to read from %s: %s", *argv, strerror(errno));
+		close(p[0]);
+		return (-1);
+	}
+	return (p[0]);
+}
+
 FILE *
 exec_editor(void *data, size_t len)
 {
@@ -20,4 +20,5 @@ enum exec_mode {
 };
 
 int	 exec_cmd(char **argv, enum exec_mode);
+int	 exec_pipe(char **argv);
 FILE	*exec_editor(void *, size_t);
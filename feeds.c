@@ -0,0 +1,471 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Subscriptions to Gemini feeds: pages whose links are labelled by a
+ * date, as gemlogs usually are.  The URLs of the feeds are in the
+ * feeds file of the data dir, one per line.  They're all fetched
+ * again at once as prefetches, so that the net process runs many of
+ * them in parallel within its limits per host and waits after a 44,
+ * and about:feeds shows their entries, the most recent first.
+ *
+ * What was seen of every feed, the hash of its lines, when it last
+ * changed and its latest entries, is kept in feeds.state in the
+ * cache dir, so that the changes are noticed across the sessions.
+ */
+
+#include "compat.h"
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "feeds.h"
+#include "fs.h"
+#include "hist.h"
+#include "mcache.h"
+#include "minibuffer.h"
+#include "parser.h"
+#include "persist.h"
+#include "telescope.h"
+#include "utils.h"
+#include "xwrapper.h"
+
+#define FEED_ENTRIES	32	/* kept of every feed */
+#define FEEDS_SHOWN	200	/* in about:feeds */
+
+struct feed_entry {
+	char		 date[11];	/* YYYY-MM-DD */
+	char		*url;
+	char		*label;
+	struct feed	*feed;
+};
+
+struct feed {
+	TAILQ_ENTRY(feed)	 feeds;
+	char			*url;
+	char			*title;
+	uint64_t		 hash;
+	time_t			 changed;
+	int			 fetching;
+	int			 failed;
+	struct feed_entry	 entries[FEED_ENTRIES];
+	size_t			 nentries;
+};
+
+static TAILQ_HEAD(, feed)	 feeds = TAILQ_HEAD_INITIALIZER(feeds);
+static int			 loaded;
+static int			 fetching;	/* feeds still to come */
+static int			 changed;	/* in this refresh */
+
+static struct feed *
+feed_find(const char *url)
+{
+	struct feed	*f;
+
+	TAILQ_FOREACH(f, &feeds, feeds)
+		if (!strcmp(f->url, url))
+			return f;
+	return NULL;
+}
+
+static struct feed *
+feed_new(const char *url)
+{
+	struct feed	*f;
+
+	f = xcalloc(1, sizeof(*f));
+	f->url = xstrdup(url);
+	f->title = xstrdup("");
+	TAILQ_INSERT_TAIL(&feeds, f, feeds);
+	return f;
+}
+
+static void
+feed_clear_entries(struct feed *f)
+{
+	size_t	 i;
+
+	for (i = 0; i < f->nentries; ++i) {
+		free(f->entries[i].url);
+		free(f->entries[i].label);
+	}
+	f->nentries = 0;
+}
+
+static void
+feed_free(struct feed *f)
+{
+	TAILQ_REMOVE(&feeds, f, feeds);
+	feed_clear_entries(f);
+	free(f->url);
+	free(f->title);
+	free(f);
+}
+
+static void
+feed_add_entry(struct feed *f, const char *date, const char *url,
+    const char *label)
+{
+	struct feed_entry	*e;
+
+	if (f->nentries == FEED_ENTRIES)
+		return;
+	e = &f->entries[f->nentries++];
+	memcpy(e->date, date, 10);
+	e->date[10] = '\0';
+	e->url = xstrdup(url);
+	e->label = xstrdup(label);
+	e->feed = f;
+}
+
+/* whether s starts with a YYYY-MM-DD date */
+static int
+has_date(const char *s)
+{
+	static const char	*fmt = "dddd-dd-dd";
+	size_t			 i;
+
+	for (i = 0; fmt[i] != '\0'; ++i) {
+		if (fmt[i] == 'd' && (s[i] < '0' || s[i] > '9'))
+			return 0;
+		if (fmt[i] == '-' && s[i] != '-')
+			return 0;
+	}
+	return 1;
+}
+
+/* the state lines are tab separated: the fields can't have tabs */
+static void
+print_field(FILE *fp, const char *s)
+{
+	fputc('\t', fp);
+	for (; *s != '\0'; ++s)
+		fputc(*s == '\t' || *s == '\n' ? ' ' : *s, fp);
+}
+
+static void
+feeds_save_state(void)
+{
+	struct pfile	 pf;
+	struct feed	*f;
+	size_t		 i;
+
+	if (safe_mode || persist_open(&pf, feeds_state_file,
+	    feeds_state_file_tmp, PERSIST_REPLACE) == -1)
+		return;
+
+	TAILQ_FOREACH(f, &feeds, feeds) {
+		fprintf(pf.fp, "F\t%s\t%016llx\t%lld", f->url,
+		    (unsigned long long)f->hash, (long long)f->changed);
+		print_field(pf.fp, f->title);
+		fputc('\n', pf.fp);
+		for (i = 0; i < f->nentries; ++i) {
+			fprintf(pf.fp, "E\t%s\t%s", f->entries[i].date,
+			    f->entries[i].url);
+			print_field(pf.fp, f->entries[i].label);
+			fputc('\n', pf.fp);
+		}
+	}
+	persist_close(&pf);
+}
+
+static void
+feeds_save_list(void)
+{
+	struct pfile	 pf;
+	struct feed	*f;
+
+	if (safe_mode || persist_open(&pf, feeds_file, feeds_file_tmp,
+	    PERSIST_REPLACE) == -1)
+		return;
+
+	TAILQ_FOREACH(f, &feeds, feeds)
+		fprintf(pf.fp, "%s\n", f->url);
+	persist_close(&pf);
+}
+
+/* split line at the tabs, returns the number of fields */
+static size_t
+split_fields(char *line, char **fields, size_t n)
+{
+	size_t	 i = 0;
+
+	while (i < n) {
+		fields[i++] = line;
+		if ((line = strchr(line, '\t')) == NULL)
+			break;
+		*line++ = '\0';
+	}
+	return i;
+}
+
+static void
+feeds_load(void)
+{
+	FILE		*fp;
+	struct feed	*f = NULL;
+	size_t		 linesize = 0;
+	ssize_t		 linelen;
+	char		*line = NULL, *fld[5];
+	const char	*errstr;
+
+	if (loaded)
+		return;
+	loaded = 1;
+
+	if ((fp = fopen(feeds_file, "r")) != NULL) {
+		while ((linelen = getline(&line, &linesize, fp)) != -1) {
+			if (line[linelen - 1] == '\n')
+				line[linelen - 1] = '\0';
+			if (*line != '\0' && *line != '#' &&
+			    feed_find(line) == NULL)
+				feed_new(line);
+		}
+		fclose(fp);
+	}
+
+	if ((fp = fopen(feeds_state_file, "r")) != NULL) {
+		while ((linelen = getline(&line, &linesize, fp)) != -1) {
+			if (line[linelen - 1] == '\n')
+				line[linelen - 1] = '\0';
+			if (line[0] == 'F' && split_fields(line, fld, 5) == 5) {
+				/* only the feeds still in the list */
+				if ((f = feed_find(fld[1])) == NULL)
+					continue;
+				f->hash = strtoull(fld[2], NULL, 16);
+				f->changed = strtonum(fld[3], 0, INT64_MAX,
+				    &errstr);
+				free(f->title);
+				f->title = xstrdup(fld[4]);
+			} else if (line[0] == 'E' && f != NULL &&
+			    split_fields(line, fld, 4) == 4 &&
+			    has_date(fld[1]))
+				feed_add_entry(f, fld[1], fld[2], fld[3]);
+		}
+		fclose(fp);
+	}
+
+	free(line);
+}
+
+/*
+ * Subscribe to url, or unsubscribe if it was already.  Returns 1 in
+ * the first case and 0 in the second.
+ */
+int
+feeds_toggle(const char *url)
+{
+	struct feed	*f;
+	int		 r = 1;
+
+	feeds_load();
+	if ((f = feed_find(url)) != NULL) {
+		if (f->fetching)
+			feed_failed(url);
+		feed_free(f);
+		r = 0;
+	} else
+		feed_new(url);
+
+	feeds_save_list();
+	feeds_save_state();
+	return r;
+}
+
+/* Fetch all the feeds again, returns how many are being fetched */
+int
+feeds_refresh(void)
+{
+	struct feed	*f;
+
+	feeds_load();
+	TAILQ_FOREACH(f, &feeds, feeds) {
+		if (f->fetching)
+			continue;
+		if (prefetch_feed(f->url) == -1) {
+			f->failed = 1;
+			continue;
+		}
+		f->fetching = 1;
+		f->failed = 0;
+		fetching++;
+	}
+
+	if (fetching == 0)
+		return 0;
+	changed = 0;
+	return fetching;
+}
+
+static void
+feed_done(struct feed *f)
+{
+	f->fetching = 0;
+	if (--fetching > 0)
+		return;
+
+	feeds_save_state();
+	message("Feeds refreshed: %d changed", changed);
+}
+
+static uint64_t
+lines_hash(struct buffer *buffer)
+{
+	struct line	*l;
+	const char	*s;
+	uint64_t	 h = 14695981039346656037ULL;
+
+	TAILQ_FOREACH(l, &buffer->head, lines) {
+		h = (h ^ l->type) * 1099511628211ULL;
+		for (s = l->line; s != NULL && *s != '\0'; ++s)
+			h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+		for (s = l->alt; s != NULL && *s != '\0'; ++s)
+			h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+		h = (h ^ '\n') * 1099511628211ULL;
+	}
+	return h;
+}
+
+/*
+ * A feed was fetched in tab: if its lines changed since the last time
+ * take its entries again.  It goes in the cache anyway, to be read
+ * without waiting for the network.
+ */
+void
+feed_fetched(struct tab *tab)
+{
+	struct feed	*f;
+	struct lineref	*ref;
+	const char	*label, *url;
+	uint64_t	 h;
+
+	if ((f = feed_find(hist_cur(tab->hist))) == NULL || !f->fetching)
+		return;
+
+	h = lines_hash(&tab->buffer);
+	if (h != f->hash || f->changed == 0) {
+		f->hash = h;
+		f->changed = time(NULL);
+		free(f->title);
+		f->title = xstrdup(tab->buffer.title);
+		changed++;
+
+		feed_clear_entries(f);
+		for (ref = tab->buffer.links.refs;
+		     ref != NULL && ref->line != NULL; ref++) {
+			if ((label = ref->line->line) == NULL ||
+			    !has_date(label) ||
+			    (url = link_url(tab, ref)) == NULL)
+				continue;
+			label += 10;
+			while (*label == ' ' || *label == '-' ||
+			    *label == ':' || *label == '\t')
+				label++;
+			feed_add_entry(f, ref->line->line, url, label);
+		}
+	}
+
+	mcache_tab(tab);
+
+	feed_done(f);
+}
+
+void
+feed_failed(const char *url)
+{
+	struct feed	*f;
+
+	if ((f = feed_find(url)) == NULL || !f->fetching)
+		return;
+	f->failed = 1;
+	feed_done(f);
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+	const struct feed_entry	*x = *(struct feed_entry * const *)a;
+	const struct feed_entry	*y = *(struct feed_entry * const *)b;
+
+	return -strcmp(x->date, y->date);
+}
+
+/* generate the about:feeds page */
+void
+feeds_about(struct tab *tab)
+{
+	struct buffer		*buffer = &tab->buffer;
+	struct feed_entry	**all;
+	struct feed		*f;
+	struct tm		 tm;
+	size_t			 i, n = 0, cap = 0;
+	const char		*title;
+	char			 date[32];
+
+	feeds_load();
+
+	parser_init(buffer, &gemtext_parser);
+	parser_parsef(buffer, "# Feeds\n\n");
+
+	if (TAILQ_EMPTY(&feeds)) {
+		parser_parsef(buffer, "No subscriptions: use feeds-subscribe"
+		    " on a gemlog to add it here.\n");
+		parser_free(tab);
+		return;
+	}
+
+	if (fetching > 0)
+		parser_parsef(buffer, "Refreshing, %d feeds to go.\n\n",
+		    fetching);
+
+	all = NULL;
+	TAILQ_FOREACH(f, &feeds, feeds) {
+		if (n + f->nentries > cap) {
+			cap = MAX(cap * 2, n + f->nentries);
+			all = xreallocarray(all, cap, sizeof(*all));
+		}
+		for (i = 0; i < f->nentries; ++i)
+			all[n++] = &f->entries[i];
+	}
+	if (n != 0)
+		qsort(all, n, sizeof(*all), entry_cmp);
+
+	for (i = 0; i < n && i < FEEDS_SHOWN; ++i) {
+		title = *all[i]->feed->title != '\0' ? all[i]->feed->title :
+		    all[i]->feed->url;
+		parser_parsef(buffer, "=> %s %s %s - %s\n", all[i]->url,
+		    all[i]->date, title, all[i]->label);
+	}
+	free(all);
+
+	parser_parsef(buffer, "\n## Subscriptions\n\n");
+	TAILQ_FOREACH(f, &feeds, feeds) {
+		*date = '\0';
+		if (f->changed != 0 && localtime_r(&f->changed, &tm) != NULL)
+			strftime(date, sizeof(date), "%Y-%m-%d %H:%M", &tm);
+		parser_parsef(buffer, "=> %s %s%s%s%s\n", f->url,
+		    *f->title != '\0' ? f->title : f->url,
+		    *date != '\0' ? ", changed " : "", date,
+		    f->failed ? " (failed)" : "");
+	}
+
+	parser_free(tab);
+}
@@ -0,0 +1,558 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Filtering of the completion candidates.  The candidates are kept
+ * case-folded in a single buffer; once there are enough of them a
+ * trigram index is built the first time it's needed.  Every bucket
+ * of the index holds the ordered list of the candidates with at
+ * least one trigram hashing there, so that a word is checked only
+ * against the candidates in its rarest bucket instead of all of them.
+ *
+ * In fuzzy mode a word matches when its characters appear in order,
+ * not necessarily next to each other.  The trigrams are of no use
+ * there, so the candidates are first checked against a bitmap of the
+ * characters they contain, then scored fzf-style and only the best
+ * FILTER_TOPK are kept in a bounded heap.
+ */
+
+#include "compat.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "xwrapper.h"
+
+#define FILTER_INDEX_MIN	512
+#define FILTER_BITS		14
+#define FILTER_NBUCKETS		(1U << FILTER_BITS)
+#define FILTER_MAXWORDS		10
+#define FILTER_TOPK		256
+
+#define SCORE_MATCH		16
+#define SCORE_GAP_START		-3
+#define SCORE_GAP		-1
+#define BONUS_BOUNDARY		8
+#define BONUS_CONSECUTIVE	8
+
+struct fent {
+	size_t		 line;
+	size_t		 alt;
+	uint64_t	 mask;
+	void		*data;
+};
+
+struct filter {
+	int		 flags;
+
+	char		*text;
+	size_t		 textlen;
+	size_t		 textcap;
+
+	struct fent	*ents;
+	size_t		 len;
+	size_t		 cap;
+
+	/* the trigram index, built on demand */
+	uint32_t	*bstart;
+	uint32_t	*posts;
+
+	/* the current result and scratch space */
+	uint32_t	*res;
+	uint32_t	*tmp;
+	size_t		 nres;
+	size_t		 rescap;
+	int		 matched;
+
+	/* fuzzy mode: the scores and the best matches */
+	int		*score;
+	uint32_t	 top[FILTER_TOPK];
+	size_t		 ntop;
+};
+
+struct filter *
+filter_new(int flags)
+{
+	struct filter	*f;
+
+	f = xcalloc(1, sizeof(*f));
+	f->flags = flags;
+	return f;
+}
+
+static void
+filter_unindex(struct filter *f)
+{
+	free(f->bstart);
+	free(f->posts);
+	f->bstart = NULL;
+	f->posts = NULL;
+}
+
+void
+filter_free(struct filter *f)
+{
+	if (f == NULL)
+		return;
+
+	filter_unindex(f);
+	free(f->text);
+	free(f->ents);
+	free(f->res);
+	free(f->tmp);
+	free(f->score);
+	free(f);
+}
+
+static inline uint64_t
+charbit(unsigned char c)
+{
+	if (c >= 'a' && c <= 'z')
+		return 1ULL << (c - 'a');
+	if (c >= '0' && c <= '9')
+		return 1ULL << (26 + c - '0');
+	return 1ULL << (36 + c % 28);
+}
+
+static uint64_t
+charmask(const char *s)
+{
+	uint64_t	 mask = 0;
+
+	for (; *s != '\0'; ++s)
+		mask |= charbit(*s);
+	return mask;
+}
+
+/* only ASCII is folded, like strcasestr does in practice */
+static inline char
+lower(char c)
+{
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/* append the folded s to the text, adding its characters to mask */
+static size_t
+fold(struct filter *f, const char *s, uint64_t *mask)
+{
+	size_t	 start, len;
+	char	 c;
+
+	len = strlen(s) + 1;
+	if (f->textlen + len > f->textcap) {
+		while (f->textlen + len > f->textcap)
+			f->textcap = f->textcap == 0 ? 4096 : f->textcap * 2;
+		f->text = xrealloc(f->text, f->textcap);
+	}
+
+	start = f->textlen;
+	for (; *s != '\0'; ++s) {
+		c = lower(*s);
+		*mask |= charbit(c);
+		f->text[f->textlen++] = c;
+	}
+	f->text[f->textlen++] = '\0';
+	return start;
+}
+
+void
+filter_add(struct filter *f, const char *line, const char *alt, void *data)
+{
+	struct fent	*e;
+
+	if (f->len == f->cap) {
+		f->cap = f->cap == 0 ? 64 : f->cap * 2;
+		f->ents = xreallocarray(f->ents, f->cap, sizeof(*f->ents));
+	}
+
+	e = &f->ents[f->len++];
+	e->mask = 0;
+	e->line = fold(f, line, &e->mask);
+	e->alt = fold(f, alt != NULL ? alt : "", &e->mask);
+	e->data = data;
+
+	filter_unindex(f);
+	f->matched = 0;
+}
+
+size_t
+filter_len(struct filter *f)
+{
+	return f->len;
+}
+
+void *
+filter_data(struct filter *f, uint32_t id)
+{
+	return f->ents[id].data;
+}
+
+static inline uint32_t
+gram(const char *s)
+{
+	const unsigned char	*u = (const unsigned char *)s;
+	uint32_t		 g;
+
+	g = (uint32_t)u[0] << 16 | (uint32_t)u[1] << 8 | u[2];
+	return (g * 2654435761U) >> (32 - FILTER_BITS);
+}
+
+static void
+index_grams(struct filter *f, uint32_t id, const char *s, uint32_t *last,
+    uint32_t *fill)
+{
+	uint32_t	 b;
+
+	for (; s[0] != '\0' && s[1] != '\0' && s[2] != '\0'; ++s) {
+		b = gram(s);
+		if (last[b] == id)
+			continue;
+		last[b] = id;
+		if (fill == NULL)
+			f->bstart[b + 1]++;
+		else
+			f->posts[fill[b]++] = id;
+	}
+}
+
+static void
+filter_index(struct filter *f)
+{
+	uint32_t	*last, *fill;
+	size_t		 i;
+
+	f->bstart = xcalloc(FILTER_NBUCKETS + 1, sizeof(*f->bstart));
+	last = xreallocarray(NULL, FILTER_NBUCKETS, sizeof(*last));
+
+	/* first count the entries in every bucket... */
+	memset(last, 0xff, FILTER_NBUCKETS * sizeof(*last));
+	for (i = 0; i < f->len; ++i) {
+		index_grams(f, i, f->text + f->ents[i].line, last, NULL);
+		index_grams(f, i, f->text + f->ents[i].alt, last, NULL);
+	}
+
+	for (i = 0; i < FILTER_NBUCKETS; ++i)
+		f->bstart[i + 1] += f->bstart[i];
+
+	/* ...then fill them */
+	f->posts = xreallocarray(NULL, f->bstart[FILTER_NBUCKETS] + 1,
+	    sizeof(*f->posts));
+	fill = xreallocarray(NULL, FILTER_NBUCKETS, sizeof(*fill));
+	memcpy(fill, f->bstart, FILTER_NBUCKETS * sizeof(*fill));
+
+	memset(last, 0xff, FILTER_NBUCKETS * sizeof(*last));
+	for (i = 0; i < f->len; ++i) {
+		index_grams(f, i, f->text + f->ents[i].line, last, fill);
+		index_grams(f, i, f->text + f->ents[i].alt, last, fill);
+	}
+
+	free(fill);
+	free(last);
+}
+
+static inline int
+has_word(struct filter *f, uint32_t id, const char *word)
+{
+	return strstr(f->text + f->ents[id].line, word) != NULL ||
+	    strstr(f->text + f->ents[id].alt, word) != NULL;
+}
+
+/*
+ * Score the best occurrence of word as a subsequence of text, like
+ * fzf does: find the first match going forward, then shrink it going
+ * backward from its end.  Consecutive characters and characters at
+ * the start of a word get a bonus, gaps cost a penalty.  Return 0
+ * if word isn't a subsequence of text.
+ */
+static int
+fuzzy_score(const char *text, const char *word, int *score)
+{
+	const char	*s, *start, *end, *w;
+	size_t		 wlen;
+	int		 sc, prev, gap;
+
+	for (s = text, w = word; *s != '\0' && *w != '\0'; ++s)
+		if (*s == *w)
+			w++;
+	if (*w != '\0')
+		return 0;
+	end = s;
+
+	wlen = strlen(word);
+	for (start = end, w = word + wlen; w > word; )
+		if (*--start == w[-1])
+			w--;
+
+	sc = prev = gap = 0;
+	for (s = start, w = word; s < end; ++s) {
+		if (*w != '\0' && *s == *w) {
+			sc += SCORE_MATCH;
+			if (s == text || !isalnum((unsigned char)s[-1]))
+				sc += BONUS_BOUNDARY;
+			else if (prev)
+				sc += BONUS_CONSECUTIVE;
+			prev = 1;
+			gap = 0;
+			w++;
+		} else {
+			sc += gap ? SCORE_GAP : SCORE_GAP_START;
+			prev = 0;
+			gap = 1;
+		}
+	}
+
+	*score = sc;
+	return 1;
+}
+
+/*
+ * The description counts only when the word isn't in the line, and
+ * then only half as much.
+ */
+static int
+fuzzy_word(struct filter *f, uint32_t id, const char *word, uint64_t mask,
+    int *score)
+{
+	if ((f->ents[id].mask & mask) != mask)
+		return 0;
+
+	if (fuzzy_score(f->text + f->ents[id].line, word, score))
+		return 1;
+	if (fuzzy_score(f->text + f->ents[id].alt, word, score)) {
+		*score /= 2;
+		return 1;
+	}
+	return 0;
+}
+
+/* is a ranked worse than b?  Ties go to the shorter and then older. */
+static inline int
+worse(struct filter *f, uint32_t a, uint32_t b)
+{
+	size_t	 alen, blen;
+
+	if (f->score[a] != f->score[b])
+		return f->score[a] < f->score[b];
+
+	/* the folded alt follows the line */
+	alen = f->ents[a].alt - f->ents[a].line;
+	blen = f->ents[b].alt - f->ents[b].line;
+	if (alen != blen)
+		return alen > blen;
+	return a > b;
+}
+
+static void
+sift_down(struct filter *f, size_t i, size_t n)
+{
+	uint32_t	 t;
+	size_t		 c;
+
+	for (; (c = 2 * i + 1) < n; i = c) {
+		if (c + 1 < n && worse(f, f->top[c + 1], f->top[c]))
+			c++;
+		if (!worse(f, f->top[c], f->top[i]))
+			break;
+		t = f->top[i];
+		f->top[i] = f->top[c];
+		f->top[c] = t;
+	}
+}
+
+/*
+ * Keep the FILTER_TOPK best matches in a heap with the worst one at
+ * the root, then sort them best first.
+ */
+static void
+rank(struct filter *f)
+{
+	uint32_t	 id, t;
+	size_t		 i, c, n;
+
+	f->ntop = 0;
+	for (i = 0; i < f->nres; ++i) {
+		id = f->res[i];
+
+		if (f->ntop < FILTER_TOPK) {
+			c = f->ntop++;
+			f->top[c] = id;
+			while (c > 0 && worse(f, id, f->top[(c - 1) / 2])) {
+				f->top[c] = f->top[(c - 1) / 2];
+				c = (c - 1) / 2;
+				f->top[c] = id;
+			}
+			continue;
+		}
+
+		if (worse(f, f->top[0], id)) {
+			f->top[0] = id;
+			sift_down(f, 0, f->ntop);
+		}
+	}
+
+	for (n = f->ntop; n > 1; --n) {
+		t = f->top[0];
+		f->top[0] = f->top[n - 1];
+		f->top[n - 1] = t;
+		sift_down(f, 0, n - 1);
+	}
+}
+
+/*
+ * Narrow the candidates to the ones having the given word.  Unless
+ * all is set, the result is intersected with the previous one.  In
+ * fuzzy mode the score of the word is added to the one of the
+ * previous words, unless it's the first.
+ */
+static void
+match_word(struct filter *f, const char *word, int all, int first)
+{
+	const uint32_t	*cand = NULL, *bucket = NULL;
+	const char	*s;
+	uint64_t	 mask = 0;
+	uint32_t	*t, id, b;
+	size_t		 ncand, nbucket = 0, i, j, k, n;
+	int		 sc;
+
+	ncand = f->len;
+	if (!all) {
+		cand = f->res;
+		ncand = f->nres;
+	}
+
+	if (f->flags & FILTER_FUZZY)
+		mask = charmask(word);
+	else if (strlen(word) >= 3 && f->len >= FILTER_INDEX_MIN) {
+		if (f->bstart == NULL)
+			filter_index(f);
+
+		/* use the smallest bucket among the word trigrams */
+		for (s = word; s[2] != '\0'; ++s) {
+			b = gram(s);
+			n = f->bstart[b + 1] - f->bstart[b];
+			if (bucket == NULL || n < nbucket) {
+				bucket = f->posts + f->bstart[b];
+				nbucket = n;
+			}
+		}
+
+		cand = bucket;
+		ncand = nbucket;
+	}
+
+	for (i = 0, j = 0, k = 0; i < ncand; ++i) {
+		id = cand != NULL ? cand[i] : i;
+
+		if (!all && cand != f->res) {
+			while (j < f->nres && f->res[j] < id)
+				j++;
+			if (j == f->nres)
+				break;
+			if (f->res[j] != id)
+				continue;
+		}
+
+		if (!(f->flags & FILTER_FUZZY)) {
+			if (has_word(f, id, word))
+				f->tmp[k++] = id;
+		} else if (fuzzy_word(f, id, word, mask, &sc)) {
+			f->score[id] = first ? sc : f->score[id] + sc;
+			f->tmp[k++] = id;
+		}
+	}
+
+	t = f->res;
+	f->res = f->tmp;
+	f->tmp = t;
+	f->nres = k;
+}
+
+/*
+ * Compute the candidates matching all the space-separated words in
+ * query.  If narrow is set, only the ones that were matching the
+ * previous time are considered.  Return the number of matches.
+ */
+size_t
+filter_match(struct filter *f, const char *query, int narrow)
+{
+	char		*q, *s, *words[FILTER_MAXWORDS];
+	size_t		 i, nwords = 0;
+	int		 all;
+
+	if (f->rescap < f->len) {
+		f->rescap = f->cap;
+		f->res = xreallocarray(f->res, f->rescap, sizeof(*f->res));
+		f->tmp = xreallocarray(f->tmp, f->rescap, sizeof(*f->tmp));
+		if (f->flags & FILTER_FUZZY)
+			f->score = xreallocarray(f->score, f->rescap,
+			    sizeof(*f->score));
+	}
+
+	q = s = xstrdup(query);
+	for (i = 0; q[i] != '\0'; ++i)
+		q[i] = lower(q[i]);
+
+	while (nwords < FILTER_MAXWORDS &&
+	    (words[nwords] = strsep(&s, " ")) != NULL) {
+		if (*words[nwords] != '\0')
+			nwords++;
+	}
+
+	all = !narrow || !f->matched;
+	for (i = 0; i < nwords; ++i) {
+		match_word(f, words[i], all, i == 0);
+		all = 0;
+	}
+
+	if (all) {
+		for (i = 0; i < f->len; ++i)
+			f->res[i] = i;
+		f->nres = f->len;
+	}
+
+	f->ntop = 0;
+	if ((f->flags & FILTER_FUZZY) && nwords > 0)
+		rank(f);
+
+	f->matched = 1;
+	free(q);
+	return f->nres;
+}
+
+/*
+ * Return the ordered ids of the candidates matched by the last call
+ * to filter_match.
+ */
+const uint32_t *
+filter_result(struct filter *f, size_t *len)
+{
+	*len = f->nres;
+	return f->res;
+}
+
+/*
+ * Return the best matches of the last call to filter_match in fuzzy
+ * mode, best first.  Nothing is ranked when the query is empty.
+ */
+const uint32_t *
+filter_ranked(struct filter *f, size_t *len)
+{
+	*len = f->ntop;
+	return f->top;
+}
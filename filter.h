@@ -0,0 +1,29 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+struct filter;
+
+#define FILTER_FUZZY	0x1
+
+struct filter	*filter_new(int);
+void		 filter_free(struct filter *);
+void		 filter_add(struct filter *, const char *, const char *, void *);
+size_t		 filter_len(struct filter *);
+void		*filter_data(struct filter *, uint32_t);
+
+size_t		 filter_match(struct filter *, const char *, int);
+const uint32_t	*filter_result(struct filter *, size_t *);
+const uint32_t	*filter_ranked(struct filter *, size_t *);
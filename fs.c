@@ -20,6 +20,7 @@
 
 #include "compat.h"
 
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -27,16 +28,21 @@
 #include <errno.h>
 #include <limits.h>
 #include <libgen.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "ev.h"
+#include "iri.h"
 #include "pages.h"
 #include "parser.h"
 #include "telescope.h"
 #include "session.h"
+#include "ui.h"
 #include "utils.h"
+#include "xwrapper.h"
 
 #include "fs.h"
 
@@ -44,12 +50,48 @@
 #define nitems(x)  (sizeof(x) / sizeof(x[0]))
 #endif
 
-static int		 select_non_dot(const struct dirent *);
-static int		 select_non_dotdot(const struct dirent *);
+/*
+ * Local files are mapped and parsed LOAD_BATCH bytes at a time: the
+ * first batch right away, so that there's something to show, and the
+ * rest when idle.  Directories are read DIR_BATCH entries at a time
+ * and, once sorted, listed in batches of the same size.  Pipes are
+ * parsed as the data comes in, up to LOAD_BATCH bytes per read.
+ */
+#define LOAD_BATCH	(256 * 1024)
+#define DIR_BATCH	1024
+
+struct fs_load {
+	TAILQ_ENTRY(fs_load)	 loads;
+	struct tab		*tab;
+	int			(*batch)(struct fs_load *);
+	unsigned int		 idle;
+	int			 fd;		/* pipes only */
+
+	/* files */
+	char			*map;
+	size_t			 len;
+	size_t			 off;
+
+	/* directories: every name is preceded by its suffix */
+	DIR			*dir;
+	int			 root;
+	char			*names;
+	size_t			 nameslen;
+	size_t			 namescap;
+	size_t			*offs;
+	char			**ents;
+	size_t			 nents;
+	size_t			 entscap;
+	size_t			 next;
+};
+
+static TAILQ_HEAD(, fs_load) loads = TAILQ_HEAD_INITIALIZER(loads);
+
 static size_t		 join_path(char*, const char*, const char*, size_t);
 static void		 getenv_default(char*, const char*, const char*, size_t);
 static void		 mkdirs(const char*, mode_t);
 static void		 init_paths(void);
+static int		 load_start(struct fs_load *);
 
 /*
  * Where to store user data.  These are all equal to ~/.telescope if
@@ -66,31 +108,116 @@ char		bookmark_file[PATH_MAX];
 char		known_hosts_file[PATH_MAX], known_hosts_tmp[PATH_MAX];
 char		crashed_file[PATH_MAX];
 char		session_file[PATH_MAX], session_file_tmp[PATH_MAX];
+char		session_journal_file[PATH_MAX];
+char		session_bin_file[PATH_MAX], session_bin_file_tmp[PATH_MAX];
 char		history_file[PATH_MAX], history_file_tmp[PATH_MAX];
 char		cert_dir[PATH_MAX], cert_dir_tmp[PATH_MAX];
 char		certs_file[PATH_MAX], certs_file_tmp[PATH_MAX];
+char		pagecache_file[PATH_MAX], pagecache_file_tmp[PATH_MAX];
+char		config_snap_file[PATH_MAX], config_snap_file_tmp[PATH_MAX];
+char		redirects_file[PATH_MAX], redirects_file_tmp[PATH_MAX];
+char		fulltext_file[PATH_MAX], fulltext_file_tmp[PATH_MAX];
+char		fulltext_docs_file[PATH_MAX];
+char		feeds_file[PATH_MAX], feeds_file_tmp[PATH_MAX];
+char		feeds_state_file[PATH_MAX], feeds_state_file_tmp[PATH_MAX];
+char		mirror_dir[PATH_MAX];
 
 char		cwd[PATH_MAX];
 
-static int
-select_non_dot(const struct dirent *d)
+static void
+dir_push(struct fs_load *l, struct dirent *d)
 {
-	return strcmp(d->d_name, ".");
+	size_t	 len, cap;
+
+	len = strlen(d->d_name);
+	if (l->namescap - l->nameslen < len + 2) {
+		cap = (l->namescap + len + 2) * 1.5;
+		l->names = xrealloc(l->names, cap);
+		l->namescap = cap;
+	}
+
+	if (l->nents == l->entscap) {
+		cap = l->entscap * 1.5 + 64;
+		l->offs = xreallocarray(l->offs, cap, sizeof(*l->offs));
+		l->entscap = cap;
+	}
+
+	l->names[l->nameslen++] = d->d_type == DT_DIR ? '/' : '\0';
+	l->offs[l->nents++] = l->nameslen;
+	memcpy(l->names + l->nameslen, d->d_name, len + 1);
+	l->nameslen += len + 1;
 }
 
 static int
-select_non_dotdot(const struct dirent *d)
+dir_cmp(const void *a, const void *b)
 {
-	return strcmp(d->d_name, ".") && strcmp(d->d_name, "..");
+	const char * const	*x = a, * const *y = b;
+
+	return strcoll(*x, *y);
 }
 
 static void
+dir_sort(struct fs_load *l)
+{
+	size_t	 i;
+
+	/* the directory may have been emptied or removed meanwhile */
+	if (l->nents == 0)
+		return;
+
+	l->ents = xcalloc(l->nents, sizeof(*l->ents));
+	for (i = 0; i < l->nents; ++i)
+		l->ents[i] = l->names + l->offs[i];
+	free(l->offs);
+	l->offs = NULL;
+
+	qsort(l->ents, l->nents, sizeof(*l->ents), dir_cmp);
+}
+
+/*
+ * Read the next batch of entries or, once they're all read and
+ * sorted, list the next batch of them.
+ */
+static int
+dir_batch(struct fs_load *l)
+{
+	struct buffer	*buffer = &l->tab->buffer;
+	struct dirent	*d;
+	const char	*name;
+	size_t		 i;
+
+	for (i = 0; l->dir != NULL && i < DIR_BATCH; ++i) {
+		if ((d = readdir(l->dir)) == NULL) {
+			closedir(l->dir);
+			l->dir = NULL;
+			dir_sort(l);
+			break;
+		}
+
+		if (!strcmp(d->d_name, ".") ||
+		    (l->root && !strcmp(d->d_name, "..")))
+			continue;
+		dir_push(l, d);
+	}
+
+	if (l->dir != NULL)
+		return 1;
+
+	for (i = 0; l->next < l->nents && i < DIR_BATCH; ++i) {
+		name = l->ents[l->next++];
+		parser_parsef(buffer, "=> %s%s\n", name,
+		    name[-1] == '/' ? "/" : "");
+	}
+
+	return l->next != l->nents;
+}
+
+static int
 send_dir(struct tab *tab, const char *path)
 {
 	struct buffer	*buffer = &tab->buffer;
-	struct dirent	**names;
-	int		(*selector)(const struct dirent *) = select_non_dot;
-	int		  i, len;
+	struct fs_load	*l;
+	DIR		*dir;
 
 #if notyet
 	/*
@@ -105,28 +232,21 @@ send_dir(struct tab *tab, const char *path)
 	}
 #endif
 
-	if (!strcmp(path, "/"))
-		selector = select_non_dotdot;
-
-	if ((len = scandir(path, &names, selector, alphasort)) == -1) {
+	if ((dir = opendir(path)) == NULL) {
 		load_page_from_str(tab, "# failure reading the directory\n");
-		return;
+		return 0;
 	}
 
 	parser_init(buffer, &gemtext_parser);
 	parser_parsef(buffer, "# Index of %s\n\n", path);
 
-	for (i = 0; i < len; ++i) {
-		const char *sufx = "";
-
-		if (names[i]->d_type == DT_DIR)
-			sufx = "/";
-
-		parser_parsef(buffer, "=> %s%s\n", names[i]->d_name, sufx);
-	}
-
-	parser_free(tab);
-	free(names);
+	l = xcalloc(1, sizeof(*l));
+	l->tab = tab;
+	l->fd = -1;
+	l->batch = dir_batch;
+	l->dir = dir;
+	l->root = !strcmp(path, "/");
+	return load_start(l);
 }
 
 static int
@@ -169,27 +289,156 @@ file_type(const char *path)
 	return &textplain_parser;
 }
 
-void
+/*
+ * Parse the next batch of the file: return 0 when it's done, either
+ * because it reached the end or because the parser failed.
+ */
+static int
+file_batch(struct fs_load *l)
+{
+	size_t	 len;
+
+	len = l->len - l->off;
+	if (len > LOAD_BATCH)
+		len = LOAD_BATCH;
+
+	if (!parser_parse(&l->tab->buffer, l->map + l->off, len))
+		return 0;
+	l->off += len;
+	return l->off != l->len;
+}
+
+static void
+load_done(struct fs_load *l)
+{
+	TAILQ_REMOVE(&loads, l, loads);
+	ev_idle_cancel(l->idle);
+	if (l->map != NULL)
+		munmap(l->map, l->len);
+	if (l->dir != NULL)
+		closedir(l->dir);
+	if (l->fd != -1) {
+		ev_del(l->fd);
+		close(l->fd);
+	}
+	free(l->names);
+	free(l->offs);
+	free(l->ents);
+	parser_free(l->tab);
+	free(l);
+}
+
+static void
+load_idle(int fd, int ev, void *d)
+{
+	struct fs_load	*l = d;
+	struct tab	*tab = l->tab;
+
+	if (l->batch(l)) {
+		l->idle = ev_idle(load_idle, l);
+		ui_on_tab_refresh(tab);
+		return;
+	}
+
+	load_done(l);
+	ui_on_tab_refresh(tab);
+	ui_on_tab_loaded(tab);
+}
+
+static void
+load_read(int fd, int ev, void *d)
+{
+	static char	 buf[LOAD_BATCH];
+	struct fs_load	*l = d;
+	struct tab	*tab = l->tab;
+	ssize_t		 r;
+
+	if ((r = read(fd, buf, sizeof(buf))) == -1 &&
+	    (errno == EAGAIN || errno == EINTR))
+		return;
+
+	if (r > 0 && parser_parse(&tab->buffer, buf, r)) {
+		ui_on_tab_refresh(tab);
+		return;
+	}
+
+	load_done(l);
+	ui_on_tab_refresh(tab);
+	ui_on_tab_loaded(tab);
+}
+
+/*
+ * Do the first batch of the load and leave the rest for later.
+ * Return 1 if there's more to do, 0 if it's all done.
+ */
+static int
+load_start(struct fs_load *l)
+{
+	TAILQ_INSERT_TAIL(&loads, l, loads);
+
+	if (l->batch(l)) {
+		l->idle = ev_idle(load_idle, l);
+		return 1;
+	}
+
+	load_done(l);
+	return 0;
+}
+
+/*
+ * Start parsing the file in the tab.  Return 1 if it continues in
+ * background, 0 if it's already done and -1 if it can't be mapped.
+ */
+static int
+load_file(struct tab *tab, FILE *fp)
+{
+	struct fs_load	*l;
+	struct stat	 sb;
+	void		*map;
+
+	if (fstat(fileno(fp), &sb) == -1 || !S_ISREG(sb.st_mode) ||
+	    sb.st_size == 0 || (uintmax_t)sb.st_size > SIZE_MAX)
+		return -1;
+
+	map = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+	if (map == MAP_FAILED)
+		return -1;
+	posix_madvise(map, sb.st_size, POSIX_MADV_SEQUENTIAL);
+
+	l = xcalloc(1, sizeof(*l));
+	l->tab = tab;
+	l->fd = -1;
+	l->batch = file_batch;
+	l->map = map;
+	l->len = sb.st_size;
+	return load_start(l);
+}
+
+/*
+ * Load the given about: or file: URL in the tab.  Return 1 if the
+ * file, or directory, is still being loaded: the tab is then
+ * refreshed as it goes and marked as loaded at the end, unless it's
+ * stopped before.
+ */
+int
 fs_load_url(struct tab *tab, const char *url)
 {
-	const char		*bpath = "bookmarks.gmi", *fallback = "# Not found\n";
 	const struct parser	*parser = &gemtext_parser;
 	char			 path[PATH_MAX];
 	FILE			*fp = NULL;
 	size_t			 i;
+	int			 ret = 0;
 	char			 buf[BUFSIZ];
 	struct page {
-		const char	*name;
-		const char	*path;
-		const uint8_t	*data;
+		const char		*name;
+		const struct page_lines	*lines;
 	} pages[] = {
-		{"about",	NULL,	about_about},
-		{"blank",	NULL,	about_blank},
-		{"bookmarks",	bpath,	bookmarks},
-		{"crash",	NULL,	about_crash},
-		{"help",	NULL,	about_help},
-		{"license",	NULL,	about_license},
-		{"new",		NULL,	about_new},
+		{"about",	&about_about_lines},
+		{"blank",	&about_blank_lines},
+		{"crash",	&about_crash_lines},
+		{"help",	&about_help_lines},
+		{"license",	&about_license_lines},
+		{"new",		&about_new_lines},
 	}, *page = NULL;
 
 	if (!strncmp(url, "about:", 6)) {
@@ -204,16 +453,9 @@ fs_load_url(struct tab *tab, const char *url)
 			goto done;
 
 		strlcpy(path, data_path_base, sizeof(path));
-		strlcat(path, "/", sizeof(path));
-		if (page->path != NULL)
-			strlcat(path, page->path, sizeof(path));
-		else {
-			strlcat(path, "page/about_", sizeof(path));
-			strlcat(path, page->name, sizeof(path));
-			strlcat(path, ".gmi", sizeof(path));
-		}
-
-		fallback = page->data;
+		strlcat(path, "/page/about_", sizeof(path));
+		strlcat(path, page->name, sizeof(path));
+		strlcat(path, ".gmi", sizeof(path));
 	} else if (!strncmp(url, "file://", 7)) {
 		url += 7;
 		strlcpy(path, url, sizeof(path));
@@ -225,11 +467,16 @@ fs_load_url(struct tab *tab, const char *url)
 		goto done;
 
 	if (is_dir(fp)) {
-		send_dir(tab, path);
+		ret = send_dir(tab, path);
 		goto done;
 	}
 
 	parser_init(&tab->buffer, parser);
+	if ((ret = load_file(tab, fp)) != -1)
+		goto done;
+
+	/* not a regular file, or empty */
+	ret = 0;
 	for (;;) {
 		size_t r;
 
@@ -244,8 +491,58 @@ fs_load_url(struct tab *tab, const char *url)
 done:
 	if (fp != NULL)
 		fclose(fp);
-	else
-		load_page_from_str(tab, fallback);
+	else if (page != NULL) {
+		/* no copy of the user, show the bundled one */
+		if (!gemtext_load_lines(tab, page->lines))
+			abort();
+		ui_on_tab_refresh(tab);
+		ui_on_tab_loaded(tab);
+	} else
+		load_page_from_str(tab, "# Not found\n");
+	return ret;
+}
+
+/*
+ * Show in the tab, as plain text, what's read from the non-blocking
+ * fd until its end.  The fd is closed then, or once the tab stops.
+ */
+void
+fs_load_fd(struct tab *tab, int fd)
+{
+	struct fs_load	*l;
+
+	parser_init(&tab->buffer, &textplain_parser);
+
+	l = xcalloc(1, sizeof(*l));
+	l->tab = tab;
+	l->fd = fd;
+	TAILQ_INSERT_TAIL(&loads, l, loads);
+
+	if (ev_add(fd, EV_READ, load_read, l) == -1) {
+		load_done(l);
+		ui_on_tab_refresh(tab);
+		ui_on_tab_loaded(tab);
+		return;
+	}
+
+	start_loading_anim(tab);
+}
+
+/*
+ * Stop parsing the file in the tab, if any: what was parsed so far
+ * is kept.
+ */
+void
+fs_stop(struct tab *tab)
+{
+	struct fs_load	*l;
+
+	TAILQ_FOREACH(l, &loads, loads) {
+		if (l->tab == tab) {
+			load_done(l);
+			return;
+		}
+	}
 }
 
 static size_t
@@ -366,6 +663,12 @@ fs_init(void)
 	    sizeof(session_file));
 	join_path(session_file_tmp, cache_path_base, "/session.XXXXXXXXXX",
 	    sizeof(session_file_tmp));
+	join_path(session_journal_file, cache_path_base, "/session.journal",
+	    sizeof(session_journal_file));
+	join_path(session_bin_file, cache_path_base, "/session.bin",
+	    sizeof(session_bin_file));
+	join_path(session_bin_file_tmp, cache_path_base,
+	    "/session.bin.XXXXXXXXXX", sizeof(session_bin_file_tmp));
 	join_path(history_file, cache_path_base, "/history",
 	    sizeof(history_file));
 	join_path(history_file_tmp, cache_path_base, "/history.XXXXXXXXXX",
@@ -380,8 +683,212 @@ fs_init(void)
 	    sizeof(certs_file_tmp));
 	join_path(crashed_file, cache_path_base, "/crashed",
 	    sizeof(crashed_file));
+	join_path(pagecache_file, cache_path_base, "/pages",
+	    sizeof(pagecache_file));
+	join_path(pagecache_file_tmp, cache_path_base, "/pages.XXXXXXXXXX",
+	    sizeof(pagecache_file_tmp));
+	join_path(config_snap_file, cache_path_base, "/config.snap",
+	    sizeof(config_snap_file));
+	join_path(config_snap_file_tmp, cache_path_base,
+	    "/config.snap.XXXXXXXXXX", sizeof(config_snap_file_tmp));
+	join_path(redirects_file, cache_path_base, "/redirects",
+	    sizeof(redirects_file));
+	join_path(redirects_file_tmp, cache_path_base,
+	    "/redirects.XXXXXXXXXX", sizeof(redirects_file_tmp));
+	join_path(fulltext_file, cache_path_base, "/fulltext",
+	    sizeof(fulltext_file));
+	join_path(fulltext_file_tmp, cache_path_base,
+	    "/fulltext.XXXXXXXXXX", sizeof(fulltext_file_tmp));
+	join_path(fulltext_docs_file, cache_path_base, "/fulltext.docs",
+	    sizeof(fulltext_docs_file));
+	join_path(feeds_file, data_path_base, "/feeds",
+	    sizeof(feeds_file));
+	join_path(feeds_file_tmp, data_path_base, "/feeds.XXXXXXXXXX",
+	    sizeof(feeds_file_tmp));
+	join_path(feeds_state_file, cache_path_base, "/feeds.state",
+	    sizeof(feeds_state_file));
+	join_path(feeds_state_file_tmp, cache_path_base,
+	    "/feeds.state.XXXXXXXXXX", sizeof(feeds_state_file_tmp));
+	join_path(mirror_dir, data_path_base, "/mirror/",
+	    sizeof(mirror_dir));
 
 	mkdirs(cert_dir, S_IRWXU);
 
 	return 0;
 }
+
+/*
+ * Where the page at iri is kept in the mirror: the path of the URL
+ * under a directory named after the host, with an index file for the
+ * directories and the extension of its type, so that it's parsed the
+ * same way when loaded back.
+ */
+static int
+mirror_file(const struct iri *iri, int gemtext, char *buf, size_t len)
+{
+	const char	*host = iri->iri_host, *path = iri->iri_path;
+	const char	*ext, *port, *s;
+	size_t		 plen, slen;
+
+	/* the host is a directory too, and "." and ".." are valid ones */
+	if (*host == '\0' || !strcmp(host, ".") || !strcmp(host, ".."))
+		return -1;
+
+	/* dot segments are already resolved, just in case */
+	for (s = path; *s != '\0'; s += slen) {
+		s += strspn(s, "/");
+		slen = strcspn(s, "/");
+		if ((slen == 1 && s[0] == '.') ||
+		    (slen == 2 && s[0] == '.' && s[1] == '.'))
+			return -1;
+	}
+
+	port = iri->iri_portstr;
+	if (*port == '\0' || !strcmp(port, "1965"))
+		port = NULL;
+
+	path += strspn(path, "/");
+	plen = strlen(path);
+	ext = gemtext ? ".gmi" : ".txt";
+	if (plen >= 4 && !strcmp(path + plen - 4, ext))
+		ext = "";
+	else if (gemtext && plen >= 7 && !strcmp(path + plen - 7, ".gemini"))
+		ext = "";
+
+	if ((size_t)snprintf(buf, len, "%s%s%s%s/%s%s%s", mirror_dir,
+	    host, port != NULL ? ":" : "", port != NULL ? port : "",
+	    path, plen == 0 || path[plen - 1] == '/' ? "index" : "",
+	    ext) >= len)
+		return -1;
+	return 0;
+}
+
+/* whether the file at path has exactly the len bytes of buf */
+static int
+same_file(const char *path, const char *buf, size_t len)
+{
+	FILE		*fp;
+	struct stat	 sb;
+	char		 chunk[BUFSIZ];
+	size_t		 off = 0, r;
+	int		 same = 0;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		return 0;
+	if (fstat(fileno(fp), &sb) == -1 || !S_ISREG(sb.st_mode) ||
+	    (size_t)sb.st_size != len)
+		goto done;
+
+	while ((r = fread(chunk, 1, sizeof(chunk), fp)) != 0) {
+		if (off + r > len || memcmp(buf + off, chunk, r) != 0)
+			goto done;
+		off += r;
+	}
+	same = off == len;
+
+done:
+	fclose(fp);
+	return same;
+}
+
+/*
+ * Save the page of buffer, loaded from iri, in the mirror unless it's
+ * already there as it is.  Returns 1 if it was saved, 0 if it didn't
+ * change and -1 if it can't be mirrored.
+ */
+int
+fs_mirror_save(struct buffer *buffer, const struct iri *iri)
+{
+	FILE		*fp;
+	char		 path[PATH_MAX], tmp[PATH_MAX], dir[PATH_MAX];
+	char		*buf = NULL;
+	size_t		 len = 0;
+	int		 fd, r = -1;
+
+	if (buffer->parser != &gemtext_parser &&
+	    buffer->parser != &textplain_parser)
+		return -1;
+	if (mirror_file(iri, buffer->parser == &gemtext_parser, path,
+	    sizeof(path)) == -1)
+		return -1;
+
+	if ((fp = open_memstream(&buf, &len)) == NULL)
+		return -1;
+	if (!parser_serialize(buffer, fp)) {
+		fclose(fp);
+		goto done;
+	}
+	if (fclose(fp) == EOF)
+		goto done;
+
+	if (same_file(path, buf, len)) {
+		r = 0;
+		goto done;
+	}
+
+	strlcpy(dir, path, sizeof(dir));
+	mkdirs(dirname(dir), S_IRWXU);
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.XXXXXXXXXX", path) >=
+	    sizeof(tmp) || (fd = mkstemp(tmp)) == -1)
+		goto done;
+	if ((fp = fdopen(fd, "w")) == NULL) {
+		close(fd);
+		unlink(tmp);
+		goto done;
+	}
+	if (fwrite(buf, 1, len, fp) != len || fclose(fp) == EOF ||
+	    rename(tmp, path) == -1) {
+		unlink(tmp);
+		goto done;
+	}
+	r = 1;
+
+done:
+	free(buf);
+	return r;
+}
+
+/* find the copy of the page at iri in the mirror */
+static int
+mirror_lookup(const struct iri *iri, char *path, size_t len)
+{
+	struct stat	 sb;
+	int		 gemtext;
+
+	if (strcmp(iri->iri_scheme, "gemini") != 0 ||
+	    *iri->iri_query != '\0')
+		return -1;
+
+	for (gemtext = 1; gemtext >= 0; --gemtext) {
+		if (mirror_file(iri, gemtext, path, len) == -1)
+			return -1;
+		if (stat(path, &sb) == 0 && S_ISREG(sb.st_mode))
+			return 0;
+	}
+	return -1;
+}
+
+int
+fs_mirror_has(const struct iri *iri)
+{
+	char		 path[PATH_MAX];
+
+	return mirror_lookup(iri, path, sizeof(path)) == 0;
+}
+
+/*
+ * Load the copy of the page of tab in the mirror, if there's one.
+ * Returns -1 if there isn't, otherwise as fs_load_url.
+ */
+int
+fs_mirror_load(struct tab *tab)
+{
+	char		 path[PATH_MAX], url[PATH_MAX + 7];
+
+	if (mirror_lookup(tab->iri, path, sizeof(path)) == -1)
+		return -1;
+
+	snprintf(url, sizeof(url), "file://%s", path);
+	return fs_load_url(tab, url);
+}
@@ -17,6 +17,8 @@
 #ifndef FS_H
 #define FS_H
 
+struct buffer;
+struct iri;
 struct tab;
 struct tofu_entry;
 
@@ -31,13 +33,28 @@ extern char	bookmark_file[PATH_MAX];
 extern char	known_hosts_file[PATH_MAX], known_hosts_tmp[PATH_MAX];
 extern char	crashed_file[PATH_MAX];
 extern char	session_file[PATH_MAX], session_file_tmp[PATH_MAX];
+extern char	session_journal_file[PATH_MAX];
+extern char	session_bin_file[PATH_MAX], session_bin_file_tmp[PATH_MAX];
 extern char	history_file[PATH_MAX], history_file_tmp[PATH_MAX];
 extern char	cert_dir[PATH_MAX], cert_dir_tmp[PATH_MAX];
 extern char	certs_file[PATH_MAX], certs_file_tmp[PATH_MAX];
+extern char	pagecache_file[PATH_MAX], pagecache_file_tmp[PATH_MAX];
+extern char	config_snap_file[PATH_MAX], config_snap_file_tmp[PATH_MAX];
+extern char	redirects_file[PATH_MAX], redirects_file_tmp[PATH_MAX];
+extern char	fulltext_file[PATH_MAX], fulltext_file_tmp[PATH_MAX];
+extern char	fulltext_docs_file[PATH_MAX];
+extern char	feeds_file[PATH_MAX], feeds_file_tmp[PATH_MAX];
+extern char	feeds_state_file[PATH_MAX], feeds_state_file_tmp[PATH_MAX];
+extern char	mirror_dir[PATH_MAX];
 
 extern char	cwd[PATH_MAX];
 
 int		 fs_init(void);
-void		 fs_load_url(struct tab *, const char *);
+int		 fs_load_url(struct tab *, const char *);
+void		 fs_load_fd(struct tab *, int);
+void		 fs_stop(struct tab *);
+int		 fs_mirror_save(struct buffer *, const struct iri *);
+int		 fs_mirror_has(const struct iri *);
+int		 fs_mirror_load(struct tab *);
 
 #endif
@@ -0,0 +1,802 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * A full-text index of the visited pages, to find them again by the
+ * words they contain.  Every page loaded is given a number and
+ * appended to the docs file, one "url\ttitle" line per page, so that
+ * the number is its line; visiting a page again gives it a new number
+ * and makes the old one stale.
+ *
+ * The words of the pages are kept in memory and, every FT_FLUSH pages
+ * and at exit, merged into the index file: a sorted table of the
+ * words pointing to their lists of pages, encoded as the varint of
+ * the distance from the previous page followed by the varint of how
+ * many times the word is there.  A query only has to search the table
+ * and walk the lists of the words it's made of, the rarest first.
+ *
+ * The pages still in memory are lost on a crash: they are in the
+ * docs file, but can't be found.
+ */
+
+#include "compat.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "fs.h"
+#include "ftindex.h"
+#include "hist.h"
+#include "persist.h"
+#include "telescope.h"
+#include "utils.h"
+#include "xwrapper.h"
+
+#define FT_MAGIC	"TSFTIDX1"
+#define FT_MINTERM	2
+#define FT_MAXTERM	32
+#define FT_MAXQUERY	8
+#define FT_MAXTEXT	(512 * 1024)	/* indexed of every page */
+#define FT_FLUSH	256		/* pages kept in memory */
+#define FT_RESULTS	100
+
+struct ft_header {
+	char		 magic[8];
+	uint32_t	 ndocs;
+	uint32_t	 nterms;
+};
+
+/* the table of the index file */
+struct ft_entry {
+	uint32_t	 str;		/* offset of the word */
+	uint32_t	 df;		/* pages that have it */
+	uint32_t	 last;		/* the last of them */
+	uint32_t	 postlen;
+	uint64_t	 post;		/* offset of the list */
+};
+
+/* a word of the pages still in memory */
+struct ft_term {
+	uint8_t		*post;
+	size_t		 len;
+	size_t		 cap;
+	uint32_t	 df;
+	uint32_t	 last;
+	uint32_t	 doc;		/* of the page being indexed */
+	uint32_t	 tf;
+	char		 term[];
+};
+
+struct ft_url {
+	uint32_t	 doc;
+	char		 url[];
+};
+
+struct ft_doc {
+	const char	*url;
+	char		*title;
+	int		 stale;
+};
+
+static int		 initialized;
+
+static struct ft_doc	*docs;
+static size_t		 ndocs;
+static size_t		 docscap;
+static struct ohash	 urls;
+
+/* the index file */
+static uint8_t		*seg;
+static size_t		 seglen;
+static int		 segmapped;
+static struct ft_entry	*ents;
+static uint32_t		 nents;
+
+static struct ohash	 pending;
+static size_t		 npending;
+static struct ft_term	**touched;
+static size_t		 ntouched;
+static size_t		 touchedcap;
+
+static struct ft_result	 results[FT_RESULTS + 1];
+
+static void
+ft_hash_init(struct ohash *h, ptrdiff_t off)
+{
+	struct ohash_info info = {
+		.key_offset = off,
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	ohash_init(h, 10, &info);
+}
+
+/* a new number for url, making the previous one stale */
+static uint32_t
+ft_new_doc(const char *url, const char *title)
+{
+	struct ft_url	*u;
+	unsigned int	 slot;
+	size_t		 len;
+
+	if (ndocs == docscap) {
+		docscap = docscap == 0 ? 1024 : docscap * 2;
+		docs = xreallocarray(docs, docscap, sizeof(*docs));
+	}
+
+	slot = ohash_qlookup(&urls, url);
+	if ((u = ohash_find(&urls, slot)) != NULL)
+		docs[u->doc].stale = 1;
+	else {
+		len = strlen(url) + 1;
+		u = xmalloc(sizeof(*u) + len);
+		memcpy(u->url, url, len);
+		ohash_insert(&urls, slot, u);
+	}
+	u->doc = ndocs;
+
+	docs[ndocs].url = u->url;
+	docs[ndocs].title = xstrdup(title);
+	docs[ndocs].stale = 0;
+	return ndocs++;
+}
+
+static void
+ft_load_docs(void)
+{
+	FILE		*fp;
+	size_t		 linesize = 0;
+	ssize_t		 linelen;
+	char		*line = NULL, *title;
+
+	if ((fp = fopen(fulltext_docs_file, "r")) == NULL)
+		return;
+
+	while ((linelen = getline(&line, &linesize, fp)) != -1) {
+		if (line[linelen - 1] == '\n')
+			line[linelen - 1] = '\0';
+		if ((title = strchr(line, '\t')) != NULL)
+			*title++ = '\0';
+		ft_new_doc(line, title != NULL ? title : "");
+	}
+
+	fclose(fp);
+	free(line);
+}
+
+static void
+ft_drop_seg(void)
+{
+	if (segmapped)
+		munmap(seg, seglen);
+	else
+		free(seg);
+	seg = NULL;
+	seglen = 0;
+	segmapped = 0;
+	ents = NULL;
+	nents = 0;
+}
+
+/* use the index in buf, if it looks fine */
+static int
+ft_use_seg(uint8_t *buf, size_t len, int mapped)
+{
+	struct ft_header	 h;
+	struct ft_entry		*e;
+	uint32_t		 i;
+
+	if (len < sizeof(h))
+		return -1;
+	memcpy(&h, buf, sizeof(h));
+	if (memcmp(h.magic, FT_MAGIC, sizeof(h.magic)) != 0 ||
+	    h.ndocs > ndocs ||
+	    (len - sizeof(h)) / sizeof(*e) < h.nterms)
+		return -1;
+
+	e = (struct ft_entry *)(buf + sizeof(h));
+	for (i = 0; i < h.nterms; ++i) {
+		if (e[i].str >= len ||
+		    memchr(buf + e[i].str, '\0', len - e[i].str) == NULL ||
+		    e[i].post > len || e[i].postlen > len - e[i].post)
+			return -1;
+	}
+
+	ft_drop_seg();
+	seg = buf;
+	seglen = len;
+	segmapped = mapped;
+	ents = e;
+	nents = h.nterms;
+	return 0;
+}
+
+static void
+ft_load_seg(void)
+{
+	struct stat	 sb;
+	void		*p;
+	int		 fd;
+
+	if ((fd = open(fulltext_file, O_RDONLY)) == -1)
+		return;
+	if (fstat(fd, &sb) == -1 || sb.st_size == 0 ||
+	    (uint64_t)sb.st_size > SIZE_MAX) {
+		close(fd);
+		return;
+	}
+
+	p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+		return;
+	if (ft_use_seg(p, sb.st_size, 1) == -1)
+		munmap(p, sb.st_size);
+}
+
+static void
+ft_init(void)
+{
+	if (initialized)
+		return;
+	initialized = 1;
+
+	ft_hash_init(&urls, offsetof(struct ft_url, url));
+	ft_hash_init(&pending, offsetof(struct ft_term, term));
+	ft_load_docs();
+	ft_load_seg();
+}
+
+static inline int
+ft_isword(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+	    (c >= '0' && c <= '9') || c >= 0x80;
+}
+
+/*
+ * Copy in buf the next word of *s, lowercased, and return its
+ * length, or 0 at the end.  The longer words are cut at FT_MAXTERM
+ * bytes, without keeping half a codepoint.
+ */
+static size_t
+ft_next_term(const char **s, char *buf)
+{
+	const unsigned char	*p = (const unsigned char *)*s;
+	size_t			 len;
+
+	for (;;) {
+		while (*p != '\0' && !ft_isword(*p))
+			p++;
+		if (*p == '\0') {
+			*s = (const char *)p;
+			return 0;
+		}
+
+		for (len = 0; len < FT_MAXTERM && ft_isword(*p); ++p)
+			buf[len++] = *p >= 'A' && *p <= 'Z' ? *p + 32 : *p;
+		if (len == FT_MAXTERM && (*p & 0xC0) == 0x80) {
+			while (len > 0 && (buf[len - 1] & 0xC0) == 0x80)
+				len--;
+			if (len > 0)
+				len--;
+		}
+		while (ft_isword(*p))
+			p++;
+
+		if (len >= FT_MINTERM) {
+			buf[len] = '\0';
+			*s = (const char *)p;
+			return len;
+		}
+	}
+}
+
+static size_t
+ft_put_varint(uint8_t *p, uint32_t n)
+{
+	size_t	 len = 0;
+
+	while (n >= 0x80) {
+		p[len++] = 0x80 | (n & 0x7F);
+		n >>= 7;
+	}
+	p[len++] = n;
+	return len;
+}
+
+static void
+ft_post(struct ft_term *t, uint32_t doc)
+{
+	if (t->cap - t->len < 10) {
+		t->cap = t->cap == 0 ? 16 : t->cap * 2;
+		t->post = xrealloc(t->post, t->cap);
+	}
+
+	t->len += ft_put_varint(t->post + t->len,
+	    t->df == 0 ? doc : doc - t->last);
+	t->len += ft_put_varint(t->post + t->len, t->tf);
+	t->last = doc;
+	t->df++;
+}
+
+static int
+ft_unvarint(const uint8_t **p, const uint8_t *end, uint32_t *n)
+{
+	unsigned int	 shift;
+
+	*n = 0;
+	for (shift = 0; *p < end && shift < 32; shift += 7) {
+		*n |= (uint32_t)(**p & 0x7F) << shift;
+		if (!(*(*p)++ & 0x80))
+			return 1;
+	}
+	return 0;
+}
+
+static struct ft_term *
+ft_pending_term(const char *term, int create)
+{
+	struct ft_term	*t;
+	unsigned int	 slot;
+	size_t		 len;
+
+	slot = ohash_qlookup(&pending, term);
+	if ((t = ohash_find(&pending, slot)) != NULL || !create)
+		return t;
+
+	len = strlen(term) + 1;
+	t = xcalloc(1, sizeof(*t) + len);
+	memcpy(t->term, term, len);
+	t->doc = UINT32_MAX;
+	ohash_insert(&pending, slot, t);
+	return t;
+}
+
+/* the title is kept on one line of the docs file */
+static void
+ft_print_doc(FILE *fp, const char *url, const char *title)
+{
+	fputs(url, fp);
+	fputc('\t', fp);
+	for (; *title != '\0'; ++title)
+		fputc(*title == '\t' || *title == '\n' ? ' ' : *title, fp);
+	fputc('\n', fp);
+}
+
+void
+ftindex_tab(struct tab *tab)
+{
+	struct pfile	 pf;
+	struct ft_term	*t;
+	struct line	*l;
+	const char	*url, *s;
+	char		 term[FT_MAXTERM + 1];
+	size_t		 i, total = 0;
+	uint32_t	 doc;
+
+	/* like the mcache, persist nothing got with a client certificate */
+	if (!fulltext_index || safe_mode || tab->code != 20 ||
+	    tab->client_cert != NULL)
+		return;
+
+	ft_init();
+
+	url = hist_cur(tab->hist);
+	doc = ft_new_doc(url, tab->buffer.title);
+	if (persist_open(&pf, fulltext_docs_file, NULL,
+	    PERSIST_APPEND) == 0) {
+		ft_print_doc(pf.fp, url, docs[doc].title);
+		persist_close(&pf);
+	}
+
+	ntouched = 0;
+	TAILQ_FOREACH(l, &tab->buffer.head, lines) {
+		if ((s = l->line) == NULL)
+			continue;
+		if ((total += strlen(s)) > FT_MAXTEXT)
+			break;
+
+		while (ft_next_term(&s, term) != 0) {
+			t = ft_pending_term(term, 1);
+			if (t->doc != doc) {
+				t->doc = doc;
+				t->tf = 0;
+				if (ntouched == touchedcap) {
+					touchedcap = touchedcap == 0 ? 512 :
+					    touchedcap * 2;
+					touched = xreallocarray(touched,
+					    touchedcap, sizeof(*touched));
+				}
+				touched[ntouched++] = t;
+			}
+			t->tf++;
+		}
+	}
+
+	for (i = 0; i < ntouched; ++i)
+		ft_post(touched[i], doc);
+
+	if (++npending >= FT_FLUSH)
+		ftindex_flush();
+}
+
+static struct ft_entry *
+ft_seg_find(const char *term)
+{
+	uint32_t	 lo = 0, hi = nents, mid;
+	int		 r;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if ((r = strcmp(term, (char *)seg + ents[mid].str)) == 0)
+			return &ents[mid];
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return NULL;
+}
+
+/* walks the list of a word, in the index file and then in memory */
+struct ft_cursor {
+	const uint8_t	*p, *end;
+	const uint8_t	*next, *nextend;
+	uint32_t	 doc;
+	uint32_t	 df;
+};
+
+static void
+ft_cursor_init(struct ft_cursor *c, const char *term)
+{
+	struct ft_entry	*e;
+	struct ft_term	*t;
+
+	memset(c, 0, sizeof(*c));
+	if (seg != NULL && (e = ft_seg_find(term)) != NULL) {
+		c->p = seg + e->post;
+		c->end = c->p + e->postlen;
+		c->df = e->df;
+	}
+	if ((t = ft_pending_term(term, 0)) != NULL) {
+		c->next = t->post;
+		c->nextend = t->post + t->len;
+		c->df += t->df;
+	}
+}
+
+static int
+ft_cursor_next(struct ft_cursor *c, uint32_t *doc, uint32_t *tf)
+{
+	uint32_t	 delta;
+
+	if (c->p == c->end) {
+		if (c->next == NULL)
+			return 0;
+		/* the pages in memory start again from 0 */
+		c->p = c->next;
+		c->end = c->nextend;
+		c->next = NULL;
+		c->doc = 0;
+	}
+
+	if (!ft_unvarint(&c->p, c->end, &delta) ||
+	    !ft_unvarint(&c->p, c->end, tf)) {
+		c->p = c->end;
+		c->next = NULL;
+		return 0;
+	}
+	c->doc += delta;
+	*doc = c->doc;
+	return *doc < ndocs;
+}
+
+struct ft_cand {
+	uint32_t	 doc;
+	double		 score;
+};
+
+static int
+ft_cand_cmp(const void *a, const void *b)
+{
+	const struct ft_cand	*x = a, *y = b;
+
+	if (x->score != y->score)
+		return x->score < y->score ? 1 : -1;
+	/* the most recent first */
+	return x->doc < y->doc ? 1 : -1;
+}
+
+static int
+ft_cursor_cmp(const void *a, const void *b)
+{
+	const struct ft_cursor	*x = a, *y = b;
+
+	if (x->df == y->df)
+		return 0;
+	return x->df < y->df ? -1 : 1;
+}
+
+/* log2(1 + ndocs / df), near enough: no need for libm */
+static double
+ft_idf(uint32_t df)
+{
+	double	 q, l = 0;
+
+	for (q = 1.0 + (double)ndocs / df; q >= 2; q /= 2)
+		l++;
+	return l + q - 1;
+}
+
+static inline double
+ft_score(uint32_t tf, double idf)
+{
+	return idf * (tf * 2.2) / (tf + 1.2);
+}
+
+/*
+ * Find the pages that have all the words of query, the best first.
+ * The results are good until the next call.
+ */
+int
+ftindex_search(const char *query, struct ft_result **ret)
+{
+	struct ft_cursor	 curs[FT_MAXQUERY];
+	struct ft_cand		*cand = NULL;
+	char			 terms[FT_MAXQUERY][FT_MAXTERM + 1];
+	size_t			 i, j, k, n, nterms = 0, ncand = 0, cap = 0;
+	uint32_t		 doc, tf;
+	double			 idf;
+
+	ft_init();
+	*ret = results;
+	results[0].url = NULL;
+
+	while (nterms < FT_MAXQUERY &&
+	    ft_next_term(&query, terms[nterms]) != 0) {
+		for (i = 0; i < nterms; ++i)
+			if (!strcmp(terms[i], terms[nterms]))
+				break;
+		if (i == nterms)
+			nterms++;
+	}
+
+	for (i = 0; i < nterms; ++i) {
+		ft_cursor_init(&curs[i], terms[i]);
+		if (curs[i].df == 0)
+			return 0;
+	}
+	if (nterms == 0)
+		return 0;
+
+	/* the rarest word gives the candidates, the others filter them */
+	qsort(curs, nterms, sizeof(*curs), ft_cursor_cmp);
+
+	idf = ft_idf(curs[0].df);
+	while (ft_cursor_next(&curs[0], &doc, &tf)) {
+		if (ncand == cap) {
+			cap = cap == 0 ? 256 : cap * 2;
+			cand = xreallocarray(cand, cap, sizeof(*cand));
+		}
+		cand[ncand].doc = doc;
+		cand[ncand].score = ft_score(tf, idf);
+		ncand++;
+	}
+
+	for (i = 1; i < nterms && ncand != 0; ++i) {
+		idf = ft_idf(curs[i].df);
+		j = k = 0;
+		while (j < ncand && ft_cursor_next(&curs[i], &doc, &tf)) {
+			while (j < ncand && cand[j].doc < doc)
+				j++;
+			if (j < ncand && cand[j].doc == doc) {
+				cand[k].doc = doc;
+				cand[k].score = cand[j].score +
+				    ft_score(tf, idf);
+				k++;
+				j++;
+			}
+		}
+		ncand = k;
+	}
+
+	for (i = 0, k = 0; i < ncand; ++i)
+		if (!docs[cand[i].doc].stale)
+			cand[k++] = cand[i];
+	ncand = k;
+
+	qsort(cand, ncand, sizeof(*cand), ft_cand_cmp);
+
+	n = MIN(ncand, FT_RESULTS);
+	for (i = 0; i < n; ++i) {
+		results[i].url = docs[cand[i].doc].url;
+		results[i].title = docs[cand[i].doc].title;
+		results[i].score = cand[i].score;
+	}
+	results[n].url = NULL;
+
+	free(cand);
+	return n;
+}
+
+static int
+ft_term_cmp(const void *a, const void *b)
+{
+	const struct ft_term	*x = *(const struct ft_term **)a;
+	const struct ft_term	*y = *(const struct ft_term **)b;
+
+	return strcmp(x->term, y->term);
+}
+
+/*
+ * Merge the words in memory into the index file.  The new pages come
+ * after the ones already there, so the lists are just concatenated,
+ * fixing the distance of the first of the new pages.
+ */
+void
+ftindex_flush(void)
+{
+	struct pfile	 pf;
+	struct ft_header h;
+	struct ft_entry	*e, *out;
+	struct ft_term	**terms, *t;
+	struct {
+		struct ft_entry	*old;
+		struct ft_term	*new;
+	}		*m;
+	const uint8_t	*rest;
+	uint8_t		*buf, *s, *post, tmp[5];
+	size_t		 i, j, n = 0, nout = 0, strslen = 0, postslen = 0;
+	const char	*word;
+	size_t		 len, skip, wlen;
+	uint32_t	 first;
+	unsigned int	 slot;
+	int		 r;
+
+	if (!initialized || npending == 0)
+		return;
+
+	terms = xreallocarray(NULL, ohash_entries(&pending) + 1,
+	    sizeof(*terms));
+	for (t = ohash_first(&pending, &slot); t != NULL;
+	    t = ohash_next(&pending, &slot))
+		terms[n++] = t;
+	qsort(terms, n, sizeof(*terms), ft_term_cmp);
+
+	/* both are sorted: merge them */
+	m = xcalloc(nents + n + 1, sizeof(*m));
+	for (i = 0, j = 0; i < nents || j < n; nout++) {
+		if (j == n)
+			r = -1;
+		else if (i == nents)
+			r = 1;
+		else
+			r = strcmp((char *)seg + ents[i].str, terms[j]->term);
+		if (r <= 0)
+			m[nout].old = &ents[i++];
+		if (r >= 0)
+			m[nout].new = terms[j++];
+	}
+
+	out = xcalloc(nout + 1, sizeof(*out));
+	for (i = 0; i < nout; ++i) {
+		e = &out[i];
+		if (m[i].old != NULL) {
+			*e = *m[i].old;
+			strslen += strlen((char *)seg + e->str) + 1;
+		} else
+			strslen += strlen(m[i].new->term) + 1;
+
+		if ((t = m[i].new) != NULL) {
+			e->postlen += t->len;
+			if (m[i].old != NULL) {
+				/* the first distance is from the old last */
+				rest = t->post;
+				ft_unvarint(&rest, t->post + t->len, &first);
+				e->postlen += ft_put_varint(tmp,
+				    first - e->last) - (rest - t->post);
+			}
+			e->df += t->df;
+			e->last = t->last;
+		}
+		postslen += e->postlen;
+	}
+
+	len = sizeof(h) + nout * sizeof(*out) + strslen + postslen;
+	if (sizeof(h) + nout * sizeof(*out) + strslen > UINT32_MAX) {
+		free(out);
+		free(m);
+		free(terms);
+		return;
+	}
+
+	buf = xmalloc(len);
+	memcpy(h.magic, FT_MAGIC, sizeof(h.magic));
+	h.ndocs = ndocs;
+	h.nterms = nout;
+	memcpy(buf, &h, sizeof(h));
+
+	s = buf + sizeof(h) + nout * sizeof(*out);
+	post = s + strslen;
+	for (i = 0; i < nout; ++i) {
+		e = &out[i];
+		t = m[i].new;
+
+		if (m[i].old != NULL)
+			word = (char *)seg + m[i].old->str;
+		else
+			word = t->term;
+		wlen = strlen(word) + 1;
+		memcpy(s, word, wlen);
+		e->str = s - buf;
+		s += wlen;
+
+		e->post = post - buf;
+		if (m[i].old != NULL) {
+			memcpy(post, seg + m[i].old->post,
+			    m[i].old->postlen);
+			post += m[i].old->postlen;
+		}
+		if (t != NULL) {
+			rest = t->post;
+			skip = 0;
+			if (m[i].old != NULL) {
+				ft_unvarint(&rest, t->post + t->len, &first);
+				post += ft_put_varint(post,
+				    first - m[i].old->last);
+				skip = rest - t->post;
+			}
+			memcpy(post, t->post + skip, t->len - skip);
+			post += t->len - skip;
+		}
+	}
+	memcpy(buf + sizeof(h), out, nout * sizeof(*out));
+	free(out);
+	free(m);
+	free(terms);
+
+	if (persist_open(&pf, fulltext_file, fulltext_file_tmp,
+	    PERSIST_REPLACE) == 0) {
+		fwrite(buf, 1, len, pf.fp);
+		persist_close(&pf);
+	}
+
+	if (ft_use_seg(buf, len, 0) == -1)
+		free(buf);
+
+	for (t = ohash_first(&pending, &slot); t != NULL;
+	    t = ohash_next(&pending, &slot)) {
+		free(t->post);
+		free(t);
+	}
+	ohash_delete(&pending);
+	ft_hash_init(&pending, offsetof(struct ft_term, term));
+	npending = 0;
+}
@@ -1,5 +1,6 @@
 BEGIN {
 	FS = "[(,)]";
+	n = 0;
 
 	print "#include \"compat.h\""
 	print "#include \"cmd.h\""
@@ -11,6 +12,7 @@ BEGIN {
 	sub("^cmd_", "", s);
 	gsub("_", "-", s);
 	printf("\t{ \"%s\", %s, %s },\n", s, $2, $3);
+	names[n++] = s;
 	next;
 }
 
@@ -18,6 +20,7 @@ BEGIN {
 	s = $2;
 	d = $3;
 	printf("\t{ \"%s\", %s, NULL },\n", s, d);
+	names[n++] = s;
 	next
 }
 
@@ -28,4 +31,21 @@ BEGIN {
 END {
 	printf("\t{ NULL, NULL, NULL },\n");
 	print "};";
+
+	# the indexes of cmds sorted by name, for cmd_lookup.  Needs
+	# to run in the C locale to sort like strcmp.
+	for (i = 0; i < n; ++i)
+		idx[i] = i;
+	for (i = 1; i < n; ++i) {
+		t = idx[i];
+		for (j = i - 1; j >= 0 && names[idx[j]] > names[t]; --j)
+			idx[j + 1] = idx[j];
+		idx[j + 1] = t;
+	}
+
+	print "const unsigned short cmds_byname[] = {";
+	for (i = 0; i < n; ++i)
+		printf("\t%d,\t/* %s */\n", idx[i], names[idx[i]]);
+	print "};";
+	printf("const size_t cmds_len = %d;\n", n);
 }
@@ -0,0 +1,198 @@
+#!/bin/sh
+#
+# Generate a two-level lookup table for the display width of the
+# codepoints from the East Asian Width property.  Every codepoint is
+# two bits wide, grouped in blocks of 256 codepoints; identical blocks
+# are shared.  The emoji from the second file get a bitmap built the
+# same way, with a 64-bit word for every 64 codepoints.
+
+file="${1:?missing input file}"
+emoji="${2:?missing emoji file}"
+
+sed -e '/^$/d'				\
+    -e '/^#/d'				\
+    -e 's/^\([0-9A-F.]*\);\([A-Za-z]*\)[ \t]*# \([A-Za-z]*\).*/\1 \2 \3/' \
+    -e 's/\.\./ /'			\
+    "$file"				\
+	| awk -v emoji="$emoji" '
+function hex(s,		i, n) {
+	n = 0
+	for (i = 1; i <= length(s); ++i)
+		n = n * 16 + index("0123456789ABCDEF", substr(s, i, 1)) - 1
+	return n
+}
+
+function add(lo, hi, w) {
+	rlo[nr] = lo
+	rhi[nr] = hi
+	rw[nr] = w
+	nr++
+}
+
+# the four 16-bit quarters, from the top one, since awk numbers
+# are doubles
+function word(base,	q, i, n, s) {
+	s = ""
+	for (q = 3; q >= 0; --q) {
+		n = 0
+		for (i = 15; i >= 0; --i)
+			n = n * 2 + ((base + q * 16 + i) in isemoji)
+		s = s sprintf("%04x", n)
+	}
+	return "0x" s "ULL"
+}
+
+BEGIN {
+	nr = 0
+
+	emax = 0
+	while ((getline line < emoji) > 0) {
+		sub(/#.*/, "", line)
+		sub(/;.*/, "", line)
+		gsub(/[ \t]/, "", line)
+		if (line == "")
+			continue
+		if ((i = index(line, "..")) != 0) {
+			lo = hex(substr(line, 1, i - 1))
+			hi = hex(substr(line, i + 2))
+		} else
+			lo = hi = hex(line)
+		for (cp = lo; cp <= hi; ++cp)
+			isemoji[cp] = 1
+		if (hi > emax)
+			emax = hi
+	}
+	close(emoji)
+}
+
+{
+	if (NF == 3) {
+		lo = hex($1)
+		hi = lo
+		eaw = $2
+		cat = $3
+	} else {
+		lo = hex($1)
+		hi = hex($2)
+		eaw = $3
+		cat = $4
+	}
+
+	if (cat == "Mn" || cat == "Me" || cat == "Cf" || cat == "Cc")
+		add(lo, hi, 0)
+	else if (eaw == "W" || eaw == "F")
+		add(lo, hi, 2)
+}
+
+END {
+	# the soft hyphen and the prepended concatenation marks are
+	# still rendered; hangul medial vowels and final consonants
+	# combine with the previous syllable.
+	add(hex("00AD"), hex("00AD"), 1)
+	add(hex("0600"), hex("0605"), 1)
+	add(hex("06DD"), hex("06DD"), 1)
+	add(hex("070F"), hex("070F"), 1)
+	add(hex("0890"), hex("0891"), 1)
+	add(hex("08E2"), hex("08E2"), 1)
+	add(hex("110BD"), hex("110BD"), 1)
+	add(hex("110CD"), hex("110CD"), 1)
+	add(hex("1160"), hex("11FF"), 0)
+	add(hex("D7B0"), hex("D7FF"), 0)
+
+	nblocks = 0
+	for (b = 0; b < 4352; ++b) {
+		blo = b * 256
+		bhi = blo + 255
+
+		for (i = 0; i < 256; ++i)
+			w[i] = 1
+
+		for (r = 0; r < nr; ++r) {
+			if (rhi[r] < blo || rlo[r] > bhi)
+				continue
+			lo = rlo[r] < blo ? blo : rlo[r]
+			hi = rhi[r] > bhi ? bhi : rhi[r]
+			for (cp = lo; cp <= hi; ++cp)
+				w[cp - blo] = rw[r]
+		}
+
+		s = ""
+		for (i = 0; i < 256; i += 4) {
+			v = w[i] + w[i+1] * 4 + w[i+2] * 16 + w[i+3] * 64
+			if (i == 0)
+				sep = "\n\t\t"
+			else if (i % 32 == 0)
+				sep = ",\n\t\t"
+			else
+				sep = ", "
+			s = s sprintf("%s0x%02x", sep, v)
+		}
+
+		if (!(s in id)) {
+			id[s] = nblocks
+			blocks[nblocks++] = s
+		}
+		stage1[b] = id[s]
+	}
+
+	eblocks = 0
+	neblocks = int(emax / 256) + 1
+	for (b = 0; b < neblocks; ++b) {
+		s = ""
+		for (i = 0; i < 4; ++i)
+			s = s sprintf("%s%s", (i == 0 ? "" : ", "),
+			    word(b * 256 + i * 64))
+
+		if (!(s in eid)) {
+			eid[s] = eblocks
+			eblock[eblocks++] = s
+		}
+		estage1[b] = eid[s]
+	}
+
+	print "/* generated by genwidth.sh, do not edit */"
+	print ""
+	print "#include \"compat.h\""
+	print ""
+	print "#include \"utf8.h\""
+	print ""
+	printf("static const uint%s_t width_stage1[4352] = {", nblocks > 256 ? "16" : "8")
+	for (b = 0; b < 4352; ++b)
+		printf("%s%d,", (b % 16 == 0 ? "\n\t" : " "), stage1[b])
+	print "\n};"
+	print ""
+	printf("static const uint8_t width_stage2[%d][64] = {\n", nblocks)
+	for (i = 0; i < nblocks; ++i)
+		printf("\t{%s\n\t},\n", blocks[i])
+	print "};"
+	print ""
+	print "/* returns 0, 1 or 2 */"
+	print "int"
+	print "uc_width(uint32_t cp)"
+	print "{"
+	print "\tif (cp > 0x10FFFF)"
+	print "\t\treturn 1;"
+	print "\treturn (width_stage2[width_stage1[cp >> 8]][(cp & 0xFF) >> 2]"
+	print "\t    >> ((cp & 3) * 2)) & 3;"
+	print "}"
+	print ""
+	printf("static const uint%s_t emoji_stage1[%d] = {", eblocks > 256 ? "16" : "8", neblocks)
+	for (b = 0; b < neblocks; ++b)
+		printf("%s%d,", (b % 16 == 0 ? "\n\t" : " "), estage1[b])
+	print "\n};"
+	print ""
+	printf("static const uint64_t emoji_stage2[%d][4] = {\n", eblocks)
+	for (i = 0; i < eblocks; ++i)
+		printf("\t{ %s },\n", eblock[i])
+	print "};"
+	print ""
+	print "int"
+	print "is_emoji(uint32_t cp)"
+	print "{"
+	printf("\tif (cp >= 0x%X)\n", neblocks * 256)
+	print "\t\treturn 0;"
+	print "\treturn (emoji_stage2[emoji_stage1[cp >> 8]][(cp & 0xFF) >> 6]"
+	print "\t    >> (cp & 63)) & 1;"
+	print "}"
+}
+'
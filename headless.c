@@ -0,0 +1,464 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Headless mode: the URLs given as arguments, or read from the
+ * standard input one per line, are loaded as in the UI, up to
+ * headless_jobs at a time, and each page is printed once loaded,
+ * wrapped at headless_width columns or in its source form.  The pages
+ * are printed in the order they were requested, each after a
+ * "==> URL <==" line as head(1) does for many files.
+ *
+ * With headless_mirror the URLs are the start of a breadth-first
+ * crawl of the links to the same host: the pages are saved in the
+ * mirror instead, unless they didn't change, and only a line for each
+ * is printed.
+ */
+
+#include "compat.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "defaults.h"
+#include "ev.h"
+#include "fs.h"
+#include "headless.h"
+#include "hist.h"
+#include "iri.h"
+#include "parser.h"
+#include "telescope.h"
+#include "session.h"
+#include "ui.h"
+#include "utils.h"
+#include "xwrapper.h"
+
+int	 headless;
+int	 headless_jobs = 8;
+int	 headless_mirror;
+int	 headless_source;
+int	 headless_width = 80;
+
+struct job {
+	TAILQ_ENTRY(job)	 jobs;
+	char			*url;
+	struct tab		*tab;
+	int			 done;
+};
+
+static TAILQ_HEAD(, job) jobs = TAILQ_HEAD_INITIALIZER(jobs);
+static int		 njobs;
+
+/* the URLs met by the crawl, the ones in the queue still to load */
+struct crawl {
+	TAILQ_ENTRY(crawl)	 queue;
+	char			 url[];
+};
+
+static TAILQ_HEAD(, crawl) crawlq = TAILQ_HEAD_INITIALIZER(crawlq);
+static struct ohash	 crawled;
+static size_t		 nsaved, nsame, nfailed;
+static int		 print_failed;
+
+static char * const	*urls;
+static int		 nurls;
+
+static char		 inbuf[GEMINI_URL_LEN];
+static size_t		 inlen;
+static int		 reading, unpollable, ineof, skipping;
+
+static char		*base;
+static int		 printed, loaded_early;
+static unsigned int	 flush_idle;
+
+static void		 headless_read(int, int, void *);
+
+static void
+crawl_add(const char *url)
+{
+	struct crawl	*c;
+	unsigned int	 slot;
+
+	slot = ohash_qlookup(&crawled, url);
+	if (ohash_find(&crawled, slot) != NULL)
+		return;
+
+	c = xcalloc(1, sizeof(*c) + strlen(url) + 1);
+	strcpy(c->url, url);
+	ohash_insert(&crawled, slot, c);
+	TAILQ_INSERT_TAIL(&crawlq, c, queue);
+}
+
+static void
+start_url(const char *url)
+{
+	struct job	*job;
+
+	job = xcalloc(1, sizeof(*job));
+	job->url = xstrdup(url);
+	TAILQ_INSERT_TAIL(&jobs, job, jobs);
+	njobs++;
+
+	/* about pages and cached ones are loaded right away */
+	loaded_early = 0;
+	if ((job->tab = new_tab(url, NULL, NULL)) == NULL)
+		job->done = 1;
+	job->done |= loaded_early;
+	loaded_early = 0;
+}
+
+/* Returns 0 if there was no URL in the line. */
+static int
+start_job(const char *raw)
+{
+	char		 url[GEMINI_URL_LEN];
+
+	raw += strspn(raw, " \t");
+	if (*raw == '\0')
+		return 0;
+
+	humanify_url(raw, base, url, sizeof(url));
+	if (headless_mirror)
+		crawl_add(url);
+	else
+		start_url(url);
+	return 1;
+}
+
+/* Start a job for the next line in inbuf, if there's a whole one. */
+static int
+next_line(void)
+{
+	char		*nl;
+	size_t		 n;
+	int		 skip, started;
+
+	do {
+		if ((nl = memchr(inbuf, '\n', inlen)) != NULL) {
+			*nl = '\0';
+			n = nl - inbuf + 1;
+		} else if (ineof && inlen != 0) {
+			inbuf[inlen] = '\0';
+			n = inlen;
+		} else
+			return 0;
+
+		inbuf[strcspn(inbuf, "\r")] = '\0';
+		skip = skipping;
+		skipping = 0;
+		started = !skip && start_job(inbuf);
+
+		memmove(inbuf, inbuf + n, inlen - n);
+		inlen -= n;
+	} while (!started);
+
+	return 1;
+}
+
+static void
+read_input(void)
+{
+	ssize_t		 r;
+
+	/* keep a byte for the NUL of the last line */
+	r = read(0, inbuf + inlen, sizeof(inbuf) - 1 - inlen);
+	if (r == -1) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		err(1, "read");
+	}
+	if (r == 0)
+		ineof = 1;
+	inlen += r;
+
+	if (inlen == sizeof(inbuf) - 1 &&
+	    memchr(inbuf, '\n', inlen) == NULL) {
+		warnx("URL too long, skipping");
+		skipping = 1;
+		inlen = 0;
+	}
+}
+
+/*
+ * Start as many jobs as possible and stop when there's nothing left.
+ * The files can't be polled, so they're read here.
+ */
+static void
+fill(void)
+{
+	struct crawl	*c;
+
+	while (njobs < headless_jobs) {
+		if ((c = TAILQ_FIRST(&crawlq)) != NULL) {
+			TAILQ_REMOVE(&crawlq, c, queue);
+			start_url(c->url);
+		} else if (nurls > 0) {
+			start_job(*urls++);
+			nurls--;
+		} else if (urls != NULL || ineof) {
+			if (urls != NULL || !next_line())
+				break;
+		} else if (!next_line()) {
+			if (!unpollable)
+				break;
+			read_input();
+		}
+	}
+
+	if (urls == NULL && !ineof && !unpollable &&
+	    njobs < headless_jobs) {
+		if (!reading && ev_add(0, EV_READ, headless_read, NULL) == -1) {
+			if (errno != EPERM)
+				err(1, "ev_add");
+			unpollable = 1;
+			fill();
+			return;
+		}
+		reading = 1;
+	} else if (reading) {
+		ev_del(0);
+		reading = 0;
+	}
+
+	if (njobs == 0 && TAILQ_EMPTY(&crawlq) &&
+	    (urls != NULL ? nurls == 0 : ineof && inlen == 0))
+		ev_break();
+}
+
+static void
+headless_read(int fd, int event, void *d)
+{
+	read_input();
+	fill();
+}
+
+static void
+print_page(struct tab *tab)
+{
+	struct buffer	*buffer = &tab->buffer;
+	struct vline	*vl;
+	const char	*prfx, *text;
+	int		 prfxlen, textlen;
+
+	printf("%s==> %s <==\n", printed++ ? "\n" : "", hist_cur(tab->hist));
+
+	if (headless_source) {
+		if (!parser_serialize(buffer, stdout)) {
+			warn("can't print %s", hist_cur(tab->hist));
+			print_failed = 1;
+		}
+		return;
+	}
+
+	wrap_page(buffer, headless_width);
+	for (vl = vline_first(buffer); vl != NULL;
+	    vl = vline_next(buffer, vl)) {
+		line_prefix_and_text(vl, &prfx, &prfxlen, &text, &textlen);
+		printf("%.*s%.*s\n", prfxlen, prfx, textlen, text);
+	}
+}
+
+/*
+ * Queue the links of the page to the same host, without the fragment.
+ * The ones with a query are left out, they're usually for an input.
+ */
+static void
+crawl_links(struct tab *tab)
+{
+	struct lineref	*ref;
+	struct iri	 iri;
+	const char	*url;
+	char		 buf[GEMINI_URL_LEN];
+
+	if (tab->buffer.parser != &gemtext_parser)
+		return;
+
+	for (ref = tab->buffer.links.refs; ref != NULL && ref->line != NULL;
+	    ref++) {
+		if ((url = link_url(tab, ref)) == NULL ||
+		    iri_parse(NULL, url, &iri) == -1 ||
+		    strcmp(iri.iri_scheme, "gemini") != 0 ||
+		    *iri.iri_query != '\0' ||
+		    strcmp(iri.iri_host, tab->iri->iri_host) != 0)
+			continue;
+		if (*iri.iri_portstr == '\0')
+			iri_setport(&iri, "1965");
+		if (strcmp(iri.iri_portstr, tab->iri->iri_portstr) != 0)
+			continue;
+		*iri.iri_fragment = '\0';
+		iri.iri_flags &= ~IH_FRAGMENT;
+		if (iri_unparse(&iri, buf, sizeof(buf)) == 0)
+			crawl_add(buf);
+	}
+}
+
+/*
+ * Save the page in the mirror and crawl its links.  Only the text
+ * pages loaded fine, from a trusted host and still on the same one
+ * after the redirects, are taken.
+ */
+static void
+mirror_page(struct job *job)
+{
+	struct tab	*tab = job->tab;
+	struct iri	 iri;
+	const char	*url = hist_cur(tab->hist);
+	const char	*why = NULL;
+
+	if (tab->code != 20) {
+		printf("failed %d %s\n", tab->code, url);
+		nfailed++;
+		return;
+	}
+
+	if (tab->trust < TS_TEMP_TRUSTED)
+		why = "untrusted";
+	else if (tab->meta == NULL || strncmp(tab->meta, "text/", 5) != 0 ||
+	    (tab->buffer.parser == &gemtext_parser &&
+	    strncmp(tab->meta, "text/gemini", 11) != 0))
+		why = "skipped";	/* what's shown is an error page */
+	else if (iri_parse(NULL, job->url, &iri) == -1 ||
+	    strcmp(iri.iri_host, tab->iri->iri_host) != 0)
+		why = "offsite";
+
+	if (why != NULL) {
+		printf("%s %s\n", why, url);
+		nfailed++;
+		return;
+	}
+
+	switch (fs_mirror_save(&tab->buffer, tab->iri)) {
+	case -1:
+		printf("skipped %s\n", url);
+		nfailed++;
+		return;
+	case 0:
+		printf("same %s\n", url);
+		nsame++;
+		break;
+	default:
+		printf("saved %s\n", url);
+		nsaved++;
+		break;
+	}
+
+	crawl_links(tab);
+}
+
+/*
+ * The pages are printed and their tabs killed once all the ones
+ * before are, and in a second moment since the tab may still be used
+ * after ui_on_tab_loaded.
+ */
+static void
+flush_jobs(int fd, int event, void *d)
+{
+	struct job	*job;
+
+	while ((job = TAILQ_FIRST(&jobs)) != NULL && job->done) {
+		TAILQ_REMOVE(&jobs, job, jobs);
+		njobs--;
+
+		if (job->tab != NULL) {
+			if (headless_mirror)
+				mirror_page(job);
+			else
+				print_page(job->tab);
+			kill_tab(job->tab, 0);
+			if (current_tab == job->tab)
+				current_tab = TAILQ_FIRST(&tabshead);
+		}
+		free(job->url);
+		free(job);
+	}
+	fflush(stdout);
+
+	fill();
+}
+
+void
+headless_loaded(struct tab *tab)
+{
+	struct job	*job;
+
+	TAILQ_FOREACH(job, &jobs, jobs)
+		if (job->tab == tab)
+			break;
+	if (job == NULL) {
+		/* still in new_tab */
+		loaded_early = 1;
+	} else
+		job->done = 1;
+
+	if (!ev_idle_pending(flush_idle))
+		flush_idle = ev_idle(flush_jobs, NULL);
+}
+
+/*
+ * Load and print or mirror the pages; return non-zero if they
+ * couldn't all be printed.
+ */
+int
+headless_run(int argc, char * const *argv)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct crawl, url),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+	struct crawl	*c;
+	unsigned int	 i;
+
+	xasprintf(&base, "file://%s/", cwd);
+	ohash_init(&crawled, 8, &info);
+
+	/* the tabs are gone as soon as their page is printed */
+	max_killed_tabs = 0;
+
+	ev_name(headless_read, "headless read");
+	ev_name(flush_jobs, "headless flush");
+
+	if (argc > 0) {
+		urls = argv;
+		nurls = argc;
+	}
+
+	fill();
+	if (njobs != 0 || (urls == NULL && (!ineof || inlen != 0)))
+		ev_loop();
+
+	if (headless_mirror)
+		fprintf(stderr, "%zu saved, %zu unchanged, %zu failed\n",
+		    nsaved, nsame, nfailed);
+
+	for (c = ohash_first(&crawled, &i); c != NULL;
+	    c = ohash_next(&crawled, &i))
+		free(c);
+	ohash_delete(&crawled);
+	free(base);
+
+	if (fflush(stdout) == EOF || ferror(stdout)) {
+		warn("stdout");
+		print_failed = 1;
+	}
+	return print_failed;
+}
@@ -21,11 +21,11 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "cmd.h"
 #include "keymap.h"
 #include "telescope.h"
 #include "ui.h"
-#include "xwrapper.h"
 
 static void	emit_help_item(char *, interactivefn *);
 static void	rec_compute_help(struct kmap *, char *, size_t);
@@ -42,10 +42,10 @@ emit_help_item(char *prfx, interactivefn *fn)
 	}
 	assert(cmd != NULL);
 
-	l = xcalloc(1, sizeof(*l));
+	l = arena_calloc(&helpwin.line_arena, 1, sizeof(*l));
 
 	l->type = LINE_HELP;
-	l->line = xstrdup(prfx);
+	l->line = arena_strdup(&helpwin.line_arena, prfx);
 	l->alt = (char*)cmd->cmd;
 
 	TAILQ_INSERT_TAIL(&helpwin.head, l, lines);
@@ -76,14 +76,21 @@ rec_compute_help(struct kmap *keymap, char *prfx, size_t len)
 	}
 }
 
+/*
+ * Rebuild the help only when it's for another keymap or the bindings
+ * changed since last time.
+ */
 void
 recompute_help(void)
 {
-	static struct kmap *last_active_map = NULL;
+	static struct kmap	*last_active_map = NULL;
+	static unsigned int	 last_generation;
 	char	p[32] = { 0 };
 
-	if (last_active_map != current_map) {
+	if (last_active_map != current_map ||
+	    last_generation != kmap_generation) {
 		last_active_map = current_map;
+		last_generation = kmap_generation;
 
 		helpwin.mode = "*Help*";
 		erase_buffer(&helpwin);
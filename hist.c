@@ -14,28 +14,86 @@
  * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+/*
+ * The history is a ring of items, so that the n-th one is found
+ * right away and the oldest can be dropped in constant time once the
+ * depth limit is reached.  The strings are interned, so the same URL
+ * in many tabs, or many times in one, is kept only once.
+ */
+
 #include "compat.h"
 
 #include <stdlib.h>
 #include <string.h>
 
 #include "hist.h"
-
-struct hist {
-	TAILQ_HEAD(mhist, hist_item)	 head;
-	int				 flags;
-	size_t				 size;
-	ssize_t				 off;
-	struct hist_item		*cur;
-};
+#include "intern.h"
 
 struct hist_item {
-	char			*str;
+	const char		*str;
 	size_t			 line_off;
 	size_t			 current_off;
-	TAILQ_ENTRY(hist_item)	 entries;
 };
 
+struct hist {
+	struct hist_item	*items;
+	size_t			 cap;
+	size_t			 first;
+	size_t			 size;
+	size_t			 depth;		/* 0 for no limit */
+	ssize_t			 off;
+	int			 flags;
+	unsigned int		 gen;
+};
+
+static inline struct hist_item *
+item(struct hist *hist, size_t n)
+{
+	return (&hist->items[(hist->first + n) % hist->cap]);
+}
+
+static inline struct hist_item *
+cur(struct hist *hist)
+{
+	if (hist->off == -1)
+		return (NULL);
+	return (item(hist, hist->off));
+}
+
+/* make room for another item, dropping the oldest if needed */
+static int
+reserve(struct hist *hist)
+{
+	struct hist_item	*items;
+	size_t			 i, cap;
+
+	if (hist->depth != 0 && hist->size == hist->depth) {
+		intern_free(item(hist, 0)->str);
+		hist->first = (hist->first + 1) % hist->cap;
+		hist->size--;
+		if (hist->off != -1)
+			hist->off--;
+		return (0);
+	}
+
+	if (hist->size < hist->cap)
+		return (0);
+
+	cap = hist->cap == 0 ? 4 : hist->cap * 2;
+	if (hist->depth != 0 && cap > hist->depth)
+		cap = hist->depth;
+	if ((items = calloc(cap, sizeof(*items))) == NULL)
+		return (-1);
+	for (i = 0; i < hist->size; ++i)
+		items[i] = *item(hist, i);
+
+	free(hist->items);
+	hist->items = items;
+	hist->cap = cap;
+	hist->first = 0;
+	return (0);
+}
+
 struct hist *
 hist_new(int flags)
 {
@@ -44,7 +102,6 @@ hist_new(int flags)
 	if ((hist = calloc(1, sizeof(*hist))) == NULL)
 		return (NULL);
 
-	TAILQ_INIT(&hist->head);
 	hist->flags = flags;
 	hist->off = -1;
 	return (hist);
@@ -57,33 +114,56 @@ hist_free(struct hist *hist)
 		return;
 
 	hist_erase(hist);
+	free(hist->items);
 	free(hist);
 }
 
-static void
-hist_erase_from(struct hist *hist, struct hist_item *h)
+/*
+ * Keep only the last n items.  The position is lost if it was on one
+ * of those dropped.
+ */
+void
+hist_set_depth(struct hist *hist, size_t depth)
 {
-	struct hist_item	*next;
-
-	while (h != NULL) {
-		next = TAILQ_NEXT(h, entries);
+	hist->depth = depth;
+	while (depth != 0 && hist->size > depth) {
+		intern_free(item(hist, 0)->str);
+		hist->first = (hist->first + 1) % hist->cap;
+		hist->size--;
+		hist->off--;
+		hist->gen++;
+	}
+	if (hist->off < -1)
+		hist->off = -1;
+}
 
+static void
+hist_erase_from(struct hist *hist, size_t n)
+{
+	while (hist->size > n) {
 		hist->size--;
-		TAILQ_REMOVE(&hist->head, h, entries);
-		free(h->str);
-		free(h);
-		h = next;
+		intern_free(item(hist, hist->size)->str);
+		hist->gen++;
 	}
 }
 
 void
 hist_erase(struct hist *hist)
 {
-	hist_erase_from(hist, TAILQ_FIRST(&hist->head));
+	hist_erase_from(hist, 0);
 
-	hist->size = 0;
+	hist->first = 0;
 	hist->off = -1;
-	hist->cur = NULL;
+}
+
+/*
+ * A number that changes every time the history or the position in it
+ * do, to tell whether it needs saving again.
+ */
+unsigned int
+hist_generation(struct hist *hist)
+{
+	return (hist->gen);
 }
 
 size_t
@@ -92,6 +172,13 @@ hist_size(struct hist *hist)
 	return (hist->size);
 }
 
+/* the memory held by the ring, the strings are counted by intern */
+size_t
+hist_memory(struct hist *hist)
+{
+	return (sizeof(*hist) + hist->cap * sizeof(*hist->items));
+}
+
 size_t
 hist_off(struct hist *hist)
 {
@@ -103,134 +190,132 @@ hist_off(struct hist *hist)
 const char *
 hist_cur(struct hist *hist)
 {
-	if (hist->cur == NULL)
+	struct hist_item	*h;
+
+	if ((h = cur(hist)) == NULL)
 		return (NULL);
-	return (hist->cur->str);
+	return (h->str);
 }
 
 int
 hist_cur_offs(struct hist *hist, size_t *line, size_t *curr)
 {
+	struct hist_item	*h;
+
 	*line = 0;
 	*curr = 0;
 
-	if (hist->cur == NULL)
+	if ((h = cur(hist)) == NULL)
 		return (-1);
 
-	*line = hist->cur->line_off;
-	*curr = hist->cur->current_off;
+	*line = h->line_off;
+	*curr = h->current_off;
 	return (0);
 }
 
 int
 hist_set_cur(struct hist *hist, const char *str)
 {
-	char		*d;
+	struct hist_item	*h;
+	const char		*d;
 
-	if (hist->cur == NULL)
+	if ((h = cur(hist)) == NULL)
 		return (-1);
 
-	if ((d = strdup(str)) == NULL)
-		return (-1);
+	d = intern(str);
 
-	free(hist->cur->str);
-	hist->cur->str = d;
+	intern_free(h->str);
+	h->str = d;
+	hist->gen++;
 	return (0);
 }
 
 int
 hist_set_offs(struct hist *hist, size_t line, size_t curr)
 {
-	if (hist->cur == NULL)
+	struct hist_item	*h;
+
+	if ((h = cur(hist)) == NULL)
 		return (-1);
 
-	hist->cur->line_off = line;
-	hist->cur->current_off = line;
+	h->line_off = line;
+	h->current_off = curr;
 	return (0);
 }
 
 const char *
 hist_nth(struct hist *hist, size_t n)
 {
-	size_t			 i;
-	struct hist_item	*h;
-
-	i = 0;
-	TAILQ_FOREACH(h, &hist->head, entries) {
-		if (i++ == n)
-			return (h->str);
-	}
-	return (NULL);
+	if (n >= hist->size)
+		return (NULL);
+	return (item(hist, n)->str);
 }
 
 const char *
 hist_prev(struct hist *hist)
 {
-	struct hist_item	*h;
-	int			 wrap = hist->flags & HIST_WRAP;
+	int	 wrap = hist->flags & HIST_WRAP;
 
-	if (hist->cur == NULL && !wrap)
+	if (hist->off == -1 && !wrap)
 		return (NULL);
 
-	if (hist->cur == NULL ||
-	    (h = TAILQ_PREV(hist->cur, mhist, entries)) == NULL) {
-		if (!wrap || (h = TAILQ_LAST(&hist->head, mhist)) == NULL)
+	if (hist->off <= 0) {
+		if (!wrap || hist->size == 0)
 			return (NULL);
 		hist->off = hist->size - 1;
 	} else
 		hist->off--;
 
-	hist->cur = h;
-	return (h->str);
+	hist->gen++;
+	return (cur(hist)->str);
 }
 
 const char *
 hist_next(struct hist *hist)
 {
-	struct hist_item	*h;
-	int			 wrap = hist->flags & HIST_WRAP;
+	int	 wrap = hist->flags & HIST_WRAP;
 
-	if (hist->cur == NULL && !wrap)
+	if (hist->off == -1 && !wrap)
 		return (NULL);
 
-	if (hist->cur == NULL ||
-	    (h = TAILQ_NEXT(hist->cur, entries)) == NULL) {
-		if (!wrap || (h = TAILQ_FIRST(&hist->head)) == NULL)
+	if (hist->off == -1 || (size_t)hist->off + 1 >= hist->size) {
+		if (!wrap || hist->size == 0)
 			return (NULL);
 		hist->off = 0;
 	} else
 		hist->off++;
 
-	hist->cur = h;
-	return (h->str);
+	hist->gen++;
+	return (cur(hist)->str);
 }
 
 void
 hist_seek_start(struct hist *hist)
 {
 	hist->off = -1;
-	hist->cur = NULL;
+	hist->gen++;
 }
 
 int
 hist_push(struct hist *hist, const char *str)
 {
 	struct hist_item	*h;
+	const char		*d;
 
-	if ((h = calloc(1, sizeof(*h))) == NULL)
-		return (-1);
+	d = intern(str);
 
-	if ((h->str = strdup(str)) == NULL) {
-		free(h);
+	if (hist->off != -1)
+		hist_erase_from(hist, hist->off + 1);
+	if (reserve(hist) == -1) {
+		intern_free(d);
 		return (-1);
 	}
 
-	if (hist->cur != NULL)
-		hist_erase_from(hist, TAILQ_NEXT(hist->cur, entries));
-	hist->cur = h;
-	hist->off++;
-	hist->size++;
-	TAILQ_INSERT_TAIL(&hist->head, h, entries);
+	h = item(hist, hist->size);
+	memset(h, 0, sizeof(*h));
+	h->str = d;
+	hist->off = hist->size++;
+	hist->gen++;
 	return (0);
 }
 
@@ -238,21 +323,32 @@ int
 hist_prepend(struct hist *hist, const char *str)
 {
 	struct hist_item	*h;
+	const char		*d;
+	size_t			 i;
 
-	if (hist->cur == NULL)
+	if (hist->off == -1)
 		return (-1);
 
-	if ((h = calloc(1, sizeof(*h))) == NULL)
-		return (-1);
+	/* older than what we keep */
+	if (hist->depth != 0 && hist->size == hist->depth)
+		return (0);
 
-	if ((h->str = strdup(str)) == NULL) {
-		free(h);
+	d = intern(str);
+	if (reserve(hist) == -1) {
+		intern_free(d);
 		return (-1);
 	}
 
+	/* shift the current item and the following ones */
+	for (i = hist->size; i > (size_t)hist->off; --i)
+		*item(hist, i) = *item(hist, i - 1);
+
+	h = item(hist, hist->off);
+	memset(h, 0, sizeof(*h));
+	h->str = d;
 	hist->size++;
 	hist->off++;
-	TAILQ_INSERT_BEFORE(hist->cur, h, entries);
+	hist->gen++;
 	return (0);
 }
 
@@ -260,23 +356,30 @@ int
 hist_append(struct hist *hist, const char *str)
 {
 	struct hist_item	*h;
+	const char		*d;
 
 	/*
 	 * Not sure.  The minibuffer needs to append even when there
 	 * are no items.
 	 */
-	if (hist->cur == NULL && !(hist->flags & HIST_WRAP))
+	if (hist->off == -1 && !(hist->flags & HIST_WRAP))
 		return (-1);
 
-	if ((h = calloc(1, sizeof(*h))) == NULL)
-		return (-1);
+	/* don't drop the current item for the future ones */
+	if (hist->depth != 0 && hist->size == hist->depth &&
+	    hist->off <= 0)
+		return (0);
 
-	if ((h->str = strdup(str)) == NULL) {
-		free(h);
+	d = intern(str);
+	if (reserve(hist) == -1) {
+		intern_free(d);
 		return (-1);
 	}
 
+	h = item(hist, hist->size);
+	memset(h, 0, sizeof(*h));
+	h->str = d;
 	hist->size++;
-	TAILQ_INSERT_TAIL(&hist->head, h, entries);
+	hist->gen++;
 	return (0);
 }
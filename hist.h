@@ -21,10 +21,13 @@ struct hist;
 
 struct hist	*hist_new(int);
 void		 hist_free(struct hist *);
+void		 hist_set_depth(struct hist *, size_t);
 void		 hist_erase(struct hist *);
 
+unsigned int	 hist_generation(struct hist *);
 size_t		 hist_size(struct hist *);
 size_t		 hist_off(struct hist *);
+size_t		 hist_memory(struct hist *);
 
 const char	*hist_cur(struct hist *);
 int		 hist_cur_offs(struct hist *, size_t *, size_t *);
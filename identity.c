@@ -16,6 +16,8 @@
 
 #include "compat.h"
 
+#include <sys/wait.h>
+
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,9 +26,12 @@
 #include <unistd.h>
 
 #include "certs.h"
+#include "ev.h"
 #include "fs.h"
+#include "pages.h"
 #include "parser.h"
 #include "telescope.h"
+#include "ui.h"
 
 #ifndef nitems
 #define nitems(x)	(sizeof(x) / sizeof((x)[0]))
@@ -50,7 +55,7 @@ struct cmd {
 };
 
 static const struct cmd cmds[] = {
-	{ "generate",	cmd_generate,	"[-t type] name" },
+	{ "generate",	cmd_generate,	"[-j jobs] [-t type] name ..." },
 	{ "remove",	cmd_remove,	"name" },
 	{ "import",	cmd_import,	"-C cert [-K key] name" },
 	{ "export",	cmd_export,	"-C cert name" },
@@ -65,25 +70,52 @@ static const struct cmd cmds[] = {
  * their the dependencies.
  */
 
-const uint8_t	*about_about;
-size_t		 about_about_len;
-const uint8_t	*about_blank;
-size_t		 about_blank_len;
-const uint8_t	*about_crash;
-size_t		 about_crash_len;
-const uint8_t	*about_help;
-size_t		 about_help_len;
-const uint8_t	*about_license;
-size_t		 about_license_len;
-const uint8_t	*about_new;
-size_t		 about_new_len;
-const uint8_t	*bookmarks;
-size_t		 bookmarks_len;
+const struct page_lines	 about_about_lines;
+const struct page_lines	 about_blank_lines;
+const struct page_lines	 about_crash_lines;
+const struct page_lines	 about_help_lines;
+const struct page_lines	 about_license_lines;
+const struct page_lines	 about_new_lines;
+const struct page_lines	 bookmarks_lines;
 
 const struct parser gemtext_parser, textplain_parser, textpatch_parser;
 
 void	 load_page_from_str(struct tab *tab, const char *page) { return; }
+int	 gemtext_load_lines(struct tab *t, const struct page_lines *p) { return 1; }
+int	 gemtext_load_records(struct buffer *b, const char *c, size_t l) { return 1; }
 void	 erase_buffer(struct buffer *buffer) { return; }
+void	 ui_on_tab_loaded(struct tab *tab) { return; }
+void	 ui_on_tab_refresh(struct tab *tab) { return; }
+
+unsigned int
+ev_idle(void (*cb)(int, int, void *), void *udata)
+{
+	return 0;
+}
+
+int
+ev_idle_cancel(unsigned int id)
+{
+	return 0;
+}
+
+int
+ev_add(int fd, int ev, void (*cb)(int, int, void *), void *udata)
+{
+	return -1;
+}
+
+int
+ev_del(int fd)
+{
+	return 0;
+}
+
+void
+start_loading_anim(struct tab *tab)
+{
+	return;
+}
 
 static void __dead
 usage(void)
@@ -139,7 +171,7 @@ main(int argc, char **argv)
 			continue;
 
 		fs_init();
-		if (certs_init(certs_file) == -1)
+		if (certs_init(certs_file) == -1 || certs_load() == -1)
 			errx(1, "failed to initialize the cert store.");
 		return (cmd->fn(cmd, argc, argv));
 	}
@@ -149,22 +181,85 @@ main(int argc, char **argv)
 }
 
 static int
-cmd_generate(const struct cmd *cmd, int argc, char **argv)
+generate(const char *name, int keytype)
 {
-	const char		*name;
 	char			 path[PATH_MAX];
-	int			 ch, r;
-	int			 ec = 1;
+	int			 r;
+
+	r = snprintf(path, sizeof(path), "%s%s", cert_dir, name);
+	if (r < 0 || (size_t)r >= sizeof(path)) {
+		warnx("%s: path too long", name);
+		return -1;
+	}
 
-	while ((ch = getopt(argc, argv, "t:")) != -1) {
+	if (cert_new(name, path, keytype) == -1) {
+		warnx("%s: failure generating the key", name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Generate the identities in up to jobs child processes at a time,
+ * as creating a key, RSA in particular, is slow.
+ */
+static int
+generate_batch(char **names, int n, int keytype, int jobs)
+{
+	pid_t			 pid;
+	int			 i = 0, running = 0, failed = 0, status;
+
+	while (i < n || running > 0) {
+		if (i < n && running < jobs) {
+			switch (pid = fork()) {
+			case -1:
+				err(1, "fork");
+			case 0:
+				_exit(generate(names[i], keytype) == -1);
+			}
+			running++;
+			i++;
+			continue;
+		}
+
+		if (wait(&status) == -1)
+			err(1, "wait");
+		running--;
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+
+	return failed ? -1 : 0;
+}
+
+static int
+cmd_generate(const struct cmd *cmd, int argc, char **argv)
+{
+	const char		*errstr;
+	long			 ncpu;
+	int			 ch, jobs = 0;
+	int			 keytype = CERT_KEY_EC;
+
+	while ((ch = getopt(argc, argv, "j:t:")) != -1) {
 		switch (ch) {
+		case 'j':
+			jobs = strtonum(optarg, 1, 256, &errstr);
+			if (errstr != NULL)
+				errx(1, "jobs is %s: %s", errstr, optarg);
+			break;
 		case 't':
 			if (!strcasecmp(optarg, "ec")) {
-				ec = 1;
+				keytype = CERT_KEY_EC;
+				break;
+			}
+			if (!strcasecmp(optarg, "p256") ||
+			    !strcasecmp(optarg, "p-256")) {
+				keytype = CERT_KEY_P256;
 				break;
 			}
 			if (!strcasecmp(optarg, "rsa")) {
-				ec = 0;
+				keytype = CERT_KEY_RSA;
 				break;
 			}
 			errx(1, "Unknown key type requested: %s", optarg);
@@ -176,18 +271,23 @@ cmd_generate(const struct cmd *cmd, int argc, char **argv)
 	argc -= optind;
 	argv += optind;
 
-	if (argc != 1)
+	if (argc == 0)
 		cmd_usage(cmd);
 
-	name = *argv;
-
-	r = snprintf(path, sizeof(path), "%s%s", cert_dir, name);
-	if (r < 0 || (size_t)r >= sizeof(path))
-		errx(1, "path too long");
+	if (argc == 1) {
+		if (generate(*argv, keytype) == -1)
+			exit(1);
+		return 0;
+	}
 
-	if (cert_new(name, path, ec) == -1)
-		errx(1, "failure generating the key");
+	if (jobs == 0) {
+		if ((ncpu = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+			ncpu = 1;
+		jobs = MIN(ncpu, argc);
+	}
 
+	if (generate_batch(argv, argc, keytype, jobs) == -1)
+		exit(1);
 	return 0;
 }
 
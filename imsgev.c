@@ -16,8 +16,12 @@
 
 #include "compat.h"
 
+#include <stdio.h>
+#include <string.h>
+
 #include "ev.h"
 #include "imsgev.h"
+#include "perf.h"
 
 void
 imsg_event_add(struct imsgev *iev)
@@ -36,12 +40,24 @@ imsg_compose_event(struct imsgev *iev, uint16_t type, uint32_t peerid,
 	int	ret;
 
 	if ((ret = imsg_compose(&iev->ibuf, type, peerid, pid, fd, data,
-	    datalen) != -1))
+	    datalen) != -1)) {
+		perf_count(PERF_IMSG_OUT, 1);
+		perf_count(PERF_IMSG_OUT_BYTES, datalen);
 		imsg_event_add(iev);
+	}
 
 	return ret;
 }
 
+void
+imsg_close_event(struct imsgev *iev, struct ibuf *ibuf)
+{
+	perf_count(PERF_IMSG_OUT, 1);
+	perf_count(PERF_IMSG_OUT_BYTES, ibuf_size(ibuf) - IMSG_HEADER_SIZE);
+	imsg_close(&iev->ibuf, ibuf);
+	imsg_event_add(iev);
+}
+
 int
 ibuf_borrow_str(struct ibuf *ibuf, char **data)
 {
@@ -53,3 +69,15 @@ ibuf_borrow_str(struct ibuf *ibuf, char **data)
 		return -1;
 	return 0;
 }
+
+/* Borrow the next NUL-terminated string and skip it. */
+int
+ibuf_next_str(struct ibuf *ibuf, char **data)
+{
+	size_t		 len;
+
+	if ((*data = ibuf_data(ibuf)) == NULL ||
+	    (len = strnlen(*data, ibuf_size(ibuf))) == ibuf_size(ibuf))
+		return -1;
+	return ibuf_skip(ibuf, len + 1);
+}
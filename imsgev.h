@@ -25,22 +25,52 @@ struct imsgev {
 enum imsg_type {
 	/* ui <-> net */
 	IMSG_GET,		/* struct get_req, peerid is the tab id */
+	IMSG_PRECONNECT,	/* struct get_req, only the host matters */
 	IMSG_ERR,
-	IMSG_CHECK_CERT,
+	IMSG_CHECK_CERT,	/* resumed, known (int) + hash string */
 	IMSG_CERT_STATUS,
 	IMSG_FAULTY_GEMSERVER,
 	IMSG_REPLY,		/* reply code (int) + meta string */
-	IMSG_PROCEED,
+	IMSG_BACKOFF,		/* int, seconds waiting for a 44 to expire */
+	IMSG_PROCEED,		/* optional int, parse the gemtext body */
 	IMSG_STOP,
+	IMSG_BACKGROUND,	/* int, whether the tab is not shown */
 	IMSG_BUF,
+	IMSG_SHM_BUF,		/* struct shmring_chunk */
+	IMSG_BUF_ACK,		/* size_t, the body bytes handled */
+	IMSG_DOWNLOAD_PROGRESS,	/* size_t, bytes saved so far */
 	IMSG_EOF,
 	IMSG_QUIT,
+	IMSG_NET_CONF,		/* struct net_conf */
+	IMSG_DNS_FLUSH,
+	IMSG_PERF,		/* replied with the perf_counters */
+	IMSG_TRACE,		/* fd is the trace file */
+	IMSG_RECORD,		/* fd is the capture to write */
+	IMSG_REPLAY,		/* int paced, fd is the capture to read */
+	IMSG_TOFU,		/* host[:port] and hash strings, repeated */
+	IMSG_SHM_RING,		/* size_t, fd is the ring for the bodies */
+
+	/* ui <-> persist */
+	IMSG_PERSIST_OPEN,	/* struct persist_open */
+	IMSG_PERSIST_DATA,
+	IMSG_PERSIST_CLOSE,
+	IMSG_PERSIST_UNLINK,	/* the path */
+	IMSG_PERSIST_ERR,	/* the error string */
 
 	/* ui <-> ctl */
 	IMSG_CTL_OPEN_URL,
+	IMSG_CTL_OPEN_URLS,	/* NUL-terminated URLs, replies the tab ids */
+	IMSG_CTL_LAZY_URLS,	/* the same, but the tabs aren't loaded yet */
+	IMSG_CTL_PERF,		/* the reply is a text in many chunks */
+	IMSG_CTL_TABS,		/* a line per tab */
+	IMSG_CTL_CURRENT,	/* the current tab */
+	IMSG_CTL_CACHE,		/* the in-memory cache stats */
+	IMSG_CTL_END,		/* end of a reply */
 };
 
 void		 imsg_event_add(struct imsgev *);
 int		 imsg_compose_event(struct imsgev *, uint16_t, uint32_t, pid_t, int, const void *, uint16_t);
+void		 imsg_close_event(struct imsgev *, struct ibuf *);
 
 int		 ibuf_borrow_str(struct ibuf *, char **);
+int		 ibuf_next_str(struct ibuf *, char **);
@@ -0,0 +1,200 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * A process-wide table of strings, mostly URLs, kept once no matter
+ * how many times they're used.  Every string carries a reference
+ * count and its hash, so other tables can index the interned strings
+ * by their address without hashing them again: two interned strings
+ * are equal only if they're the same pointer.
+ */
+
+#include "compat.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "utils.h"
+#include "xwrapper.h"
+
+struct istr {
+	uint32_t	 hash;
+	unsigned int	 refs;
+	char		 str[];
+};
+
+static struct ohash	 strings;
+static int		 initialized;
+
+static inline struct istr *
+istr(const char *str)
+{
+	return (struct istr *)(str - offsetof(struct istr, str));
+}
+
+static void
+strings_init(unsigned int sz)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct istr, str),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	ohash_init(&strings, sz, &info);
+	initialized = 1;
+}
+
+static unsigned int
+lookup(const char *str, size_t len, uint32_t *hash)
+{
+	if (!initialized)
+		strings_init(10);
+
+	*hash = fnv1a(FNV1A_INIT, str, len);
+	return ohash_lookup_interval(&strings, str, str + len, *hash);
+}
+
+/* return the interned copy of str, with a new reference */
+const char *
+intern(const char *str)
+{
+	return intern_mem(str, strlen(str));
+}
+
+/* like intern, for the len bytes at str that needn't be terminated */
+const char *
+intern_mem(const char *str, size_t len)
+{
+	struct istr	*is;
+	unsigned int	 slot;
+	uint32_t	 hash;
+
+	slot = lookup(str, len, &hash);
+	if ((is = ohash_find(&strings, slot)) != NULL) {
+		is->refs++;
+		return is->str;
+	}
+
+	is = xmalloc(sizeof(*is) + len + 1);
+	is->hash = hash;
+	is->refs = 1;
+	memcpy(is->str, str, len);
+	is->str[len] = '\0';
+	ohash_insert(&strings, slot, is);
+	return is->str;
+}
+
+/* the interned copy of str, if any, without taking a reference */
+const char *
+intern_lookup(const char *str)
+{
+	struct istr	*is;
+	uint32_t	 hash;
+
+	if ((is = ohash_find(&strings, lookup(str, strlen(str),
+	    &hash))) == NULL)
+		return NULL;
+	return is->str;
+}
+
+/* another reference to an interned string */
+const char *
+intern_ref(const char *str)
+{
+	istr(str)->refs++;
+	return str;
+}
+
+void
+intern_free(const char *str)
+{
+	struct istr	*is;
+
+	if (str == NULL)
+		return;
+
+	is = istr(str);
+	if (--is->refs != 0)
+		return;
+
+	ohash_remove(&strings, ohash_lookup_interval(&strings, str,
+	    str + strlen(str), is->hash));
+	free(is);
+}
+
+/*
+ * Make room for n more strings, so that interning them in bulk never
+ * grows the table.  The strings already there are moved to a table
+ * of the right size.
+ */
+void
+intern_reserve(size_t n)
+{
+	struct ohash	 old;
+	struct istr	*is;
+	unsigned int	 slot, sz = 10;
+
+	if (initialized)
+		n += ohash_entries(&strings);
+
+	/* ohash grows past 3/4 */
+	while (sz < 30 && ((size_t)1 << sz) * 3 < n * 4)
+		sz++;
+
+	if (!initialized) {
+		strings_init(sz);
+		return;
+	}
+
+	old = strings;
+	strings_init(sz);
+	for (is = ohash_first(&old, &slot); is != NULL;
+	    is = ohash_next(&old, &slot))
+		ohash_insert(&strings, ohash_lookup_interval(&strings,
+		    is->str, is->str + strlen(is->str), is->hash), is);
+	ohash_delete(&old);
+}
+
+/* the memory held by the strings; n is set to how many there are */
+size_t
+intern_memory(size_t *n)
+{
+	struct istr	*is;
+	unsigned int	 i;
+	size_t		 size;
+
+	*n = 0;
+	if (!initialized)
+		return 0;
+
+	*n = ohash_entries(&strings);
+	size = hash_memory(&strings);
+	for (is = ohash_first(&strings, &i); is != NULL;
+	    is = ohash_next(&strings, &i))
+		size += sizeof(*is) + strlen(is->str) + 1;
+	return size;
+}
+
+uint32_t
+intern_hash(const char *str)
+{
+	return istr(str)->hash;
+}
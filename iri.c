@@ -28,16 +28,32 @@
 
 /* TODO: URI -> IRI.  accept IRI but emit always URI */
 
-static inline int
-cpstr(const char *start, const char *till, char *buf, size_t len)
-{
-	size_t		slen = till - start;
+/*
+ * A URL as parsed: the fields point inside the string, nothing is
+ * copied.
+ */
+struct field {
+	const char	*p;
+	size_t		 len;
+};
+
+struct parsed {
+	struct field	 scheme;
+	struct field	 uinfo;
+	struct field	 host;
+	struct field	 port;
+	struct field	 path;
+	struct field	 query;
+	struct field	 fragment;
+	uint16_t	 portnum;
+	int		 flags;
+};
 
-	if (slen + 1 >= len)
-		return (-1);
-	memcpy(buf, start, slen);
-	buf[slen] = '\0';
-	return (0);
+static inline void
+setf(struct field *f, const char *start, const char *till)
+{
+	f->p = start;
+	f->len = till - start;
 }
 
 static inline int
@@ -116,7 +132,7 @@ advance_segment_nz_nc(const char *s)
 }
 
 static const char *
-parse_scheme(const char *s, struct iri *iri)
+parse_scheme(const char *s, struct parsed *u)
 {
 	const char	*t = s;
 
@@ -129,16 +145,14 @@ parse_scheme(const char *s, struct iri *iri)
 	    *t == '.')
 		t++;
 
-	if (cpstr(s, t, iri->iri_scheme, sizeof(iri->iri_scheme)) == -1)
-		return (NULL);
-
-	iri->iri_flags |= IH_SCHEME;
+	setf(&u->scheme, s, t);
+	u->flags |= IH_SCHEME;
 	return (t);
 }
 
 /* userinfo is always optional */
 static const char *
-parse_uinfo(const char *s, struct iri *iri)
+parse_uinfo(const char *s, struct parsed *u)
 {
 	const char	*t = s;
 
@@ -154,14 +168,13 @@ parse_uinfo(const char *s, struct iri *iri)
 	if (*t != '@')
 		return (s);
 
-	if (cpstr(s, t, iri->iri_uinfo, sizeof(iri->iri_uinfo)) == -1)
-		return (NULL);
-	iri->iri_flags |= IH_UINFO;
+	setf(&u->uinfo, s, t);
+	u->flags |= IH_UINFO;
 	return (t + 1);
 }
 
 static const char *
-parse_host(const char *s, struct iri *iri)
+parse_host(const char *s, struct parsed *u)
 {
 	const char	*t = s;
 
@@ -177,9 +190,8 @@ parse_host(const char *s, struct iri *iri)
 		if (*t == '\0')
 			return (NULL);
 		t++;
-		if (cpstr(s, t, iri->iri_host, sizeof(iri->iri_host)) == -1)
-			return (NULL);
-		iri->iri_flags |= IH_HOST;
+		setf(&u->host, s, t);
+		u->flags |= IH_HOST;
 		return (t);
 	}
 
@@ -192,62 +204,63 @@ parse_host(const char *s, struct iri *iri)
 			break;
 	}
 
-	if (cpstr(s, t, iri->iri_host, sizeof(iri->iri_host)) == -1)
-		return (NULL);
-	iri->iri_flags |= IH_HOST;
+	setf(&u->host, s, t);
+	u->flags |= IH_HOST;
 	return (t);
 }
 
 static const char *
-parse_port(const char *s, struct iri *iri)
+parse_port(const char *s, struct parsed *u)
 {
 	const char	*t = s;
-	const char	*errstr;
+	long		 port = 0;
 
-	while (isdigit((unsigned char)*t))
+	while (isdigit((unsigned char)*t)) {
+		port = port * 10 + *t - '0';
+		if (port > UINT16_MAX)
+			return (NULL);
 		t++;
-	if (cpstr(s, t, iri->iri_portstr, sizeof(iri->iri_portstr)) == -1)
-		return (NULL);
-	iri->iri_port = strtonum(iri->iri_portstr, 1, UINT16_MAX, &errstr);
-	if (errstr)
+	}
+	if (port == 0)
 		return (NULL);
-	iri->iri_flags |= IH_PORT;
+	setf(&u->port, s, t);
+	u->portnum = port;
+	u->flags |= IH_PORT;
 	return (t);
 }
 
 static const char *
-parse_authority(const char *s, struct iri *iri)
+parse_authority(const char *s, struct parsed *u)
 {
 	const char	*t;
 
-	if ((t = parse_uinfo(s, iri)) == NULL)
+	if ((t = parse_uinfo(s, u)) == NULL)
 		return (NULL);
 
-	if ((t = parse_host(t, iri)) == NULL)
+	if ((t = parse_host(t, u)) == NULL)
 		return (NULL);
 
 	if (*t == ':')
-		return (parse_port(t + 1, iri));
+		return (parse_port(t + 1, u));
 
 	return (t);
 }
 
 static const char *
-parse_path_abempty(const char *s, struct iri *iri)
+parse_path_abempty(const char *s, struct parsed *u)
 {
 	const char	*t = s;
 
 	while (*t == '/')
 		t = advance_segment(t + 1);
 
-	if (cpstr(s, t, iri->iri_path, sizeof(iri->iri_path)) == -1)
-		return (NULL);
-	iri->iri_flags |= IH_PATH;
+	setf(&u->path, s, t);
+	u->flags |= IH_PATH;
 	return (t);
 }
 
 static const char *
-parse_path_absolute(const char *s, struct iri *iri)
+parse_path_absolute(const char *s, struct parsed *u)
 {
 	const char	*t;
 
@@ -261,14 +274,13 @@ parse_path_absolute(const char *s, struct iri *iri)
 			t = advance_segment(t + 1);
 	}
 
-	if (cpstr(s, t, iri->iri_path, sizeof(iri->iri_path)) == -1)
-		return (NULL);
-	iri->iri_flags |= IH_PATH;
+	setf(&u->path, s, t);
+	u->flags |= IH_PATH;
 	return (t);
 }
 
 static const char *
-parse_path_rootless(const char *s, struct iri *iri)
+parse_path_rootless(const char *s, struct parsed *u)
 {
 	const char	*t;
 
@@ -278,14 +290,13 @@ parse_path_rootless(const char *s, struct iri *iri)
 	while (*t == '/')
 		t = advance_segment(t + 1);
 
-	if (cpstr(s, t, iri->iri_path, sizeof(iri->iri_path)) == -1)
-		return (NULL);
-	iri->iri_flags |= IH_PATH;
+	setf(&u->path, s, t);
+	u->flags |= IH_PATH;
 	return (t);
 }
 
 static const char *
-parse_path_noscheme(const char *s, struct iri *iri)
+parse_path_noscheme(const char *s, struct parsed *u)
 {
 	const char	*t;
 
@@ -295,62 +306,61 @@ parse_path_noscheme(const char *s, struct iri *iri)
 	while (*t == '/')
 		t = advance_segment(t + 1);
 
-	if (cpstr(s, t, iri->iri_path, sizeof(iri->iri_path)) == -1)
-		return (NULL);
-	iri->iri_flags |= IH_PATH;
+	setf(&u->path, s, t);
+	u->flags |= IH_PATH;
 	return (t);
 }
 
 static const char *
-parse_path_empty(const char *s, struct iri *iri)
+parse_path_empty(const char *s, struct parsed *u)
 {
-	iri->iri_path[0] = '\0';
-	iri->iri_flags |= IH_PATH;
+	setf(&u->path, s, s);
+	u->flags |= IH_PATH;
 	return (s);
 }
 
 static const char *
-parse_hier(const char *s, struct iri *iri)
+parse_hier(const char *s, struct parsed *u)
 {
 	const char	*t;
 
 	if (!strncmp(s, "//", 2)) {
-		if ((t = parse_authority(s + 2, iri)) == NULL)
+		if ((t = parse_authority(s + 2, u)) == NULL)
 			return (NULL);
-		return (parse_path_abempty(t, iri));
+		return (parse_path_abempty(t, u));
 	}
 
-	if ((t = parse_path_absolute(s, iri)) != NULL)
+	if ((t = parse_path_absolute(s, u)) != NULL)
 		return (t);
 
-	if ((t = parse_path_rootless(s, iri)) != NULL)
+	if ((t = parse_path_rootless(s, u)) != NULL)
 		return (t);
 
-	return (parse_path_empty(s, iri));
+	return (parse_path_empty(s, u));
 }
 
 static const char *
-parse_relative(const char *s, struct iri *iri)
+parse_relative(const char *s, struct parsed *u)
 {
 	const char	*t = s;
 
 	if (!strncmp(s, "//", 2)) {
-		if ((t = parse_authority(s + 2, iri)) == NULL)
+		if ((t = parse_authority(s + 2, u)) == NULL)
 			return (NULL);
-		return (parse_path_abempty(t, iri));
+		return (parse_path_abempty(t, u));
 	}
 
-	if ((t = parse_path_absolute(s, iri)) != NULL)
+	if ((t = parse_path_absolute(s, u)) != NULL)
 		return (t);
 
-	if ((t = parse_path_noscheme(s, iri)) != NULL)
+	if ((t = parse_path_noscheme(s, u)) != NULL)
 		return (t);
 
-	return (parse_path_empty(s, iri));
+	return (parse_path_empty(s, u));
 }
 
 static const char *
-parse_qf(const char *s, int flag, struct iri *iri, char *buf, size_t bufsize)
+parse_qf(const char *s, int flag, struct parsed *u, struct field *f)
 {
 	const char	*n, *t = s;
 
@@ -363,36 +373,33 @@ parse_qf(const char *s, int flag, struct iri *iri, char *buf, size_t bufsize)
 			break;
 	}
 
-	if (cpstr(s, t, buf, bufsize) == -1)
-		return (NULL);
-	iri->iri_flags |= flag;
+	setf(f, s, t);
+	u->flags |= flag;
 	return (t);
 }
 
 static int
-parse_uri(const char *s, struct iri *iri)
+parse_uri(const char *s, struct parsed *u)
 {
-	iri->iri_flags = 0;
+	memset(u, 0, sizeof(*u));
 
-	if ((s = parse_scheme(s, iri)) == NULL)
+	if ((s = parse_scheme(s, u)) == NULL)
 		return (-1);
 
 	if (*s != ':')
 		return (-1);
 
-	if ((s = parse_hier(s + 1, iri)) == NULL)
+	if ((s = parse_hier(s + 1, u)) == NULL)
 		return (-1);
 
 	if (*s == '?') {
-		s = parse_qf(s + 1, IH_QUERY, iri, iri->iri_query,
-		    sizeof(iri->iri_query));
+		s = parse_qf(s + 1, IH_QUERY, u, &u->query);
 		if (s == NULL)
 			return (-1);
 	}
 
 	if (*s == '#') {
-		s = parse_qf(s + 1, IH_FRAGMENT, iri, iri->iri_fragment,
-		    sizeof(iri->iri_fragment));
+		s = parse_qf(s + 1, IH_FRAGMENT, u, &u->fragment);
 		if (s == NULL)
 			return (-1);
 	}
@@ -404,21 +411,19 @@ parse_uri(const char *s, struct iri *iri)
 }
 
 static int
-parse_relative_ref(const char *s, struct iri *iri)
+parse_relative_ref(const char *s, struct parsed *u)
 {
-	if ((s = parse_relative(s, iri)) == NULL)
+	if ((s = parse_relative(s, u)) == NULL)
 		return (-1);
 
 	if (*s == '?') {
-		s = parse_qf(s + 1, IH_QUERY, iri, iri->iri_query,
-		    sizeof(iri->iri_query));
+		s = parse_qf(s + 1, IH_QUERY, u, &u->query);
 		if (s == NULL)
 			return (-1);
 	}
 
 	if (*s == '#') {
-		s = parse_qf(s + 1, IH_FRAGMENT, iri, iri->iri_fragment,
-		    sizeof(iri->iri_fragment));
+		s = parse_qf(s + 1, IH_FRAGMENT, u, &u->fragment);
 		if (s == NULL)
 			return (-1);
 	}
@@ -430,83 +435,95 @@ parse_relative_ref(const char *s, struct iri *iri)
 }
 
 static int
-parse(const char *s, struct iri *iri)
+parse(const char *s, struct parsed *u)
 {
-	iri->iri_flags = 0;
+	memset(u, 0, sizeof(*u));
 
 	if (s == NULL)
 		return (0);
 
-	if (parse_uri(s, iri) == -1) {
-		iri->iri_flags = 0;
-		if (parse_relative_ref(s, iri) == -1)
+	if (parse_uri(s, u) == -1) {
+		memset(u, 0, sizeof(*u));
+		if (parse_relative_ref(s, u) == -1)
 			return (-1);
 	}
 
 	return (0);
 }
 
-static inline void
-lowerify(char *s)
-{
-	for (; *s; ++s)
-		*s = tolower((unsigned char)*s);
-}
-
+/*
+ * Take the given fields of src, as described in RFC 3986 section
+ * 5.2.2.  Scheme, host and path are always set, even if empty.
+ */
 static void
-cpfields(struct iri *dest, const struct iri *src, int flags)
+take(struct parsed *dest, const struct parsed *src, int flags)
 {
 	if (flags & IH_SCHEME) {
-		dest->iri_flags |= IH_SCHEME;
-		if (src->iri_flags & IH_SCHEME)
-			memcpy(dest->iri_scheme, src->iri_scheme,
-			    sizeof(dest->iri_scheme));
-		lowerify(dest->iri_scheme);
-	}
-	if (flags & IH_UINFO) {
-		if (src->iri_flags & IH_UINFO) {
-			memcpy(dest->iri_uinfo, src->iri_uinfo,
-			    sizeof(dest->iri_uinfo));
-			dest->iri_flags |= IH_UINFO;
-		}
+		dest->flags |= IH_SCHEME;
+		if (src->flags & IH_SCHEME)
+			dest->scheme = src->scheme;
+	}
+	if ((flags & IH_UINFO) && (src->flags & IH_UINFO)) {
+		dest->flags |= IH_UINFO;
+		dest->uinfo = src->uinfo;
 	}
 	if (flags & IH_HOST) {
-		dest->iri_flags |= IH_HOST;
-		if (src->iri_flags & IH_HOST)
-			memcpy(dest->iri_host, src->iri_host,
-			    sizeof(dest->iri_host));
-		lowerify(dest->iri_host);
-	}
-	if (flags & IH_PORT) {
-		if (src->iri_flags & IH_PORT) {
-			dest->iri_port = src->iri_port;
-			memcpy(dest->iri_portstr, src->iri_portstr,
-			    sizeof(dest->iri_portstr));
-			dest->iri_flags |= IH_PORT;
-		}
+		dest->flags |= IH_HOST;
+		if (src->flags & IH_HOST)
+			dest->host = src->host;
+	}
+	if ((flags & IH_PORT) && (src->flags & IH_PORT)) {
+		dest->flags |= IH_PORT;
+		dest->port = src->port;
+		dest->portnum = src->portnum;
 	}
 	if (flags & IH_PATH) {
-		dest->iri_flags |= IH_PATH;
-		if (src->iri_flags & IH_PATH)
-			memcpy(dest->iri_path, src->iri_path,
-			    sizeof(dest->iri_path));
-	}
-	if (flags & IH_QUERY) {
-		if (src->iri_flags & IH_QUERY) {
-			dest->iri_flags |= IH_QUERY;
-			memcpy(dest->iri_query, src->iri_query,
-			    sizeof(dest->iri_query));
-		}
+		dest->flags |= IH_PATH;
+		if (src->flags & IH_PATH)
+			dest->path = src->path;
 	}
-	if (flags & IH_FRAGMENT) {
-		if (src->iri_flags & IH_FRAGMENT) {
-			dest->iri_flags |= IH_FRAGMENT;
-			memcpy(dest->iri_fragment, src->iri_fragment,
-			    sizeof(dest->iri_fragment));
-		}
+	if ((flags & IH_QUERY) && (src->flags & IH_QUERY)) {
+		dest->flags |= IH_QUERY;
+		dest->query = src->query;
+	}
+	if ((flags & IH_FRAGMENT) && (src->flags & IH_FRAGMENT)) {
+		dest->flags |= IH_FRAGMENT;
+		dest->fragment = src->fragment;
 	}
 }
 
+/* the output buffer of iri_resolve, always NUL-terminated */
+struct out {
+	char		*buf;
+	size_t		 len;
+	size_t		 cap;
+	int		 err;
+};
+
+static void
+put(struct out *o, const char *s, size_t len, int lower)
+{
+	size_t		 i;
+
+	if (o->err || len >= o->cap - o->len) {
+		o->err = 1;
+		return;
+	}
+
+	for (i = 0; i < len; ++i)
+		o->buf[o->len + i] = lower ? tolower((unsigned char)s[i]) : s[i];
+	o->len += len;
+	o->buf[o->len] = '\0';
+}
+
+static inline void
+putf(struct out *o, const struct field *f, int lower, struct iri_span *sp)
+{
+	sp->off = o->len;
+	put(o, f->p, f->len, lower);
+	sp->len = o->len - sp->off;
+}
+
 static inline int
 remove_dot_segments(char *buf, ptrdiff_t bufsize)
 {
@@ -538,105 +555,258 @@ remove_dot_segments(char *buf, ptrdiff_t bufsize)
 	return (-1);
 }
 
-static inline int
-mergepath(char *buf, size_t bufsize, int abs, const char *base, const char *r)
+/* Write the reference path r merged with the base one. */
+static void
+mergepath(struct out *o, int abs, const struct field *base,
+    const struct field *r)
 {
+	static const struct field slash = { "/", 1 };
 	const char	*s;
+	size_t		 i;
 
-	if (base == NULL || *base == '\0')
-		base = "/";
-	if (r == NULL || *r == '\0')
-		r = "/";
+	if (base->len == 0)
+		base = &slash;
+	if (r->len == 0)
+		r = &slash;
 
-	if (bufsize == 0)
-		return (-1);
-	buf[0] = '\0';
+	if (abs && base->len == 1 && *base->p == '/') {
+		put(o, "/", 1, 0);
+		if (*r->p == '/')
+			put(o, r->p + 1, r->len - 1, 0);
+		else
+			put(o, r->p, r->len, 0);
+		return;
+	}
 
-	if (abs && (*base == '\0' || !strcmp(base, "/"))) {
-		if (*r == '/')
-			r++;
-		strlcpy(buf, "/", bufsize);
-		strlcat(buf, r, bufsize);
-		return (0);
+	for (s = NULL, i = base->len; i > 0; --i) {
+		if (base->p[i - 1] == '/') {
+			s = base->p + i - 1;
+			break;
+		}
 	}
 
-	if ((s = strrchr(base, '/')) != NULL) {
-		cpstr(base, s + 1, buf, bufsize);
-		if (*r == '/')
-			r++;
+	if (s == NULL) {
+		put(o, r->p, r->len, 0);
+		return;
 	}
-	if (strlcat(buf, r, bufsize) >= bufsize) {
-		errno = ENAMETOOLONG;
-		return (-1);
+
+	put(o, base->p, s + 1 - base->p, 0);
+	if (*r->p == '/')
+		put(o, r->p + 1, r->len - 1, 0);
+	else
+		put(o, r->p, r->len, 0);
+}
+
+#define PATH_COPY	0	/* take the path as is, minus the dot segments */
+#define PATH_ASIS	1	/* take it verbatim */
+#define PATH_MERGE	2	/* merge the reference path with the base one */
+
+/*
+ * Compute the fields of the target URL for the reference r relative
+ * to b, as in RFC 3986 section 5.2.2, and return how to build its
+ * path.
+ */
+static int
+target(struct parsed *t, const struct parsed *b, const struct parsed *r)
+{
+	memset(t, 0, sizeof(*t));
+	take(t, r, IH_FRAGMENT);
+
+	if (r->flags & IH_SCHEME) {
+		take(t, r, r->flags);
+		return (PATH_COPY);
 	}
 
-	return (0);
+	take(t, b, IH_SCHEME);
+
+	if (r->flags & IH_HOST) {
+		take(t, r, IH_AUTHORITY|IH_PATH|IH_QUERY);
+		return (PATH_COPY);
+	}
+
+	take(t, b, IH_AUTHORITY);
+
+	if ((r->flags & IH_PATH) && r->path.len == 0) {
+		take(t, b, IH_PATH);
+		if (r->flags & IH_QUERY)
+			take(t, r, IH_QUERY);
+		else
+			take(t, b, IH_QUERY);
+		return (PATH_ASIS);
+	}
+
+	take(t, r, IH_QUERY);
+	if ((r->flags & IH_PATH) && *r->path.p == '/') {
+		take(t, r, IH_PATH);
+		return (PATH_COPY);
+	}
+
+	t->flags |= IH_PATH;
+	return (PATH_MERGE);
 }
 
+/*
+ * Resolve str against base, if not NULL, and write the result in buf
+ * as iri_unparse would.  If f is not NULL, it's filled with where the
+ * fields are in buf.  This doesn't allocate nor use any static
+ * storage, and is a lot cheaper than iri_parse.  The path is merged
+ * in buf before the dot segments are removed, so buf may need to be
+ * a bit larger than the result.
+ */
 int
-iri_parse(const char *base, const char *str, struct iri *iri)
+iri_resolve(const char *base, const char *str, char *buf, size_t len,
+    struct iri_fields *f)
 {
-	static struct iri	ibase, iparsed;
+	struct parsed	 b, r, t;
+	struct iri_fields fields;
+	struct out	 o;
+	const struct field empty = { "", 0 };
+	int		 how, need_ss;
 
-	memset(iri, 0, sizeof(*iri));
+	if (f == NULL)
+		f = &fields;
 
+	memset(&b, 0, sizeof(b));
 	if (base == NULL) {
-		ibase.iri_flags = 0;
-		if (parse_uri(str, &iparsed) == -1) {
+		if (parse_uri(str, &r) == -1) {
 			errno = EINVAL;
 			return (-1);
 		}
 	} else {
-		if (parse_uri(base, &ibase) == -1 ||
-		    parse(str, &iparsed) == -1) {
+		if (parse_uri(base, &b) == -1 || parse(str, &r) == -1) {
 			errno = EINVAL;
 			return (-1);
 		}
 	}
 
-	cpfields(iri, &iparsed, IH_FRAGMENT);
+	how = target(&t, &b, &r);
 
-	if (iparsed.iri_flags & IH_SCHEME) {
-		cpfields(iri, &iparsed, iparsed.iri_flags);
-		remove_dot_segments(iri->iri_path, sizeof(iri->iri_path));
-		return (0);
-	}
+	memset(f, 0, sizeof(*f));
+	f->str = buf;
+	f->flags = t.flags;
+	f->portnum = t.portnum;
 
-	cpfields(iri, &ibase, IH_SCHEME);
+	if (len == 0) {
+		errno = ENOBUFS;
+		return (-1);
+	}
+	o.buf = buf;
+	o.len = 0;
+	o.cap = len < UINT16_MAX ? len : UINT16_MAX;
+	o.err = 0;
+	buf[0] = '\0';
 
-	if (iparsed.iri_flags & IH_HOST) {
-		cpfields(iri, &iparsed, IH_AUTHORITY|IH_PATH|IH_QUERY);
-		remove_dot_segments(iri->iri_path, sizeof(iri->iri_path));
-		return (0);
+	if (t.flags & IH_SCHEME) {
+		putf(&o, &t.scheme, 1, &f->scheme);
+		put(&o, ":", 1, 0);
 	}
 
-	cpfields(iri, &ibase, IH_AUTHORITY);
+	/* file is a quirky scheme */
+	need_ss = (t.flags & IH_AUTHORITY) ||
+	    (f->scheme.len == 4 && !strncmp(buf + f->scheme.off, "file", 4));
+	if (need_ss)
+		put(&o, "//", 2, 0);
+
+	if (t.flags & IH_UINFO) {
+		putf(&o, &t.uinfo, 0, &f->uinfo);
+		put(&o, "@", 1, 0);
+	}
+	if (t.flags & IH_HOST)
+		putf(&o, &t.host, 1, &f->host);
+	if (t.flags & IH_PORT) {
+		put(&o, ":", 1, 0);
+		putf(&o, &t.port, 0, &f->port);
+	}
 
-	if ((iparsed.iri_flags & IH_PATH) && *iparsed.iri_path == '\0') {
-		cpfields(iri, &ibase, IH_PATH);
-		if (iparsed.iri_flags & IH_QUERY)
-			cpfields(iri, &iparsed, IH_QUERY);
-		else
-			cpfields(iri, &ibase, IH_QUERY);
-		return (0);
+	f->path.off = o.len;
+	if (how == PATH_MERGE)
+		mergepath(&o, b.flags & IH_AUTHORITY,
+		    (b.flags & IH_PATH) ? &b.path : &empty,
+		    (r.flags & IH_PATH) ? &r.path : &empty);
+	else
+		put(&o, t.path.p, t.path.len, 0);
+	if (o.err) {
+		errno = ENOBUFS;
+		return (-1);
+	}
+	if (how != PATH_ASIS) {
+		remove_dot_segments(buf + f->path.off, o.len - f->path.off + 1);
+		o.len = f->path.off + strlen(buf + f->path.off);
 	}
+	f->path.len = o.len - f->path.off;
 
-	cpfields(iri, &iparsed, IH_QUERY);
-	if ((iparsed.iri_flags & IH_PATH) && *iparsed.iri_path == '/')
-		cpfields(iri, &iparsed, IH_PATH);
-	else {
-		if (!(ibase.iri_flags & IH_PATH))
-			ibase.iri_path[0] = '\0';
-		if (!(iparsed.iri_flags & IH_PATH))
-			iparsed.iri_path[0] = '\0';
-		if (mergepath(iri->iri_path, sizeof(iri->iri_path),
-		    ibase.iri_flags & IH_AUTHORITY, ibase.iri_path,
-		    iparsed.iri_path) == -1)
+	/* an authority is always followed by an absolute path */
+	if ((t.flags & IH_AUTHORITY) && buf[f->path.off] != '/') {
+		if (o.len + 1 >= o.cap) {
+			errno = ENOBUFS;
 			return (-1);
-		iri->iri_flags |= IH_PATH;
+		}
+		memmove(buf + f->path.off + 1, buf + f->path.off,
+		    f->path.len + 1);
+		buf[f->path.off++] = '/';
+		o.len++;
 	}
-	if (remove_dot_segments(iri->iri_path, sizeof(iri->iri_path)) == -1)
+
+	if (t.flags & IH_QUERY) {
+		put(&o, "?", 1, 0);
+		putf(&o, &t.query, 0, &f->query);
+	}
+	if (t.flags & IH_FRAGMENT) {
+		put(&o, "#", 1, 0);
+		putf(&o, &t.fragment, 0, &f->fragment);
+	}
+
+	if (o.err) {
+		errno = ENOBUFS;
 		return (-1);
+	}
+	return (0);
+}
+
+static inline int
+cpfield(char *dst, size_t size, const struct iri_fields *f,
+    const struct iri_span *sp)
+{
+	if (sp->len >= size)
+		return (-1);
+	memcpy(dst, f->str + sp->off, sp->len);
+	dst[sp->len] = '\0';
+	return (0);
+}
+
+/*
+ * Kept for the users of struct iri: resolve the URL with iri_resolve
+ * and copy the fields out.
+ */
+int
+iri_parse(const char *base, const char *str, struct iri *iri)
+{
+	struct iri_fields f;
+	char		 buf[IRI_RESOLVE_MAX];
+
+	if (iri_resolve(base, str, buf, sizeof(buf), &f) == -1)
+		return (-1);
+
+	if (cpfield(iri->iri_scheme, sizeof(iri->iri_scheme), &f,
+	    &f.scheme) == -1 ||
+	    cpfield(iri->iri_uinfo, sizeof(iri->iri_uinfo), &f,
+	    &f.uinfo) == -1 ||
+	    cpfield(iri->iri_host, sizeof(iri->iri_host), &f,
+	    &f.host) == -1 ||
+	    cpfield(iri->iri_portstr, sizeof(iri->iri_portstr), &f,
+	    &f.port) == -1 ||
+	    cpfield(iri->iri_path, sizeof(iri->iri_path), &f,
+	    &f.path) == -1 ||
+	    cpfield(iri->iri_query, sizeof(iri->iri_query), &f,
+	    &f.query) == -1 ||
+	    cpfield(iri->iri_fragment, sizeof(iri->iri_fragment), &f,
+	    &f.fragment) == -1) {
+		errno = EINVAL;
+		return (-1);
+	}
+
+	iri->iri_port = f.portnum;
+	iri->iri_flags = f.flags;
 	return (0);
 }
 
@@ -676,11 +846,82 @@ iri_unparse(const struct iri *i, char *buf, size_t buflen)
 	return (0);
 }
 
+static inline int
+hexval(int c)
+{
+	if (isdigit((unsigned char)c))
+		return (c - '0');
+	return (tolower((unsigned char)c) - 'a' + 10);
+}
+
+/*
+ * Length of the percent-encoded UTF-8 sequence at s if it decodes to
+ * a codepoint that can be shown as is, 0 otherwise.  The C1 controls
+ * and the bidi overrides and isolates are kept escaped.
+ */
+static int
+human_seq(const char *s, uint8_t *out)
+{
+	uint32_t	 cp;
+	int		 i, n;
+
+	if (!pctenc(s))
+		return (0);
+	out[0] = hexval(s[1]) << 4 | hexval(s[2]);
+	if (out[0] >= 0xC2 && out[0] <= 0xDF)
+		n = 2;
+	else if (out[0] >= 0xE0 && out[0] <= 0xEF)
+		n = 3;
+	else if (out[0] >= 0xF0 && out[0] <= 0xF4)
+		n = 4;
+	else
+		return (0);
+
+	cp = out[0] & (0x7F >> n);
+	for (i = 1; i < n; ++i) {
+		s += 3;
+		if (!pctenc(s))
+			return (0);
+		out[i] = hexval(s[1]) << 4 | hexval(s[2]);
+		if ((out[i] & 0xC0) != 0x80)
+			return (0);
+		cp = cp << 6 | (out[i] & 0x3F);
+	}
+
+	/* overlong, surrogates, out of range */
+	if ((n == 3 && cp < 0x800) || (n == 4 && cp < 0x10000) ||
+	    (cp >= 0xD800 && cp <= 0xDFFF) || cp > 0x10FFFF)
+		return (0);
+	if (cp <= 0x9F || (cp >= 0x202A && cp <= 0x202E) ||
+	    (cp >= 0x2066 && cp <= 0x2069))
+		return (0);
+	return (n);
+}
+
+/*
+ * Unparse the IRI for display: the percent-encoded UTF-8 sequences
+ * are decoded, the rest is left escaped.
+ */
 int
 iri_human(const struct iri *iri, char *buf, size_t buflen)
 {
-	memset(buf, 0, buflen);
-	return (-1);
+	uint8_t		 seq[4];
+	char		*s, *t;
+	int		 n;
+
+	if (iri_unparse(iri, buf, buflen) == -1)
+		return (-1);
+
+	for (s = t = buf; *s != '\0';) {
+		if (*s == '%' && (n = human_seq(s, seq)) != 0) {
+			memcpy(t, seq, n);
+			t += n;
+			s += n * 3;
+		} else
+			*t++ = *s++;
+	}
+	*t = '\0';
+	return (0);
 }
 
 int
@@ -737,11 +978,18 @@ iri_setquery(struct iri *iri, const char *p)
 
 int
 iri_urlescape(const char *path, char *buf, size_t len)
+{
+	return (iri_urlescapen(path, strlen(path), buf, len));
+}
+
+/* Like iri_urlescape, but escape only the first plen bytes of path. */
+int
+iri_urlescapen(const char *path, size_t plen, char *buf, size_t len)
 {
 	const char	*hex = "0123456789abcdef";
-	const uint8_t	*p = path;
+	const uint8_t	*p = path, *end = p + plen;
 
-	while (*p) {
+	while (p < end) {
 		if (len == 0)
 			break;
 
@@ -762,7 +1010,7 @@ iri_urlescape(const char *path, char *buf, size_t len)
 		p++;
 	}
 
-	if (len == 0 || *p)
+	if (len == 0 || p < end)
 		return (-1);
 
 	*buf = '\0';
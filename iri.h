@@ -38,6 +38,35 @@ struct iri {
 	int		iri_flags;
 };
 
+/*
+ * Where the fields of a URL are in a string, see iri_resolve.  Only
+ * those with the corresponding IH_* flag set are meaningful.  As in
+ * struct iri, the path doesn't include the slash that separates it
+ * from the authority when it's relative.
+ */
+struct iri_span {
+	uint16_t	off;
+	uint16_t	len;
+};
+
+struct iri_fields {
+	const char	*str;
+	struct iri_span	 scheme;
+	struct iri_span	 uinfo;
+	struct iri_span	 host;
+	struct iri_span	 port;
+	struct iri_span	 path;
+	struct iri_span	 query;
+	struct iri_span	 fragment;
+	uint16_t	 portnum;
+	int		 flags;
+};
+
+/* enough for every struct iri */
+#define IRI_RESOLVE_MAX	(sizeof(struct iri) + 16)
+
+int	iri_resolve(const char *, const char *, char *, size_t,
+	    struct iri_fields *);
 int	iri_parse(const char *, const char *, struct iri *);
 int	iri_unparse(const struct iri *, char *, size_t);
 int	iri_human(const struct iri *, char *, size_t);
@@ -45,6 +74,7 @@ int	iri_setport(struct iri *, const char *);
 int	iri_setquery(struct iri *, const char *);
 
 int	iri_urlescape(const char *, char *, size_t);
+int	iri_urlescapen(const char *, size_t, char *, size_t);
 int	iri_urlunescape(const char *, char *, size_t);
 
 #endif /* IRI_H */
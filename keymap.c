@@ -27,6 +27,8 @@
 
 #define CTRL(n)	((n)&0x1F)
 
+unsigned int kmap_generation;
+
 static struct keytable {
 	const char	*p;
 	int		 k;
@@ -118,14 +120,77 @@ static struct keytable {
 	{ NULL, 0 },
 };
 
+/* the keytable sorted by name and by key, built on first use */
+static struct keytable	**byname, **bykey;
+static size_t		  keytablelen;
+
+static int
+byname_cmp(const void *a, const void *b)
+{
+	const struct keytable	*i = *(struct keytable **)a;
+	const struct keytable	*j = *(struct keytable **)b;
+
+	return strcmp(i->p, j->p);
+}
+
+static int
+bykey_cmp(const void *a, const void *b)
+{
+	const struct keytable	*i = *(struct keytable **)a;
+	const struct keytable	*j = *(struct keytable **)b;
+
+	if (i->k != j->k)
+		return i->k < j->k ? -1 : 1;
+	/* keep the first name for the keys that have more */
+	return i < j ? -1 : i > j;
+}
+
+static void
+keytable_init(void)
+{
+	size_t	 i;
+
+	if (byname != NULL)
+		return;
+
+	for (keytablelen = 0; keytable[keytablelen].p != NULL; ++keytablelen)
+		/* nop */ ;
+
+	byname = xcalloc(keytablelen, sizeof(*byname));
+	bykey = xcalloc(keytablelen, sizeof(*bykey));
+	for (i = 0; i < keytablelen; ++i)
+		byname[i] = bykey[i] = &keytable[i];
+	qsort(byname, keytablelen, sizeof(*byname), byname_cmp);
+	qsort(bykey, keytablelen, sizeof(*bykey), bykey_cmp);
+}
+
 int
 kbd(const char *key)
 {
-	struct keytable *t;
+	struct keytable	*t;
+	size_t		 len, lo, hi, mid;
+	int		 r;
+
+	keytable_init();
 
-	for (t = keytable; t->p != NULL; ++t) {
-		if (!strncmp(key, t->p, strlen(t->p)))
+	/* the name goes up to the next space */
+	for (len = 0; key[len] != '\0' && !isspace((unsigned char)key[len]);
+	     ++len)
+		/* nop */ ;
+
+	lo = 0;
+	hi = keytablelen;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		t = byname[mid];
+		if ((r = strncmp(key, t->p, len)) == 0 && t->p[len] != '\0')
+			r = -1;
+		if (r == 0)
 			return t->k;
+		if (r < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
 	}
 
         return *key;
@@ -134,13 +199,78 @@ kbd(const char *key)
 const char *
 unkbd(int k)
 {
-	struct keytable *t;
+	size_t	 lo, hi, mid;
+
+	keytable_init();
 
-	for (t = keytable; t->p != NULL; ++t) {
-		if (k == t->k)
-			return t->p;
+	/* the leftmost entry for k */
+	lo = 0;
+	hi = keytablelen;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (bykey[mid]->k < k)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
 
+	if (lo < keytablelen && bykey[lo]->k == k)
+		return bykey[lo]->p;
+	return NULL;
+}
+
+static inline size_t
+kmap_hash(int meta, int key)
+{
+	uint32_t	 h;
+
+	h = (uint32_t)key * 2654435761U;
+	return h ^ (meta ? 0x9e3779b9U : 0);
+}
+
+/*
+ * Insert the entry in the hash table, growing it to keep the load
+ * under one half.
+ */
+static void
+kmap_index(struct kmap *map, struct keymap *entry)
+{
+	struct keymap	*k;
+	size_t		 i, mask;
+
+	if ((map->nkeys + 1) * 2 > map->idxsz) {
+		free(map->idx);
+		map->idxsz = map->idxsz == 0 ? 16 : map->idxsz * 2;
+		map->idx = xcalloc(map->idxsz, sizeof(*map->idx));
+		map->nkeys = 0;
+		TAILQ_FOREACH(k, &map->m, keymaps)
+			if (k != entry)
+				kmap_index(map, k);
+	}
+
+	mask = map->idxsz - 1;
+	for (i = kmap_hash(entry->meta, entry->key) & mask;
+	     map->idx[i] != NULL; i = (i + 1) & mask)
+		/* nop */ ;
+	map->idx[i] = entry;
+	map->nkeys++;
+}
+
+static struct keymap *
+kmap_find(struct kmap *map, int meta, int key)
+{
+	struct keymap	*k;
+	size_t		 i, mask;
+
+	if (map->idxsz == 0)
+		return NULL;
+
+	mask = map->idxsz - 1;
+	for (i = kmap_hash(meta, key) & mask; (k = map->idx[i]) != NULL;
+	     i = (i + 1) & mask) {
+		if (k->meta == meta && k->key == key)
+			return k;
+	}
 	return NULL;
 }
 
@@ -150,6 +280,8 @@ kmap_define_key(struct kmap *map, const char *key, void (*fn)(struct buffer*))
 	int ctrl, meta, k;
 	struct keymap	*entry;
 
+	kmap_generation++;
+
 again:
 	if ((ctrl = !strncmp(key, "C-", 2)))
 		key += 2;
@@ -168,15 +300,13 @@ again:
 	while (*key != '\0' && isspace(*key))
 		++key;
 
-	TAILQ_FOREACH(entry, &map->m, keymaps) {
-		if (entry->meta == meta && entry->key == k) {
-			if (*key == '\0') {
-				entry->fn = fn;
-				return 1;
-			}
-			map = &entry->map;
-			goto again;
+	if ((entry = kmap_find(map, meta, k)) != NULL) {
+		if (*key == '\0') {
+			entry->fn = fn;
+			return 1;
 		}
+		map = &entry->map;
+		goto again;
 	}
 
 	entry = xcalloc(1, sizeof(*entry));
@@ -186,6 +316,7 @@ again:
 	TAILQ_INIT(&entry->map.m);
 
 	TAILQ_INSERT_TAIL(&map->m, entry, keymaps);
+	kmap_index(map, entry);
 
         if (*key != '\0') {
 		map = &entry->map;
@@ -202,18 +333,14 @@ lookup_key(struct kmap **map, struct thiskey *key, struct buffer *buf)
 {
 	struct keymap *k;
 
-	TAILQ_FOREACH(k, &(*map)->m, keymaps) {
-		if (k->meta == key->meta &&
-		    k->key == key->key) {
-			if (k->fn == NULL) {
-				*map = &k->map;
-				return LK_ADVANCED_MAP;
-			} else {
-				k->fn(buf);
-				return LK_MATCHED;
-			}
-		}
+	if ((k = kmap_find(*map, key->meta, key->key)) == NULL)
+		return LK_UNBOUND;
+
+	if (k->fn == NULL) {
+		*map = &k->map;
+		return LK_ADVANCED_MAP;
 	}
 
-	return LK_UNBOUND;
+	k->fn(buf);
+	return LK_MATCHED;
 }
@@ -24,9 +24,17 @@ struct buffer;
 struct kmap {
 	TAILQ_HEAD(map, keymap)	m;
 	void			(*unhandled_input)(void);
+
+	/* hash table over m, see keymap.c */
+	struct keymap		**idx;
+	size_t			 idxsz;
+	size_t			 nkeys;
 };
 extern struct kmap global_map, minibuffer_map;
 
+/* bumped every time a binding changes */
+extern unsigned int kmap_generation;
+
 typedef void(interactivefn)(struct buffer *);
 
 struct keymap {
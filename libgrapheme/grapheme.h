@@ -8,6 +8,24 @@
 
 #define GRAPHEME_INVALID_CODEPOINT UINT32_C(0xFFFD)
 
+/*
+ * Retained state of a line break search, so that the breaks of a
+ * string are found in a single forward pass.  The members are
+ * private.
+ */
+typedef struct grapheme_internal_line_break_state {
+	const void *src;
+	size_t len;
+	size_t off;
+	bool utf8;
+	uint_least8_t last_non_cm_or_zwj_prop;
+	uint_least8_t last_non_sp_prop;
+	uint_least8_t last_non_sp_cm_or_zwj_prop;
+	uint_least8_t lb25_level;
+	bool lb21a_flag;
+	bool ri_even;
+} GRAPHEME_LINE_BREAK_STATE;
+
 size_t grapheme_decode_utf8(const char *, size_t, uint_least32_t *);
 size_t grapheme_encode_utf8(uint_least32_t, char *, size_t);
 
@@ -31,6 +49,10 @@ size_t grapheme_next_line_break_utf8(const char *, size_t);
 size_t grapheme_next_sentence_break_utf8(const char *, size_t);
 size_t grapheme_next_word_break_utf8(const char *, size_t);
 
+void grapheme_line_break_init(GRAPHEME_LINE_BREAK_STATE *, const uint_least32_t *, size_t);
+void grapheme_line_break_init_utf8(GRAPHEME_LINE_BREAK_STATE *, const char *, size_t);
+size_t grapheme_next_line_break_state(GRAPHEME_LINE_BREAK_STATE *);
+
 size_t grapheme_to_lowercase(const uint_least32_t *, size_t, uint_least32_t *, size_t);
 size_t grapheme_to_titlecase(const uint_least32_t *, size_t, uint_least32_t *, size_t);
 size_t grapheme_to_uppercase(const uint_least32_t *, size_t, uint_least32_t *, size_t);
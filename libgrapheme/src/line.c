@@ -18,14 +18,14 @@ get_break_prop(uint_least32_t cp)
 }
 
 static size_t
-next_line_break(HERODOTUS_READER *r)
+next_line_break(HERODOTUS_READER *r, GRAPHEME_LINE_BREAK_STATE *s)
 {
 	HERODOTUS_READER tmp;
 	enum line_break_property cp0_prop, cp1_prop, last_non_cm_or_zwj_prop,
 	                         last_non_sp_prop, last_non_sp_cm_or_zwj_prop;
 	uint_least32_t cp;
-	uint_least8_t lb25_level = 0;
-	bool lb21a_flag = false, ri_even = true;
+	uint_least8_t lb25_level;
+	bool lb21a_flag, ri_even;
 
 	/*
 	 * Apply line breaking algorithm (UAX #14), see
@@ -38,13 +38,36 @@ next_line_break(HERODOTUS_READER *r)
 
 	/*
 	 * Initialize the different properties such that we have
-	 * a good state after the state-update in the loop
+	 * a good state after the state-update in the loop, or pick
+	 * up those retained from the previous call
 	 */
-	last_non_cm_or_zwj_prop = LINE_BREAK_PROP_AL; /* according to LB10 */
-	last_non_sp_prop = last_non_sp_cm_or_zwj_prop = NUM_LINE_BREAK_PROPS;
+	if (s == NULL) {
+		last_non_cm_or_zwj_prop = LINE_BREAK_PROP_AL; /* according to LB10 */
+		last_non_sp_prop = last_non_sp_cm_or_zwj_prop = NUM_LINE_BREAK_PROPS;
+		lb25_level = 0;
+		lb21a_flag = false;
+		ri_even = true;
+	} else {
+		last_non_cm_or_zwj_prop = (enum line_break_property)s->last_non_cm_or_zwj_prop;
+		last_non_sp_prop = (enum line_break_property)s->last_non_sp_prop;
+		last_non_sp_cm_or_zwj_prop = (enum line_break_property)s->last_non_sp_cm_or_zwj_prop;
+		lb25_level = s->lb25_level;
+		lb21a_flag = s->lb21a_flag;
+		ri_even = s->ri_even;
+	}
+
+	herodotus_read_codepoint(r, true, &cp);
+	cp0_prop = get_break_prop(cp);
+
+	/*
+	 * A CM or ZWJ right after a break opportunity was not
+	 * attached to anything by LB9 and is an AL according to LB10
+	 */
+	if (cp0_prop == LINE_BREAK_PROP_CM || cp0_prop == LINE_BREAK_PROP_ZWJ) {
+		last_non_cm_or_zwj_prop = LINE_BREAK_PROP_AL;
+	}
 
-	for (herodotus_read_codepoint(r, true, &cp), cp0_prop = get_break_prop(cp);
-	     herodotus_read_codepoint(r, false, &cp) == HERODOTUS_STATUS_SUCCESS;
+	for (; herodotus_read_codepoint(r, false, &cp) == HERODOTUS_STATUS_SUCCESS;
 	     herodotus_read_codepoint(r, true, &cp), cp0_prop = cp1_prop) {
 		/* get property of the right codepoint */
 		cp1_prop = get_break_prop(cp);
@@ -110,9 +133,10 @@ next_line_break(HERODOTUS_READER *r)
 			 *     spot
 			 */
 			if ((lb25_level == 0 ||
-			     lb25_level == 1) &&
+			     lb25_level == 1 ||
+			     lb25_level == 3) &&
 			    cp0_prop == LINE_BREAK_PROP_NU) {
-				/* sequence has begun */
+				/* sequence has begun, possibly anew */
 				lb25_level = 1;
 			} else if ((lb25_level == 1 || lb25_level == 2) &&
 			           (cp0_prop == LINE_BREAK_PROP_NU ||
@@ -486,6 +510,15 @@ next_line_break(HERODOTUS_READER *r)
 		break;
 	}
 
+	if (s != NULL) {
+		s->last_non_cm_or_zwj_prop = (uint_least8_t)last_non_cm_or_zwj_prop;
+		s->last_non_sp_prop = (uint_least8_t)last_non_sp_prop;
+		s->last_non_sp_cm_or_zwj_prop = (uint_least8_t)last_non_sp_cm_or_zwj_prop;
+		s->lb25_level = lb25_level;
+		s->lb21a_flag = lb21a_flag;
+		s->ri_even = ri_even;
+	}
+
 	return herodotus_reader_number_read(r);
 }
 
@@ -496,7 +529,7 @@ grapheme_next_line_break(const uint_least32_t *str, size_t len)
 
 	herodotus_reader_init(&r, HERODOTUS_TYPE_CODEPOINT, str, len);
 
-	return next_line_break(&r);
+	return next_line_break(&r, NULL);
 }
 
 size_t
@@ -506,5 +539,63 @@ grapheme_next_line_break_utf8(const char *str, size_t len)
 
 	herodotus_reader_init(&r, HERODOTUS_TYPE_UTF8, str, len);
 
-	return next_line_break(&r);
+	return next_line_break(&r, NULL);
+}
+
+static void
+line_break_init(GRAPHEME_LINE_BREAK_STATE *s, const void *str, size_t len,
+                bool utf8)
+{
+	s->src = str;
+	s->len = len;
+	s->off = 0;
+	s->utf8 = utf8;
+
+	s->last_non_cm_or_zwj_prop = LINE_BREAK_PROP_AL; /* according to LB10 */
+	s->last_non_sp_prop = s->last_non_sp_cm_or_zwj_prop = NUM_LINE_BREAK_PROPS;
+	s->lb25_level = 0;
+	s->lb21a_flag = false;
+	s->ri_even = true;
+}
+
+void
+grapheme_line_break_init(GRAPHEME_LINE_BREAK_STATE *s,
+                         const uint_least32_t *str, size_t len)
+{
+	line_break_init(s, str, len, false);
+}
+
+void
+grapheme_line_break_init_utf8(GRAPHEME_LINE_BREAK_STATE *s, const char *str,
+                              size_t len)
+{
+	line_break_init(s, str, len, true);
+}
+
+size_t
+grapheme_next_line_break_state(GRAPHEME_LINE_BREAK_STATE *s)
+{
+	HERODOTUS_READER r;
+	size_t ret;
+
+	if (s->src == NULL || s->off >= s->len) {
+		return 0;
+	}
+
+	if (s->utf8) {
+		herodotus_reader_init(&r, HERODOTUS_TYPE_UTF8,
+		                      (const char *)s->src + s->off,
+		                      (s->len == SIZE_MAX) ? SIZE_MAX :
+		                      s->len - s->off);
+	} else {
+		herodotus_reader_init(&r, HERODOTUS_TYPE_CODEPOINT,
+		                      (const uint_least32_t *)s->src + s->off,
+		                      (s->len == SIZE_MAX) ? SIZE_MAX :
+		                      s->len - s->off);
+	}
+
+	ret = next_line_break(&r, s);
+	s->off += ret;
+
+	return ret;
 }
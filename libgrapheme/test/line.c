@@ -1,6 +1,7 @@
 /* See LICENSE file for copyright and license details. */
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 
 #include "../gen/line-test.h"
 #include "../grapheme.h"
@@ -47,6 +48,14 @@ static const struct unit_test_next_break next_line_break[] = {
 		},
 		.output = { 3 },
 	},
+	{
+		.description = "number after a closed number",
+		.input = {
+			.src    = (uint_least32_t *)(uint_least32_t[]){ 0x30, 0x29, 0x30, 0x29 },
+			.srclen = 4,
+		},
+		.output = { 4 },
+	},
 };
 
 static const struct unit_test_next_break_utf8 next_line_break_utf8[] = {
@@ -110,12 +119,64 @@ unit_test_callback_next_line_break_utf8(const void *t, size_t off,
 	                                          name, argv0);
 }
 
+static int
+run_state_tests(const char *argv0)
+{
+	GRAPHEME_LINE_BREAK_STATE s, s8;
+	char buf[1024];
+	size_t i, j, k, len, res, res8, failed;
+
+	/*
+	 * the stateful search has to find the same breaks as the
+	 * conformance tests, in one pass over the codepoints and
+	 * their UTF-8 encoding
+	 */
+	for (i = 0, failed = 0; i < LEN(line_break_test); i++) {
+		for (k = 0, len = 0; k < line_break_test[i].cplen; k++) {
+			len += grapheme_encode_utf8(line_break_test[i].cp[k],
+			                            buf + len, sizeof(buf) - len);
+		}
+		grapheme_line_break_init(&s, line_break_test[i].cp,
+		                         line_break_test[i].cplen);
+		grapheme_line_break_init_utf8(&s8, buf, len);
+
+		for (j = 0, k = 0; ; j++) {
+			res = grapheme_next_line_break_state(&s);
+			res8 = grapheme_next_line_break_state(&s8);
+			if (j == line_break_test[i].lenlen) {
+				if (res == 0 && res8 == 0) {
+					break;
+				}
+			} else if (res == line_break_test[i].len[j]) {
+				/* compare the UTF-8 one by its codepoints */
+				for (len = k + res; k < len; k++) {
+					res8 -= grapheme_encode_utf8(
+						line_break_test[i].cp[k], NULL, 0);
+				}
+				if (res8 == 0) {
+					continue;
+				}
+			}
+			fprintf(stderr, "%s: Failed stateful conformance test "
+			        "%zu \"%s\".\n", argv0, i,
+			        line_break_test[i].descr);
+			failed++;
+			break;
+		}
+	}
+	printf("%s: %zu/%zu stateful conformance tests passed.\n", argv0,
+	       LEN(line_break_test) - failed, LEN(line_break_test));
+
+	return (failed > 0) ? 1 : 0;
+}
+
 int
 main(int argc, char *argv[])
 {
 	(void)argc;
 
-	return run_break_tests(grapheme_next_line_break,
+	return run_state_tests(argv[0]) +
+	       run_break_tests(grapheme_next_line_break,
 	                       line_break_test, LEN(line_break_test),
 	                       argv[0]) +
 	       run_unit_tests(unit_test_callback_next_line_break,
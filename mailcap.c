@@ -24,12 +24,14 @@
 #include <errno.h>
 #include <fnmatch.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "compat.h"
 #include "mailcap.h"
+#include "utils.h"
 #include "xwrapper.h"
 
 #define DEFAULT_MAILCAP_ENTRY "*/*; "DEFAULT_OPENER" %s"
@@ -52,10 +54,30 @@ static void		 argv_free(int, char **);
 
 struct mailcaplist 	 mailcaps = TAILQ_HEAD_INITIALIZER(mailcaps);
 
+/*
+ * The entries for a type, like text/html, and the ones for all the
+ * subtypes of a type, with `*' as subtype, are also indexed by it:
+ * only the other patterns are matched one by one.  Just the first
+ * entry for a key is indexed, since the others can't be found.
+ */
+struct mailcap_key {
+	struct mailcap	*mc;
+	char		 name[];
+};
+
+static struct ohash	 bytype;
+static struct ohash	 bymajor;
+static struct mailcap	**patterns;
+static size_t		 npatterns;
+static size_t		 nmailcaps;
+static int		 index_ready;
+
 static FILE		*find_mailcap_file(void);
 static struct mailcap	*mailcap_new(void);
-static void		 mailcap_expand_cmd(struct mailcap *, char *, char *);
+static void		 mailcap_expand_cmd(struct mailcap *, const char *,
+			    const char *);
 static int		 parse_mailcap_line(char *);
+static void		 mailcap_index(struct mailcap *);
 static struct mailcap 	*mailcap_by_mimetype(const char *);
 
 /* FIXME: $MAILCAPS can override this, but we don't check for that. */
@@ -348,12 +370,13 @@ parse_mailcap_line(char *input)
 		return (-1);
 	}
 	TAILQ_INSERT_TAIL(&mailcaps, mc, mailcaps);
+	mailcap_index(mc);
 
 	return (0);
 }
 
 void
-mailcap_expand_cmd(struct mailcap *mc, char *mt, char *file)
+mailcap_expand_cmd(struct mailcap *mc, const char *mt, const char *file)
 {
 	char		**argv;
 	int		 argc = 0, ret;
@@ -385,16 +408,94 @@ mailcap_expand_cmd(struct mailcap *mc, char *mt, char *file)
 	mc->cmd_argc = argc;
 }
 
+static void
+index_init(void)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct mailcap_key, name),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	if (index_ready)
+		return;
+
+	ohash_init(&bytype, 6, &info);
+	ohash_init(&bymajor, 4, &info);
+	index_ready = 1;
+}
+
+static void
+index_key(struct ohash *h, struct mailcap *mc, size_t len)
+{
+	struct mailcap_key	*k;
+	const char		*end = mc->mime_type + len;
+	unsigned int		 slot;
+
+	slot = ohash_qlookupi(h, mc->mime_type, &end);
+	if (ohash_find(h, slot) != NULL)
+		return;
+
+	k = xmalloc(sizeof(*k) + len + 1);
+	k->mc = mc;
+	memcpy(k->name, mc->mime_type, len);
+	k->name[len] = '\0';
+	ohash_insert(h, slot, k);
+}
+
+static void
+mailcap_index(struct mailcap *mc)
+{
+	const char	*mt = mc->mime_type;
+	size_t		 len, plain;
+
+	index_init();
+	mc->idx = nmailcaps++;
+
+	len = strlen(mt);
+	plain = strcspn(mt, "*?[\\");
+	if (plain == len)
+		index_key(&bytype, mc, len);
+	else if (len >= 2 && plain == len - 1 && mt[plain - 1] == '/')
+		index_key(&bymajor, mc, len - 2);
+	else {
+		patterns = xreallocarray(patterns, npatterns + 1,
+		    sizeof(*patterns));
+		patterns[npatterns++] = mc;
+	}
+}
+
+/*
+ * Find the first entry that matches, in the order of the mailcaps:
+ * the one for the type, the one for its major type, or one of the
+ * patterns that come before them.
+ */
 static struct mailcap *
 mailcap_by_mimetype(const char *mt)
 {
-	struct mailcap	*mc;
+	struct mailcap_key	*k;
+	struct mailcap		*mc = NULL;
+	const char		*slash;
+	size_t			 i;
+
+	index_init();
+
+	if ((k = ohash_find(&bytype, ohash_qlookup(&bytype, mt))) != NULL)
+		mc = k->mc;
 
-	TAILQ_FOREACH(mc, &mailcaps, mailcaps) {
-		if (fnmatch(mc->mime_type, mt, 0) == 0)
-			return (mc);
+	if ((slash = strchr(mt, '/')) != NULL &&
+	    (k = ohash_find(&bymajor, ohash_qlookupi(&bymajor, mt, &slash)))
+	    != NULL && (mc == NULL || k->mc->idx < mc->idx))
+		mc = k->mc;
+
+	for (i = 0; i < npatterns; ++i) {
+		if (mc != NULL && patterns[i]->idx > mc->idx)
+			break;
+		if (fnmatch(patterns[i]->mime_type, mt, 0) == 0)
+			return (patterns[i]);
 	}
-	return (NULL);
+	return (mc);
 }
 
 void
@@ -442,7 +543,7 @@ mailcap_parse(FILE *f)
 }
 
 struct mailcap *
-mailcap_cmd_from_mimetype(char *mime_type, char *filename)
+mailcap_cmd_from_mimetype(const char *mime_type, const char *filename)
 {
 	struct mailcap	*mc = NULL;
 
@@ -27,6 +27,7 @@ struct mailcap {
 #define MAILCAP_COPIOUSOUTPUT 0x2
 	int	 	 	 flags;
 
+	size_t			 idx;		/* in the mailcaps */
 	TAILQ_ENTRY(mailcap) 	 mailcaps;
 };
 
@@ -36,6 +37,6 @@ extern struct mailcaplist 	 mailcaps;
 
 void 	 	 init_mailcap(void);
 void		 mailcap_parse(FILE *);
-struct mailcap	*mailcap_cmd_from_mimetype(char *, char *);
+struct mailcap	*mailcap_cmd_from_mimetype(const char *, const char *);
 
 #endif
@@ -16,56 +16,518 @@
 
 #include "compat.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#if HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "defaults.h"
 #include "ev.h"
+#include "fs.h"
 #include "hist.h"
+#include "intern.h"
 #include "mcache.h"
 #include "parser.h"
+#include "perf.h"
+#include "search.h"
 #include "telescope.h"
+#include "utf8.h"
 #include "utils.h"
 #include "xwrapper.h"
 
 static struct timeval tv = { 5 * 60, 0 };
 static unsigned int timeout;
+static unsigned int cleanup;
+
+static void	clean_old_entries_idle(int, int, void *);
 
 static struct ohash	h;
 static size_t		npages;
 static size_t		tot;
+static size_t		rawtot;
+
+static struct {
+	size_t		 hits;
+	size_t		 disk_hits;
+	size_t		 misses;
+	size_t		 evictions;
+	size_t		 expired;
+	size_t		 served;	/* bytes */
+	long long	 saved;		/* msec of network fetch */
+} stats;
+
+/*
+ * Pages are cached in a flat form of their line list, so that they
+ * can be restored without going through the parser again.  Strings
+ * are stored one after the other in strs and referenced by offset.
+ * The lines and the strings share a single allocation that, for big
+ * enough pages, is kept compressed.
+ *
+ * The same body is often served under different URLs, so bodies are
+ * indexed by a hash of their content and shared between the entries.
+ */
+#define MCACHE_ZMIN	(16 * 1024)
+#define MC_NONE		UINT64_MAX
+
+struct mcache_line {
+	uint32_t		 type;
+	uint32_t		 flags;
+	uint64_t		 line;
+	uint64_t		 alt;
+	uint64_t		 data;	/* offset inside line */
+};
+
+/*
+ * The wrapped form of a cached page, saved when the user moves away
+ * from it and only valid for the settings it was computed with.
+ */
+struct mcache_vline {
+	uint32_t		 line;	/* index of the parent */
+	uint32_t		 flags;
+	uint32_t		 from;
+	uint32_t		 len;
+	uint32_t		 cplen;
+};
+
+struct mcache_body {
+	uint64_t		 hash;
+	int			 refs;
+	int			 indexed;	/* it's in bh */
+	const struct parser	*parser;
+	char			 title[128 + 1];
+	struct mcache_line	*lines;
+	size_t			 nlines;
+	char			*strs;
+	size_t			 strslen;
+	char			*z;		/* compressed lines and strs */
+	size_t			 zlen;
+	size_t			 size;
+	size_t			 rawsize;
+	struct mcache_vline	*vlines;
+	size_t			 nvlines;
+	struct shtext		*live;		/* in use by some tabs */
+	int			 lo_width;
+	int			 lo_fill_column;
+	int			 lo_emojify;
+	int			 lo_pre;
+};
 
 struct mcache_entry {
 	time_t			 ts;
-	const struct parser	*parser;
 	int			 trust;
-	char			*buf;
-	size_t			 buflen;
-	char			 url[];
+	struct mcache_body	*body;
+	size_t			 hits;
+	long			 fetch_ms;	/* time it took to load */
+	TAILQ_ENTRY(mcache_entry) entries;
+	const char		*url;		/* interned */
 };
 
+static struct ohash	bh;
+
+/* least recently used first */
+static TAILQ_HEAD(mcache_lru, mcache_entry) lru = TAILQ_HEAD_INITIALIZER(lru);
+
+static void
+mcache_free_body(struct mcache_body *b)
+{
+	unsigned int	 slot;
+
+	if (--b->refs > 0)
+		return;
+
+	if (b->indexed) {
+		slot = ohash_lookup_memory(&bh, (const char *)&b->hash,
+		    sizeof(b->hash), b->hash);
+		ohash_remove(&bh, slot);
+	}
+
+	tot -= b->size;
+	rawtot -= b->rawsize;
+
+	/* the tabs still showing it keep the text */
+	if (b->live != NULL)
+		b->live->owner = NULL;
+
+	free(b->lines);
+	free(b->z);
+	free(b->vlines);
+	free(b);
+}
+
+/*
+ * The entries are indexed by the address of their interned URL, so
+ * only the intern table compares the strings.
+ */
+static struct mcache_entry *
+mcache_find(const char *url, unsigned int *slot)
+{
+	if ((url = intern_lookup(url)) == NULL)
+		return NULL;
+	*slot = ohash_lookup_memory(&h, (const char *)&url, sizeof(url),
+	    intern_hash(url));
+	return ohash_find(&h, *slot);
+}
+
 static void
 mcache_free_entry(const char *url)
 {
 	struct mcache_entry	*e;
 	unsigned int		 slot;
+	size_t			 len;
 
-	slot = ohash_qlookup(&h, url);
-	if ((e = ohash_remove(&h, slot)) == NULL)
+	if ((e = mcache_find(url, &slot)) == NULL)
 		return;
+	ohash_remove(&h, slot);
 
+	TAILQ_REMOVE(&lru, e, entries);
 	npages--;
-	tot -= e->buflen;
+	len = sizeof(*e) + strlen(e->url) + 1;
+	tot -= len;
+	rawtot -= len;
 
-	free(e->buf);
+	mcache_free_body(e->body);
+	intern_free(e->url);
 	free(e);
 }
 
+/*
+ * Append str to the strings of the body.  mcache_tab already sized the
+ * buffer, so copy up to the NUL without scanning the string again.
+ */
+static uint64_t
+mcache_addstr(struct mcache_body *e, const char *str, size_t avail)
+{
+	size_t	 off;
+	char	*end;
+
+	if (str == NULL)
+		return MC_NONE;
+
+	off = e->strslen;
+	if ((end = memccpy(e->strs + off, str, '\0', avail - off)) == NULL)
+		abort();
+	e->strslen = end - e->strs;
+	return off;
+}
+
+/*
+ * The optional disk tier: an append-only pack file in the cache
+ * directory, holding one record per cached page in the same flat form
+ * used in memory.  It's mapped at startup and indexed by URL; newer
+ * records for the same URL shadow the older ones, which are dropped
+ * when the file gets compacted.  The format is in host byte order,
+ * it's not meant to be moved between machines.
+ */
+#define PACK_MAGIC	0x31435054	/* TPC1 */
+#define PACK_MAXAGE	(30 * 24 * 60 * 60)
+#define PACK_ALIGN(n)	(((n) + 7) & ~(size_t)7)
+
+struct pack_rec {
+	uint32_t		 magic;
+	uint32_t		 urllen;	/* including the NUL */
+	uint64_t		 reclen;
+	int64_t			 ts;
+	int32_t			 trust;
+	uint32_t		 nlines;
+	uint64_t		 strslen;
+	char			 parser[16];
+	char			 title[136];
+	/*
+	 * followed by the url, the lines and the strings, each
+	 * aligned to 8 bytes.
+	 */
+};
+
+struct pack_entry {
+	off_t			 off;
+	size_t			 len;
+	char			 url[];
+};
+
+static struct ohash	 ph;
+static int		 pack_fd = -1;
+static char		*pack_map;
+static size_t		 pack_maplen;
+static off_t		 pack_end;
+static size_t		 pack_live;
+
+static const struct parser *parsers[] = {
+	&gemtext_parser,
+	&gophermap_parser,
+	&textpatch_parser,
+	&textplain_parser,
+};
+
+static const struct parser *
+pack_parser(const char *name)
+{
+	size_t	 i;
+
+	for (i = 0; i < sizeof(parsers) / sizeof(parsers[0]); ++i)
+		if (!strcmp(parsers[i]->name, name))
+			return parsers[i];
+	return NULL;
+}
+
+/* returns the record at off if it's sane, NULL otherwise */
+static const struct pack_rec *
+pack_check(const char *buf, size_t buflen, size_t off)
+{
+	const struct pack_rec	*r;
+	size_t			 need;
+
+	if (buflen - off < sizeof(*r))
+		return NULL;
+
+	r = (const struct pack_rec *)(buf + off);
+	if (r->magic != PACK_MAGIC || r->reclen < sizeof(*r) ||
+	    r->reclen > buflen - off || r->urllen == 0 ||
+	    r->nlines > r->reclen / sizeof(struct mcache_line) ||
+	    r->strslen > r->reclen)
+		return NULL;
+
+	need = sizeof(*r) + PACK_ALIGN(r->urllen) +
+	    r->nlines * sizeof(struct mcache_line) + r->strslen;
+	if (need > r->reclen ||
+	    memchr(r->parser, '\0', sizeof(r->parser)) == NULL ||
+	    memchr(r->title, '\0', sizeof(r->title)) == NULL ||
+	    pack_parser(r->parser) == NULL)
+		return NULL;
+
+	if (buf[off + sizeof(*r) + r->urllen - 1] != '\0')
+		return NULL;
+
+	return r;
+}
+
+static void
+pack_index_add(const char *url, off_t off, size_t len)
+{
+	struct pack_entry	*pe;
+	unsigned int		 slot;
+	size_t			 l;
+
+	slot = ohash_qlookup(&ph, url);
+	if ((pe = ohash_remove(&ph, slot)) != NULL) {
+		pack_live -= pe->len;
+		free(pe);
+		slot = ohash_qlookup(&ph, url);
+	}
+
+	l = strlen(url) + 1;
+	pe = xmalloc(sizeof(*pe) + l);
+	pe->off = off;
+	pe->len = len;
+	memcpy(pe->url, url, l);
+	ohash_insert(&ph, slot, pe);
+	pack_live += len;
+}
+
+/* rewrite the pack file keeping only the live records */
+static int
+pack_compact(void)
+{
+	struct pack_entry	*pe;
+	unsigned int		 i;
+	off_t			 off = 0;
+	int			 fd;
+	char			 path[PATH_MAX];
+
+	strlcpy(path, pagecache_file_tmp, sizeof(path));
+	if ((fd = mkstemp(path)) == -1)
+		return -1;
+
+	for (pe = ohash_first(&ph, &i); pe != NULL; pe = ohash_next(&ph, &i)) {
+		if (write(fd, pack_map + pe->off, pe->len) != (ssize_t)pe->len)
+			goto err;
+		pe->off = off;
+		off += pe->len;
+	}
+
+	if (rename(path, pagecache_file) == -1)
+		goto err;
+
+	munmap(pack_map, pack_maplen);
+	close(pack_fd);
+	pack_fd = fd;
+	pack_end = off;
+	pack_maplen = off;
+	pack_map = NULL;
+	if (pack_maplen != 0) {
+		pack_map = mmap(NULL, pack_maplen, PROT_READ, MAP_SHARED,
+		    pack_fd, 0);
+		if (pack_map == MAP_FAILED)
+			return -1;
+	}
+	return 0;
+
+err:
+	close(fd);
+	unlink(path);
+	return -1;
+}
+
+static void
+pack_close(void)
+{
+	struct pack_entry	*pe;
+	unsigned int		 i;
+
+	for (pe = ohash_first(&ph, &i); pe != NULL; pe = ohash_next(&ph, &i))
+		free(pe);
+	ohash_delete(&ph);
+
+	if (pack_map != NULL)
+		munmap(pack_map, pack_maplen);
+	if (pack_fd != -1)
+		close(pack_fd);
+	pack_map = NULL;
+	pack_maplen = 0;
+	pack_fd = -1;
+}
+
+static void
+pack_open(void)
+{
+	struct ohash_info	 info = {
+		.key_offset = offsetof(struct pack_entry, url),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+	const struct pack_rec	*r;
+	struct stat		 sb;
+	size_t			 off;
+	time_t			 treshold;
+	int			 flags;
+
+	ohash_init(&ph, 5, &info);
+
+	flags = safe_mode ? O_RDONLY : O_RDWR | O_CREAT;
+	if ((pack_fd = open(pagecache_file, flags | O_CLOEXEC, 0600)) == -1) {
+		if (errno != ENOENT)
+			warn("open %s", pagecache_file);
+		return;
+	}
+
+	if (fstat(pack_fd, &sb) == -1 || (uintmax_t)sb.st_size > SIZE_MAX) {
+		pack_close();
+		return;
+	}
+
+	if ((pack_maplen = sb.st_size) != 0) {
+		pack_map = mmap(NULL, pack_maplen, PROT_READ, MAP_SHARED,
+		    pack_fd, 0);
+		if (pack_map == MAP_FAILED) {
+			pack_map = NULL;
+			pack_close();
+			return;
+		}
+	}
+
+	treshold = time(NULL) - PACK_MAXAGE;
+	for (off = 0; (r = pack_check(pack_map, pack_maplen, off)) != NULL;
+	     off += r->reclen) {
+		if (r->ts >= treshold)
+			pack_index_add(pack_map + off + sizeof(*r), off,
+			    r->reclen);
+	}
+	pack_end = off;
+
+	if (safe_mode)
+		return;
+
+	/* drop a partially written record, if any */
+	if ((size_t)pack_end != pack_maplen &&
+	    ftruncate(pack_fd, pack_end) == -1) {
+		pack_close();
+		return;
+	}
+
+	if (pack_end - pack_live > pack_live && pack_compact() == -1)
+		pack_close();
+}
+
+static void
+pack_append(struct mcache_entry *e)
+{
+	static const char	 zeros[8];
+	struct mcache_body	*b;
+	struct pack_rec		 r;
+	struct iovec		 iov[5];
+	size_t			 urllen, linelen, strspad;
+	ssize_t			 w;
+
+	if (pack_fd == -1 || safe_mode)
+		return;
+
+	b = e->body;
+	urllen = strlen(e->url) + 1;
+	linelen = b->nlines * sizeof(*b->lines);
+	strspad = PACK_ALIGN(b->strslen) - b->strslen;
+
+	memset(&r, 0, sizeof(r));
+	r.magic = PACK_MAGIC;
+	r.urllen = urllen;
+	r.reclen = sizeof(r) + PACK_ALIGN(urllen) + linelen +
+	    PACK_ALIGN(b->strslen);
+	r.ts = e->ts;
+	r.trust = e->trust;
+	r.nlines = b->nlines;
+	r.strslen = b->strslen;
+	strlcpy(r.parser, b->parser->name, sizeof(r.parser));
+	strlcpy(r.title, b->title, sizeof(r.title));
+
+	/* the url is followed by its NUL and some padding */
+	iov[0].iov_base = &r;
+	iov[0].iov_len = sizeof(r);
+	iov[1].iov_base = (void *)e->url;
+	iov[1].iov_len = urllen - 1;
+	iov[2].iov_base = (void *)zeros;
+	iov[2].iov_len = PACK_ALIGN(urllen) - urllen + 1;
+	iov[3].iov_base = b->lines;
+	iov[3].iov_len = linelen;
+	iov[4].iov_base = b->strs;
+	iov[4].iov_len = b->strslen;
+
+	if (lseek(pack_fd, pack_end, SEEK_SET) == -1 ||
+	    (w = writev(pack_fd, iov, 5)) == -1 ||
+	    (size_t)w != r.reclen - strspad ||
+	    (strspad != 0 && write(pack_fd, zeros, strspad) != (ssize_t)strspad)) {
+		/* don't leave a broken record behind */
+		if (ftruncate(pack_fd, pack_end) == -1)
+			pack_close();
+		return;
+	}
+
+	pack_index_add(e->url, pack_end, r.reclen);
+	pack_end += r.reclen;
+}
+
 static void
 clean_old_entries(int fd, int ev, void *data)
+{
+	/* it walks the whole cache, so do it when there's nothing else */
+	if ((cleanup = ev_idle(clean_old_entries_idle, NULL)) == 0)
+		clean_old_entries_idle(-1, EV_IDLE, NULL);
+}
+
+static void
+clean_old_entries_idle(int fd, int ev, void *data)
 {
 	struct mcache_entry	*e;
 	unsigned int		 i;
@@ -74,9 +536,12 @@ clean_old_entries(int fd, int ev, void *data)
 	/* delete pages older than an hour */
 	treshold = time(NULL) - 60 * 60;
 
-	for (e = ohash_first(&h, &i); e != NULL; e = ohash_next(&h, &i))
-		if (e->ts < treshold)
+	for (e = ohash_first(&h, &i); e != NULL; e = ohash_next(&h, &i)) {
+		if (e->ts < treshold) {
+			stats.expired++;
 			mcache_free_entry(e->url);
+		}
+	}
 
 	timeout = ev_timer(&tv, clean_old_entries, NULL);
 }
@@ -91,87 +556,821 @@ mcache_init(void)
 		.alloc = hash_alloc,
 	};
 
+	struct ohash_info binfo = {
+		.key_offset = offsetof(struct mcache_body, hash),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
 	ohash_init(&h, 5, &info);
+	ohash_init(&bh, 5, &binfo);
+
+	ev_name(clean_old_entries, "cache expiry timer");
+	ev_name(clean_old_entries_idle, "cache expiry");
+
+	if (disk_cache)
+		pack_open();
+}
+
+static long
+elapsed_ms(const struct timespec *start)
+{
+	struct timespec	 now, diff;
+
+	if (start->tv_sec == 0 && start->tv_nsec == 0)
+		return 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, start, &diff);
+	return diff.tv_sec * 1000 + diff.tv_nsec / 1000000;
+}
+
+/*
+ * Compress the lines and the strings of the body in place, if it's
+ * worth it.
+ */
+static void
+mcache_compress(struct mcache_body *b)
+{
+#if HAVE_ZLIB
+	uLongf	 zlen;
+	size_t	 len;
+	char	*z;
+
+	len = b->nlines * sizeof(*b->lines) + b->strslen;
+	if (len < MCACHE_ZMIN)
+		return;
+
+	zlen = compressBound(len);
+	z = xmalloc(zlen);
+	if (compress2((Bytef *)z, &zlen, (Bytef *)b->lines, len,
+	    Z_BEST_SPEED) != Z_OK || zlen > len - len / 8) {
+		free(z);
+		return;
+	}
+
+	b->z = xrealloc(z, zlen);
+	b->zlen = zlen;
+	b->size -= len - zlen;
+	free(b->lines);
+	b->lines = NULL;
+	b->strs = NULL;
+#endif
+}
+
+static int
+mcache_uncompress(struct mcache_body *b, char **blob)
+{
+#if HAVE_ZLIB
+	uLongf	 len;
+
+	len = b->nlines * sizeof(*b->lines) + b->strslen;
+	*blob = xmalloc(len);
+	if (uncompress((Bytef *)*blob, &len, (Bytef *)b->z, b->zlen) != Z_OK ||
+	    len != b->nlines * sizeof(*b->lines) + b->strslen) {
+		free(*blob);
+		*blob = NULL;
+		return 0;
+	}
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+static uint64_t
+mcache_hash(struct mcache_body *b)
+{
+	uint64_t	 h = FNV1A_INIT;
+
+	h = fnv1a(h, b->parser->name, strlen(b->parser->name));
+	h = fnv1a(h, b->title, strlen(b->title) + 1);
+	return fnv1a(h, b->lines, b->nlines * sizeof(*b->lines) + b->strslen);
+}
+
+/*
+ * Check that the body b, which is not compressed, is the same as the
+ * cached one ob; a matching hash is not enough.
+ */
+static int
+mcache_same_body(struct mcache_body *ob, struct mcache_body *b)
+{
+	char	*blob = NULL;
+	size_t	 len;
+	int	 r;
+
+	if (ob->parser != b->parser || strcmp(ob->title, b->title) != 0 ||
+	    ob->nlines != b->nlines || ob->strslen != b->strslen)
+		return 0;
+
+	len = b->nlines * sizeof(*b->lines) + b->strslen;
+	if (len == 0)
+		return 1;
+
+	if (ob->z != NULL) {
+		if (!mcache_uncompress(ob, &blob))
+			return 0;
+		r = !memcmp(blob, b->lines, len);
+		free(blob);
+		return r;
+	}
+
+	return !memcmp(ob->lines, b->lines, len);
 }
 
 int
 mcache_tab(struct tab *tab)
 {
-	struct mcache_entry	*e;
+	struct mcache_entry	*e, *old;
+	struct mcache_body	*b, *ob;
+	struct mcache_line	*ml;
+	struct line		*l;
 	unsigned int		 slot;
-	size_t			 l, len;
+	size_t			 ul, len, need, nlines = 0, strslen = 0;
 	const char		*url;
-	FILE			*fp;
+	int			 shared = 0;
+
+	TAILQ_FOREACH(l, &tab->buffer.head, lines) {
+		nlines++;
+		if (l->line != NULL)
+			strslen += strlen(l->line) + 1;
+		if (l->alt != NULL)
+			strslen += strlen(l->alt) + 1;
+	}
 
 	url = hist_cur(tab->hist);
-	l = strlen(url);
-	len = sizeof(*e) + l + 1;
+	ul = strlen(url);
+	len = sizeof(*e) + ul + 1;
+
+	/* free any previously cached copies of this page */
+	mcache_free_entry(url);
+
+	if (len + sizeof(*b) + nlines * sizeof(*b->lines) + strslen >
+	    (size_t)cache_size && !disk_cache)
+		return -1;
 
-	e = xcalloc(1, len);
+	e = xcalloc(1, sizeof(*e));
 	e->ts = time(NULL);
-	e->parser = tab->buffer.parser;
 	e->trust = tab->trust;
-	memcpy(e->url, url, l);
+	e->url = intern(url);
 
-	if ((fp = open_memstream(&e->buf, &e->buflen)) == NULL)
-		goto err;
+	b = xcalloc(1, sizeof(*b));
+	b->refs = 1;
+	b->parser = tab->buffer.parser;
+	strlcpy(b->title, tab->buffer.title, sizeof(b->title));
 
-	if (!parser_serialize(&tab->buffer, fp))
-		goto err;
+	b->nlines = nlines;
+	if (nlines != 0 || strslen != 0) {
+		b->lines = xcalloc(1, nlines * sizeof(*b->lines) + strslen);
+		b->strs = (char *)(b->lines + nlines);
+	}
 
-	fclose(fp);
+	ml = b->lines;
+	TAILQ_FOREACH(l, &tab->buffer.head, lines) {
+		ml->type = l->type;
+		ml->flags = l->flags;
+		ml->line = mcache_addstr(b, l->line, strslen);
+		ml->alt = mcache_addstr(b, l->alt, strslen);
+		ml->data = MC_NONE;
+		if (l->data != NULL && l->line != NULL)
+			ml->data = (const char *)l->data - l->line;
+		ml++;
+	}
 
-	/* free any previously cached copies of this page */
-	mcache_free_entry(url);
+	b->rawsize = b->size = sizeof(*b) + nlines * sizeof(*b->lines) +
+	    strslen;
+	e->body = b;
+	e->fetch_ms = elapsed_ms(&tab->load_start);
+
+	/* don't persist pages obtained with a client certificate */
+	if (tab->client_cert == NULL)
+		pack_append(e);
+
+	b->hash = mcache_hash(b);
+	slot = ohash_lookup_memory(&bh, (const char *)&b->hash,
+	    sizeof(b->hash), b->hash);
+	if ((ob = ohash_find(&bh, slot)) != NULL && mcache_same_body(ob, b)) {
+		free(b->lines);
+		free(b);
+		e->body = b = ob;
+		b->refs++;
+		shared = 1;
+		need = len;
+	} else {
+		mcache_compress(b);
+		need = len + b->size;
+	}
+
+	if (need > (size_t)cache_size) {
+		/* a new body isn't accounted yet */
+		if (shared)
+			b->refs--;
+		else {
+			free(b->lines);
+			free(b->z);
+			free(b->vlines);
+			free(b);
+		}
+		intern_free(e->url);
+		free(e);
+		return -1;
+	}
+
+	/* make room evicting the least recently used pages */
+	while (tot + need > (size_t)cache_size &&
+	    (old = TAILQ_FIRST(&lru)) != NULL) {
+		stats.evictions++;
+		mcache_free_entry(old->url);
+	}
+
+	if (!shared) {
+		tot += b->size;
+		rawtot += b->rawsize;
+
+		/* on a collision the body is just not shared */
+		slot = ohash_lookup_memory(&bh, (const char *)&b->hash,
+		    sizeof(b->hash), b->hash);
+		if (ohash_find(&bh, slot) == NULL) {
+			ohash_insert(&bh, slot, b);
+			b->indexed = 1;
+		}
+	}
 
-	slot = ohash_qlookup(&h, url);
+	slot = ohash_lookup_memory(&h, (const char *)&e->url, sizeof(e->url),
+	    intern_hash(e->url));
 	ohash_insert(&h, slot, e);
+	TAILQ_INSERT_TAIL(&lru, e, entries);
 
 	npages++;
-	tot += e->buflen;
+	tot += len;
+	rawtot += len;
 
-	if (!ev_timer_pending(timeout))
+	if (!ev_timer_pending(timeout) && !ev_idle_pending(cleanup))
 		timeout = ev_timer(&tv, clean_old_entries, NULL);
 
 	return 0;
+}
+
+static void
+shtext_drop(struct shtext *st)
+{
+	struct mcache_body	*b = st->owner;
+
+	if (b != NULL)
+		b->live = NULL;
+	free(st->data);
+	free(st);
+}
+
+static struct shtext *
+shtext_new(struct mcache_body *b, char *data, size_t len)
+{
+	struct shtext	*st;
+
+	st = xcalloc(1, sizeof(*st));
+	st->data = data;
+	st->len = len;
+	st->owner = b;
+	st->drop = shtext_drop;
+	if (b != NULL)
+		b->live = st;
+	return st;
+}
+
+/*
+ * Fill the tab with the given flat line list.  The strings are in st,
+ * that the tab then shares with the others restored from the same
+ * body.  Since records could come from the disk, the offsets are
+ * checked.
+ */
+static int
+mcache_restore(struct tab *tab, const struct parser *parser,
+    const char *title, int trust, const struct mcache_line *mls,
+    size_t nlines, struct shtext *st, char *strs, size_t strslen)
+{
+	const struct mcache_line *ml;
+	struct buffer		*buffer = &tab->buffer;
+	struct line		*lines, *l;
+	size_t			 i;
+
+	parser_init(buffer, parser);
+	strlcpy(buffer->title, title, sizeof(buffer->title));
+	buffer->shared = st;
+	st->refs++;
+
+	if (strslen != 0 && strs[strslen - 1] != '\0')
+		goto err;
+
+	if (nlines == 0)
+		goto done;
+
+	lines = arena_calloc(&buffer->line_arena, nlines, sizeof(*lines));
+	for (i = 0; i < nlines; ++i) {
+		ml = &mls[i];
+		l = &lines[i];
+
+		if (ml->type > LINE_FRINGE ||
+		    (ml->line != MC_NONE && ml->line >= strslen) ||
+		    (ml->alt != MC_NONE && ml->alt >= strslen) ||
+		    (ml->data != MC_NONE && (ml->line == MC_NONE ||
+		    ml->data >= strslen - ml->line)))
+			goto err;
+
+		l->type = ml->type;
+		l->flags = ml->flags;
+		if (ml->line != MC_NONE)
+			l->line = strs + ml->line;
+		if (ml->alt != MC_NONE)
+			l->alt = strs + ml->alt;
+		if (ml->data != MC_NONE)
+			l->data = l->line + ml->data;
+		if (l->type == LINE_LINK && l->data != NULL)
+			l->emojiwidth = utf8_swidth_between(l->line,
+			    l->data);
+
+		TAILQ_INSERT_TAIL(&buffer->head, l, lines);
+		parser_index_line(buffer, l);
+	}
+
+done:
+	tab->trust = trust;
+	return 1;
 
 err:
-	if (fp != NULL)
-		fclose(fp);
-	if (e->buf != NULL)
-		free(e->buf);
-	free(e);
-	return -1;
+	erase_buffer(buffer);
+	return 0;
+}
+
+static int
+pack_lookup(const char *url, struct tab *tab)
+{
+	const struct pack_rec	*r;
+	struct pack_entry	*pe;
+	unsigned int		 slot;
+	struct shtext		*st;
+	const char		*rec;
+	char			*buf = NULL, *strs;
+	size_t			 urllen;
+	int			 ret = 0;
+
+	if (pack_fd == -1)
+		return 0;
+
+	slot = ohash_qlookup(&ph, url);
+	if ((pe = ohash_find(&ph, slot)) == NULL)
+		return 0;
+
+	if ((size_t)pe->off + pe->len <= pack_maplen) {
+		rec = pack_map + pe->off;
+	} else {
+		/* appended after the file was mapped */
+		buf = xmalloc(pe->len);
+		if (pread(pack_fd, buf, pe->len, pe->off) != (ssize_t)pe->len)
+			goto done;
+		rec = buf;
+	}
+
+	if ((r = pack_check(rec, pe->len, 0)) == NULL)
+		goto done;
+
+	urllen = PACK_ALIGN(r->urllen);
+	rec += sizeof(*r) + urllen;
+	strs = xmalloc(r->strslen + 1);
+	if (r->strslen != 0)
+		memcpy(strs, rec + r->nlines * sizeof(struct mcache_line),
+		    r->strslen);
+	st = shtext_new(NULL, strs, r->strslen);
+	ret = mcache_restore(tab, pack_parser(r->parser), r->title,
+	    r->trust, (const struct mcache_line *)rec, r->nlines,
+	    st, strs, r->strslen);
+	if (ret) {
+		stats.disk_hits++;
+		stats.served += pe->len;
+	}
+
+done:
+	free(buf);
+	return ret;
+}
+
+/*
+ * Install the saved layout of e in the tab just restored from it and
+ * move to the position recorded in the history, as set_scroll_position
+ * would do.
+ */
+static void
+mcache_restore_layout(struct tab *tab, struct mcache_body *b)
+{
+	struct buffer		*buffer = &tab->buffer;
+	struct mcache_vline	*mv;
+	struct vline		*vl;
+	struct line		*lines;
+	size_t			 i, top, cur;
+
+	if (b->vlines == NULL || b->lo_fill_column != fill_column ||
+	    b->lo_emojify != emojify_link || b->lo_pre != !dont_wrap_pre)
+		return;
+
+	if (buffer->vlines_cap < b->nvlines) {
+		buffer->vlines = xreallocarray(buffer->vlines, b->nvlines,
+		    sizeof(*buffer->vlines));
+		buffer->vlines_cap = b->nvlines;
+	}
+
+	hist_cur_offs(tab->hist, &top, &cur);
+
+	/* mcache_restore allocates all the lines in a single array */
+	lines = TAILQ_FIRST(&buffer->head);
+	buffer->line_max = 0;
+	for (i = 0; i < b->nvlines; ++i) {
+		mv = &b->vlines[i];
+		vl = &buffer->vlines[i];
+
+		vl->parent = &lines[mv->line];
+		vl->from = mv->from;
+		vl->len = mv->len;
+		vl->cplen = mv->cplen;
+		vl->flags = mv->flags;
+		if (!(vl->flags & L_CONTINUATION))
+			vl->parent->vline = i;
+
+		if (!(vl->parent->flags & L_HIDDEN))
+			buffer->line_max++;
+
+		if (buffer->top_line == NULL && mv->line == top)
+			buffer->top_line = vl;
+		if (buffer->current_line == NULL && mv->line == cur)
+			buffer->current_line = vl;
+	}
+
+	buffer->vlines_len = b->nvlines;
+	buffer->last_wrapped = &lines[b->nlines - 1];
+	buffer->wrap_width = b->lo_width;
+	buffer->wrap_fill_column = b->lo_fill_column;
+	buffer->wrap_pre = b->lo_pre;
+	buffer->force_redraw = 1;
+
+	if (buffer->top_line == NULL)
+		buffer->top_line = vline_first(buffer);
+	if (buffer->current_line == NULL)
+		buffer->current_line = buffer->top_line;
+}
+
+/*
+ * Save how the page currently shown in tab is wrapped in its cache
+ * entry, if there's one, so that coming back to it is instant.
+ */
+void
+mcache_layout(struct tab *tab)
+{
+	struct buffer		*buffer = &tab->buffer;
+	struct mcache_entry	*e, *old;
+	struct mcache_body	*b;
+	struct mcache_vline	*mvs, *mv;
+	struct vline		*vl;
+	struct line		*l;
+	unsigned int		 slot;
+	size_t			 i, n = 0, nlines = 0, len;
+	const char		*url;
+
+	if (tab->loading_anim || buffer->vlines_len == 0 ||
+	    wrap_pending(buffer) || (url = hist_cur(tab->hist)) == NULL)
+		return;
+
+	if ((e = mcache_find(url, &slot)) == NULL)
+		return;
+	b = e->body;
+
+	if (b->vlines != NULL && b->lo_width == buffer->wrap_width &&
+	    b->lo_fill_column == buffer->wrap_fill_column &&
+	    b->lo_pre == buffer->wrap_pre && b->lo_emojify == emojify_link)
+		return;
+
+	/* make sure it's still the page that was cached */
+	TAILQ_FOREACH(l, &buffer->head, lines)
+		nlines++;
+	if (nlines != b->nlines || nlines > UINT32_MAX)
+		return;
+
+	mvs = xreallocarray(NULL, buffer->vlines_len, sizeof(*mvs));
+	l = TAILQ_FIRST(&buffer->head);
+	for (i = 0; i < buffer->vlines_len; ++i) {
+		vl = &buffer->vlines[i];
+		mv = &mvs[i];
+
+		while (l != NULL && l != vl->parent) {
+			l = TAILQ_NEXT(l, lines);
+			n++;
+		}
+
+		if (l == NULL || vl->from > UINT32_MAX ||
+		    vl->len > UINT32_MAX || vl->cplen > UINT32_MAX) {
+			free(mvs);
+			return;
+		}
+
+		mv->line = n;
+		mv->flags = vl->flags;
+		mv->from = vl->from;
+		mv->len = vl->len;
+		mv->cplen = vl->cplen;
+	}
+
+	len = b->nvlines * sizeof(*b->vlines);
+	b->size -= len;
+	b->rawsize -= len;
+	tot -= len;
+	rawtot -= len;
+	free(b->vlines);
+
+	b->vlines = mvs;
+	b->nvlines = buffer->vlines_len;
+	b->lo_width = buffer->wrap_width;
+	b->lo_fill_column = buffer->wrap_fill_column;
+	b->lo_pre = buffer->wrap_pre;
+	b->lo_emojify = emojify_link;
+
+	len = b->nvlines * sizeof(*b->vlines);
+	b->size += len;
+	b->rawsize += len;
+	tot += len;
+	rawtot += len;
+
+	while (tot > (size_t)cache_size &&
+	    (old = TAILQ_FIRST(&lru)) != NULL && old != e) {
+		stats.evictions++;
+		mcache_free_entry(old->url);
+	}
+}
+
+/*
+ * Evict the least recently used pages until at least want bytes are
+ * freed, or the cache is empty.  Returns what was freed.
+ */
+size_t
+mcache_shrink(size_t want)
+{
+	struct mcache_entry	*old;
+	size_t			 before = tot;
+
+	while (before - tot < want && (old = TAILQ_FIRST(&lru)) != NULL) {
+		stats.evictions++;
+		mcache_free_entry(old->url);
+	}
+	return before - tot;
+}
+
+int
+mcache_has(const char *url)
+{
+	unsigned int	 slot;
+
+	if (mcache_find(url, &slot) != NULL)
+		return 1;
+
+	if (pack_fd == -1)
+		return 0;
+	slot = ohash_qlookup(&ph, url);
+	return ohash_find(&ph, slot) != NULL;
 }
 
 int
 mcache_lookup(const char *url, struct tab *tab)
 {
 	struct mcache_entry	*e;
+	struct mcache_body	*b;
+	struct shtext		*st;
 	unsigned int		 slot;
+	char			*blob;
+	int			 r;
 
-	slot = ohash_qlookup(&h, url);
-	if ((e = ohash_find(&h, slot)) == NULL)
-		return 0;
+	if ((e = mcache_find(url, &slot)) == NULL) {
+		/* only the network schemes are ever cached */
+		if ((r = pack_lookup(url, tab)) == 0 &&
+		    (!strncmp(url, "gemini://", 9) ||
+		    !strncmp(url, "gopher://", 9) ||
+		    !strncmp(url, "finger://", 9))) {
+			stats.misses++;
+			perf_count(PERF_MCACHE_MISSES, 1);
+		}
+		return r;
+	}
 
-	parser_init(&tab->buffer, e->parser);
-	if (!parser_parse(&tab->buffer, e->buf, e->buflen))
-		goto err;
-	if (!parser_free(tab))
-		goto err;
+	TAILQ_REMOVE(&lru, e, entries);
+	TAILQ_INSERT_TAIL(&lru, e, entries);
 
-	tab->trust = e->trust;
-	return 1;
+	b = e->body;
+	e->hits++;
+	stats.hits++;
+	perf_count(PERF_MCACHE_HITS, 1);
+	stats.served += b->rawsize;
+	stats.saved += e->fetch_ms;
+
+	/*
+	 * The text is copied, or uncompressed with the lines, only for
+	 * the first of the tabs showing the page at the same time.
+	 */
+	if ((st = b->live) == NULL && b->z != NULL) {
+		if (!mcache_uncompress(b, &blob))
+			return 0;
+		st = shtext_new(b, blob, b->nlines * sizeof(*b->lines) +
+		    b->strslen);
+	} else if (st == NULL) {
+		blob = xmalloc(b->strslen + 1);
+		if (b->strslen != 0)
+			memcpy(blob, b->strs, b->strslen);
+		st = shtext_new(b, blob, b->strslen);
+	}
+
+	if (b->z != NULL)
+		r = mcache_restore(tab, b->parser, b->title, e->trust,
+		    (struct mcache_line *)st->data, b->nlines, st,
+		    st->data + b->nlines * sizeof(*b->lines), b->strslen);
+	else
+		r = mcache_restore(tab, b->parser, b->title, e->trust,
+		    b->lines, b->nlines, st, st->data, b->strslen);
+
+	if (r)
+		mcache_restore_layout(tab, b);
+	return r;
+}
+
+static void
+fmt_size(size_t n, char *buf)
+{
+	if (fmt_scaled(n, buf) == -1)
+		snprintf(buf, FMT_SCALED_STRSIZE, "%zu", n);
+}
+
+static void
+fmt_age(time_t secs, char *buf, size_t len)
+{
+	if (secs < 60)
+		snprintf(buf, len, "%llds", (long long)secs);
+	else if (secs < 60 * 60)
+		snprintf(buf, len, "%lldm", (long long)secs / 60);
+	else
+		snprintf(buf, len, "%lldh", (long long)secs / (60 * 60));
+}
+
+/* generate the about:cache page */
+void
+mcache_about(struct tab *tab)
+{
+	struct buffer		*buffer = &tab->buffer;
+	struct mcache_entry	*e;
+	struct mcache_body	*body;
+	unsigned int		 i;
+	time_t			 now;
+	size_t			 dedup = 0;
+	char			 a[FMT_SCALED_STRSIZE], b[FMT_SCALED_STRSIZE];
+	char			 c[FMT_SCALED_STRSIZE], age[16];
+
+	now = time(NULL);
+
+	for (body = ohash_first(&bh, &i); body != NULL;
+	     body = ohash_next(&bh, &i))
+		dedup += (body->refs - 1) * body->rawsize;
+
+	parser_init(buffer, &gemtext_parser);
+	parser_parsef(buffer, "# Page cache\n\n");
+
+	fmt_size(tot, a);
+	fmt_size(rawtot, b);
+	fmt_size(cache_size, c);
+	parser_parsef(buffer, "Pages in memory: %zu, using %s (%s uncompressed)"
+	    " out of %s.\n", npages, a, b, c);
+	if (pack_fd != -1) {
+		fmt_size(pack_end, a);
+		parser_parsef(buffer, "Pages on disk: %u, %s.\n",
+		    ohash_entries(&ph), a);
+	}
+	parser_parsef(buffer, "\n");
+
+	fmt_size(stats.served, a);
+	parser_parsef(buffer, "* hits: %zu (%zu from disk)\n",
+	    stats.hits + stats.disk_hits, stats.disk_hits);
+	parser_parsef(buffer, "* misses: %zu\n", stats.misses);
+	parser_parsef(buffer, "* evicted: %zu, expired: %zu\n",
+	    stats.evictions, stats.expired);
+	parser_parsef(buffer, "* served from cache: %s\n", a);
+	fmt_size(dedup, a);
+	parser_parsef(buffer, "* saved by sharing identical pages: %s\n", a);
+	parser_parsef(buffer, "* network time saved: %lld.%03llds\n",
+	    stats.saved / 1000, stats.saved % 1000);
+	parser_parsef(buffer, "* TLS sessions resumed: %zu out of %zu"
+	    " handshakes\n", tls_resumed, tls_handshakes);
+
+	parser_parsef(buffer, "\n## Entries\n\n");
+	parser_parsef(buffer, "Most recently used first.\n\n");
+	TAILQ_FOREACH_REVERSE(e, &lru, mcache_lru, entries) {
+		body = e->body;
+		fmt_size(body->size, a);
+		fmt_age(now - e->ts, age, sizeof(age));
+		parser_parsef(buffer, "=> %s %s — %s%s, %s old, %zu hits\n",
+		    e->url, *body->title != '\0' ? body->title : e->url, a,
+		    body->refs > 1 ? " shared" : "", age, e->hits);
+	}
 
-err:
 	parser_free(tab);
-	erase_buffer(&tab->buffer);
-	return 0;
 }
 
 void
-mcache_info(size_t *r_npages, size_t *r_tot)
+mcache_info(size_t *r_npages, size_t *r_tot, size_t *r_rawtot)
 {
 	*r_npages = npages;
 	*r_tot = tot;
+	*r_rawtot = rawtot;
+}
+
+/* fill top with the n biggest entries, biggest first */
+size_t
+mcache_largest(struct mcache_usage *top, size_t n)
+{
+	struct mcache_entry	*e;
+	size_t			 i, len = 0;
+
+	TAILQ_FOREACH(e, &lru, entries) {
+		for (i = len; i > 0 && top[i - 1].size < e->body->size; --i)
+			if (i < n)
+				top[i] = top[i - 1];
+		if (i == n)
+			continue;
+		top[i].url = e->url;
+		top[i].title = e->body->title;
+		top[i].size = e->body->size;
+		top[i].shared = e->body->refs > 1;
+		if (len < n)
+			len++;
+	}
+	return len;
+}
+
+/*
+ * The URLs of the cached pages, the most recently used first, each
+ * one referenced until the caller passes it to intern_free.  The
+ * array is NULL-terminated.
+ */
+const char **
+mcache_urls(void)
+{
+	struct mcache_entry	*e;
+	const char		**urls;
+	size_t			 i = 0;
+
+	urls = xcalloc(npages + 1, sizeof(*urls));
+	TAILQ_FOREACH_REVERSE(e, &lru, mcache_lru, entries) {
+		if (i == npages)
+			break;
+		urls[i++] = intern_ref(e->url);
+	}
+	return urls;
+}
+
+/*
+ * Call fn with the index and the text of the lines of the cached page
+ * of url that contain needle, see search_mem.  It doesn't count as a
+ * use of the entry.  Returns 0 if the page is not cached anymore.
+ */
+int
+mcache_grep(const char *url, const char *needle, int fold,
+    void (*fn)(size_t, const char *, void *), void *arg)
+{
+	struct mcache_entry	*e;
+	struct mcache_body	*b;
+	const struct mcache_line *lines;
+	const char		*strs, *text;
+	char			*blob = NULL;
+	unsigned int		 slot;
+	size_t			 i, nlen;
+
+	if ((e = mcache_find(url, &slot)) == NULL)
+		return 0;
+
+	b = e->body;
+	if (b->z != NULL && b->live != NULL) {
+		lines = (struct mcache_line *)b->live->data;
+		strs = b->live->data + b->nlines * sizeof(*b->lines);
+	} else if (b->z != NULL) {
+		if (!mcache_uncompress(b, &blob))
+			return 0;
+		lines = (struct mcache_line *)blob;
+		strs = blob + b->nlines * sizeof(*b->lines);
+	} else {
+		lines = b->lines;
+		strs = b->strs;
+	}
+
+	nlen = strlen(needle);
+	for (i = 0; i < b->nlines; ++i) {
+		if (lines[i].line == MC_NONE)
+			continue;
+		text = strs + lines[i].line;
+		if (search_mem(text, strlen(text), needle, nlen, fold) != NULL)
+			fn(i, text, arg);
+	}
+
+	free(blob);
+	return 1;
 }
@@ -19,9 +19,24 @@
 
 struct tab;
 
+struct mcache_usage {
+	const char	*url;
+	const char	*title;
+	size_t		 size;
+	int		 shared;
+};
+
 void	 mcache_init(void);
 int	 mcache_tab(struct tab *);
+void	 mcache_layout(struct tab *);
+int	 mcache_has(const char *);
 int	 mcache_lookup(const char *, struct tab *);
-void	 mcache_info(size_t *, size_t *);
+void	 mcache_about(struct tab *);
+void	 mcache_info(size_t *, size_t *, size_t *);
+size_t	 mcache_largest(struct mcache_usage *, size_t);
+size_t	 mcache_shrink(size_t);
+const char **mcache_urls(void);
+int	 mcache_grep(const char *, const char *, int,
+	    void (*)(size_t, const char *, void *), void *);
 
 #endif
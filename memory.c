@@ -0,0 +1,233 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The about:memory page: what the ui process holds, tab by tab and
+ * for the stores shared by all of them.  Only the allocations are
+ * accounted, not the overhead of malloc.
+ */
+
+#include "compat.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "certs.h"
+#include "hist.h"
+#include "intern.h"
+#include "mcache.h"
+#include "memory.h"
+#include "parser.h"
+#include "telescope.h"
+#include "session.h"
+#include "tofu.h"
+#include "ui.h"
+#include "xwrapper.h"
+
+#define MEMORY_TOP_PAGES	10
+
+struct tabmem {
+	struct tab	*tab;
+	struct bufmem	 m;
+	size_t		 nlines;
+	size_t		 text;
+	size_t		 hist;
+	size_t		 tot;
+	int		 killed;
+};
+
+static void
+fmt_size(size_t n, char *buf)
+{
+	if (fmt_scaled(n, buf) == -1)
+		snprintf(buf, FMT_SCALED_STRSIZE, "%zu", n);
+}
+
+static void
+tabmem_fill(struct tabmem *tm, struct tab *tab, int killed)
+{
+	struct line	*l;
+
+	memset(tm, 0, sizeof(*tm));
+	tm->tab = tab;
+	tm->killed = killed;
+
+	buffer_memory(&tab->buffer, &tm->m);
+	TAILQ_FOREACH(l, &tab->buffer.head, lines) {
+		tm->nlines++;
+		if (l->line != NULL)
+			tm->text += strlen(l->line);
+		if (l->alt != NULL && l->alt != l->line)
+			tm->text += strlen(l->alt);
+	}
+
+	tm->hist = hist_memory(tab->hist);
+	tm->tot = sizeof(*tab) + tm->m.tot + tm->hist;
+}
+
+static int
+tabmem_cmp(const void *a, const void *b)
+{
+	const struct tabmem	*ta = a, *tb = b;
+
+	if (ta->tot > tb->tot)
+		return -1;
+	return ta->tot < tb->tot;
+}
+
+static void
+print_tab(struct buffer *buffer, struct tabmem *tm)
+{
+	struct tab	*tab = tm->tab;
+	const char	*url, *title, *state = "";
+	char		 a[FMT_SCALED_STRSIZE], b[FMT_SCALED_STRSIZE];
+	char		 c[FMT_SCALED_STRSIZE], d[FMT_SCALED_STRSIZE];
+
+	if ((url = hist_cur(tab->hist)) == NULL)
+		url = "about:blank";
+	title = *tab->buffer.title != '\0' ? tab->buffer.title : url;
+	if (tm->killed)
+		state = " (closed)";
+	else if (tab->flags & TAB_LAZY)
+		state = " (unloaded)";
+	else if (tab == current_tab)
+		state = " (current)";
+
+	fmt_size(tm->tot, a);
+	parser_parsef(buffer, "=> %s %s%s — %s\n", url, title, state, a);
+
+	fmt_size(tm->m.arena, a);
+	fmt_size(tm->text, b);
+	fmt_size(tm->m.vlines, c);
+	fmt_size(tm->m.index + tm->m.raw + tm->hist, d);
+	parser_parsef(buffer, "%zu lines in %s (%s of text), %zu vlines in"
+	    " %s, %s for the rest\n", tm->nlines, a, b,
+	    tab->buffer.vlines_len, c, d);
+	if (tm->m.shared != 0 && tab->buffer.shared->refs > 1) {
+		fmt_size(tm->m.shared, a);
+		parser_parsef(buffer, "text shared with %d other tabs, %s\n",
+		    tab->buffer.shared->refs - 1, a);
+	}
+	if (tm->m.spilled != 0) {
+		fmt_size(tm->m.spilled, a);
+		parser_parsef(buffer, "%s more in a temporary file\n", a);
+	}
+}
+
+/* the total of about:memory, without the details */
+size_t
+memory_accounted(struct ohash *certs)
+{
+	struct tab	*t;
+	size_t		 npages, ctot, crawtot, nstrs, tot = 0;
+
+	TAILQ_FOREACH(t, &tabshead, tabs)
+		tot += sizeof(*t) + buffer_memory(&t->buffer, NULL) +
+		    hist_memory(t->hist);
+	TAILQ_FOREACH(t, &ktabshead, tabs)
+		tot += sizeof(*t) + buffer_memory(&t->buffer, NULL) +
+		    hist_memory(t->hist);
+
+	mcache_info(&npages, &ctot, &crawtot);
+	return tot + ctot + history_memory() + tofu_memory(certs) +
+	    certs_memory() + intern_memory(&nstrs);
+}
+
+/* generate the about:memory page */
+void
+memory_about(struct tab *tab, struct ohash *certs)
+{
+	struct buffer		*buffer = &tab->buffer;
+	struct mcache_usage	 top[MEMORY_TOP_PAGES];
+	struct tabmem		*tabs = NULL;
+	struct tab		*t;
+	size_t			 i, n = 0, cap = 0, ntop, tabtot = 0;
+	size_t			 npages, ctot, crawtot, nstrs;
+	size_t			 hist, known, ids, strs, tot;
+	char			 a[FMT_SCALED_STRSIZE], b[FMT_SCALED_STRSIZE];
+
+	TAILQ_FOREACH(t, &tabshead, tabs) {
+		if (n == cap) {
+			cap = cap == 0 ? 16 : cap * 2;
+			tabs = xreallocarray(tabs, cap, sizeof(*tabs));
+		}
+		tabmem_fill(&tabs[n++], t, 0);
+	}
+	TAILQ_FOREACH(t, &ktabshead, tabs) {
+		if (n == cap) {
+			cap = cap == 0 ? 16 : cap * 2;
+			tabs = xreallocarray(tabs, cap, sizeof(*tabs));
+		}
+		tabmem_fill(&tabs[n++], t, 1);
+	}
+	qsort(tabs, n, sizeof(*tabs), tabmem_cmp);
+	for (i = 0; i < n; ++i)
+		tabtot += tabs[i].tot;
+
+	mcache_info(&npages, &ctot, &crawtot);
+	ntop = mcache_largest(top, MEMORY_TOP_PAGES);
+
+	hist = history_memory();
+	known = tofu_memory(certs);
+	ids = certs_memory();
+	strs = intern_memory(&nstrs);
+	tot = tabtot + ctot + hist + known + ids + strs;
+
+	parser_init(buffer, &gemtext_parser);
+	parser_parsef(buffer, "# Memory\n\n");
+
+	fmt_size(tot, a);
+	parser_parsef(buffer, "Accounted for: %s, not counting the overhead"
+	    " of the allocator.\n\n", a);
+
+	fmt_size(tabtot, a);
+	parser_parsef(buffer, "## Tabs\n\n");
+	parser_parsef(buffer, "%zu tabs, including the closed ones, using"
+	    " %s.  Biggest first.  The commands tab-hibernate-heaviest and"
+	    " tab-close-heaviest release the biggest hidden tab.\n\n", n, a);
+	for (i = 0; i < n; ++i)
+		print_tab(buffer, &tabs[i]);
+	free(tabs);
+
+	fmt_size(ctot, a);
+	fmt_size(crawtot, b);
+	parser_parsef(buffer, "\n## Page cache\n\n");
+	parser_parsef(buffer, "%zu pages using %s (%s uncompressed).\n\n",
+	    npages, a, b);
+	for (i = 0; i < ntop; ++i) {
+		fmt_size(top[i].size, a);
+		parser_parsef(buffer, "=> %s %s — %s%s\n", top[i].url,
+		    *top[i].title != '\0' ? top[i].title : top[i].url, a,
+		    top[i].shared ? " shared" : "");
+	}
+	parser_parsef(buffer, "=> about:cache All the entries\n");
+
+	parser_parsef(buffer, "\n## Other\n\n");
+	fmt_size(hist, a);
+	parser_parsef(buffer, "* global history: %s, %zu entries\n", a,
+	    history.len);
+	fmt_size(known, a);
+	parser_parsef(buffer, "* known hosts: %s\n", a);
+	fmt_size(ids, a);
+	parser_parsef(buffer, "* client certificates: %s\n", a);
+	fmt_size(strs, a);
+	parser_parsef(buffer, "* interned URLs and domains: %s, %zu strings\n",
+	    a, nstrs);
+
+	parser_free(tab);
+}
@@ -71,7 +71,8 @@ setup_parser_for(struct tab *tab)
 	char *b, buf[GEMINI_URL_LEN] = {0};
 	const struct parser_table *t;
 
-	memcpy(buf, tab->meta, sizeof(tab->meta));
+	if (tab->meta != NULL)
+		strlcpy(buf, tab->meta, sizeof(buf));
 
 	for (b = buf; *b != ';' && *b != '\0'; ++b)
 		;
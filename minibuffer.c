@@ -26,23 +26,30 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+#include "bookmarks.h"
 #include "certs.h"
 #include "cmd.h"
+#include "compl.h"
 #include "defaults.h"
 #include "ev.h"
+#include "filter.h"
 #include "fs.h"
+#include "ftindex.h"
 #include "hist.h"
+#include "intern.h"
 #include "iri.h"
 #include "keymap.h"
+#include "mcache.h"
 #include "minibuffer.h"
+#include "perf.h"
+#include "search.h"
 #include "session.h"
 #include "ui.h"
 #include "utf8.h"
 #include "utils.h"
 #include "xwrapper.h"
 
-#define nitems(x) (sizeof(x)/sizeof(x[0]))
-
 static void		*minibuffer_metadata(void);
 static const char	*minibuffer_compl_text(void);
 static void		 minibuffer_hist_save_entry(void);
@@ -52,6 +59,8 @@ static void		 read_self_insert(void);
 static void		 read_abort(void);
 static void		 read_select(const char *);
 static void		 handle_clear_echoarea(int, int, void *);
+static void		 compl_add(const char *, const char *, void *);
+static void		 swa_stop(void);
 
 static unsigned long	clechotimer;
 static struct timeval	clechotv = { 5, 0 };
@@ -81,26 +90,44 @@ codepoint_isgraph(uint32_t cp)
 	return 1;
 }
 
-static inline int
-matches(char **words, size_t len, struct line *l)
+/*
+ * Lay the completions out in the order given by the fuzzy ranking,
+ * with the ones not in it hidden, or in the original order if rank
+ * is NULL.
+ */
+static void
+reorder_completions(const uint32_t *rank, size_t nrank)
 {
-	size_t	i;
-	int	lm, am;
-
-	for (i = 0; i < len; ++i) {
-		lm = am = 0;
+	struct filter	*f;
+	struct buffer	*b;
+	struct line	*l;
+	size_t		 i, n;
 
-		if (strcasestr(l->line, words[i]) != NULL)
-			lm = 1;
-		if (l->alt != NULL &&
-		    strcasestr(l->alt, words[i]) != NULL)
-			am = 1;
+	f = ministate.compl.filter;
+	b = &ministate.compl.buffer;
+	n = filter_len(f);
 
-		if (!lm && !am)
-			return 0;
+	TAILQ_INIT(&b->head);
+	if (rank != NULL) {
+		for (i = 0; i < n; ++i) {
+			l = filter_data(f, i);
+			l->type = LINE_COMPL;
+			l->flags |= L_HIDDEN;
+		}
+		for (i = 0; i < nrank; ++i) {
+			l = filter_data(f, rank[i]);
+			l->flags &= ~L_HIDDEN;
+			TAILQ_INSERT_TAIL(&b->head, l, lines);
+		}
+	}
+	for (i = 0; i < n; ++i) {
+		l = filter_data(f, i);
+		if (rank == NULL || l->flags & L_HIDDEN)
+			TAILQ_INSERT_TAIL(&b->head, l, lines);
 	}
 
-	return 1;
+	/* start over from the best match */
+	ui_wrap_completions(1);
 }
 
 /*
@@ -110,14 +137,17 @@ matches(char **words, size_t len, struct line *l)
 void
 recompute_completions(int add)
 {
-	static char	 buf[GEMINI_URL_LEN];
 	const char	*text;
-	char		*input, **ap, *words[10];
-	size_t		 len = 0;
+	const uint32_t	*res, *rank;
+	size_t		 i, id, nres, nrank;
+	struct filter	*f;
 	struct line	*l;
 	struct vline	*vl;
 	struct buffer	*b;
 
+	if (ministate.changedfn != NULL)
+		ministate.changedfn();
+
 	if (in_minibuffer != MB_COMPREAD)
 		return;
 
@@ -126,34 +156,40 @@ recompute_completions(int add)
 	else
 		text = ministate.buf;
 
-	strlcpy(buf, text, sizeof(buf));
-	input = buf;
-
-	/* tokenize the input */
-	for (ap = words; ap < words + nitems(words) &&
-	    (*ap = strsep(&input, " ")) != NULL;) {
-		if (**ap != '\0')
-			ap++, len++;
-	}
+	f = ministate.compl.filter;
+	filter_match(f, text, add);
+	res = filter_result(f, &nres);
+	rank = filter_ranked(f, &nrank);
 
 	b = &ministate.compl.buffer;
-	TAILQ_FOREACH(l, &b->head, lines) {
-		l->type = LINE_COMPL;
-		if (add && l->flags & L_HIDDEN)
-			continue;
-		if (matches(words, len, l)) {
-			if (l->flags & L_HIDDEN)
-				b->line_max++;
-			l->flags &= ~L_HIDDEN;
-		} else {
-			if (!(l->flags & L_HIDDEN))
-				b->line_max--;
-			l->flags |= L_HIDDEN;
+	if (nrank != 0 || ministate.compl.ranked) {
+		reorder_completions(nrank != 0 ? rank : NULL, nrank);
+		ministate.compl.ranked = nrank != 0;
+	}
+	ministate.compl.nmatches = nrank != 0 ? nrank : nres;
+
+	/* otherwise the candidates are in the order they were added */
+	if (!ministate.compl.ranked) {
+		i = id = 0;
+		TAILQ_FOREACH(l, &b->head, lines) {
+			l->type = LINE_COMPL;
+			if (i < nres && res[i] == id) {
+				i++;
+				if (l->flags & L_HIDDEN)
+					b->line_max++;
+				l->flags &= ~L_HIDDEN;
+			} else {
+				if (!(l->flags & L_HIDDEN))
+					b->line_max--;
+				l->flags |= L_HIDDEN;
+			}
+			id++;
 		}
+		vline_hidden_changed(b);
 	}
 
 	if (b->current_line == NULL)
-		b->current_line = TAILQ_FIRST(&b->vhead);
+		b->current_line = vline_first(b);
 	b->current_line = adjust_line(b->current_line, b);
 	vl = b->current_line;
 	if (ministate.compl.must_select && vl != NULL)
@@ -283,16 +319,14 @@ eecmd_select(const char *t)
 {
 	struct cmd	*cmd;
 
-	for (cmd = cmds; cmd->cmd != NULL; ++cmd) {
-		if (!strcmp(cmd->cmd, t)) {
-			minibuffer_hist_save_entry();
-			exit_minibuffer();
-			cmd->fn(current_buffer());
-			return;
-		}
+	if ((cmd = cmd_lookup(t)) == NULL) {
+		message("No match");
+		return;
 	}
 
-	message("No match");
+	minibuffer_hist_save_entry();
+	exit_minibuffer();
+	cmd->fn(current_buffer());
 }
 
 void
@@ -361,11 +395,18 @@ void
 bp_select(const char *url)
 {
 	if (*url != '\0') {
-		if (bookmark_page(url) == -1)
+		switch (bookmark_page(url)) {
+		case -1:
 			message("failed to bookmark page: %s",
 			    strerror(errno));
-		else
+			break;
+		case 1:
+			message("Already bookmarked");
+			break;
+		default:
 			message("Bookmarked");
+			break;
+		}
 	} else
 		message("Abort.");
 	exit_minibuffer();
@@ -396,7 +437,8 @@ ls_select(const char *text)
 	}
 
 	exit_minibuffer();
-	load_url_in_tab(current_tab, l->alt, NULL, LU_MODE_NOCACHE);
+	load_url_in_tab(current_tab, line_url(current_tab, l), NULL,
+	    LU_MODE_NOCACHE);
 }
 
 static inline void
@@ -406,18 +448,15 @@ jump_to_line(struct line *l)
 	struct buffer	*buffer;
 
 	buffer = current_buffer();
+	wrap_page_finish(buffer);
 
-	TAILQ_FOREACH(vl, &buffer->vhead, vlines) {
-		if (vl->parent == l)
-			break;
-	}
-
-	if (vl == NULL)
+	if ((vl = line_vline(buffer, l)) == NULL)
 		message("Ops, %s error!  Please report to %s",
 		    __func__, PACKAGE_BUGREPORT);
 	else {
 		buffer->top_line = vl;
 		buffer->current_line = vl;
+		buffer->line_off = vline_visible_index(buffer, vl);
 	}
 }
 
@@ -454,7 +493,7 @@ save_cert_for_site_cb(int r, void *data)
 {
 	struct tab		*tab = data;
 
-	cert_save_for(tab->client_cert, &tab->iri, r);
+	cert_save_for(tab->client_cert, tab->iri, r);
 }
 
 void
@@ -490,6 +529,519 @@ search_select(const char *text)
 	load_url_in_tab(current_tab, buf, NULL, LU_MODE_NOCACHE);
 }
 
+static void
+svr_select(const char *text)
+{
+	const char	*url;
+
+	if ((url = minibuffer_metadata()) == NULL) {
+		message("No page selected");
+		return;
+	}
+
+	exit_minibuffer();
+	load_url_in_tab(current_tab, url, NULL, LU_MODE_NOCACHE);
+}
+
+/* search-visited: run the query and pick one of the pages found */
+void
+sv_select(const char *text)
+{
+	struct minibuffer	 m = {
+		.self_insert = sensible_self_insert,
+		.done = svr_select,
+		.complfn = compl_sv,
+		.must_select = 1,
+	};
+	struct ft_result	*res;
+	int			 n;
+
+	exit_minibuffer();
+	if ((n = ftindex_search(text, &res)) == 0) {
+		message("No match");
+		return;
+	}
+
+	m.compldata = res;
+	enter_minibuffer(&m, "Visited pages (%d): ", n);
+}
+
+/*
+ * swiper-all: the lines with the query of all the tabs and then of
+ * the cached pages that aren't shown by any, one page at a time when
+ * the ui is idle.  The matches are added to the completions as they
+ * are found, so they can be narrowed while the search goes on.
+ */
+#define SWA_SLICE	5000	/* usec */
+
+struct swa_hit {
+	int		 cached;
+	uint32_t	 tab;
+	const char	*url;
+	size_t		 idx;		/* of the line */
+};
+
+static struct {
+	char		*needle;
+	int		 fold;
+	uint32_t	*tabs;		/* the ids */
+	size_t		 ntabs;
+	size_t		 curtab;
+	const char	**urls;		/* see mcache_urls */
+	size_t		 cururl;
+	unsigned int	 idle;
+	size_t		 nhits;
+
+	/* for swa_add */
+	int		 cached;
+	uint32_t	 tabid;
+	const char	*taburl;
+	int		 tabno;
+} swa;
+
+static void	 swa_run(int, int, void *);
+
+static const char *
+compl_swa(void **data, void **ret, const char **descr)
+{
+	return NULL;
+}
+
+static void
+swa_add(size_t idx, const char *text, void *arg)
+{
+	struct buffer	*b = &ministate.compl.buffer;
+	struct swa_hit	*hit;
+	char		*descr;
+
+	hit = arena_calloc(&b->line_arena, 1, sizeof(*hit));
+	hit->cached = swa.cached;
+	hit->tab = swa.tabid;
+	hit->url = arena_strdup(&b->line_arena, swa.taburl);
+	hit->idx = idx;
+
+	if (swa.cached)
+		xasprintf(&descr, "cached, line %zu: %s", idx + 1,
+		    (const char *)arg);
+	else
+		xasprintf(&descr, "tab %d, line %zu: %s", swa.tabno, idx + 1,
+		    (const char *)arg);
+	compl_add(text, arena_strdup(&b->line_arena, descr), hit);
+	free(descr);
+	swa.nhits++;
+}
+
+static void
+swa_grep_tab(struct tab *tab)
+{
+	struct line	*l;
+	const char	*title;
+	size_t		 idx = 0, nlen;
+
+	title = *tab->buffer.title != '\0' ? tab->buffer.title :
+	    hist_cur(tab->hist);
+	nlen = strlen(swa.needle);
+	TAILQ_FOREACH(l, &tab->buffer.head, lines) {
+		if (l->line != NULL && search_mem(l->line, strlen(l->line),
+		    swa.needle, nlen, swa.fold) != NULL)
+			swa_add(idx, l->line, (void *)title);
+		idx++;
+	}
+}
+
+/* whether url is what a tab with its lines in memory shows */
+static int
+swa_shown(const char *url)
+{
+	struct tab	*tab;
+
+	TAILQ_FOREACH(tab, &tabshead, tabs)
+		if (TAILQ_FIRST(&tab->buffer.head) != NULL &&
+		    !strcmp(hist_cur(tab->hist), url))
+			return 1;
+	return 0;
+}
+
+static void
+swa_prompt(void)
+{
+	snprintf(ministate.prompt, sizeof(ministate.prompt),
+	    "Lines in all tabs (%zu%s): ", swa.nhits,
+	    swa.idle != 0 ? "+" : "");
+}
+
+static void
+swa_run(int fd, int ev, void *d)
+{
+	struct tab	*tab;
+	const char	*url;
+	uint64_t	 start;
+	size_t		 nhits = swa.nhits;
+
+	swa.idle = 0;
+	start = perf_usec();
+	while (perf_usec() - start < SWA_SLICE && !ev_yield()) {
+		if (swa.curtab < swa.ntabs) {
+			swa.tabid = swa.tabs[swa.curtab++];
+			swa.tabno++;
+			if ((tab = tab_by_id(swa.tabid)) == NULL)
+				continue;
+			swa.taburl = hist_cur(tab->hist);
+			swa_grep_tab(tab);
+			continue;
+		}
+
+		if ((url = swa.urls[swa.cururl]) == NULL)
+			break;
+		swa.cururl++;
+		if (swa_shown(url))
+			continue;
+		swa.cached = 1;
+		swa.taburl = url;
+		mcache_grep(url, swa.needle, swa.fold, swa_add, (void *)url);
+	}
+
+	if (swa.curtab < swa.ntabs || swa.urls[swa.cururl] != NULL)
+		swa.idle = ev_idle(swa_run, NULL);
+	else if (swa.nhits == 0)
+		message("No match");
+
+	/* the new lines need their vlines to become the current one */
+	if (swa.nhits != nhits) {
+		ui_wrap_completions(0);
+		recompute_completions(0);
+	}
+	swa_prompt();
+	ui_schedule_redraw();
+}
+
+static void
+swa_stop(void)
+{
+	size_t	 i;
+
+	if (swa.idle != 0)
+		ev_idle_cancel(swa.idle);
+	swa.idle = 0;
+
+	free(swa.needle);
+	swa.needle = NULL;
+	free(swa.tabs);
+	swa.tabs = NULL;
+	if (swa.urls != NULL) {
+		for (i = 0; swa.urls[i] != NULL; ++i)
+			intern_free(swa.urls[i]);
+		free(swa.urls);
+		swa.urls = NULL;
+	}
+}
+
+static struct line *
+line_at(struct buffer *buffer, size_t idx)
+{
+	struct line	*l;
+
+	TAILQ_FOREACH(l, &buffer->head, lines)
+		if (idx-- == 0)
+			return l;
+	return NULL;
+}
+
+static void
+swa_select(const char *text)
+{
+	struct swa_hit	*hit;
+	struct tab	*tab;
+	struct line	*l;
+
+	if ((hit = minibuffer_metadata()) == NULL) {
+		message("No line selected");
+		return;
+	}
+
+	if (hit->cached)
+		tab = new_tab(hit->url, NULL, current_tab);
+	else if ((tab = tab_by_id(hit->tab)) != NULL)
+		switch_to_tab(tab);
+
+	/* a cached page is restored on the spot */
+	if (tab == NULL || strcmp(hist_cur(tab->hist), hit->url) ||
+	    (l = line_at(&tab->buffer, hit->idx)) == NULL) {
+		exit_minibuffer();
+		message("The page has changed");
+		return;
+	}
+
+	exit_minibuffer();
+	jump_to_line(l);
+}
+
+void
+swa_start(const char *text)
+{
+	struct minibuffer	 m = {
+		.self_insert = sensible_self_insert,
+		.done = swa_select,
+		.complfn = compl_swa,
+		.must_select = 1,
+	};
+	struct tab		*tab;
+	const char		*q;
+	size_t			 n = 0;
+
+	exit_minibuffer();
+	if (*text == '\0')
+		return;
+
+	/* text is the minibuffer, cleared by enter_minibuffer */
+	swa.needle = xstrdup(text);
+	swa.fold = 1;
+	for (q = swa.needle; *q != '\0'; ++q)
+		if (*q >= 'A' && *q <= 'Z')
+			swa.fold = 0;
+
+	enter_minibuffer(&m, "Lines in all tabs: ");
+
+	TAILQ_FOREACH(tab, &tabshead, tabs)
+		n++;
+	swa.tabs = xcalloc(n, sizeof(*swa.tabs));
+	swa.ntabs = 0;
+	TAILQ_FOREACH(tab, &tabshead, tabs)
+		swa.tabs[swa.ntabs++] = tab->id;
+	swa.curtab = 0;
+	swa.cached = 0;
+	swa.urls = mcache_urls();
+	swa.cururl = 0;
+	swa.nhits = 0;
+	swa.tabno = 0;
+
+	swa_run(-1, 0, NULL);
+}
+
+/*
+ * isearch: the query is searched as it's typed and the point moved to
+ * the match, C-s and C-r move to the next and previous ones.
+ */
+static struct {
+	struct search	*search;
+	struct buffer	*buffer;
+	struct excursion place;
+	size_t		 cur;
+	int		 backward;
+	int		 failing;
+	int		 wrapped;
+	char		 last[sizeof(ministate.buf)];
+} isearch;
+
+static void
+isearch_prompt(void)
+{
+	size_t	 n;
+
+	n = search_count(isearch.search);
+	if (n == 0 || isearch.failing)
+		snprintf(ministate.prompt, sizeof(ministate.prompt),
+		    "%sI-search%s: ", isearch.failing ? "Failing " : "",
+		    isearch.backward ? " backward" : "");
+	else
+		snprintf(ministate.prompt, sizeof(ministate.prompt),
+		    "%zu/%zu %sI-search%s: ", isearch.cur + 1, n,
+		    isearch.wrapped ? "Wrapped " : "",
+		    isearch.backward ? " backward" : "");
+}
+
+static void
+isearch_goto(size_t n)
+{
+	const struct search_match *m;
+	struct buffer	*b = isearch.buffer;
+	struct vline	*vl;
+
+	if ((m = search_nth(isearch.search, n)) == NULL)
+		return;
+
+	vl = &b->vlines[m->vidx];
+	isearch.cur = n;
+	b->current_line = vl;
+	b->cpoff = utf8_ncplen(vl->parent->line + vl->from,
+	    m->off - vl->from);
+
+	/* redraw_window scrolls down by itself, but not up */
+	if (b->top_line == NULL || vl < b->top_line) {
+		b->top_line = vl;
+		b->line_off = vline_visible_index(b, vl);
+	}
+}
+
+/*
+ * Search where the current match is, or from where the search
+ * started if there's none.
+ */
+static void
+isearch_update(void)
+{
+	const struct search_match *m;
+	struct buffer	*b = isearch.buffer;
+	struct vline	*vl;
+	size_t		 n, vidx, off;
+
+	m = NULL;
+	if (!isearch.failing)
+		m = search_nth(isearch.search, isearch.cur);
+	if (m != NULL && m->vidx < b->vlines_len &&
+	    b->vlines[m->vidx].parent == m->line) {
+		vidx = m->vidx;
+		off = m->off;
+	} else if ((vl = isearch.place.current_line) != NULL) {
+		vidx = vline_index(b, vl);
+		off = vl->from;
+		if (vl->parent->line != NULL)
+			off += utf8_nth(vl->parent->line + vl->from,
+			    isearch.place.cpoff) - (vl->parent->line + vl->from);
+	} else
+		vidx = off = 0;
+
+	b->force_redraw = 1;
+	isearch.failing = 0;
+	isearch.wrapped = 0;
+
+	if (search_set(isearch.search, b, ministate.buf) == 0) {
+		if (*ministate.buf != '\0')
+			isearch.failing = 1;
+		else
+			restore_excursion(&isearch.place, b);
+		isearch_prompt();
+		return;
+	}
+
+	n = search_nearest(isearch.search, vidx, off, isearch.backward);
+	if (n == search_count(isearch.search))
+		isearch.failing = 1;
+	else
+		isearch_goto(n);
+	isearch_prompt();
+}
+
+static void
+isearch_end(void)
+{
+	strlcpy(isearch.last, ministate.buf, sizeof(isearch.last));
+	search_clear(isearch.search);
+	isearch.buffer->force_redraw = 1;
+	isearch.buffer = NULL;
+	exit_minibuffer();
+}
+
+static void
+isearch_select(const char *text)
+{
+	isearch_end();
+}
+
+static void
+isearch_abort(void)
+{
+	restore_excursion(&isearch.place, isearch.buffer);
+	isearch_end();
+}
+
+void
+isearch_start(struct buffer *buffer, int backward)
+{
+	struct minibuffer m = {
+		.self_insert = sensible_self_insert,
+		.done = isearch_select,
+		.abort = isearch_abort,
+		.changed = isearch_update,
+	};
+
+	if (isearch.search == NULL)
+		isearch.search = search_new();
+
+	wrap_page_finish(buffer);
+	save_excursion(&isearch.place, buffer);
+	isearch.buffer = buffer;
+	isearch.cur = 0;
+	isearch.backward = backward;
+	isearch.failing = 0;
+	isearch.wrapped = 0;
+
+	enter_minibuffer(&m, "%s", "");
+	isearch_prompt();
+}
+
+/*
+ * Move to the next match, or the previous one if backward is set.
+ * Return 0 if there's no isearch in progress.
+ */
+int
+isearch_repeat(int backward)
+{
+	size_t	 n;
+
+	if (!in_minibuffer || isearch.buffer == NULL)
+		return 0;
+
+	/* repeat the last search */
+	if (*ministate.buf == '\0' && *isearch.last != '\0') {
+		isearch.backward = backward;
+		strlcpy(ministate.buf, isearch.last, sizeof(ministate.buf));
+		ministate.vline.cplen = utf8_cplen(ministate.buf);
+		ministate.buffer.cpoff = ministate.vline.cplen;
+		recompute_completions(0);
+		return 1;
+	}
+
+	/* the buffer may have changed in the meantime */
+	if (search_set(isearch.search, isearch.buffer, ministate.buf) == 0) {
+		isearch_update();
+		return 1;
+	}
+
+	n = search_count(isearch.search);
+	if (isearch.cur >= n)
+		isearch.cur = 0;
+
+	isearch.backward = backward;
+	if (isearch.failing) {
+		isearch.failing = 0;
+		isearch.wrapped = 1;
+		isearch.cur = backward ? n - 1 : 0;
+	} else if (!backward) {
+		if (++isearch.cur == n) {
+			isearch.cur = 0;
+			isearch.wrapped = 1;
+		}
+	} else {
+		if (isearch.cur-- == 0) {
+			isearch.cur = n - 1;
+			isearch.wrapped = 1;
+		}
+	}
+
+	isearch_goto(isearch.cur);
+	isearch.buffer->force_redraw = 1;
+	isearch_prompt();
+	return 1;
+}
+
+/*
+ * Return the matches to highlight in the line; *cur is set to the
+ * current one and *len to their length.
+ */
+size_t
+isearch_line(const struct line *l, const struct search_match **ret,
+    const struct search_match **cur, size_t *len)
+{
+	if (isearch.buffer == NULL)
+		return 0;
+
+	*cur = isearch.failing ? NULL :
+	    search_nth(isearch.search, isearch.cur);
+	*len = search_len(isearch.search);
+	return search_line(isearch.search, l, ret);
+}
+
 static void
 yornp_self_insert(void)
 {
@@ -535,8 +1087,29 @@ read_select(const char *text)
 	read_cb(text, read_data);
 }
 
+/* append a candidate to the completions */
+static void
+compl_add(const char *s, const char *descr, void *data)
+{
+	struct buffer	*b;
+	struct line	*l;
+
+	b = &ministate.compl.buffer;
+	l = arena_calloc(&b->line_arena, 1, sizeof(*l));
+
+	l->type = LINE_COMPL;
+	l->data = data;
+	l->alt = (char*)descr;
+	l->line = arena_strdup(&b->line_arena, s);
+
+	filter_add(ministate.compl.filter, s, descr, l);
+
+	TAILQ_INSERT_TAIL(&b->head, l, lines);
+}
+
 /*
- * TODO: we should collect this asynchronously...
+ * Most completions are collected at once, see swa_run for the ones
+ * that are added while the minibuffer is open.
  */
 static inline void
 populate_compl_buffer(complfn *fn, void *data)
@@ -547,23 +1120,19 @@ populate_compl_buffer(complfn *fn, void *data)
 	void		*linedata;
 
 	b = &ministate.compl.buffer;
+	ministate.compl.filter = filter_new(fuzzy_completion ? FILTER_FUZZY : 0);
+	ministate.compl.ranked = 0;
 
 	linedata = NULL;
 	descr = NULL;
 	while ((s = fn(&data, &linedata, &descr)) != NULL) {
-		l = xcalloc(1, sizeof(*l));
-
-		l->type = LINE_COMPL;
-		l->data = linedata;
-		l->alt = (char*)descr;
-		l->line = xstrdup(s);
-
-		TAILQ_INSERT_TAIL(&b->head, l, lines);
-
+		compl_add(s, descr, linedata);
 		linedata = NULL;
 		descr = NULL;
 	}
 
+	ministate.compl.nmatches = filter_len(ministate.compl.filter);
+
 	if ((l = TAILQ_FIRST(&b->head)) != NULL &&
 	    ministate.compl.must_select)
 		l->type = LINE_COMPL_CURRENT;
@@ -598,6 +1167,7 @@ enter_minibuffer(struct minibuffer *minibuffer, const char *fmt, ...)
 	ministate.abortfn = minibuffer->abort;
 	if (ministate.abortfn == NULL)
 		ministate.abortfn = exit_minibuffer;
+	ministate.changedfn = minibuffer->changed;
 
 	ministate.buffer.cpoff = 0;
 	if (minibuffer->input) {
@@ -622,8 +1192,12 @@ enter_minibuffer(struct minibuffer *minibuffer, const char *fmt, ...)
 void
 exit_minibuffer(void)
 {
+	swa_stop();
+
 	if (in_minibuffer == MB_COMPREAD) {
 		erase_buffer(&ministate.compl.buffer);
+		filter_free(ministate.compl.filter);
+		ministate.compl.filter = NULL;
 		ui_schedule_redraw();
 	}
 
@@ -720,10 +1294,11 @@ minibuffer_init(void)
 		err(1, "hist_new");
 
 	TAILQ_INIT(&ministate.compl.buffer.head);
-	TAILQ_INIT(&ministate.compl.buffer.vhead);
 
 	ministate.line.type = LINE_TEXT;
 	ministate.vline.parent = &ministate.line;
 	ministate.buffer.mode = "*minibuffer*";
 	ministate.buffer.current_line = &ministate.vline;
+
+	ev_name(handle_clear_echoarea, "echo area");
 }
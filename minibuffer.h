@@ -36,7 +36,9 @@
  */
 typedef const char *(complfn)(void **, void **, const char **);
 
+struct filter;
 struct hist;
+struct search_match;
 extern struct hist *eecmd_history;
 extern struct hist *ir_history;
 extern struct hist *lu_history;
@@ -48,6 +50,7 @@ struct ministate {
 	char		 prompt[64];
 	void		 (*donefn)(const char *);
 	void		 (*abortfn)(void);
+	void		 (*changedfn)(void);
 
 	char		 buf[1025];
 	struct line	 line;
@@ -62,6 +65,9 @@ struct ministate {
 		complfn		*fn;
 		void		*data;
 		int		 must_select;
+		struct filter	*filter;
+		int		 ranked;
+		size_t		 nmatches;
 	} compl;
 };
 extern struct ministate	 ministate;
@@ -87,11 +93,19 @@ void	 swiper_select(const char *);
 void	 toc_select(const char *);
 void	 uc_select(const char *);
 void	 search_select(const char *);
+void	 sv_select(const char *);
+void	 swa_start(const char *);
+
+void	 isearch_start(struct buffer *, int);
+int	 isearch_repeat(int);
+size_t	 isearch_line(const struct line *, const struct search_match **,
+	    const struct search_match **, size_t *);
 
 struct minibuffer {
 	void		(*self_insert)(void);
 	void		(*done)(const char *);
 	void		(*abort)(void);
+	void		(*changed)(void);	/* after every edit */
 	struct hist	*history;
 	complfn		*complfn;
 	void		*compldata;
@@ -16,20 +16,26 @@
 
 #include "compat.h"
 
-#include <sys/mman.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 
 #include <ctype.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
+#if !HAVE_ASR_RUN
+# include <pthread.h>
+#endif
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <tls.h>
 #include <unistd.h>
 
@@ -38,9 +44,14 @@
 #endif
 
 #include "bufio.h"
+#include "capture.h"
 #include "ev.h"
 #include "imsgev.h"
+#include "parser.h"
+#include "perf.h"
+#include "shmring.h"
 #include "telescope.h"
+#include "trace.h"
 #include "utils.h"
 #include "xwrapper.h"
 
@@ -55,67 +66,348 @@ enum conn_state {
 	CONN_ERROR,
 };
 
+/*
+ * Identifies a client certificate without reading it: the ui process
+ * sends an already opened file.
+ */
+struct ccert_id {
+	dev_t			 dev;
+	ino_t			 ino;
+	off_t			 size;
+	time_t			 mtime;
+};
+
+#if !HAVE_ASR_RUN
+/*
+ * Without asr, getaddrinfo(3) is run by a small pool of threads and
+ * the results are sent back to the event loop through a pipe.
+ */
+#define RESOLVERS	4
+
+struct resolve_job {
+	TAILQ_ENTRY(resolve_job) jobs;
+	struct req		*req;
+	char			*host;
+	char			*port;
+	struct addrinfo		*ai;
+	int			 gai_errno;
+};
+
+static TAILQ_HEAD(, resolve_job) resolve_queue =
+    TAILQ_HEAD_INITIALIZER(resolve_queue);
+static pthread_mutex_t	 resolve_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	 resolve_cond = PTHREAD_COND_INITIALIZER;
+static int		 resolve_pipe[2] = { -1, -1 };
+#endif
+
+/*
+ * Happy Eyeballs (RFC 8305): the addresses are tried in parallel,
+ * alternating the families, with a head start for each one.
+ */
+#define HE_ATTEMPTS	4
+
+struct attempt {
+	int			 fd;
+	int			 family;
+};
+
 /* a pending request */
 struct req {
 	uint32_t		 id;
 	enum conn_state		 state;
 	int			 proto;
+	int			 prio;
+	int			 started;
 	int			 fd;
 	char			*host;
 	char			*port;
 	char			*req;
 	size_t			 len;
-	void			*ccert;
-	size_t			 ccert_len;
-	int			 ccert_fd;
+	struct ident		*ident;
+	struct ccert_id		 ccert_id;
+	int			 dl_fd;
+	int			 dl_blocked;
+	int			 dl_parked;	/* see dl_park */
+	unsigned int		 dl_yield;	/* see dl_yield_ev */
+	size_t			 dl_bytes;
+	int			 hold;		/* see get_req */
+	int			 delayed;	/* IMSG_BACKOFF was sent */
+	int			 watch;		/* see reap_stuck */
+	long long		 watch_ms;
+	int			 warm;		/* see IMSG_PRECONNECT */
+	unsigned int		 warm_timer;
+	char			*warm_hash;
+	int			 warm_resumed;
+#if HAVE_SPLICE
+	int			 dl_pipe[2];	/* see net_splice_download */
+	size_t			 dl_inpipe;
+	int			 dl_nosplice;	/* see net_unsplice */
+	size_t			 dl_told;
+#endif
 
 	int			 eof;
 	unsigned int		 timer;
 	struct bufio		 bio;
+	int			 background;
+	unsigned int		 flush_timer;
+	size_t			 unacked;	/* see BODY_WINDOW */
+	int			 throttled;
+	struct buffer		*pbuf;		/* see net_send_body */
+	char			*recs;
+	size_t			 recslen;
+	size_t			 recscap;
+
+	struct timespec		 start;
+	struct req_timing	 timing;
+	size_t			 received;
 
 	int			 conn_error;
 	const char		*cause;
 
-	struct addrinfo		*servinfo, *p;
+	int			 replay;
+	const char		*replay_hash;
+
+	struct addrinfo		*servinfo;
+	int			 servinfo_cached;
+	struct addrinfo		**addrs;
+	size_t			 naddrs;
+	size_t			 nextaddr;
+	struct attempt		 attempts[HE_ATTEMPTS];
+	unsigned int		 he_timer;
 #if HAVE_ASR_RUN
 	struct asr_query	*q;
 	int			 ar_fd;
+#else
+	struct resolve_job	*job;
 #endif
 
 	TAILQ_ENTRY(req)	 reqs;
+	TAILQ_ENTRY(req)	 queue;
 };
 
 static struct req	*req_by_id(uint32_t);
 
 static void	 die(void) __attribute__((__noreturn__));
 
+static void	 sched_run(void);
+static void	 reap_arm(void);
+static long long monotonic_ms(void);
+static long long backoff_left(const char *);
+static void	 backoff_wake(int, int, void *);
 static void	 close_with_err(struct req*, const char*);
 static void	 close_with_errf(struct req*, const char*, ...)
     __attribute__((format(printf, 2, 3)));
 
-static int	 try_to_connect(struct req *);
+static void	 addrinfo_free(struct addrinfo *);
+
+static void	 attempts_close(struct req *);
+static void	 connect_ev(int, int, void *);
+static void	 connect_start(struct req *);
+static void	 replay_start(struct req *);
 static int	 gemini_parse_reply(struct req *, const char *);
+static void	 net_send_body(struct req *, int);
+static void	 net_trace_timing(struct req *);
+static void	 net_flush_download(int, int, void *);
+static void	 net_download_ev(int, int, void *);
 static void	 net_ev(int, int, void *);
+static void	 warm_ev(int, int, void *);
+static void	 cert_accepted(struct req *);
 static void	 handle_dispatch_imsg(int, int, void*);
 
 static int	 net_send_ui(int, uint32_t, const void *, uint16_t);
 
 /* TODO: making this customizable */
-struct timeval timeout_for_handshake = { 5, 0 };
+/*
+ * The body is sent to the ui in messages as big as possible, waiting
+ * a bit for more data to arrive.  Tabs not shown can wait more.
+ */
+#define IMSG_CHUNK		(MAX_IMSGSIZE - IMSG_HEADER_SIZE)
+#define BATCH_BACKGROUND	(16 * IMSG_CHUNK)
+
+/*
+ * The body sent to the ui and not acked yet with IMSG_BUF_ACK that a
+ * request can have before the socket is not read anymore, so that a
+ * busy ui doesn't make the queue grow without bounds.
+ */
+#define BODY_WINDOW		(64 * IMSG_CHUNK)
+
+struct timeval flush_foreground = { 0, 20000 };
+struct timeval flush_background = { 0, 500000 };
+
+/* where the bodies go when the ui set it up, see IMSG_SHM_RING */
+static struct shmring	 body_ring;
+
+/*
+ * Downloads are written in batches as big as this, or what arrived
+ * in a slice of time if it's slower.
+ */
+#define DL_BATCH		(1024 * 1024)
+
+struct timeval flush_download = { 0, 100000 };
+
+/*
+ * What a started request is waiting for, each phase with its own
+ * limit in seconds, 0 disables it.  The idle one is the time without
+ * anything from the server once the request was sent, unless it's
+ * the ui that's behind.  Once a second the stuck requests are closed,
+ * so that their slots go to the queued ones.
+ */
+#define WATCH_NONE		0
+#define WATCH_CONNECT		1	/* resolving and connecting */
+#define WATCH_HANDSHAKE		2
+#define WATCH_IDLE		3
+
+static int		 connect_timeout = 10;
+static int		 handshake_timeout = 5;
+static int		 idle_timeout = 30;
+static int		 total_timeout = 0;	/* but for downloads */
+
+/*
+ * The socket options of the connections.  The receive buffer is only
+ * raised once a reply grew past RCVBUF_AFTER, since setting it stops
+ * the kernel from tuning it and most replies are short.
+ */
+static int		 tcp_fastopen = 0;
+static int		 tcp_nodelay = 1;
+static int		 tcp_rcvbuf = 0;
+
+#define RCVBUF_AFTER		(256 * 1024)
+static unsigned int	 reap_timer;
+
+struct timeval reap_interval = { 1, 0 };
+
+/*
+ * Connections opened ahead of time to the host of the link under the
+ * cursor: resolved, connected and for Gemini handshaked too, but
+ * without a request yet.  An IMSG_GET for the same host and port
+ * takes one over.  They're closed if not used in a while.
+ */
+#define WARM_MAX		4
+#define WARM_PENDING		1
+#define WARM_READY		2
+
+struct timeval warm_ttl = { 15, 0 };
+struct timeval connection_attempt_delay = { 0, 250000 };
+
+/*
+ * TLS sessions are saved by libtls in a file, so keep a small pool of
+ * anonymous temporary files, created before the sandbox is set up,
+ * and assign them to (host, port, client certificate) in LRU order.
+ * Every slot also keeps the tls_config for that triple, so that the
+ * client certificate isn't read and parsed again on every request.
+ */
+#define TLS_SESSIONS	32
+
+/*
+ * Resolved addresses are cached for dns_ttl seconds, failures for a
+ * few seconds at most, so that a burst of requests to the same host
+ * (redirects, prefetches) doesn't go through the resolver every time.
+ */
+#define DNS_NEG_TTL	5
+#define DNS_MAX		256
+
+struct dns_entry {
+	struct addrinfo		*ai;
+	int			 gai_errno;
+	time_t			 expires;
+	char			 key[];		/* host:port */
+};
+
+static struct ohash	 dns;
+static int		 dns_ttl = 60;
+
+/*
+ * Hosts that replied 44 SLOW DOWN: no request to them is started
+ * before the deadline, whatever its priority.
+ */
+#define BACKOFF_DEFAULT		5
+#define BACKOFF_MAX		3600
+
+struct backoff {
+	long long		 until;		/* ms, CLOCK_MONOTONIC */
+	char			 host[];
+};
+
+static struct ohash	 backoffs;
+static unsigned int	 backoff_timer;
+
+/* the address family that connected last time, per host */
+struct af_pref {
+	int			 family;
+	char			 host[];
+};
+
+static struct ohash	 af_prefs;
+
+struct tls_session {
+	char			*host;
+	char			*port;
+	struct ccert_id		 ccert_id;
+	struct tls_config	*conf;
+	int			 fd;
+	unsigned long		 used;
+};
+
+static struct tls_session	 sessions[TLS_SESSIONS];
+static unsigned long		 sessions_tick;
+
+/*
+ * A copy of the certificate hashes the ui accepts, per host[:port],
+ * so that when they match the request can go on right away instead
+ * of waiting for the ui to check it.
+ */
+struct known_host {
+	char			*hash;
+	char			 domain[];
+};
+
+static struct ohash	 known_hosts;
+
+/*
+ * The client certificates, by identity name.  The ui passes the file
+ * only when it changed since the last time, otherwise the copy kept
+ * here is used.
+ */
+struct ident {
+	struct ccert_id		 id;
+	uint8_t			*pem;
+	size_t			 len;
+	char			 name[];
+};
+
+static struct ohash	 idents;
 
 TAILQ_HEAD(, req) reqhead;
 
+/*
+ * Requests waiting for a free slot, sorted by priority.  Foreground
+ * ones always start right away since the user is waiting for them.
+ */
+#define MAX_CONNS		16
+#define MAX_CONNS_PER_HOST	4
+
+/*
+ * The downloads from the same host that are read at the same time,
+ * the others are parked with their connection open until one ends.
+ * While pages are being loaded the downloads are read only once
+ * every dl_yield_tv, and a spliced one DL_YIELD_BATCH at a time, so
+ * that they don't take the bandwidth from them: the window of their
+ * connection closes and the server slows down.
+ */
+#define MAX_DL_PER_HOST		2
+#define DL_YIELD_BATCH		(16 * 1024)
+
+struct timeval dl_yield_tv = { 0, 25000 };
+
+static TAILQ_HEAD(, req) queue = TAILQ_HEAD_INITIALIZER(queue);
+static int		 nstarted;
+
+static struct ohash	 reqids;
+
 static struct req *
 req_by_id(uint32_t id)
 {
-	struct req *r;
-
-	TAILQ_FOREACH(r, &reqhead, reqs) {
-		if (r->id == id)
-			return r;
-	}
-
-	return NULL;
+	return idmap_get(&reqids, id);
 }
 
 static void __attribute__((__noreturn__))
@@ -138,6 +430,73 @@ req_bio_ev(struct req *req)
 	return (ret);
 }
 
+/*
+ * Whether a page is being loaded for the user: the downloads yield
+ * to it.
+ */
+static int
+pages_loading(void)
+{
+	struct req	*r;
+
+	TAILQ_FOREACH(r, &reqhead, reqs) {
+		if (r->started && !r->background && !r->warm &&
+		    r->dl_fd == -1 && r->state != CONN_CLOSE &&
+		    r->state != CONN_ERROR)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+dl_yield_ev(int fd, int ev, void *d)
+{
+	struct req	*req = d;
+
+	req->dl_yield = 0;
+	ev_add(req->fd, req_bio_ev(req), net_ev, req);
+}
+
+/*
+ * Park the download req if its host has already MAX_DL_PER_HOST
+ * going.  Returns 1 if it was parked.
+ */
+static int
+dl_park(struct req *req)
+{
+	struct req	*r;
+	int		 n = 0;
+
+	TAILQ_FOREACH(r, &reqhead, reqs) {
+		if (r != req && r->dl_fd != -1 && !r->dl_parked &&
+		    !strcmp(r->host, req->host))
+			n++;
+	}
+	if (n < MAX_DL_PER_HOST)
+		return 0;
+
+	req->dl_parked = 1;
+	ev_del(req->fd);
+	perf_count(PERF_DL_PARKED, 1);
+	return 1;
+}
+
+/* resume the oldest download parked for host */
+static void
+dl_unpark(const char *host)
+{
+	struct req	*r;
+
+	TAILQ_FOREACH(r, &reqhead, reqs) {
+		if (r->dl_parked && !strcmp(r->host, host)) {
+			r->dl_parked = 0;
+			r->watch_ms = monotonic_ms();
+			ev_add(r->fd, req_bio_ev(r), net_ev, r);
+			return;
+		}
+	}
+}
+
 static void
 close_conn(int fd, int ev, void *d)
 {
@@ -151,6 +510,12 @@ close_conn(int fd, int ev, void *d)
 		asr_abort(req->q);
 		ev_del(req->ar_fd);
 	}
+#else
+	if (req->job) {
+		/* resolve_done will free it */
+		req->job->req = NULL;
+		req->job = NULL;
+	}
 #endif
 
 	if (req->timer != 0) {
@@ -158,6 +523,23 @@ close_conn(int fd, int ev, void *d)
 		req->timer = 0;
 	}
 
+	attempts_close(req);
+
+	if (req->flush_timer != 0) {
+		ev_timer_cancel(req->flush_timer);
+		req->flush_timer = 0;
+	}
+
+	if (req->warm_timer != 0) {
+		ev_timer_cancel(req->warm_timer);
+		req->warm_timer = 0;
+	}
+
+	if (req->dl_yield != 0) {
+		ev_timer_cancel(req->dl_yield);
+		req->dl_yield = 0;
+	}
+
 	if (req->state == CONN_CLOSE &&
 	    req->fd != -1 &&
 	    bufio_close(&req->bio) == -1 &&
@@ -166,33 +548,65 @@ close_conn(int fd, int ev, void *d)
 		return;
 	}
 
-	if (req->servinfo)
+	if (req->servinfo_cached)
+		addrinfo_free(req->servinfo);
+	else if (req->servinfo)
 		freeaddrinfo(req->servinfo);
+	free(req->addrs);
 
 	bufio_free(&req->bio);
 
-	if (req->ccert != NULL) {
-		munmap(req->ccert, req->ccert_len);
-		close(req->ccert_fd);
+	if (req->pbuf != NULL) {
+		release_buffer(req->pbuf);
+		free(req->pbuf);
+	}
+	free(req->recs);
+
+	if (req->dl_fd != -1) {
+		if (req->dl_blocked)
+			ev_del(req->dl_fd);
+		close(req->dl_fd);
+	}
+#if HAVE_SPLICE
+	if (req->dl_pipe[0] != -1) {
+		close(req->dl_pipe[0]);
+		close(req->dl_pipe[1]);
+	}
+#endif
+
+	/* its slot goes to the next download from the host */
+	if (req->dl_fd != -1 && !req->dl_parked) {
+		req->dl_fd = -1;
+		dl_unpark(req->host);
 	}
 
 	free(req->host);
 	free(req->port);
 	free(req->req);
+	free(req->warm_hash);
 
 	TAILQ_REMOVE(&reqhead, req, reqs);
+	idmap_del(&reqids, req->id, req);
 	if (req->fd != -1) {
 		ev_del(req->fd);
 		close(req->fd);
 	}
+	if (req->started)
+		nstarted--;
+	else
+		TAILQ_REMOVE(&queue, req, queue);
 	free(req);
+
+	sched_run();
 }
 
 static void
 close_with_err(struct req *req, const char *err)
 {
 	req->state = CONN_ERROR;
-	net_send_ui(IMSG_ERR, req->id, err, strlen(err)+1);
+	/* nobody is waiting for a warm one */
+	if (!req->warm)
+		net_send_ui(IMSG_ERR, req->id, err, strlen(err)+1);
 	close_conn(0, 0, req);
 }
 
@@ -211,6 +625,226 @@ close_with_errf(struct req *req, const char *fmt, ...)
 	free(s);
 }
 
+static uint64_t
+req_elapsed(struct req *req)
+{
+	struct timespec	 now, diff;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &req->start, &diff);
+	return diff.tv_sec * 1000000ULL + diff.tv_nsec / 1000;
+}
+
+static void
+req_mark(struct req *req, int phase)
+{
+	req->timing.t[phase] = req_elapsed(req);
+}
+
+/*
+ * Account n bytes read from the socket: the first ones tell whether
+ * the request rode the SYN, and the big replies get the larger
+ * receive buffer.
+ */
+static void
+req_received(struct req *req, size_t n)
+{
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+	struct tcp_info	 ti;
+	socklen_t	 len;
+#endif
+	int		 size;
+
+	if (req->timing.t[TIMING_FIRST_BYTE] == 0) {
+		req_mark(req, TIMING_FIRST_BYTE);
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+		len = sizeof(ti);
+		if (tcp_fastopen && getsockopt(req->fd, IPPROTO_TCP,
+		    TCP_INFO, &ti, &len) == 0 &&
+		    (ti.tcpi_options & TCPI_OPT_SYN_DATA))
+			req->timing.flags |= TIMING_F_FASTOPEN;
+#endif
+	}
+
+	if (req->received < RCVBUF_AFTER &&
+	    req->received + n >= RCVBUF_AFTER && tcp_rcvbuf > 0) {
+		size = tcp_rcvbuf;
+		if (setsockopt(req->fd, SOL_SOCKET, SO_RCVBUF, &size,
+		    sizeof(size)) == 0)
+			req->timing.flags |= TIMING_F_RCVBUF;
+	}
+	req->received += n;
+}
+
+static inline void
+req_watch(struct req *req, int what)
+{
+	req->watch = what;
+	req->watch_ms = monotonic_ms();
+}
+
+/* what the request is known by in a capture */
+static char *
+req_key(struct req *req)
+{
+	char	*key;
+
+	xasprintf(&key, "%d %s %s %s", req->proto, req->host, req->port,
+	    req->req);
+	return key;
+}
+
+/* for the capture, the time spent in the queue doesn't count */
+static uint64_t
+req_capture_usec(struct req *req)
+{
+	return req_elapsed(req) - req->timing.t[TIMING_STARTED];
+}
+
+static void
+addrinfo_free(struct addrinfo *ai)
+{
+	struct addrinfo	*next;
+
+	for (; ai != NULL; ai = next) {
+		next = ai->ai_next;
+		free(ai->ai_addr);
+		free(ai);
+	}
+}
+
+/* copy the parts of the list that try_to_connect needs */
+static struct addrinfo *
+addrinfo_dup(const struct addrinfo *ai)
+{
+	struct addrinfo	*head = NULL, **tail = &head, *n;
+
+	for (; ai != NULL; ai = ai->ai_next) {
+		n = xcalloc(1, sizeof(*n));
+		n->ai_flags = ai->ai_flags;
+		n->ai_family = ai->ai_family;
+		n->ai_socktype = ai->ai_socktype;
+		n->ai_protocol = ai->ai_protocol;
+		n->ai_addrlen = ai->ai_addrlen;
+		n->ai_addr = xmalloc(ai->ai_addrlen);
+		memcpy(n->ai_addr, ai->ai_addr, ai->ai_addrlen);
+		*tail = n;
+		tail = &n->ai_next;
+	}
+
+	return head;
+}
+
+static void
+dns_init(void)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct dns_entry, key),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	ohash_init(&dns, 5, &info);
+}
+
+static void
+dns_remove(unsigned int slot)
+{
+	struct dns_entry	*e;
+
+	if ((e = ohash_remove(&dns, slot)) != NULL) {
+		addrinfo_free(e->ai);
+		free(e);
+	}
+}
+
+static void
+dns_flush(void)
+{
+	struct dns_entry	*e;
+	unsigned int		 i;
+
+	for (e = ohash_first(&dns, &i); e != NULL; e = ohash_next(&dns, &i)) {
+		addrinfo_free(e->ai);
+		free(e);
+	}
+	ohash_delete(&dns);
+	dns_init();
+}
+
+static void
+dns_forget(const char *host, const char *port)
+{
+	char	 key[NI_MAXHOST + NI_MAXSERV + 1];
+
+	snprintf(key, sizeof(key), "%s:%s", host, port);
+	dns_remove(ohash_qlookup(&dns, key));
+}
+
+static void
+dns_store(struct req *req, const struct addrinfo *ai, int gai_errno)
+{
+	struct dns_entry	*e;
+	unsigned int		 slot;
+	char			 key[NI_MAXHOST + NI_MAXSERV + 1];
+	size_t			 len;
+
+	if (dns_ttl == 0)
+		return;
+
+	if (ohash_entries(&dns) >= DNS_MAX)
+		dns_flush();
+
+	len = snprintf(key, sizeof(key), "%s:%s", req->host, req->port) + 1;
+	dns_remove(ohash_qlookup(&dns, key));
+
+	e = xcalloc(1, sizeof(*e) + len);
+	memcpy(e->key, key, len);
+	e->gai_errno = gai_errno;
+	if (gai_errno == 0) {
+		e->ai = addrinfo_dup(ai);
+		e->expires = time(NULL) + dns_ttl;
+	} else
+		e->expires = time(NULL) + MIN(dns_ttl, DNS_NEG_TTL);
+
+	slot = ohash_qlookup(&dns, key);
+	ohash_insert(&dns, slot, e);
+}
+
+/*
+ * Resolve the request from the cache if possible.  Returns 0 if the
+ * resolver has to be used.
+ */
+static int
+dns_lookup(struct req *req)
+{
+	struct dns_entry	*e;
+	unsigned int		 slot;
+	char			 key[NI_MAXHOST + NI_MAXSERV + 1];
+
+	snprintf(key, sizeof(key), "%s:%s", req->host, req->port);
+	slot = ohash_qlookup(&dns, key);
+	if ((e = ohash_find(&dns, slot)) == NULL)
+		return 0;
+
+	if (e->expires < time(NULL)) {
+		dns_remove(slot);
+		return 0;
+	}
+
+	if (e->gai_errno != 0) {
+		close_with_errf(req, "failed to resolve %s: %s",
+		    req->host, gai_strerror(e->gai_errno));
+		return 1;
+	}
+
+	req->servinfo = addrinfo_dup(e->ai);
+	req->servinfo_cached = 1;
+	connect_start(req);
+	return 1;
+}
+
 #if HAVE_ASR_RUN
 static void
 req_resolve(int fd, int ev, void *d)
@@ -221,6 +855,9 @@ req_resolve(int fd, int ev, void *d)
 	struct timeval		 tv;
 
 	if (req->q == NULL) {
+		if (dns_lookup(req))
+			return;
+
 		memset(&hints, 0, sizeof(hints));
 		hints.ai_family = AF_UNSPEC;
 		hints.ai_socktype = SOCK_STREAM;
@@ -267,180 +904,1334 @@ req_resolve(int fd, int ev, void *d)
 	req->q = NULL;
 
 	if (ar.ar_gai_errno) {
+		dns_store(req, NULL, ar.ar_gai_errno);
 		close_with_errf(req, "failed to resolve %s: %s",
 		    req->host, gai_strerror(ar.ar_gai_errno));
 		return;
 	}
 
 	req->servinfo = ar.ar_addrinfo;
+	dns_store(req, req->servinfo, 0);
 
-	req->p = req->servinfo;
-	net_ev(-1, EV_READ, req);
+	connect_start(req);
 }
 #else
-static void
-req_resolve(int fd, int ev, struct req *req)
+static void *
+resolver(void *arg)
 {
+	struct resolve_job	*job;
 	struct addrinfo		 hints;
-	int			 s;
 
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_UNSPEC;
-	hints.ai_socktype = SOCK_STREAM;
+	for (;;) {
+		pthread_mutex_lock(&resolve_mtx);
+		while ((job = TAILQ_FIRST(&resolve_queue)) == NULL)
+			pthread_cond_wait(&resolve_cond, &resolve_mtx);
+		TAILQ_REMOVE(&resolve_queue, job, jobs);
+		pthread_mutex_unlock(&resolve_mtx);
 
-	s = getaddrinfo(req->host, req->port, &hints, &req->servinfo);
-	if (s != 0) {
-		close_with_errf(req, "failed to resolve %s: %s",
-		    req->host, gai_strerror(s));
-		return;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+
+		job->gai_errno = getaddrinfo(job->host, job->port, &hints,
+		    &job->ai);
+
+		if (write(resolve_pipe[1], &job, sizeof(job)) != sizeof(job))
+			_exit(1);
 	}
 
-	req->fd = -1;
-	req->p = req->servinfo;
-	net_ev(-1, EV_READ, req);
+	return NULL;
 }
-#endif
 
-static int
-try_to_connect(struct req *req)
+static void
+resolve_done(int fd, int ev, void *d)
 {
-	int		 error;
-	socklen_t	 len = sizeof(error);
+	struct resolve_job	*job;
+	struct req		*req;
+	ssize_t			 n;
 
- again:
-	if (req->p == NULL)
-		return (-1);
+	for (;;) {
+		n = read(fd, &job, sizeof(job));
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			return;
+		if (n != sizeof(job))
+			die();
+
+		if ((req = job->req) == NULL) {
+			if (job->ai)
+				freeaddrinfo(job->ai);
+		} else if (job->gai_errno != 0) {
+			req->job = NULL;
+			dns_store(req, NULL, job->gai_errno);
+			close_with_errf(req, "failed to resolve %s: %s",
+			    req->host, gai_strerror(job->gai_errno));
+		} else {
+			req->job = NULL;
+			req->servinfo = job->ai;
+			dns_store(req, req->servinfo, 0);
+
+			connect_start(req);
+		}
 
-	if (req->fd != -1) {
-		if (getsockopt(req->fd, SOL_SOCKET, SO_ERROR, &error,
-		    &len) == -1) {
-			req->conn_error = errno;
-			req->cause = "getsockopt";
+		free(job->host);
+		free(job->port);
+		free(job);
+	}
+}
+
+/*
+ * Must be called after the sandbox is in place: threads created
+ * afterwards inherit the restrictions of the process.
+ */
+static void
+resolvers_init(void)
+{
+	pthread_t	 t;
+	int		 i;
+
+	if (pipe(resolve_pipe) == -1)
+		err(1, "pipe");
+	if (!mark_nonblock_cloexec(resolve_pipe[0]) ||
+	    fcntl(resolve_pipe[1], F_SETFD, FD_CLOEXEC) == -1)
+		err(1, "fcntl");
+	if (ev_add(resolve_pipe[0], EV_READ, resolve_done, NULL) == -1)
+		err(1, "ev_add");
+
+	for (i = 0; i < RESOLVERS; ++i) {
+		if ((errno = pthread_create(&t, NULL, resolver, NULL)) != 0)
+			err(1, "pthread_create");
+		pthread_detach(t);
+	}
+}
+
+static void
+req_resolve(int fd, int ev, struct req *req)
+{
+	struct resolve_job	*job;
+
+	if (dns_lookup(req))
+		return;
+
+	job = xcalloc(1, sizeof(*job));
+	job->req = req;
+	job->host = xstrdup(req->host);
+	job->port = xstrdup(req->port);
+	req->job = job;
+
+	pthread_mutex_lock(&resolve_mtx);
+	TAILQ_INSERT_TAIL(&resolve_queue, job, jobs);
+	pthread_cond_signal(&resolve_cond);
+	pthread_mutex_unlock(&resolve_mtx);
+}
+#endif
+
+static int
+host_conns(const char *host)
+{
+	struct req	*r;
+	int		 n = 0;
+
+	TAILQ_FOREACH(r, &reqhead, reqs) {
+		if (r->started && !strcmp(r->host, host))
+			n++;
+	}
+	return n;
+}
+
+static void
+sched_add(struct req *req)
+{
+	struct req	*r;
+
+	TAILQ_FOREACH(r, &queue, queue) {
+		if (r->prio < req->prio) {
+			TAILQ_INSERT_BEFORE(r, req, queue);
+			goto run;
+		}
+	}
+	TAILQ_INSERT_TAIL(&queue, req, queue);
+
+ run:
+	sched_run();
+}
+
+/*
+ * Start the queued requests that fit in the limits.  The ones for a
+ * host that asked to slow down wait for the earliest deadline.
+ */
+static void
+sched_run(void)
+{
+	static int	 running;
+	struct req	*req;
+	struct timeval	 tv;
+	long long	 wait, next = 0;
+	int		 secs;
+
+	/* starting a request can end up closing one */
+	if (running)
+		return;
+	running = 1;
+
+ again:
+	TAILQ_FOREACH(req, &queue, queue) {
+		if ((wait = backoff_left(req->host)) > 0) {
+			secs = (wait + 999) / 1000;
+			if (!req->delayed && !req->warm)
+				net_send_ui(IMSG_BACKOFF, req->id, &secs,
+				    sizeof(secs));
+			req->delayed = 1;
+			if (next == 0 || wait < next)
+				next = wait;
+			continue;
+		}
+
+		if (req->prio != PRIO_FOREGROUND &&
+		    (nstarted >= MAX_CONNS ||
+		    host_conns(req->host) >= MAX_CONNS_PER_HOST))
+			continue;
+
+		TAILQ_REMOVE(&queue, req, queue);
+		req->started = 1;
+		nstarted++;
+		req_mark(req, TIMING_STARTED);
+		req_watch(req, WATCH_CONNECT);
+		if (capture_mode == CAPTURE_REPLAY)
+			replay_start(req);
+		else
+			req_resolve(-1, 0, req);
+		goto again;
+	}
+
+	if (next > 0) {
+		if (backoff_timer != 0)
+			ev_timer_cancel(backoff_timer);
+		tv.tv_sec = next / 1000;
+		tv.tv_usec = next % 1000 * 1000;
+		backoff_timer = ev_timer(&tv, backoff_wake, NULL);
+	}
+
+	reap_arm();
+	running = 0;
+}
+
+/* close the started requests stuck for longer than their phase allows */
+static void
+reap_stuck(int fd, int ev, void *d)
+{
+	struct req	*req;
+	long long	 now;
+	int		 limit;
+	const char	*what;
+
+	reap_timer = 0;
+
+ again:
+	now = monotonic_ms();
+	TAILQ_FOREACH(req, &reqhead, reqs) {
+		if (!req->started)
+			continue;
+
+		/* the ui or the file are slow, not the server */
+		if (req->throttled || req->dl_blocked || req->dl_parked) {
+			req->watch_ms = now;
+			continue;
+		}
+
+		if (total_timeout > 0 && !req->warm && req->dl_fd == -1 &&
+		    req_elapsed(req) >= total_timeout * 1000000ULL) {
+			close_with_err(req, "Timeout loading page");
+			/* closing one can start or close others */
+			goto again;
+		}
+
+		switch (req->watch) {
+		case WATCH_CONNECT:
+			limit = connect_timeout;
+			what = "connecting to";
+			break;
+		case WATCH_HANDSHAKE:
+			limit = handshake_timeout;
+			what = "during the handshake with";
+			break;
+		case WATCH_IDLE:
+			limit = idle_timeout;
+			what = "waiting for";
+			break;
+		default:
+			continue;
+		}
+
+		if (limit > 0 && now - req->watch_ms >= limit * 1000LL) {
+			close_with_errf(req, "Timeout %s %s", what,
+			    req->host);
+			goto again;
+		}
+	}
+
+	reap_arm();
+}
+
+static void
+reap_arm(void)
+{
+	if (reap_timer == 0 && nstarted > 0)
+		reap_timer = ev_timer(&reap_interval, reap_stuck, NULL);
+}
+
+static void
+af_prefs_init(void)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct af_pref, host),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	ohash_init(&af_prefs, 5, &info);
+}
+
+static void
+backoffs_init(void)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct backoff, host),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	ohash_init(&backoffs, 4, &info);
+}
+
+static long long
+monotonic_ms(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+/* the milliseconds to wait before talking to host again, if any */
+static long long
+backoff_left(const char *host)
+{
+	struct backoff	*b;
+	unsigned int	 slot;
+	long long	 now;
+
+	if (ohash_entries(&backoffs) == 0)
+		return 0;
+
+	slot = ohash_qlookup(&backoffs, host);
+	if ((b = ohash_find(&backoffs, slot)) == NULL)
+		return 0;
+	if ((now = monotonic_ms()) >= b->until) {
+		ohash_remove(&backoffs, slot);
+		free(b);
+		return 0;
+	}
+	return b->until - now;
+}
+
+/* meta is the seconds to wait as sent with the 44 reply */
+static void
+backoff_set(const char *host, const char *meta)
+{
+	struct backoff	*b;
+	unsigned int	 slot;
+	const char	*errstr;
+	size_t		 len;
+	long long	 secs;
+
+	/* a huge delay is the maximum, a negative or zero one the default */
+	secs = strtonum(meta, LLONG_MIN, LLONG_MAX, &errstr);
+	if (errstr != NULL && errno == ERANGE && strchr(meta, '-') == NULL)
+		secs = BACKOFF_MAX;
+	else if (errstr != NULL || secs < 1)
+		secs = BACKOFF_DEFAULT;
+	secs = MIN(secs, BACKOFF_MAX);
+
+	slot = ohash_qlookup(&backoffs, host);
+	if ((b = ohash_find(&backoffs, slot)) == NULL) {
+		len = strlen(host) + 1;
+		b = xcalloc(1, sizeof(*b) + len);
+		memcpy(b->host, host, len);
+		ohash_insert(&backoffs, slot, b);
+	}
+	b->until = monotonic_ms() + secs * 1000;
+}
+
+static void
+backoff_wake(int fd, int ev, void *d)
+{
+	backoff_timer = 0;
+	sched_run();
+}
+
+static int
+af_pref_get(const char *host)
+{
+	struct af_pref	*af;
+
+	af = ohash_find(&af_prefs, ohash_qlookup(&af_prefs, host));
+	return af != NULL ? af->family : AF_UNSPEC;
+}
+
+static void
+af_pref_set(const char *host, int family)
+{
+	struct af_pref	*af;
+	unsigned int	 slot, i;
+	size_t		 len;
+
+	slot = ohash_qlookup(&af_prefs, host);
+	if ((af = ohash_find(&af_prefs, slot)) != NULL) {
+		af->family = family;
+		return;
+	}
+
+	if (ohash_entries(&af_prefs) >= DNS_MAX) {
+		for (af = ohash_first(&af_prefs, &i); af != NULL;
+		    af = ohash_next(&af_prefs, &i))
+			free(af);
+		ohash_delete(&af_prefs);
+		af_prefs_init();
+		slot = ohash_qlookup(&af_prefs, host);
+	}
+
+	len = strlen(host) + 1;
+	af = xmalloc(sizeof(*af) + len);
+	af->family = family;
+	memcpy(af->host, host, len);
+	ohash_insert(&af_prefs, slot, af);
+}
+
+static void
+known_hosts_init(void)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct known_host, domain),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	ohash_init(&known_hosts, 5, &info);
+}
+
+static void
+idents_init(void)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct ident, name),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	ohash_init(&idents, 5, &info);
+}
+
+static void
+known_host_set(const char *domain, const char *hash)
+{
+	struct known_host *kh;
+	unsigned int	 slot;
+	size_t		 len;
+
+	slot = ohash_qlookup(&known_hosts, domain);
+	if ((kh = ohash_find(&known_hosts, slot)) == NULL) {
+		len = strlen(domain) + 1;
+		kh = xmalloc(sizeof(*kh) + len);
+		memcpy(kh->domain, domain, len);
+		ohash_insert(&known_hosts, slot, kh);
+	} else
+		free(kh->hash);
+	kh->hash = xstrdup(hash);
+}
+
+/* whether the ui would accept the certificate of the request */
+static int
+known_host_match(struct req *req, const char *hash)
+{
+	struct known_host *kh;
+	char		 domain[NI_MAXHOST + NI_MAXSERV + 1];
+
+	strlcpy(domain, req->host, sizeof(domain));
+	if (*req->port != '\0' && strcmp(req->port, "1965")) {
+		strlcat(domain, ":", sizeof(domain));
+		strlcat(domain, req->port, sizeof(domain));
+	}
+
+	kh = ohash_find(&known_hosts, ohash_qlookup(&known_hosts, domain));
+	return kh != NULL && !strcmp(kh->hash, hash);
+}
+
+/*
+ * Sort the addresses for the connection attempts: the preferred
+ * family first, then alternating with the others (RFC 8305 s. 4).
+ * The preferred family is the one that worked last time for this
+ * host, otherwise the one of the first address returned by the
+ * resolver, which already sorted them.
+ */
+static void
+sort_addrs(struct req *req)
+{
+	struct addrinfo	*ai, **tmp;
+	size_t		 n = 0, np = 0, i, j;
+	int		 family;
+
+	for (ai = req->servinfo; ai != NULL; ai = ai->ai_next)
+		n++;
+	req->addrs = xcalloc(n, sizeof(*req->addrs));
+	req->naddrs = n;
+	req->nextaddr = 0;
+
+	if (n == 0)
+		return;
+
+	family = af_pref_get(req->host);
+	if (family == AF_UNSPEC)
+		family = req->servinfo->ai_family;
+
+	for (ai = req->servinfo; ai != NULL; ai = ai->ai_next)
+		if (ai->ai_family == family)
+			np++;
+
+	/* the preferred family first, then the others */
+	tmp = xcalloc(n, sizeof(*tmp));
+	i = 0, j = np;
+	for (ai = req->servinfo; ai != NULL; ai = ai->ai_next) {
+		if (ai->ai_family == family)
+			tmp[i++] = ai;
+		else
+			tmp[j++] = ai;
+	}
+
+	for (n = 0, i = 0, j = np; n < req->naddrs;) {
+		if (i < np)
+			req->addrs[n++] = tmp[i++];
+		if (j < req->naddrs)
+			req->addrs[n++] = tmp[j++];
+	}
+	free(tmp);
+}
+
+static int
+attempts_pending(struct req *req)
+{
+	size_t	 i;
+	int	 n = 0;
+
+	for (i = 0; i < HE_ATTEMPTS; ++i)
+		if (req->attempts[i].fd != -1)
+			n++;
+	return n;
+}
+
+static void
+attempts_close(struct req *req)
+{
+	size_t	 i;
+
+	for (i = 0; i < HE_ATTEMPTS; ++i) {
+		if (req->attempts[i].fd == -1)
+			continue;
+		ev_del(req->attempts[i].fd);
+		close(req->attempts[i].fd);
+		req->attempts[i].fd = -1;
+	}
+
+	if (req->he_timer != 0) {
+		ev_timer_cancel(req->he_timer);
+		req->he_timer = 0;
+	}
+}
+
+/*
+ * The options are only hints: a connection without them still works.
+ * With TCP_FASTOPEN_CONNECT the connect is deferred until the first
+ * write, the ClientHello or the request, that goes out with the SYN
+ * when the kernel has a cookie for the server.
+ */
+static void
+sock_options(struct req *req, int fd)
+{
+	int	 one = 1;
+
+	if (tcp_nodelay && setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one,
+	    sizeof(one)) == 0)
+		req->timing.flags |= TIMING_F_NODELAY;
+
+#ifdef TCP_FASTOPEN_CONNECT
+	/*
+	 * The connection seems established at once, so the Happy
+	 * Eyeballs attempts couldn't tell the good addresses apart.
+	 */
+	if (tcp_fastopen && req->naddrs == 1)
+		setsockopt(fd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT, &one,
+		    sizeof(one));
+#endif
+}
+
+/*
+ * Start a connection attempt to the next address.  Returns -1 when
+ * no more attempts can be made right now.
+ */
+static int
+connect_next(struct req *req)
+{
+	struct addrinfo	*ai;
+	struct attempt	*at = NULL;
+	size_t		 i;
+	int		 fd;
+
+	for (i = 0; i < HE_ATTEMPTS; ++i) {
+		if (req->attempts[i].fd == -1) {
+			at = &req->attempts[i];
+			break;
+		}
+	}
+	if (at == NULL)
+		return (-1);
+
+	while (req->nextaddr < req->naddrs) {
+		ai = req->addrs[req->nextaddr++];
+
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) {
+			req->conn_error = errno;
+			req->cause = "socket";
+			continue;
+		}
+
+		if (!mark_nonblock_cloexec(fd)) {
+			req->conn_error = errno;
+			req->cause = "setsockopt";
+			close(fd);
+			continue;
+		}
+
+		sock_options(req, fd);
+
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == -1 &&
+		    errno != EINPROGRESS) {
+			req->conn_error = errno;
+			req->cause = "connect";
+			close(fd);
+			continue;
+		}
+
+		if (ev_add(fd, EV_WRITE, connect_ev, req) == -1) {
+			req->conn_error = errno;
+			req->cause = "ev_add";
+			close(fd);
+			continue;
+		}
+
+		at->fd = fd;
+		at->family = ai->ai_family;
+		return (0);
+	}
+
+	return (-1);
+}
+
+/*
+ * Start one more attempt and, if there are addresses left, schedule
+ * the next one after the head start.  Fails the request when
+ * nothing is pending anymore.
+ */
+static void
+connect_more(struct req *req)
+{
+	connect_next(req);
+
+	if (req->he_timer == 0 && req->nextaddr < req->naddrs) {
+		req->he_timer = ev_timer(&connection_attempt_delay,
+		    connect_ev, req);
+	}
+
+	if (attempts_pending(req) == 0) {
+		/* the addresses may have changed */
+		dns_forget(req->host, req->port);
+		close_with_errf(req, "failed to connect to %s (%s: %s)",
+		    req->host, req->cause, strerror(req->conn_error));
+	}
+}
+
+static void
+connect_ev(int fd, int ev, void *d)
+{
+	struct req	*req = d;
+	struct attempt	*at = NULL;
+	socklen_t	 len;
+	size_t		 i;
+	int		 error;
+
+	if (ev == EV_TIMEOUT) {
+		req->he_timer = 0;
+		connect_more(req);
+		return;
+	}
+
+	for (i = 0; i < HE_ATTEMPTS; ++i) {
+		if (req->attempts[i].fd == fd) {
+			at = &req->attempts[i];
+			break;
+		}
+	}
+	if (at == NULL)
+		return;
+
+	len = sizeof(error);
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+		error = errno;
+
+	if (error != 0) {
+		req->conn_error = error;
+		req->cause = "connect";
+		ev_del(fd);
+		close(fd);
+		at->fd = -1;
+		connect_more(req);
+		return;
+	}
+
+	/* the winner: drop the other attempts */
+	at->fd = -1;
+	ev_del(fd);
+	attempts_close(req);
+	af_pref_set(req->host, at->family);
+	req_mark(req, TIMING_CONNECTED);
+
+	req->fd = fd;
+	net_ev(fd, EV_WRITE, req);
+}
+
+static void
+connect_start(struct req *req)
+{
+	req_mark(req, TIMING_RESOLVED);
+	if (req->servinfo_cached)
+		perf_count(PERF_DNS_CACHED, 1);
+	else {
+		perf_count(PERF_DNS_LOOKUPS, 1);
+		perf_count(PERF_DNS, req->timing.t[TIMING_RESOLVED] -
+		    req->timing.t[TIMING_STARTED]);
+	}
+
+	req->state = CONN_CONNECTING;
+	req->fd = -1;
+	sort_addrs(req);
+
+	req->cause = "connect";
+	req->conn_error = EHOSTUNREACH;
+	connect_more(req);
+}
+
+static void
+replay_connected(int fd, int ev, void *d)
+{
+	struct req	*req = d;
+
+	req->timer = 0;
+	req_mark(req, TIMING_CONNECTED);
+	net_ev(req->fd, EV_WRITE, req);
+}
+
+/*
+ * Connect the request to its reply in the capture instead of the
+ * server.  With the original pacing the handshake takes as long as
+ * it did when it was recorded.
+ */
+static void
+replay_start(struct req *req)
+{
+	struct timeval	 tv;
+	uint64_t	 cert_usec;
+	char		*key;
+	int		 sv[2], r;
+
+	req_mark(req, TIMING_RESOLVED);
+	req->state = CONN_CONNECTING;
+	req->replay = 1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, sv) == -1) {
+		close_with_errf(req, "socketpair: %s", strerror(errno));
+		return;
+	}
+	req->fd = sv[0];
+	if (!mark_nonblock_cloexec(sv[0]) || !mark_nonblock_cloexec(sv[1])) {
+		close(sv[1]);
+		close_with_errf(req, "fcntl: %s", strerror(errno));
+		return;
+	}
+
+	key = req_key(req);
+	r = capture_start(key, sv[1], &cert_usec, &req->replay_hash);
+	free(key);
+	if (r == -1) {
+		close(sv[1]);
+		close_with_err(req, "Not found in the capture");
+		return;
+	}
+
+	if (cert_usec == 0) {
+		replay_connected(-1, 0, req);
+		return;
+	}
+
+	tv.tv_sec = cert_usec / 1000000;
+	tv.tv_usec = cert_usec % 1000000;
+	if ((req->timer = ev_timer(&tv, replay_connected, req)) == 0)
+		close_with_err(req, "failed to setup replay timer");
+}
+
+static int
+gemini_parse_reply(struct req *req, const char *header)
+{
+	struct ibuf	*ibuf;
+	size_t		 len;
+	int		 code;
+
+	if (!isdigit(header[0]) || !isdigit(header[1]))
+		return -1;
+
+	code = (header[0] - '0')*10 + (header[1] - '0');
+	if (header[2] != ' ')
+		return -1;
+
+	header += 3;
+	len = strlen(header) + 1;
+
+	if (code == 44 && !req->replay)
+		backoff_set(req->host, header);
+
+	if ((ibuf = imsg_create(&iev_ui->ibuf, IMSG_REPLY, req->id, 0,
+	    sizeof(code) + len)) == NULL)
+		die();
+	if (imsg_add(ibuf, &code, sizeof(code)) == -1 ||
+	    imsg_add(ibuf, header, len) == -1)
+		die();
+	imsg_close_event(iev_ui, ibuf);
+	return code;
+}
+
+static void
+sessions_init(void)
+{
+	FILE	*fp;
+	size_t	 i;
+
+	for (i = 0; i < TLS_SESSIONS; ++i) {
+		sessions[i].fd = -1;
+		/* tmpfile(3) removes the file already */
+		if ((fp = tmpfile()) == NULL)
+			continue;
+		sessions[i].fd = fileno(fp);
+	}
+}
+
+static int
+same_ccert(const struct ccert_id *a, const struct ccert_id *b)
+{
+	return a->dev == b->dev && a->ino == b->ino &&
+	    a->size == b->size && a->mtime == b->mtime;
+}
+
+static struct tls_config *
+tls_conf_new(struct req *req, int sessfd)
+{
+	struct tls_config	*conf;
+	struct ident		*id;
+
+	if ((conf = tls_config_new()) == NULL)
+		return (NULL);
+
+	/* the certificate is checked by the ui process */
+	tls_config_insecure_noverifycert(conf);
+	tls_config_insecure_noverifyname(conf);
+	tls_config_insecure_noverifytime(conf);
+
+	if ((id = req->ident) != NULL &&
+	    tls_config_set_keypair_mem(conf, id->pem, id->len, id->pem,
+	    id->len) == -1) {
+		tls_config_free(conf);
+		return (NULL);
+	}
+
+	/* not fatal: the handshake is just not resumed */
+	if (sessfd != -1)
+		(void)tls_config_set_session_fd(conf, sessfd);
+
+	return (conf);
+}
+
+/*
+ * Return the tls_config for the request.  It's owned by the session
+ * pool unless *owned is set.  libtls keeps a reference to the config
+ * for every context configured with it, so it can be freed as soon
+ * as tls_configure is done.
+ */
+static struct tls_config *
+tls_conf_for(struct req *req, int *owned)
+{
+	struct tls_session	*s, *lru = NULL;
+	size_t			 i;
+
+	for (i = 0; i < TLS_SESSIONS; ++i) {
+		s = &sessions[i];
+		if (s->fd == -1)
+			continue;
+
+		if (s->conf != NULL && !strcmp(s->host, req->host) &&
+		    !strcmp(s->port, req->port) &&
+		    same_ccert(&s->ccert_id, &req->ccert_id)) {
+			s->used = ++sessions_tick;
+			*owned = 0;
+			return (s->conf);
+		}
+
+		if (lru == NULL || s->used < lru->used)
+			lru = s;
+	}
+
+	if (lru == NULL || ftruncate(lru->fd, 0) == -1) {
+		*owned = 1;
+		return (tls_conf_new(req, -1));
+	}
+
+	tls_config_free(lru->conf);
+	free(lru->host);
+	free(lru->port);
+	lru->host = NULL;
+	lru->port = NULL;
+
+	if ((lru->conf = tls_conf_new(req, lru->fd)) == NULL)
+		return (NULL);
+	lru->host = xstrdup(req->host);
+	lru->port = xstrdup(req->port);
+	lru->ccert_id = req->ccert_id;
+	lru->used = ++sessions_tick;
+	*owned = 0;
+	return (lru->conf);
+}
+
+static inline int
+net_send_req(struct req *req)
+{
+	return (bufio_compose(&req->bio, req->req, req->len));
+}
+
+/*
+ * Write what was read so far to the download file once there's a
+ * batch of it, or when forced, and tell the ui how much was saved.
+ * If the file can't take it all, like a slow pipe, stop reading from
+ * the server until it can.
+ */
+static int
+net_write_download(struct req *req, int force)
+{
+	const uint8_t	*data;
+	size_t		 avail, done = 0;
+	ssize_t		 w;
+
+	data = bufio_peek(&req->bio, &avail);
+	if (avail == 0)
+		return (0);
+
+	if (!force && avail < DL_BATCH) {
+		if (req->flush_timer == 0)
+			req->flush_timer = ev_timer(&flush_download,
+			    net_flush_download, req);
+		return (0);
+	}
+
+	if (req->flush_timer != 0) {
+		ev_timer_cancel(req->flush_timer);
+		req->flush_timer = 0;
+	}
+
+	while (done < avail) {
+		w = write(req->dl_fd, data + done, avail - done);
+		if (w == -1 && errno == EINTR)
+			continue;
+		if (w == -1 && errno == EAGAIN) {
+			req->dl_blocked = 1;
+			ev_del(req->fd);
+			if (ev_add(req->dl_fd, EV_WRITE, net_download_ev,
+			    req) == -1)
+				return (-1);
+			break;
+		}
+		if (w == -1)
+			return (-1);
+		done += w;
+	}
+
+	if (done == 0)
+		return (0);
+
+	buf_drain(&req->bio.rbuf, done);
+	req->dl_bytes += done;
+	net_send_ui(IMSG_DOWNLOAD_PROGRESS, req->id, &req->dl_bytes,
+	    sizeof(req->dl_bytes));
+	return (0);
+}
+
+static void
+net_flush_download(int fd, int ev, void *d)
+{
+	struct req	*req = d;
+
+	req->flush_timer = 0;
+	if (net_write_download(req, 1) == -1)
+		close_with_errf(req, "can't save the download: %s",
+		    strerror(errno));
+}
+
+#if HAVE_SPLICE
+/*
+ * Plaintext downloads that aren't being recorded don't need to go
+ * through bufio: the body is moved from the socket to the file by the
+ * kernel, through a pipe.
+ */
+static int
+net_can_splice(struct req *req)
+{
+	return req->dl_fd != -1 && req->state == CONN_BODY &&
+	    req->bio.ctx == NULL && !req->replay && !req->dl_nosplice &&
+	    capture_mode != CAPTURE_RECORD;
+}
+
+/*
+ * The socket or the file can't be spliced, on some filesystems for
+ * example: move what's in the pipe back to bufio and go on with the
+ * plain read and write, net_write_download saves it from there.
+ */
+static int
+net_unsplice(struct req *req)
+{
+	char		 buf[BUFSIZ];
+	ssize_t		 n;
+
+	req->dl_nosplice = 1;
+	if (req->flush_timer != 0) {
+		ev_timer_cancel(req->flush_timer);
+		req->flush_timer = 0;
+	}
+
+	while (req->dl_inpipe > 0) {
+		n = read(req->dl_pipe[0], buf, MIN(sizeof(buf),
+		    req->dl_inpipe));
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n <= 0 || buf_append(&req->bio.rbuf, buf, n) == -1)
+			return (-1);
+		req->dl_inpipe -= n;
+	}
+	return (0);
+}
+
+/* tell the ui about the bytes saved since the last time */
+static void
+net_tell_download(int fd, int ev, void *d)
+{
+	struct req	*req = d;
+
+	req->flush_timer = 0;
+	if (req->dl_told == req->dl_bytes)
+		return;
+	req->dl_told = req->dl_bytes;
+	net_send_ui(IMSG_DOWNLOAD_PROGRESS, req->id, &req->dl_bytes,
+	    sizeof(req->dl_bytes));
+}
+
+/*
+ * Splice what the socket has to the download file.  What's already
+ * in the pipe goes first; if the file can't take it, wait until it
+ * can as net_write_download does.  At most a DL_BATCH is read each
+ * time, so that the other connections get their turn.  Sets req->eof
+ * at the end of the reply.
+ */
+static int
+net_splice_download(struct req *req)
+{
+	ssize_t		 n;
+	size_t		 batch;
+	int		 read = 0;
+
+	if (req->dl_pipe[0] == -1 &&
+	    pipe2(req->dl_pipe, O_CLOEXEC|O_NONBLOCK) == -1)
+		return (-1);
+
+	batch = pages_loading() ? DL_YIELD_BATCH : DL_BATCH;
+	for (;;) {
+		while (req->dl_inpipe > 0) {
+			n = splice(req->dl_pipe[0], NULL, req->dl_fd, NULL,
+			    req->dl_inpipe, SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+			if (n == -1 && errno == EINTR)
+				continue;
+			if (n == -1 && (errno == EINVAL || errno == ENOSYS))
+				return (net_unsplice(req));
+			if (n == -1 && errno == EAGAIN) {
+				req->dl_blocked = 1;
+				ev_del(req->fd);
+				if (ev_add(req->dl_fd, EV_WRITE,
+				    net_download_ev, req) == -1)
+					return (-1);
+				return (0);
+			}
+			if (n == -1)
+				return (-1);
+			req->dl_inpipe -= n;
+			req->dl_bytes += n;
+		}
+
+		if (req->eof || read)
+			break;
+
+		n = splice(req->fd, NULL, req->dl_pipe[1], NULL, batch,
+		    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+		if (n == -1 && errno == EINTR)
+			continue;
+		if (n == -1 && errno == EAGAIN)
+			break;
+		if (n == -1 && (errno == EINVAL || errno == ENOSYS))
+			return (net_unsplice(req));
+		if (n == -1)
 			return (-1);
+		if (n == 0)
+			req->eof = 1;
+		read = 1;
+		req->dl_inpipe = n;
+		perf_count(PERF_BYTES_IN, n);
+		if (n > 0) {
+			req_received(req, n);
+			req->watch_ms = monotonic_ms();
 		}
+	}
+
+	if (req->eof) {
+		if (req->flush_timer != 0) {
+			ev_timer_cancel(req->flush_timer);
+			req->flush_timer = 0;
+		}
+		net_tell_download(-1, 0, req);
+	} else if (req->flush_timer == 0 && req->dl_told != req->dl_bytes)
+		req->flush_timer = ev_timer(&flush_download,
+		    net_tell_download, req);
+	return (0);
+}
+#endif
+
+/* the download file can take more data */
+static void
+net_download_ev(int fd, int ev, void *d)
+{
+	struct req	*req = d;
+
+	ev_del(req->dl_fd);
+	req->dl_blocked = 0;
+	net_ev(req->fd, 0, req);
+}
+
+static void
+net_flush_body(int fd, int ev, void *d)
+{
+	struct req	*req = d;
+
+	req->flush_timer = 0;
+	net_send_body(req, 1);
+}
+
+/*
+ * Send the body read so far once there's enough for a batch, or
+ * when forced.  Otherwise wait a bit for more data to arrive.  When
+ * the ui asked for it, the body is parsed here and what's sent are
+ * the lines, see gemtext_load_records.
+ */
+static void
+net_send_body(struct req *req, int force)
+{
+	struct shmring_chunk chunk;
+	const uint8_t	*data;
+	size_t		 avail, len, batch;
+
+	data = bufio_peek(&req->bio, &avail);
+	batch = req->background ? BATCH_BACKGROUND : IMSG_CHUNK;
+
+	if (!force && avail < batch) {
+		if (avail != 0 && req->flush_timer == 0)
+			req->flush_timer = ev_timer(req->background ?
+			    &flush_background : &flush_foreground,
+			    net_flush_body, req);
+		return;
+	}
 
-		if (error == 0) /* connected */
-			return (0);
+	if (req->flush_timer != 0) {
+		ev_timer_cancel(req->flush_timer);
+		req->flush_timer = 0;
+	}
 
-		req->conn_error = error;
-		req->cause = "connect";
-		close(req->fd);
-		req->fd = -1;
-		req->p = req->p->ai_next;
-		goto again;
+	if (req->pbuf != NULL) {
+		if ((avail != 0 &&
+		    !parser_parse(req->pbuf, (const char *)data, avail)) ||
+		    (req->eof && !parser_flush(req->pbuf)))
+			die();
+		buf_drain(&req->bio.rbuf, SIZE_MAX);
+
+		req->recslen = 0;
+		gemtext_pack_lines(req->pbuf, &req->recs, &req->recslen,
+		    &req->recscap);
+		empty_linelist(req->pbuf);
+		data = (const uint8_t *)req->recs;
+		avail = req->recslen;
 	}
 
-	req->fd = socket(req->p->ai_family, req->p->ai_socktype,
-	    req->p->ai_protocol);
-	if (req->fd == -1) {
-		req->conn_error = errno;
-		req->cause = "socket";
-		req->p = req->p->ai_next;
-		goto again;
+	if (tracing()) {
+		char	 arg[32];
+
+		(void)snprintf(arg, sizeof(arg), "%zu bytes", avail);
+		trace_instant("IMSG_BUF", req->id, arg);
 	}
 
-	if (!mark_nonblock_cloexec(req->fd)) {
-		req->conn_error = errno;
-		req->cause = "setsockopt";
-		return (-1);
+	/*
+	 * Put the body in the ring if there's room, otherwise in
+	 * messages, since imsg can't handle those that are "too big".
+	 */
+	while (avail > 0) {
+		len = MIN(avail, shmring_max_chunk(&body_ring));
+		if (shmring_put(&body_ring, data, len, &chunk) == 0) {
+			net_send_ui(IMSG_SHM_BUF, req->id, &chunk,
+			    sizeof(chunk));
+			perf_count(PERF_SHM_BYTES, len);
+		} else {
+			len = MIN(avail, IMSG_CHUNK);
+			net_send_ui(IMSG_BUF, req->id, data, len);
+		}
+		data += len;
+		avail -= len;
+		req->unacked += len;
 	}
+	if (req->pbuf == NULL)
+		buf_drain(&req->bio.rbuf, SIZE_MAX);
+}
 
-	if (connect(req->fd, req->p->ai_addr, req->p->ai_addrlen) == 0)
-		return (0);
-	errno = EAGAIN;
-	return (-1);
+/*
+ * Turn the phases of a finished request into spans on the trace.
+ * The phases that were skipped, like the handshake on a plain
+ * connection, are not emitted.
+ */
+static void
+net_trace_timing(struct req *req)
+{
+	static const char *names[] = {
+		"resolve", "connect", "handshake", "cert", "first byte",
+		"body",
+	};
+	uint64_t	 base, *t = req->timing.t;
+	int		 i;
+
+	base = req->start.tv_sec * 1000000ULL + req->start.tv_nsec / 1000;
+	for (i = TIMING_STARTED; i < TIMING_EOF; ++i) {
+		if (t[i + 1] <= t[i])
+			continue;
+		trace_span(names[i], req->id, base + t[i], base + t[i + 1],
+		    NULL);
+	}
 }
 
-static int
-gemini_parse_reply(struct req *req, const char *header)
+/* tell the ui about the certificate, and go on if it's known */
+static void
+check_cert(struct req *req, const char *hash, int resumed)
 {
 	struct ibuf	*ibuf;
 	size_t		 len;
-	int		 code;
-
-	if (!isdigit(header[0]) || !isdigit(header[1]))
-		return -1;
-
-	code = (header[0] - '0')*10 + (header[1] - '0');
-	if (header[2] != ' ')
-		return -1;
-
-	header += 3;
-	len = strlen(header) + 1;
-
-	if ((ibuf = imsg_create(&iev_ui->ibuf, IMSG_REPLY, req->id, 0,
-	    sizeof(code) + len)) == NULL)
+	int		 known;
+
+	/* the ui is only told about the known ones */
+	known = known_host_match(req, hash);
+	len = strlen(hash) + 1;
+	if ((ibuf = imsg_create(&iev_ui->ibuf, IMSG_CHECK_CERT,
+	    req->id, 0, sizeof(resumed) + sizeof(known) + len)) == NULL ||
+	    imsg_add(ibuf, &resumed, sizeof(resumed)) == -1 ||
+	    imsg_add(ibuf, &known, sizeof(known)) == -1 ||
+	    imsg_add(ibuf, hash, len) == -1)
 		die();
-	if (imsg_add(ibuf, &code, sizeof(code)) == -1 ||
-	    imsg_add(ibuf, header, len) == -1)
-		die();
-	imsg_close(&iev_ui->ibuf, ibuf);
-	imsg_event_add(iev_ui);
-	return code;
-}
+	imsg_close_event(iev_ui, ibuf);
 
-static inline int
-net_send_req(struct req *req)
-{
-	return (bufio_compose(&req->bio, req->req, req->len));
+	if (known)
+		cert_accepted(req);
 }
 
 static void
 net_ev(int fd, int ev, void *d)
 {
-	static char	 buf[4096];
 	struct req	*req = d;
+	struct tls_config *conf;
 	const char	*hash;
 	ssize_t		 read;
 	size_t		 len;
 	char		*header;
-	int		 code;
-
-	if (ev == EV_TIMEOUT) {
-		close_with_err(req, "Timeout loading page");
-		return;
-	}
+	int		 code, resumed, owned, r;
 
 	if (req->state == CONN_CONNECTING) {
-		ev_del(req->fd);
-		if (try_to_connect(req) == -1) {
-			if (req->fd != -1 && errno == EAGAIN) {
-				ev_add(req->fd, EV_WRITE, net_ev, req);
-				return;
-			}
-			close_with_errf(req, "failed to connect to %s"
-			    " (%s: %s)", req->host, req->cause,
-			    strerror(req->conn_error));
-			return;
-		}
-
+		/* connect_ev found a working connection */
 		bufio_set_fd(&req->bio, req->fd);
 
 		switch (req->proto) {
 		case PROTO_FINGER:
 		case PROTO_GOPHER:
+			if (req->warm) {
+				/* warm_ttl closes it, not connect-timeout */
+				req->warm = WARM_READY;
+				req->watch = WATCH_NONE;
+				ev_add(req->fd, EV_READ, warm_ev, req);
+				return;
+			}
 			/* finger and gopher don't have a header nor TLS */
+			req->timing.t[TIMING_HANDSHAKE] =
+			    req->timing.t[TIMING_CONNECTED];
+			req->timing.t[TIMING_CERT] =
+			    req->timing.t[TIMING_CONNECTED];
 			req->state = CONN_BODY;
+			req_watch(req, WATCH_IDLE);
 			if (net_send_req(req) == -1) {
 				close_with_err(req, "failed to send request");
 				return;
 			}
 			break;
 		case PROTO_GEMINI:
+			if (req->replay) {
+				req->timing.t[TIMING_HANDSHAKE] =
+				    req->timing.t[TIMING_CONNECTED];
+				req->state = CONN_HEADER;
+				if (req->replay_hash == NULL) {
+					close_with_err(req, "No certificate"
+					    " in the capture");
+					return;
+				}
+				check_cert(req, req->replay_hash, 0);
+				return;
+			}
 			req->state = CONN_HANDSHAKE;
-			if (bufio_starttls(&req->bio, req->host, 1,
-			    req->ccert, req->ccert_len,
-			    req->ccert, req->ccert_len) == -1) {
+			if ((conf = tls_conf_for(req, &owned)) == NULL) {
 				close_with_err(req, "failed to setup TLS");
 				return;
 			}
-			req->timer = ev_timer(&timeout_for_handshake,
-			    net_ev, req);
-			if (req->timer == 0) {
-				close_with_err(req, "failed to setup"
-				    " handshake timer");
+			r = bufio_starttls(&req->bio, req->host, conf);
+			if (owned)
+				tls_config_free(conf);
+			if (r == -1) {
+				close_with_err(req, "failed to setup TLS");
 				return;
 			}
+			req_watch(req, WATCH_HANDSHAKE);
 			break;
 		}
 	}
@@ -451,10 +2242,10 @@ net_ev(int fd, int ev, void *d)
 			return;
 		}
 
-		ev_timer_cancel(req->timer);
-		req->timer = 0;
-
+		req_mark(req, TIMING_HANDSHAKE);
 		req->state = CONN_HEADER;
+		/* the ui may take its time to check the certificate */
+		req->watch = WATCH_NONE;
 
 		/* pause until we've told the certificate is OK */
 		ev_del(req->fd);
@@ -466,18 +2257,56 @@ net_ev(int fd, int ev, void *d)
 			return;
 		}
 
-		net_send_ui(IMSG_CHECK_CERT, req->id, hash, strlen(hash)+1);
+		resumed = tls_conn_session_resumed(req->bio.ctx);
+		perf_count(PERF_TLS_HANDSHAKES, 1);
+		perf_count(PERF_TLS_RESUMED, resumed != 0);
+		if (req->warm) {
+			/* the certificate is checked once it's used */
+			req->warm_hash = xstrdup(hash);
+			req->warm_resumed = resumed;
+			req->warm = WARM_READY;
+			ev_add(req->fd, req_bio_ev(req), warm_ev, req);
+			return;
+		}
+		if (capture_mode == CAPTURE_RECORD)
+			capture_cert(req->id, req_capture_usec(req), hash);
+		check_cert(req, hash, resumed);
 		return;
 	}
 
+#if HAVE_SPLICE
+	if (net_can_splice(req) && ((ev & EV_READ) || req->dl_inpipe > 0)) {
+		/* what bufio read before the download started goes first */
+		if (net_write_download(req, 1) == -1 ||
+		    (!req->dl_blocked && net_splice_download(req) == -1)) {
+			close_with_errf(req, "can't save the download: %s",
+			    strerror(errno));
+			return;
+		}
+		if (req->dl_blocked)
+			return;
+		if (!req->dl_nosplice)
+			ev &= ~EV_READ;
+	}
+#endif
+
 	if (ev & EV_READ) {
 		read = bufio_read(&req->bio);
+		if (read > 0)
+			perf_count(PERF_BYTES_IN, read);
+		if (read > 0 && capture_mode == CAPTURE_RECORD)
+			capture_data(req->id, req_capture_usec(req),
+			    req->bio.rbuf.buf + req->bio.rbuf.len - read, read);
 		if (read == -1 && errno != EAGAIN) {
 			req->eof = 1;
 			net_send_ui(IMSG_FAULTY_GEMSERVER, req->id, NULL, 0);
 		}
 		if (read == 0)
 			req->eof = 1;
+		if (read > 0) {
+			req_received(req, read);
+			req->watch_ms = monotonic_ms();
+		}
 	}
 
 	if ((ev & EV_WRITE) && bufio_write(&req->bio) == -1 &&
@@ -506,6 +2335,8 @@ net_ev(int fd, int ev, void *d)
 			return;
 		}
 		if (code < 20 || code >= 30) {
+			if (capture_mode == CAPTURE_RECORD)
+				capture_eof(req->id, req_capture_usec(req));
 			close_conn(0, 0, req);
 			return;
 		}
@@ -514,58 +2345,291 @@ net_ev(int fd, int ev, void *d)
 
 		/* pause until we've been told to go ahead */
 		ev_del(req->fd);
+		req->watch = WATCH_NONE;
 		return;
 	}
 	
-	/*
-	 * Split data into chunks before sending.  imsg can't handle
-	 * message that are "too big".
-	 */
-	for (;;) {
-		if ((len = bufio_drain(&req->bio, buf, sizeof(buf))) == 0)
-			break;
-		net_send_ui(IMSG_BUF, req->id, buf, len);
+	/* keep the start of the body until the ui says where it goes */
+	if (req->hold) {
+		if (req->eof || req->bio.rbuf.len >= DL_BATCH) {
+			ev_del(req->fd);
+			req->watch = WATCH_NONE;
+		}
+		else
+			ev_add(req->fd, req_bio_ev(req), net_ev, req);
+		return;
+	}
+
+	if (req->dl_fd != -1) {
+		if (net_write_download(req, req->eof) == -1) {
+			close_with_errf(req, "can't save the download: %s",
+			    strerror(errno));
+			return;
+		}
+		/* net_download_ev goes on when the file is writable */
+		if (req->dl_blocked)
+			return;
+	} else {
+		net_send_body(req, req->eof);
 	}
 
 	if (req->eof) {
-		net_send_ui(IMSG_EOF, req->id, NULL, 0);
+		req_mark(req, TIMING_EOF);
+		if (req->timing.t[TIMING_FIRST_BYTE] == 0)
+			req->timing.t[TIMING_FIRST_BYTE] =
+			    req->timing.t[TIMING_EOF];
+		if (tracing())
+			net_trace_timing(req);
+		if (capture_mode == CAPTURE_RECORD)
+			capture_eof(req->id, req_capture_usec(req));
+		net_send_ui(IMSG_EOF, req->id, &req->timing,
+		    sizeof(req->timing));
 		close_conn(0, 0, req);
 		return;
 	}
 
+	/* IMSG_BUF_ACK goes on once the ui catches up */
+	if (req->unacked >= BODY_WINDOW) {
+		req->throttled = 1;
+		ev_del(req->fd);
+		return;
+	}
+
+	if (req->dl_fd != -1 && pages_loading()) {
+		ev_del(req->fd);
+		req->dl_yield = ev_timer(&dl_yield_tv, dl_yield_ev, req);
+		perf_count(PERF_DL_YIELDS, 1);
+		return;
+	}
+
 	ev_add(req->fd, req_bio_ev(req), net_ev, req);
 }
 
+/*
+ * A warm connection only waits for the server to close it, or for
+ * its time to run out.  Reading also lets TLS handle the messages
+ * that come after the handshake, like the session tickets.
+ */
+static void
+warm_ev(int fd, int ev, void *d)
+{
+	struct req	*req = d;
+	ssize_t		 r;
+
+	if (ev == EV_TIMEOUT) {
+		req->warm_timer = 0;
+		close_conn(0, 0, req);
+		return;
+	}
+
+	if (req->warm != WARM_READY)
+		return;
+
+	r = bufio_read(&req->bio);
+	if (r == 0 || (r == -1 && errno != EAGAIN)) {
+		close_conn(0, 0, req);
+		return;
+	}
+	ev_add(req->fd, req_bio_ev(req), warm_ev, req);
+}
+
+static struct req *
+warm_find(int proto, const char *host, const char *port)
+{
+	struct req	*req;
+
+	TAILQ_FOREACH(req, &reqhead, reqs) {
+		if (req->warm && req->proto == proto &&
+		    !strcmp(req->host, host) && !strcmp(req->port, port))
+			return (req);
+	}
+	return (NULL);
+}
+
+static struct req *
+req_new(const struct get_req *r)
+{
+	struct req	*req;
+	size_t		 i;
+
+	req = xcalloc(1, sizeof(*req));
+
+	req->fd = -1;
+#if HAVE_ASR_RUN
+	req->ar_fd = -1;
+#endif
+	req->dl_fd = -1;
+#if HAVE_SPLICE
+	req->dl_pipe[0] = -1;
+	req->dl_pipe[1] = -1;
+#endif
+	clock_gettime(CLOCK_MONOTONIC, &req->start);
+	for (i = 0; i < HE_ATTEMPTS; ++i)
+		req->attempts[i].fd = -1;
+	TAILQ_INSERT_HEAD(&reqhead, req, reqs);
+
+	req->host = xstrdup(r->host);
+	req->port = xstrdup(r->port);
+	if (bufio_init(&req->bio) == -1)
+		die();
+	req->proto = r->proto;
+	return (req);
+}
+
+/* open a warm connection, unless there's one already */
+static void
+warm_open(const struct get_req *r)
+{
+	struct req	*req, *oldest = NULL;
+	int		 n = 0;
+
+	if (capture_mode != CAPTURE_NONE)
+		return;
+
+	if ((req = warm_find(r->proto, r->host, r->port)) != NULL) {
+		ev_timer_cancel(req->warm_timer);
+		req->warm_timer = ev_timer(&warm_ttl, warm_ev, req);
+		return;
+	}
+
+	TAILQ_FOREACH(req, &reqhead, reqs) {
+		if (req->warm) {
+			oldest = req;
+			n++;
+		}
+	}
+	if (n >= WARM_MAX)
+		close_conn(0, 0, oldest);
+
+	req = req_new(r);
+	req->warm = WARM_PENDING;
+	req->prio = PRIO_PREFETCH;
+	req->background = 1;
+	perf_count(PERF_PRECONNECTS, 1);
+	if ((req->warm_timer = ev_timer(&warm_ttl, warm_ev, req)) == 0) {
+		close_conn(0, 0, req);
+		return;
+	}
+	sched_add(req);
+}
+
+/*
+ * Hand the warm connection to the request that took it over, once
+ * its fields are set.  If it's not ready yet it just goes on.
+ */
+static void
+warm_resume(struct req *req)
+{
+	int	 warm = req->warm, flags = req->timing.flags;
+
+	req->warm = 0;
+	perf_count(PERF_PRECONNECTS_USED, 1);
+	ev_timer_cancel(req->warm_timer);
+	req->warm_timer = 0;
+
+	/* what happened before is not part of this request */
+	clock_gettime(CLOCK_MONOTONIC, &req->start);
+	memset(&req->timing, 0, sizeof(req->timing));
+	req->timing.flags = flags;
+
+	if (!req->started) {
+		TAILQ_REMOVE(&queue, req, queue);
+		sched_add(req);
+		return;
+	}
+
+	if (warm != WARM_READY)
+		return;
+
+	ev_del(req->fd);
+	if (req->proto == PROTO_GEMINI)
+		check_cert(req, req->warm_hash, req->warm_resumed);
+	else
+		net_ev(req->fd, EV_WRITE, req);
+}
+
 static int
-load_cert(struct imsg *imsg, struct req *req)
+read_ident(struct ident *ident, int fd)
 {
 	struct stat	 sb;
-	int		 fd;
-
-	if ((fd = imsg_get_fd(imsg)) == -1)
-		return (0);
+	uint8_t		*pem;
+	size_t		 len = 0;
+	ssize_t		 n;
 
-	if (fstat(fd, &sb) == -1)
+	if (fstat(fd, &sb) == -1 || sb.st_size < 0)
 		return (-1);
 
-#if 0
-	if (sb.st_size >= (off_t)SIZE_MAX) {
-		close(fd);
-		return (-1);
+	pem = xmalloc(sb.st_size + 1);
+	while (len < (size_t)sb.st_size) {
+		if ((n = read(fd, pem + len, sb.st_size - len)) == -1) {
+			if (errno == EINTR)
+				continue;
+			free(pem);
+			return (-1);
+		}
+		if (n == 0)
+			break;
+		len += n;
 	}
-#endif
 
-	req->ccert = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
-	if (req->ccert == MAP_FAILED) {
-		req->ccert = NULL;
+	free(ident->pem);
+	ident->pem = pem;
+	ident->len = len;
+	ident->id.dev = sb.st_dev;
+	ident->id.ino = sb.st_ino;
+	ident->id.size = sb.st_size;
+	ident->id.mtime = sb.st_mtime;
+	return (0);
+}
+
+static int
+load_cert(struct imsg *imsg, struct get_req *r, struct req *req)
+{
+	struct ident	*ident;
+	unsigned int	 slot;
+	size_t		 len;
+	int		 fd, ret = 0;
+
+	fd = imsg_get_fd(imsg);
+	if (*r->ccert == '\0') {
+		if (fd != -1)
+			close(fd);
+		return (0);
+	}
+
+	slot = ohash_qlookup(&idents, r->ccert);
+	if ((ident = ohash_find(&idents, slot)) == NULL) {
+		if (fd == -1)
+			return (-1);
+		len = strlen(r->ccert) + 1;
+		ident = xcalloc(1, sizeof(*ident) + len);
+		memcpy(ident->name, r->ccert, len);
+		ohash_insert(&idents, slot, ident);
+	}
+
+	if (fd != -1) {
+		ret = read_ident(ident, fd);
 		close(fd);
-		return (-1);
 	}
 
-	req->ccert_len = sb.st_size;
-	req->ccert_fd = fd;
+	req->ident = ident;
+	req->ccert_id = ident->id;
+	return (ret);
+}
 
-	return (0);
+static void
+cert_accepted(struct req *req)
+{
+	req_mark(req, TIMING_CERT);
+	req_watch(req, WATCH_IDLE);
+
+	if (net_send_req(req) == -1) {
+		close_with_err(req, "failed to send request");
+		return;
+	}
+
+	if (ev_add(req->fd, EV_WRITE, net_ev, req) == -1)
+		close_with_err(req, "failed to register event.");
 }
 
 static void
@@ -574,10 +2638,14 @@ handle_dispatch_imsg(int fd, int event, void *d)
 	struct imsgev	*iev = d;
 	struct imsgbuf	*ibuf = &iev->ibuf;
 	struct imsg	 imsg;
+	struct ibuf	 data;
 	struct req	*req;
 	struct get_req	 r;
+	struct net_conf	 nc;
+	char		*domain, *hash, *key;
 	ssize_t		 n;
-	int		 certok;
+	size_t		 size;
+	int		 certok, flags, tfd, paced, warm;
 
 	if (event & EV_READ) {
 		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
@@ -597,39 +2665,62 @@ handle_dispatch_imsg(int fd, int event, void *d)
 			err(1, "imsg_get");
 		if (n == 0)
 			break;
+
+		perf_count(PERF_IMSG_IN, 1);
+		perf_count(PERF_IMSG_IN_BYTES, imsg_get_len(&imsg));
+
 		switch (imsg_get_type(&imsg)) {
 		case IMSG_GET:
 			if (imsg_get_data(&imsg, &r, sizeof(r)) == -1 ||
 			    r.host[sizeof(r.host) - 1] != '\0' ||
 			    r.port[sizeof(r.port) - 1] != '\0' ||
-			    r.req[sizeof(r.req) - 1] != '\0')
+			    r.req[sizeof(r.req) - 1] != '\0' ||
+			    r.ccert[sizeof(r.ccert) - 1] != '\0')
 				die();
 			if (r.proto != PROTO_FINGER &&
 			    r.proto != PROTO_GEMINI &&
 			    r.proto != PROTO_GOPHER)
 				die();
 
-			req = xcalloc(1, sizeof(*req));
-
-			req->fd = -1;
-#if HAVE_ASR_RUN
-			req->ar_fd = -1;
-#endif
-			req->ccert_fd = -1;
+			trace_instant("IMSG_GET", imsg_get_id(&imsg), r.host);
+			req = NULL;
+			if (*r.ccert == '\0' && capture_mode == CAPTURE_NONE)
+				req = warm_find(r.proto, r.host, r.port);
+			warm = req != NULL;
+			if (req == NULL)
+				req = req_new(&r);
 			req->id = imsg_get_id(&imsg);
-			TAILQ_INSERT_HEAD(&reqhead, req, reqs);
+			idmap_put(&reqids, req->id, req);
 
-			req->host = xstrdup(r.host);
-			req->port = xstrdup(r.port);
 			req->req = xstrdup(r.req);
-			if (load_cert(&imsg, req) == -1)
-				die();
-			if (bufio_init(&req->bio) == -1)
+			if (load_cert(&imsg, &r, req) == -1)
 				die();
 
 			req->len = strlen(req->req);
-			req->proto = r.proto;
-			req_resolve(-1, 0, req);
+			req->prio = r.prio;
+			req->background = r.prio != PRIO_FOREGROUND;
+			req->hold = r.hold && r.proto != PROTO_GEMINI;
+			if (capture_mode == CAPTURE_RECORD) {
+				key = req_key(req);
+				capture_req(req->id, key);
+				free(key);
+			}
+			if (warm)
+				warm_resume(req);
+			else
+				sched_add(req);
+			break;
+
+		case IMSG_PRECONNECT:
+			if (imsg_get_data(&imsg, &r, sizeof(r)) == -1 ||
+			    r.host[sizeof(r.host) - 1] != '\0' ||
+			    r.port[sizeof(r.port) - 1] != '\0')
+				die();
+			if (r.proto != PROTO_FINGER &&
+			    r.proto != PROTO_GEMINI &&
+			    r.proto != PROTO_GOPHER)
+				die();
+			warm_open(&r);
 			break;
 
 		case IMSG_CERT_STATUS:
@@ -643,22 +2734,43 @@ handle_dispatch_imsg(int fd, int event, void *d)
 				close_conn(0, 0, req);
 				break;
 			}
+			cert_accepted(req);
+			break;
 
-			if (net_send_req(req) == -1) {
-				close_with_err(req, "failed to send request");
-				break;
-			}
-
-			if (ev_add(req->fd, EV_WRITE, net_ev, req) == -1) {
-				close_with_err(req,
-				    "failed to register event.");
-				break;
+		case IMSG_TOFU:
+			if (imsg_get_ibuf(&imsg, &data) == -1)
+				die();
+			while (ibuf_size(&data) != 0) {
+				if (ibuf_next_str(&data, &domain) == -1 ||
+				    ibuf_next_str(&data, &hash) == -1)
+					die();
+				known_host_set(domain, hash);
 			}
 			break;
 
 		case IMSG_PROCEED:
 			if ((req = req_by_id(imsg_get_id(&imsg))) == NULL)
 				break;
+			/* the ui may leave the parsing of gemtext to us */
+			if (imsg_get_len(&imsg) == sizeof(flags) &&
+			    imsg_get_data(&imsg, &flags, sizeof(flags)) != -1 &&
+			    flags && req->pbuf == NULL) {
+				req->pbuf = xcalloc(1, sizeof(*req->pbuf));
+				parser_init(req->pbuf, &gemtext_parser);
+			}
+			/* downloads are written here directly */
+			req->dl_fd = imsg_get_fd(&imsg);
+			if (req->dl_fd != -1 &&
+			    (flags = fcntl(req->dl_fd, F_GETFL)) != -1)
+				fcntl(req->dl_fd, F_SETFL, flags | O_NONBLOCK);
+			/* a held one that's not connected yet just goes on */
+			flags = req->hold;
+			req->hold = 0;
+			if (flags && req->state != CONN_BODY)
+				break;
+			req_watch(req, WATCH_IDLE);
+			if (req->dl_fd != -1 && dl_park(req))
+				break;
 			ev_add(req->fd, EV_READ, net_ev, req);
 			net_ev(req->fd, 0, req);
 			break;
@@ -669,6 +2781,81 @@ handle_dispatch_imsg(int fd, int event, void *d)
 			close_conn(0, 0, req);
 			break;
 
+		case IMSG_BUF_ACK:
+			if ((req = req_by_id(imsg_get_id(&imsg))) == NULL)
+				break;
+			if (imsg_get_data(&imsg, &size, sizeof(size)) == -1)
+				die();
+			req->unacked -= MIN(size, req->unacked);
+			if (req->throttled && req->unacked < BODY_WINDOW) {
+				req->throttled = 0;
+				/* the TLS layer may have more already */
+				net_ev(req->fd, EV_READ, req);
+			}
+			break;
+
+		case IMSG_BACKGROUND:
+			if ((req = req_by_id(imsg_get_id(&imsg))) == NULL)
+				break;
+			if (imsg_get_data(&imsg, &req->background,
+			    sizeof(req->background)) == -1)
+				die();
+			/* don't let the now visible tab wait */
+			if (!req->background && req->state == CONN_BODY &&
+			    req->flush_timer != 0)
+				net_send_body(req, 1);
+			break;
+
+		case IMSG_NET_CONF:
+			if (imsg_get_data(&imsg, &nc, sizeof(nc)) == -1)
+				die();
+			dns_ttl = MAX(nc.dns_ttl, 0);
+			connect_timeout = MAX(nc.connect_timeout, 0);
+			handshake_timeout = MAX(nc.handshake_timeout, 0);
+			idle_timeout = MAX(nc.idle_timeout, 0);
+			total_timeout = MAX(nc.total_timeout, 0);
+			tcp_fastopen = nc.tcp_fastopen;
+			tcp_nodelay = nc.tcp_nodelay;
+			tcp_rcvbuf = MAX(nc.tcp_rcvbuf, 0);
+			break;
+
+		case IMSG_DNS_FLUSH:
+			dns_flush();
+			break;
+
+		case IMSG_PERF:
+			net_send_ui(IMSG_PERF, imsg_get_id(&imsg),
+			    perf_counters, sizeof(perf_counters));
+			break;
+
+		case IMSG_TRACE:
+			if ((tfd = imsg_get_fd(&imsg)) == -1)
+				die();
+			trace_init(tfd, "net");
+			break;
+
+		case IMSG_RECORD:
+			if ((tfd = imsg_get_fd(&imsg)) == -1)
+				die();
+			capture_record(tfd);
+			break;
+
+		case IMSG_REPLAY:
+			if (imsg_get_data(&imsg, &paced, sizeof(paced)) == -1 ||
+			    (tfd = imsg_get_fd(&imsg)) == -1)
+				die();
+			capture_replay(tfd, paced);
+			break;
+
+		case IMSG_SHM_RING:
+			if (imsg_get_data(&imsg, &size, sizeof(size)) == -1 ||
+			    (tfd = imsg_get_fd(&imsg)) == -1)
+				die();
+			if (shmring_map(&body_ring, tfd, size) == -1)
+				die();
+			close(tfd);
+			break;
+
 		case IMSG_QUIT:
 			ev_break();
 			imsg_free(&imsg);
@@ -698,6 +2885,9 @@ net_main(void)
 	setproctitle("net");
 
 	TAILQ_INIT(&reqhead);
+	idmap_init(&reqids, offsetof(struct req, id));
+	known_hosts_init();
+	idents_init();
 
 	if (ev_init() == -1)
 		exit(1);
@@ -709,7 +2899,14 @@ net_main(void)
 	iev_ui->events = EV_READ;
 	ev_add(iev_ui->ibuf.fd, iev_ui->events, iev_ui->handler, iev_ui);
 
+	dns_init();
+	af_prefs_init();
+	backoffs_init();
+	sessions_init();
 	sandbox_net_process();
+#if !HAVE_ASR_RUN
+	resolvers_init();
+#endif
 
 	ev_loop();
 
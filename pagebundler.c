@@ -15,9 +15,11 @@
  */
 
 /*
- * pagebundler converts the given file into a valid C program that can
- * be compiled.  The generated code provides a variable that holds the
- * content of the original file and a _len variable with the size.
+ * pagebundler parses the given gemtext file and turns it into a valid
+ * C program that can be compiled.  The generated code provides a
+ * struct page_lines named after the file, with the lines already
+ * split the way parser_gemtext.c does, so that the bundled pages can
+ * be shown without parsing them at every visit.
  *
  * Usage: pagebundler file > outfile
  */
@@ -31,6 +33,38 @@
 #include <string.h>
 #include <unistd.h>
 
+static const char *types[] = {
+	"LINE_TEXT",
+	"LINE_LINK",
+	"LINE_TITLE_1",
+	"LINE_TITLE_2",
+	"LINE_TITLE_3",
+	"LINE_ITEM",
+	"LINE_QUOTE",
+	"LINE_PRE_START",
+	"LINE_PRE_CONTENT",
+	"LINE_PRE_END",
+};
+
+enum {
+	T_TEXT,
+	T_LINK,
+	T_TITLE_1,
+	T_TITLE_2,
+	T_TITLE_3,
+	T_ITEM,
+	T_QUOTE,
+	T_PRE_START,
+	T_PRE_CONTENT,
+	T_PRE_END,
+};
+
+static char	 varname[PATH_MAX];
+static char	*title;
+static size_t	 nlines;
+static int	 ascii;		/* the line being parsed */
+static int	 inpre;
+
 static void
 setfname(const char *fname, char *buf, size_t siz)
 {
@@ -58,16 +92,217 @@ setfname(const char *fname, char *buf, size_t siz)
 static int
 validc(int c)
 {
-	return isprint(c) && c != '\\' && c != '\'' && c != '\n';
+	return isprint(c) && c != '\\' && c != '"' && c != '?';
+}
+
+static void
+print_str(const char *s, size_t len)
+{
+	size_t	 i;
+
+	if (s == NULL) {
+		printf("NULL");
+		return;
+	}
+
+	printf("\"");
+	for (i = 0; i < len; ++i) {
+		if (validc((unsigned char)s[i]))
+			printf("%c", s[i]);
+		else
+			printf("\\%03o", (unsigned char)s[i]);
+	}
+	printf("\"");
+}
+
+/* the same as emit_line in parser_gemtext.c */
+static void
+emit(int type, const char *text, size_t len, const char *url, size_t ulen)
+{
+	if (nlines++ == 0)
+		printf("static const struct page_line %s_l[] = {\n", varname);
+
+	printf("\t{ %s, %s, ", types[type], ascii ? "L_ASCII" : "0");
+	if (text != NULL && text == url)
+		print_str(url, ulen);
+	else
+		print_str(text, len);
+	printf(", ");
+	print_str(url, ulen);
+	printf(" },\n");
+}
+
+static inline int
+is_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+static void
+parse_link(const char *line, size_t len)
+{
+	const char	*start;
+	size_t		 ulen;
+
+	if (len <= 2) {
+		emit(T_TEXT, NULL, 0, NULL, 0);
+		return;
+	}
+
+	line += 2, len -= 2;
+	while (len > 0 && is_blank(line[0]))
+		line++, len--;
+
+	if (len == 0) {
+		emit(T_TEXT, NULL, 0, NULL, 0);
+		return;
+	}
+
+	start = line;
+	while (len > 0 && !is_blank(line[0]))
+		line++, len--;
+
+	ulen = line - start;
+
+	while (len > 0 && is_blank(line[0]))
+		line++, len--;
+
+	if (len == 0)
+		emit(T_LINK, start, ulen, start, ulen);
+	else
+		emit(T_LINK, line, len, start, ulen);
+}
+
+static void
+parse_title(const char *line, size_t len)
+{
+	int	 t = T_TITLE_1;
+
+	line++, len--;
+	while (len > 0 && *line == '#') {
+		line++, len--;
+		t++;
+		if (t == T_TITLE_3)
+			break;
+	}
+
+	while (len > 0 && is_blank(*line))
+		line++, len--;
+
+	if (len == 0) {
+		emit(t, NULL, 0, NULL, 0);
+		return;
+	}
+
+	if (t == T_TITLE_1 && title == NULL) {
+		if ((title = strndup(line, len)) == NULL) {
+			fprintf(stderr, "strndup: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+
+	emit(t, line, len, NULL, 0);
+}
+
+static void
+parse_line(const char *line, size_t len)
+{
+	if (inpre) {
+		if (len >= 3 && !strncmp(line, "```", 3)) {
+			inpre = 0;
+			emit(T_PRE_END, NULL, 0, NULL, 0);
+		} else if (len == 0)
+			emit(T_PRE_CONTENT, NULL, 0, NULL, 0);
+		else
+			emit(T_PRE_CONTENT, line, len, NULL, 0);
+		return;
+	}
+
+	if (len == 0) {
+		emit(T_TEXT, NULL, 0, NULL, 0);
+		return;
+	}
+
+	switch (*line) {
+	case '*':
+		if (len < 1 || line[1] != ' ')
+			break;
+
+		line += 2, len -= 2;
+		while (len > 0 && is_blank(*line))
+			line++, len--;
+		if (len == 0)
+			emit(T_ITEM, NULL, 0, NULL, 0);
+		else
+			emit(T_ITEM, line, len, NULL, 0);
+		return;
+
+	case '>':
+		line++, len--;
+		while (len > 0 && is_blank(*line))
+			line++, len--;
+		if (len == 0)
+			emit(T_QUOTE, NULL, 0, NULL, 0);
+		else
+			emit(T_QUOTE, line, len, NULL, 0);
+		return;
+
+	case '=':
+		if (len > 1 && line[1] == '>') {
+			parse_link(line, len);
+			return;
+		}
+		break;
+
+	case '#':
+		parse_title(line, len);
+		return;
+
+	case '`':
+		if (len < 3 || strncmp(line, "```", 3) != 0)
+			break;
+
+		inpre = 1;
+		line += 3, len -= 3;
+		while (len > 0 && is_blank(*line))
+			line++, len--;
+		if (len == 0)
+			emit(T_PRE_START, NULL, 0, NULL, 0);
+		else
+			emit(T_PRE_START, line, len, NULL, 0);
+		return;
+	}
+
+	emit(T_TEXT, line, len, NULL, 0);
+}
+
+/*
+ * Drop the control characters other than tabs, as parser.c does,
+ * and tell whether the line is made only of printable ASCII.
+ */
+static size_t
+filter_line(char *line, size_t len)
+{
+	size_t	 i, n;
+
+	ascii = 1;
+	for (i = 0, n = 0; i < len; ++i) {
+		if ((unsigned char)line[i] < ' ' && line[i] != '\t')
+			continue;
+		if ((unsigned char)line[i] < ' ' ||
+		    (unsigned char)line[i] >= 127)
+			ascii = 0;
+		line[n++] = line[i];
+	}
+	return n;
 }
 
 int
 main(int argc, char **argv)
 {
-	size_t	 r, i, n;
 	FILE	*f;
-	uint8_t	 buf[BUFSIZ];
-	char	 varname[PATH_MAX];
+	char	*buf = NULL, *line, *end;
+	size_t	 size = 0, len, r;
 
 	if (argc != 2) {
 		fprintf(stderr, "usage: %s file\n", *argv);
@@ -82,34 +317,51 @@ main(int argc, char **argv)
 		return 1;
 	}
 
-	printf("const uint8_t %s[] = {", varname);
-
-	n = 0;
 	for (;;) {
-		r = fread(buf, 1, sizeof(buf), f);
-
-		for (i = 0; i < r; ++i, ++n) {
-			if (n % 12 == 0)
-				printf("\n\t");
-			else
-				printf(" ");
-
-			if (validc(buf[i]))
-				printf("'%c',", buf[i]);
-			else if (buf[i] == '\n')
-				printf("'\\n',");
-			else
-				printf("0x%x,", buf[i]);
+		if ((buf = realloc(buf, size + BUFSIZ)) == NULL) {
+			fprintf(stderr, "realloc: %s\n", strerror(errno));
+			return 1;
 		}
-		printf("\n");
-
-		if (r != sizeof(buf))
+		r = fread(buf + size, 1, BUFSIZ, f);
+		size += r;
+		if (r != BUFSIZ)
 			break;
 	}
+	if (ferror(f)) {
+		fprintf(stderr, "%s: can't read %s\n", argv[0], argv[1]);
+		return 1;
+	}
+	fclose(f);
 
-	printf("\t0x0\n");
-	printf("}; /* %s */\n", varname);
+	line = buf;
+	len = size;
+	if (len >= 3 && !memcmp(line, "\xEF\xBB\xBF", 3))
+		line += 3, len -= 3;
 
-	fclose(f);
+	while ((end = memchr(line, '\n', len)) != NULL) {
+		parse_line(line, filter_line(line, end - line));
+		len -= end - line + 1;
+		line = end + 1;
+	}
+
+	/* the last line, not terminated by a newline */
+	if (len != 0) {
+		parse_line(line, filter_line(line, len));
+		if (inpre)
+			emit(T_PRE_END, NULL, 0, NULL, 0);
+	}
+
+	if (nlines != 0)
+		printf("};\n\n");
+
+	printf("const struct page_lines %s_lines = {\n", varname);
+	printf("\t%s%s, %zu, ", nlines != 0 ? varname : "NULL",
+	    nlines != 0 ? "_l" : "", nlines);
+	print_str(title != NULL ? title : "", title != NULL ?
+	    strlen(title) : 0);
+	printf("\n};\n\n");
+
+	free(buf);
+	free(title);
 	return 0;
 }
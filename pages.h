@@ -18,27 +18,30 @@
 #define PAGES_H
 
 #include <stddef.h>
-#include <stdint.h>
 
-extern const uint8_t	 about_about[];
-extern size_t		 about_about_len;
-
-extern const uint8_t	 about_blank[];
-extern size_t		 about_blank_len;
-
-extern const uint8_t	 about_crash[];
-extern size_t		 about_crash_len;
-
-extern const uint8_t	 about_help[];
-extern size_t		 about_help_len;
-
-extern const uint8_t	 about_license[];
-extern size_t		 about_license_len;
-
-extern const uint8_t	 about_new[];
-extern size_t		 about_new_len;
-
-extern const uint8_t	 bookmarks[];
-extern size_t		 bookmarks_len;
+/*
+ * The bundled pages, already split in lines by pagebundler, see
+ * gemtext_load_lines.
+ */
+struct page_line {
+	int		 type;
+	int		 flags;
+	const char	*line;
+	const char	*alt;
+};
+
+struct page_lines {
+	const struct page_line	*lines;
+	size_t			 nlines;
+	const char		*title;
+};
+
+extern const struct page_lines	 about_about_lines;
+extern const struct page_lines	 about_blank_lines;
+extern const struct page_lines	 about_crash_lines;
+extern const struct page_lines	 about_help_lines;
+extern const struct page_lines	 about_license_lines;
+extern const struct page_lines	 about_new_lines;
+extern const struct page_lines	 bookmarks_lines;
 
 #endif
@@ -30,9 +30,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "cfgsnap.h"
 #include "cmd.h"
 #include "defaults.h"
+#include "fs.h"
 #include "iri.h"
 #include "keymap.h"
 #include "telescope.h"
@@ -70,6 +73,7 @@ static int attrname(const char *);
 static void setattr(char *, char *, char *);
 static void add_proxy(char *, char *);
 static void bindkey(const char *, const char *, const char *);
+static int apply_cfgop(const struct cfgop *);
 static void do_parseconfig(const char *, int);
 
 %}
@@ -193,7 +197,7 @@ yylex(void)
 {
 	char buf[1024], *ebuf, *p, *str;
 	const char *errstr;
-	int c, quotes = 0, escape = 0, qpos = -1, nonkw = 0;
+	int c, quotes = 0, escape = 0, qpos = -1, nonkw = 0, scale;
 	size_t i;
 
 	p = buf;
@@ -314,9 +318,36 @@ eow:
 	}
 	c = *buf;
 	if (!nonkw && (c == '-' || isdigit(c))) {
-		yylval.num = strtonum(buf, INT_MIN, INT_MAX, &errstr);
+		/* allow a K, M or G suffix for sizes */
+		scale = 1;
+		i = strlen(buf);
+		if (i > 1 && isdigit((unsigned char)buf[i - 2])) {
+			switch (buf[i - 1]) {
+			case 'K':
+			case 'k':
+				scale = 1024;
+				break;
+			case 'M':
+			case 'm':
+				scale = 1024 * 1024;
+				break;
+			case 'G':
+			case 'g':
+				scale = 1024 * 1024 * 1024;
+				break;
+			}
+			if (scale != 1) {
+				c = buf[i - 1];
+				buf[i - 1] = '\0';
+			}
+		}
+		yylval.num = strtonum(buf, INT_MIN / scale, INT_MAX / scale,
+		    &errstr);
+		if (scale != 1)
+			buf[i - 1] = c;
 		if (errstr != NULL)
 			yyerror("number is %s: %s", errstr, buf);
+		yylval.num *= scale;
 		return NUMBER;
 	}
 	str = xstrdup(buf);
@@ -334,6 +365,8 @@ setprfx(const char *prfx, const char *cont)
 {
 	assert(current_style != NULL);
 
+	cfgsnap_add(&(struct cfgop){ CFG_PRFX, { 0 },
+	    { current_style, prfx, cont } });
 	if (!config_setprfx(current_style, prfx, cont))
 		yyerror("invalid style %s", current_style);
 }
@@ -341,6 +374,8 @@ setprfx(const char *prfx, const char *cont)
 static void
 setvari(char *var, int val)
 {
+	cfgsnap_add(&(struct cfgop){ CFG_VARI, { val }, { var } });
+
 	/*
 	 * For some time, fall back to a boolean as compat
 	 * with telescope 0.8 and previous.
@@ -356,6 +391,7 @@ setvari(char *var, int val)
 static void
 setvars(char *var, char *val)
 {
+	cfgsnap_add(&(struct cfgop){ CFG_VARS, { 0 }, { var, val } });
 	if (!config_setvars(var, val))
 		yyerror("invalid variable or value: %s = \"%s\"",
 		    var, val);
@@ -366,6 +402,7 @@ setvars(char *var, char *val)
 static void
 setvarb(char *var, int val)
 {
+	cfgsnap_add(&(struct cfgop){ CFG_VARB, { val }, { var } });
 	if (!config_setvarb(var, val))
 		yyerror("invalid variable or value: %s = %s",
 		    var, val ? "true" : "false");
@@ -430,6 +467,8 @@ setcolor(const char *prfx, const char *line, const char *trail)
 	l = colorname(line);
 	t = colorname(trail);
 
+	cfgsnap_add(&(struct cfgop){ CFG_COLOR, { p, l, t, color_type == BG },
+	    { current_style } });
 	if (!config_setcolor(color_type == BG, current_style, p, l, t))
 		yyerror("invalid style %s", current_style);
 }
@@ -491,15 +530,47 @@ setattr(char *prfx, char *line, char *trail)
 	l = attrname(line);
 	t = attrname(trail);
 
+	cfgsnap_add(&(struct cfgop){ CFG_ATTR, { p, l, t }, { current_style } });
 	if (!config_setattr(current_style, p, l, t))
 		yyerror("invalid style %s", current_style);
 }
 
+static void
+insert_proxy(char *proto, const char *host, const char *port)
+{
+	struct proxy *p;
+
+	p = xcalloc(1, sizeof(*p));
+
+	p->match_proto = proto;
+	p->proto = PROTO_GEMINI;
+
+	p->host = xstrdup(host);
+
+	p->port = xstrdup(port);
+
+	TAILQ_INSERT_HEAD(&proxies, p, proxies);
+}
+
+/* forget the proxies added by a snapshot replayed only in part */
+static void
+clear_proxies(void)
+{
+	struct proxy *p;
+
+	while ((p = TAILQ_FIRST(&proxies)) != NULL) {
+		TAILQ_REMOVE(&proxies, p, proxies);
+		free(p->match_proto);
+		free(p->host);
+		free(p->port);
+		free(p);
+	}
+}
+
 static void
 add_proxy(char *proto, char *proxy)
 {
 	static struct iri iri;
-	struct proxy *p;
 
 	if (iri_parse(NULL, proxy, &iri) == -1) {
 		yyerror("can't parse URL: %s", proxy);
@@ -517,16 +588,9 @@ add_proxy(char *proto, char *proxy)
 		return;
 	}
 
-	p = xcalloc(1, sizeof(*p));
-
-	p->match_proto = proto;
-	p->proto = PROTO_GEMINI;
-
-	p->host = xstrdup(iri.iri_host);
-
-	p->port = xstrdup(iri.iri_portstr);
-
-	TAILQ_INSERT_HEAD(&proxies, p, proxies);
+	cfgsnap_add(&(struct cfgop){ CFG_PROXY, { 0 },
+	    { proto, iri.iri_host, iri.iri_portstr } });
+	insert_proxy(proto, iri.iri_host, iri.iri_portstr);
 }
 
 static interactivefn *
@@ -534,11 +598,18 @@ cmdname(const char *name)
 {
 	struct cmd *cmd;
 
-	for (cmd = cmds; cmd->cmd != NULL; ++cmd) {
-		if (!strcmp(cmd->cmd, name))
-			return cmd->fn;
-	}
+	if ((cmd = cmd_lookup(name)) == NULL)
+		return NULL;
+	return cmd->fn;
+}
 
+static struct kmap *
+kmapname(const char *name)
+{
+	if (!strcmp(name, "global-map"))
+		return &global_map;
+	if (!strcmp(name, "minibuffer-map"))
+		return &minibuffer_map;
 	return NULL;
 }
 
@@ -548,27 +619,67 @@ bindkey(const char *map, const char *key, const char *cmd)
 	struct kmap *kmap;
 	interactivefn *fn;
 
-	if (!strcmp(map, "global-map"))
-		kmap = &global_map;
-	else if (!strcmp(map, "minibuffer-map"))
-		kmap = &minibuffer_map;
-	else {
+	if ((kmap = kmapname(map)) == NULL) {
 		yyerror("unknown map: %s", map);
 		return;
 	}
 
 	if ((fn = cmdname(cmd)) == NULL) {
-		yyerror("unknown cmd: %s", fn);
+		yyerror("unknown cmd: %s", cmd);
 		return;
 	}
 
+	cfgsnap_add(&(struct cfgop){ CFG_BIND, { 0 }, { map, key, cmd } });
 	if (!kmap_define_key(kmap, key, fn))
 		yyerror("failed to bind %s %s %s", map, key, cmd);
 }
 
+/* redo a rule saved in the config snapshot */
+static int
+apply_cfgop(const struct cfgop *op)
+{
+	struct kmap	*kmap;
+	interactivefn	*fn;
+	const char	*const *s = op->str;
+	const int	*n = op->num;
+
+	switch (op->op) {
+	case CFG_VARI:
+		return s[0] != NULL &&
+		    (config_setvari(s[0], n[0]) || config_setvarb(s[0], n[0]));
+	case CFG_VARS:
+		return s[0] != NULL && s[1] != NULL &&
+		    config_setvars(s[0], xstrdup(s[1]));
+	case CFG_VARB:
+		return s[0] != NULL && config_setvarb(s[0], n[0]);
+	case CFG_PRFX:
+		return s[0] != NULL && s[1] != NULL && s[2] != NULL &&
+		    config_setprfx(s[0], xstrdup(s[1]), xstrdup(s[2]));
+	case CFG_COLOR:
+		return s[0] != NULL &&
+		    config_setcolor(n[3], s[0], n[0], n[1], n[2]);
+	case CFG_ATTR:
+		return s[0] != NULL && config_setattr(s[0], n[0], n[1], n[2]);
+	case CFG_PROXY:
+		if (s[0] == NULL || s[1] == NULL || s[2] == NULL)
+			return 0;
+		insert_proxy(xstrdup(s[0]), s[1], s[2]);
+		return 1;
+	case CFG_BIND:
+		if (s[0] == NULL || s[1] == NULL || s[2] == NULL ||
+		    (kmap = kmapname(s[0])) == NULL ||
+		    (fn = cmdname(s[2])) == NULL)
+			return 0;
+		return kmap_define_key(kmap, s[1], fn);
+	default:
+		return 0;
+	}
+}
+
 static void
 do_parseconfig(const char *filename, int fonf)
 {
+	cfgsnap_file(filename);
 	if ((yyfp = fopen(filename, "r")) == NULL) {
 		if (fonf)
 			err(1, "%s", filename);
@@ -582,22 +693,37 @@ do_parseconfig(const char *filename, int fonf)
 		exit(1);
 }
 
+/*
+ * Load the given config file, then the one for the terminal, from the
+ * snapshot in the cache directory if they didn't change since it was
+ * taken.
+ */
 void
-parseconfig(const char *filename, int fonf)
+parseconfig(const char *filename, int fonf, int snap)
 {
-	char altconf[PATH_MAX], *term;
-
-	/* load the given config file */
-	do_parseconfig(filename, fonf);
-
-	/* then try to load file-TERM */
+	const char	*paths[2];
+	char		 altconf[PATH_MAX], *term;
+	size_t		 i, npaths = 0;
+
+	paths[npaths++] = filename;
+	if ((term = getenv("TERM")) != NULL) {
+		strlcpy(altconf, filename, sizeof(altconf));
+		strlcat(altconf, "-", sizeof(altconf));
+		strlcat(altconf, term, sizeof(altconf));
+		paths[npaths++] = altconf;
+	}
 
-	if ((term = getenv("TERM")) == NULL)
+	/* a missing config file given with -c is an error */
+	if (snap && (!fonf || access(filename, F_OK) == 0) &&
+	    cfgsnap_load(config_snap_file, paths, npaths, apply_cfgop) == 0)
 		return;
 
-	strlcpy(altconf, filename, sizeof(altconf));
-	strlcat(altconf, "-", sizeof(altconf));
-	strlcat(altconf, term, sizeof(altconf));
+	/* the other rules are just done again, these would be added twice */
+	clear_proxies();
+
+	for (i = 0; i < npaths; ++i)
+		do_parseconfig(paths[i], i == 0 ? fonf : 0);
 
-	do_parseconfig(altconf, 0);
+	if (snap && !safe_mode)
+		cfgsnap_save(config_snap_file, config_snap_file_tmp);
 }
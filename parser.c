@@ -16,14 +16,19 @@
 
 #include "compat.h"
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "hist.h"
 #include "parser.h"
+#include "perf.h"
 #include "telescope.h"
 #include "xwrapper.h"
 
+static void utf8_reject(struct buffer *);
+static int ascii_line(struct buffer *, const char *, size_t);
 static int parser_foreach_line(struct buffer *, const char *, size_t);
 
 void
@@ -35,16 +40,72 @@ parser_init(struct buffer *buffer, const struct parser *p)
 	buffer->parser = p;
 	buffer->mode = p->name;
 	buffer->parser_flags = p->initflags;
+
+	/* drop whatever was left by an interrupted load */
+	buffer->len = 0;
+	buffer->cur = 0;
+	buffer->nonascii = 0;
+	buffer->u8need = buffer->u8have = 0;
+}
+
+static void
+lineidx_push(struct lineidx *idx, struct line *l)
+{
+	size_t	 cap;
+
+	if (idx->len + 1 >= idx->cap) {
+		cap = idx->cap * 1.5 + 16;
+		idx->refs = xreallocarray(idx->refs, cap, sizeof(*idx->refs));
+		idx->cap = cap;
+	}
+	idx->refs[idx->len].line = l;
+	idx->refs[idx->len].cache = NULL;
+	idx->len++;
+	idx->refs[idx->len].line = NULL;
+}
+
+/*
+ * Called by the parsers for every line they add to the buffer, to
+ * keep the indexes over it and to mark the lines made only of
+ * printable ASCII.
+ */
+void
+parser_index_line(struct buffer *buffer, struct line *l)
+{
+	if (buffer->parser_flags & PARSER_ASCII)
+		l->flags |= L_ASCII;
+
+	switch (l->type) {
+	case LINE_TITLE_1:
+	case LINE_TITLE_2:
+	case LINE_TITLE_3:
+	case LINE_PATCH_HUNK_HDR:
+		lineidx_push(&buffer->headings, l);
+		break;
+	case LINE_LINK:
+		lineidx_push(&buffer->links, l);
+		break;
+	default:
+		break;
+	}
 }
 
 int
 parser_parse(struct buffer *buffer, const char *chunk, size_t len)
 {
 	const struct parser *p = buffer->parser;
+	uint64_t t;
+	int r;
 
-	if (p->parse)
-		return p->parse(buffer, chunk, len);
-	return parser_foreach_line(buffer, chunk, len);
+	t = perf_usec();
+	if (buffer->parser_flags & PARSER_RECORDS)
+		r = gemtext_load_records(buffer, chunk, len);
+	else if (p->parse)
+		r = p->parse(buffer, chunk, len);
+	else
+		r = parser_foreach_line(buffer, chunk, len);
+	perf_count(PERF_PARSE, perf_usec() - t);
+	return r;
 }
 
 int
@@ -66,28 +127,64 @@ parser_parsef(struct buffer *buffer, const char *fmt, ...)
 	return r;
 }
 
+/*
+ * Parse what's left at the end of the data and let go of the
+ * buffered text.
+ */
 int
-parser_free(struct tab *tab)
+parser_flush(struct buffer *buffer)
 {
-	struct buffer		*buffer = &tab->buffer;
 	const struct parser	*p = buffer->parser;
 	int			 r = 1;
-	char			*tilde, *slash;
+	size_t			 len;
 
+	/* a record cut by the end of the data is lost */
+	if (buffer->parser_flags & PARSER_RECORDS)
+		buffer->len = buffer->cur = 0;
+
+	/* a sequence cut by the end of the data */
+	if (buffer->u8need != 0) {
+		if (buffer->cap - buffer->len < 3) {
+			buffer->cap += 3;
+			buffer->buf = xrealloc(buffer->buf, buffer->cap);
+		}
+		utf8_reject(buffer);
+	}
+
+	len = buffer->len - buffer->cur;
+	if (len != 0 && ascii_line(buffer, buffer->buf + buffer->cur, len))
+		buffer->parser_flags |= PARSER_ASCII;
 	if (p->free) {
 		r = p->free(buffer);
-	} else if (buffer->len != 0) {
+	} else if (len != 0) {
+		/* flush the last line, if not terminated by a newline */
 		if (p->parse)
-			r = p->parse(buffer, buffer->buf, buffer->len);
+			r = p->parse(buffer, buffer->buf + buffer->cur, len);
 		else
-			r = parser_foreach_line(buffer, buffer->buf,
-			    buffer->len);
+			r = p->parseline(buffer, buffer->buf + buffer->cur,
+			    len);
 	}
 
+	buffer->parser_flags &= ~(PARSER_ASCII|PARSER_RECORDS);
+
 	free(buffer->buf);
 	buffer->buf = NULL;
 	buffer->len = 0;
+	buffer->cap = 0;
+	buffer->cur = 0;
+	buffer->nonascii = 0;
+
+	return r;
+}
+
+int
+parser_free(struct tab *tab)
+{
+	struct buffer		*buffer = &tab->buffer;
+	char			*tilde, *slash;
+	int			 r;
 
+	r = parser_flush(buffer);
 	if (*buffer->title != '\0')
 		return r;
 
@@ -100,78 +197,292 @@ parser_free(struct tab *tab)
 
 		if ((slash = strchr(buffer->title, '/')) != NULL)
 			*slash = '\0';
-	} else
-		strlcpy(buffer->title, tab->iri.iri_host,
+	} else if (tab->iri != NULL)
+		strlcpy(buffer->title, tab->iri->iri_host,
 		    sizeof(buffer->title));
 
 	return r;
 }
 
+/*
+ * Write the line in the format of the buffer.  Lines are serialized
+ * one at a time so that big pages can be saved in chunks.
+ */
 int
-parser_serialize(struct buffer *b, FILE *fp)
+parser_serialize_line(struct buffer *b, struct line *line, FILE *fp)
 {
 	const struct parser	*p = b->parser;
-	struct line		*line;
 	const char		*text;
-	int			 r;
 
 	if (p->serialize != NULL)
-		return p->serialize(b, fp);
+		return p->serialize(line, fp);
 
 	/* a default implementation good enough for plain text */
-	TAILQ_FOREACH(line, &b->head, lines) {
-		if ((text = line->line) == NULL)
-			text = "";
+	if ((text = line->line) == NULL)
+		text = "";
+	return fprintf(fp, "%s\n", text) != -1;
+}
 
-		r = fprintf(fp, "%s\n", text);
-		if (r == -1)
+int
+parser_serialize(struct buffer *b, FILE *fp)
+{
+	struct line	*line;
+
+	TAILQ_FOREACH(line, &b->head, lines) {
+		if (!parser_serialize_line(b, line, fp))
 			return 0;
 	}
 
 	return 1;
 }
 
+#define ONES	((unsigned long)-1 / 0xFF)
+#define HIGHS	(ONES * 0x80)
+
+/* true if every byte of the word is printable ASCII */
+#define ALL_PRINTABLE_ASCII(w)						\
+	(!(((w) | ((w) + ONES)) & HIGHS) &&				\
+	    !(((w) - ONES * ' ') & ~(w) & HIGHS))
+
+#define REPLACEMENT_CHAR	"\xEF\xBF\xBD"	/* U+FFFD */
+
+/*
+ * Undo the UTF-8 sequence left incomplete at the end of buf and put
+ * a replacement character in its place.  There's always room for it.
+ */
+static void
+utf8_reject(struct buffer *b)
+{
+	b->len -= b->u8have;
+	memcpy(b->buf + b->len, REPLACEMENT_CHAR, 3);
+	b->len += 3;
+	b->nonascii = b->len;
+	b->u8need = b->u8have = 0;
+}
+
+#define CONT(c)		(((c) & 0xC0) == 0x80)
+
+/*
+ * The length of the clean run at the start of s: printable ASCII,
+ * newlines, tabs and well-formed UTF-8 sequences, as in table 3-7 of
+ * Unicode.  Words of printable ASCII are checked at once.  *na is
+ * set past the last byte that's not printable ASCII, if any.
+ */
+static size_t
+clean_run(const uint8_t *s, const uint8_t *end, const uint8_t **na)
+{
+	const uint8_t	*p = s;
+	unsigned long	 w;
+	unsigned int	 c, slow = 0;
+
+	while (p < end) {
+		/* don't look at the same bytes again */
+		if (slow != 0)
+			slow--;
+		else if (end - p >= (ptrdiff_t)sizeof(w)) {
+			memcpy(&w, p, sizeof(w));
+			if (ALL_PRINTABLE_ASCII(w)) {
+				p += sizeof(w);
+				continue;
+			}
+			slow = sizeof(w) - 1;
+		}
+
+		c = *p;
+		if (c < 0x80) {
+			if ((c >= ' ' && c != 127) || c == '\n')
+				p++;
+			else if (c == '\t')
+				*na = ++p;
+			else
+				break;
+			continue;
+		}
+
+		if (c >= 0xC2 && c <= 0xDF) {
+			if (end - p < 2 || !CONT(p[1]))
+				break;
+			p += 2;
+		} else if (c >= 0xE0 && c <= 0xEF) {
+			if (end - p < 3 || !CONT(p[1]) || !CONT(p[2]) ||
+			    (c == 0xE0 && p[1] < 0xA0) ||
+			    (c == 0xED && p[1] > 0x9F))
+				break;
+			p += 3;
+		} else if (c >= 0xF0 && c <= 0xF4) {
+			if (end - p < 4 || !CONT(p[1]) || !CONT(p[2]) ||
+			    !CONT(p[3]) ||
+			    (c == 0xF0 && p[1] < 0x90) ||
+			    (c == 0xF4 && p[1] > 0x8F))
+				break;
+			p += 4;
+		} else
+			break;
+		*na = p;
+	}
+
+	return p - s;
+}
+
+/*
+ * Copy the bytes from src at the end of buf, as long as there's room
+ * for them, dropping every "funny" ASCII character but newlines and
+ * tabs and replacing the ill-formed UTF-8 sequences with U+FFFD.
+ * The clean runs are copied at once, the rest byte by byte.  A
+ * sequence cut at the end of the chunk is kept as it is and
+ * completed, or replaced, by the next one.  Returns the number of
+ * bytes consumed.
+ */
+static size_t
+copy_sanitized(struct buffer *b, const char *src, size_t len)
+{
+	const uint8_t	*s = (const uint8_t *)src, *end = s + len;
+	const uint8_t	*na = NULL;
+	char		*d, *dend, *nonascii;
+	size_t		 n;
+	unsigned int	 ch, need, have, lo, hi;
+
+	d = b->buf + b->len;
+	dend = b->buf + b->cap;
+	nonascii = b->buf + b->nonascii;
+	need = b->u8need;
+	have = b->u8have;
+	lo = b->u8lo;
+	hi = b->u8hi;
+
+	/* always leave room for a replacement character */
+	while (s < end && dend - d >= 3) {
+		if (need != 0) {
+			ch = *s;
+			if (ch < lo || ch > hi) {
+				/* ch can start the next one */
+				d -= have;
+				memcpy(d, REPLACEMENT_CHAR, 3);
+				d += 3;
+				nonascii = d;
+				need = have = 0;
+				continue;
+			}
+			*d++ = ch;
+			s++;
+			nonascii = d;
+			lo = 0x80;
+			hi = 0xBF;
+			have = --need == 0 ? 0 : have + 1;
+			continue;
+		}
+
+		n = MIN(end - s, dend - d - 3);
+		if ((n = clean_run(s, s + n, &na)) != 0) {
+			memcpy(d, s, n);
+			if (na != NULL)
+				nonascii = d + (na - s);
+			d += n;
+			s += n;
+			na = NULL;
+			continue;
+		}
+
+		ch = *s++;
+		if (ch < 0x80)
+			continue;	/* a control character */
+
+		lo = 0x80;
+		hi = 0xBF;
+		if (ch >= 0xC2 && ch <= 0xDF)
+			need = 1;
+		else if (ch >= 0xE0 && ch <= 0xEF) {
+			need = 2;
+			if (ch == 0xE0)
+				lo = 0xA0;
+			else if (ch == 0xED)
+				hi = 0x9F;
+		} else if (ch >= 0xF0 && ch <= 0xF4) {
+			need = 3;
+			if (ch == 0xF0)
+				lo = 0x90;
+			else if (ch == 0xF4)
+				hi = 0x8F;
+		}
+
+		if (need == 0) {
+			memcpy(d, REPLACEMENT_CHAR, 3);
+			d += 3;
+		} else {
+			*d++ = ch;
+			have = 1;
+		}
+		nonascii = d;
+	}
+
+	b->len = d - b->buf;
+	b->nonascii = nonascii - b->buf;
+	b->u8need = need;
+	b->u8have = have;
+	b->u8lo = lo;
+	b->u8hi = hi;
+	return (const char *)s - src;
+}
+
+/*
+ * Append the chunk to the buffer.  The unconsumed data is the range
+ * [cur, len) of buf: it's moved back at the start only when there
+ * isn't enough space left and the buffer grows geometrically, so
+ * that every byte is copied a bounded number of times.  The data is
+ * sanitized while copying, which may need a bit more space.
+ */
 static int
 parser_append(struct buffer *b, const char *buf, size_t len)
 {
-	size_t newlen;
-	char *t;
-
-	if (len == 0)
-		return (1);
-
-	newlen = len + b->len;
-	t = xcalloc(1, newlen);
-	memcpy(t, b->buf, b->len);
-	memcpy(t + b->len, buf, len);
-	free(b->buf);
-	b->buf = t;
-	b->len = newlen;
+	size_t	 newcap, n;
+
+	while (len != 0) {
+		if (b->cur != 0 && b->cap - b->len < len + 3) {
+			memmove(b->buf, b->buf + b->cur, b->len - b->cur);
+			b->len -= b->cur;
+			b->nonascii = b->nonascii > b->cur ?
+			    b->nonascii - b->cur : 0;
+			b->cur = 0;
+		}
+
+		if (b->cap - b->len < len + 3) {
+			newcap = b->cap == 0 ? BUFSIZ : b->cap;
+			while (newcap - b->len < len + 3)
+				newcap *= 2;
+			b->buf = xrealloc(b->buf, newcap);
+			b->cap = newcap;
+		}
+
+		n = copy_sanitized(b, buf, len);
+		buf += n;
+		len -= n;
+	}
+
 	return 1;
 }
 
+/*
+ * Whether the line is only printable ASCII, which is recorded in the
+ * lines for wrap.c.  There's no need to look at it when nothing else
+ * was copied after its start.
+ */
 static int
-parser_set_buf(struct buffer *b, const char *buf, size_t len)
+ascii_line(struct buffer *b, const char *s, size_t len)
 {
-	char *tmp;
+	unsigned long	 w;
+	size_t		 i;
 
-	if (len == 0) {
-		b->len = 0;
-		free(b->buf);
-		b->buf = NULL;
+	if (b->nonascii <= (size_t)(s - b->buf))
 		return 1;
-	}
-
-	/*
-	 * p->buf and buf can (and probably almost always will)
-	 * overlap!
-	 */
 
-	tmp = xcalloc(1, len);
-	memcpy(tmp, buf, len);
-	free(b->buf);
-	b->buf = tmp;
-	b->len = len;
+	for (i = 0; len - i >= sizeof(w); i += sizeof(w)) {
+		memcpy(&w, s + i, sizeof(w));
+		if (!ALL_PRINTABLE_ASCII(w))
+			return 0;
+	}
+	for (; i < len; ++i)
+		if ((unsigned char)s[i] < ' ' || (unsigned char)s[i] >= 127)
+			return 0;
 	return 1;
 }
 
@@ -180,13 +491,17 @@ parser_foreach_line(struct buffer *b, const char *buf, size_t size)
 {
 	const struct parser	*p = b->parser;
 	char			*beg, *end;
-	unsigned int		 ch;
-	size_t			 i, l, len;
+	size_t			 l, len, off = 0;
+	int			 r;
+
+	/* the pending data, if any, is known not to have a newline */
+	if (b->parser_flags & PARSER_IN_BODY)
+		off = b->len - b->cur;
 
 	if (!parser_append(b, buf, size))
 		return 0;
-	beg = b->buf;
-	len = b->len;
+	beg = b->buf + b->cur;
+	len = b->len - b->cur;
 
 	if (!(b->parser_flags & PARSER_IN_BODY) && len < 3)
 		return 1;
@@ -199,41 +514,30 @@ parser_foreach_line(struct buffer *b, const char *buf, size_t size)
 		 * it's useless; some editors may still add one
 		 * though.
 		 */
-		if (memmem(beg, len, "\xEF\xBB\xBF", 3) == beg) {
-			b += 3;
+		if (!memcmp(beg, "\xEF\xBB\xBF", 3)) {
+			beg += 3;
 			len -= 3;
 		}
 	}
 
-	/* drop every "funny" ASCII character */
-	for (i = 0; i < len; ) {
-		ch = beg[i];
-		if ((ch >= ' ' || ch == '\n' || ch == '\t')
-		    && ch != 127) { /* del */
-			++i;
-			continue;
-		}
-		memmove(&beg[i], &beg[i+1], len - i - 1);
-		len--;
-	}
-
-	while (len > 0) {
-		if ((end = memmem((char*)beg, len, "\n", 1)) == NULL)
-			break;
+	while ((end = memchr(beg + off, '\n', len - off)) != NULL) {
 		l = end - beg;
 
-		if (!p->parseline(b, beg, l))
+		if (ascii_line(b, beg, l))
+			b->parser_flags |= PARSER_ASCII;
+		r = p->parseline(b, beg, l);
+		b->parser_flags &= ~PARSER_ASCII;
+		if (!r)
 			return 0;
 
-		len -= l;
-		beg += l;
-
-		if (len > 0) {
-			/* skip \n */
-			len--;
-			beg++;
-		}
+		/* skip the line and the \n */
+		len -= l + 1;
+		beg += l + 1;
+		off = 0;
 	}
 
-	return parser_set_buf(b, beg, len);
+	b->cur = beg - b->buf;
+	if (b->cur == b->len)
+		b->cur = b->len = b->nonascii = 0;
+	return 1;
 }
@@ -18,6 +18,8 @@
 #define PARSER_H
 
 struct buffer;
+struct line;
+struct page_lines;
 struct tab;
 
 struct parser {
@@ -27,14 +29,21 @@ struct parser {
 	int		(*parse)(struct buffer *, const char *, size_t);
 	int		(*parseline)(struct buffer *, const char *, size_t);
 	int		(*free)(struct buffer *);
-	int		(*serialize)(struct buffer *, FILE *);
+	int		(*serialize)(struct line *, FILE *);
 };
 
 void	 parser_init(struct buffer *, const struct parser *);
 int	 parser_parse(struct buffer *, const char *, size_t);
 int	 parser_parsef(struct buffer *, const char *, ...);
+int	 parser_flush(struct buffer *);
 int	 parser_free(struct tab *);
 int	 parser_serialize(struct buffer *, FILE *);
+int	 parser_serialize_line(struct buffer *, struct line *, FILE *);
+void	 parser_index_line(struct buffer *, struct line *);
+
+int	 gemtext_load_lines(struct tab *, const struct page_lines *);
+void	 gemtext_pack_lines(struct buffer *, char **, size_t *, size_t *);
+int	 gemtext_load_records(struct buffer *, const char *, size_t);
 
 extern const struct parser	 gemtext_parser;
 extern const struct parser	 gophermap_parser;
@@ -24,20 +24,40 @@
 
 #include "compat.h"
 
-#include <ctype.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 
+#include "arena.h"
 #include "defaults.h"
+#include "pages.h"
 #include "parser.h"
 #include "telescope.h"
 #include "utf8.h"
 #include "xwrapper.h"
 
+/*
+ * A line as sent by the net process when it's the one parsing the
+ * body, see gemtext_pack_lines.  The text and the URL follow, not
+ * NUL-terminated.
+ */
+struct line_rec {
+	uint8_t		 type;
+	uint8_t		 flags;
+#define REC_ASCII	0x1
+#define REC_TEXT	0x2
+#define REC_URL		0x4
+#define REC_SHARED	0x8	/* the text is the URL */
+	uint16_t	 pad;
+	uint32_t	 len;
+	uint32_t	 ulen;
+};
+
 static int	gemtext_parse_line(struct buffer *, const char *, size_t);
 static int	gemtext_free(struct buffer *);
-static int	gemtext_serialize(struct buffer *, FILE *);
+static int	gemtext_serialize(struct line *, FILE *);
 
+static void	line_flags(struct line *);
 static int	parse_link(struct buffer *, const char*, size_t);
 static int	parse_title(struct buffer *, const char*, size_t);
 static void	search_title(struct buffer *, enum line_type);
@@ -49,34 +69,83 @@ const struct parser gemtext_parser = {
 	.serialize = &gemtext_serialize,
 };
 
+/*
+ * The control characters other than tabs are filtered out before the
+ * lines get here, so the only whitespace left is spaces and tabs.
+ */
+static inline int
+is_blank(char c)
+{
+	return c == ' ' || c == '\t';
+}
+
+/*
+ * Add a line to the buffer.  The line and its text, and the URL of
+ * links, are copied in a single allocation from the buffer arena; a
+ * link without a label shares the URL as text.
+ */
 static inline int
-emit_line(struct buffer *b, enum line_type type, char *line, char *alt)
+emit_line(struct buffer *b, enum line_type type, const char *text,
+    size_t len, const char *url, size_t ulen)
 {
-	struct line *l;
+	struct line	*l;
+	size_t		 size;
+	char		*p;
 
-	l = xcalloc(1, sizeof(*l));
+	size = sizeof(*l);
+	if (text != NULL && text != url)
+		size += len + 1;
+	if (url != NULL)
+		size += ulen + 1;
+
+	l = arena_alloc(&b->line_arena, size);
+	p = (char *)(l + 1);
 
 	l->type = type;
-	l->line = line;
-	l->alt = alt;
+	if (url != NULL) {
+		memcpy(p, url, ulen);
+		p[ulen] = '\0';
+		l->alt = p;
+		p += ulen + 1;
+	}
+	if (text != NULL && text == url)
+		l->line = l->alt;
+	else if (text != NULL) {
+		memcpy(p, text, len);
+		p[len] = '\0';
+		l->line = p;
+	}
+
+	line_flags(l);
+	TAILQ_INSERT_TAIL(&b->head, l, lines);
+	parser_index_line(b, l);
+
+	return 1;
+}
 
+/* what depends on the settings: the hidden lines and the emojis */
+static void
+line_flags(struct line *l)
+{
 	switch (l->type) {
 	case LINE_PRE_START:
 	case LINE_PRE_END:
 		if (hide_pre_context)
-			l->flags = L_HIDDEN;
+			l->flags |= L_HIDDEN;
 		if (l->type == LINE_PRE_END &&
 		    hide_pre_closing_line)
-			l->flags = L_HIDDEN;
+			l->flags |= L_HIDDEN;
 		break;
 	case LINE_PRE_CONTENT:
 		if (hide_pre_blocks)
-			l->flags = L_HIDDEN;
+			l->flags |= L_HIDDEN;
 		break;
 	case LINE_LINK:
 		if (emojify_link &&
-		    !emojied_line(line, (const char **)&l->data))
+		    !emojied_line(l->line, (const char **)&l->data))
 			l->data = NULL;
+		if (l->data != NULL)
+			l->emojiwidth = utf8_swidth_between(l->line, l->data);
 		break;
 	default:
 		break;
@@ -84,51 +153,42 @@ emit_line(struct buffer *b, enum line_type type, char *line, char *alt)
 
 	if (dont_apply_styling)
 		l->flags &= ~L_HIDDEN;
-
-	TAILQ_INSERT_TAIL(&b->head, l, lines);
-
-	return 1;
 }
 
 static int
 parse_link(struct buffer *b, const char *line, size_t len)
 {
-	char *label, *url;
 	const char *start;
+	size_t ulen;
 
 	if (len <= 2)
-		return emit_line(b, LINE_TEXT, NULL, NULL);
+		return emit_line(b, LINE_TEXT, NULL, 0, NULL, 0);
 
 	line += 2, len -= 2;
-	while (len > 0 && isspace((unsigned char)line[0]))
+	while (len > 0 && is_blank(line[0]))
 		line++, len--;
 
 	if (len == 0)
-		return emit_line(b, LINE_TEXT, NULL, NULL);
+		return emit_line(b, LINE_TEXT, NULL, 0, NULL, 0);
 
 	start = line;
-	while (len > 0 && !isspace((unsigned char)line[0]))
+	while (len > 0 && !is_blank(line[0]))
 		line++, len--;
 
-	url = xstrndup(start, line - start);
+	ulen = line - start;
 
-	while (len > 0 && isspace(line[0]))
+	while (len > 0 && is_blank(line[0]))
 		line++, len--;
 
-	if (len == 0) {
-		label = xstrdup(url);
-	} else {
-		label = xstrndup(line, len);
-	}
-
-	return emit_line(b, LINE_LINK, label, url);
+	if (len == 0)
+		return emit_line(b, LINE_LINK, start, ulen, start, ulen);
+	return emit_line(b, LINE_LINK, line, len, start, ulen);
 }
 
 static int
 parse_title(struct buffer *b, const char *line, size_t len)
 {
 	enum line_type t = LINE_TITLE_1;
-	char *l;
 
 	line++, len--;
 	while (len > 0 && *line == '#') {
@@ -138,38 +198,34 @@ parse_title(struct buffer *b, const char *line, size_t len)
 			break;
 	}
 
-	while (len > 0 && isspace((unsigned char)*line))
+	while (len > 0 && is_blank(*line))
 		line++, len--;
 
 	if (len == 0)
-		return emit_line(b, t, NULL, NULL);
+		return emit_line(b, t, NULL, 0, NULL, 0);
 
 	if (t == LINE_TITLE_1 && *b->title == '\0')
 		strncpy(b->title, line, MIN(sizeof(b->title)-1, len));
 
-	l = xstrndup(line, len);
-	return emit_line(b, t, l, NULL);
+	return emit_line(b, t, line, len, NULL, 0);
 }
 
 static int
 gemtext_parse_line(struct buffer *b, const char *line, size_t len)
 {
-	char *l;
-
 	if (b->parser_flags & PARSER_IN_PRE) {
 		if (len >= 3 && !strncmp(line, "```", 3)) {
 			b->parser_flags ^= PARSER_IN_PRE;
-			return emit_line(b, LINE_PRE_END, NULL, NULL);
+			return emit_line(b, LINE_PRE_END, NULL, 0, NULL, 0);
 		}
 
 		if (len == 0)
-			return emit_line(b, LINE_PRE_CONTENT, NULL, NULL);
-		l = xstrndup(line, len);
-		return emit_line(b, LINE_PRE_CONTENT, l, NULL);
+			return emit_line(b, LINE_PRE_CONTENT, NULL, 0, NULL, 0);
+		return emit_line(b, LINE_PRE_CONTENT, line, len, NULL, 0);
 	}
 
 	if (len == 0)
-		return emit_line(b, LINE_TEXT, NULL, NULL);
+		return emit_line(b, LINE_TEXT, NULL, 0, NULL, 0);
 
 	switch (*line) {
 	case '*':
@@ -177,21 +233,19 @@ gemtext_parse_line(struct buffer *b, const char *line, size_t len)
 			break;
 
 		line += 2, len -= 2;
-		while (len > 0 && isspace((unsigned char)*line))
+		while (len > 0 && is_blank(*line))
 			line++, len--;
 		if (len == 0)
-			return emit_line(b, LINE_ITEM, NULL, NULL);
-		l = xstrndup(line, len);
-		return emit_line(b, LINE_ITEM, l, NULL);
+			return emit_line(b, LINE_ITEM, NULL, 0, NULL, 0);
+		return emit_line(b, LINE_ITEM, line, len, NULL, 0);
 
 	case '>':
 		line++, len--;
-		while (len > 0 && isspace((unsigned char)*line))
+		while (len > 0 && is_blank(*line))
 			line++, len--;
 		if (len == 0)
-			return emit_line(b, LINE_QUOTE, NULL, NULL);
-		l = xstrndup(line, len);
-		return emit_line(b, LINE_QUOTE, l, NULL);
+			return emit_line(b, LINE_QUOTE, NULL, 0, NULL, 0);
+		return emit_line(b, LINE_QUOTE, line, len, NULL, 0);
 
 	case '=':
 		if (len > 1 && line[1] == '>')
@@ -207,28 +261,27 @@ gemtext_parse_line(struct buffer *b, const char *line, size_t len)
 
 		b->parser_flags |= PARSER_IN_PRE;
 		line += 3, len -= 3;
-		while (len > 0 && isspace((unsigned char)*line))
+		while (len > 0 && is_blank(*line))
 			line++, len--;
 		if (len == 0)
 			return emit_line(b, LINE_PRE_START,
-			    NULL, NULL);
-		l = xstrndup(line, len);
-		return emit_line(b, LINE_PRE_START, l, NULL);
+			    NULL, 0, NULL, 0);
+		return emit_line(b, LINE_PRE_START, line, len, NULL, 0);
 	}
 
-	l = xstrndup(line, len);
-	return emit_line(b, LINE_TEXT, l, NULL);
+	return emit_line(b, LINE_TEXT, line, len, NULL, 0);
 }
 
 static int
 gemtext_free(struct buffer *b)
 {
 	/* flush the buffer */
-	if (b->len != 0) {
-		if (!gemtext_parse_line(b, b->buf, b->len))
+	if (b->len != b->cur) {
+		if (!gemtext_parse_line(b, b->buf + b->cur,
+		    b->len - b->cur))
 			return 0;
 		if ((b->parser_flags & PARSER_IN_PRE) &&
-		    !emit_line(b, LINE_PRE_END, NULL, NULL))
+		    !emit_line(b, LINE_PRE_END, NULL, 0, NULL, 0))
 			return 0;
 	}
 
@@ -244,12 +297,178 @@ gemtext_free(struct buffer *b)
 	return 1;
 }
 
+/*
+ * Fill the tab with one of the pages split by pagebundler at build
+ * time.  The text is not copied, the lines point to the tables.
+ */
+int
+gemtext_load_lines(struct tab *tab, const struct page_lines *pl)
+{
+	struct buffer		*b = &tab->buffer;
+	const struct page_line	*pline;
+	struct line		*lines, *l;
+	size_t			 i;
+
+	parser_init(b, &gemtext_parser);
+	strlcpy(b->title, pl->title, sizeof(b->title));
+
+	if (pl->nlines != 0) {
+		lines = arena_calloc(&b->line_arena, pl->nlines,
+		    sizeof(*lines));
+		for (i = 0; i < pl->nlines; ++i) {
+			pline = &pl->lines[i];
+			l = &lines[i];
+
+			l->type = pline->type;
+			l->flags = pline->flags;
+			l->line = (char *)pline->line;
+			l->alt = (char *)pline->alt;
+
+			line_flags(l);
+			TAILQ_INSERT_TAIL(&b->head, l, lines);
+			parser_index_line(b, l);
+		}
+	}
+
+	return parser_free(tab);
+}
+
+/*
+ * Append the lines in the buffer to the records in *recs, growing it
+ * as needed.
+ */
+void
+gemtext_pack_lines(struct buffer *b, char **recs, size_t *len, size_t *cap)
+{
+	struct line_rec	 r;
+	struct line	*l;
+	size_t		 need;
+
+	TAILQ_FOREACH(l, &b->head, lines) {
+		memset(&r, 0, sizeof(r));
+		r.type = l->type;
+		if (l->flags & L_ASCII)
+			r.flags |= REC_ASCII;
+		if (l->alt != NULL) {
+			r.flags |= REC_URL;
+			r.ulen = strlen(l->alt);
+		}
+		if (l->line != NULL && l->line == l->alt)
+			r.flags |= REC_SHARED;
+		else if (l->line != NULL) {
+			r.flags |= REC_TEXT;
+			r.len = strlen(l->line);
+		}
+
+		need = sizeof(r) + r.len + r.ulen;
+		if (*cap - *len < need) {
+			*cap = MAX(*cap * 2, *len + need);
+			*recs = xrealloc(*recs, *cap);
+		}
+		memcpy(*recs + *len, &r, sizeof(r));
+		*len += sizeof(r);
+		if (r.flags & REC_TEXT) {
+			memcpy(*recs + *len, l->line, r.len);
+			*len += r.len;
+		}
+		if (r.flags & REC_URL) {
+			memcpy(*recs + *len, l->alt, r.ulen);
+			*len += r.ulen;
+		}
+	}
+}
+
+/* whether s is only printable ASCII, as REC_ASCII claims */
+static int
+rec_ascii(const char *s, size_t len)
+{
+	size_t		 i;
+
+	for (i = 0; i < len; ++i)
+		if ((unsigned char)s[i] < ' ' || (unsigned char)s[i] >= 127)
+			return 0;
+	return 1;
+}
+
+/*
+ * Add the lines packed by the net process to the buffer.  The
+ * records may be cut anywhere by the chunks: what's left of the last
+ * one is kept in the buffer until the rest arrives.  They come from
+ * the sandboxed process, so the ones that don't make sense fail the
+ * parse.
+ */
+int
+gemtext_load_records(struct buffer *b, const char *chunk, size_t len)
+{
+	struct line_rec	 r;
+	const char	*text, *url;
+	size_t		 avail, cap, tlen;
+
+	if (b->cap - b->len < len) {
+		cap = MAX(b->cap * 2, b->len + len);
+		b->buf = xrealloc(b->buf, cap);
+		b->cap = cap;
+	}
+	memcpy(b->buf + b->len, chunk, len);
+	b->len += len;
+
+	for (;;) {
+		avail = b->len - b->cur;
+		if (avail < sizeof(r))
+			break;
+		memcpy(&r, b->buf + b->cur, sizeof(r));
+		if (avail - sizeof(r) < (size_t)r.len + r.ulen)
+			break;
+
+		if (r.type > LINE_PRE_END)
+			return 0;
+
+		/* a shared text has no bytes of its own */
+		if ((r.flags & REC_SHARED) &&
+		    ((r.flags & REC_TEXT) || r.len != 0))
+			return 0;
+
+		text = url = NULL;
+		tlen = r.len;
+		if (r.flags & REC_TEXT)
+			text = b->buf + b->cur + sizeof(r);
+		if (r.flags & REC_URL)
+			url = b->buf + b->cur + sizeof(r) + r.len;
+		if (r.flags & REC_SHARED) {
+			text = url;
+			tlen = r.ulen;
+		}
+
+		if (r.type == LINE_TITLE_1 && text != NULL &&
+		    *b->title == '\0')
+			strncpy(b->title, text,
+			    MIN(sizeof(b->title) - 1, tlen));
+
+		if ((r.flags & REC_ASCII) &&
+		    (text == NULL || rec_ascii(text, tlen)) &&
+		    (url == NULL || rec_ascii(url, r.ulen)))
+			b->parser_flags |= PARSER_ASCII;
+		if (!emit_line(b, r.type, text, r.len, url, r.ulen))
+			return 0;
+		b->parser_flags &= ~PARSER_ASCII;
+
+		b->cur += sizeof(r) + r.len + r.ulen;
+	}
+
+	memmove(b->buf, b->buf + b->cur, b->len - b->cur);
+	b->len -= b->cur;
+	b->cur = 0;
+	return 1;
+}
+
 static void
 search_title(struct buffer *b, enum line_type level)
 {
-	struct line *l;
+	struct line	*l;
+	size_t		 i;
 
-	TAILQ_FOREACH(l, &b->head, lines) {
+	for (i = 0; i < b->headings.len; ++i) {
+		l = b->headings.refs[i].line;
 		if (l->type == level) {
 			if (l->line == NULL)
 				continue;
@@ -272,46 +491,39 @@ static const char *gemtext_prefixes[] = {
 };
 
 static int
-gemtext_serialize(struct buffer *b, FILE *fp)
+gemtext_serialize(struct line *line, FILE *fp)
 {
-	struct line	*line;
 	const char	*text;
 	const char	*alt;
 	int		 r;
 
-	TAILQ_FOREACH(line, &b->head, lines) {
-		if ((text = line->line) == NULL)
-			text = "";
-
-		if ((alt = line->alt) == NULL)
-			alt = "";
-
-		switch (line->type) {
-		case LINE_TEXT:
-		case LINE_TITLE_1:
-		case LINE_TITLE_2:
-		case LINE_TITLE_3:
-		case LINE_ITEM:
-		case LINE_QUOTE:
-		case LINE_PRE_START:
-		case LINE_PRE_CONTENT:
-		case LINE_PRE_END:
-			r = fprintf(fp, "%s%s\n", gemtext_prefixes[line->type],
-			    text);
-			break;
+	if ((text = line->line) == NULL)
+		text = "";
 
-		case LINE_LINK:
-			r = fprintf(fp, "=> %s %s\n", alt, text);
-			break;
+	if ((alt = line->alt) == NULL)
+		alt = "";
 
-		default:
-			/* not reached */
-			abort();
-		}
+	switch (line->type) {
+	case LINE_TEXT:
+	case LINE_TITLE_1:
+	case LINE_TITLE_2:
+	case LINE_TITLE_3:
+	case LINE_ITEM:
+	case LINE_QUOTE:
+	case LINE_PRE_START:
+	case LINE_PRE_CONTENT:
+	case LINE_PRE_END:
+		r = fprintf(fp, "%s%s\n", gemtext_prefixes[line->type], text);
+		break;
 
-		if (r == -1)
-			return 0;
+	case LINE_LINK:
+		r = fprintf(fp, "=> %s %s\n", alt, text);
+		break;
+
+	default:
+		/* not reached */
+		abort();
 	}
 
-	return 1;
+	return r != -1;
 }
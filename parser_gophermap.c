@@ -20,28 +20,33 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
 #include "iri.h"
 #include "parser.h"
 #include "telescope.h"
 #include "utils.h"
-#include "xwrapper.h"
 
 #ifndef LINE_MAX
 #define LINE_MAX 2048
 #endif
 
+/* the fields of a selector, as spans of the line */
 struct gm_selector {
 	char		 type;
 	const char	*ds;
+	size_t		 dslen;
 	const char	*selector;
+	size_t		 sellen;
 	const char	*addr;
+	size_t		 addrlen;
 	const char	*port;
+	size_t		 portlen;
 };
 
-static void	gm_parse_selector(char *, struct gm_selector *);
+static void	gm_parse_selector(const char *, size_t, struct gm_selector *);
 
 static int	gm_parse_line(struct buffer *, const char *, size_t);
-static int	gm_serialize(struct buffer *, FILE *);
+static int	gm_serialize(struct line *, FILE *);
 
 const struct parser gophermap_parser = {
 	.name = "gophermap",
@@ -49,29 +54,45 @@ const struct parser gophermap_parser = {
 	.serialize = &gm_serialize,
 };
 
+/* Return the length of the field at line, up to the next tab. */
+static inline size_t
+field(const char *line, size_t len)
+{
+	const char	*tab;
+
+	if ((tab = memchr(line, '\t', len)) == NULL)
+		return len;
+	return tab - line;
+}
+
 static void
-gm_parse_selector(char *line, struct gm_selector *s)
+gm_parse_selector(const char *line, size_t len, struct gm_selector *s)
 {
+	const char	*end = line + len;
+
 	s->type = *line++;
-	s->ds = line;
-	s->selector = "";
-	s->addr = "";
-	s->port = "";
+	s->selector = s->addr = s->port = "";
 
-	if ((line = strchr(line, '\t')) == NULL)
+	s->ds = line;
+	s->dslen = field(line, end - line);
+	if ((line += s->dslen) == end)
 		return;
-	*line++ = '\0';
-	s->selector = line;
+	line++;
 
-	if ((line = strchr(line, '\t')) == NULL)
+	s->selector = line;
+	s->sellen = field(line, end - line);
+	if ((line += s->sellen) == end)
 		return;
-	*line++ = '\0';
-	s->addr = line;
+	line++;
 
-	if ((line = strchr(line, '\t')) == NULL)
+	s->addr = line;
+	s->addrlen = field(line, end - line);
+	if ((line += s->addrlen) == end)
 		return;
-	*line++ = '\0';
+	line++;
+
 	s->port = line;
+	s->portlen = field(line, end - line);
 }
 
 static int
@@ -79,61 +100,72 @@ selector2uri(struct gm_selector *s, char *buf, size_t len)
 {
 	int	 r;
 
-	r = snprintf(buf, len, "gopher://%s:%s/%c%s",
-	    s->addr, s->port, s->type, *s->selector != '/' ? "/" : "");
+	r = snprintf(buf, len, "gopher://%.*s:%.*s/%c%s",
+	    (int)s->addrlen, s->addr, (int)s->portlen, s->port, s->type,
+	    s->sellen == 0 || *s->selector != '/' ? "/" : "");
 	if (r < 0 || (size_t)r >= len)
 		return (-1);
 
 	buf += r;
 	len -= r;
-	return (iri_urlescape(s->selector, buf, len));
+	return (iri_urlescapen(s->selector, s->sellen, buf, len));
 }
 
+/*
+ * The line, its text and its URL, if any, are allocated at once, as
+ * done for text/gemini.
+ */
 static inline int
 emit_line(struct buffer *b, enum line_type type, struct gm_selector *s)
 {
-	struct line *l;
-	char buf[LINE_MAX];
-
-	l = xcalloc(1, sizeof(*l));
-
-	l->line = xstrdup(s->ds);
+	struct line	*l;
+	const char	*url = NULL;
+	size_t		 ulen = 0;
+	char		*p, buf[LINE_MAX];
+
+	if (type == LINE_LINK) {
+		if (s->type == 'h' && s->sellen >= 4 &&
+		    !strncmp(s->selector, "URL:", 4)) {
+			url = s->selector + 4;
+			ulen = s->sellen - 4;
+		} else {
+			if (selector2uri(s, buf, sizeof(buf)) == -1)
+				return 0;
+			url = buf;
+			ulen = strlen(buf);
+		}
+	}
 
-	switch (l->type = type) {
-	case LINE_LINK:
-		if (s->type == 'h' && !strncmp(s->selector, "URL:", 4)) {
-			strlcpy(buf, s->selector+4, sizeof(buf));
-		} else if (selector2uri(s, buf, sizeof(buf)) == -1)
-			goto err;
+	l = arena_alloc(&b->line_arena, sizeof(*l) + s->dslen + 1 +
+	    (url != NULL ? ulen + 1 : 0));
+	p = (char *)(l + 1);
 
-		l->alt = xstrdup(buf);
-		break;
+	l->type = type;
+	memcpy(p, s->ds, s->dslen);
+	p[s->dslen] = '\0';
+	l->line = p;
 
-	default:
-		break;
+	if (url != NULL) {
+		p += s->dslen + 1;
+		memcpy(p, url, ulen);
+		p[ulen] = '\0';
+		l->alt = p;
 	}
 
 	TAILQ_INSERT_TAIL(&b->head, l, lines);
+	parser_index_line(b, l);
 
 	return 1;
-
-err:
-	if (l != NULL) {
-		free(l->line);
-		free(l->alt);
-		free(l);
-	}
-	return 0;
 }
 
 static int
 gm_parse_line(struct buffer *b, const char *line, size_t linelen)
 {
-	char buf[LINE_MAX] = {0};
 	struct gm_selector s = {0};
 
-	memcpy(buf, line, MIN(sizeof(buf)-1, linelen));
-	gm_parse_selector(buf, &s);
+	if (linelen == 0)
+		return 1;
+	gm_parse_selector(line, linelen, &s);
 
 	switch (s.type) {
 	case '0':	/* text file */
@@ -247,37 +279,31 @@ serialize_link(struct line *line, const char *text, FILE *fp)
 }
 
 static int
-gm_serialize(struct buffer *b, FILE *fp)
+gm_serialize(struct line *line, FILE *fp)
 {
-	struct line	*line;
 	const char	*text;
 	int		 r;
 
-	TAILQ_FOREACH(line, &b->head, lines) {
-		if ((text = line->line) == NULL)
-			text = "";
-
-		switch (line->type) {
-		case LINE_LINK:
-			r = serialize_link(line, text, fp);
-			break;
+	if ((text = line->line) == NULL)
+		text = "";
 
-		case LINE_TEXT:
-			r = fprintf(fp, "i%s\t\terror.host\t1\n", text);
-			break;
+	switch (line->type) {
+	case LINE_LINK:
+		r = serialize_link(line, text, fp);
+		break;
 
-		case LINE_QUOTE:
-			r = fprintf(fp, "3%s\t\terror.host\t1\n", text);
-			break;
+	case LINE_TEXT:
+		r = fprintf(fp, "i%s\t\terror.host\t1\n", text);
+		break;
 
-		default:
-			/* unreachable */
-			abort();
-		}
+	case LINE_QUOTE:
+		r = fprintf(fp, "3%s\t\terror.host\t1\n", text);
+		break;
 
-		if (r == -1)
-			return 0;
+	default:
+		/* unreachable */
+		abort();
 	}
 
-	return 1;
+	return r != -1;
 }
@@ -23,11 +23,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+#include "defaults.h"
 #include "parser.h"
 #include "telescope.h"
 #include "utils.h"
-#include "xwrapper.h"
 
+static void	tpatch_fold(struct buffer *);
 static int	tpatch_emit_line(struct buffer *, const char *, size_t);
 static int	tpatch_parse_line(struct buffer *, const char *, size_t);
 
@@ -37,12 +39,35 @@ const struct parser textpatch_parser = {
 	.initflags = PARSER_IN_PATCH_HDR,
 };
 
+/*
+ * The patch grew past patch-fold-size: hide the body of the hunks
+ * seen so far, and of the ones still to come.  They're opened with
+ * push-button on their header and only wrapped then.
+ */
+static void
+tpatch_fold(struct buffer *b)
+{
+	struct line *l;
+
+	b->parser_flags |= PARSER_PATCH_FOLD;
+
+	wrap_join(b);
+	TAILQ_FOREACH(l, &b->head, lines)
+		if (LINE_HUNK_BODY(l->type))
+			l->flags |= L_HIDDEN;
+	wrap_hidden_changed(b, NULL, NULL);
+}
+
 static int
 tpatch_emit_line(struct buffer *b, const char *line, size_t linelen)
 {
 	struct line *l;
 
-	l = xcalloc(1, sizeof(*l));
+	if (!(b->parser_flags & PARSER_PATCH_FOLD) && patch_fold_size > 0 &&
+	    arena_size(&b->line_arena) > (size_t)patch_fold_size)
+		tpatch_fold(b);
+
+	l = arena_calloc(&b->line_arena, 1, sizeof(*l));
 
 	if (b->parser_flags & PARSER_IN_PATCH_HDR)
 		l->type = LINE_PATCH_HDR;
@@ -50,9 +75,7 @@ tpatch_emit_line(struct buffer *b, const char *line, size_t linelen)
 		l->type = LINE_PATCH;
 
 	if (linelen != 0) {
-		l->line = xcalloc(1, linelen + 1);
-
-		memcpy(l->line, line, linelen);
+		l->line = arena_strndup(&b->line_arena, line, linelen);
 
 		if (!(b->parser_flags & PARSER_IN_PATCH_HDR))
 			switch (*l->line) {
@@ -83,7 +106,11 @@ tpatch_emit_line(struct buffer *b, const char *line, size_t linelen)
 			b->parser_flags &= ~PARSER_IN_PATCH_HDR;
 	}
 
+	if ((b->parser_flags & PARSER_PATCH_FOLD) && LINE_HUNK_BODY(l->type))
+		l->flags |= L_HIDDEN;
+
 	TAILQ_INSERT_TAIL(&b->head, l, lines);
+	parser_index_line(b, l);
 
 	return 1;
 }
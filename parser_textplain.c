@@ -23,9 +23,10 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "arena.h"
+#include "defaults.h"
 #include "parser.h"
 #include "telescope.h"
-#include "xwrapper.h"
 
 static int	textplain_parse_line(struct buffer *, const char *, size_t);
 
@@ -39,17 +40,20 @@ emit_line(struct buffer *b, const char *line, size_t len)
 {
 	struct line *l;
 
-	l = xcalloc(1, sizeof(*l));
+	/* the huge documents go to the disk */
+	if (TAILQ_EMPTY(&b->head) && spill_size > 0)
+		arena_spill_at(&b->line_arena, spill_size);
+
+	l = arena_calloc(&b->line_arena, 1, sizeof(*l));
 
 	l->type = LINE_TEXT;
 
 	if (len != 0) {
-		l->line = xcalloc(1, len + 1);
-
-		memcpy(l->line, line, len);
+		l->line = arena_strndup(&b->line_arena, line, len);
 	}
 
 	TAILQ_INSERT_TAIL(&b->head, l, lines);
+	parser_index_line(b, l);
 
 	return 1;
 }
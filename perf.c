@@ -0,0 +1,419 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "defaults.h"
+#include "ev.h"
+#include "imsgev.h"
+#include "parser.h"
+#include "perf.h"
+#include "proxy.h"
+#include "telescope.h"
+
+#define STARTUP_PHASES	24
+#define SLOW_FRAMES	16
+#define INPUT_SAMPLES	1024
+
+/* how long every step of the startup took, in microseconds */
+static struct {
+	const char	*name;
+	long long	 usec;
+} phases[STARTUP_PHASES];
+static size_t		 nphases;
+static struct timespec	 startup_last;
+
+/* the slowest frames drawn so far, slowest first */
+static struct perf_frame frames[SLOW_FRAMES];
+static size_t		 nframes;
+static FILE		*framelog;
+
+/* the last keystroke-to-paint latencies, in usec */
+static uint64_t		 inputs[INPUT_SAMPLES];
+static uint64_t		 ninputs;
+static uint64_t		 input_start;	/* of the first key not drawn yet */
+
+static const char	*frame_parts[FRAME_PARTS] = {
+	[FRAME_HELP] =		"help",
+	[FRAME_DOWNLOAD] =	"dl",
+	[FRAME_TABLINE] =	"tabs",
+	[FRAME_BODY] =		"body",
+	[FRAME_MODELINE] =	"modeln",
+	[FRAME_MINIBUFFER] =	"echo",
+	[FRAME_UPDATE] =	"update",
+};
+
+static const char *
+kind_name(int kind)
+{
+	switch (kind) {
+	case EV_TIMEOUT:	return "timer";
+	case EV_SIGNAL:		return "signal";
+	case EV_IDLE:		return "idle";
+	case EV_READ:		return "fd";
+	default:		return "-";
+	}
+}
+
+static inline double
+pct(uint64_t part, uint64_t whole)
+{
+	return whole == 0 ? 0 : part * 100.0 / whole;
+}
+
+void
+perf_startup_begin(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &startup_last);
+}
+
+/* the phase with the given name (a string literal) just ended */
+void
+perf_startup(const char *name)
+{
+	struct timespec	 now, diff;
+
+	if (nphases == STARTUP_PHASES)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &startup_last, &diff);
+	startup_last = now;
+
+	phases[nphases].name = name;
+	phases[nphases].usec = diff.tv_sec * 1000000LL + diff.tv_nsec / 1000;
+	nphases++;
+}
+
+void
+perf_startup_report(FILE *fp)
+{
+	long long	 total = 0;
+	size_t		 i;
+
+	fprintf(fp, "%-16s %10s %10s\n", "phase", "ms", "total ms");
+	for (i = 0; i < nphases; ++i) {
+		total += phases[i].usec;
+		fprintf(fp, "%-16s %10.2f %10.2f\n", phases[i].name,
+		    phases[i].usec / 1e3, total / 1e3);
+	}
+}
+
+/* log the frames slower than slow-frame to path */
+int
+perf_frame_log(const char *path)
+{
+	if ((framelog = fopen(path, "a")) == NULL)
+		return -1;
+	setvbuf(framelog, NULL, _IOLBF, 0);
+	return 0;
+}
+
+static void
+log_frame(const struct perf_frame *f)
+{
+	struct tm	 tm;
+	time_t		 now;
+	char		 date[32];
+	int		 i;
+
+	now = time(NULL);
+	if (localtime_r(&now, &tm) == NULL ||
+	    strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm) == 0)
+		(void)strlcpy(date, "-", sizeof(date));
+
+	fprintf(framelog, "%s %.1fms", date, f->usec / 1e3);
+	for (i = 0; i < FRAME_PARTS; ++i)
+		fprintf(framelog, " %s=%.1f", frame_parts[i],
+		    f->parts[i] / 1e3);
+	fprintf(framelog, " mode=%s lines=%zu vlines=%zu walked=%zu"
+	    " size=%dx%d\n", f->mode != NULL ? f->mode : "-", f->lines,
+	    f->vlines, f->walked, f->cols, f->rows);
+}
+
+void
+perf_frame(const struct perf_frame *f)
+{
+	size_t		 i;
+
+	if (framelog != NULL && slow_frame > 0 &&
+	    f->usec >= (uint64_t)slow_frame * 1000)
+		log_frame(f);
+
+	if (nframes == SLOW_FRAMES && frames[nframes - 1].usec >= f->usec)
+		return;
+
+	if (nframes < SLOW_FRAMES)
+		nframes++;
+	for (i = nframes - 1; i > 0 && frames[i - 1].usec < f->usec; --i)
+		frames[i] = frames[i - 1];
+	frames[i] = *f;
+}
+
+static void
+frames_report(FILE *fp)
+{
+	const struct perf_frame	*f;
+	uint64_t		 now;
+	size_t			 i;
+	int			 p;
+
+	fprintf(fp, "## Slowest frames\n\n");
+	if (nframes == 0) {
+		fprintf(fp, "No frame drawn yet.\n\n");
+		return;
+	}
+
+	fprintf(fp, "Milliseconds spent in every part of the frame: the"
+	    " help and the downloads windows, the tabline, the body, the"
+	    " modeline, the echo area and the terminal update.  Then the"
+	    " lines of the page, the vlines visited to fill the windows"
+	    " and the size of the terminal.\n\n```\n");
+	fprintf(fp, "%6s", "total");
+	for (p = 0; p < FRAME_PARTS; ++p)
+		fprintf(fp, " %6s", frame_parts[p]);
+	fprintf(fp, " %7s %7s %6s %7s %5s %s\n", "lines", "vlines",
+	    "walked", "size", "ago", "mode");
+
+	now = perf_usec();
+	for (i = 0; i < nframes; ++i) {
+		f = &frames[i];
+		fprintf(fp, "%6.1f", f->usec / 1e3);
+		for (p = 0; p < FRAME_PARTS; ++p)
+			fprintf(fp, " %6.1f", f->parts[p] / 1e3);
+		fprintf(fp, " %7zu %7zu %6zu %3dx%-3d %4llus %s\n",
+		    f->lines, f->vlines, f->walked, f->cols, f->rows,
+		    (unsigned long long)(now - f->when) / 1000000,
+		    f->mode != NULL ? f->mode : "-");
+	}
+	fprintf(fp, "```\n\n");
+}
+
+/* some keys were handled; they're seen once the next frame is drawn */
+void
+perf_input(void)
+{
+	if (input_start == 0)
+		input_start = perf_usec();
+}
+
+/* a frame was drawn */
+void
+perf_paint(void)
+{
+	if (input_start == 0)
+		return;
+	inputs[ninputs++ % INPUT_SAMPLES] = perf_usec() - input_start;
+	input_start = 0;
+}
+
+static int
+usec_cmp(const void *a, const void *b)
+{
+	uint64_t	 x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void
+inputs_report(FILE *fp)
+{
+	uint64_t	 sorted[INPUT_SAMPLES];
+	size_t		 n;
+
+	fprintf(fp, "## Input latency\n\n");
+	if (ninputs == 0) {
+		fprintf(fp, "No key pressed yet.\n\n");
+		return;
+	}
+
+	n = MIN(ninputs, INPUT_SAMPLES);
+	memcpy(sorted, inputs, n * sizeof(*sorted));
+	qsort(sorted, n, sizeof(*sorted), usec_cmp);
+
+	fprintf(fp, "From reading the keys to drawing the frame, over the"
+	    " last %zu of %llu inputs.\n\n", n,
+	    (unsigned long long)ninputs);
+	fprintf(fp, "* median: %.1fms\n", sorted[n / 2] / 1e3);
+	fprintf(fp, "* p99: %.1fms\n", sorted[n * 99 / 100] / 1e3);
+	fprintf(fp, "* max: %.1fms\n\n", sorted[n - 1] / 1e3);
+}
+
+static const struct {
+	const char	*name;
+	int		 usec;
+} counters[PERF_MAX] = {
+	[PERF_BYTES_IN] =	{ "bytes received",	0 },
+	[PERF_PARSE] =		{ "parsing ms",		1 },
+	[PERF_WRAP] =		{ "wrapping ms",	1 },
+	[PERF_REDRAW] =		{ "redrawing ms",	1 },
+	[PERF_REDRAWS] =	{ "redraws",		0 },
+	[PERF_IMSG_IN] =	{ "imsg received",	0 },
+	[PERF_IMSG_IN_BYTES] =	{ "imsg bytes received", 0 },
+	[PERF_IMSG_OUT] =	{ "imsg sent",		0 },
+	[PERF_IMSG_OUT_BYTES] =	{ "imsg bytes sent",	0 },
+	[PERF_MCACHE_HITS] =	{ "mcache hits",	0 },
+	[PERF_MCACHE_MISSES] =	{ "mcache misses",	0 },
+	[PERF_TLS_HANDSHAKES] =	{ "TLS handshakes",	0 },
+	[PERF_TLS_RESUMED] =	{ "TLS resumptions",	0 },
+	[PERF_DNS] =		{ "resolving ms",	1 },
+	[PERF_DNS_LOOKUPS] =	{ "DNS lookups",	0 },
+	[PERF_DNS_CACHED] =	{ "DNS cache hits",	0 },
+	[PERF_SHM_BYTES] =	{ "bytes in the ring",	0 },
+	[PERF_PRECONNECTS] =	{ "preconnects",	0 },
+	[PERF_PRECONNECTS_USED] = { "preconnects used",	0 },
+	[PERF_DL_PARKED] =	{ "downloads parked",	0 },
+	[PERF_DL_YIELDS] =	{ "download yields",	0 },
+};
+
+static void
+print_counter(FILE *fp, int c, const uint64_t *v)
+{
+	if (v == NULL)
+		fprintf(fp, " %12s", "-");
+	else if (counters[c].usec)
+		fprintf(fp, " %12.1f", v[c] / 1e3);
+	else
+		fprintf(fp, " %12llu", (unsigned long long)v[c]);
+}
+
+/*
+ * Write a gemtext report of the event loop stats and of the counters,
+ * the ones of the net process too if given.
+ */
+void
+perf_report(FILE *fp, const uint64_t *net)
+{
+	struct ev_stats		 st;
+	const struct ev_site	*s;
+	const char		*name;
+	size_t			 i, b;
+	int			 c;
+
+	ev_stats(&st);
+
+	fprintf(fp, "## Event loop\n\n");
+	fprintf(fp, "Up for %.1fs, %llu iterations.\n\n",
+	    st.uptime / 1e6, (unsigned long long)st.iterations);
+	fprintf(fp, "* waiting for events: %.1fs (%.1f%%)\n",
+	    st.polling / 1e6, pct(st.polling, st.uptime));
+	fprintf(fp, "* running callbacks: %.1fs (%.1f%%)\n",
+	    st.handling / 1e6, pct(st.handling, st.uptime));
+	fprintf(fp, "* longest stall in the last %ds: %.1fms\n",
+	    EV_STALL_WINDOW, st.stall / 1e3);
+	if (st.since_input != 0)
+		fprintf(fp, "* last input: %.1fs ago\n",
+		    st.since_input / 1e6);
+	fprintf(fp, "\n");
+
+	fprintf(fp, "## Counters\n\n```\n");
+	fprintf(fp, "%-20s %12s %12s\n", "counter", "ui", "net");
+	for (c = 0; c < PERF_MAX; ++c) {
+		fprintf(fp, "%-20s", counters[c].name);
+		print_counter(fp, c, perf_counters);
+		print_counter(fp, c, net);
+		fprintf(fp, "\n");
+	}
+	fprintf(fp, "```\n\n");
+
+	inputs_report(fp);
+	frames_report(fp);
+	proxy_report(fp);
+
+	fprintf(fp, "## Startup\n\n```\n");
+	perf_startup_report(fp);
+	fprintf(fp, "```\n\n");
+
+	fprintf(fp, "## Callbacks\n\n```\n");
+	fprintf(fp, "%-20s %-6s %10s %10s %9s %9s\n", "site", "kind",
+	    "calls", "total ms", "avg us", "max ms");
+	for (i = 0; i < st.nsites; ++i) {
+		s = &st.sites[i];
+		if ((name = s->name) == NULL)
+			name = "(unnamed)";
+		fprintf(fp, "%-20.20s %-6s %10llu %10.1f %9.1f %9.1f\n",
+		    name, kind_name(s->kind), (unsigned long long)s->calls,
+		    s->total / 1e3,
+		    s->calls == 0 ? 0 : (double)s->total / s->calls,
+		    s->max / 1e3);
+	}
+	fprintf(fp, "```\n\n");
+
+	fprintf(fp, "## Latency histograms\n\n");
+	fprintf(fp, "Number of calls by duration.\n\n```\n");
+	for (i = 0; i < st.nsites; ++i) {
+		s = &st.sites[i];
+		if (s->calls == 0)
+			continue;
+		if ((name = s->name) == NULL)
+			name = "(unnamed)";
+		fprintf(fp, "%s:\n", name);
+		for (b = 0; b < EV_HIST; ++b) {
+			if (s->hist[b] == 0)
+				continue;
+			if (b == EV_HIST - 1)
+				fprintf(fp, "  >=%7.3fms %llu\n",
+				    (1ULL << (b - 1)) / 1e3,
+				    (unsigned long long)s->hist[b]);
+			else
+				fprintf(fp, "  < %7.3fms %llu\n",
+				    (1ULL << b) / 1e3,
+				    (unsigned long long)s->hist[b]);
+		}
+	}
+	fprintf(fp, "```\n");
+}
+
+/*
+ * Generate the about:perf page.  The counters of the net process are
+ * asked first; perf_about_done is called with them.
+ */
+void
+perf_about(struct tab *tab)
+{
+	ui_send_net(IMSG_PERF, tab->id, -1, NULL, 0);
+}
+
+void
+perf_about_done(struct tab *tab, const uint64_t *net)
+{
+	struct buffer	*buffer = &tab->buffer;
+	FILE		*fp;
+	char		*str = NULL;
+	size_t		 len = 0;
+
+	parser_init(buffer, &gemtext_parser);
+	parser_parsef(buffer, "# Performance\n\n");
+
+	if ((fp = open_memstream(&str, &len)) == NULL) {
+		parser_parsef(buffer, "Can't generate the report: %s\n",
+		    strerror(errno));
+		parser_free(tab);
+		return;
+	}
+	perf_report(fp, net);
+	fclose(fp);
+
+	parser_parse(buffer, str, len);
+	free(str);
+	parser_free(tab);
+}
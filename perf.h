@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PERF_H
+#define PERF_H
+
+struct tab;
+
+/*
+ * Counters kept by every process.  They're defined in utils.c, so
+ * that the parsers and wrap.c don't need the rest of perf.c.
+ */
+enum {
+	PERF_BYTES_IN,		/* read from the servers */
+	PERF_PARSE,		/* usec spent parsing */
+	PERF_WRAP,		/* usec spent wrapping */
+	PERF_REDRAW,		/* usec spent redrawing */
+	PERF_REDRAWS,
+	PERF_IMSG_IN,
+	PERF_IMSG_IN_BYTES,
+	PERF_IMSG_OUT,
+	PERF_IMSG_OUT_BYTES,
+	PERF_MCACHE_HITS,
+	PERF_MCACHE_MISSES,
+	PERF_TLS_HANDSHAKES,
+	PERF_TLS_RESUMED,
+	PERF_DNS,		/* usec spent resolving */
+	PERF_DNS_LOOKUPS,
+	PERF_DNS_CACHED,
+	PERF_SHM_BYTES,		/* of the bodies passed in the ring */
+	PERF_PRECONNECTS,
+	PERF_PRECONNECTS_USED,
+	PERF_DL_PARKED,
+	PERF_DL_YIELDS,
+	PERF_MAX,
+};
+
+extern uint64_t	 perf_counters[PERF_MAX];
+
+#define perf_count(c, n)	(perf_counters[(c)] += (n))
+
+/* the parts of a frame redraw_frame times separately */
+enum {
+	FRAME_HELP,
+	FRAME_DOWNLOAD,
+	FRAME_TABLINE,
+	FRAME_BODY,
+	FRAME_MODELINE,
+	FRAME_MINIBUFFER,
+	FRAME_UPDATE,		/* doupdate, writing to the terminal */
+	FRAME_PARTS,
+};
+
+struct perf_frame {
+	uint64_t	 when;		/* perf_usec at the start */
+	uint64_t	 usec;
+	uint64_t	 parts[FRAME_PARTS];
+	const char	*mode;
+	size_t		 lines;		/* of the current buffer */
+	size_t		 vlines;
+	size_t		 walked;	/* vlines visited to fill the windows */
+	int		 rows;
+	int		 cols;
+};
+
+uint64_t perf_usec(void);
+
+void	 perf_startup_begin(void);
+void	 perf_startup(const char *);
+void	 perf_startup_report(FILE *);
+int	 perf_frame_log(const char *);
+void	 perf_frame(const struct perf_frame *);
+void	 perf_input(void);
+void	 perf_paint(void);
+void	 perf_report(FILE *, const uint64_t *);
+void	 perf_about(struct tab *);
+void	 perf_about_done(struct tab *, const uint64_t *);
+
+#endif
@@ -0,0 +1,455 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * The persist process does the writes of the session, the history
+ * and the known hosts for the ui, which only has to format them in
+ * memory and hand them over: on a slow disk or a network mount the
+ * fsyncs and renames no longer stall the input.
+ *
+ * The messages are handled in order: a file is opened, written and
+ * closed, so the ordering of the writes the ui relies upon is kept.
+ * Replaced files are synced before being renamed in place, while the
+ * appends are synced in batch once all the pending messages have been
+ * handled.
+ */
+
+#include "compat.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ev.h"
+#include "imsgev.h"
+#include "persist.h"
+#include "telescope.h"
+#include "utils.h"
+#include "xwrapper.h"
+
+#define PERSIST_CHUNK	(MAX_IMSGSIZE - IMSG_HEADER_SIZE)
+
+static struct imsgev	*iev_ui;
+
+/* the file being written */
+static struct {
+	FILE	*fp;
+	int	 mode;
+	int	 err;
+	char	 path[PATH_MAX];
+	char	 tmp[PATH_MAX];
+
+	/* the new lines, for PERSIST_COMPACT */
+	char	*buf;
+	size_t	 len;
+	size_t	 cap;
+} cur;
+
+/* the appended files still to sync */
+static int	*syncfds;
+static size_t	 nsync;
+static size_t	 synccap;
+
+static void __attribute__((__noreturn__))
+die(void)
+{
+	abort(); 		/* TODO */
+}
+
+int
+persist_open(struct pfile *pf, const char *path, const char *tmp, int mode)
+{
+	memset(pf, 0, sizeof(*pf));
+	pf->mode = mode;
+	strlcpy(pf->path, path, sizeof(pf->path));
+	if (tmp != NULL)
+		strlcpy(pf->tmp, tmp, sizeof(pf->tmp));
+
+	if ((pf->fp = open_memstream(&pf->buf, &pf->len)) == NULL)
+		return -1;
+	return 0;
+}
+
+int
+persist_close(struct pfile *pf)
+{
+	struct persist_open	 po;
+	size_t			 off, n;
+	int			 err;
+
+	err = fclose(pf->fp) == EOF;
+	pf->fp = NULL;
+	if (err) {
+		free(pf->buf);
+		pf->buf = NULL;
+		return -1;
+	}
+
+	memset(&po, 0, sizeof(po));
+	po.mode = pf->mode;
+	strlcpy(po.path, pf->path, sizeof(po.path));
+	strlcpy(po.tmp, pf->tmp, sizeof(po.tmp));
+
+	err = ui_send_persist(IMSG_PERSIST_OPEN, &po, sizeof(po)) == -1;
+	for (off = 0; !err && off < pf->len; off += n) {
+		n = MIN(pf->len - off, PERSIST_CHUNK);
+		err = ui_send_persist(IMSG_PERSIST_DATA, pf->buf + off,
+		    n) == -1;
+	}
+	if (!err)
+		err = ui_send_persist(IMSG_PERSIST_CLOSE, NULL, 0) == -1;
+
+	free(pf->buf);
+	pf->buf = NULL;
+	return err ? -1 : 0;
+}
+
+void
+persist_unlink(const char *path)
+{
+	ui_send_persist(IMSG_PERSIST_UNLINK, path, strlen(path) + 1);
+}
+
+static void
+persist_err(const char *path, int saved_errno)
+{
+	char	*str;
+
+	xasprintf(&str, "%s: %s", path, strerror(saved_errno));
+	imsg_compose_event(iev_ui, IMSG_PERSIST_ERR, 0, 0, -1, str,
+	    strlen(str) + 1);
+	free(str);
+}
+
+static void
+do_open(struct persist_open *po)
+{
+	int	 fd;
+
+	memset(&cur, 0, sizeof(cur));
+	cur.mode = po->mode;
+	strlcpy(cur.path, po->path, sizeof(cur.path));
+
+	if (cur.mode == PERSIST_APPEND) {
+		if ((fd = open(cur.path, O_WRONLY|O_APPEND|O_CREAT|O_CLOEXEC,
+		    0600)) == -1 || (cur.fp = fdopen(fd, "a")) == NULL) {
+			cur.err = errno;
+			if (fd != -1)
+				close(fd);
+		}
+		return;
+	}
+
+	strlcpy(cur.tmp, po->tmp, sizeof(cur.tmp));
+	if ((fd = mkstemp(cur.tmp)) == -1 ||
+	    (cur.fp = fdopen(fd, "w")) == NULL) {
+		cur.err = errno;
+		if (fd != -1) {
+			unlink(cur.tmp);
+			close(fd);
+		}
+	}
+}
+
+static void
+do_data(const void *data, size_t len)
+{
+	if (cur.fp == NULL || cur.err)
+		return;
+
+	if (cur.mode != PERSIST_COMPACT) {
+		if (fwrite(data, 1, len, cur.fp) != len)
+			cur.err = errno;
+		return;
+	}
+
+	if (cur.len + len > cur.cap) {
+		cur.cap = (cur.len + len) * 2;
+		cur.buf = xrealloc(cur.buf, cur.cap);
+	}
+	memcpy(cur.buf + cur.len, data, len);
+	cur.len += len;
+}
+
+struct ckey {
+	size_t	 last;		/* the line that wins */
+	char	 key[];
+};
+
+/* the key of a line is its first field */
+static size_t
+line_key(const char *line, size_t len)
+{
+	const char	*sp;
+
+	if ((sp = memchr(line, ' ', len)) == NULL)
+		return len;
+	return sp - line;
+}
+
+static void
+write_compacted(const char *buf, size_t len)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct ckey, key),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+	struct ohash	 h;
+	struct ckey	*k;
+	const char	*p, *nl, *end = buf + len;
+	const char	*kend;
+	unsigned int	 slot;
+	size_t		 i, klen;
+	int		 pass;
+
+	ohash_init(&h, 10, &info);
+
+	for (pass = 0; pass < 2; ++pass) {
+		for (i = 0, p = buf; p < end; p = nl + 1, ++i) {
+			if ((nl = memchr(p, '\n', end - p)) == NULL)
+				nl = end;
+			klen = line_key(p, nl - p);
+			kend = p + klen;
+			slot = ohash_qlookupi(&h, p, &kend);
+			k = ohash_find(&h, slot);
+
+			if (pass == 1) {
+				if (k->last == i) {
+					fwrite(p, 1, nl - p, cur.fp);
+					fputc('\n', cur.fp);
+				}
+				continue;
+			}
+
+			if (k == NULL) {
+				k = xmalloc(sizeof(*k) + klen + 1);
+				memcpy(k->key, p, klen);
+				k->key[klen] = '\0';
+				ohash_insert(&h, slot, k);
+			}
+			k->last = i;
+		}
+	}
+
+	for (k = ohash_first(&h, &slot); k != NULL; k = ohash_next(&h, &slot))
+		free(k);
+	ohash_delete(&h);
+}
+
+/*
+ * Rewrite the old file with the new lines, keeping only the last line
+ * for every key.
+ */
+static int
+compact(void)
+{
+	FILE	*fp, *mem;
+	char	*buf = NULL, *line = NULL;
+	size_t	 len = 0, linesize = 0;
+	ssize_t	 linelen;
+
+	if ((mem = open_memstream(&buf, &len)) == NULL)
+		return -1;
+
+	if ((fp = fopen(cur.path, "r")) == NULL && errno != ENOENT) {
+		fclose(mem);
+		free(buf);
+		return -1;
+	}
+
+	while (fp != NULL && (linelen = getline(&line, &linesize, fp)) != -1) {
+		fputs(line, mem);
+		if (line[linelen - 1] != '\n')
+			fputc('\n', mem);
+	}
+	free(line);
+	if (fp != NULL)
+		fclose(fp);
+
+	fwrite(cur.buf, 1, cur.len, mem);
+	if (fclose(mem) == EOF) {
+		free(buf);
+		return -1;
+	}
+
+	write_compacted(buf, len);
+	free(buf);
+	return 0;
+}
+
+static void
+do_close(void)
+{
+	int	 fd;
+
+	if (cur.fp == NULL)
+		goto err;
+
+	if (cur.mode == PERSIST_COMPACT && !cur.err && compact() == -1)
+		cur.err = errno;
+
+	if (fflush(cur.fp) == EOF && !cur.err)
+		cur.err = errno;
+
+	if (cur.mode == PERSIST_APPEND) {
+		/* synced and closed once the queue is drained */
+		if ((fd = dup(fileno(cur.fp))) != -1) {
+			if (nsync == synccap) {
+				synccap = synccap == 0 ? 8 : synccap * 2;
+				syncfds = xreallocarray(syncfds, synccap,
+				    sizeof(*syncfds));
+			}
+			syncfds[nsync++] = fd;
+		}
+		fclose(cur.fp);
+		goto err;
+	}
+
+	if (!cur.err && fsync(fileno(cur.fp)) == -1)
+		cur.err = errno;
+	if (fclose(cur.fp) == EOF && !cur.err)
+		cur.err = errno;
+	if (!cur.err && rename(cur.tmp, cur.path) == -1)
+		cur.err = errno;
+	if (cur.err)
+		unlink(cur.tmp);
+
+ err:
+	if (cur.err)
+		persist_err(cur.path, cur.err);
+	free(cur.buf);
+	memset(&cur, 0, sizeof(cur));
+}
+
+static void
+sync_appended(void)
+{
+	size_t	 i;
+
+	for (i = 0; i < nsync; ++i) {
+		fsync(syncfds[i]);
+		close(syncfds[i]);
+	}
+	nsync = 0;
+}
+
+static void
+handle_dispatch_imsg(int fd, int event, void *d)
+{
+	struct imsgev		*iev = d;
+	struct imsgbuf		*ibuf = &iev->ibuf;
+	struct imsg		 imsg;
+	struct persist_open	 po;
+	struct ibuf		 data;
+	char			*path;
+	ssize_t			 n;
+
+	if (event & EV_READ) {
+		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+			err(1, "imsg_read");
+		if (n == 0)
+			err(1, "connection closed");
+	}
+	if (event & EV_WRITE) {
+		if ((n = msgbuf_write(&ibuf->w)) == -1 && errno != EAGAIN)
+			err(1, "msgbuf_write");
+		if (n == 0)
+			err(1, "connection closed");
+	}
+
+	for (;;) {
+		if ((n = imsg_get(ibuf, &imsg)) == -1)
+			err(1, "imsg_get");
+		if (n == 0)
+			break;
+
+		switch (imsg_get_type(&imsg)) {
+		case IMSG_PERSIST_OPEN:
+			if (imsg_get_data(&imsg, &po, sizeof(po)) == -1)
+				die();
+			po.path[sizeof(po.path) - 1] = '\0';
+			po.tmp[sizeof(po.tmp) - 1] = '\0';
+			do_open(&po);
+			break;
+
+		case IMSG_PERSIST_DATA:
+			if (imsg_get_ibuf(&imsg, &data) == -1)
+				die();
+			do_data(ibuf_data(&data), ibuf_size(&data));
+			break;
+
+		case IMSG_PERSIST_CLOSE:
+			do_close();
+			break;
+
+		case IMSG_PERSIST_UNLINK:
+			if (imsg_get_ibuf(&imsg, &data) == -1 ||
+			    ibuf_borrow_str(&data, &path) == -1)
+				die();
+			if (unlink(path) == -1 && errno != ENOENT)
+				persist_err(path, errno);
+			break;
+
+		case IMSG_QUIT:
+			sync_appended();
+			ev_break();
+			imsg_free(&imsg);
+			return;
+
+		default:
+			errx(1, "got unknown imsg %d", imsg_get_type(&imsg));
+		}
+
+		imsg_free(&imsg);
+	}
+
+	sync_appended();
+	imsg_event_add(iev);
+}
+
+int
+persist_main(void)
+{
+	setproctitle("persist");
+
+	if (ev_init() == -1)
+		exit(1);
+
+	/* Setup pipe and event handler to the main process */
+	iev_ui = xmalloc(sizeof(*iev_ui));
+	imsg_init(&iev_ui->ibuf, 3);
+	iev_ui->handler = handle_dispatch_imsg;
+	iev_ui->events = EV_READ;
+	ev_add(iev_ui->ibuf.fd, iev_ui->events, iev_ui->handler, iev_ui);
+
+	sandbox_persist_process();
+
+	ev_loop();
+
+	imsg_flush(&iev_ui->ibuf);
+	msgbuf_clear(&iev_ui->ibuf.w);
+	close(iev_ui->ibuf.fd);
+	free(iev_ui);
+
+	return 0;
+}
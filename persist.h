@@ -0,0 +1,42 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+struct pfile {
+	FILE	*fp;
+	char	*buf;
+	size_t	 len;
+	int	 mode;
+	char	 path[PATH_MAX];
+	char	 tmp[PATH_MAX];
+};
+
+#define PERSIST_REPLACE	0	/* write a temp file and rename it */
+#define PERSIST_APPEND	1
+#define PERSIST_COMPACT	2	/* keep only the last line of every key */
+
+struct persist_open {
+	int	 mode;
+	char	 path[PATH_MAX];
+	char	 tmp[PATH_MAX];	/* template for mkstemp */
+};
+
+/* ui side */
+int	 persist_open(struct pfile *, const char *, const char *, int);
+int	 persist_close(struct pfile *);
+void	 persist_unlink(const char *);
+
+/* the persist process */
+int	 persist_main(void);
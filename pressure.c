@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * When the ui process grows past memory-limit it gives memory back,
+ * from what's cheapest to get again to what's dearest, and stops as
+ * soon as it's under the limit: the least recently used pages of the
+ * mcache, the least recently shown tabs, hibernated, the closed tabs
+ * and at last what malloc keeps for itself.
+ *
+ * The size is checked every PRESSURE_INTERVAL seconds.  On Linux it's
+ * the resident size, read from /proc/self/statm, opened before the
+ * sandbox is entered; elsewhere it's what about:memory accounts for.
+ */
+
+#include "compat.h"
+
+#include <sys/time.h>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if HAVE_MALLOC_TRIM
+#include <malloc.h>
+#endif
+
+#include "defaults.h"
+#include "ev.h"
+#include "mcache.h"
+#include "memory.h"
+#include "minibuffer.h"
+#include "pressure.h"
+#include "session.h"
+
+#define PRESSURE_INTERVAL	10
+
+static struct ohash	*certs;
+static int		 statm = -1;
+static size_t		 pagesize;
+
+static void	pressure_timer(int, int, void *);
+
+static size_t
+pressure_usage(void)
+{
+	char		 buf[128], *sp;
+	ssize_t		 r;
+	size_t		 resident;
+
+	if (statm != -1 &&
+	    (r = pread(statm, buf, sizeof(buf) - 1, 0)) > 0) {
+		buf[r] = '\0';
+		/* the total size, then the resident one, in pages */
+		if ((sp = strchr(buf, ' ')) != NULL &&
+		    sscanf(sp, "%zu", &resident) == 1)
+			return resident * pagesize;
+	}
+
+	return memory_accounted(certs);
+}
+
+static void
+pressure_shed(size_t over)
+{
+	size_t		 cache, tabs, killed;
+	int		 ntabs, nkilled;
+	char		 a[FMT_SCALED_STRSIZE], b[FMT_SCALED_STRSIZE];
+	char		 c[FMT_SCALED_STRSIZE];
+
+	cache = mcache_shrink(over);
+	over -= MIN(over, cache);
+
+	tabs = hibernate_lru(over, &ntabs);
+	over -= MIN(over, tabs);
+
+	killed = drop_killed_tabs(over, &nkilled);
+
+	if (cache == 0 && tabs == 0 && killed == 0)
+		return;
+
+#if HAVE_MALLOC_TRIM
+	malloc_trim(0);
+#endif
+
+	if (fmt_scaled(cache, a) == -1)
+		snprintf(a, sizeof(a), "%zu", cache);
+	if (fmt_scaled(tabs, b) == -1)
+		snprintf(b, sizeof(b), "%zu", tabs);
+	if (fmt_scaled(killed, c) == -1)
+		snprintf(c, sizeof(c), "%zu", killed);
+	message("Low on memory, freed: %s of cache, %s in %d tabs, %s in %d"
+	    " closed tabs", a, b, ntabs, c, nkilled);
+}
+
+static void
+pressure_schedule(void)
+{
+	struct timeval	 tv = { PRESSURE_INTERVAL, 0 };
+
+	if (memory_limit > 0)
+		ev_timer(&tv, pressure_timer, NULL);
+}
+
+static void
+pressure_timer(int fd, int event, void *data)
+{
+	size_t		 usage;
+
+	if ((usage = pressure_usage()) > (size_t)memory_limit)
+		pressure_shed(usage - memory_limit);
+	pressure_schedule();
+}
+
+/* to be called before the sandbox */
+void
+pressure_init(struct ohash *c)
+{
+	long		 ps;
+
+	certs = c;
+
+#ifdef __linux__
+	if ((ps = sysconf(_SC_PAGESIZE)) > 0 &&
+	    (statm = open("/proc/self/statm", O_RDONLY|O_CLOEXEC)) != -1)
+		pagesize = ps;
+#else
+	(void)ps;
+#endif
+
+	ev_name(pressure_timer, "memory pressure");
+	pressure_schedule();
+}
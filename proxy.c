@@ -0,0 +1,158 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * Choose among the proxies configured for a scheme.  Every proxy
+ * keeps a moving average of the time needed to connect to it and to
+ * get the first byte of the reply, and how often it failed recently.
+ * The healthiest one is used; one that fails is set aside for a while,
+ * longer the more it keeps failing, and the next best is tried.
+ */
+
+#include "compat.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "proxy.h"
+#include "telescope.h"
+
+#define PROXY_DOWN_MIN	5	/* seconds */
+#define PROXY_DOWN_MAX	300
+#define PROXY_WINDOW	64	/* requests before the counts decay */
+
+static inline uint64_t
+ewma(uint64_t avg, uint64_t sample)
+{
+	if (avg == 0)
+		return sample;
+	return (avg * 7 + sample) / 8;
+}
+
+static void
+decay(struct proxy *p)
+{
+	if (p->ok + p->failed < PROXY_WINDOW)
+		return;
+	p->ok /= 2;
+	p->failed /= 2;
+}
+
+/*
+ * The expected latency inflated by the recent failure rate.  Proxies
+ * never used score zero so they get measured first.
+ */
+static uint64_t
+score(const struct proxy *p)
+{
+	return (p->connect + p->ttfb) * (p->ok + p->failed + 1) /
+	    (p->ok + 1);
+}
+
+int
+proxy_down(const struct proxy *p)
+{
+	return p->down_until > time(NULL);
+}
+
+/*
+ * Return the best proxy for the scheme other than skip.  When all of
+ * them are set aside, the one that comes back first is returned.
+ */
+struct proxy *
+proxy_pick(const char *scheme, const struct proxy *skip)
+{
+	struct proxy	*p, *best = NULL;
+	int		 down, bestdown = 0;
+
+	TAILQ_FOREACH(p, &proxies, proxies) {
+		if (p == skip || strcmp(scheme, p->match_proto) != 0)
+			continue;
+
+		down = proxy_down(p);
+		if (best == NULL ||
+		    (bestdown && !down) ||
+		    (bestdown && down && p->down_until < best->down_until) ||
+		    (!bestdown && !down && score(p) < score(best))) {
+			best = p;
+			bestdown = down;
+		}
+	}
+
+	return best;
+}
+
+void
+proxy_done(struct proxy *p, const struct req_timing *t)
+{
+	const uint64_t	*v = t->t;
+
+	decay(p);
+	p->ok++;
+	p->streak = 0;
+	p->down_until = 0;
+
+	if (v[TIMING_CONNECTED] >= v[TIMING_STARTED])
+		p->connect = ewma(p->connect,
+		    v[TIMING_CONNECTED] - v[TIMING_STARTED]);
+	if (v[TIMING_FIRST_BYTE] >= v[TIMING_CONNECTED])
+		p->ttfb = ewma(p->ttfb,
+		    v[TIMING_FIRST_BYTE] - v[TIMING_CONNECTED]);
+}
+
+void
+proxy_failed(struct proxy *p)
+{
+	int	 secs;
+
+	decay(p);
+	p->failed++;
+	if (p->streak < 16)
+		p->streak++;
+
+	secs = PROXY_DOWN_MIN << (p->streak - 1);
+	if (secs > PROXY_DOWN_MAX)
+		secs = PROXY_DOWN_MAX;
+	p->down_until = time(NULL) + secs;
+}
+
+void
+proxy_report(FILE *fp)
+{
+	struct proxy	*p;
+	time_t		 now;
+
+	if (TAILQ_EMPTY(&proxies))
+		return;
+
+	now = time(NULL);
+	fprintf(fp, "## Proxies\n\n```\n");
+	fprintf(fp, "%-8s %-30s %10s %10s %6s %6s %s\n", "scheme", "proxy",
+	    "connect ms", "ttfb ms", "ok", "failed", "state");
+	TAILQ_FOREACH(p, &proxies, proxies) {
+		fprintf(fp, "%-8s %-24.24s:%-5.5s %10.1f %10.1f %6u %6u ",
+		    p->match_proto, p->host, p->port, p->connect / 1e3,
+		    p->ttfb / 1e3, p->ok, p->failed);
+		if (p->down_until > now)
+			fprintf(fp, "down for %llds\n",
+			    (long long)(p->down_until - now));
+		else
+			fprintf(fp, "up\n");
+	}
+	fprintf(fp, "```\n\n");
+}
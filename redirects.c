@@ -0,0 +1,286 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Redirects seen recently, so that following a link that redirected
+ * last time goes straight to the target instead of paying for another
+ * connection just to learn where to go.  The permanent ones (31) are
+ * kept for redirect-cache-ttl seconds and saved in the cache dir, the
+ * temporary ones (30) only in memory for a minute at most.
+ *
+ * The file is only appended to; it's rewritten from the table once
+ * most of its lines are stale.
+ */
+
+#include "compat.h"
+
+#include <limits.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "defaults.h"
+#include "fs.h"
+#include "persist.h"
+#include "redirects.h"
+#include "telescope.h"
+#include "utils.h"
+#include "xwrapper.h"
+
+#define REDIRECTS_MAX		1024
+#define REDIRECT_TEMP_TTL	60
+#define REDIRECTS_COMPACT_MIN	64
+
+struct redirect {
+	char		*to;
+	time_t		 expires;
+	int		 permanent;
+	char		 from[];
+};
+
+static struct ohash	 redirects;
+static int		 initialized;
+static size_t		 records;	/* lines in the file */
+
+static void
+redirects_init(void)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct redirect, from),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	ohash_init(&redirects, 6, &info);
+	initialized = 1;
+}
+
+static void
+redirect_remove(unsigned int slot)
+{
+	struct redirect	*r;
+
+	if ((r = ohash_remove(&redirects, slot)) == NULL)
+		return;
+	free(r->to);
+	free(r);
+}
+
+/* drop the expired entries, or the one closest to expire if none is */
+static void
+redirects_evict(void)
+{
+	struct redirect	*r, *victim = NULL;
+	unsigned int	 i;
+	time_t		 now;
+	int		 n = 0;
+
+	now = time(NULL);
+	for (r = ohash_first(&redirects, &i); r != NULL;
+	    r = ohash_next(&redirects, &i)) {
+		if (r->expires <= now) {
+			redirect_remove(ohash_qlookup(&redirects, r->from));
+			n++;
+		} else if (victim == NULL || r->expires < victim->expires)
+			victim = r;
+	}
+
+	if (n == 0 && victim != NULL)
+		redirect_remove(ohash_qlookup(&redirects, victim->from));
+}
+
+static struct redirect *
+redirect_set(const char *from, const char *to, time_t expires,
+    int permanent)
+{
+	struct redirect	*r;
+	unsigned int	 slot;
+	size_t		 len;
+
+	if (!initialized)
+		redirects_init();
+
+	slot = ohash_qlookup(&redirects, from);
+	if ((r = ohash_find(&redirects, slot)) == NULL) {
+		if (ohash_entries(&redirects) >= REDIRECTS_MAX) {
+			redirects_evict();
+			slot = ohash_qlookup(&redirects, from);
+		}
+		len = strlen(from) + 1;
+		r = xcalloc(1, sizeof(*r) + len);
+		memcpy(r->from, from, len);
+		ohash_insert(&redirects, slot, r);
+	}
+
+	free(r->to);
+	r->to = xstrdup(to);
+	r->expires = expires;
+	r->permanent = permanent;
+	return r;
+}
+
+/* rewrite the file with the permanent entries still valid */
+static void
+redirects_save(void)
+{
+	struct pfile	 pf;
+	struct redirect	*r;
+	unsigned int	 i;
+	time_t		 now;
+
+	if (persist_open(&pf, redirects_file, redirects_file_tmp,
+	    PERSIST_REPLACE) == -1)
+		return;
+
+	records = 0;
+	now = time(NULL);
+	for (r = ohash_first(&redirects, &i); r != NULL;
+	    r = ohash_next(&redirects, &i)) {
+		if (!r->permanent || r->expires <= now)
+			continue;
+		fprintf(pf.fp, "%s %s %lld\n", r->from, r->to,
+		    (long long)r->expires);
+		records++;
+	}
+	persist_close(&pf);
+}
+
+void
+redirects_load(void)
+{
+	FILE		*fp;
+	size_t		 linesize = 0;
+	ssize_t		 linelen;
+	char		*line = NULL, *to, *exp;
+	const char	*errstr;
+	time_t		 now, expires;
+
+	if ((fp = fopen(redirects_file, "r")) == NULL)
+		return;
+
+	now = time(NULL);
+	while ((linelen = getline(&line, &linesize, fp)) != -1) {
+		records++;
+		if (line[linelen - 1] == '\n')
+			line[linelen - 1] = '\0';
+		if ((to = strchr(line, ' ')) == NULL)
+			continue;
+		*to++ = '\0';
+		if ((exp = strchr(to, ' ')) == NULL)
+			continue;
+		*exp++ = '\0';
+
+		expires = strtonum(exp, 0, INT64_MAX, &errstr);
+		if (errstr != NULL)
+			continue;
+
+		/* the last line for an URL wins, "-" means forgotten */
+		if (!strcmp(to, "-"))
+			redirect_forget(line);
+		else if (expires > now)
+			redirect_set(line, to, expires, 1);
+	}
+
+	fclose(fp);
+	free(line);
+}
+
+/*
+ * Remember that from redirected to to, which must be already
+ * resolved against from.
+ */
+void
+redirect_add(const char *from, const char *to, int permanent)
+{
+	struct pfile	 pf;
+	struct redirect	*r;
+	time_t		 ttl;
+
+	if (redirect_cache_ttl <= 0 || !strcmp(from, to))
+		return;
+
+	ttl = redirect_cache_ttl;
+	if (!permanent)
+		ttl = MIN(ttl, REDIRECT_TEMP_TTL);
+	r = redirect_set(from, to, time(NULL) + ttl, permanent);
+
+	if (!permanent || safe_mode)
+		return;
+
+	if (records >= REDIRECTS_COMPACT_MIN &&
+	    records >= 2 * ohash_entries(&redirects)) {
+		redirects_save();
+		return;
+	}
+
+	if (persist_open(&pf, redirects_file, NULL, PERSIST_APPEND) == -1)
+		return;
+	fprintf(pf.fp, "%s %s %lld\n", r->from, r->to,
+	    (long long)r->expires);
+	persist_close(&pf);
+	records++;
+}
+
+/* the target of the redirect from url, or NULL */
+const char *
+redirect_lookup(const char *url)
+{
+	struct redirect	*r;
+	unsigned int	 slot;
+
+	if (!initialized || redirect_cache_ttl <= 0)
+		return NULL;
+
+	slot = ohash_qlookup(&redirects, url);
+	if ((r = ohash_find(&redirects, slot)) == NULL)
+		return NULL;
+	if (r->expires <= time(NULL)) {
+		redirect_remove(slot);
+		return NULL;
+	}
+	return r->to;
+}
+
+/* drop the redirect from url, e.g. the target is not there anymore */
+void
+redirect_forget(const char *url)
+{
+	struct pfile	 pf;
+	struct redirect	*r;
+	unsigned int	 slot;
+	int		 permanent;
+
+	if (!initialized)
+		return;
+
+	slot = ohash_qlookup(&redirects, url);
+	if ((r = ohash_find(&redirects, slot)) == NULL)
+		return;
+	permanent = r->permanent;
+	redirect_remove(slot);
+
+	if (!permanent || safe_mode || !operating)
+		return;
+
+	if (persist_open(&pf, redirects_file, NULL, PERSIST_APPEND) == -1)
+		return;
+	fprintf(pf.fp, "%s - %lld\n", url, (long long)time(NULL) + 1);
+	persist_close(&pf);
+	records++;
+}
@@ -36,6 +36,13 @@ sandbox_net_process(void)
 		err(1, "pledge");
 }
 
+void
+sandbox_persist_process(void)
+{
+	if (pledge("stdio rpath wpath cpath", NULL) == -1)
+		err(1, "pledge");
+}
+
 void
 sandbox_ui_process(void)
 {
@@ -260,6 +267,16 @@ sandbox_net_process(void)
 		err(1, "landlock_unveil(NULL, NULL)");
 }
 
+void
+sandbox_persist_process(void)
+{
+	/*
+	 * Writes to the cache and data directories, which landlock_unveil
+	 * can't express yet.
+	 */
+	return;
+}
+
 void
 sandbox_ui_process(void)
 {
@@ -278,6 +295,12 @@ sandbox_net_process(void)
 	return;
 }
 
+void
+sandbox_persist_process(void)
+{
+	return;
+}
+
 void
 sandbox_ui_process(void)
 {
@@ -0,0 +1,416 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Substring search over the lines of a buffer, for isearch.  All the
+ * matches, overlapping ones too, are kept in document order together
+ * with the vline they start in, and the first match of every line is
+ * indexed by the line, so that moving to the next match and finding
+ * what to highlight in a row are both O(1).
+ *
+ * When the query grows the new matches can only start where the old
+ * ones did, so they're found by checking the old positions instead
+ * of scanning the buffer again.  Queries without uppercase letters
+ * are matched ignoring the (ASCII) case.
+ */
+
+#include "compat.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+#include "telescope.h"
+#include "utils.h"
+#include "xwrapper.h"
+
+struct search {
+	char			*needle;
+	size_t			 len;
+	size_t			 cap;
+	int			 fold;
+
+	/* what the matches refer to, to notice a rewrap */
+	struct buffer		*buffer;
+	struct vline		*vlines;
+	size_t			 vlines_len;
+
+	struct search_match	*matches;
+	size_t			 nmatches;
+	size_t			 matchcap;
+
+	/* the first match of every line */
+	struct ohash		 lines;
+};
+
+static inline int
+lower(int c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 'a';
+	return c;
+}
+
+static inline int
+upper(int c)
+{
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 'A';
+	return c;
+}
+
+/*
+ * Compare the needle with the text at h, which is NUL-terminated:
+ * the needle has no NUL so the match can't run over the end.
+ */
+static inline int
+match_at(const char *h, const char *n, size_t nlen, int fold)
+{
+	size_t	 i;
+
+	if (!fold)
+		return strncmp(h, n, nlen) == 0;
+
+	for (i = 0; i < nlen; ++i)
+		if (lower((unsigned char)h[i]) != (unsigned char)n[i])
+			return 0;
+	return 1;
+}
+
+/*
+ * Find the needle in the first hlen bytes of hay.  Without folding
+ * this is memmem, two-way both in the libc and in compat/.  With it,
+ * the candidate positions are found with memchr on the two cases of
+ * the first character of the needle, expected to be already folded.
+ */
+const char *
+search_mem(const char *hay, size_t hlen, const char *needle, size_t nlen,
+    int fold)
+{
+	const char	*end, *lo, *up, *p;
+	int		 c;
+
+	if (nlen == 0 || nlen > hlen)
+		return NULL;
+
+	if (!fold)
+		return memmem(hay, hlen, needle, nlen);
+
+	c = (unsigned char)*needle;
+	end = hay + hlen - nlen + 1;
+	lo = memchr(hay, c, end - hay);
+	up = NULL;
+	if (upper(c) != c)
+		up = memchr(hay, upper(c), end - hay);
+
+	for (;;) {
+		if (lo != NULL && (up == NULL || lo < up))
+			p = lo;
+		else if (up != NULL)
+			p = up;
+		else
+			return NULL;
+
+		if (match_at(p + 1, needle + 1, nlen - 1, fold))
+			return p;
+
+		if (p == lo)
+			lo = memchr(p + 1, c, end - p - 1);
+		else
+			up = memchr(p + 1, upper(c), end - p - 1);
+	}
+}
+
+struct search *
+search_new(void)
+{
+	struct search	*s;
+	struct ohash_info info = {
+		.key_offset = offsetof(struct search_match, line),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	s = xcalloc(1, sizeof(*s));
+	ohash_init(&s->lines, 5, &info);
+	return s;
+}
+
+void
+search_free(struct search *s)
+{
+	if (s == NULL)
+		return;
+
+	ohash_delete(&s->lines);
+	free(s->needle);
+	free(s->matches);
+	free(s);
+}
+
+static inline uint32_t
+line_hash(const struct line *l)
+{
+	return fnv1a(FNV1A_INIT, &l, sizeof(l));
+}
+
+static void
+index_lines(struct search *s)
+{
+	struct search_match	*m;
+	struct ohash_info	 info;
+	struct line		*prev = NULL;
+	unsigned int		 slot;
+	size_t			 i;
+
+	info = s->lines.info;
+	ohash_delete(&s->lines);
+	ohash_init(&s->lines, 5, &info);
+
+	for (i = 0; i < s->nmatches; ++i) {
+		m = &s->matches[i];
+		if (m->line == prev)
+			continue;
+		prev = m->line;
+		slot = ohash_lookup_memory(&s->lines, (const char *)&m->line,
+		    sizeof(m->line), line_hash(m->line));
+		ohash_insert(&s->lines, slot, m);
+	}
+}
+
+void
+search_clear(struct search *s)
+{
+	s->len = 0;
+	s->buffer = NULL;
+	s->nmatches = 0;
+	index_lines(s);
+}
+
+static void
+add_match(struct search *s, struct line *l, size_t off, size_t vidx)
+{
+	size_t	 cap;
+
+	if (s->nmatches == s->matchcap) {
+		cap = s->matchcap * 1.5 + 64;
+		s->matches = xreallocarray(s->matches, cap,
+		    sizeof(*s->matches));
+		s->matchcap = cap;
+	}
+
+	s->matches[s->nmatches].line = l;
+	s->matches[s->nmatches].off = off;
+	s->matches[s->nmatches].vidx = vidx;
+	s->nmatches++;
+}
+
+static void
+scan(struct search *s, struct buffer *b)
+{
+	struct vline	*vl;
+	struct line	*l;
+	const char	*hay, *p;
+	size_t		 i, j, off, hlen;
+
+	s->nmatches = 0;
+	for (i = 0; i < b->vlines_len; ++i) {
+		vl = &b->vlines[i];
+		l = vl->parent;
+		if (vl->flags & L_CONTINUATION || l->line == NULL ||
+		    l->flags & L_HIDDEN)
+			continue;
+
+		j = i;
+		hay = l->line;
+		hlen = strlen(hay);
+		for (p = hay; (p = search_mem(p, hlen - (p - hay), s->needle,
+		    s->len, s->fold)) != NULL; p++) {
+			off = p - hay;
+
+			/* the emoji of a link is not part of the text */
+			if (off < vl->from)
+				continue;
+
+			while (j + 1 < b->vlines_len &&
+			    b->vlines[j + 1].parent == l &&
+			    b->vlines[j + 1].from <= off)
+				j++;
+			add_match(s, l, off, j);
+		}
+	}
+}
+
+static void
+narrow(struct search *s)
+{
+	struct search_match	*m;
+	size_t			 i, n = 0;
+
+	for (i = 0; i < s->nmatches; ++i) {
+		m = &s->matches[i];
+		if (match_at(m->line->line + m->off, s->needle, s->len,
+		    s->fold))
+			s->matches[n++] = *m;
+	}
+	s->nmatches = n;
+}
+
+/*
+ * Search the query in the buffer and return the number of matches.
+ * It's cheap to call again with the same arguments: the buffer is
+ * scanned only if it changed or if the query isn't an extension of
+ * the previous one.
+ */
+size_t
+search_set(struct search *s, struct buffer *b, const char *query)
+{
+	const char	*q;
+	size_t		 len;
+	int		 fold, stale;
+
+	len = strlen(query);
+	if (len == 0) {
+		search_clear(s);
+		return 0;
+	}
+
+	fold = 1;
+	for (q = query; *q != '\0'; ++q)
+		if (*q >= 'A' && *q <= 'Z')
+			fold = 0;
+
+	stale = s->buffer != b || s->vlines != b->vlines ||
+	    s->vlines_len != b->vlines_len;
+
+	if (!stale && len == s->len && !strcmp(query, s->needle))
+		return s->nmatches;
+
+	if (s->cap < len + 1) {
+		s->cap = len + 1;
+		s->needle = xrealloc(s->needle, s->cap);
+	}
+
+	/*
+	 * The old matches are a superset of the new ones even when
+	 * the query stopped being case-insensitive.
+	 */
+	if (!stale && s->len != 0 && len > s->len &&
+	    !strncmp(query, s->needle, s->len)) {
+		memcpy(s->needle, query, len + 1);
+		s->len = len;
+		s->fold = fold;
+		narrow(s);
+	} else {
+		memcpy(s->needle, query, len + 1);
+		s->len = len;
+		s->fold = fold;
+		s->buffer = b;
+		s->vlines = b->vlines;
+		s->vlines_len = b->vlines_len;
+		scan(s, b);
+	}
+
+	index_lines(s);
+	return s->nmatches;
+}
+
+size_t
+search_len(struct search *s)
+{
+	return s->len;
+}
+
+size_t
+search_count(struct search *s)
+{
+	return s->nmatches;
+}
+
+const struct search_match *
+search_nth(struct search *s, size_t n)
+{
+	if (n >= s->nmatches)
+		return NULL;
+	return &s->matches[n];
+}
+
+static inline int
+before(const struct search_match *m, size_t vidx, size_t off)
+{
+	return m->vidx < vidx || (m->vidx == vidx && m->off < off);
+}
+
+/*
+ * Return the index of the first match at or after the position given
+ * by the vline index and the offset in the line, or of the last one
+ * at or before it if backward is set.  Return the number of matches
+ * if there's none.
+ */
+size_t
+search_nearest(struct search *s, size_t vidx, size_t off, int backward)
+{
+	size_t	 lo = 0, hi = s->nmatches, mid;
+
+	/* first match not before the position */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (before(&s->matches[mid], vidx, off))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (!backward)
+		return lo;
+
+	if (lo < s->nmatches && s->matches[lo].vidx == vidx &&
+	    s->matches[lo].off == off)
+		return lo;
+	if (lo == 0)
+		return s->nmatches;
+	return lo - 1;
+}
+
+/*
+ * Set *ret to the matches in the given line and return how many they
+ * are.  Nothing matches if the buffer was changed since the search.
+ */
+size_t
+search_line(struct search *s, const struct line *l,
+    const struct search_match **ret)
+{
+	const struct search_match *m, *end;
+	unsigned int	 slot;
+
+	if (s->nmatches == 0 || s->vlines != s->buffer->vlines ||
+	    s->vlines_len != s->buffer->vlines_len)
+		return 0;
+
+	slot = ohash_lookup_memory(&s->lines, (const char *)&l, sizeof(l),
+	    line_hash(l));
+	if ((m = ohash_find(&s->lines, slot)) == NULL)
+		return 0;
+
+	*ret = m;
+	end = s->matches + s->nmatches;
+	while (m < end && m->line == l)
+		m++;
+	return m - *ret;
+}
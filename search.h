@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+struct buffer;
+struct line;
+struct search;
+
+struct search_match {
+	struct line	*line;
+	size_t		 off;		/* in line->line */
+	size_t		 vidx;		/* the vline where it starts */
+};
+
+struct search	*search_new(void);
+void		 search_free(struct search *);
+void		 search_clear(struct search *);
+size_t		 search_set(struct search *, struct buffer *, const char *);
+size_t		 search_len(struct search *);
+size_t		 search_count(struct search *);
+const struct search_match *search_nth(struct search *, size_t);
+size_t		 search_nearest(struct search *, size_t, size_t, int);
+size_t		 search_line(struct search *, const struct line *,
+		    const struct search_match **);
+
+const char	*search_mem(const char *, size_t, const char *, size_t, int);
@@ -16,41 +16,93 @@
 
 #include "compat.h"
 
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/time.h>
 
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "arena.h"
 #include "defaults.h"
 #include "ev.h"
 #include "fs.h"
 #include "hist.h"
 #include "imsgev.h"
+#include "intern.h"
+#include "mcache.h"
 #include "minibuffer.h"
+#include "persist.h"
 #include "session.h"
 #include "tofu.h"
 #include "ui.h"
+#include "utils.h"
+#include "watch.h"
 #include "xwrapper.h"
 
 struct history	history;
 
+/* the history items by URI and by age */
+static struct ohash			histhash;
+static TAILQ_HEAD(, history_item)	histage;
+
 static unsigned int	 autosavetimer;
+static unsigned int	 autosaveidle;
+
+static void		 hibernate_schedule(void);
+static void		 hibernate_timer(int, int, void *);
 
 void
 switch_to_tab(struct tab *tab)
 {
+	int	 bg;
+
+	/* the net process sends bigger batches to hidden tabs */
+	if (current_tab != tab) {
+		bg = 1;
+		if (current_tab != NULL && current_tab->loading_anim)
+			ui_send_net(IMSG_BACKGROUND, current_tab->id, -1,
+			    &bg, sizeof(bg));
+		bg = 0;
+		if (tab->loading_anim)
+			ui_send_net(IMSG_BACKGROUND, tab->id, -1,
+			    &bg, sizeof(bg));
+	}
+
+	/* while restoring, keep the times read from the session */
+	if (operating && current_tab != NULL)
+		current_tab->active = time(NULL);
 	current_tab = tab;
+	tab->active = time(NULL);
 	tab->flags &= ~TAB_URGENT;
 
 	if (operating && tab->flags & TAB_LAZY)
 		load_url_in_tab(tab, hist_cur(tab->hist), NULL,
 		    LU_MODE_NOHIST);
+	else if (operating)
+		ui_on_tab_refresh(tab);	/* hidden tabs aren't wrapped */
+}
+
+/* the tabs in tabshead by id, the killed ones aren't there */
+static struct ohash	tabids;
+
+void
+tabs_init(void)
+{
+	idmap_init(&tabids, offsetof(struct tab, id));
+}
+
+struct tab *
+tab_by_id(uint32_t id)
+{
+	return idmap_get(&tabids, id);
 }
 
 unsigned int
@@ -61,8 +113,24 @@ tab_new_id(void)
 	return tab_counter++;
 }
 
-struct tab *
-new_tab(const char *url, const char *base, struct tab *after)
+/*
+ * Give the tab a new id, so that the replies to its old requests are
+ * not routed to it anymore.
+ */
+void
+tab_renew_id(struct tab *tab)
+{
+	int	 live;
+
+	live = tab_by_id(tab->id) == tab;
+	idmap_del(&tabids, tab->id, tab);
+	tab->id = tab_new_id();
+	if (live)
+		idmap_put(&tabids, tab->id, tab);
+}
+
+static struct tab *
+alloc_tab(struct tab *after)
 {
 	struct tab	*tab;
 
@@ -76,24 +144,294 @@ new_tab(const char *url, const char *base, struct tab *after)
 		ev_break();
 		return NULL;
 	}
+	hist_set_depth(tab->hist, max_tab_history);
 
 	TAILQ_INIT(&tab->buffer.head);
-	TAILQ_INIT(&tab->buffer.vhead);
 
 	tab->id = tab_new_id();
+	idmap_put(&tabids, tab->id, tab);
 
 	if (after != NULL)
 		TAILQ_INSERT_AFTER(&tabshead, after, tab, tabs);
 	else
 		TAILQ_INSERT_TAIL(&tabshead, tab, tabs);
+	return tab;
+}
+
+struct tab *
+new_tab(const char *url, const char *base, struct tab *after)
+{
+	struct tab	*tab;
+
+	if ((tab = alloc_tab(after)) == NULL)
+		return NULL;
 
 	if (!operating)
 		tab->flags |= TAB_LAZY;
-	load_url_in_tab(tab, url, base, 0);
+	/* switch first so the request is sent as a foreground one */
 	switch_to_tab(tab);
+	load_url_in_tab(tab, url, base, 0);
+	return tab;
+}
+
+/*
+ * Like new_tab, but the tab is only added at the end of the list and
+ * loaded when it's first switched to, as the ones of the session.
+ */
+struct tab *
+new_lazy_tab(const char *url)
+{
+	struct tab	*tab;
+
+	if ((tab = alloc_tab(NULL)) == NULL)
+		return NULL;
+
+	if (hist_push(tab->hist, url) == -1) {
+		ev_break();
+		return NULL;
+	}
+	strlcpy(tab->buffer.title, url, sizeof(tab->buffer.title));
+	tab->flags |= TAB_LAZY;
 	return tab;
 }
 
+/*
+ * The tabs not shown for hibernate_after minutes, and then the least
+ * recently shown ones while the hidden tabs take more than
+ * hibernate_budget bytes, release their buffer.  Only the URL, the
+ * title and the scroll position in the history are kept: the tab is
+ * marked lazy and so loaded again, from the mcache, by switch_to_tab.
+ */
+static int
+can_hibernate(struct tab *tab)
+{
+	const char	*url;
+
+	if (tab == current_tab || tab->flags & TAB_LAZY ||
+	    tab->loading_anim || (url = hist_cur(tab->hist)) == NULL)
+		return 0;
+
+	/* these are cheap to generate again */
+	if (!strncmp(url, "about:", 6) || !strncmp(url, "file:", 5))
+		return 1;
+
+	return mcache_has(url);
+}
+
+void
+hibernate_tab(struct tab *tab)
+{
+	size_t		 top_line, current_line;
+
+	get_scroll_position(tab, &top_line, &current_line);
+	hist_set_offs(tab->hist, top_line, current_line);
+	mcache_layout(tab);
+
+	release_buffer(&tab->buffer);
+	tab->flags |= TAB_LAZY;
+}
+
+/*
+ * The hidden tab holding the biggest buffer, only among those that
+ * can be hibernated if hibernatable is set.
+ */
+struct tab *
+heaviest_tab(int hibernatable)
+{
+	struct tab	*tab, *heaviest = NULL;
+	size_t		 size, max = 0;
+
+	TAILQ_FOREACH(tab, &tabshead, tabs) {
+		if (tab == current_tab || tab->flags & TAB_LAZY)
+			continue;
+		if (hibernatable && !can_hibernate(tab))
+			continue;
+		if ((size = buffer_memory(&tab->buffer, NULL)) > max) {
+			max = size;
+			heaviest = tab;
+		}
+	}
+
+	return heaviest;
+}
+
+static int
+tab_cmp_active(const void *a, const void *b)
+{
+	const struct tab	*ta = *(struct tab * const *)a;
+	const struct tab	*tb = *(struct tab * const *)b;
+
+	if (ta->active < tb->active)
+		return -1;
+	return ta->active > tb->active;
+}
+
+static void
+hibernate_tabs(void)
+{
+	struct tab	*tab, **tabs = NULL;
+	size_t		 i, n = 0, cap = 0, tot = 0;
+	time_t		 now;
+
+	now = time(NULL);
+	TAILQ_FOREACH(tab, &tabshead, tabs) {
+		if (!can_hibernate(tab))
+			continue;
+
+		if (hibernate_after > 0 &&
+		    now - tab->active >= (time_t)hibernate_after * 60) {
+			hibernate_tab(tab);
+			continue;
+		}
+
+		if (hibernate_budget <= 0)
+			continue;
+		if (n == cap) {
+			cap = cap == 0 ? 16 : cap * 2;
+			tabs = xreallocarray(tabs, cap, sizeof(*tabs));
+		}
+		tabs[n++] = tab;
+		tot += buffer_memory(&tab->buffer, NULL);
+	}
+
+	if (tot > (size_t)hibernate_budget) {
+		qsort(tabs, n, sizeof(*tabs), tab_cmp_active);
+		for (i = 0; i < n && tot > (size_t)hibernate_budget; ++i) {
+			tot -= buffer_memory(&tabs[i]->buffer, NULL);
+			hibernate_tab(tabs[i]);
+		}
+	}
+
+	free(tabs);
+}
+
+/*
+ * Hibernate the least recently shown tabs until at least want bytes
+ * are freed, parking their page in the mcache first if it's not
+ * there anymore and it's a complete one.  What the mcache grows by
+ * is not freed, so it's taken from the tally.  Returns what was
+ * freed and the tabs in *n.
+ */
+size_t
+hibernate_lru(size_t want, int *n)
+{
+	struct tab	*tab, **tabs = NULL;
+	const char	*url;
+	size_t		 i, ntabs = 0, cap = 0, freed = 0, size;
+	size_t		 npages, before, after, rawtot, parked = 0;
+
+	*n = 0;
+	TAILQ_FOREACH(tab, &tabshead, tabs) {
+		if (tab == current_tab || tab->flags & TAB_LAZY ||
+		    tab->loading_anim || hist_cur(tab->hist) == NULL)
+			continue;
+		if (ntabs == cap) {
+			cap = cap == 0 ? 16 : cap * 2;
+			tabs = xreallocarray(tabs, cap, sizeof(*tabs));
+		}
+		tabs[ntabs++] = tab;
+	}
+	if (ntabs != 0)
+		qsort(tabs, ntabs, sizeof(*tabs), tab_cmp_active);
+
+	for (i = 0; i < ntabs && freed < want + parked; ++i) {
+		tab = tabs[i];
+		url = hist_cur(tab->hist);
+		if (!can_hibernate(tab) && (tab->flags & TAB_COMPLETE) &&
+		    (!strncmp(url, "gemini://", 9) ||
+		    !strncmp(url, "gopher://", 9) ||
+		    !strncmp(url, "finger://", 9))) {
+			mcache_info(&npages, &before, &rawtot);
+			mcache_tab(tab);
+			mcache_info(&npages, &after, &rawtot);
+			if (after > before)
+				parked += after - before;
+			else
+				freed += before - after;
+		}
+		if (!can_hibernate(tab))
+			continue;
+
+		size = buffer_memory(&tab->buffer, NULL);
+		hibernate_tab(tab);
+		freed += size;
+		(*n)++;
+	}
+
+	free(tabs);
+	return freed - MIN(freed, parked);
+}
+
+/*
+ * Forget the oldest killed tabs until at least want bytes are freed.
+ * Returns what was freed and the tabs in *n.
+ */
+size_t
+drop_killed_tabs(size_t want, int *n)
+{
+	struct tab	*tab;
+	size_t		 freed = 0;
+
+	*n = 0;
+	while (freed < want &&
+	    (tab = TAILQ_LAST(&ktabshead, tabshead)) != NULL) {
+		freed += sizeof(*tab) + buffer_memory(&tab->buffer, NULL) +
+		    hist_memory(tab->hist);
+		free_tab(tab);
+		(*n)++;
+	}
+
+	if (*n != 0)
+		autosave_hook();
+	return freed;
+}
+
+static void
+hibernate_schedule(void)
+{
+	struct timeval	 tv = { 60, 0 };
+
+	if (hibernate_after > 0 || hibernate_budget > 0)
+		ev_timer(&tv, hibernate_timer, NULL);
+}
+
+static void
+hibernate_timer(int fd, int event, void *data)
+{
+	hibernate_tabs();
+	hibernate_schedule();
+}
+
+/*
+ * Killed tabs keep only their history, like the hibernated ones: the
+ * page is parked in the mcache, if it's not there yet, and loaded
+ * again from it once the tab is brought back.  Error pages and the
+ * interrupted loads aren't parked, the tab will fetch them again.
+ */
+static void
+park_killed_tab(struct tab *tab)
+{
+	const char	*url;
+	size_t		 top_line, current_line;
+
+	if (tab->flags & TAB_LAZY)
+		return;
+
+	if (!tab->loading_anim && (tab->flags & TAB_COMPLETE) &&
+	    (url = hist_cur(tab->hist)) != NULL) {
+		get_scroll_position(tab, &top_line, &current_line);
+		hist_set_offs(tab->hist, top_line, current_line);
+
+		if ((!strncmp(url, "gemini://", 9) ||
+		    !strncmp(url, "gopher://", 9) ||
+		    !strncmp(url, "finger://", 9)) && !mcache_has(url))
+			mcache_tab(tab);
+		mcache_layout(tab);
+	}
+
+	tab->flags |= TAB_LAZY;
+}
+
 /*
  * Move a tab from the tablist to the killed tab list and erase its
  * contents.  Append should always be 0 to prepend tabs so unkill_tab
@@ -106,9 +444,12 @@ kill_tab(struct tab *tab, int append)
 {
 	int count;
 
+	park_killed_tab(tab);
 	stop_tab(tab);
-	erase_buffer(&tab->buffer);
+	unwatch_tab(tab);
+	release_buffer(&tab->buffer);
 	TAILQ_REMOVE(&tabshead, tab, tabs);
+	idmap_del(&tabids, tab->id, tab);
 	ui_schedule_redraw();
 	autosave_hook();
 
@@ -131,8 +472,8 @@ kill_tab(struct tab *tab, int append)
 
 /*
  * Resurrects the lastest killed tab and returns it.  The tab is already
- * added to the tab list with the TAB_LAZY flag set.  NB: this doesn't
- * update current_tab.
+ * added to the tab list with the TAB_LAZY flag set, so that its page is
+ * loaded again.  NB: this doesn't update current_tab.
  */
 struct tab *
 unkill_tab(void)
@@ -148,6 +489,7 @@ unkill_tab(void)
 	t = TAILQ_FIRST(&ktabshead);
 	TAILQ_REMOVE(&ktabshead, t, tabs);
 	TAILQ_INSERT_TAIL(&tabshead, t, tabs);
+	idmap_put(&tabids, t->id, t);
 	t->flags |= TAB_LAZY;
 	return t;
 }
@@ -160,32 +502,107 @@ void
 free_tab(struct tab *tab)
 {
 	TAILQ_REMOVE(&ktabshead, tab, tabs);
+	wrap_join(&tab->buffer);
 	hist_free(tab->hist);
+	free(tab->iri);
+	free(tab->meta);
+	free(tab->redirect_src);
+	free(tab->buffer.buf);
+	arena_free(&tab->buffer.line_arena);
+	free(tab->buffer.vlines);
+	free(tab->buffer.vis);
+	free(tab->buffer.headings.refs);
+	free(tab->buffer.links.refs);
+	free(tab->timing_url);
+	free(tab->modeline_url);
+	free(tab->modeline_src);
 	free(tab);
 }
 
 void
 stop_tab(struct tab *tab)
 {
+	fs_stop(tab);
 	ui_send_net(IMSG_STOP, tab->id, -1, NULL, 0);
 }
 
-static inline void
-savetab(FILE *fp, struct tab *tab, int killed)
+/*
+ * The session is kept as a snapshot, the session file, plus a journal
+ * of the changes since it was written.  A save appends to the journal
+ * only the tabs that changed since the previous one, and the order of
+ * the tabs when that changed too.  The first save after the startup,
+ * or once the journal grows bigger than the snapshot, writes a new
+ * snapshot instead and drops the journal.
+ *
+ * The journal has the same lines as the session file, the tabs being
+ * told apart by their id flag, and the "! tabs" and "! killed" records
+ * with the ids of the tabs in order.
+ *
+ * With binary-session the snapshot is session.bin instead: a header,
+ * the tabs, the URLs of their history and then the strings they refer
+ * to by offset, so that loading it is only a mmap and a walk over the
+ * tabs.  It's in host byte order, as it's just a cache of the state.
+ * The journal stays textual.
+ */
+#define SBIN_MAGIC	"TLSCSESS"
+#define SBIN_VERSION	2
+
+struct sbin_header {
+	char		 magic[8];
+	uint32_t	 version;
+	uint32_t	 ntabs;
+	uint32_t	 nhist;
+	uint32_t	 strslen;
+};
+
+#define SBIN_CURRENT	0x1
+#define SBIN_KILLED	0x2
+
+struct sbin_tab {
+	uint32_t	 id;
+	uint32_t	 flags;
+	uint32_t	 top;
+	uint32_t	 cur;
+	uint32_t	 title;		/* offset in the strings */
+	uint32_t	 hist;		/* index of the first URL */
+	uint32_t	 nhist;
+	uint32_t	 histcur;	/* the URL shown, from hist */
+	int64_t		 active;	/* when it was last shown */
+};
+
+static int		 sess_compact = 1;
+static long		 sess_snapshot_len;
+static long		 sess_journal_len;
+static uint64_t		 sess_order_hash;
+
+static void
+tab_header(struct tab *tab, int killed, char *buf, size_t len)
 {
-	size_t		 i, size, cur;
 	size_t		 top_line, current_line;
 
 	get_scroll_position(tab, &top_line, &current_line);
 
-	fprintf(fp, "%s ", hist_cur(tab->hist));
-	if (tab == current_tab)
-		fprintf(fp, "current,");
-	if (killed)
-		fprintf(fp, "killed,");
+	snprintf(buf, len, "%s %s%sid=%u,top=%zu,cur=%zu,act=%lld %s\n",
+	    hist_cur(tab->hist), tab == current_tab ? "current," : "",
+	    killed ? "killed," : "", tab->id, top_line, current_line,
+	    (long long)tab->active, tab->buffer.title);
+}
 
-	fprintf(fp, "top=%zu,cur=%zu %s\n", top_line, current_line,
-	    tab->buffer.title);
+/* true if the tab changed since it was last saved */
+static inline int
+tab_changed(struct tab *tab, const char *header, uint64_t *hash)
+{
+	*hash = fnv1a(FNV1A_INIT, header, strlen(header));
+	return tab->sess_hash != *hash ||
+	    tab->sess_gen != hist_generation(tab->hist);
+}
+
+static inline void
+savetab(FILE *fp, struct tab *tab, const char *header, uint64_t hash)
+{
+	size_t		 i, size, cur;
+
+	fputs(header, fp);
 
 	cur = hist_off(tab->hist);
 	size = hist_size(tab->hist);
@@ -195,70 +612,271 @@ savetab(FILE *fp, struct tab *tab, int killed)
 		fprintf(fp, "%s %s\n", i > cur ? ">" : "<",
 		    hist_nth(tab->hist, i));
 	}
+
+	tab->sess_hash = hash;
+	tab->sess_gen = hist_generation(tab->hist);
 }
 
-static void
-save_tabs(void)
+static uint64_t
+order_hash(void)
 {
-	FILE		*fp;
 	struct tab	*tab;
-	int		 fd, err;
-	char		 sfn[PATH_MAX];
-
-	strlcpy(sfn, session_file_tmp, sizeof(sfn));
-	if ((fd = mkstemp(sfn)) == -1 ||
-	    (fp = fdopen(fd, "w")) == NULL) {
-		if (fd != -1) {
-			unlink(sfn);
-			close(fd);
-		}
-		return;
-	}
+	uint64_t	 h = FNV1A_INIT;
 
 	TAILQ_FOREACH(tab, &tabshead, tabs)
-		savetab(fp, tab, 0);
+		h = fnv1a(h, &tab->id, sizeof(tab->id));
+	h = fnv1a(h, "!", 1);
 	TAILQ_FOREACH(tab, &ktabshead, tabs)
-		savetab(fp, tab, 1);
+		h = fnv1a(h, &tab->id, sizeof(tab->id));
+	return h;
+}
 
-	err = fflush(fp) == EOF;
-	fclose(fp);
+static uint32_t
+sbin_str(FILE *fp, size_t *off, const char *str)
+{
+	size_t	 len;
+	uint32_t ret = *off;
 
-	if (err || rename(sfn, session_file) == -1)
-		unlink(sfn);
+	len = strlen(str) + 1;
+	fwrite(str, 1, len, fp);
+	*off += len;
+	return ret;
 }
 
 static void
-save_all_history(void)
+sbin_tab(struct sbin_tab *bt, struct tab *tab, int killed,
+    uint32_t *hist, FILE *strs, size_t *off)
 {
-	FILE	*fp;
-	size_t	 i;
-	int	 fd, err;
-	char	 sfn[PATH_MAX];
-
-	strlcpy(sfn, history_file_tmp, sizeof(sfn));
-	if ((fd = mkstemp(sfn)) == -1 ||
-	    (fp = fdopen(fd, "w")) == NULL) {
-		if (fd != -1) {
-			unlink(sfn);
-			close(fd);
+	size_t		 i, top_line, current_line;
+	uint64_t	 hash;
+	char		 header[GEMINI_URL_LEN * 2];
+
+	get_scroll_position(tab, &top_line, &current_line);
+
+	bt->id = tab->id;
+	if (tab == current_tab)
+		bt->flags |= SBIN_CURRENT;
+	if (killed)
+		bt->flags |= SBIN_KILLED;
+	bt->top = top_line;
+	bt->cur = current_line;
+	bt->active = tab->active;
+	bt->title = sbin_str(strs, off, tab->buffer.title);
+	bt->nhist = hist_size(tab->hist);
+	bt->histcur = hist_off(tab->hist);
+	for (i = 0; i < bt->nhist; ++i)
+		hist[i] = sbin_str(strs, off, hist_nth(tab->hist, i));
+
+	/* so that the journal knows what was saved */
+	tab_header(tab, killed, header, sizeof(header));
+	tab_changed(tab, header, &hash);
+	tab->sess_hash = hash;
+	tab->sess_gen = hist_generation(tab->hist);
+}
+
+static void
+save_snapshot_bin(FILE *fp)
+{
+	struct sbin_header	 hdr;
+	struct sbin_tab		*bt;
+	struct tab		*tab;
+	FILE			*strs;
+	uint32_t		*hist;
+	char			*str = NULL;
+	size_t			 ntabs = 0, nhist = 0, i, h, off = 0, len = 0;
+
+	TAILQ_FOREACH(tab, &tabshead, tabs) {
+		ntabs++;
+		nhist += hist_size(tab->hist);
+	}
+	TAILQ_FOREACH(tab, &ktabshead, tabs) {
+		ntabs++;
+		nhist += hist_size(tab->hist);
+	}
+
+	if ((strs = open_memstream(&str, &len)) == NULL)
+		err(1, "open_memstream");
+	bt = xcalloc(ntabs + 1, sizeof(*bt));
+	hist = xcalloc(nhist + 1, sizeof(*hist));
+
+	i = h = 0;
+	TAILQ_FOREACH(tab, &tabshead, tabs) {
+		bt[i].hist = h;
+		sbin_tab(&bt[i], tab, 0, &hist[h], strs, &off);
+		h += bt[i++].nhist;
+	}
+	TAILQ_FOREACH(tab, &ktabshead, tabs) {
+		bt[i].hist = h;
+		sbin_tab(&bt[i], tab, 1, &hist[h], strs, &off);
+		h += bt[i++].nhist;
+	}
+	if (fclose(strs) == EOF)
+		err(1, "fclose");
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, SBIN_MAGIC, sizeof(hdr.magic));
+	hdr.version = SBIN_VERSION;
+	hdr.ntabs = ntabs;
+	hdr.nhist = nhist;
+	hdr.strslen = len;
+
+	fwrite(&hdr, sizeof(hdr), 1, fp);
+	fwrite(bt, sizeof(*bt), ntabs, fp);
+	fwrite(hist, sizeof(*hist), nhist, fp);
+	fwrite(str, 1, len, fp);
+
+	free(bt);
+	free(hist);
+	free(str);
+}
+
+static void
+save_snapshot(void)
+{
+	struct pfile	 pf;
+	struct tab	*tab;
+	uint64_t	 hash;
+	const char	*path, *tmp, *other;
+	char		 header[GEMINI_URL_LEN * 2];
+
+	if (binary_session) {
+		path = session_bin_file;
+		tmp = session_bin_file_tmp;
+		other = session_file;
+	} else {
+		path = session_file;
+		tmp = session_file_tmp;
+		other = session_bin_file;
+	}
+
+	if (persist_open(&pf, path, tmp, PERSIST_REPLACE) == -1)
+		return;
+
+	if (binary_session)
+		save_snapshot_bin(pf.fp);
+	else {
+		TAILQ_FOREACH(tab, &tabshead, tabs) {
+			tab_header(tab, 0, header, sizeof(header));
+			tab_changed(tab, header, &hash);
+			savetab(pf.fp, tab, header, hash);
 		}
+		TAILQ_FOREACH(tab, &ktabshead, tabs) {
+			tab_header(tab, 1, header, sizeof(header));
+			tab_changed(tab, header, &hash);
+			savetab(pf.fp, tab, header, hash);
+		}
+	}
+
+	/*
+	 * Drop the journal before the rename: if we crash halfway the
+	 * last changes are lost, but an old journal is never replayed
+	 * over a newer snapshot.
+	 */
+	persist_unlink(session_journal_file);
+	if (persist_close(&pf) == -1)
 		return;
+	persist_unlink(other);
+
+	sess_compact = 0;
+	sess_snapshot_len = pf.len;
+	sess_journal_len = 0;
+	sess_order_hash = order_hash();
+}
+
+static int
+journal_tabs(struct pfile *pf, struct tabshead *head, int killed)
+{
+	struct tab	*tab;
+	uint64_t	 hash;
+	char		 header[GEMINI_URL_LEN * 2];
+
+	TAILQ_FOREACH(tab, head, tabs) {
+		tab_header(tab, killed, header, sizeof(header));
+		if (!tab_changed(tab, header, &hash))
+			continue;
+
+		if (pf->fp == NULL && persist_open(pf, session_journal_file,
+		    NULL, PERSIST_APPEND) == -1)
+			return -1;
+		savetab(pf->fp, tab, header, hash);
 	}
 
-	for (i = 0; i < history.len; ++i) {
-		history.items[i].dirty = 0;
-		fprintf(fp, "%lld %s\n", (long long)history.items[i].ts,
-		    history.items[i].uri);
+	return 0;
+}
+
+static void
+save_journal(void)
+{
+	struct pfile	 pf;
+	struct tab	*tab;
+	uint64_t	 hash;
+
+	memset(&pf, 0, sizeof(pf));
+	if (journal_tabs(&pf, &tabshead, 0) == -1 ||
+	    journal_tabs(&pf, &ktabshead, 1) == -1)
+		goto err;
+
+	if ((hash = order_hash()) != sess_order_hash) {
+		if (pf.fp == NULL && persist_open(&pf, session_journal_file,
+		    NULL, PERSIST_APPEND) == -1)
+			goto err;
+
+		fputs("! tabs", pf.fp);
+		TAILQ_FOREACH(tab, &tabshead, tabs)
+			fprintf(pf.fp, " %u", tab->id);
+		fputs("\n! killed", pf.fp);
+		TAILQ_FOREACH(tab, &ktabshead, tabs)
+			fprintf(pf.fp, " %u", tab->id);
+		fputs("\n", pf.fp);
+		sess_order_hash = hash;
 	}
 
-	err = fflush(fp) == EOF;
-	fclose(fp);
+	/* nothing changed */
+	if (pf.fp == NULL)
+		return;
 
-	if (err || rename(sfn, history_file) == -1) {
-		unlink(sfn);
+	if (persist_close(&pf) == 0) {
+		sess_journal_len += pf.len;
 		return;
 	}
 
+ err:
+	/* the journal may be incomplete, start over */
+	if (pf.fp != NULL)
+		persist_close(&pf);
+	sess_compact = 1;
+}
+
+static void
+save_tabs(void)
+{
+	if (sess_compact || sess_journal_len > sess_snapshot_len)
+		save_snapshot();
+	else
+		save_journal();
+}
+
+static void
+save_all_history(void)
+{
+	struct pfile	 pf;
+	size_t		 i;
+
+	if (persist_open(&pf, history_file, history_file_tmp,
+	    PERSIST_REPLACE) == -1)
+		return;
+
+	for (i = 0; i < history.len; ++i) {
+		history.items[i]->dirty = 0;
+		history.items[i]->ondisk = 1;
+		fprintf(pf.fp, "%lld %s\t%u\n",
+		    (long long)history.items[i]->ts,
+		    history.items[i]->uri, history.items[i]->visits);
+	}
+
+	if (persist_close(&pf) == -1)
+		return;
+
 	history.dirty = 0;
 	history.extra = 0;
 }
@@ -266,23 +884,28 @@ save_all_history(void)
 static void
 save_dirty_history(void)
 {
-	FILE	*fp;
-	size_t	 i;
+	struct pfile	 pf;
+	size_t		 i;
 
-	if ((fp = fopen(history_file, "a")) == NULL)
+	if (persist_open(&pf, history_file, NULL, PERSIST_APPEND) == -1)
 		return;
 
 	for (i = 0; i < history.len && history.dirty > 0; ++i) {
-		if (!history.items[i].dirty)
+		if (!history.items[i]->dirty)
 			continue;
 		history.dirty--;
-		history.items[i].dirty = 0;
-		fprintf(fp, "%lld %s\n", (long long)history.items[i].ts,
-		    history.items[i].uri);
+		history.items[i]->dirty = 0;
+		/* the line it had in the file is now a stale one */
+		if (history.items[i]->ondisk)
+			history.extra++;
+		history.items[i]->ondisk = 1;
+		fprintf(pf.fp, "%lld %s\t%u\n",
+		    (long long)history.items[i]->ts,
+		    history.items[i]->uri, history.items[i]->visits);
 	}
 	history.dirty = 0;
 
-	fclose(fp);
+	persist_close(&pf);
 }
 
 void
@@ -293,124 +916,359 @@ save_session(void)
 
 	save_tabs();
 
-	if (history.extra > HISTORY_CAP/2)
+	if (history.extra > history.len / 2)
 		save_all_history();
 	else if (history.dirty)
 		save_dirty_history();
 }
 
+/*
+ * The persist process failed to write something: the journal or the
+ * history file may be missing some records, so rewrite them whole the
+ * next time.
+ */
 void
-history_push(struct histitem *hi)
+save_session_failed(void)
 {
-	size_t		 i, oldest = 0;
-	char		*uri;
+	sess_compact = 1;
+	history.extra = history.len + 1;
+}
 
-	for (i = 0; i < history.len; ++i) {
-		if (history.items[i].ts < history.items[oldest].ts)
-			oldest = i;
+void
+history_init(void)
+{
+	struct ohash_info info = {
+		.key_offset = offsetof(struct history_item, uri),
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	ohash_init(&histhash, 10, &info);
+	TAILQ_INIT(&histage);
+}
+
+/*
+ * The items are indexed by the address of their interned uri.  On a
+ * miss the reference taken on uri is passed to the new item.
+ */
+static struct history_item *
+history_lookup(const char *uri, unsigned int *slot)
+{
+	*slot = ohash_lookup_memory(&histhash, (const char *)&uri,
+	    sizeof(uri), intern_hash(uri));
+	return ohash_find(&histhash, *slot);
+}
+
+static struct history_item *
+history_new(const char *uri, time_t ts, unsigned int slot)
+{
+	struct history_item	*hi;
+
+	hi = xcalloc(1, sizeof(*hi));
+	hi->uri = uri;
+	hi->ts = ts;
+
+	ohash_insert(&histhash, slot, hi);
+	TAILQ_INSERT_TAIL(&histage, hi, entries);
+	return hi;
+}
 
-		/* remove duplicates */
-		if (!strcmp(history.items[i].uri, hi->uri))
-			return;
+/* the position of uri in the items, or where it should go */
+static size_t
+history_bsearch(const char *uri)
+{
+	size_t	 lo = 0, hi = history.len, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strcmp(history.items[mid]->uri, uri) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
 	}
+	return lo;
+}
+
+/*
+ * Size the table and the items for the n lines of the history file
+ * before they're loaded, as load_certs does for known_hosts.
+ */
+static void
+history_reserve(size_t n)
+{
+	struct ohash_info info;
+	unsigned int	 sz = 10;
 
-	uri = xstrdup(hi->uri);
+	if (history.len != 0 || n == 0)
+		return;
+
+	intern_reserve(n);
+
+	/* ohash grows past 3/4 */
+	while (sz < 30 && ((size_t)1 << sz) * 3 < n * 4)
+		sz++;
+
+	info = histhash.info;
+	ohash_delete(&histhash);
+	ohash_init(&histhash, sz, &info);
+
+	history.cap = n;
+	history.items = xreallocarray(history.items, history.cap,
+	    sizeof(*history.items));
+}
+
+static void
+history_grow(void)
+{
+	if (history.len < history.cap)
+		return;
 
-	/* don't grow too much; replace the oldest */
-	if (history.len == HISTORY_CAP) {
-		history.items[oldest].ts = hi->ts;
-		free(history.items[oldest].uri);
-		history.items[oldest].uri = uri;
+	history.cap = history.cap == 0 ? 64 : history.cap * 2;
+	history.items = xreallocarray(history.items, history.cap,
+	    sizeof(*history.items));
+}
 
-		/* Growed past the max value, signal to regen the file. */
+/* forget the least recently visited items past max_history */
+static void
+history_evict(void)
+{
+	struct history_item	*hi;
+	unsigned int		 slot;
+	size_t			 i;
+
+	while (history.len > (size_t)max_history &&
+	    (hi = TAILQ_FIRST(&histage)) != NULL) {
+		i = history_bsearch(hi->uri);
+		memmove(&history.items[i], &history.items[i + 1],
+		    (history.len - i - 1) * sizeof(*history.items));
+		history.len--;
+
+		if (hi->dirty)
+			history.dirty--;
+
+		history_lookup(hi->uri, &slot);
+		ohash_remove(&histhash, slot);
+		TAILQ_REMOVE(&histage, hi, entries);
+		intern_free(hi->uri);
+		free(hi);
+
+		/* it's still in the file, signal to regen it. */
+		history.extra++;
+	}
+}
+
+/*
+ * Add an item read from the history file, uri is len bytes long and
+ * not NUL-terminated.  The items are sorted and the excess dropped
+ * only once they're all loaded by history_sort.
+ */
+static void
+history_push(const char *uri, size_t len, time_t ts, unsigned int visits)
+{
+	struct history_item	*item;
+	unsigned int		 slot;
+
+	uri = intern_mem(uri, len);
+	if ((item = history_lookup(uri, &slot)) != NULL) {
+		intern_free(uri);
+
+		/*
+		 * The file is append-only, keep the latest visit.  Old
+		 * files have a line per visit and no count.
+		 */
+		if (item->ts < ts)
+			item->ts = ts;
+		if (visits == 0)
+			item->visits++;
+		else if (item->visits < visits)
+			item->visits = visits;
 		history.extra++;
 		return;
 	}
 
-	history.items[history.len].ts = hi->ts;
-	history.items[history.len].uri = uri;
-	history.len++;
+	history_grow();
+	item = history_new(uri, ts, slot);
+	item->visits = visits != 0 ? visits : 1;
+	item->ondisk = 1;
+	history.items[history.len++] = item;
 }
 
 static int
 history_cmp(const void *a, const void *b)
 {
-	const struct history_item *i = a, *j = b;
+	const struct history_item *i = *(struct history_item **)a;
+	const struct history_item *j = *(struct history_item **)b;
+
 	return strcmp(i->uri, j->uri);
 }
 
+static int
+history_age_cmp(const void *a, const void *b)
+{
+	const struct history_item *i = *(struct history_item **)a;
+	const struct history_item *j = *(struct history_item **)b;
+
+	if (i->ts == j->ts)
+		return 0;
+	return i->ts < j->ts ? -1 : 1;
+}
+
 void
 history_sort(void)
 {
-	qsort(history.items, history.len, sizeof(history.items[0]),
+	size_t	 i;
+
+	qsort(history.items, history.len, sizeof(*history.items),
+	    history_age_cmp);
+
+	TAILQ_INIT(&histage);
+	for (i = 0; i < history.len; ++i)
+		TAILQ_INSERT_TAIL(&histage, history.items[i], entries);
+
+	qsort(history.items, history.len, sizeof(*history.items),
 	    history_cmp);
+
+	history_evict();
 }
 
 void
 history_add(const char *uri)
 {
-	size_t	 i, j, insert = 0, oldest = 0;
-	char	*u;
-	int	 c;
+	struct history_item	*hi;
+	unsigned int		 slot;
+	size_t			 i;
+
+	uri = intern(uri);
+	if ((hi = history_lookup(uri, &slot)) != NULL) {
+		intern_free(uri);
+		TAILQ_REMOVE(&histage, hi, entries);
+		TAILQ_INSERT_TAIL(&histage, hi, entries);
+	} else {
+		hi = history_new(uri, 0, slot);
+
+		history_grow();
+		i = history_bsearch(uri);
+		memmove(&history.items[i + 1], &history.items[i],
+		    (history.len - i) * sizeof(*history.items));
+		history.items[i] = hi;
+		history.len++;
+	}
 
-	for (i = 0; i < history.len; ++i) {
-		if (history.items[i].ts < history.items[oldest].ts)
-			oldest = i;
+	hi->ts = time(NULL);
+	hi->visits++;
+	if (!hi->dirty) {
+		hi->dirty = 1;
+		history.dirty++;
+	}
 
-		if (insert != 0 && insert < i)
-			continue;
+	history_evict();
+	autosave_hook();
+}
 
-		c = strcmp(uri, history.items[i].uri);
-		if (c == 0) {
-			history.items[i].ts = time(NULL);
-			history.items[i].dirty = 1;
-			history.dirty++;
-			autosave_hook();
-			return;
-		}
+/*
+ * How much an entry is worth in the completions: the number of visits
+ * weighted by how recent the last one was.
+ */
+static long long
+frecency(struct history_item *hi, time_t now)
+{
+	time_t	 age = now - hi->ts;
+	int	 weight;
+
+	if (age < 4 * 86400)
+		weight = 100;
+	else if (age < 14 * 86400)
+		weight = 70;
+	else if (age < 31 * 86400)
+		weight = 50;
+	else if (age < 90 * 86400)
+		weight = 30;
+	else
+		weight = 10;
 
-		if (c > 0)
-			insert = i;
-	}
+	return (long long)hi->visits * weight;
+}
 
-	u = xstrdup(uri);
+struct frecent {
+	long long		 score;
+	struct history_item	*hi;
+};
 
-	/* if history is full, replace the oldest one */
-	if (history.len == HISTORY_CAP) {
-		free(history.items[oldest].uri);
-		history.items[oldest].uri = u;
-		history.items[oldest].ts = time(NULL);
-		history.items[oldest].dirty = 1;
-		history.dirty++;
-		history_sort();
-		autosave_hook();
-		return;
+static int
+frecent_cmp(const void *a, const void *b)
+{
+	const struct frecent *i = a, *j = b;
+
+	if (i->score != j->score)
+		return i->score > j->score ? -1 : 1;
+	if (i->hi->ts != j->hi->ts)
+		return i->hi->ts > j->hi->ts ? -1 : 1;
+	return strcmp(i->hi->uri, j->hi->uri);
+}
+
+/*
+ * Return the history entries, the most frecent first, in a NULL
+ * terminated array valid until the next call or history change.
+ */
+struct history_item **
+history_by_frecency(void)
+{
+	static struct history_item	**items;
+	static struct frecent		 *tmp;
+	static size_t			  cap;
+	time_t				  now;
+	size_t				  i;
+
+	if (cap < history.len + 1) {
+		cap = history.len + 1;
+		items = xreallocarray(items, cap, sizeof(*items));
+		tmp = xreallocarray(tmp, cap, sizeof(*tmp));
 	}
 
-	/* otherwise just insert in the right spot */
+	now = time(NULL);
+	for (i = 0; i < history.len; ++i) {
+		tmp[i].score = frecency(history.items[i], now);
+		tmp[i].hi = history.items[i];
+	}
+	qsort(tmp, history.len, sizeof(*tmp), frecent_cmp);
 
-	for (j = history.len; j > insert; --j)
-		memcpy(&history.items[j], &history.items[j-1],
-		    sizeof(history.items[j]));
+	for (i = 0; i < history.len; ++i)
+		items[i] = tmp[i].hi;
+	items[i] = NULL;
+	return items;
+}
 
-	history.items[insert].ts = time(NULL);
-	history.items[insert].uri = u;
-	history.items[insert].dirty = 1;
-	history.dirty++;
-	history.len++;
-	autosave_hook();
+/* the memory held by the global history, the URIs are interned */
+size_t
+history_memory(void)
+{
+	return history.cap * sizeof(*history.items) +
+	    history.len * sizeof(struct history_item) +
+	    hash_memory(&histhash);
+}
+
+static void
+autosave_idle(int fd, int event, void *data)
+{
+	save_session();
 }
 
 void
 autosave_init(void)
 {
-	return;
+	ev_name(autosave_timer, "autosave timer");
+	ev_name(autosave_idle, "autosave");
+	ev_name(hibernate_timer, "hibernate timer");
+	hibernate_schedule();
 }
 
+/* don't write the session on the way of the user, wait to be idle. */
 void
 autosave_timer(int fd, int event, void *data)
 {
-	save_session();
+	if ((autosaveidle = ev_idle(autosave_idle, NULL)) == 0)
+		save_session();
 }
 
 /*
@@ -425,7 +1283,8 @@ autosave_hook(void)
 	if (autosave <= 0)
 		return;
 
-	if (!ev_timer_pending(autosavetimer)) {
+	if (!ev_timer_pending(autosavetimer) &&
+	    !ev_idle_pending(autosaveidle)) {
 		tv.tv_sec = autosave;
 		tv.tv_usec = 0;
 
@@ -433,93 +1292,166 @@ autosave_hook(void)
 	}
 }
 
+/*
+ * Split the line between p and end in the blank-separated fields and
+ * return how many there are, up to four: a known host has three.
+ */
 static inline int
-parse_khost_line(char *line, char *tmp[3])
+khost_fields(const char *p, const char *end, const char *f[4],
+    size_t len[4])
 {
-	char **ap;
-
-	for (ap = tmp; ap < &tmp[3] &&
-	    (*ap = strsep(&line, " \t\n")) != NULL;) {
-		if (**ap != '\0')
-			ap++;
+	const char	*s;
+	int		 n = 0;
+
+	while (n < 4) {
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p == end)
+			break;
+		for (s = p; p < end && *p != ' ' && *p != '\t'; p++)
+			;
+		f[n] = s;
+		len[n++] = p - s;
 	}
 
-	return ap == &tmp[3] && *line == '\0';
+	return n;
 }
 
-static void
+/*
+ * known_hosts is mapped and parsed in place in a single pass, after
+ * counting the lines to size the table once.
+ */
+void
 load_certs(struct ohash *certs)
 {
-	char		*tmp[3], *line = NULL;
-	const char	*errstr;
-	size_t		 lineno = 0, linesize = 0;
-	ssize_t		 linelen;
-	FILE		*f;
-	struct tofu_entry *e;
+	struct stat	 sb;
+	const char	*f[4];
+	char		*map, *p, *eol, *end;
+	size_t		 len[4], lineno = 0, nlines = 1, maplen;
+	int		 fd, verified;
 
-	if ((f = fopen(known_hosts_file, "r")) == NULL)
+	if ((fd = open(known_hosts_file, O_RDONLY)) == -1)
 		return;
+	if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+		close(fd);
+		return;
+	}
+
+	maplen = sb.st_size;
+	map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("mmap %s", known_hosts_file);
+		return;
+	}
+	posix_madvise(map, maplen, POSIX_MADV_SEQUENTIAL);
 
-	e = xcalloc(1, sizeof(*e));
+	end = map + maplen;
+	for (p = map; (p = memchr(p, '\n', end - p)) != NULL; p++)
+		nlines++;
+	tofu_reserve(certs, nlines, maplen);
 
-	while ((linelen = getline(&line, &linesize, f)) != -1) {
+	for (p = map; p < end; p = eol + 1) {
 		lineno++;
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
 
-		if (parse_khost_line(line, tmp)) {
-			strlcpy(e->domain, tmp[0], sizeof(e->domain));
-			strlcpy(e->hash, tmp[1], sizeof(e->hash));
+		if (khost_fields(p, eol, f, len) != 3) {
+			warnx("%s:%zu invalid entry", known_hosts_file,
+			    lineno);
+			continue;
+		}
 
-			e->verified = strtonum(tmp[2], 0, 1, &errstr);
-			if (errstr != NULL)
-				errx(1, "%s:%zu verification for %s is %s: %s",
-				    known_hosts_file, lineno,
-				    e->domain, errstr, tmp[2]);
+		if (len[2] != 1 || (*f[2] != '0' && *f[2] != '1'))
+			errx(1, "%s:%zu verification for %.*s is invalid: "
+			    "%.*s", known_hosts_file, lineno, (int)len[0],
+			    f[0], (int)len[2], f[2]);
+		verified = *f[2] == '1';
 
-			tofu_add(certs, e);
-		} else
-			warnx("%s:%zu invalid entry",
-			    known_hosts_file, lineno);
+		/* the last line for a host wins */
+		tofu_load(certs, f[0], len[0], f[1], len[1], verified);
 	}
 
-	free(line);
-	fclose(f);
-	return;
+	munmap(map, maplen);
 }
 
+/* parse the number between p and end, the fields aren't terminated */
+static int
+hist_num(const char *p, const char *end, long long min, long long max,
+    long long *n)
+{
+	char		 buf[32];
+	const char	*errstr;
 
-static void
+	if (end - p <= 0 || (size_t)(end - p) >= sizeof(buf))
+		return (-1);
+	memcpy(buf, p, end - p);
+	buf[end - p] = '\0';
+	*n = strtonum(buf, min, max, &errstr);
+	return (errstr == NULL ? 0 : -1);
+}
+
+/*
+ * The history file is mapped and parsed in place like known_hosts.
+ * Since it's append-only an URL may be there more than once; the
+ * duplicates are merged through the hash table, and counted in
+ * history.extra so that the file is compacted soon.
+ */
+void
 load_hist(void)
 {
-	FILE		*hist;
-	size_t		 linesize = 0;
-	ssize_t		 linelen;
-	char		*nl, *spc, *line = NULL;
-	const char	*errstr;
-	struct histitem	 hi;
+	struct stat	 sb;
+	char		*map, *p, *eol, *end, *spc, *tab;
+	size_t		 maplen, nlines = 1;
+	long long	 ts, visits;
+	unsigned int	 vis;
+	int		 fd;
+
+	if ((fd = open(history_file, O_RDONLY)) == -1)
+		return;
+	if (fstat(fd, &sb) == -1 || sb.st_size == 0) {
+		close(fd);
+		return;
+	}
 
-	if ((hist = fopen(history_file, "r")) == NULL)
+	maplen = sb.st_size;
+	map = mmap(NULL, maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		warn("mmap %s", history_file);
 		return;
+	}
+	posix_madvise(map, maplen, POSIX_MADV_SEQUENTIAL);
 
-	while ((linelen = getline(&line, &linesize, hist)) != -1) {
-		if ((nl = strchr(line, '\n')) != NULL)
-			*nl = '\0';
-		if ((spc = strchr(line, ' ')) == NULL)
+	end = map + maplen;
+	for (p = map; (p = memchr(p, '\n', end - p)) != NULL; p++)
+		nlines++;
+	/* past max_history they're evicted anyway */
+	history_reserve(MIN(nlines, (size_t)max_history));
+
+	for (p = map; p < end; p = eol + 1) {
+		if ((eol = memchr(p, '\n', end - p)) == NULL)
+			eol = end;
+
+		if ((spc = memchr(p, ' ', eol - p)) == NULL ||
+		    hist_num(p, spc, INT64_MIN, INT64_MAX, &ts) == -1)
 			continue;
-		*spc = '\0';
 		spc++;
 
-		memset(&hi, 0, sizeof(hi));
-		hi.ts = strtonum(line, INT64_MIN, INT64_MAX, &errstr);
-		if (errstr != NULL)
-			continue;
-		if (strlcpy(hi.uri, spc, sizeof(hi.uri)) >= sizeof(hi.uri))
+		vis = 0;
+		if ((tab = memchr(spc, '\t', eol - spc)) != NULL) {
+			if (hist_num(tab + 1, eol, 1, UINT_MAX, &visits) == 0)
+				vis = visits;
+		} else
+			tab = eol;
+
+		if (tab == spc || tab - spc >= GEMINI_URL_LEN)
 			continue;
 
-		history_push(&hi);
+		history_push(spc, tab - spc, ts, vis);
 	}
 
-	fclose(hist);
-	free(line);
+	munmap(map, maplen);
 
 	history_sort();
 }
@@ -561,6 +1493,7 @@ parse_tab_line(char *line, struct tab **ct)
 	const char *uri, *title = "";
 	int current = 0, killed = 0;
 	size_t tline = 0, cline = 0;
+	time_t active = 0;
 
 	uri = line;
 	if ((s = strchr(line, ' ')) == NULL)
@@ -581,6 +1514,8 @@ parse_tab_line(char *line, struct tab **ct)
 			tline = strtonum(ap+4, 0, UINT32_MAX, NULL);
 		else if (!strncmp(ap, "cur=", 4))
 			cline = strtonum(ap + 4, 0, UINT32_MAX, NULL);
+		else if (!strncmp(ap, "act=", 4))
+			active = strtonum(ap + 4, 0, LLONG_MAX, NULL);
 	}
 
 	if (tline > cline) {
@@ -592,6 +1527,7 @@ parse_tab_line(char *line, struct tab **ct)
 		err(1, "new_tab");
 	hist_set_offs(tab->hist, tline, cline);
 	strlcpy(tab->buffer.title, title, sizeof(tab->buffer.title));
+	tab->active = active;
 
 	if (current)
 		*ct = tab;
@@ -601,46 +1537,379 @@ parse_tab_line(char *line, struct tab **ct)
 	return tab;
 }
 
+/*
+ * A tab as read from the session file and the journal: the lines
+ * describing it, the last ones read replacing the previous ones.
+ */
+struct srec {
+	uint32_t	 id;
+	char		*buf;
+	size_t		 len;
+	size_t		 cap;
+
+	/* or the tab in the binary snapshot */
+	const struct sbin_tab *bin;
+};
+
+struct sload {
+	struct srec	*recs;
+	size_t		 len;
+	size_t		 cap;
+
+	/* the binary snapshot, if any */
+	void		*map;
+	size_t		 maplen;
+	const uint32_t	*hist;
+	const char	*strs;
+	size_t		 strslen;
+
+	/* the last order in the journal, if any */
+	uint32_t	*order;
+	size_t		 norder;
+	size_t		 ordercap;
+	size_t		 nlive;
+	int		 has_order;
+};
+
 static void
-load_tabs(void)
+srec_append(struct srec *r, const char *line)
+{
+	size_t	 len;
+
+	len = strlen(line) + 1;
+	if (r->len + len > r->cap) {
+		r->cap = (r->len + len) * 2;
+		r->buf = xrealloc(r->buf, r->cap);
+	}
+	memcpy(r->buf + r->len, line, len);
+	r->buf[r->len + len - 1] = '\n';
+	r->len += len;
+}
+
+/* the id flag of a tab line, or -1 if there's none */
+static int64_t
+tab_line_id(const char *line)
+{
+	const char	*errstr;
+	char		 flags[128], *s, *ap;
+	int64_t		 id;
+
+	if ((line = strchr(line, ' ')) == NULL)
+		return -1;
+	strlcpy(flags, line + 1, sizeof(flags));
+	if ((s = strchr(flags, ' ')) != NULL)
+		*s = '\0';
+
+	s = flags;
+	while ((ap = strsep(&s, ",")) != NULL) {
+		if (strncmp(ap, "id=", 3) != 0)
+			continue;
+		id = strtonum(ap + 3, 0, UINT32_MAX, &errstr);
+		if (errstr == NULL)
+			return id;
+	}
+	return -1;
+}
+
+static struct srec *
+sload_new(struct sload *sl, uint32_t id)
+{
+	struct srec	*r;
+
+	if (sl->len == sl->cap) {
+		sl->cap = sl->cap == 0 ? 16 : sl->cap * 2;
+		sl->recs = xreallocarray(sl->recs, sl->cap, sizeof(*sl->recs));
+	}
+	r = &sl->recs[sl->len++];
+	memset(r, 0, sizeof(*r));
+	r->id = id;
+	return r;
+}
+
+static struct srec *
+sload_rec(struct sload *sl, uint32_t id)
 {
-	struct tab	*tab = NULL, *ct = NULL;
-	FILE		*session;
+	size_t		 i;
+
+	for (i = 0; i < sl->len; ++i)
+		if (sl->recs[i].id == id)
+			return &sl->recs[i];
+	return sload_new(sl, id);
+}
+
+static void
+sload_order(struct sload *sl, char *line, int killed)
+{
+	const char	*errstr;
+	char		*ap;
+	int64_t		 id;
+
+	if (!killed)
+		sl->norder = 0;
+
+	while ((ap = strsep(&line, " ")) != NULL) {
+		if (*ap == '\0')
+			continue;
+		id = strtonum(ap, 0, UINT32_MAX, &errstr);
+		if (errstr != NULL)
+			continue;
+		if (sl->norder == sl->ordercap) {
+			sl->ordercap = sl->ordercap == 0 ? 16 :
+			    sl->ordercap * 2;
+			sl->order = xreallocarray(sl->order, sl->ordercap,
+			    sizeof(*sl->order));
+		}
+		sl->order[sl->norder++] = id;
+	}
+
+	if (!killed)
+		sl->nlive = sl->norder;
+	sl->has_order = 1;
+}
+
+/* read the session file or the journal into sl */
+static int
+sload_read(struct sload *sl, const char *path, uint32_t *noid)
+{
+	FILE		*fp;
+	struct srec	*r = NULL;
 	size_t		 lineno = 0, linesize = 0;
 	ssize_t		 linelen;
-	char		*uri, *line = NULL;
+	int64_t		 id;
+	char		*line = NULL;
 
-	if ((session = fopen(session_file, "r")) == NULL) {
-		new_tab("about:new", NULL, NULL);
-		new_tab("about:help", NULL, NULL);
-		return;
-	}
+	if ((fp = fopen(path, "r")) == NULL)
+		return -1;
 
-	while ((linelen = getline(&line, &linesize, session)) != -1) {
+	while ((linelen = getline(&line, &linesize, fp)) != -1) {
 		lineno++;
 
 		if (linelen > 0 && line[linelen-1] == '\n')
 			line[linelen-1] = '\0';
 
-		if (*line == '<' || *line == '>') {
-			uri = line + 1;
-			if (*uri != ' ' || tab == NULL) {
+		if (!strncmp(line, "! tabs", 6)) {
+			sload_order(sl, line + 6, 0);
+			r = NULL;
+		} else if (!strncmp(line, "! killed", 8)) {
+			sload_order(sl, line + 8, 1);
+			r = NULL;
+		} else if (*line == '<' || *line == '>') {
+			if (line[1] != ' ' || r == NULL) {
 				fprintf(stderr, "%s:%zu invalid line\n",
-				    session_file, lineno);
+				    path, lineno);
 				continue;
 			}
-			uri++;
+			srec_append(r, line);
+		} else {
+			/* old sessions don't have the ids */
+			if ((id = tab_line_id(line)) == -1)
+				id = (*noid)++;
+			r = sload_rec(sl, id);
+			r->len = 0;
+			r->bin = NULL;
+			srec_append(r, line);
+		}
+	}
 
+	fclose(fp);
+	free(line);
+	return 0;
+}
+
+/* map the binary snapshot and add its tabs to sl */
+static int
+sload_bin(struct sload *sl, const char *path)
+{
+	struct sbin_header	 hdr;
+	const struct sbin_tab	*bt;
+	struct srec		*r;
+	struct stat		 sb;
+	const char		*p;
+	size_t			 i, left;
+	int			 fd;
+
+	if ((fd = open(path, O_RDONLY)) == -1)
+		return -1;
+	if (fstat(fd, &sb) == -1 || (size_t)sb.st_size < sizeof(hdr)) {
+		close(fd);
+		return -1;
+	}
+
+	sl->maplen = sb.st_size;
+	sl->map = mmap(NULL, sl->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (sl->map == MAP_FAILED) {
+		sl->map = NULL;
+		return -1;
+	}
+
+	p = sl->map;
+	left = sl->maplen - sizeof(hdr);
+	memcpy(&hdr, p, sizeof(hdr));
+	if (memcmp(hdr.magic, SBIN_MAGIC, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != SBIN_VERSION)
+		goto bad;
+
+	if (hdr.ntabs > left / sizeof(*bt))
+		goto bad;
+	bt = (const struct sbin_tab *)(p + sizeof(hdr));
+	left -= hdr.ntabs * sizeof(*bt);
+
+	if (hdr.nhist > left / sizeof(*sl->hist))
+		goto bad;
+	sl->hist = (const uint32_t *)(bt + hdr.ntabs);
+	left -= hdr.nhist * sizeof(*sl->hist);
+
+	/* so that every offset in the strings gives a string */
+	if (hdr.strslen != left || left == 0 ||
+	    p[sl->maplen - 1] != '\0')
+		goto bad;
+	sl->strs = (const char *)(sl->hist + hdr.nhist);
+	sl->strslen = hdr.strslen;
+
+	for (i = 0; i < hdr.ntabs; ++i) {
+		if (bt[i].hist > hdr.nhist ||
+		    bt[i].nhist > hdr.nhist - bt[i].hist ||
+		    bt[i].histcur >= bt[i].nhist)
+			goto bad;
+
+		/* the snapshot comes first, the ids are unique */
+		r = sload_new(sl, bt[i].id);
+		r->bin = &bt[i];
+	}
+
+	return 0;
+
+ bad:
+	warnx("%s: invalid session, ignoring", path);
+	munmap(sl->map, sl->maplen);
+	sl->map = NULL;
+	return -1;
+}
+
+static inline const char *
+sload_str(struct sload *sl, uint32_t off)
+{
+	if (off >= sl->strslen)
+		return "";
+	return sl->strs + off;
+}
+
+static void
+load_bin_tab(struct sload *sl, const struct sbin_tab *bt, struct tab **ct)
+{
+	struct tab	*tab;
+	const uint32_t	*hist;
+	size_t		 i, tline, cline;
+
+	hist = sl->hist + bt->hist;
+	if ((tab = new_tab(sload_str(sl, hist[bt->histcur]), NULL,
+	    NULL)) == NULL)
+		err(1, "new_tab");
+
+	for (i = 0; i < bt->histcur; ++i)
+		hist_prepend(tab->hist, sload_str(sl, hist[i]));
+	for (i = bt->histcur + 1; i < bt->nhist; ++i)
+		hist_append(tab->hist, sload_str(sl, hist[i]));
+
+	tline = bt->top;
+	cline = bt->cur;
+	if (tline > cline) {
+		tline = 0;
+		cline = 0;
+	}
+	hist_set_offs(tab->hist, tline, cline);
+	strlcpy(tab->buffer.title, sload_str(sl, bt->title),
+	    sizeof(tab->buffer.title));
+	tab->active = bt->active;
+
+	if (bt->flags & SBIN_CURRENT)
+		*ct = tab;
+	else if (bt->flags & SBIN_KILLED)
+		kill_tab(tab, 1);
+}
+
+static void
+load_tab(struct sload *sl, struct srec *r, struct tab **ct)
+{
+	struct tab	*tab = NULL;
+	char		*line, *s;
+
+	if (r->bin != NULL) {
+		load_bin_tab(sl, r->bin, ct);
+		return;
+	}
+
+	s = r->buf;
+	while ((line = strsep(&s, "\n")) != NULL) {
+		if (*line == '\0')
+			continue;
+
+		if (*line == '<' || *line == '>') {
+			if (tab == NULL)
+				continue;
 			if (*line == '>') /* future hist */
-				hist_append(tab->hist, uri);
+				hist_append(tab->hist, line + 2);
 			else
-				hist_prepend(tab->hist, uri);
+				hist_prepend(tab->hist, line + 2);
 		} else
-			tab = parse_tab_line(line, &ct);
+			tab = parse_tab_line(line, ct);
 	}
+}
 
-	fclose(session);
-	free(line);
+static void
+load_tabs(void)
+{
+	struct sload	 sl;
+	struct tab	*ct = NULL;
+	struct srec	*r;
+	size_t		 i, j;
+	uint32_t	 noid = UINT32_MAX / 2;
+	int		 have_session;
+
+	/* both snapshots may be there if we crashed while converting */
+	memset(&sl, 0, sizeof(sl));
+	if (binary_session)
+		have_session = sload_bin(&sl, session_bin_file) != -1 ||
+		    sload_read(&sl, session_file, &noid) != -1;
+	else
+		have_session = sload_read(&sl, session_file, &noid) != -1 ||
+		    sload_bin(&sl, session_bin_file) != -1;
+	have_session |= sload_read(&sl, session_journal_file, &noid) != -1;
+
+	if (!have_session) {
+		new_tab("about:new", NULL, NULL);
+		new_tab("about:help", NULL, NULL);
+		return;
+	}
+
+	for (i = 0; i < sl.len; ++i)
+		if (sl.recs[i].len != 0)
+			sl.recs[i].buf[sl.recs[i].len - 1] = '\0';
+
+	if (!sl.has_order) {
+		for (i = 0; i < sl.len; ++i)
+			load_tab(&sl, &sl.recs[i], &ct);
+	} else {
+		/* the tabs not in the order were closed for good */
+		for (i = 0; i < sl.norder; ++i) {
+			for (j = 0; j < sl.len; ++j) {
+				r = &sl.recs[j];
+				if (r->id == sl.order[i] &&
+				    (r->len != 0 || r->bin != NULL)) {
+					load_tab(&sl, r, &ct);
+					break;
+				}
+			}
+		}
+	}
+
+	for (i = 0; i < sl.len; ++i)
+		free(sl.recs[i].buf);
+	free(sl.recs);
+	free(sl.order);
+	if (sl.map != NULL)
+		munmap(sl.map, sl.maplen);
 
 	if (ct == NULL || TAILQ_EMPTY(&tabshead))
 		ct = new_tab("about:new", NULL, NULL);
@@ -651,11 +1920,14 @@ load_tabs(void)
 		new_tab("about:crash", NULL, NULL);
 }
 
+/*
+ * Restore the tabs.  The known hosts and the history are loaded apart
+ * with load_certs and load_hist, as the first tab doesn't need them
+ * to start loading.
+ */
 int
-load_session(struct ohash *certs)
+load_session(void)
 {
-	load_certs(certs);
-	load_hist();
 	load_tabs();
 	return 0;
 }
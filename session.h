@@ -32,45 +32,56 @@ struct session_tab_hist {
 	int		future;
 };
 
-struct histitem {
-	time_t	ts;
-	char	uri[GEMINI_URL_LEN];
-};
-
 struct history_item {
-	time_t	 ts;
-	char	*uri;
-	int	 dirty;
+	TAILQ_ENTRY(history_item) entries;	/* oldest first */
+	time_t		 ts;
+	unsigned int	 visits;
+	int		 dirty;
+	int		 ondisk;	/* it has a line in the file */
+	const char	*uri;		/* interned */
 };
 
-#define HISTORY_CAP 1000
 struct history {
-	struct history_item	items[HISTORY_CAP];
+	struct history_item	**items;	/* sorted by URI */
 	size_t			len;
+	size_t			cap;
 	size_t			dirty;
 	size_t			extra;
 };
 extern struct history history;
 
+void		 tabs_init(void);
+struct tab	*tab_by_id(uint32_t);
 void		 switch_to_tab(struct tab *);
 unsigned int	 tab_new_id(void);
+void		 tab_renew_id(struct tab *);
 struct tab	*new_tab(const char *, const char *base, struct tab *);
+struct tab	*new_lazy_tab(const char *);
 void		 kill_tab(struct tab *, int);
 struct tab	*unkill_tab(void);
 void		 free_tab(struct tab *);
 void		 stop_tab(struct tab*);
+void		 hibernate_tab(struct tab *);
+struct tab	*heaviest_tab(int);
+size_t		 hibernate_lru(size_t, int *);
+size_t		 drop_killed_tabs(size_t, int *);
 
 void		 save_session(void);
+void		 save_session_failed(void);
 
-void		 history_push(struct histitem *);
+void		 history_init(void);
 void		 history_sort(void);
 void		 history_add(const char *);
+struct history_item **history_by_frecency(void);
+size_t		 history_memory(void);
 
 void		 autosave_init(void);
 void		 autosave_timer(int, int, void *);
 void		 autosave_hook(void);
 
-int		 load_session(struct ohash *);
+void		 load_certs(struct ohash *);
+void		 load_hist(void);
+int		 load_session(void);
 int		 lock_session(void);
 
 #endif
@@ -0,0 +1,176 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+/*
+ * The ring is a header with the position up to which the ui is done,
+ * followed by the data.  Positions only grow and are taken modulo the
+ * size: a chunk is always contiguous, the space left at the end when
+ * it doesn't fit is skipped.  The chunks are released in the same
+ * order they were put, since their positions travel on the same imsg
+ * channel, so the tail alone is enough.
+ */
+
+#include "compat.h"
+
+#include <sys/mman.h>
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "shmring.h"
+
+#define SHMRING_TMP	"/tmp/telescope.shm.XXXXXXXXXX"
+
+struct shmring_hdr {
+	_Atomic uint64_t	 tail;
+	char			 pad[64 - sizeof(uint64_t)];
+};
+
+static size_t
+ring_size(size_t size)
+{
+	size_t	 n = 64 * 1024;
+
+	while (n < size && n < 64 * 1024 * 1024)
+		n *= 2;
+	return n;
+}
+
+/*
+ * Create a ring of at least size bytes and map it.  Returns the file
+ * descriptor to pass to the other process, or -1 on error.
+ */
+int
+shmring_create(struct shmring *ring, size_t size)
+{
+	int	 fd;
+#ifndef HAVE_MEMFD_CREATE
+	char	 path[sizeof(SHMRING_TMP)];
+#endif
+
+	size = ring_size(size);
+
+#ifdef HAVE_MEMFD_CREATE
+	if ((fd = memfd_create("telescope", MFD_CLOEXEC)) == -1)
+		return -1;
+#else
+	strlcpy(path, SHMRING_TMP, sizeof(path));
+	if ((fd = mkstemp(path)) == -1)
+		return -1;
+	unlink(path);
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) == -1) {
+		close(fd);
+		return -1;
+	}
+#endif
+
+	if (ftruncate(fd, sizeof(struct shmring_hdr) + size) == -1 ||
+	    shmring_map(ring, fd, size) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/* map the ring created by the other process */
+int
+shmring_map(struct shmring *ring, int fd, size_t size)
+{
+	void	*p;
+
+	if (size != ring_size(size))
+		return -1;
+
+	p = mmap(NULL, sizeof(struct shmring_hdr) + size,
+	    PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED)
+		return -1;
+
+	memset(ring, 0, sizeof(*ring));
+	ring->hdr = p;
+	ring->data = (unsigned char *)p + sizeof(struct shmring_hdr);
+	ring->size = size;
+	ring->head = atomic_load(&ring->hdr->tail);
+	return 0;
+}
+
+/* the biggest chunk worth putting, to keep the ring flowing */
+size_t
+shmring_max_chunk(struct shmring *ring)
+{
+	return ring->size / 4;
+}
+
+/*
+ * Copy len bytes in the ring, filling c with their position.
+ * Returns -1 if there's no room for them.
+ */
+int
+shmring_put(struct shmring *ring, const void *buf, size_t len,
+    struct shmring_chunk *c)
+{
+	uint64_t	 tail, pos, off;
+
+	if (ring->size == 0 || len == 0 || len > ring->size)
+		return -1;
+
+	tail = atomic_load_explicit(&ring->hdr->tail, memory_order_acquire);
+	pos = ring->head;
+	off = pos & (ring->size - 1);
+	if (off + len > ring->size)
+		pos += ring->size - off;
+	if (pos + len - tail > ring->size)
+		return -1;
+
+	memcpy(ring->data + (pos & (ring->size - 1)), buf, len);
+	ring->head = pos + len;
+
+	c->pos = pos;
+	c->len = len;
+	return 0;
+}
+
+/*
+ * The bytes of the chunk, or NULL if it doesn't fit in the ring: the
+ * position comes from the other process.
+ */
+const void *
+shmring_get(struct shmring *ring, const struct shmring_chunk *c)
+{
+	uint64_t	 off;
+
+	if (ring->size == 0 || c->len > ring->size)
+		return NULL;
+	off = c->pos & (ring->size - 1);
+	if (off + c->len > ring->size)
+		return NULL;
+	return ring->data + off;
+}
+
+/* give back the space of the chunk and of the ones before it */
+void
+shmring_release(struct shmring *ring, const struct shmring_chunk *c)
+{
+	if (ring->hdr == NULL)
+		return;
+	atomic_store_explicit(&ring->hdr->tail, c->pos + c->len,
+	    memory_order_release);
+}
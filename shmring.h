@@ -0,0 +1,52 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+/*
+ * A ring of memory shared between the net and the ui process to carry
+ * the body of the replies: net copies the chunks in and sends only
+ * their position over imsg, the ui parses them in place and gives the
+ * space back.
+ */
+
+struct shmring_hdr;
+
+struct shmring {
+	struct shmring_hdr	*hdr;
+	unsigned char		*data;
+	size_t			 size;		/* of data, a power of 2 */
+	uint64_t		 head;		/* only for the producer */
+};
+
+/* what IMSG_SHM_BUF carries */
+struct shmring_chunk {
+	uint64_t		 pos;
+	size_t			 len;
+};
+
+int		 shmring_create(struct shmring *, size_t);
+int		 shmring_map(struct shmring *, int, size_t);
+size_t		 shmring_max_chunk(struct shmring *);
+int		 shmring_put(struct shmring *, const void *, size_t,
+		    struct shmring_chunk *);
+const void	*shmring_get(struct shmring *, const struct shmring_chunk *);
+void		 shmring_release(struct shmring *,
+		    const struct shmring_chunk *);
+
+#endif
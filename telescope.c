@@ -26,38 +26,66 @@
 #include <getopt.h>
 #include <limits.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "bookmarks.h"
 #include "certs.h"
 #include "cmd.h"
 #include "control.h"
 #include "defaults.h"
 #include "ev.h"
 #include "exec.h"
+#include "feeds.h"
 #include "fs.h"
+#include "ftindex.h"
+#include "headless.h"
 #include "hist.h"
 #include "imsgev.h"
 #include "iri.h"
 #include "keymap.h"
 #include "mailcap.h"
 #include "mcache.h"
+#include "memory.h"
 #include "minibuffer.h"
 #include "parser.h"
 #include "parser.h"
+#include "perf.h"
+#include "persist.h"
+#include "pressure.h"
+#include "proxy.h"
+#include "redirects.h"
 #include "session.h"
+#include "shmring.h"
 #include "telescope.h"
 #include "tofu.h"
+#include "trace.h"
 #include "ui.h"
 #include "utils.h"
+#include "watch.h"
 #include "xwrapper.h"
 
 static const struct option longopts[] = {
+	{"control",	no_argument,	NULL,	'X'},
+	{"frame-log",	required_argument, NULL, 'F'},
+	{"headless",	no_argument,	NULL,	'H'},
 	{"help",	no_argument,	NULL,	'h'},
+	{"jobs",	required_argument, NULL, 'j'},
+	{"mirror",	no_argument,	NULL,	'm'},
+	{"perf",	no_argument,	NULL,	'P'},
+	{"record",	required_argument, NULL, 'R'},
+	{"replay",	required_argument, NULL, 'y'},
+	{"replay-paced", no_argument,	NULL,	'g'},
 	{"safe",	no_argument,	NULL,	'S'},
+	{"source",	no_argument,	NULL,	's'},
+	{"trace",	required_argument, NULL, 'r'},
+	{"trace-startup", no_argument,	NULL,	't'},
 	{"version",	no_argument,	NULL,	'v'},
+	{"width",	required_argument, NULL, 'w'},
 	{NULL,		0,		NULL,	0},
 };
 
@@ -77,15 +105,77 @@ int			 operating;
  */
 int			safe_mode;
 
-static struct imsgev	*iev_net;
+static struct imsgev	*iev_persist;
+
+/*
+ * The net processes, and the ring each puts the bodies in, see
+ * shm-ring.  The requests are spread among them by host, so that the
+ * TLS sessions of a host stay in one of them; netroutes remembers
+ * where each request went until it's done.
+ */
+#define NET_WORKERS_MAX	8
+static struct imsgev	 iev_nets[NET_WORKERS_MAX];
+static struct shmring	 body_rings[NET_WORKERS_MAX];
+static int		 nnets = 1;
+
+struct netroute {
+	uint32_t	 id;
+	int		 net;
+};
+static struct ohash	 netroutes;
+
+/* the body bytes to ack to the net process, see imsg_body_done */
+#define BUFACKS		16
+static struct {
+	uint32_t	 id;
+	size_t		 bytes;
+}			 bufacks[BUFACKS];
+static size_t		 nbufacks;
+
+/* the counters of all the net processes, summed as they reply */
+static uint64_t		 net_counters[PERF_MAX];
+static int		 net_counters_pending;
 
 struct tabshead		 tabshead = TAILQ_HEAD_INITIALIZER(tabshead);
 struct tabshead		 ktabshead = TAILQ_HEAD_INITIALIZER(ktabshead);
 struct proxylist	 proxies = TAILQ_HEAD_INITIALIZER(proxies);
 
+/* handshakes done by the net process, and how many were resumed */
+size_t			 tls_handshakes;
+size_t			 tls_resumed;
+
+/*
+ * Pages being prefetched: each one is loaded in a tab that's never
+ * shown and whose only purpose is to end up in the mcache.  The same
+ * machinery is used to revalidate the page shown in the tab target.
+ */
+#define PREFETCH_INFLIGHT	2
+#define PREFETCH_RETRIES	2
+#define FEEDS_INFLIGHT		16
+
+struct prefetch {
+	TAILQ_ENTRY(prefetch)	 entries;
+	int			 started;
+	int			 revalidate;
+	int			 warmup;
+	int			 feed;		/* see feeds.c */
+	int			 retries;	/* after a 44 */
+	size_t			 bytes;
+	uint32_t		 target;
+	struct tab		 tab;
+};
+
+static TAILQ_HEAD(, prefetch)	 prefetches = TAILQ_HEAD_INITIALIZER(prefetches);
+static int			 prefetch_inflight;
+static int			 feeds_inflight;
+static struct ohash		 prefetchids;	/* the started ones */
+static long long		 warmup_next;	/* ns, CLOCK_MONOTONIC */
+static unsigned long		 warmup_timer;
+
 enum telescope_process {
 	PROC_UI,
 	PROC_NET,
+	PROC_PERSIST,
 };
 
 #define CANNOT_FETCH		0
@@ -120,17 +210,37 @@ const char *err_pages[70] = {
 };
 
 static void		 die(void) __attribute__((__noreturn__));
-static struct tab	*tab_by_id(uint32_t);
+static void		 tab_set_meta(struct tab *, const char *);
+static struct prefetch	*prefetch_by_id(uint32_t);
+static struct prefetch	*prefetch_new(const char *, struct iri *);
+static void		 prefetch_free(struct prefetch *);
+static void		 prefetch_stop(struct prefetch *);
+static void		 prefetch_done(struct prefetch *);
+static void		 prefetch_abort(struct prefetch *);
+static void		 revalidate_done(struct prefetch *);
+static void		 prefetch_run(void);
+static void		 prefetch_page(struct tab *);
+static long long	 monotonic_ns(void);
+static void		 warmup_timeout(int, int, void *);
+static void		 warmup_session(void);
+static void		 handle_prefetch_imsg(struct imsgev *, struct prefetch *,
+			    struct imsg *);
+static int		 normalize_code(int);
 static void		 handle_imsg_check_cert(struct imsg *);
 static void		 handle_check_cert_user_choice(int, void *);
 static void		 handle_maybe_save_new_cert(int, void *);
 static void		 handle_maybe_save_page(int, void *);
 static void		 handle_save_page_path(const char *, struct tab *);
 static void		 handle_dispatch_imsg(int, int, void *);
+static void		 netroute_del(uint32_t);
+static void		 handle_persist_imsg(int, int, void *);
 static void		 load_about_url(struct tab *, const char *);
 static void		 load_file_url(struct tab *, const char *);
 static void		 load_finger_url(struct tab *, const char *);
 static void		 load_gemini_url(struct tab *, const char *);
+static const char	*gopher_skip_selector(const char *, int *);
+static void		 gopher_request(struct iri *, const char *,
+			     struct get_req *);
 static void		 load_gopher_url(struct tab *, const char *);
 static void		 load_via_proxy(struct tab *, const char *,
 			     struct proxy *);
@@ -139,6 +249,7 @@ static void		 make_request(struct tab *, struct get_req *, int,
 static void		 do_load_url(struct tab *, const char *, const char *, int);
 static pid_t		 start_child(enum telescope_process, const char *, int);
 static void		 send_url(const char *);
+static void		 query_perf(void);
 
 static const struct proto {
 	const char	*schema;
@@ -161,17 +272,735 @@ die(void)
 	abort(); 		/* TODO */
 }
 
+static void
+tab_set_meta(struct tab *tab, const char *meta)
+{
+	if (strlen(meta) >= GEMINI_URL_LEN)
+		die();
+	free(tab->meta);
+	tab->meta = xstrdup(meta);
+}
+
+static struct prefetch *
+prefetch_by_id(uint32_t id)
+{
+	return idmap_get(&prefetchids, id);
+}
+
+static struct prefetch *
+prefetch_new(const char *url, struct iri *iri)
+{
+	struct prefetch	*p;
+
+	p = xcalloc(1, sizeof(*p));
+	if ((p->tab.hist = hist_new(HIST_LINEAR)) == NULL ||
+	    hist_push(p->tab.hist, url) == -1) {
+		hist_free(p->tab.hist);
+		free(p);
+		return NULL;
+	}
+	TAILQ_INIT(&p->tab.buffer.head);
+	p->tab.iri = xmalloc(sizeof(*p->tab.iri));
+	memcpy(p->tab.iri, iri, sizeof(*iri));
+	return p;
+}
+
+/* the request of p is over, it may be started again */
+static void
+prefetch_stop(struct prefetch *p)
+{
+	if (p->feed)
+		feeds_inflight--;
+	else
+		prefetch_inflight--;
+	idmap_del(&prefetchids, p->tab.id, p);
+	p->started = 0;
+}
+
+static void
+prefetch_free(struct prefetch *p)
+{
+	long long	 now;
+	int		 started = p->started;
+
+	if (p->started)
+		prefetch_stop(p);
+
+	/* the next warm-up waits for what this one took */
+	if (started && p->warmup && warmup_rate > 0) {
+		now = monotonic_ns();
+		if (warmup_next < now)
+			warmup_next = now;
+		warmup_next += (long long)p->bytes * 1000000000LL /
+		    warmup_rate;
+	}
+
+	TAILQ_REMOVE(&prefetches, p, entries);
+	hist_free(p->tab.hist);
+	free(p->tab.iri);
+	free(p->tab.meta);
+	free(p->tab.buffer.buf);
+	arena_free(&p->tab.buffer.line_arena);
+	free(p->tab.buffer.vlines);
+	free(p->tab.buffer.vis);
+	free(p->tab.buffer.headings.refs);
+	free(p->tab.buffer.links.refs);
+	free(p);
+}
+
+static void
+prefetch_done(struct prefetch *p)
+{
+	prefetch_free(p);
+	prefetch_run();
+}
+
+static long long
+monotonic_ns(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void
+warmup_timeout(int fd, int ev, void *data)
+{
+	prefetch_run();
+}
+
+/*
+ * Start the queued prefetches, but never more than PREFETCH_INFLIGHT
+ * at a time and only while the current tab isn't loading, so that
+ * they don't compete with what the user is waiting for.  Warm-ups
+ * are also kept under warmup-rate on average.  The feeds were asked
+ * for explicitly instead: up to FEEDS_INFLIGHT of them start at once,
+ * the net process keeping them within its own limits per host.
+ */
+static void
+prefetch_run(void)
+{
+	struct prefetch	*p, *tp;
+	struct get_req	 req;
+	struct timeval	 tv;
+	const char	*path;
+	long long	 wait;
+	int		 type, busy;
+
+	busy = current_tab != NULL && current_tab->loading_anim;
+
+	TAILQ_FOREACH_SAFE(p, &prefetches, entries, tp) {
+		if (p->started)
+			continue;
+		if (p->feed ? feeds_inflight >= FEEDS_INFLIGHT :
+		    busy || prefetch_inflight >= PREFETCH_INFLIGHT)
+			continue;
+
+		if (p->warmup) {
+			/* the tab was shown in the meantime */
+			if (mcache_has(hist_cur(p->tab.hist))) {
+				prefetch_free(p);
+				continue;
+			}
+
+			wait = warmup_next - monotonic_ns();
+			if (warmup_rate > 0 && wait > 0) {
+				if (!ev_timer_pending(warmup_timer)) {
+					tv.tv_sec = wait / 1000000000LL;
+					tv.tv_usec = wait % 1000000000LL / 1000;
+					warmup_timer = ev_timer(&tv,
+					    warmup_timeout, NULL);
+				}
+				continue;
+			}
+		}
+
+		memset(&req, 0, sizeof(req));
+		strlcpy(req.host, p->tab.iri->iri_host, sizeof(req.host));
+		strlcpy(req.port, p->tab.iri->iri_portstr, sizeof(req.port));
+		if (!strcmp(p->tab.iri->iri_scheme, "gopher")) {
+			/* there's no reply header to pick the parser */
+			path = gopher_skip_selector(p->tab.iri->iri_path,
+			    &type);
+			parser_init(&p->tab.buffer, type == '0' ?
+			    &textplain_parser : &gophermap_parser);
+			gopher_request(p->tab.iri, path, &req);
+			req.proto = PROTO_GOPHER;
+		} else {
+			strlcpy(req.req, hist_cur(p->tab.hist),
+			    sizeof(req.req));
+			strlcat(req.req, "\r\n", sizeof(req.req));
+			req.proto = PROTO_GEMINI;
+		}
+		if (p->revalidate)
+			req.prio = PRIO_REVALIDATE;
+		else if (p->warmup)
+			req.prio = PRIO_BACKGROUND;
+		else
+			req.prio = PRIO_PREFETCH;
+
+		p->started = 1;
+		p->tab.id = tab_new_id();
+		idmap_put(&prefetchids, p->tab.id, p);
+		clock_gettime(CLOCK_MONOTONIC, &p->tab.load_start);
+		if (p->feed)
+			feeds_inflight++;
+		else
+			prefetch_inflight++;
+		ui_send_net(IMSG_GET, p->tab.id, -1, &req, sizeof(req));
+	}
+}
+
+/*
+ * Return the target of the link, resolved against the URL of the
+ * page.  It's computed on first use and then kept in the index, in
+ * the buffer arena, until the URL of the page changes, e.g. after a
+ * redirect.  Links that can't be resolved are returned as they are.
+ */
+const char *
+link_url(struct tab *tab, struct lineref *ref)
+{
+	struct buffer	*buffer = &tab->buffer;
+	const char	*base;
+	char		 buf[GEMINI_URL_LEN];
+	size_t		 i;
+
+	if ((base = hist_cur(tab->hist)) == NULL)
+		base = "";
+	if (buffer->links_base == NULL ||
+	    strcmp(buffer->links_base, base) != 0) {
+		for (i = 0; i < buffer->links.len; ++i)
+			buffer->links.refs[i].cache = NULL;
+		buffer->links_base = arena_strdup(&buffer->line_arena, base);
+	}
+
+	if (ref->cache != NULL || ref->line->alt == NULL)
+		return ref->cache;
+
+	if (iri_resolve(*base != '\0' ? base : NULL, ref->line->alt, buf,
+	    sizeof(buf), NULL) == -1)
+		ref->cache = ref->line->alt;
+	else
+		ref->cache = arena_strdup(&tab->buffer.line_arena, buf);
+	return ref->cache;
+}
+
+/* Like link_url, for a link line that's not known to be indexed. */
+const char *
+line_url(struct tab *tab, struct line *l)
+{
+	struct lineref	*ref;
+
+	if ((ref = lineidx_find(&tab->buffer, &tab->buffer.links, l)) == NULL)
+		return l->alt;
+	return link_url(tab, ref);
+}
+
+/*
+ * Once the cursor rests on a link for preconnect_delay milliseconds
+ * the net process is asked to connect to its host, so that following
+ * it doesn't have to wait for the resolver and the handshake.
+ * Nothing is requested, and client certificates are never used.
+ */
+static unsigned int	 preconnect_timer;
+static uint32_t		 preconnect_tab;
+static struct line	*preconnect_line;
+
+static void
+preconnect_fire(int fd, int ev, void *d)
+{
+	const struct proto	*pr;
+	struct proxy		*p;
+	struct vline		*vl;
+	struct get_req		 req;
+	struct iri		 iri;
+	const char		*url;
+	int			 temp;
+
+	preconnect_timer = 0;
+	vl = current_tab->buffer.current_line;
+	if (current_tab->id != preconnect_tab || vl == NULL ||
+	    vl->parent != preconnect_line)
+		return;
+
+	if ((url = line_url(current_tab, vl->parent)) == NULL ||
+	    iri_parse(NULL, url, &iri) == -1)
+		return;
+
+	memset(&req, 0, sizeof(req));
+	for (pr = protos; pr->schema != NULL; ++pr)
+		if (!strcmp(iri.iri_scheme, pr->schema))
+			break;
+	if (pr->schema != NULL) {
+		/* about: and file: */
+		if (pr->port == NULL)
+			return;
+		if (*iri.iri_portstr == '\0')
+			iri_setport(&iri, pr->port);
+		if (!strcmp(pr->schema, "gemini"))
+			req.proto = PROTO_GEMINI;
+		else if (!strcmp(pr->schema, "gopher"))
+			req.proto = PROTO_GOPHER;
+		else
+			req.proto = PROTO_FINGER;
+		strlcpy(req.host, iri.iri_host, sizeof(req.host));
+		strlcpy(req.port, iri.iri_portstr, sizeof(req.port));
+	} else {
+		if ((p = proxy_pick(iri.iri_scheme, NULL)) == NULL)
+			return;
+		req.proto = p->proto;
+		strlcpy(req.host, p->host, sizeof(req.host));
+		strlcpy(req.port, p->port, sizeof(req.port));
+	}
+
+	if (req.proto == PROTO_GEMINI && cert_for(&iri, &temp) != NULL)
+		return;
+
+	ui_send_net(IMSG_PRECONNECT, 0, -1, &req, sizeof(req));
+}
+
+/* called after the keys are processed, see preconnect_fire */
+void
+preconnect_link(void)
+{
+	struct vline	*vl;
+	struct timeval	 tv;
+
+	vl = current_tab->buffer.current_line;
+	if (preconnect_delay <= 0 || vl == NULL ||
+	    vl->parent->type != LINE_LINK) {
+		preconnect_line = NULL;
+		if (preconnect_timer != 0)
+			ev_timer_cancel(preconnect_timer);
+		preconnect_timer = 0;
+		return;
+	}
+
+	if (current_tab->id == preconnect_tab && vl->parent == preconnect_line)
+		return;
+
+	preconnect_tab = current_tab->id;
+	preconnect_line = vl->parent;
+	if (preconnect_timer != 0)
+		ev_timer_cancel(preconnect_timer);
+	tv.tv_sec = preconnect_delay / 1000;
+	tv.tv_usec = (preconnect_delay % 1000) * 1000;
+	preconnect_timer = ev_timer(&tv, preconnect_fire, NULL);
+}
+
+/*
+ * Queue the first prefetch links of the page that point to the same
+ * host and aren't cached yet.
+ */
+static void
+prefetch_page(struct tab *tab)
+{
+	struct prefetch	*p;
+	struct lineref	*ref;
+	struct iri	 iri;
+	const char	*base, *url;
+	int		 n = 0, temp;
+
+	if (prefetch <= 0 || tab->buffer.parser != &gemtext_parser)
+		return;
+
+	base = hist_cur(tab->hist);
+	for (ref = tab->buffer.links.refs; ref != NULL && ref->line != NULL;
+	    ref++) {
+		if (n == prefetch)
+			break;
+		if ((url = link_url(tab, ref)) == NULL)
+			continue;
+
+		if (iri_parse(NULL, url, &iri) == -1 ||
+		    strcmp(iri.iri_scheme, "gemini") != 0 ||
+		    strcmp(iri.iri_host, tab->iri->iri_host) != 0 ||
+		    strcmp(iri.iri_portstr, tab->iri->iri_portstr) != 0)
+			continue;
+
+		/* never send a client certificate behind the user back */
+		if (cert_for(&iri, &temp) != NULL)
+			continue;
+
+		if (!strcmp(url, base) || mcache_has(url) ||
+		    fs_mirror_has(&iri))
+			continue;
+
+		TAILQ_FOREACH(p, &prefetches, entries)
+			if (!strcmp(hist_cur(p->tab.hist), url))
+				break;
+		if (p != NULL)
+			continue;
+
+		if ((p = prefetch_new(url, &iri)) == NULL)
+			return;
+		TAILQ_INSERT_TAIL(&prefetches, p, entries);
+		n++;
+	}
+
+	prefetch_run();
+}
+
+static int
+warmup_cmp(const void *a, const void *b)
+{
+	const struct tab	*ta = *(struct tab * const *)a;
+	const struct tab	*tb = *(struct tab * const *)b;
+
+	if (ta->active > tb->active)
+		return -1;
+	return ta->active < tb->active;
+}
+
+/*
+ * Queue the fetch of the pages of the restored tabs, the most recently
+ * used first, so that switching to them later doesn't hit the network.
+ */
+static void
+warmup_session(void)
+{
+	struct prefetch	*p;
+	struct tab	*tab, **tabs = NULL;
+	struct iri	 iri;
+	const char	*url;
+	size_t		 i, n = 0, cap = 0;
+	int		 temp, type;
+
+	if (warmup_tabs <= 0)
+		return;
+
+	TAILQ_FOREACH(tab, &tabshead, tabs) {
+		if (!(tab->flags & TAB_LAZY) || tab == current_tab)
+			continue;
+		url = hist_cur(tab->hist);
+		if (mcache_has(url) || iri_parse(NULL, url, &iri) == -1)
+			continue;
+		if (!strcmp(iri.iri_scheme, "gopher")) {
+			/* only menus and text, not searches */
+			gopher_skip_selector(iri.iri_path, &type);
+			if (type != '0' && type != '1')
+				continue;
+		} else if (strcmp(iri.iri_scheme, "gemini") != 0 ||
+		    cert_for(&iri, &temp) != NULL)
+			continue;
+		if (n == cap) {
+			cap = cap == 0 ? 16 : cap * 2;
+			tabs = xreallocarray(tabs, cap, sizeof(*tabs));
+		}
+		tabs[n++] = tab;
+	}
+	if (n > 0)
+		qsort(tabs, n, sizeof(*tabs), warmup_cmp);
+
+	for (i = 0; i < n && i < (size_t)warmup_tabs; ++i) {
+		url = hist_cur(tabs[i]->hist);
+		if (iri_parse(NULL, url, &iri) == -1 ||
+		    (p = prefetch_new(url, &iri)) == NULL)
+			continue;
+		p->warmup = 1;
+		TAILQ_INSERT_TAIL(&prefetches, p, entries);
+	}
+	free(tabs);
+
+	prefetch_run();
+}
+
+/*
+ * Returns the tab a revalidation was started for, if it's still
+ * showing the same page.
+ */
 static struct tab *
-tab_by_id(uint32_t id)
+revalidate_target(struct prefetch *p)
+{
+	struct tab	*tab;
+
+	if (!p->revalidate || (tab = tab_by_id(p->target)) == NULL ||
+	    tab->loading_anim || strcmp(hist_cur(tab->hist),
+	    hist_cur(p->tab.hist)) != 0)
+		return NULL;
+	return tab;
+}
+
+/* Drop the prefetch; failed revalidations fall back to a reload. */
+static void
+prefetch_abort(struct prefetch *p)
+{
+	struct tab	*tab;
+
+	if ((tab = revalidate_target(p)) != NULL)
+		load_url_in_tab(tab, hist_cur(tab->hist), NULL,
+		    LU_MODE_NOHIST|LU_MODE_NOCACHE|LU_MODE_NOMIRROR);
+	if (p->feed)
+		feed_failed(hist_cur(p->tab.hist));
+	prefetch_done(p);
+}
+
+static int
+same_lines(struct buffer *a, struct buffer *b)
+{
+	struct line	*x, *y;
+
+	x = TAILQ_FIRST(&a->head);
+	y = TAILQ_FIRST(&b->head);
+	for (; x != NULL && y != NULL;
+	    x = TAILQ_NEXT(x, lines), y = TAILQ_NEXT(y, lines)) {
+		if (x->type != y->type ||
+		    (x->line == NULL) != (y->line == NULL) ||
+		    (x->alt == NULL) != (y->alt == NULL) ||
+		    (x->line != NULL && strcmp(x->line, y->line) != 0) ||
+		    (x->alt != NULL && strcmp(x->alt, y->alt) != 0))
+			return 0;
+	}
+
+	return x == NULL && y == NULL;
+}
+
+/*
+ * The fresh copy of the page is in p; swap it in the target tab,
+ * keeping the scroll position, only if it's actually different.
+ */
+static void
+revalidate_done(struct prefetch *p)
+{
+	struct tab	*tab;
+	struct relayout	 rl;
+	size_t		 line_off, curr_off;
+
+	if ((tab = revalidate_target(p)) == NULL)
+		goto done;
+
+	if (same_lines(&tab->buffer, &p->tab.buffer) &&
+	    !strcmp(tab->buffer.title, p->tab.buffer.title)) {
+		message("%s is up to date", hist_cur(tab->hist));
+		goto done;
+	}
+
+	get_scroll_position(tab, &line_off, &curr_off);
+	hist_set_offs(tab->hist, line_off, curr_off);
+
+	/* only what changed needs to be wrapped again */
+	relayout_save(&tab->buffer, &rl);
+
+	if (mcache_tab(&p->tab) == -1 ||
+	    !mcache_lookup(hist_cur(tab->hist), tab)) {
+		/* too big for the cache */
+		relayout_free(&rl);
+		load_url_in_tab(tab, hist_cur(tab->hist), NULL,
+		    LU_MODE_NOHIST|LU_MODE_NOCACHE|LU_MODE_NOMIRROR);
+		goto done;
+	}
+
+	if (relayout_apply(&tab->buffer, &rl, body_cols)) {
+		get_scroll_position(tab, &line_off, &curr_off);
+		hist_set_offs(tab->hist, line_off, curr_off);
+	}
+	relayout_free(&rl);
+
+	ui_on_tab_refresh(tab);
+	ui_on_tab_loaded(tab);
+
+done:
+	prefetch_done(p);
+}
+
+/*
+ * Reload the page in tab showing the cached copy while a fresh one is
+ * being fetched in the background.  Returns 0 if the page can't be
+ * revalidated this way.
+ */
+int
+revalidate_page(struct tab *tab)
+{
+	struct prefetch	*p;
+	const char	*url;
+	int		 temp;
+
+	url = hist_cur(tab->hist);
+	if (tab->loading_anim || tab->proxy != NULL || tab->iri == NULL ||
+	    url == NULL ||
+	    strncmp(url, "gemini://", 9) != 0 || !mcache_has(url) ||
+	    cert_for(tab->iri, &temp) != NULL)
+		return 0;
+
+	TAILQ_FOREACH(p, &prefetches, entries) {
+		if (p->revalidate && p->target == tab->id)
+			return 1;
+	}
+
+	if ((p = prefetch_new(url, tab->iri)) == NULL)
+		return 0;
+	p->revalidate = 1;
+	p->target = tab->id;
+	TAILQ_INSERT_HEAD(&prefetches, p, entries);
+
+	message("Revalidating %s...", url);
+	prefetch_run();
+	return 1;
+}
+
+/*
+ * Fetch the feed at url in the background for feeds.c, that's told
+ * how it went with feed_fetched or feed_failed.
+ */
+int
+prefetch_feed(const char *url)
+{
+	struct prefetch	*p;
+	struct iri	 iri;
+	int		 temp;
+
+	if (iri_parse(NULL, url, &iri) == -1 ||
+	    strcmp(iri.iri_scheme, "gemini") != 0 ||
+	    cert_for(&iri, &temp) != NULL ||
+	    (p = prefetch_new(url, &iri)) == NULL)
+		return -1;
+	p->feed = 1;
+	TAILQ_INSERT_TAIL(&prefetches, p, entries);
+	prefetch_run();
+	return 0;
+}
+
+/*
+ * The body carried by an IMSG_BUF, or by an IMSG_SHM_BUF in the ring
+ * shared with the net process.
+ */
+static const char *
+imsg_body(struct imsgev *iev, struct imsg *imsg, size_t *len)
 {
-	struct tab *t;
+	struct shmring_chunk	 c;
+	const char		*data;
 
-	TAILQ_FOREACH(t, &tabshead, tabs) {
-		if (t->id == id)
-			return t;
+	if (imsg_get_type(imsg) == IMSG_BUF) {
+		*len = imsg_get_len(imsg);
+		return imsg->data;
 	}
 
-	return NULL;
+	if (imsg_get_data(imsg, &c, sizeof(c)) == -1 ||
+	    (data = shmring_get(&body_rings[iev - iev_nets], &c)) == NULL)
+		die();
+	*len = c.len;
+	return data;
+}
+
+/* tell the net process how much of the bodies was handled */
+static void
+bufacks_flush(struct imsgev *iev)
+{
+	size_t	 i;
+
+	for (i = 0; i < nbufacks; ++i)
+		imsg_compose_event(iev, IMSG_BUF_ACK, bufacks[i].id, 0, -1,
+		    &bufacks[i].bytes, sizeof(bufacks[i].bytes));
+	nbufacks = 0;
+}
+
+/*
+ * Once a body message is handled, give back the space in the ring
+ * and account it for the ack sent at the end of the batch.
+ */
+static void
+imsg_body_done(struct imsgev *iev, struct imsg *imsg)
+{
+	struct shmring_chunk	 c;
+	uint32_t		 id;
+	size_t			 i, len;
+
+	if (imsg_get_type(imsg) == IMSG_BUF)
+		len = imsg_get_len(imsg);
+	else if (imsg_get_type(imsg) == IMSG_SHM_BUF &&
+	    imsg_get_data(imsg, &c, sizeof(c)) != -1) {
+		shmring_release(&body_rings[iev - iev_nets], &c);
+		len = c.len;
+	} else
+		return;
+
+	id = imsg_get_id(imsg);
+	for (i = 0; i < nbufacks; ++i)
+		if (bufacks[i].id == id)
+			break;
+	if (i == nbufacks) {
+		if (nbufacks == BUFACKS)
+			bufacks_flush(iev);
+		i = nbufacks++;
+		bufacks[i].id = id;
+		bufacks[i].bytes = 0;
+	}
+	bufacks[i].bytes += len;
+}
+
+/*
+ * Let the net process go on with the body, asking it to parse it
+ * too when it's gemtext, see parse-in-net.
+ */
+static void
+send_proceed(struct tab *tab)
+{
+	int	 parse = 0;
+
+	if (parse_in_net && tab->buffer.parser == &gemtext_parser) {
+		tab->buffer.parser_flags |= PARSER_RECORDS;
+		parse = 1;
+	}
+	ui_send_net(IMSG_PROCEED, tab->id, -1, &parse, sizeof(parse));
+}
+
+static void
+handle_prefetch_imsg(struct imsgev *iev, struct prefetch *p,
+    struct imsg *imsg)
+{
+	struct ibuf	 ibuf;
+	const char	*body;
+	char		*str;
+	size_t		 len;
+	int		 code;
+
+	switch (imsg_get_type(imsg)) {
+	case IMSG_REPLY:
+		if (imsg_get_ibuf(imsg, &ibuf) == -1 ||
+		    ibuf_get(&ibuf, &code, sizeof(code)) == -1 ||
+		    ibuf_borrow_str(&ibuf, &str) == -1)
+			die();
+		tab_set_meta(&p->tab, str);
+		/* the net process holds the next try until it's time */
+		if (code == 44 && p->retries++ < PREFETCH_RETRIES) {
+			stop_tab(&p->tab);
+			prefetch_stop(p);
+			prefetch_run();
+			break;
+		}
+		/* redirects, input requests and errors aren't followed */
+		if (normalize_code(code) != 20 || !setup_parser_for(&p->tab)) {
+			stop_tab(&p->tab);
+			prefetch_abort(p);
+			break;
+		}
+		send_proceed(&p->tab);
+		break;
+	case IMSG_BUF:
+	case IMSG_SHM_BUF:
+		body = imsg_body(iev, imsg, &len);
+		if (!parser_parse(&p->tab.buffer, body, len))
+			die();
+		p->bytes += len;
+		break;
+	case IMSG_EOF:
+		if (!parser_free(&p->tab))
+			die();
+		if (p->revalidate)
+			revalidate_done(p);
+		else if (p->feed) {
+			feed_fetched(&p->tab);
+			prefetch_done(p);
+		} else {
+			mcache_tab(&p->tab);
+			prefetch_done(p);
+		}
+		break;
+	case IMSG_ERR:
+		prefetch_abort(p);
+		break;
+	}
 }
 
 static void
@@ -183,44 +1012,57 @@ handle_imsg_check_cert(struct imsg *imsg)
 	struct ibuf		 ibuf;
 	struct tofu_entry	*e;
 	struct tab		*tab;
-	size_t			 datalen;
+	struct prefetch		*p;
+	int			 resumed, known;
 
 	if (imsg_get_ibuf(imsg, &ibuf) == -1 ||
+	    ibuf_get(&ibuf, &resumed, sizeof(resumed)) == -1 ||
+	    ibuf_get(&ibuf, &known, sizeof(known)) == -1 ||
 	    ibuf_borrow_str(&ibuf, &hash) == -1)
 		abort();
-	datalen = strlen(hash);
 
-	if ((tab = tab_by_id(imsg_get_id(imsg))) == NULL)
+	tls_handshakes++;
+	if (resumed)
+		tls_resumed++;
+
+	if ((tab = tab_by_id(imsg_get_id(imsg))) == NULL) {
+		if ((p = prefetch_by_id(imsg_get_id(imsg))) == NULL)
+			return;
+
+		/* only proceed for already known and matching hosts */
+		e = tofu_lookup(&certs, p->tab.iri->iri_host,
+		    p->tab.iri->iri_portstr);
+		tofu_res = e != NULL && !strcmp(hash, e->hash);
+		if (!known)
+			ui_send_net(IMSG_CERT_STATUS, imsg->hdr.peerid, -1,
+			    &tofu_res, sizeof(tofu_res));
+		if (!tofu_res)
+			prefetch_abort(p);
+		else if (e->verified == -1)
+			p->tab.trust = TS_TEMP_TRUSTED;
+		else if (e->verified == 1)
+			p->tab.trust = TS_VERIFIED;
+		else
+			p->tab.trust = TS_TRUSTED;
 		return;
+	}
 
 	if (tab->proxy != NULL) {
 		host = tab->proxy->host;
 		port = tab->proxy->port;
 	} else {
-		host = tab->iri.iri_host;
-		port = tab->iri.iri_portstr;
+		host = tab->iri->iri_host;
+		port = tab->iri->iri_portstr;
 	}
 
 	if ((e = tofu_lookup(&certs, host, port)) == NULL) {
-		/* TODO: an update in libressl/libretls changed
-		 * significantly.  Find a better approach at storing
-		 * the certs! */
-		if (datalen > sizeof(e->hash))
-			abort();
-
 		tofu_res = 1;	/* trust on first use */
-		e = xcalloc(1, sizeof(*e));
-		strlcpy(e->domain, host, sizeof(e->domain));
-		if (*port != '\0' && strcmp(port, "1965")) {
-			strlcat(e->domain, ":", sizeof(e->domain));
-			strlcat(e->domain, port, sizeof(e->domain));
-		}
-		strlcpy(e->hash, hash, sizeof(e->hash));
-		tofu_save(&certs, e);
+		e = tofu_save(&certs, host, port, hash);
 	} else
 		tofu_res = !strcmp(hash, e->hash);
 
-	if (tofu_res) {
+	/* known matching hosts don't wait for the reply */
+	if (tofu_res || known) {
 		if (e->verified == -1)
 			tab->trust = TS_TEMP_TRUSTED;
 		else if (e->verified == 1)
@@ -228,8 +1070,9 @@ handle_imsg_check_cert(struct imsg *imsg)
 		else
 			tab->trust = TS_TRUSTED;
 
-		ui_send_net(IMSG_CERT_STATUS, imsg->hdr.peerid, -1,
-		    &tofu_res, sizeof(tofu_res));
+		if (!known)
+			ui_send_net(IMSG_CERT_STATUS, imsg->hdr.peerid, -1,
+			    &tofu_res, sizeof(tofu_res));
 	} else {
 		tab->trust = TS_UNTRUSTED;
 		load_page_from_str(tab, "# Certificate mismatch\n");
@@ -250,8 +1093,8 @@ handle_check_cert_user_choice(int accept, void *d)
 	if (accept) {
 		const char *host, *port;
 
-		host = tab->iri.iri_host;
-		port = tab->iri.iri_portstr;
+		host = tab->iri->iri_host;
+		port = tab->iri->iri_portstr;
 
 		/*
 		 * trust the certificate for this session only.  If
@@ -278,30 +1121,20 @@ static void
 handle_maybe_save_new_cert(int accept, void *data)
 {
 	struct tab *tab = data;
-	struct tofu_entry *e;
 	const char *host, *port;
 
 	if (tab->proxy != NULL) {
 		host = tab->proxy->host;
 		port = tab->proxy->port;
 	} else {
-		host = tab->iri.iri_host;
-		port = tab->iri.iri_portstr;
+		host = tab->iri->iri_host;
+		port = tab->iri->iri_portstr;
 	}
 
 	if (!accept)
 		goto end;
 
-	e = xcalloc(1, sizeof(*e));
-
-	strlcpy(e->domain, host, sizeof(e->domain));
-	if (*port != '\0' && strcmp(port, "1965")) {
-		strlcat(e->domain, ":", sizeof(e->domain));
-		strlcat(e->domain, port, sizeof(e->domain));
-	}
-	strlcpy(e->hash, tab->cert, sizeof(e->hash));
-
-	tofu_update_persist(&certs, e);
+	tofu_update_persist(&certs, host, port, tab->cert);
 
 	tab->trust = TS_TRUSTED;
 
@@ -310,7 +1143,7 @@ end:
 	tab->cert = NULL;
 }
 
-static inline int
+static int
 normalize_code(int n)
 {
 	if (n < 20) {
@@ -339,13 +1172,37 @@ normalize_code(int n)
 		return MALFORMED_RESPONSE;
 }
 
+/* save where the reply redirects to, unless it depends on the request */
+static void
+remember_redirect(struct tab *tab)
+{
+	struct iri	 iri;
+	const char	*from;
+	char		 to[GEMINI_URL_LEN];
+
+	from = hist_cur(tab->hist);
+	if (tab->client_cert != NULL || strchr(from, '?') != NULL)
+		return;
+	if (iri_parse(from, tab->meta, &iri) == -1 ||
+	    iri_unparse(&iri, to, sizeof(to)) == -1)
+		return;
+	redirect_add(from, to, tab->code == 31);
+}
+
 static void
 handle_request_response(struct tab *tab)
 {
 	char		 buf[128];
 
-	if (tab->code != 30 && tab->code != 31)
+	if (tab->code != 30 && tab->code != 31) {
 		tab->redirect_count = 0;
+		/* a remembered redirect that leads nowhere anymore */
+		if (tab->redirect_src != NULL && tab->code >= 40 &&
+		    tab->code < 60)
+			redirect_forget(tab->redirect_src);
+		free(tab->redirect_src);
+		tab->redirect_src = NULL;
+	}
 
 	if (tab->code < 10) {	/* internal errors */
 		load_page_from_str(tab, err_pages[tab->code]);
@@ -358,7 +1215,7 @@ handle_request_response(struct tab *tab)
 	} else if (tab->code == 20) {
 		history_add(hist_cur(tab->hist));
 		if (setup_parser_for(tab)) {
-			ui_send_net(IMSG_PROCEED, tab->id, -1, NULL, 0);
+			send_proceed(tab);
 		} else if (safe_mode) {
 			load_page_from_str(tab,
 			    err_pages[UNKNOWN_TYPE_OR_CSET]);
@@ -375,9 +1232,11 @@ handle_request_response(struct tab *tab)
 		if (tab->redirect_count > 5) {
 			load_page_from_str(tab,
 			    err_pages[TOO_MANY_REDIRECTS]);
-		} else
+		} else {
+			remember_redirect(tab);
 			do_load_url(tab, tab->meta, hist_cur(tab->hist),
 			    LU_MODE_NOCACHE);
+		}
 	} else { /* 4x, 5x & 6x */
 		load_page_from_str(tab, err_pages[tab->code]);
 		if (tab->code >= 60)
@@ -400,7 +1259,7 @@ handle_maybe_save_page(int dosave, void *data)
 		return;
 	}
 
-	if ((f = strrchr(tab->iri.iri_path, '/')) == NULL)
+	if ((f = strrchr(tab->iri->iri_path, '/')) == NULL)
 		f = "";
 	else
 		f++;
@@ -431,28 +1290,44 @@ handle_save_page_path(const char *path, struct tab *tab)
 	ui_show_downloads_pane();
 	d = enqueue_download(tab->id, path, tab->meta);
 	d->fd = fd;
-	ui_send_net(IMSG_PROCEED, d->id, -1, NULL, 0);
+
+	/* the net process writes the file */
+	if ((fd = dup(d->fd)) == -1) {
+		message("Can't save to %s: %s", path, strerror(errno));
+		stop_tab(tab);
+		close(d->fd);
+		d->fd = -1;
+		ui_on_download_refresh();
+		return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &d->start);
+	ui_send_net(IMSG_PROCEED, d->id, fd, NULL, 0);
 
 	/*
 	 * Change this tab id, the old one is associated with the
 	 * download now.
 	 */
-	tab->id = tab_new_id();
+	tab_renew_id(tab);
 }
 
 static void
 handle_dispatch_imsg(int fd, int event, void *data)
 {
+	uint64_t	 counters[PERF_MAX];
 	struct imsgev	*iev = data;
 	struct imsgbuf	*imsgbuf = &iev->ibuf;
 	struct imsg	 imsg;
 	struct ibuf	 ibuf;
 	struct tab	*tab;
-	struct download	*d;
-	const char	*h;
+	struct download	*d = NULL;
+	struct prefetch	*p;
+	struct proxy	*proxy;
+	const char	*h, *body;
 	char		*str, *page;
+	size_t		 bytes;
 	ssize_t		 n;
-	int		 code;
+	uint64_t	 t;
+	int		 code, i;
 
 	if (event & EV_READ) {
 		if ((n = imsg_read(imsgbuf)) == -1 && errno != EAGAIN)
@@ -473,21 +1348,63 @@ handle_dispatch_imsg(int fd, int event, void *data)
 		if (n == 0)
 			break;
 
+		perf_count(PERF_IMSG_IN, 1);
+		perf_count(PERF_IMSG_IN_BYTES, imsg_get_len(&imsg));
+
+		if (imsg_get_type(&imsg) == IMSG_EOF ||
+		    imsg_get_type(&imsg) == IMSG_ERR)
+			netroute_del(imsg_get_id(&imsg));
+
+		if (imsg_get_type(&imsg) != IMSG_CHECK_CERT &&
+		    (p = prefetch_by_id(imsg_get_id(&imsg))) != NULL) {
+			handle_prefetch_imsg(iev, p, &imsg);
+			imsg_body_done(iev, &imsg);
+			imsg_free(&imsg);
+			continue;
+		}
+
 		switch (imsg_get_type(&imsg)) {
 		case IMSG_ERR:
-			if ((tab = tab_by_id(imsg_get_id(&imsg))) == NULL)
+			if ((tab = tab_by_id(imsg_get_id(&imsg))) == NULL &&
+			    ((d = download_by_id(imsg_get_id(&imsg)))) == NULL)
 				break;
 			if (imsg_get_ibuf(&imsg, &ibuf) == -1 ||
 			    ibuf_borrow_str(&ibuf, &str) == -1)
 				die();
+			if (tab == NULL) {
+				message("Download failed: %s", str);
+				close(d->fd);
+				d->fd = -1;
+				ui_on_download_refresh();
+				break;
+			}
+			trace_request(tab->id, 0, NULL);
+			if ((proxy = tab->proxy) != NULL) {
+				/* try the next best one */
+				proxy_failed(proxy);
+				proxy = proxy_pick(tab->iri->iri_scheme, proxy);
+				if (proxy != NULL && !proxy_down(proxy)) {
+					load_via_proxy(tab, NULL, proxy);
+					break;
+				}
+			}
 			xasprintf(&page, "# Error loading %s\n\n> %s\n",
 				  hist_cur(tab->hist), str);
 			load_page_from_str(tab, page);
 			free(page);
 			break;
 		case IMSG_CHECK_CERT:
+			trace_instant("IMSG_CHECK_CERT", imsg_get_id(&imsg),
+			    NULL);
 			handle_imsg_check_cert(&imsg);
 			break;
+		case IMSG_BACKOFF:
+			if ((tab = tab_by_id(imsg_get_id(&imsg))) == NULL)
+				break;
+			if (imsg_get_data(&imsg, &code, sizeof(code)) == -1)
+				die();
+			tab->backoff_until = time(NULL) + code;
+			break;
 		case IMSG_REPLY:
 			if ((tab = tab_by_id(imsg_get_id(&imsg))) == NULL)
 				break;
@@ -495,34 +1412,38 @@ handle_dispatch_imsg(int fd, int event, void *data)
 			    ibuf_get(&ibuf, &code, sizeof(code)) == -1 ||
 			    ibuf_borrow_str(&ibuf, &str) == -1)
 				die();
-			if (strlcpy(tab->meta, str, sizeof(tab->meta)) >=
-			    sizeof(tab->meta))
-				die();
+			trace_instant("IMSG_REPLY", tab->id, str);
+			tab_set_meta(tab, str);
 			tab->code = normalize_code(code);
 			handle_request_response(tab);
 			break;
 		case IMSG_BUF:
+		case IMSG_SHM_BUF:
 			if ((tab = tab_by_id(imsg_get_id(&imsg))) == NULL &&
 			    ((d = download_by_id(imsg_get_id(&imsg)))) == NULL)
-				return;
+				break;
 
 			if (tab) {
-				if (!parser_parse(&tab->buffer, imsg.data,
-				    imsg_get_len(&imsg)))
+				t = perf_usec();
+				body = imsg_body(iev, &imsg, &bytes);
+				if (!parser_parse(&tab->buffer, body, bytes))
 					die();
-				ui_on_tab_refresh(tab);
-			} else {
-				size_t datalen = imsg_get_len(&imsg);
-
-				d->bytes += datalen;
-				write(d->fd, imsg.data, datalen);
-				ui_on_download_refresh();
+				trace_span("parse", tab->id, t, perf_usec(),
+				    NULL);
+				tab->flags |= TAB_REFRESH;
 			}
 			break;
+		case IMSG_DOWNLOAD_PROGRESS:
+			if ((d = download_by_id(imsg_get_id(&imsg))) == NULL)
+				break;
+			if (imsg_get_data(&imsg, &bytes, sizeof(bytes)) == -1)
+				die();
+			download_progress(d, bytes);
+			break;
 		case IMSG_FAULTY_GEMSERVER:
 			if ((tab = tab_by_id(imsg_get_id(&imsg))) == NULL &&
 			    ((d = download_by_id(imsg_get_id(&imsg)))) == NULL)
-				return;
+				break;
 
 			if (tab) {
 				tab->faulty_gemserver = 1;
@@ -534,36 +1455,143 @@ handle_dispatch_imsg(int fd, int event, void *data)
 		case IMSG_EOF:
 			if ((tab = tab_by_id(imsg_get_id(&imsg))) == NULL &&
 			    ((d = download_by_id(imsg_get_id(&imsg)))) == NULL)
-				return;
+				break;
 
 			if (tab == NULL && d != NULL) {
 				download_finished(d);
-				return;
+				break;
 			}
 
 			if (tab != NULL) {
 				if (!parser_free(tab))
 					die();
 				h = hist_cur(tab->hist);
+				if (imsg_get_data(&imsg, &tab->timing,
+				    sizeof(tab->timing)) != -1) {
+					free(tab->timing_url);
+					tab->timing_url = xstrdup(h);
+					/* 43 is the proxy failing */
+					if (tab->proxy != NULL &&
+					    tab->code == 43)
+						proxy_failed(tab->proxy);
+					else if (tab->proxy != NULL)
+						proxy_done(tab->proxy,
+						    &tab->timing);
+				}
+				if (!tab->faulty_gemserver &&
+				    (strncmp(h, "gemini://", 9) != 0 ||
+				    tab->code / 10 == 2))
+					tab->flags |= TAB_COMPLETE;
+
+				t = perf_usec();
 				if (!strncmp(h, "gemini://", 9) ||
 				    !strncmp(h, "gopher://", 9) ||
-				    !strncmp(h, "finger://", 9))
+				    !strncmp(h, "finger://", 9)) {
 					mcache_tab(tab);
+					ftindex_tab(tab);
+				}
+				trace_span("mcache_tab", tab->id, t,
+				    perf_usec(), NULL);
+				trace_request(tab->id, 0, NULL);
+
+				/*
+				 * Gemini is handled as soon as a 2x
+				 * reply is got.
+				 */
+				if (!strncmp(h, "finger://", 9) ||
+				    !strncmp(h, "gopher://", 9))
+					history_add(h);
+
+				tab->flags &= ~TAB_REFRESH;
+				ui_on_tab_refresh(tab);
+				ui_on_tab_loaded(tab);
+
+				if (!strncmp(h, "gemini://", 9))
+					prefetch_page(tab);
+				else
+					prefetch_run();
+			}
+			break;
+		case IMSG_PERF:
+			if (imsg_get_data(&imsg, counters,
+			    sizeof(counters)) == -1)
+				die();
+			for (i = 0; i < PERF_MAX; ++i)
+				net_counters[i] += counters[i];
+			if (--net_counters_pending > 0)
+				break;
+			if ((tab = tab_by_id(imsg_get_id(&imsg))) == NULL ||
+			    !tab->loading_anim ||
+			    strcmp(hist_cur(tab->hist), "about:perf") != 0)
+				break;
+			perf_about_done(tab, net_counters);
+			ui_on_tab_refresh(tab);
+			ui_on_tab_loaded(tab);
+			break;
+		default:
+			errx(1, "got unknown imsg %d", imsg_get_type(&imsg));
+		}
+
+		imsg_body_done(iev, &imsg);
+		imsg_free(&imsg);
+	}
+
+	bufacks_flush(iev);
+
+	/*
+	 * Wrap and redraw once per read instead of once per IMSG_BUF:
+	 * the net process may have queued plenty of them.
+	 */
+	TAILQ_FOREACH(tab, &tabshead, tabs) {
+		if (tab->flags & TAB_REFRESH) {
+			tab->flags &= ~TAB_REFRESH;
+			ui_on_tab_refresh(tab);
+		}
+	}
+
+	imsg_event_add(iev);
+}
+
+static void
+handle_persist_imsg(int fd, int event, void *data)
+{
+	struct imsgev	*iev = data;
+	struct imsgbuf	*imsgbuf = &iev->ibuf;
+	struct imsg	 imsg;
+	struct ibuf	 ibuf;
+	char		*str;
+	ssize_t		 n;
+
+	if (event & EV_READ) {
+		if ((n = imsg_read(imsgbuf)) == -1 && errno != EAGAIN)
+			err(1, "imsg_read");
+		if (n == 0)
+			err(1, "connection closed");
+	}
+	if (event & EV_WRITE) {
+		if ((n = msgbuf_write(&imsgbuf->w)) == -1 && errno != EAGAIN)
+			err(1, "msgbuf_write");
+		if (n == 0)
+			err(1, "connection closed");
+	}
 
-				/*
-				 * Gemini is handled as soon as a 2x
-				 * reply is got.
-				 */
-				if (!strncmp(h, "finger://", 9) ||
-				    !strncmp(h, "gopher://", 9))
-					history_add(h);
+	for (;;) {
+		if ((n = imsg_get(imsgbuf, &imsg)) == -1)
+			err(1, "imsg_get");
+		if (n == 0)
+			break;
 
-				ui_on_tab_refresh(tab);
-				ui_on_tab_loaded(tab);
-			}
+		switch (imsg_get_type(&imsg)) {
+		case IMSG_PERSIST_ERR:
+			if (imsg_get_ibuf(&imsg, &ibuf) == -1 ||
+			    ibuf_borrow_str(&ibuf, &str) == -1)
+				die();
+			message("Failed to save %s", str);
+			save_session_failed();
 			break;
+
 		default:
-			errx(1, "got unknown imsg %d", imsg_get_type(&imsg));
+			die();
 		}
 
 		imsg_free(&imsg);
@@ -572,11 +1600,86 @@ handle_dispatch_imsg(int fd, int event, void *data)
 	imsg_event_add(iev);
 }
 
+/* width of the waterfall in about:timing */
+#define TIMING_BAR	50
+
+/* generate the about:timing page for the last request of the tab */
+static void
+timing_about(struct tab *tab)
+{
+	static const char *names[TIMING_MAX] = {
+		"Queue", "DNS", "Connect", "TLS", "TOFU", "Wait", "Body",
+	};
+	struct buffer	*buffer = &tab->buffer;
+	uint64_t	 total, from, to;
+	char		 bar[TIMING_BAR + 1];
+	size_t		 i, s, e;
+
+	parser_init(buffer, &gemtext_parser);
+	parser_parsef(buffer, "# Timing\n\n");
+
+	if (tab->timing_url == NULL) {
+		parser_parsef(buffer, "No page loaded in this tab yet.\n");
+		parser_free(tab);
+		return;
+	}
+
+	parser_parsef(buffer, "Last request of this tab:\n\n=> %s\n\n",
+	    tab->timing_url);
+
+	total = MAX(tab->timing.t[TIMING_EOF], 1);
+	parser_parsef(buffer, "```\n");
+	for (i = 0, from = 0; i < TIMING_MAX; ++i, from = to) {
+		to = MAX(tab->timing.t[i], from);
+
+		s = from * TIMING_BAR / total;
+		e = to * TIMING_BAR / total;
+		if (e == s && to != from)
+			e = MIN(s + 1, TIMING_BAR);
+		memset(bar, ' ', TIMING_BAR);
+		memset(bar + s, '=', e - s);
+		bar[TIMING_BAR] = '\0';
+
+		parser_parsef(buffer, "%-8s %8.1fms |%s|\n", names[i],
+		    (to - from) / 1000.0, bar);
+	}
+	parser_parsef(buffer, "%-8s %8.1fms\n```\n", "Total",
+	    tab->timing.t[TIMING_EOF] / 1000.0);
+
+	if (tab->timing.flags & TIMING_F_NODELAY)
+		parser_parsef(buffer, "* TCP_NODELAY was set.\n");
+	if (tab->timing.flags & TIMING_F_FASTOPEN)
+		parser_parsef(buffer, "* The request was sent with the SYN"
+		    " (TCP Fast Open).\n");
+	if (tab->timing.flags & TIMING_F_RCVBUF)
+		parser_parsef(buffer, "* The receive buffer was raised to"
+		    " tcp-rcvbuf.\n");
+
+	parser_free(tab);
+}
+
 static void
 load_about_url(struct tab *tab, const char *url)
 {
 	tab->trust = TS_TRUSTED;
-	fs_load_url(tab, url);
+	if (!strcmp(url, "about:bookmarks"))
+		bookmarks_about(tab);
+	else if (!strcmp(url, "about:cache"))
+		mcache_about(tab);
+	else if (!strcmp(url, "about:memory"))
+		memory_about(tab, &certs);
+	else if (!strcmp(url, "about:timing"))
+		timing_about(tab);
+	else if (!strcmp(url, "about:feeds"))
+		feeds_about(tab);
+	else if (!strcmp(url, "about:perf") || fs_load_url(tab, url)) {
+		/* about:perf waits for the counters of the net process */
+		if (!strcmp(url, "about:perf"))
+			perf_about(tab);
+		ui_on_tab_refresh(tab);
+		start_loading_anim(tab);
+		return;
+	}
 	ui_on_tab_refresh(tab);
 	ui_on_tab_loaded(tab);
 }
@@ -585,7 +1688,13 @@ static void
 load_file_url(struct tab *tab, const char *url)
 {
 	tab->trust = TS_TRUSTED;
-	fs_load_url(tab, url);
+	if (tab->flags & TAB_WATCH)
+		watch_tab(tab);
+	if (fs_load_url(tab, url)) {
+		ui_on_tab_refresh(tab);
+		start_loading_anim(tab);
+		return;
+	}
 	ui_on_tab_refresh(tab);
 	ui_on_tab_loaded(tab);
 }
@@ -597,18 +1706,18 @@ load_finger_url(struct tab *tab, const char *url)
 	const char	*path;
 
 	memset(&req, 0, sizeof(req));
-	strlcpy(req.host, tab->iri.iri_host, sizeof(req.host));
-	strlcpy(req.port, tab->iri.iri_portstr, sizeof(req.port));
+	strlcpy(req.host, tab->iri->iri_host, sizeof(req.host));
+	strlcpy(req.port, tab->iri->iri_portstr, sizeof(req.port));
 
 	/*
 	 * Sometimes the finger url have the user as path component
 	 * (e.g. finger://thelambdalab.xyz/plugd), sometimes as
 	 * userinfo (e.g. finger://cobradile@finger.farm).
 	 */
-	if (tab->iri.iri_flags & IH_UINFO) {
-		strlcpy(req.req, tab->iri.iri_uinfo, sizeof(req.req));
+	if (tab->iri->iri_flags & IH_UINFO) {
+		strlcpy(req.req, tab->iri->iri_uinfo, sizeof(req.req));
 	} else {
-		path = tab->iri.iri_path;
+		path = tab->iri->iri_path;
 		while (*path == '/')
 			++path;
 		strlcpy(req.req, path, sizeof(req.req));
@@ -625,13 +1734,13 @@ load_gemini_url(struct tab *tab, const char *url)
 	struct get_req	 req;
 
 	memset(&req, 0, sizeof(req));
-	strlcpy(req.host, tab->iri.iri_host, sizeof(req.host));
-	strlcpy(req.port, tab->iri.iri_portstr, sizeof(req.port));
+	strlcpy(req.host, tab->iri->iri_host, sizeof(req.host));
+	strlcpy(req.port, tab->iri->iri_portstr, sizeof(req.port));
 
 	make_request(tab, &req, PROTO_GEMINI, hist_cur(tab->hist));
 }
 
-static inline const char *
+static const char *
 gopher_skip_selector(const char *path, int *ret_type)
 {
 	*ret_type = 0;
@@ -648,7 +1757,16 @@ gopher_skip_selector(const char *path, int *ret_type)
 	switch (*ret_type = *path) {
 	case '0':
 	case '1':
+	case '4':
+	case '5':
+	case '6':
 	case '7':
+	case '9':
+	case 'I':
+	case 'd':
+	case 'g':
+	case 's':
+	case ';':
 		break;
 
 	default:
@@ -660,6 +1778,19 @@ gopher_skip_selector(const char *path, int *ret_type)
 	return ++path;
 }
 
+/* Set the selector in req, path is what follows the item type. */
+static void
+gopher_request(struct iri *iri, const char *path, struct get_req *req)
+{
+	if (iri_urlunescape(path, req->req, sizeof(req->req)) == -1)
+		strlcpy(req->req, path, sizeof(req->req));
+	if (iri->iri_flags & IH_QUERY) {
+		strlcat(req->req, "?", sizeof(req->req));
+		strlcat(req->req, iri->iri_query, sizeof(req->req));
+	}
+	strlcat(req->req, "\r\n", sizeof(req->req));
+}
+
 static void
 load_gopher_url(struct tab *tab, const char *url)
 {
@@ -668,10 +1799,10 @@ load_gopher_url(struct tab *tab, const char *url)
 	const char	*path;
 
 	memset(&req, 0, sizeof(req));
-	strlcpy(req.host, tab->iri.iri_host, sizeof(req.host));
-	strlcpy(req.port, tab->iri.iri_portstr, sizeof(req.port));
+	strlcpy(req.host, tab->iri->iri_host, sizeof(req.host));
+	strlcpy(req.port, tab->iri->iri_portstr, sizeof(req.port));
 
-	path = gopher_skip_selector(tab->iri.iri_path, &type);
+	path = gopher_skip_selector(tab->iri->iri_path, &type);
 	switch (type) {
 	case '0':
 		parser_init(&tab->buffer, &textplain_parser);
@@ -685,19 +1816,35 @@ load_gopher_url(struct tab *tab, const char *url)
 		ui_require_input(tab, 0, ir_select_gopher);
 		load_page_from_str(tab, err_pages[10]);
 		return;
+	case '4':
+	case '5':
+	case '6':
+	case '9':
+	case 'I':
+	case 'd':
+	case 'g':
+	case 's':
+	case ';':
+		/* binary files are saved, as gemini does for 2x */
+		if (safe_mode) {
+			load_page_from_str(tab,
+			    err_pages[UNKNOWN_TYPE_OR_CSET]);
+			return;
+		}
+		req.hold = 1;
+		gopher_request(tab->iri, path, &req);
+		make_request(tab, &req, PROTO_GOPHER, NULL);
+		tab_set_meta(tab, "application/octet-stream");
+		hist_prev(tab->hist);
+		ui_yornp("Can't display a binary file, save it?",
+		    handle_maybe_save_page, tab);
+		return;
 	default:
 		load_page_from_str(tab, "Unknown gopher selector");
 		return;
 	}
 
-	if (iri_urlunescape(path, req.req, sizeof(req.req)) == -1)
-		strlcpy(req.req, path, sizeof(req.req));
-	if (tab->iri.iri_flags & IH_QUERY) {
-		strlcat(req.req, "?", sizeof(req.req));
-		strlcat(req.req, tab->iri.iri_query, sizeof(req.req));
-	}
-	strlcat(req.req, "\r\n", sizeof(req.req));
-
+	gopher_request(tab->iri, path, &req);
 	make_request(tab, &req, PROTO_GOPHER, NULL);
 }
 
@@ -715,20 +1862,30 @@ load_via_proxy(struct tab *tab, const char *url, struct proxy *p)
 	make_request(tab, &req, p->proto, hist_cur(tab->hist));
 }
 
+/* the net worker that handles the requests to host */
+static int
+net_index(const char *host)
+{
+	return fnv1a(FNV1A_INIT, host, strlen(host)) % nnets;
+}
+
 static void
 make_request(struct tab *tab, struct get_req *req, int proto, const char *r)
 {
 	int	 use_cert = 0, fd = -1;
 
 	if (proto == PROTO_GEMINI) {
-		tab->client_cert = cert_for(&tab->iri, &tab->client_cert_temp);
+		tab->client_cert = cert_for(tab->iri, &tab->client_cert_temp);
 		use_cert = (tab->client_cert != NULL);
 	}
 
 	stop_tab(tab);
-	tab->id = tab_new_id();
+	tab_renew_id(tab);
+	tab->flags &= ~TAB_COMPLETE;
 	tab->faulty_gemserver = 0;
+	tab->backoff_until = 0;
 	req->proto = proto;
+	req->prio = tab == current_tab ? PRIO_FOREGROUND : PRIO_BACKGROUND;
 
 	if (r != NULL) {
 		strlcpy(req->req, r, sizeof(req->req));
@@ -736,14 +1893,19 @@ make_request(struct tab *tab, struct get_req *req, int proto, const char *r)
 	}
 
 	start_loading_anim(tab);
+	clock_gettime(CLOCK_MONOTONIC, &tab->load_start);
 
 	if (!use_cert)
 		tab->client_cert = NULL;
-	if (use_cert && (fd = cert_open(tab->client_cert)) == -1) {
+	if (use_cert && cert_open_changed(tab->client_cert,
+	    net_index(req->host), &fd) == -1) {
 		tab->client_cert = NULL;
 		message("failed to open certificate: %s", strerror(errno));
 	}
+	if (tab->client_cert != NULL)
+		strlcpy(req->ccert, tab->client_cert, sizeof(req->ccert));
 
+	trace_request(tab->id, 1, hist_cur(tab->hist));
 	ui_send_net(IMSG_GET, tab->id, fd, req, sizeof(*req));
 }
 
@@ -753,14 +1915,14 @@ gopher_send_search_req(struct tab *tab, const char *text)
 	struct get_req	req;
 
 	memset(&req, 0, sizeof(req));
-	strlcpy(req.host, tab->iri.iri_host, sizeof(req.host));
-	strlcpy(req.port, tab->iri.iri_portstr, sizeof(req.port));
+	strlcpy(req.host, tab->iri->iri_host, sizeof(req.host));
+	strlcpy(req.port, tab->iri->iri_portstr, sizeof(req.port));
 
 	/* +2 to skip /7 */
-	strlcpy(req.req, tab->iri.iri_path+2, sizeof(req.req));
-	if (tab->iri.iri_flags & IH_QUERY) {
+	strlcpy(req.req, tab->iri->iri_path+2, sizeof(req.req));
+	if (tab->iri->iri_flags & IH_QUERY) {
 		strlcat(req.req, "?", sizeof(req.req));
-		strlcat(req.req, tab->iri.iri_query, sizeof(req.req));
+		strlcat(req.req, tab->iri->iri_query, sizeof(req.req));
 	}
 
 	strlcat(req.req, "\t", sizeof(req.req));
@@ -809,14 +1971,22 @@ do_load_url(struct tab *tab, const char *url, const char *base, int mode)
 {
 	const struct proto	*p;
 	struct proxy		*proxy;
-	int			 nocache = mode & LU_MODE_NOCACHE;
+	const char		*to;
+	int			 nocache = mode & LU_MODE_NOCACHE, r;
 	char			*t;
-	char			 buf[1025];
+	char			 buf[1025], target[1025];
+
+	/* a local file may still be parsed into the buffer */
+	fs_stop(tab);
+	unwatch_tab(tab);
+	tab->flags &= ~TAB_COMPLETE;
 
 	tab->proxy = NULL;
 	tab->trust = TS_UNKNOWN;
 
-	if (iri_parse(base, url, &tab->iri) == -1) {
+	if (tab->iri == NULL)
+		tab->iri = xcalloc(1, sizeof(*tab->iri));
+	if (iri_parse(base, url, tab->iri) == -1) {
 		xasprintf(&t, "# error loading %s\n>%s\n", url,
 		    "Can't parse the IRI");
 		hist_set_cur(tab->hist, url);
@@ -825,32 +1995,53 @@ do_load_url(struct tab *tab, const char *url, const char *base, int mode)
 		return;
 	}
 
-	iri_unparse(&tab->iri, buf, sizeof(buf));
+	iri_unparse(tab->iri, buf, sizeof(buf));
 	hist_set_cur(tab->hist, buf);
 
+	/* skip the round trip to learn what the target is */
+	if ((to = redirect_lookup(buf)) != NULL && tab->redirect_count < 5) {
+		tab->redirect_count++;
+		free(tab->redirect_src);
+		tab->redirect_src = xstrdup(buf);
+		strlcpy(target, to, sizeof(target));
+		do_load_url(tab, target, NULL, mode);
+		return;
+	}
+
 	if (!nocache && mcache_lookup(buf, tab)) {
+		tab->flags |= TAB_COMPLETE;
 		ui_on_tab_refresh(tab);
 		ui_on_tab_loaded(tab);
 		return;
 	}
 
+	/* the offline copy of the mirrored capsules, but not on reload */
+	if (!(mode & LU_MODE_NOMIRROR) && !headless &&
+	    (r = fs_mirror_load(tab)) != -1) {
+		tab->trust = TS_TRUSTED;
+		ui_on_tab_refresh(tab);
+		if (r)
+			start_loading_anim(tab);
+		else
+			ui_on_tab_loaded(tab);
+		return;
+	}
+
 	for (p = protos; p->schema != NULL; ++p) {
-		if (!strcmp(tab->iri.iri_scheme, p->schema)) {
+		if (!strcmp(tab->iri->iri_scheme, p->schema)) {
 			/* patch the port */
-			if (*tab->iri.iri_portstr == '\0' &&
+			if (*tab->iri->iri_portstr == '\0' &&
 			    p->port != NULL)
-				iri_setport(&tab->iri, p->port);
+				iri_setport(tab->iri, p->port);
 
 			p->loadfn(tab, buf);
 			return;
 		}
 	}
 
-	TAILQ_FOREACH(proxy, &proxies, proxies) {
-		if (!strcmp(tab->iri.iri_scheme, proxy->match_proto)) {
-			load_via_proxy(tab, url, proxy);
-			return;
-		}
+	if ((proxy = proxy_pick(tab->iri->iri_scheme, NULL)) != NULL) {
+		load_via_proxy(tab, url, proxy);
+		return;
 	}
 
 	load_page_from_str(tab, err_pages[UNKNOWN_PROTOCOL]);
@@ -875,6 +2066,7 @@ load_url(struct tab *tab, const char *url, const char *base, int mode)
 	} else if (hist_size(tab->hist) != 0) {
 		get_scroll_position(tab, &line_off, &curr_off);
 		hist_set_offs(tab->hist, line_off, curr_off);
+		mcache_layout(tab);
 	}
 
 	if (dohist) {
@@ -886,8 +2078,12 @@ load_url(struct tab *tab, const char *url, const char *base, int mode)
 		strlcpy(tab->buffer.title, url, sizeof(tab->buffer.title));
 	}
 
-	if (!lazy)
+	if (!lazy) {
+		tab->redirect_count = 0;
+		free(tab->redirect_src);
+		tab->redirect_src = NULL;
 		do_load_url(tab, url, base, mode);
+	}
 }
 
 void
@@ -909,6 +2105,7 @@ load_previous_page(struct tab *tab)
 {
 	const char	*h;
 
+	mcache_layout(tab);
 	if ((h = hist_prev(tab->hist)) == NULL)
 		return 0;
 	do_load_url(tab, h, NULL, LU_MODE_NONE);
@@ -920,25 +2117,129 @@ load_next_page(struct tab *tab)
 {
 	const char	*h;
 
+	mcache_layout(tab);
 	if ((h = hist_next(tab->hist)) == NULL)
 		return 0;
 	do_load_url(tab, h, NULL, LU_MODE_NONE);
 	return 1;
 }
 
+/*
+ * Pages are saved SAVE_BATCH lines at a time, the first batch right
+ * away and the others when idle, so that a big page doesn't block the
+ * input.  The save is abandoned if the tab is closed or its lines are
+ * freed, because it navigated away or was reloaded.
+ */
+#define SAVE_BATCH	4096
+
+struct save {
+	TAILQ_ENTRY(save)	 saves;
+	uint32_t		 tab_id;
+	unsigned int		 gen;
+	struct line		*next;
+	FILE			*fp;
+	char			*path;
+	size_t			 done;
+	size_t			 total;
+	unsigned int		 idle;
+};
+
+static TAILQ_HEAD(, save) saves = TAILQ_HEAD_INITIALIZER(saves);
+
+static void
+save_done(struct save *s, int aborted)
+{
+	TAILQ_REMOVE(&saves, s, saves);
+	ev_idle_cancel(s->idle);
+	if (fclose(s->fp) == EOF && !aborted) {
+		message("Failed to save the page.");
+		aborted = 1;
+	}
+	if (aborted)
+		unlink(s->path);
+	else
+		message("Saved %s", s->path);
+	free(s->path);
+	free(s);
+}
+
+static void
+save_batch(int fd, int ev, void *d)
+{
+	struct save	*s = d;
+	struct tab	*tab;
+	size_t		 i;
+
+	if ((tab = tab_by_id(s->tab_id)) == NULL || tab->buffer.gen != s->gen) {
+		message("The page changed, not saving %s", s->path);
+		save_done(s, 1);
+		return;
+	}
+
+	for (i = 0; s->next != NULL && i < SAVE_BATCH; ++i) {
+		if (!parser_serialize_line(&tab->buffer, s->next, s->fp)) {
+			message("Failed to save the page.");
+			save_done(s, 1);
+			return;
+		}
+		s->next = TAILQ_NEXT(s->next, lines);
+		s->done++;
+	}
+
+	if (s->next == NULL) {
+		save_done(s, 0);
+		return;
+	}
+
+	/* the page may still be growing */
+	message("Saving %s... %zu%%", s->path,
+	    MIN(s->done * 100 / s->total, 100));
+	s->idle = ev_idle(save_batch, s);
+}
+
 void
 write_buffer(const char *path, struct tab *tab)
 {
-	FILE *fp;
+	struct save	*s;
+	struct line	*l;
+	FILE		*fp;
 
 	if (path == NULL)
 		return;
 
-	if ((fp = fopen(path, "w")) == NULL)
+	if ((fp = fopen(path, "w")) == NULL) {
+		message("Can't open %s: %s", path, strerror(errno));
 		return;
-	if (!parser_serialize(&tab->buffer, fp))
-		message("Failed to save the page.");
-	fclose(fp);
+	}
+
+	s = xcalloc(1, sizeof(*s));
+	s->tab_id = tab->id;
+	s->gen = tab->buffer.gen;
+	s->next = TAILQ_FIRST(&tab->buffer.head);
+	s->fp = fp;
+	s->path = xstrdup(path);
+	TAILQ_FOREACH(l, &tab->buffer.head, lines)
+		s->total++;
+	TAILQ_INSERT_TAIL(&saves, s, saves);
+
+	save_batch(-1, 0, s);
+}
+
+/*
+ * Stop the pages being saved, leaving no partial files around.
+ * Return the number of saves stopped.
+ */
+int
+write_buffer_abort(void)
+{
+	struct save	*s;
+	int		 n = 0;
+
+	while ((s = TAILQ_FIRST(&saves)) != NULL) {
+		save_done(s, 1);
+		n++;
+	}
+	return n;
 }
 
 /*
@@ -984,18 +2285,6 @@ humanify_url(const char *raw, const char *base, char *ret, size_t len)
 	strlcat(ret, raw, len);
 }
 
-int
-bookmark_page(const char *url)
-{
-	FILE *fp;
-
-	if ((fp = fopen(bookmark_file, "a")) == NULL)
-		return -1;
-	fprintf(fp, "=> %s\n", url);
-	fclose(fp);
-	return 0;
-}
-
 static pid_t
 start_child(enum telescope_process p, const char *argv0, int fd)
 {
@@ -1023,6 +2312,9 @@ start_child(enum telescope_process p, const char *argv0, int fd)
 	case PROC_NET:
 		argv[argc++] = "-Tn";
 		break;
+	case PROC_PERSIST:
+		argv[argc++] = "-Tp";
+		break;
 	}
 
 	if (safe_mode)
@@ -1033,11 +2325,10 @@ start_child(enum telescope_process p, const char *argv0, int fd)
 	err(1, "execvp(%s)", argv0);
 }
 
-static void
-send_url(const char *url)
+static int
+ctl_connect(void)
 {
 	struct sockaddr_un	 sun;
-	struct imsgbuf		 ibuf;
 	int			 ctl_sock;
 
 	if ((ctl_sock = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
@@ -1050,6 +2341,16 @@ send_url(const char *url)
 	if (connect(ctl_sock, (struct sockaddr *)&sun, sizeof(sun)) == -1)
 		err(1, "connect: %s", ctlsock_path);
 
+	return (ctl_sock);
+}
+
+static void
+send_url(const char *url)
+{
+	struct imsgbuf		 ibuf;
+	int			 ctl_sock;
+
+	ctl_sock = ctl_connect();
 	imsg_init(&ibuf, ctl_sock);
 	imsg_compose(&ibuf, IMSG_CTL_OPEN_URL, 0, 0, -1, url,
 	    strlen(url) + 1);
@@ -1057,11 +2358,216 @@ send_url(const char *url)
 	close(ctl_sock);
 }
 
+/* send a request and copy the text of the reply to stdout */
+static void
+ctl_request(struct imsgbuf *ibuf, uint32_t type, const void *data,
+    size_t len)
+{
+	struct imsg		 imsg;
+	ssize_t			 n;
+	int			 done = 0;
+
+	imsg_compose(ibuf, type, 0, 0, -1, data, len);
+	if (imsg_flush(ibuf) == -1)
+		err(1, "imsg_flush");
+
+	while (!done) {
+		if ((n = imsg_read(ibuf)) == -1 && errno != EAGAIN)
+			err(1, "imsg_read");
+		if (n == 0)
+			errx(1, "connection closed");
+
+		for (;;) {
+			if ((n = imsg_get(ibuf, &imsg)) == -1)
+				err(1, "imsg_get");
+			if (n == 0)
+				break;
+
+			if (imsg_get_type(&imsg) == IMSG_CTL_END)
+				done = 1;
+			else if (imsg_get_type(&imsg) == type)
+				fwrite(imsg.data, 1, imsg_get_len(&imsg),
+				    stdout);
+			imsg_free(&imsg);
+		}
+	}
+}
+
+/* print the event loop stats of the running instance */
+static void
+query_perf(void)
+{
+	struct imsgbuf		 ibuf;
+	int			 ctl_sock;
+
+	ctl_sock = ctl_connect();
+	imsg_init(&ibuf, ctl_sock);
+	ctl_request(&ibuf, IMSG_CTL_PERF, NULL, 0);
+	close(ctl_sock);
+}
+
+static const struct ctl_cmd {
+	const char	*name;
+	int		 type;
+	int		 urls;
+} ctl_cmds[] = {
+	{"open",	IMSG_CTL_OPEN_URLS,	1},
+	{"lazy",	IMSG_CTL_LAZY_URLS,	1},
+	{"tabs",	IMSG_CTL_TABS,		0},
+	{"current",	IMSG_CTL_CURRENT,	0},
+	{"cache",	IMSG_CTL_CACHE,		0},
+	{"perf",	IMSG_CTL_PERF,		0},
+	{NULL,		0,			0},
+};
+
+/*
+ * Read commands from the standard input, one per line, and send them
+ * to the running instance over a single connection.  Each reply is
+ * printed followed by a line with only a dot.
+ */
+static void
+control(void)
+{
+	const struct ctl_cmd	*cmd;
+	struct imsgbuf		 ibuf;
+	char			*line = NULL, *s, *base, *data;
+	char			 buf[GEMINI_URL_LEN];
+	size_t			 linesize = 0, len, n;
+	ssize_t			 linelen;
+	int			 ctl_sock;
+
+	xasprintf(&base, "file://%s/", cwd);
+	data = xmalloc(MAX_IMSGSIZE - IMSG_HEADER_SIZE);
+
+	ctl_sock = ctl_connect();
+	imsg_init(&ibuf, ctl_sock);
+
+	while ((linelen = getline(&line, &linesize, stdin)) != -1) {
+		if ((s = strtok(line, " \t\r\n")) == NULL)
+			continue;
+
+		for (cmd = ctl_cmds; cmd->name != NULL; ++cmd)
+			if (!strcmp(cmd->name, s))
+				break;
+		if (cmd->name == NULL) {
+			warnx("unknown command: %s", s);
+			continue;
+		}
+
+		if (!cmd->urls) {
+			ctl_request(&ibuf, cmd->type, NULL, 0);
+			puts(".");
+			fflush(stdout);
+			continue;
+		}
+
+		/* as many URLs in a message as they fit */
+		len = 0;
+		while ((s = strtok(NULL, " \t\r\n")) != NULL) {
+			humanify_url(s, base, buf, sizeof(buf));
+			n = strlen(buf) + 1;
+			if (len + n > MAX_IMSGSIZE - IMSG_HEADER_SIZE) {
+				ctl_request(&ibuf, cmd->type, data, len);
+				len = 0;
+			}
+			memcpy(data + len, buf, n);
+			len += n;
+		}
+		if (len != 0)
+			ctl_request(&ibuf, cmd->type, data, len);
+		puts(".");
+		fflush(stdout);
+	}
+	if (ferror(stdin))
+		err(1, "getline");
+
+	close(ctl_sock);
+	free(line);
+	free(data);
+	free(base);
+}
+
+static void
+netroute_del(uint32_t id)
+{
+	struct netroute	*r;
+
+	if ((r = idmap_get(&netroutes, id)) != NULL) {
+		idmap_del(&netroutes, id, r);
+		free(r);
+	}
+}
+
+/*
+ * Send a message to the net process handling the request, or to all
+ * of them for the ones not about a request.  The IMSG_GET pick the
+ * process by the hash of the host.
+ */
 int
 ui_send_net(int type, uint32_t peerid, int fd, const void *data,
     uint16_t datalen)
 {
-	return imsg_compose_event(iev_net, type, peerid, 0, fd, data,
+	const struct get_req	*req;
+	struct netroute		*r;
+	int			 i, dfd, ret = 0;
+
+	switch (type) {
+	case IMSG_PERF:
+		memset(net_counters, 0, sizeof(net_counters));
+		net_counters_pending = nnets;
+		/* fallthrough */
+	case IMSG_NET_CONF:
+	case IMSG_DNS_FLUSH:
+	case IMSG_TOFU:
+	case IMSG_TRACE:
+	case IMSG_RECORD:
+	case IMSG_REPLAY:
+	case IMSG_QUIT:
+		for (i = 0; i < nnets; ++i) {
+			dfd = fd;
+			if (fd != -1 && i != nnets - 1 && (dfd = dup(fd)) == -1)
+				return -1;
+			if (imsg_compose_event(&iev_nets[i], type, peerid, 0,
+			    dfd, data, datalen) == -1)
+				ret = -1;
+		}
+		return ret;
+
+	case IMSG_PRECONNECT:
+	case IMSG_GET:
+		/* the same worker, so that the connection can be used */
+		req = data;
+		i = net_index(req->host);
+		if (type == IMSG_PRECONNECT)
+			break;
+		netroute_del(peerid);
+		r = xcalloc(1, sizeof(*r));
+		r->id = peerid;
+		r->net = i;
+		idmap_put(&netroutes, peerid, r);
+		break;
+
+	default:
+		if ((r = idmap_get(&netroutes, peerid)) == NULL) {
+			/* the request is already over */
+			if (fd != -1)
+				close(fd);
+			return 0;
+		}
+		i = r->net;
+		if (type == IMSG_STOP)
+			netroute_del(peerid);
+		break;
+	}
+
+	return imsg_compose_event(&iev_nets[i], type, peerid, 0, fd, data,
+	    datalen);
+}
+
+int
+ui_send_persist(int type, const void *data, uint16_t datalen)
+{
+	return imsg_compose_event(iev_persist, type, 0, 0, -1, data,
 	    datalen);
 }
 
@@ -1077,15 +2583,21 @@ usage(int r)
 int
 main(int argc, char * const *argv)
 {
-	struct imsgev	 net_ibuf;
+	struct imsgev	 persist_ibuf;
+	struct net_conf	 nc;
 	pid_t		 pid;
 	int		 control_fd;
-	int		 pipe2net[2];
-	int		 ch, configtest = 0, fail = 0;
+	int		 pipe2net[2], pipe2persist[2];
+	int		 ch, configtest = 0, fail = 0, perf = 0, ctl = 0;
+	int		 trace = 0, paced = 0;
 	int		 proc = -1;
 	int		 sessionfd = -1;
-	int		 status;
-	const char	*argv0;
+	int		 status, fd, i, ret = 0;
+	const char	*argv0, *errstr, *trace_path = NULL;
+	const char	*record_path = NULL, *replay_path = NULL;
+	const char	*frame_log = NULL;
+
+	perf_startup_begin();
 
 	argv0 = argv[0];
 
@@ -1105,14 +2617,41 @@ main(int argc, char * const *argv)
 			break;
 		case 'h':
 			usage(0);
+		case 'H':
+			headless = 1;
+			break;
+		case 'j':
+			headless_jobs = strtonum(optarg, 1, 1000, &errstr);
+			if (errstr != NULL)
+				errx(1, "jobs is %s: %s", errstr, optarg);
+			break;
+		case 'm':
+			headless = 1;
+			headless_mirror = 1;
+			break;
+		case 'P':
+			perf = 1;
+			break;
+		case 'X':
+			ctl = 1;
+			break;
 		case 'S':
 			safe_mode = 1;
 			break;
+		case 's':
+			headless_source = 1;
+			break;
+		case 't':
+			trace = 1;
+			break;
 		case 'T':
 			switch (*optarg) {
 			case 'n':
 				proc = PROC_NET;
 				break;
+			case 'p':
+				proc = PROC_PERSIST;
+				break;
 			default:
 				errx(1, "invalid process spec %c",
 				    *optarg);
@@ -1122,6 +2661,26 @@ main(int argc, char * const *argv)
 			printf("%s %s\n", PACKAGE_NAME, PACKAGE_VERSION);
 			exit(0);
 			break;
+		case 'F':
+			frame_log = optarg;
+			break;
+		case 'r':
+			trace_path = optarg;
+			break;
+		case 'R':
+			record_path = optarg;
+			break;
+		case 'y':
+			replay_path = optarg;
+			break;
+		case 'g':
+			paced = 1;
+			break;
+		case 'w':
+			headless_width = strtonum(optarg, 10, 1000, &errstr);
+			if (errstr != NULL)
+				errx(1, "width is %s: %s", errstr, optarg);
+			break;
 		default:
 			usage(1);
 		}
@@ -1130,11 +2689,16 @@ main(int argc, char * const *argv)
 	argc -= optind;
 	argv += optind;
 
+	if (record_path != NULL && replay_path != NULL)
+		errx(1, "can't both record and replay");
+
 	if (proc != -1) {
 		if (argc > 0)
 			usage(1);
 		else if (proc == PROC_NET)
 			return net_main();
+		else if (proc == PROC_PERSIST)
+			return persist_main();
 		else
 			usage(1);
 	}
@@ -1145,18 +2709,32 @@ main(int argc, char * const *argv)
 	TAILQ_INIT(&minibuffer_map.m);
 
 	init_mailcap();
+	perf_startup("mailcap");
 
 	if (fs_init() == -1)
 		err(1, "fs_init failed");
+	perf_startup("fs");
 	if (certs_init(certs_file) == -1)
 		err(1, "certs_init failed");
+	perf_startup("client certs");
 	config_init();
-	parseconfig(config_path, fail);
+	parseconfig(config_path, fail, !configtest);
+	perf_startup("config");
 	if (configtest) {
 		puts("config OK");
 		exit(0);
 	}
 
+	if (perf) {
+		query_perf();
+		exit(0);
+	}
+
+	if (ctl) {
+		control();
+		exit(0);
+	}
+
 	if (default_protocol == NULL &&
 	    (default_protocol = strdup("gemini")) == NULL)
 		err(1, "strdup");
@@ -1165,7 +2743,10 @@ main(int argc, char * const *argv)
 	    (download_path = strdup("/tmp/")) == NULL)
 		errx(1, "strdup");
 
-	if (argc != 0) {
+	/* headless doesn't touch the session and takes many URLs */
+	if (headless)
+		safe_mode = 1;
+	else if (argc != 0) {
 		char *base;
 
 		xasprintf(&base, "file://%s/", cwd);
@@ -1185,14 +2766,32 @@ main(int argc, char * const *argv)
 		errx(1, "can't lock session, is another instance of "
 		    "telescope already running?");
 	}
+	perf_startup("lock");
+
+	/* Start children; a capture is written or read by only one. */
+	if (record_path == NULL && replay_path == NULL)
+		nnets = MAX(1, MIN(net_workers, NET_WORKERS_MAX));
+	for (i = 0; i < nnets; ++i) {
+		if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC,
+		    pipe2net) == -1)
+			err(1, "socketpair");
+		start_child(PROC_NET, argv0, pipe2net[1]);
+		if (fcntl(pipe2net[0], F_SETFD, FD_CLOEXEC) == -1)
+			err(1, "fcntl");
+		imsg_init(&iev_nets[i].ibuf, pipe2net[0]);
+		iev_nets[i].handler = handle_dispatch_imsg;
+	}
+	idmap_init(&netroutes, offsetof(struct netroute, id));
 
-	/* Start children. */
-	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, pipe2net) == -1)
+	if (socketpair(AF_UNIX, SOCK_STREAM, PF_UNSPEC, pipe2persist) == -1)
 		err(1, "socketpair");
-	start_child(PROC_NET, argv0, pipe2net[1]);
-	imsg_init(&net_ibuf.ibuf, pipe2net[0]);
-	iev_net = &net_ibuf;
-	iev_net->handler = handle_dispatch_imsg;
+	start_child(PROC_PERSIST, argv0, pipe2persist[1]);
+	if (!mark_nonblock_cloexec(pipe2persist[0]))
+		err(1, "mark_nonblock_cloexec");
+	imsg_init(&persist_ibuf.ibuf, pipe2persist[0]);
+	iev_persist = &persist_ibuf;
+	iev_persist->handler = handle_persist_imsg;
+	perf_startup("children");
 
 	setproctitle("ui");
 
@@ -1211,26 +2810,128 @@ main(int argc, char * const *argv)
 	/* initialize the in-memory cache store */
 	mcache_init();
 
+	tabs_init();
+	downloads_init();
+	idmap_init(&prefetchids, offsetof(struct prefetch, tab.id));
+
+	/* and the global history */
+	history_init();
+
 	/* Setup event handler for the autosave */
 	autosave_init();
 
 	/* Setup event handlers for pipes to net */
-	iev_net->events = EV_READ;
-	ev_add(iev_net->ibuf.fd, iev_net->events, iev_net->handler, iev_net);
+	for (i = 0; i < nnets; ++i) {
+		iev_nets[i].events = EV_READ;
+		ev_add(iev_nets[i].ibuf.fd, iev_nets[i].events,
+		    iev_nets[i].handler, &iev_nets[i]);
+	}
+	ev_name(handle_dispatch_imsg, "net imsg dispatch");
+
+	iev_persist->events = EV_READ;
+	ev_add(iev_persist->ibuf.fd, iev_persist->events,
+	    iev_persist->handler, iev_persist);
+	ev_name(iev_persist->handler, "persist imsg dispatch");
+
+	memset(&nc, 0, sizeof(nc));
+	nc.dns_ttl = dns_cache_ttl;
+	nc.connect_timeout = connect_timeout;
+	nc.handshake_timeout = handshake_timeout;
+	nc.idle_timeout = idle_timeout;
+	nc.total_timeout = total_timeout;
+	nc.tcp_fastopen = tcp_fastopen;
+	nc.tcp_nodelay = tcp_nodelay;
+	nc.tcp_rcvbuf = tcp_rcvbuf;
+	ui_send_net(IMSG_NET_CONF, 0, -1, &nc, sizeof(nc));
+
+	for (i = 0; shm_ring > 0 && i < nnets; ++i) {
+		if ((fd = shmring_create(&body_rings[i], shm_ring)) == -1)
+			err(1, "can't create the shared ring");
+		imsg_compose_event(&iev_nets[i], IMSG_SHM_RING, 0, 0, fd,
+		    &body_rings[i].size, sizeof(body_rings[i].size));
+	}
+
+	if (frame_log != NULL && perf_frame_log(frame_log) == -1)
+		err(1, "can't open %s", frame_log);
+
+	if (trace_path != NULL) {
+		if ((fd = trace_open(trace_path)) == -1)
+			err(1, "can't open %s", trace_path);
+		trace_init(fd, "ui");
+		if ((fd = dup(fd)) == -1)
+			err(1, "dup");
+		ui_send_net(IMSG_TRACE, 0, fd, NULL, 0);
+	}
 
-	if (ui_init()) {
+	if (record_path != NULL) {
+		if ((fd = open(record_path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND,
+		    0644)) == -1)
+			err(1, "can't open %s", record_path);
+		ui_send_net(IMSG_RECORD, 0, fd, NULL, 0);
+	} else if (replay_path != NULL) {
+		if ((fd = open(replay_path, O_RDONLY)) == -1)
+			err(1, "can't open %s", replay_path);
+		ui_send_net(IMSG_REPLAY, 0, fd, &paced, sizeof(paced));
+	}
+	perf_startup("init");
+
+	if (headless) {
+		minibuffer_init();
+		sandbox_ui_process();
+		redirects_load();
+		load_certs(&certs);
+		tofu_share(&certs);
+		operating = 1;
+		ret = headless_run(argc, argv);
+	} else if (ui_init()) {
+		perf_startup("ui");
+		pressure_init(&certs);
 		sandbox_ui_process();
-		load_session(&certs);
+		perf_startup("sandbox");
+		redirects_load();
+		load_session();
 		if (has_url)
 			new_tab(url, NULL, NULL);
+		perf_startup("tabs");
+
+		/*
+		 * Get the request for the current tab going and draw it,
+		 * then load the rest while the net process works on it.
+		 * The replies are handled only from the event loop, so
+		 * the known hosts are there before they're needed.
+		 */
 		operating = 1;
 		switch_to_tab(current_tab);
+		for (i = 0; i < nnets; ++i) {
+			imsg_flush(&iev_nets[i].ibuf);
+			imsg_event_add(&iev_nets[i]);
+		}
+		ui_paint();
+		perf_startup("first paint");
+		load_certs(&certs);
+		tofu_share(&certs);
+		perf_startup("known hosts");
+		load_hist();
+		perf_startup("history");
+		warmup_session();
+
 		ui_main_loop();
 		ui_end();
+
+		if (trace)
+			perf_startup_report(stderr);
 	}
 
 	ui_send_net(IMSG_QUIT, 0, -1, NULL, 0);
-	imsg_flush(&iev_net->ibuf);
+	for (i = 0; i < nnets; ++i)
+		imsg_flush(&iev_nets[i].ibuf);
+
+	/* the last writes may be still queued: wait for them */
+	ftindex_flush();
+	ui_send_persist(IMSG_QUIT, NULL, 0);
+	fcntl(iev_persist->ibuf.fd, F_SETFL,
+	    fcntl(iev_persist->ibuf.fd, F_GETFL) & ~O_NONBLOCK);
+	imsg_flush(&iev_persist->ibuf);
 
 	/* wait for children to terminate */
 	do {
@@ -1248,5 +2949,5 @@ main(int argc, char * const *argv)
 	if (!safe_mode && close(sessionfd) == -1)
 		err(1, "close(sessionfd = %d)", sessionfd);
 
-	return 0;
+	return ret;
 }
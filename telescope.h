@@ -20,6 +20,7 @@
 #include <limits.h>
 #include <stdio.h>		/* XXX: for parsers.h */
 
+#include "arena.h"
 #include "iri.h"
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
@@ -67,17 +68,27 @@ enum line_type {
 	LINE_FRINGE,
 };
 
+struct layout;
+struct wrap_job;
+
 struct line {
 	enum line_type		 type;
-	char			*line;
-	char			*alt;
-	void			*data;
-
 #define L_HIDDEN	0x1
+#define L_ASCII		0x4	/* only printable ASCII */
 	int			 flags;
+	int			 emojiwidth;	/* of the emoji of a link */
+	uint32_t		 vline;		/* the first one, see wrap.c */
+	char			*line;
+	char			*alt;
+	void			*data;		/* the space after the emoji */
+	struct layout		*layout;	/* see wrap.c */
 	TAILQ_ENTRY(line)	 lines;
 };
 
+/* a link line printed with its emoji as prefix; data is the space */
+#define LINE_EMOJIFIED(l)						\
+	((l)->type == LINE_LINK && (l)->data != NULL && emojify_link)
+
 struct vline {
 	struct line		*parent;
 	size_t			 from;
@@ -85,8 +96,9 @@ struct vline {
 	size_t			 cplen;
 
 #define L_CONTINUATION	0x2
+#define L_UNWRAPPED	0x4	/* preformatted, possibly wider than the window */
+#define L_FOLDED	0x8	/* hidden and not wrapped yet, see wrap_line */
 	int			 flags;
-	TAILQ_ENTRY(vline)	 vlines;
 };
 
 /*
@@ -103,38 +115,129 @@ enum trust_state {
 
 struct parser;
 
+/*
+ * Some kind of lines in document order, as the parsers emit them.
+ * The array always ends with an entry with a NULL line.
+ */
+struct lineref {
+	struct line		*line;
+	const char		*cache;		/* e.g. see link_url */
+};
+
+struct lineidx {
+	struct lineref		*refs;
+	size_t			 len;
+	size_t			 cap;
+};
+
+/* the memory held by a buffer, see buffer_memory */
+struct bufmem {
+	size_t			 arena;		/* the lines and their text */
+	size_t			 vlines;	/* and the skip index */
+	size_t			 index;		/* headings and links */
+	size_t			 raw;		/* the parser buffer */
+	size_t			 tot;
+	size_t			 shared;	/* not part of tot */
+	size_t			 spilled;	/* neither, see arena_spill_at */
+};
+
+/*
+ * The text of the lines shared by the buffers restored from the same
+ * cache entry.  It's never modified, so it's never copied either;
+ * drop is called once the last reference goes away.
+ */
+struct shtext {
+	int			 refs;
+	char			*data;
+	size_t			 len;
+	void			*owner;
+	void			(*drop)(struct shtext *);
+};
+
 struct buffer {
 	char			 title[128 + 1];
 	const char		*mode;
 	char			*buf;
 	size_t			 len;
 	size_t			 cap;
+	size_t			 cur;	/* read cursor in buf */
 
 #define PARSER_IN_BODY	1
 #define PARSER_IN_PRE	2
 #define PARSER_IN_PATCH_HDR 4
+#define PARSER_ASCII	8	/* the line being parsed, see parser.c */
+#define PARSER_RECORDS	16	/* parsed by the net process already */
+#define PARSER_PATCH_FOLD 32	/* the hunks are folded, see textpatch */
+
+/* the lines of the hunks, what the big patches fold */
+#define LINE_HUNK_BODY(t)						\
+	((t) == LINE_PATCH || (t) == LINE_PATCH_ADD || (t) == LINE_PATCH_DEL)
 	int			 parser_flags;
 	const struct parser	*parser;
 
+	/* the end of the last byte copied that's not printable ASCII */
+	size_t			 nonascii;
+	/* the UTF-8 sequence cut at the end of buf and what it needs */
+	uint8_t			 u8need;
+	uint8_t			 u8have;
+	uint8_t			 u8lo;
+	uint8_t			 u8hi;
+
 	size_t			 last_line_off;
 	int			 force_redraw;
 
 	int			 curs_x;
 	int			 curs_y;
+	size_t			 hscroll;	/* of the unwrapped vlines */
 	size_t			 line_off;
 	size_t			 line_max;
 	struct vline		*top_line;
 	struct vline		*current_line;
 	size_t			 cpoff;
 
+	/* state for wrap_page_tail */
+	struct line		*last_wrapped;
+	int			 wrap_width;
+	int			 wrap_fill_column;
+	int			 wrap_pre;
+
+	/* backing storage for the lines */
+	struct arena		 line_arena;
+	struct shtext		*shared;	/* their text, if not there */
+
 	TAILQ_HEAD(, line)	 head;
-	TAILQ_HEAD(vhead, vline) vhead;
+	unsigned int		 gen;	/* bumped when the lines are freed */
+
+	/* the headings, or the hunks of a patch, and the links */
+	struct lineidx		 headings;
+	struct lineidx		 links;
+	const char		*links_base;	/* see link_url */
+
+	/* the wrapped layout, see vline_* in wrap.c */
+	struct vline		*vlines;
+	size_t			 vlines_len;
+	size_t			 vlines_cap;
+
+	/*
+	 * Skip index over the hidden vlines, built on demand by
+	 * vline_next_visible and vline_prev_visible.
+	 */
+	uint32_t		*vis;
+	size_t			 vis_len;
+	size_t			 vis_cap;
+	size_t			 vis_hidden;
+
+	/* the rewrap in the pool, see wrap_page_async */
+	struct wrap_job		*wrap_job;
 };
 
 #define TAB_CURRENT	0x1	/* only for save_session */
 #define TAB_KILLED	0x2	/* only for save_session */
 #define TAB_URGENT	0x4
 #define TAB_LAZY	0x8	/* to lazy load tabs */
+#define TAB_REFRESH	0x10	/* got new data, refresh after the read */
+#define TAB_WATCH	0x20	/* reload local files when they change */
+#define TAB_COMPLETE	0x40	/* the whole page of a 2x reply is shown */
 
 #define NEW_TAB_URL	"about:new"
 
@@ -143,6 +246,31 @@ struct hist;
 TAILQ_HEAD(tabshead, tab);
 extern struct tabshead tabshead;
 extern struct tabshead ktabshead;
+/*
+ * When a request got past each phase, in microseconds since the net
+ * process received it.  Sent along with IMSG_EOF.
+ */
+enum {
+	TIMING_STARTED,
+	TIMING_RESOLVED,
+	TIMING_CONNECTED,
+	TIMING_HANDSHAKE,
+	TIMING_CERT,
+	TIMING_FIRST_BYTE,
+	TIMING_EOF,
+	TIMING_MAX,
+};
+
+/* how the connection was set up, see timing_about */
+#define TIMING_F_NODELAY	0x1
+#define TIMING_F_FASTOPEN	0x2	/* the request rode the SYN */
+#define TIMING_F_RCVBUF		0x4
+
+struct req_timing {
+	uint64_t	t[TIMING_MAX];
+	int		flags;
+};
+
 struct tab {
 	TAILQ_ENTRY(tab)	 tabs;
 	uint32_t		 id;
@@ -154,19 +282,41 @@ struct tab {
 	const char		*client_cert;
 	int			 client_cert_temp;
 	struct proxy		*proxy;
-	struct iri		 iri;
+	struct iri		*iri;		/* once loaded */
 	struct hist		*hist;
 	char			*last_input_url;
 
 	int			 code;
-	char			 meta[GEMINI_URL_LEN];
+	char			*meta;		/* of the last reply */
 	int			 redirect_count;
+	char			*redirect_src;	/* see redirect_lookup */
 
 	struct buffer		 buffer;
 
+	time_t			 backoff_until;	/* see IMSG_BACKOFF */
 	short			 loading_anim;
 	short			 loading_anim_step;
 	unsigned long		 loading_timer;
+	struct timespec		 load_start;
+
+	char			*timing_url;
+	struct req_timing	 timing;
+
+	/* the last time it was shown, for the hibernation */
+	time_t			 active;
+
+	/* what the tab bar and the modeline show, see ui.c */
+#define TAB_LABEL_SIZE	160
+	char			 label[TAB_LABEL_SIZE];
+	char			 label_src[TAB_LABEL_SIZE];
+	size_t			 label_srclen;
+	int			 label_urgent;
+	char			*modeline_url;
+	char			*modeline_src;
+
+	/* what was last written to the session, see session.c */
+	uint64_t		 sess_hash;
+	unsigned int		 sess_gen;
 };
 
 extern TAILQ_HEAD(proxylist, proxy) proxies;
@@ -177,6 +327,14 @@ struct proxy {
 	char	*port;
 	int	 proto;
 
+	/* health, see proxy.c */
+	uint64_t	 connect;	/* usec */
+	uint64_t	 ttfb;
+	unsigned int	 ok;
+	unsigned int	 failed;
+	int		 streak;
+	time_t		 down_until;
+
 	TAILQ_ENTRY(proxy) proxies;
 };
 
@@ -187,11 +345,34 @@ enum {
 	/* ... */
 };
 
+/* priority of the requests, the higher the sooner they start */
+enum {
+	PRIO_BACKGROUND,	/* tabs not shown, e.g. restored ones */
+	PRIO_PREFETCH,
+	PRIO_REVALIDATE,	/* the page in the current tab */
+	PRIO_FOREGROUND,
+};
+
 struct get_req {
 	int		proto;
+	int		prio;
 	char		host[254];
 	char		port[16];
 	char		req[1027];
+	char		ccert[256];	/* the identity, if any */
+	int		hold;		/* wait for IMSG_PROCEED, for gopher */
+};
+
+/* settings of the net process, sent after the config is parsed */
+struct net_conf {
+	int		dns_ttl;
+	int		connect_timeout;
+	int		handshake_timeout;
+	int		idle_timeout;
+	int		total_timeout;
+	int		tcp_fastopen;
+	int		tcp_nodelay;
+	int		tcp_rcvbuf;
 };
 
 /* downloads.c */
@@ -202,12 +383,20 @@ struct download {
 	size_t			 bytes;
 	char 			*mime_type;
 	char			*path;
+	struct timespec		 start;
+	struct timespec		 last;		/* of the last progress */
+	double			 rate;		/* bytes/s */
+	long long		 elapsed;	/* usec, once done */
+	struct line		*line;		/* in the downloads pane */
 	STAILQ_ENTRY(download)	 entries;
 };
 
 void		 recompute_downloads(void);
+void		 refresh_downloads(void);
+void		 downloads_init(void);
 struct download	*enqueue_download(uint32_t, const char *, const char *);
 struct download	*download_by_id(uint32_t);
+void		 download_progress(struct download *, size_t);
 void 	 	 download_finished(struct download *);
 
 /* help.c */
@@ -220,19 +409,23 @@ int		 setup_parser_for(struct tab*);
 int		 net_main(void);
 
 /* parse.y */
-void		 parseconfig(const char *, int);
+void		 parseconfig(const char *, int, int);
 
 /* sandbox.c */
 void		 sandbox_net_process(void);
+void		 sandbox_persist_process(void);
 void		 sandbox_ui_process(void);
 
 /* telescope.c */
 extern int operating;
 extern int safe_mode;
+extern size_t tls_handshakes;
+extern size_t tls_resumed;
 
 #define LU_MODE_NONE	0x0
 #define LU_MODE_NOHIST	0x1
 #define LU_MODE_NOCACHE	0x2
+#define LU_MODE_NOMIRROR	0x4
 
 void		 gopher_send_search_req(struct tab *, const char *);
 void		 load_page_from_str(struct tab *, const char *);
@@ -240,16 +433,68 @@ void		 load_url(struct tab *, const char *, const char *, int);
 void		 load_url_in_tab(struct tab *, const char *, const char *, int);
 int		 load_previous_page(struct tab*);
 int		 load_next_page(struct tab*);
+int		 revalidate_page(struct tab *);
+int		 prefetch_feed(const char *);
 void		 write_buffer(const char *, struct tab *);
+int		 write_buffer_abort(void);
 void		 humanify_url(const char *, const char *, char *, size_t);
-int		 bookmark_page(const char *);
+const char	*link_url(struct tab *, struct lineref *);
+const char	*line_url(struct tab *, struct line *);
+void		 preconnect_link(void);
 int		 ui_send_net(int, uint32_t, int, const void *, uint16_t);
+int		 ui_send_persist(int, const void *, uint16_t);
 
 /* wrap.c */
+
+/*
+ * The wrapped form of a page about to be replaced with a new version
+ * of itself, see relayout_apply.
+ */
+struct relayout {
+	uint64_t	*hash;		/* of every line */
+	size_t		*len;		/* and its length */
+	size_t		*first;		/* their first vline, nlines + 1 */
+	struct vline	*vlines;
+	size_t		 nlines;
+	int		 width;
+	int		 fill_column;
+	int		 pre;
+	int		 emojify;
+	size_t		 top, topdelta;	/* line and vline inside it */
+	size_t		 cur, curdelta;
+};
+
 void		 erase_buffer(struct buffer *);
+void		 release_buffer(struct buffer *);
+size_t		 buffer_memory(struct buffer *, struct bufmem *);
 void		 empty_linelist(struct buffer*);
 void		 empty_vlist(struct buffer*);
 int		 wrap_text(struct buffer*, const char*, struct line*, size_t, int);
 int		 wrap_page(struct buffer *, int width);
+void		 wrap_line_update(struct buffer *, struct line *);
+void		 wrap_hidden_changed(struct buffer *, struct line *,
+		    struct line *);
+int		 wrap_page_tail(struct buffer *, int width, size_t);
+int		 wrap_pending(struct buffer *);
+void		 wrap_page_finish(struct buffer *);
+void		 relayout_save(struct buffer *, struct relayout *);
+int		 relayout_apply(struct buffer *, struct relayout *, int);
+void		 relayout_free(struct relayout *);
+int		 wrap_page_async(struct buffer *, int width);
+void		 wrap_join(struct buffer *);
+void		 wrap_join_all(void);
+struct vline	*vline_at(struct buffer *, size_t);
+size_t		 vline_index(struct buffer *, struct vline *);
+struct vline	*vline_first(struct buffer *);
+struct vline	*vline_last(struct buffer *);
+struct vline	*vline_next(struct buffer *, struct vline *);
+struct vline	*vline_prev(struct buffer *, struct vline *);
+void		 vline_hidden_changed(struct buffer *);
+struct vline	*vline_next_visible(struct buffer *, struct vline *);
+struct vline	*vline_prev_visible(struct buffer *, struct vline *);
+size_t		 vline_visible_index(struct buffer *, struct vline *);
+struct vline	*line_vline(struct buffer *, struct line *);
+struct lineref	*lineidx_near(struct buffer *, struct lineidx *, size_t, int);
+struct lineref	*lineidx_find(struct buffer *, struct lineidx *, struct line *);
 
 #endif /* TELESCOPE_H */
@@ -0,0 +1,833 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measure the throughput of the parsers and of the wrapping code on
+ * synthetic documents.  The documents are fed to parser_parse in
+ * chunks of the same size net.c uses and then rewrapped at a few
+ * different widths.
+ *
+ * The other hot paths are measured too: the event loop timers, the
+ * extraction of lines from a bufio buffer, the filtering of the
+ * completions while typing and the page cache.  With -m the results
+ * are printed one per line as tab-separated fields: the benchmark,
+ * the step, the operations done, the bytes processed, the time taken
+ * in nanoseconds and the allocations made.
+ */
+
+#include "compat.h"
+
+#include <sys/resource.h>
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bufio.h"
+#include "defaults.h"
+#include "ev.h"
+#include "filter.h"
+#include "fs.h"
+#include "hist.h"
+#include "mcache.h"
+#include "parser.h"
+#include "telescope.h"
+#include "xwrapper.h"
+
+#define DEFAULT_SIZE	(4 * 1024 * 1024)
+#define DEFAULT_CHUNK	4096	/* same as net.c */
+#define MAX_WIDTHS	16
+#define EV_TIMERS	(100 * 1000)
+#define COMPL_ENTRIES	(100 * 1000)
+#define MCACHE_PAGES	256
+#define MCACHE_PAGE	(16 * 1024)
+
+#define nitems(x)	(sizeof(x) / sizeof((x)[0]))
+
+/* XXX: needed just to please the linker */
+int hide_pre_context;
+int hide_pre_closing_line;
+int hide_pre_blocks;
+int long_line_size;
+int patch_fold_size;
+int emojify_link = 1;
+int dont_apply_styling;
+int dont_wrap_pre;
+int fill_column = 120;
+int cache_size = 64 * 1024 * 1024;
+int disk_cache;
+int safe_mode = 1;
+int spill_size;
+int wrap_threads;
+size_t tls_handshakes;
+size_t tls_resumed;
+char pagecache_file[PATH_MAX], pagecache_file_tmp[PATH_MAX];
+
+struct lineprefix line_prefixes[] = {
+	[LINE_TEXT] =		{ "",		"" },
+	[LINE_LINK] =		{ "→ ",		"  " },
+	[LINE_TITLE_1] =	{ "# ",		"  " },
+	[LINE_TITLE_2] =	{ "## ",	"   " },
+	[LINE_TITLE_3] =	{ "### ",	"    " },
+	[LINE_ITEM] =		{ " • ",	"   " },
+	[LINE_QUOTE] =		{ " ┃ ",	" ┃ " },
+	[LINE_PRE_START] =	{ "─── ",	"    " },
+	[LINE_PRE_CONTENT] =	{ "",		"" },
+	[LINE_PRE_END] =	{ "─── ",	"" },
+
+	[LINE_PATCH] =		{"", ""},
+	[LINE_PATCH_HDR] =	{"", ""},
+	[LINE_PATCH_HUNK_HDR] =	{"", ""},
+	[LINE_PATCH_ADD] =	{"", ""},
+	[LINE_PATCH_DEL] =	{"", ""},
+
+	[LINE_COMPL] =		{"", ""},
+	[LINE_COMPL_CURRENT] =	{"", ""},
+
+	[LINE_HELP] =		{"", ""},
+
+	[LINE_DOWNLOAD] =	{" Fetching ", "          "},
+	[LINE_DOWNLOAD_DONE] =	{" Done     ", "          "},
+	[LINE_DOWNLOAD_INFO] =	{" ", " "},
+
+	[LINE_FRINGE] =		{"~", ""},
+};
+
+static size_t	 nallocs;
+static int	 machine;
+
+/*
+ * Counting versions of the xwrapper functions; all the allocations
+ * done by the parsers and by wrap.c go through them.
+ */
+void *
+xmalloc(size_t size)
+{
+	void	*ptr;
+
+	nallocs++;
+	if ((ptr = malloc(size)) == NULL)
+		err(1, "malloc");
+	return ptr;
+}
+
+void *
+xcalloc(size_t nmemb, size_t size)
+{
+	void	*ptr;
+
+	nallocs++;
+	if ((ptr = calloc(nmemb, size)) == NULL)
+		err(1, "calloc");
+	return ptr;
+}
+
+void *
+xrealloc(void *ptr, size_t size)
+{
+	nallocs++;
+	if ((ptr = realloc(ptr, size)) == NULL)
+		err(1, "realloc");
+	return ptr;
+}
+
+void *
+xreallocarray(void *ptr, size_t nmemb, size_t size)
+{
+	nallocs++;
+	if ((ptr = reallocarray(ptr, nmemb, size)) == NULL)
+		err(1, "reallocarray");
+	return ptr;
+}
+
+char *
+xstrdup(const char *str)
+{
+	char	*cp;
+
+	nallocs++;
+	if ((cp = strdup(str)) == NULL)
+		err(1, "strdup");
+	return cp;
+}
+
+struct doc {
+	char	*buf;
+	size_t	 len;
+	size_t	 cap;
+};
+
+static void
+doc_add(struct doc *d, const char *s)
+{
+	size_t	 len;
+
+	len = strlen(s);
+	if (d->len + len > d->cap) {
+		d->cap = (d->cap + len) * 2;
+		if ((d->buf = realloc(d->buf, d->cap)) == NULL)
+			err(1, "realloc");
+	}
+	memcpy(d->buf + d->len, s, len);
+	d->len += len;
+}
+
+static const char *words[] = {
+	"lorem", "ipsum", "dolor", "sit", "amet", "gemini", "capsule",
+	"über", "naïve", "café", "日本語", "テキスト", "🙂", "東京",
+	"consectetur", "adipiscing", "elit", "sed", "do", "eiusmod",
+};
+
+static uint32_t	 seed;
+
+static uint32_t
+rnd(void)
+{
+	/* deterministic, so that runs are comparable */
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+static void
+add_words(struct doc *d, int n)
+{
+	int	 i;
+
+	for (i = 0; i < n; ++i) {
+		if (i != 0)
+			doc_add(d, " ");
+		doc_add(d, words[rnd() % nitems(words)]);
+	}
+}
+
+static void
+gen_gemtext(struct doc *d, size_t size)
+{
+	char	 buf[128];
+	int	 i;
+
+	while (d->len < size) {
+		switch (rnd() % 10) {
+		case 0:
+			doc_add(d, "## ");
+			add_words(d, 4);
+			break;
+		case 1:
+		case 2:
+			(void)snprintf(buf, sizeof(buf),
+			    "=> gemini://example.com/%u.gmi ", rnd());
+			doc_add(d, buf);
+			add_words(d, 1 + rnd() % 6);
+			break;
+		case 3:
+			doc_add(d, "* ");
+			add_words(d, 3 + rnd() % 10);
+			break;
+		case 4:
+			doc_add(d, "> ");
+			add_words(d, 10 + rnd() % 40);
+			break;
+		case 5:
+			doc_add(d, "```\n");
+			for (i = 0; i < 8; ++i) {
+				doc_add(d, "\tcode ");
+				add_words(d, 6);
+				doc_add(d, "\n");
+			}
+			doc_add(d, "```");
+			break;
+		default:
+			add_words(d, 20 + rnd() % 120);
+			break;
+		}
+		doc_add(d, "\n");
+	}
+}
+
+/* code listings and ASCII art, wider than the window */
+static void
+gen_pre(struct doc *d, size_t size)
+{
+	static const char *art[] = {
+		"+--", "---", "|  ", " | ", "/\\", "\\/", "__", "..",
+		"┌─", "──", "─┐", "│ ", "└─", "─┘", "░▒▓", "  ",
+	};
+	int	 i, j, n;
+
+	while (d->len < size) {
+		doc_add(d, "Some words before the block.\n```\n");
+		for (i = 0; i < 40; ++i) {
+			if (rnd() % 2) {
+				n = 20 + rnd() % 60;
+				for (j = 0; j < n; ++j)
+					doc_add(d, art[rnd() % nitems(art)]);
+			} else {
+				doc_add(d, "\tif (");
+				add_words(d, 4 + rnd() % 30);
+				doc_add(d, ") {");
+			}
+			doc_add(d, "\n");
+		}
+		doc_add(d, "```\n");
+	}
+}
+
+/* an index page: only links, some of them without a label */
+static void
+gen_links(struct doc *d, size_t size)
+{
+	char	 buf[128];
+
+	while (d->len < size) {
+		(void)snprintf(buf, sizeof(buf),
+		    "=> gemini://example.com/%u/%u.gmi", rnd(), rnd());
+		doc_add(d, buf);
+		if (rnd() % 3 != 0) {
+			doc_add(d, " ");
+			add_words(d, 2 + rnd() % 6);
+		}
+		doc_add(d, "\n");
+	}
+}
+
+static void
+gen_gophermap(struct doc *d, size_t size)
+{
+	char	 buf[128];
+
+	while (d->len < size) {
+		switch (rnd() % 4) {
+		case 0:
+			doc_add(d, "1");
+			add_words(d, 3);
+			(void)snprintf(buf, sizeof(buf),
+			    "\t/dir/%u\texample.com\t70\r\n", rnd());
+			break;
+		case 1:
+			doc_add(d, "0");
+			add_words(d, 4);
+			(void)snprintf(buf, sizeof(buf),
+			    "\t/file/%u.txt\texample.com\t70\r\n", rnd());
+			break;
+		default:
+			doc_add(d, "i");
+			add_words(d, 5 + rnd() % 10);
+			(void)strlcpy(buf, "\t\terror.host\t1\r\n",
+			    sizeof(buf));
+			break;
+		}
+		doc_add(d, buf);
+	}
+}
+
+static void
+gen_patch(struct doc *d, size_t size)
+{
+	char	 buf[128];
+	int	 i;
+
+	while (d->len < size) {
+		if (rnd() % 8 == 0) {
+			(void)snprintf(buf, sizeof(buf),
+			    "diff a/file%u.c b/file%u.c\n"
+			    "--- a/file%u.c\n"
+			    "+++ b/file%u.c\n", seed, seed, seed, seed);
+			doc_add(d, buf);
+		}
+		(void)snprintf(buf, sizeof(buf), "@@ -%u,7 +%u,7 @@\n",
+		    rnd(), rnd());
+		doc_add(d, buf);
+		for (i = 0; i < 7; ++i) {
+			doc_add(d, i == 3 ? "-\t" : i == 4 ? "+\t" : " \t");
+			add_words(d, 3 + rnd() % 10);
+			doc_add(d, "\n");
+		}
+	}
+}
+
+static void
+gen_text(struct doc *d, size_t size)
+{
+	while (d->len < size) {
+		add_words(d, rnd() % 16);
+		doc_add(d, "\n");
+	}
+}
+
+static const struct bench {
+	const char		*name;
+	const struct parser	*parser;
+	void			(*gen)(struct doc *, size_t);
+} benches[] = {
+	{ "gemtext",	&gemtext_parser,	gen_gemtext },
+	{ "gophermap",	&gophermap_parser,	gen_gophermap },
+	{ "links",	&gemtext_parser,	gen_links },
+	{ "patch",	&textpatch_parser,	gen_patch },
+	{ "pre",	&gemtext_parser,	gen_pre },
+	{ "text",	&textplain_parser,	gen_text },
+};
+
+static double
+now(void)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long
+peak_rss(void)
+{
+	struct rusage	 ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) == -1)
+		err(1, "getrusage");
+#ifdef __APPLE__
+	return ru.ru_maxrss / 1024;
+#else
+	return ru.ru_maxrss;
+#endif
+}
+
+static void
+heading(const char *fmt, ...)
+{
+	va_list	 ap;
+
+	if (machine)
+		return;
+	va_start(ap, fmt);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+static void
+report(const char *bench, const char *what, size_t ops, size_t len,
+    double t, size_t allocs)
+{
+	if (machine)
+		printf("%s\t%s\t%zu\t%zu\t%.0f\t%zu\n", bench, what, ops, len,
+		    t * 1e9, allocs);
+	else if (len != 0)
+		printf("  %-12s %9.2f MB/s %9.3f ms %8zu allocs\n", what,
+		    len / t / (1024 * 1024), t * 1000, allocs);
+	else
+		printf("  %-12s %9.1f ns/op %9.3f ms %8zu allocs\n", what,
+		    t * 1e9 / ops, t * 1000, allocs);
+}
+
+static void
+tab_init(struct tab *tab, const char *url)
+{
+	memset(tab, 0, sizeof(*tab));
+	if ((tab->hist = hist_new(HIST_LINEAR)) == NULL)
+		err(1, "hist_new");
+	if (hist_push(tab->hist, url) == -1)
+		err(1, "hist_push");
+	TAILQ_INIT(&tab->buffer.head);
+}
+
+static void
+tab_parse(struct tab *tab, const struct parser *parser, struct doc *d,
+    size_t chunk)
+{
+	size_t	 off, n;
+
+	parser_init(&tab->buffer, parser);
+	for (off = 0; off < d->len; off += n) {
+		n = MIN(chunk, d->len - off);
+		if (!parser_parse(&tab->buffer, d->buf + off, n))
+			errx(1, "parser_parse failed");
+	}
+	if (!parser_free(tab))
+		errx(1, "parser_free failed");
+}
+
+static void
+tab_free(struct tab *tab)
+{
+	erase_buffer(&tab->buffer);
+	arena_free(&tab->buffer.line_arena);
+	free(tab->buffer.vlines);
+	hist_free(tab->hist);
+}
+
+static void
+run(const struct bench *b, size_t size, size_t chunk, int *widths,
+    int nwidths)
+{
+	struct tab	 tab;
+	struct doc	 d;
+	double		 t;
+	size_t		 a;
+	int		 i;
+	char		 what[32];
+
+	memset(&d, 0, sizeof(d));
+	seed = 42;
+	b->gen(&d, size);
+
+	tab_init(&tab, "gemini://example.com/");
+
+	heading("%s: %zu bytes in chunks of %zu\n", b->name, d.len, chunk);
+
+	a = nallocs;
+	t = now();
+	tab_parse(&tab, b->parser, &d, chunk);
+	report(b->name, "parse", 1, d.len, now() - t, nallocs - a);
+
+	/* the first wrap also computes the layout of every line */
+	for (i = 0; i < nwidths; ++i) {
+		a = nallocs;
+		t = now();
+		wrap_page(&tab.buffer, widths[i]);
+		(void)snprintf(what, sizeof(what), "wrap %d", widths[i]);
+		report(b->name, what, 1, d.len, now() - t, nallocs - a);
+	}
+
+	heading("  %zu vlines, peak RSS %ld KB\n", tab.buffer.vlines_len,
+	    peak_rss());
+
+	tab_free(&tab);
+	free(d.buf);
+}
+
+static size_t	 ev_fired, ev_rearm;
+
+static void
+ev_fire(int fd, int ev, void *data)
+{
+	struct timeval	 tv = { 0, 0 };
+
+	/* half of them schedule another one, as the retries do */
+	if (ev_rearm > 0) {
+		ev_rearm--;
+		if (ev_timer(&tv, ev_fire, NULL) == 0)
+			err(1, "ev_timer");
+	}
+
+	if (--ev_fired == 0)
+		ev_break();
+}
+
+/*
+ * Schedule a lot of timers, cancel half of them and let the other
+ * ones fire.
+ */
+static void
+bench_ev(size_t size, size_t chunk)
+{
+	struct timeval	 tv;
+	unsigned int	*ids;
+	size_t		 i, n = EV_TIMERS, a;
+	double		 t;
+
+	heading("ev: %zu timers\n", n);
+
+	ids = xcalloc(n, sizeof(*ids));
+	seed = 42;
+
+	a = nallocs;
+	t = now();
+	for (i = 0; i < n; ++i) {
+		tv.tv_sec = 0;
+		tv.tv_usec = rnd() % 1000;
+		if ((ids[i] = ev_timer(&tv, ev_fire, NULL)) == 0)
+			err(1, "ev_timer");
+	}
+	report("ev", "add", n, 0, now() - t, nallocs - a);
+
+	a = nallocs;
+	t = now();
+	for (i = 0; i < n; i += 2)
+		if (ev_timer_cancel(ids[i]) == -1)
+			err(1, "ev_timer_cancel");
+	report("ev", "cancel", n / 2, 0, now() - t, nallocs - a);
+
+	ev_rearm = n / 2 / 2;
+	ev_fired = n / 2 + ev_rearm;
+
+	a = nallocs;
+	t = now();
+	if (ev_loop() == -1)
+		err(1, "ev_loop");
+	report("ev", "fire", n / 2 + n / 2 / 2, 0, now() - t, nallocs - a);
+
+	free(ids);
+}
+
+/* split a gophermap in lines as it's read from the network */
+static void
+bench_bufio(size_t size, size_t chunk)
+{
+	struct bufio	 bio;
+	struct doc	 d;
+	size_t		 off, n, len, nlines = 0;
+	double		 t;
+
+	memset(&d, 0, sizeof(d));
+	seed = 42;
+	gen_gophermap(&d, size);
+
+	heading("bufio: %zu bytes in chunks of %zu\n", d.len, chunk);
+
+	if (bufio_init(&bio) == -1)
+		err(1, "bufio_init");
+
+	t = now();
+	for (off = 0; off < d.len; off += n) {
+		n = MIN(chunk, d.len - off);
+		if (bufio_compose(&bio, d.buf + off, n) == -1)
+			err(1, "bufio_compose");
+		while (buf_getdelim(&bio.wbuf, "\r\n", &len) != NULL) {
+			buf_drain(&bio.wbuf, len);
+			nlines++;
+		}
+	}
+	report("bufio", "getdelim", nlines, d.len, now() - t, 0);
+
+	bufio_free(&bio);
+	free(d.buf);
+}
+
+/*
+ * Type a query one character at a time over a big history, as
+ * recompute_completions does, then delete it one character at a time.
+ */
+static void
+bench_completion(size_t size, size_t chunk)
+{
+	static const char *query = "gemini capsule naïve";
+	struct filter	*f;
+	char		 url[128], title[64], buf[64];
+	size_t		 i, n = COMPL_ENTRIES, len, found = 0, a;
+	double		 t;
+
+	heading("completion: %zu entries\n", n);
+
+	seed = 42;
+	f = filter_new(0);
+
+	a = nallocs;
+	t = now();
+	for (i = 0; i < n; ++i) {
+		(void)snprintf(url, sizeof(url),
+		    "gemini://%s.example/%s/%u.gmi", words[rnd() % nitems(words)],
+		    words[rnd() % nitems(words)], rnd());
+		(void)snprintf(title, sizeof(title), "%s %s %s",
+		    words[rnd() % nitems(words)], words[rnd() % nitems(words)],
+		    words[rnd() % nitems(words)]);
+		filter_add(f, url, title, NULL);
+	}
+	report("completion", "add", n, 0, now() - t, nallocs - a);
+
+	len = strlen(query);
+
+	a = nallocs;
+	t = now();
+	for (i = 1; i <= len; ++i) {
+		(void)strlcpy(buf, query, i + 1);
+		found = filter_match(f, buf, i > 1);
+	}
+	report("completion", "type", len, 0, now() - t, nallocs - a);
+	heading("  %zu matches for \"%s\"\n", found, query);
+
+	a = nallocs;
+	t = now();
+	for (i = len; i > 0; --i) {
+		(void)strlcpy(buf, query, i + 1);
+		(void)filter_match(f, buf, 0);
+	}
+	report("completion", "delete", len, 0, now() - t, nallocs - a);
+
+	filter_free(f);
+}
+
+/* store a lot of different pages in the cache and restore them */
+static void
+bench_mcache(size_t size, size_t chunk)
+{
+	struct tab	*tabs, tab;
+	struct doc	 d;
+	size_t		 i, n = MCACHE_PAGES, len = 0, a;
+	double		 t;
+	char		 url[64];
+
+	heading("mcache: %zu pages of %zu bytes\n", n, (size_t)MCACHE_PAGE);
+
+	mcache_init();
+
+	tabs = xcalloc(n, sizeof(*tabs));
+	seed = 42;
+	for (i = 0; i < n; ++i) {
+		memset(&d, 0, sizeof(d));
+		gen_gemtext(&d, MCACHE_PAGE);
+		(void)snprintf(url, sizeof(url),
+		    "gemini://example.com/%zu.gmi", i);
+		tab_init(&tabs[i], url);
+		tab_parse(&tabs[i], &gemtext_parser, &d, chunk);
+		len += d.len;
+		free(d.buf);
+	}
+
+	a = nallocs;
+	t = now();
+	for (i = 0; i < n; ++i)
+		if (mcache_tab(&tabs[i]) == -1)
+			errx(1, "mcache_tab failed");
+	report("mcache", "store", n, len, now() - t, nallocs - a);
+
+	tab_init(&tab, "about:blank");
+
+	a = nallocs;
+	t = now();
+	for (i = 0; i < n; ++i) {
+		(void)snprintf(url, sizeof(url),
+		    "gemini://example.com/%zu.gmi", i);
+		if (!mcache_lookup(url, &tab))
+			errx(1, "mcache_lookup failed for %s", url);
+	}
+	report("mcache", "lookup", n, len, now() - t, nallocs - a);
+
+	tab_free(&tab);
+	for (i = 0; i < n; ++i)
+		tab_free(&tabs[i]);
+	free(tabs);
+}
+
+static const struct extra {
+	const char		*name;
+	void			(*fn)(size_t, size_t);
+} extras[] = {
+	{ "bufio",	bench_bufio },
+	{ "completion",	bench_completion },
+	{ "ev",		bench_ev },
+	{ "mcache",	bench_mcache },
+};
+
+static int
+wanted(const char *name, int argc, char **argv)
+{
+	int	 i;
+
+	if (argc == 0)
+		return 1;
+	for (i = 0; i < argc; ++i)
+		if (!strcmp(argv[i], name))
+			return 1;
+	return 0;
+}
+
+static size_t
+parse_size(const char *s)
+{
+	char		*ep;
+	unsigned long	 n;
+
+	errno = 0;
+	n = strtoul(s, &ep, 10);
+	if (errno != 0 || ep == s)
+		errx(1, "invalid size: %s", s);
+	switch (*ep) {
+	case 'k':
+	case 'K':
+		n *= 1024;
+		ep++;
+		break;
+	case 'm':
+	case 'M':
+		n *= 1024 * 1024;
+		ep++;
+		break;
+	}
+	if (*ep != '\0' || n == 0)
+		errx(1, "invalid size: %s", s);
+	return n;
+}
+
+static void __dead
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-mp] [-c chunk] [-s size] [-w width] "
+	    "[bench ...]\n", getprogname());
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*errstr;
+	size_t		 size = DEFAULT_SIZE, chunk = DEFAULT_CHUNK;
+	int		 widths[MAX_WIDTHS] = { 40, 80, 120, 200 };
+	int		 nwidths = 0, ch;
+	size_t		 i;
+
+	while ((ch = getopt(argc, argv, "c:mps:w:")) != -1) {
+		switch (ch) {
+		case 'c':
+			chunk = parse_size(optarg);
+			break;
+		case 'm':
+			machine = 1;
+			break;
+		case 'p':
+			dont_wrap_pre = 1;
+			break;
+		case 's':
+			size = parse_size(optarg);
+			break;
+		case 'w':
+			if (nwidths == MAX_WIDTHS)
+				errx(1, "too many widths");
+			widths[nwidths++] = strtonum(optarg, 1, INT_MAX,
+			    &errstr);
+			if (errstr != NULL)
+				errx(1, "width is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (nwidths == 0)
+		nwidths = 4;
+
+	if (ev_init() == -1)
+		err(1, "ev_init");
+
+	if (machine)
+		printf("# bench\tstep\tops\tbytes\tnsec\tallocs\n");
+
+	for (i = 0; i < nitems(benches); ++i)
+		if (wanted(benches[i].name, argc, argv))
+			run(&benches[i], size, chunk, widths, nwidths);
+	for (i = 0; i < nitems(extras); ++i)
+		if (wanted(extras[i].name, argc, argv))
+			extras[i].fn(size, chunk);
+
+	return 0;
+}
@@ -48,6 +48,23 @@ unsigned long	 tout_a;
 unsigned long	 tout_b;
 unsigned long	 tout_c;
 
+/* a lot of timers, one every third is cancelled */
+#define NMANY	3000
+
+unsigned int	 many[NMANY];
+int		 many_fired[NMANY];
+int		 many_last = -1;
+int		 many_bad;
+
+/* idle callbacks: one re-adds itself a few times, one is cancelled */
+int		 idle_runs;
+int		 idle_cancelled;
+unsigned int	 idle_b;
+
+/* an idle callback that should yield once there's input */
+int		 input[2];
+int		 yield_ok;
+
 static void
 pipe_ev(int fd, int ev, void *data)
 {
@@ -71,6 +88,88 @@ timeout_cancel_b(int fd, int ev, void *data)
 	ev_timer_cancel(tout_b);
 }
 
+static void
+timeout_many(int fd, int ev, void *data)
+{
+	int	 i = (int *)data - many_fired;
+
+	/* they have to fire in order and only once */
+	if (i % 3 == 0 || many_fired[i] || i < many_last)
+		many_bad = 1;
+	many_fired[i] = 1;
+	many_last = i;
+}
+
+static void
+add_many(void)
+{
+	struct timeval	 tv;
+	int		 i;
+
+	for (i = 0; i < NMANY; ++i) {
+		tv.tv_sec = 0;
+		tv.tv_usec = 50000 + i * 50;
+		if ((many[i] = ev_timer(&tv, timeout_many,
+		    &many_fired[i])) == 0)
+			err(1, "ev_timer");
+	}
+
+	for (i = 0; i < NMANY; i += 3)
+		if (ev_timer_cancel(many[i]) == -1)
+			errx(1, "can't cancel timer %d", i);
+
+	for (i = 0; i < NMANY; ++i)
+		if (ev_timer_pending(many[i]) != (i % 3 != 0))
+			errx(1, "wrong pending state for timer %d", i);
+}
+
+static int
+check_many(void)
+{
+	int	 i;
+
+	for (i = 0; i < NMANY; ++i) {
+		if (ev_timer_pending(many[i]))
+			return 0;
+		if (many_fired[i] != (i % 3 != 0))
+			return 0;
+	}
+	return !many_bad;
+}
+
+static void
+idle_cb(int fd, int ev, void *data)
+{
+	assert(fd == -1 && ev == EV_IDLE);
+	if (++idle_runs < 10 && ev_idle(idle_cb, NULL) == 0)
+		err(1, "ev_idle");
+}
+
+static void
+idle_cancel_cb(int fd, int ev, void *data)
+{
+	idle_cancelled = 1;
+}
+
+static void
+yield_cb(int fd, int ev, void *data)
+{
+	struct timeval	 start, now, diff;
+
+	if (ev_yield())
+		return;
+	if (write(input[1], "x", 1) != 1)
+		err(1, "write");
+
+	gettimeofday(&start, NULL);
+	do {
+		gettimeofday(&now, NULL);
+		timersub(&now, &start, &diff);
+	} while (diff.tv_sec == 0 && diff.tv_usec < EV_YIELD_SLICE);
+
+	yield_ok = ev_yield();
+}
+
 static void
 timeout_quit(int fd, int ev, void *data)
 {
@@ -95,13 +194,37 @@ main(void)
 	if (ev_add(p[0], POLLIN, pipe_ev, NULL) == -1)
 		err(1, "ev_add");
 
+	if (pipe(input) == -1)
+		err(1, "pipe");
+	ev_input(input[0]);
+
 	if ((tout_c = ev_timer(&tv_c, timeout_quit, &fired_c)) == 0 ||
 	    (tout_b = ev_timer(&tv_b, timeout_cb, &fired_b)) == 0 ||
 	    (tout_a = ev_timer(&tv_a, timeout_cancel_b, &fired_a)) == 0)
 		err(1, "ev_timer");
 
+	add_many();
+
+	if (ev_idle(idle_cb, NULL) == 0 ||
+	    (idle_b = ev_idle(idle_cancel_cb, NULL)) == 0 ||
+	    ev_idle(yield_cb, NULL) == 0)
+		err(1, "ev_idle");
+	if (!ev_idle_pending(idle_b) || ev_idle_cancel(idle_b) == -1 ||
+	    ev_idle_pending(idle_b))
+		errx(1, "can't cancel the idle callback");
+
 	ev_loop();
 
+	if (!check_many())
+		errx(1, "the many timers didn't fire as expected");
+
+	if (idle_runs != 10 || idle_cancelled)
+		errx(1, "idle callbacks not run as expected: %d %d",
+		    idle_runs, idle_cancelled);
+
+	if (!yield_ok)
+		errx(1, "the idle callback didn't yield to the input");
+
 	if (fired_a && !fired_b && fired_c)
 		return 0;
 
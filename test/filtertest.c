@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+
+#define NCAND	3000
+
+char	*lines[NCAND];
+char	*alts[NCAND];
+
+static const char *words[] = {
+	"gemini", "Gopher", "capsule", "telescope", "Omar", "polo",
+	"about", "tilde", "space", "log", "index", "a", "x",
+};
+
+/* what the minibuffer used to do */
+static int
+naive(const char *query, int i)
+{
+	char	 buf[128], *q, *w;
+
+	strlcpy(buf, query, sizeof(buf));
+	for (q = buf; (w = strsep(&q, " ")) != NULL;) {
+		if (*w == '\0')
+			continue;
+		if (strcasestr(lines[i], w) == NULL &&
+		    (alts[i] == NULL || strcasestr(alts[i], w) == NULL))
+			return 0;
+	}
+	return 1;
+}
+
+static int
+check(struct filter *f, const char *query, int narrow, int *prev)
+{
+	const uint32_t	*res;
+	size_t		 i, j, n;
+	int		 want;
+
+	filter_match(f, query, narrow);
+	res = filter_result(f, &n);
+
+	for (i = 0, j = 0; i < NCAND; ++i) {
+		want = naive(query, i) && (!narrow || prev[i]);
+		if (want != (j < n && res[j] == i)) {
+			fprintf(stderr, "FAIL \"%s\": candidate %zu \"%s\" "
+			    "%s\n", query, i, lines[i],
+			    want ? "missing" : "unexpected");
+			return (1);
+		}
+		if (want)
+			j++;
+		prev[i] = want;
+	}
+	if (j != n) {
+		fprintf(stderr, "FAIL \"%s\": %zu extra results\n", query,
+		    n - j);
+		return (1);
+	}
+
+	fprintf(stderr, "OK \"%s\"%s -> %zu\n", query,
+	    narrow ? " (narrow)" : "", n);
+	return (0);
+}
+
+static int
+check_fuzzy(const char *query, const char *first, size_t nmatches)
+{
+	struct filter	*f;
+	const uint32_t	*top;
+	const char	*cands[] = {
+		"about:help", "gemini://tilde.team/telescope", "telescope",
+		"tab-close", "gemini://example.com/t/e/l/e/s/c/o/p",
+		"toggle-pre-wrap", "help",
+	};
+	size_t		 i, n;
+
+	f = filter_new(FILTER_FUZZY);
+	for (i = 0; i < sizeof(cands) / sizeof(cands[0]); ++i)
+		filter_add(f, cands[i], NULL, (void *)cands[i]);
+
+	filter_match(f, query, 0);
+	top = filter_ranked(f, &n);
+	if (n != nmatches ||
+	    (n != 0 && strcmp(filter_data(f, top[0]), first) != 0)) {
+		fprintf(stderr, "FAIL fuzzy \"%s\": got %zu matches, "
+		    "first \"%s\"\n", query, n,
+		    n != 0 ? (char *)filter_data(f, top[0]) : "");
+		filter_free(f);
+		return (1);
+	}
+
+	fprintf(stderr, "OK fuzzy \"%s\" -> %zu\n", query, n);
+	filter_free(f);
+	return (0);
+}
+
+int
+main(void)
+{
+	struct filter	*f;
+	char		 buf[128];
+	size_t		 n;
+	int		 i, prev[NCAND], ret = 0;
+
+	srandom(42);
+	f = filter_new(0);
+	for (i = 0; i < NCAND; ++i) {
+		snprintf(buf, sizeof(buf), "gemini://%s.%s/%s-%d",
+		    words[random() % 13], words[random() % 13],
+		    words[random() % 13], i);
+		lines[i] = strdup(buf);
+		if (i % 3 == 0)
+			alts[i] = NULL;
+		else {
+			snprintf(buf, sizeof(buf), "%s %s",
+			    words[random() % 13], words[random() % 13]);
+			alts[i] = strdup(buf);
+		}
+		filter_add(f, lines[i], alts[i], NULL);
+	}
+
+	ret |= check(f, "", 0, prev);
+	ret |= check(f, "gopher", 0, prev);
+	ret |= check(f, "GOPHER", 0, prev);
+	ret |= check(f, "tel", 0, prev);
+	ret |= check(f, "tele", 1, prev);
+	ret |= check(f, "teles", 1, prev);
+	ret |= check(f, "teles a", 1, prev);
+	ret |= check(f, "teles ab", 1, prev);
+	ret |= check(f, "polo  about", 0, prev);
+	ret |= check(f, "x", 0, prev);
+	ret |= check(f, "x 17", 1, prev);
+	ret |= check(f, "index space", 0, prev);
+	ret |= check(f, "nothing-like-this", 0, prev);
+	ret |= check(f, "-2999", 0, prev);
+
+	filter_free(f);
+
+	ret |= check_fuzzy("", "", 0);
+	ret |= check_fuzzy("telescope", "telescope", 2);
+	ret |= check_fuzzy("tscope", "telescope", 2);
+	ret |= check_fuzzy("help", "help", 2);
+	ret |= check_fuzzy("tc", "tab-close", 4);
+	ret |= check_fuzzy("TILDE tel", "gemini://tilde.team/telescope", 1);
+	ret |= check_fuzzy("zzz", "", 0);
+
+	/* only the best are kept */
+	f = filter_new(FILTER_FUZZY);
+	for (i = 0; i < NCAND; ++i)
+		filter_add(f, lines[i], alts[i], NULL);
+	filter_match(f, "gmi", 0);
+	filter_ranked(f, &n);
+	if (n != 256) {
+		fprintf(stderr, "FAIL fuzzy top-k: got %zu\n", n);
+		ret = 1;
+	}
+	filter_free(f);
+
+	for (i = 0; i < NCAND; ++i) {
+		free(lines[i]);
+		free(alts[i]);
+	}
+
+	return (ret);
+}
@@ -38,6 +38,12 @@ emojied_line(const char *s, const char **space_ret)
 	return 0;
 }
 
+size_t
+utf8_swidth_between(const char *str, const char *end)
+{
+	return 0;
+}
+
 void
 erase_buffer(struct buffer *buffer)
 {
@@ -60,7 +66,6 @@ main(void)
 		err(1, "hist_push");
 
 	TAILQ_INIT(&tab.buffer.head);
-	TAILQ_INIT(&tab.buffer.vhead);
 
 	parser_init(&tab.buffer, &gemtext_parser);
 	for (;;) {
@@ -30,6 +30,12 @@ erase_buffer(struct buffer *buffer)
 	return;
 }
 
+int
+gemtext_load_records(struct buffer *buffer, const char *chunk, size_t len)
+{
+	return 0;
+}
+
 int
 main(void)
 {
@@ -46,7 +52,6 @@ main(void)
 		err(1, "hist_push");
 
 	TAILQ_INIT(&tab.buffer.head);
-	TAILQ_INIT(&tab.buffer.vhead);
 
 	parser_init(&tab.buffer, &gophermap_parser);
 	for (;;) {
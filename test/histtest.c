@@ -0,0 +1,215 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hist.h"
+
+#define NOPS	20000
+#define MAXN	64
+
+/* the same history, as a plain array */
+struct model {
+	char	 strs[MAXN * 2][16];
+	size_t	 size;
+	size_t	 depth;
+	ssize_t	 off;
+};
+
+static void
+model_drop(struct model *m)
+{
+	memmove(m->strs[0], m->strs[1], (m->size - 1) * sizeof(m->strs[0]));
+	m->size--;
+	if (m->off != -1)
+		m->off--;
+}
+
+static void
+model_push(struct model *m, const char *s)
+{
+	if (m->off != -1)
+		m->size = m->off + 1;
+	if (m->depth != 0 && m->size == m->depth)
+		model_drop(m);
+	strlcpy(m->strs[m->size], s, sizeof(m->strs[0]));
+	m->off = m->size++;
+}
+
+static void
+model_prepend(struct model *m, const char *s)
+{
+	if (m->off == -1 || (m->depth != 0 && m->size == m->depth))
+		return;
+	memmove(m->strs[m->off + 1], m->strs[m->off],
+	    (m->size - m->off) * sizeof(m->strs[0]));
+	strlcpy(m->strs[m->off], s, sizeof(m->strs[0]));
+	m->size++;
+	m->off++;
+}
+
+static void
+model_append(struct model *m, const char *s)
+{
+	if (m->off == -1)
+		return;
+	if (m->depth != 0 && m->size == m->depth) {
+		if (m->off <= 0)
+			return;
+		model_drop(m);
+	}
+	strlcpy(m->strs[m->size++], s, sizeof(m->strs[0]));
+}
+
+static int
+check(struct model *m, struct hist *h, int op)
+{
+	const char	*cur;
+	size_t		 i;
+
+	cur = m->off == -1 ? NULL : m->strs[m->off];
+	if (hist_size(h) != m->size ||
+	    (m->off != -1 && hist_off(h) != (size_t)m->off) ||
+	    (cur == NULL) != (hist_cur(h) == NULL) ||
+	    (cur != NULL && strcmp(cur, hist_cur(h)) != 0)) {
+		fprintf(stderr, "FAIL after op %d: size %zu/%zu off %zu/%zd\n",
+		    op, hist_size(h), m->size, hist_off(h), m->off);
+		return 1;
+	}
+
+	for (i = 0; i < m->size; ++i) {
+		if (strcmp(hist_nth(h, i), m->strs[i]) != 0) {
+			fprintf(stderr, "FAIL after op %d: item %zu is %s,"
+			    " not %s\n", op, i, hist_nth(h, i), m->strs[i]);
+			return 1;
+		}
+	}
+	if (hist_nth(h, m->size) != NULL) {
+		fprintf(stderr, "FAIL after op %d: item past the end\n", op);
+		return 1;
+	}
+	return 0;
+}
+
+static int
+run(size_t depth)
+{
+	struct model	 m;
+	struct hist	*h;
+	char		 s[16];
+	int		 i, op;
+
+	memset(&m, 0, sizeof(m));
+	m.off = -1;
+	m.depth = depth;
+
+	if ((h = hist_new(HIST_LINEAR)) == NULL)
+		abort();
+	hist_set_depth(h, depth);
+
+	for (i = 0; i < NOPS; ++i) {
+		/* few distinct strings, to exercise the interning */
+		snprintf(s, sizeof(s), "url-%ld", random() % 20);
+
+		op = random() % 6;
+		if (m.size >= MAXN && (op == 0 || op > 3))
+			op = 1;
+
+		switch (op) {
+		case 0:
+			model_push(&m, s);
+			hist_push(h, s);
+			break;
+		case 1:
+			if (m.off > 0)
+				m.off--;
+			hist_prev(h);
+			break;
+		case 2:
+			if (m.off != -1 && (size_t)m.off + 1 < m.size)
+				m.off++;
+			hist_next(h);
+			break;
+		case 3:
+			if (m.off != -1)
+				strlcpy(m.strs[m.off], s, sizeof(m.strs[0]));
+			hist_set_cur(h, s);
+			break;
+		case 4:
+			model_prepend(&m, s);
+			hist_prepend(h, s);
+			break;
+		case 5:
+			model_append(&m, s);
+			hist_append(h, s);
+			break;
+		}
+
+		if (check(&m, h, op))
+			return 1;
+	}
+
+	hist_free(h);
+	fprintf(stderr, "OK depth %zu\n", depth);
+	return 0;
+}
+
+int
+main(void)
+{
+	struct hist	*a, *b;
+	int		 ret = 0;
+
+	srandom(42);
+	ret |= run(0);
+	ret |= run(1);
+	ret |= run(5);
+	ret |= run(17);
+
+	/* the minibuffer histories wrap around */
+	if ((a = hist_new(HIST_WRAP)) == NULL ||
+	    (b = hist_new(HIST_LINEAR)) == NULL)
+		abort();
+	hist_append(a, "one");
+	hist_append(a, "two");
+	if (hist_cur(a) != NULL || strcmp(hist_prev(a), "two") != 0 ||
+	    strcmp(hist_prev(a), "one") != 0 ||
+	    strcmp(hist_prev(a), "two") != 0 ||
+	    strcmp(hist_next(a), "one") != 0) {
+		fprintf(stderr, "FAIL wrap\n");
+		ret = 1;
+	}
+	hist_seek_start(a);
+	if (hist_cur(a) != NULL || strcmp(hist_next(a), "one") != 0) {
+		fprintf(stderr, "FAIL seek start\n");
+		ret = 1;
+	}
+
+	/* the strings are shared */
+	hist_push(b, "two");
+	if (hist_cur(b) != hist_nth(a, 1)) {
+		fprintf(stderr, "FAIL strings not interned\n");
+		ret = 1;
+	}
+
+	hist_free(a);
+	hist_free(b);
+	return ret;
+}
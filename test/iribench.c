@@ -0,0 +1,293 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Measure how fast links are resolved against the page they're in.
+ * The links come from the text/gemini and gophermap files given as
+ * arguments, or are generated, and are resolved against a few
+ * different bases, as iri_parse and iri_unparse did for every link
+ * followed and as iri_resolve does now.
+ */
+
+#include "compat.h"
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "iri.h"
+
+#define DEFAULT_COUNT	(2 * 1000 * 1000)
+#define URL_LEN		1024	/* GEMINI_URL_LEN */
+
+#define nitems(x)	(sizeof(x) / sizeof((x)[0]))
+
+static const char *bases[] = {
+	"gemini://example.com/",
+	"gemini://example.com/~user/gemlog/2024/index.gmi",
+	"gemini://geminispace.example/search?query",
+	"gopher://gopher.example.org:70/1/archives/",
+	"file:///home/user/notes/todo.gmi",
+};
+
+static char	**links;
+static size_t	  nlinks, linkscap;
+
+static unsigned int seed = 42;
+
+static unsigned int
+rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+static void
+add_link(const char *s, size_t len)
+{
+	if (len == 0)
+		return;
+
+	if (nlinks == linkscap) {
+		linkscap = linkscap * 2 + 1024;
+		if ((links = reallocarray(links, linkscap,
+		    sizeof(*links))) == NULL)
+			err(1, "reallocarray");
+	}
+	if ((links[nlinks] = strndup(s, len)) == NULL)
+		err(1, "strndup");
+	nlinks++;
+}
+
+/* Take the links of a text/gemini or gophermap file. */
+static void
+load_corpus(const char *path)
+{
+	FILE		*fp;
+	char		*line = NULL, *s, *t, *host, *port;
+	char		 buf[2048];
+	size_t		 linesize = 0;
+	ssize_t		 linelen;
+
+	if ((fp = fopen(path, "r")) == NULL)
+		err(1, "can't open %s", path);
+
+	while ((linelen = getline(&line, &linesize, fp)) != -1) {
+		line[strcspn(line, "\r\n")] = '\0';
+
+		if (!strncmp(line, "=>", 2)) {
+			s = line + 2;
+			s += strspn(s, " \t");
+			add_link(s, strcspn(s, " \t"));
+			continue;
+		}
+
+		/* a gophermap: type, name, selector, host and port */
+		if ((s = strchr(line, '\t')) == NULL || *line == 'i')
+			continue;
+		s++;
+		if ((t = strchr(s, '\t')) == NULL)
+			continue;
+		*t++ = '\0';
+		host = t;
+		if ((t = strchr(host, '\t')) == NULL)
+			continue;
+		*t++ = '\0';
+		port = t;
+		port[strcspn(port, "\t")] = '\0';
+
+		if (!strncmp(s, "URL:", 4))
+			add_link(s + 4, strlen(s + 4));
+		else if (snprintf(buf, sizeof(buf), "gopher://%s:%s/%c%s",
+		    host, port, *line, s) < (int)sizeof(buf))
+			add_link(buf, strlen(buf));
+	}
+
+	free(line);
+	fclose(fp);
+}
+
+/* Make up the links of a capsule, most of them relative. */
+static void
+gen_corpus(size_t n)
+{
+	static const char *words[] = {
+		"index", "gemlog", "2024", "about", "posts", "notes",
+		"files", "archive", "tags", "~user", "docs", "feed",
+	};
+	char		 buf[256];
+	size_t		 i;
+
+	for (i = 0; i < n; ++i) {
+		switch (rnd() % 8) {
+		case 0:
+			(void)snprintf(buf, sizeof(buf),
+			    "gemini://host%u.example/%s/%s.gmi", rnd() % 100,
+			    words[rnd() % nitems(words)],
+			    words[rnd() % nitems(words)]);
+			break;
+		case 1:
+			(void)snprintf(buf, sizeof(buf), "/%s/%s/",
+			    words[rnd() % nitems(words)],
+			    words[rnd() % nitems(words)]);
+			break;
+		case 2:
+			(void)snprintf(buf, sizeof(buf), "../%s/%u.gmi",
+			    words[rnd() % nitems(words)], rnd());
+			break;
+		case 3:
+			(void)snprintf(buf, sizeof(buf), "?%s%%20%s",
+			    words[rnd() % nitems(words)],
+			    words[rnd() % nitems(words)]);
+			break;
+		case 4:
+			(void)snprintf(buf, sizeof(buf),
+			    "gopher://gopher.example.org/1/%s",
+			    words[rnd() % nitems(words)]);
+			break;
+		default:
+			(void)snprintf(buf, sizeof(buf), "%s-%u.gmi",
+			    words[rnd() % nitems(words)], rnd());
+			break;
+		}
+		add_link(buf, strlen(buf));
+	}
+}
+
+static int	 machine;
+
+static double
+now(void)
+{
+	struct timespec	 ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		err(1, "clock_gettime");
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+report(const char *what, size_t n, double t, size_t failed)
+{
+	if (machine)
+		printf("iri\t%s\t%zu\t0\t%.0f\t0\n", what, n, t * 1e9);
+	else
+		printf("  %-16s %8.2f Mlinks/s %8.1f ns/link %8zu failed\n",
+		    what, n / t / 1e6, t * 1e9 / n, failed);
+}
+
+static void
+bench_parse(size_t count)
+{
+	static struct iri iri;
+	char		 buf[URL_LEN];
+	size_t		 i, failed = 0;
+	double		 t;
+
+	t = now();
+	for (i = 0; i < count; ++i) {
+		if (iri_parse(bases[i % nitems(bases)], links[i % nlinks],
+		    &iri) == -1 || iri_unparse(&iri, buf, sizeof(buf)) == -1)
+			failed++;
+	}
+	report("parse+unparse", count, now() - t, failed);
+}
+
+static void
+bench_resolve(size_t count)
+{
+	struct iri_fields f;
+	char		 buf[URL_LEN];
+	size_t		 i, failed = 0;
+	double		 t;
+
+	t = now();
+	for (i = 0; i < count; ++i) {
+		if (iri_resolve(bases[i % nitems(bases)], links[i % nlinks],
+		    buf, sizeof(buf), &f) == -1)
+			failed++;
+	}
+	report("resolve", count, now() - t, failed);
+}
+
+static void
+bench_escape(size_t count)
+{
+	char		 buf[URL_LEN * 3];
+	size_t		 i, failed = 0;
+	double		 t;
+
+	t = now();
+	for (i = 0; i < count; ++i) {
+		if (iri_urlescape(links[i % nlinks], buf, sizeof(buf)) == -1)
+			failed++;
+	}
+	report("urlescape", count, now() - t, failed);
+}
+
+static void __dead
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-m] [-n count] [file ...]\n", getprogname());
+	exit(1);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char	*errstr;
+	size_t		 count = DEFAULT_COUNT;
+	int		 ch, i;
+
+	while ((ch = getopt(argc, argv, "mn:")) != -1) {
+		switch (ch) {
+		case 'm':
+			machine = 1;
+			break;
+		case 'n':
+			count = strtonum(optarg, 1, LLONG_MAX, &errstr);
+			if (errstr != NULL)
+				errx(1, "count is %s: %s", errstr, optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	for (i = 0; i < argc; ++i)
+		load_corpus(argv[i]);
+	if (argc == 0)
+		gen_corpus(10000);
+	if (nlinks == 0)
+		errx(1, "no links found");
+
+	if (!machine)
+		printf("%zu links against %zu bases, %zu times\n", nlinks,
+		    nitems(bases), count);
+	bench_parse(count);
+	bench_resolve(count);
+	bench_escape(count);
+
+	return 0;
+}
@@ -0,0 +1,265 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Fuzz iri.c.  The input is a base URL and a reference separated by
+ * a newline; remove_dot_segments and mergepath are reached through
+ * iri_resolve.  Build with
+ *
+ *	cc -fsanitize=fuzzer,address -DLIBFUZZER -I. -Icompat \
+ *	    test/irifuzz.c iri.c
+ *
+ * for libFuzzer.  Otherwise the files given as arguments are run,
+ * which is what AFL wants, or with no arguments a few seeds and
+ * their mutations.
+ */
+
+#include "compat.h"
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iri.h"
+
+#define MAXIN		1024
+#define MUTATIONS	200000
+#define CANARY		0xa5
+
+#define nitems(x)	(sizeof(x) / sizeof((x)[0]))
+
+#define check(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s failed for \"%s\" "	\
+			    "\"%s\"\n", __FILE__, __LINE__, #cond,	\
+			    base, ref);					\
+			abort();					\
+		}							\
+	} while (0)
+
+static void
+check_span(const char *base, const char *ref, const struct iri_fields *f,
+    const struct iri_span *sp, int flag, size_t len)
+{
+	if (!(f->flags & flag))
+		return;
+	check((size_t)sp->off + sp->len <= len);
+}
+
+static void
+check_resolve(const char *base, const char *ref)
+{
+	static struct iri	 iri;
+	struct iri_fields	 f;
+	char			 buf[IRI_RESOLVE_MAX], small[IRI_RESOLVE_MAX + 1];
+	char			 unparsed[IRI_RESOLVE_MAX];
+	size_t			 len, n;
+
+	if (iri_resolve(base, ref, buf, sizeof(buf), &f) == -1)
+		return;
+
+	len = strnlen(buf, sizeof(buf));
+	check(len < sizeof(buf));
+	check(f.str == buf);
+	check_span(base, ref, &f, &f.scheme, IH_SCHEME, len);
+	check_span(base, ref, &f, &f.uinfo, IH_UINFO, len);
+	check_span(base, ref, &f, &f.host, IH_HOST, len);
+	check_span(base, ref, &f, &f.port, IH_PORT, len);
+	check_span(base, ref, &f, &f.path, IH_PATH, len);
+	check_span(base, ref, &f, &f.query, IH_QUERY, len);
+	check_span(base, ref, &f, &f.fragment, IH_FRAGMENT, len);
+	if (f.flags & IH_PORT)
+		check(f.portnum != 0);
+	if (f.flags & IH_AUTHORITY)
+		check(buf[f.path.off] == '/' || buf[f.path.off - 1] == '/');
+
+	/* the old interface has to agree, when the fields fit */
+	if (iri_parse(base, ref, &iri) == 0) {
+		check(iri_unparse(&iri, unparsed, sizeof(unparsed)) == 0);
+		check(!strcmp(buf, unparsed));
+	}
+
+	/*
+	 * Small buffers never get written past their end, and either
+	 * fail or give the same result.  They have to fail when the
+	 * result doesn't fit, but may when it does since the path is
+	 * merged before the dot segments are removed.
+	 */
+	for (n = 0; n < sizeof(buf); n += 1 + n / 4) {
+		memset(small, CANARY, sizeof(small));
+		if (iri_resolve(base, ref, small, n, NULL) == 0) {
+			check(n > len);
+			check(!strcmp(buf, small));
+		} else
+			check(errno == ENOBUFS);
+		check((unsigned char)small[n] == CANARY);
+	}
+}
+
+static void
+check_escape(const char *base, const char *ref)
+{
+	char		 esc[MAXIN * 3 + 1], unesc[MAXIN + 1];
+
+	check(iri_urlescape(ref, esc, sizeof(esc)) == 0);
+	check(iri_urlunescape(esc, unesc, sizeof(unesc)) == 0);
+	check(!strcmp(ref, unesc));
+}
+
+int	LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	char		 in[MAXIN + 1], *base, *ref;
+	size_t		 i, n = 0;
+
+	for (i = 0; i < size && n < MAXIN; ++i)
+		if (data[i] != '\0')
+			in[n++] = data[i];
+	in[n] = '\0';
+
+	base = in;
+	if ((ref = strchr(in, '\n')) != NULL)
+		*ref++ = '\0';
+	else
+		ref = in + n;
+
+	check_resolve(NULL, base);
+	check_resolve(base, ref);
+	check_escape(base, ref);
+	return (0);
+}
+
+#ifndef LIBFUZZER
+
+static const char *seeds[] = {
+	"gemini://example.com/a/b/c\n../../d",
+	"gemini://example.com/a/b/c\n./../../../g",
+	"gemini://example.com\nfoo",
+	"gemini://user@example.com:1965/a;b?q#f\n//other.example/x/./y/..",
+	"gemini://example.com/a?b#c\n?query",
+	"gemini://example.com/a?b#c\n#frag",
+	"gemini://example.com/a?b#c\n",
+	"gemini://[::1]:70/\n/%2e%2e/%20",
+	"gopher://example.com/1/x\ngopher://host:65535/0/y",
+	"file:///tmp/a/b\nc/../d",
+	"http://a/b/c/d;p?q\ng:h",
+	"about:blank\nabout:help",
+	"gemini://example.com/\n..",
+	"gemini://example.com/x/\n.//..//.",
+};
+
+static unsigned int seed = 42;
+
+static unsigned int
+rnd(void)
+{
+	seed = seed * 1103515245 + 12345;
+	return (seed >> 16) & 0x7fff;
+}
+
+static void
+run(const uint8_t *data, size_t len)
+{
+	if (LLVMFuzzerTestOneInput(data, len) != 0)
+		abort();
+}
+
+static void
+run_file(const char *path)
+{
+	FILE		*fp;
+	uint8_t		 buf[MAXIN];
+	size_t		 len;
+
+	if (!strcmp(path, "-"))
+		fp = stdin;
+	else if ((fp = fopen(path, "r")) == NULL)
+		err(1, "can't open %s", path);
+	len = fread(buf, 1, sizeof(buf), fp);
+	if (ferror(fp))
+		err(1, "read %s", path);
+	if (fp != stdin)
+		fclose(fp);
+	run(buf, len);
+}
+
+static void
+mutate(void)
+{
+	static const char alphabet[] = "/./..?#%:@[]aZ09-_~  \n%2e%41\xc3\xa8";
+	uint8_t		 buf[MAXIN];
+	const char	*s;
+	size_t		 len, pos;
+	int		 i, edits;
+
+	s = seeds[rnd() % nitems(seeds)];
+	len = strlen(s);
+	memcpy(buf, s, len);
+
+	edits = 1 + rnd() % 8;
+	for (i = 0; i < edits; ++i) {
+		pos = len == 0 ? 0 : rnd() % len;
+		switch (rnd() % 3) {
+		case 0:
+			if (len == sizeof(buf))
+				break;
+			memmove(buf + pos + 1, buf + pos, len - pos);
+			buf[pos] = alphabet[rnd() % (sizeof(alphabet) - 1)];
+			len++;
+			break;
+		case 1:
+			if (len == 0)
+				break;
+			memmove(buf + pos, buf + pos + 1, len - pos - 1);
+			len--;
+			break;
+		default:
+			if (len == 0)
+				break;
+			buf[pos] = alphabet[rnd() % (sizeof(alphabet) - 1)];
+			break;
+		}
+	}
+
+	run(buf, len);
+}
+
+int
+main(int argc, char **argv)
+{
+	size_t		 i;
+	int		 j;
+
+	if (argc > 1) {
+		for (j = 1; j < argc; ++j)
+			run_file(argv[j]);
+		return (0);
+	}
+
+	for (i = 0; i < nitems(seeds); ++i)
+		run((const uint8_t *)seeds[i], strlen(seeds[i]));
+	for (i = 0; i < MUTATIONS; ++i)
+		mutate();
+	return (0);
+}
+
+#endif /* LIBFUZZER */
@@ -52,6 +52,39 @@ resolve(const char *base, const char *ref, const char *expected)
 	return (0);
 }
 
+static int
+span_is(const struct iri_fields *f, const struct iri_span *sp,
+    const char *exp)
+{
+	return (sp->len == strlen(exp) &&
+	    !strncmp(f->str + sp->off, exp, sp->len));
+}
+
+static int
+fields(const char *base, const char *ref, const char *host,
+    const char *port, const char *path, const char *query)
+{
+	struct iri_fields	f;
+	char			buf[512];
+
+	if (iri_resolve(base, ref, buf, sizeof(buf), &f) == -1) {
+		fprintf(stderr, "FAIL fields(\"%s\", \"%s\") %s\n", base, ref,
+		    strerror(errno));
+		return (1);
+	}
+
+	if (!span_is(&f, &f.host, host) || !span_is(&f, &f.port, port) ||
+	    !span_is(&f, &f.path, path) || !span_is(&f, &f.query, query)) {
+		fprintf(stderr, "FAIL fields(\"%s\", \"%s\") -> %s\n",
+		    base, ref, buf);
+		return (1);
+	}
+
+	fprintf(stderr, "OK fields(\"%s\", \"%s\") -> %s\n", base, ref,
+	    buf);
+	return (0);
+}
+
 static int
 setquery(const char *iri, const char *query, const char *expected)
 {
@@ -88,6 +121,35 @@ setquery(const char *iri, const char *query, const char *expected)
 	return (0);
 }
 
+static int
+human(const char *iri, const char *expected)
+{
+	static struct iri	i;
+	char			buf[512];
+
+	if (iri_parse(NULL, iri, &i) == -1) {
+		fprintf(stderr, "FAIL can't parse <%s>: %s\n", iri,
+		    strerror(errno));
+		return (1);
+	}
+
+	if (iri_human(&i, buf, sizeof(buf)) == -1) {
+		fprintf(stderr, "FAIL human(\"%s\") %s\n", iri,
+		    strerror(errno));
+		return (1);
+	}
+
+	if (strcmp(buf, expected) != 0) {
+		fprintf(stderr, "FAIL human(\"%s\")\n", iri);
+		fprintf(stderr, "got:\t%s\n", buf);
+		fprintf(stderr, "want:\t%s\n", expected);
+		return (1);
+	}
+
+	fprintf(stderr, "OK human(\"%s\") -> %s\n", iri, expected);
+	return (0);
+}
+
 static int
 urlencode(const char *str, const char *exp)
 {
@@ -213,6 +275,20 @@ main(void)
 	ret |= resolve(base, "file:///tmp/foo", "file:///tmp/foo");
 	ret |= resolve(base, "file:/tmp/foo", "file:///tmp/foo");
 
+	ret |= resolve(NULL, "gemini://A:65535/x", "gemini://a:65535/x");
+	ret |= fields(NULL, "gemini://Host:1965/a/./b?q", "host", "1965",
+	    "/a/b", "q");
+	ret |= fields("gemini://h/a/b", "../c?x#y", "h", "", "/c", "x");
+	ret |= fields("gemini://h/a", "//g", "g", "", "", "");
+
+	ret |= human("gemini://h/caf%C3%A9?na%c3%afve#%E6%97%A5",
+	    "gemini://h/café?naïve#日");
+	ret |= human("gemini://h/a%20b%2Fc", "gemini://h/a%20b%2Fc");
+	ret |= human("gemini://h/%C3", "gemini://h/%C3");
+	ret |= human("gemini://h/%C3%28%C0%AF", "gemini://h/%C3%28%C0%AF");
+	ret |= human("gemini://h/%ED%A0%80", "gemini://h/%ED%A0%80");
+	ret |= human("gemini://h/%C2%85%E2%80%AE", "gemini://h/%C2%85%E2%80%AE");
+
 	ret |= urlencode("foobar", "foobar");
 	ret |= urlencode("foo/bar", "foo/bar");
 	ret |= urlencode("foo bar", "foo%20bar");
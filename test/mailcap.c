@@ -30,13 +30,28 @@
 
 #include "mailcap.h"
 
+/*
+ * With no arguments print the entries read from stdin, otherwise
+ * the one used for each of the given types.
+ */
 int
-main(void)
+main(int argc, char **argv)
 {
 	struct mailcap	*mc;
+	int		 i;
 
 	mailcap_parse(stdin);
 
+	for (i = 1; i < argc; ++i) {
+		if ((mc = mailcap_cmd_from_mimetype(argv[i], "file")) == NULL)
+			printf("%s: none\n", argv[i]);
+		else
+			printf("%s: %s; %s\n", argv[i], mc->mime_type,
+			    mc->cmd);
+	}
+	if (argc > 1)
+		return (0);
+
 	TAILQ_FOREACH(mc, &mailcaps, mailcaps) {
 		printf("%s; %s", mc->mime_type, mc->cmd);
 		if (mc->flags & MAILCAP_NEEDSTERMINAL)
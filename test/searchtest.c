@@ -0,0 +1,208 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include "compat.h"
+
+#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "search.h"
+#include "telescope.h"
+
+#define NLINES	500
+#define WIDTH	16
+
+static const char *words[] = {
+	"gemini", "Gopher", "capsule", "aaa", "telescope", "GEM", "ab",
+	"x", "über", "a",
+};
+
+static struct buffer	 buffer;
+static struct line	 lines[NLINES];
+
+static void
+build(void)
+{
+	struct vline	*vl;
+	char		 buf[256];
+	size_t		 i, j, len, off;
+
+	buffer.vlines_cap = NLINES * 16;
+	buffer.vlines = calloc(buffer.vlines_cap, sizeof(*buffer.vlines));
+	if (buffer.vlines == NULL)
+		abort();
+
+	for (i = 0; i < NLINES; ++i) {
+		*buf = '\0';
+		for (j = 0; j < i % 7; ++j) {
+			strlcat(buf, words[random() % 10], sizeof(buf));
+			strlcat(buf, j % 2 ? " " : "", sizeof(buf));
+		}
+		lines[i].line = i % 50 == 0 ? NULL : strdup(buf);
+		if (i % 97 == 0)
+			lines[i].flags = L_HIDDEN;
+
+		/* a dumb wrap, but the matches must cross the vlines */
+		len = lines[i].line != NULL ? strlen(lines[i].line) : 0;
+		off = 0;
+		do {
+			vl = &buffer.vlines[buffer.vlines_len++];
+			vl->parent = &lines[i];
+			vl->from = off;
+			vl->len = len - off < WIDTH ? len - off : WIDTH;
+			vl->flags = off != 0 ? L_CONTINUATION : 0;
+			off += vl->len;
+		} while (off < len);
+	}
+}
+
+static int
+naive_at(const char *h, const char *q, size_t len, int fold)
+{
+	size_t	 i;
+
+	for (i = 0; i < len; ++i) {
+		if (h[i] == '\0')
+			return 0;
+		if (fold ? tolower((unsigned char)h[i]) != (unsigned char)q[i] :
+		    h[i] != q[i])
+			return 0;
+	}
+	return 1;
+}
+
+static int
+check(struct search *s, const char *query)
+{
+	const struct search_match *m, *lm;
+	struct vline	*vl;
+	const char	*q;
+	size_t		 i, k, n, nl, len, off;
+	int		 fold = 1;
+
+	for (q = query; *q; ++q)
+		if (*q >= 'A' && *q <= 'Z')
+			fold = 0;
+
+	n = search_set(s, &buffer, query);
+	len = strlen(query);
+
+	k = 0;
+	for (i = 0; i < buffer.vlines_len; ++i) {
+		vl = &buffer.vlines[i];
+		if (vl->flags & L_CONTINUATION || vl->parent->line == NULL ||
+		    vl->parent->flags & L_HIDDEN)
+			continue;
+		nl = search_line(s, vl->parent, &lm);
+		for (off = 0; vl->parent->line[off] != '\0'; ++off) {
+			if (!naive_at(vl->parent->line + off, query, len, fold))
+				continue;
+			if ((m = search_nth(s, k)) == NULL ||
+			    m->line != vl->parent || m->off != off) {
+				fprintf(stderr, "FAIL \"%s\": missing match "
+				    "at line %zu offset %zu\n", query,
+				    (size_t)(vl->parent - lines), off);
+				return 1;
+			}
+			if (off < buffer.vlines[m->vidx].from ||
+			    off >= buffer.vlines[m->vidx].from +
+			    buffer.vlines[m->vidx].len ||
+			    buffer.vlines[m->vidx].parent != m->line) {
+				fprintf(stderr, "FAIL \"%s\": wrong vline "
+				    "for match %zu\n", query, k);
+				return 1;
+			}
+			if (nl == 0 || m < lm || m >= lm + nl) {
+				fprintf(stderr, "FAIL \"%s\": match %zu not "
+				    "in its line\n", query, k);
+				return 1;
+			}
+			if (search_nearest(s, m->vidx, off, 0) != k ||
+			    search_nearest(s, m->vidx, off, 1) != k) {
+				fprintf(stderr, "FAIL \"%s\": search_nearest "
+				    "doesn't find match %zu\n", query, k);
+				return 1;
+			}
+			k++;
+		}
+	}
+
+	if (k != n) {
+		fprintf(stderr, "FAIL \"%s\": %zu extra matches\n", query,
+		    n - k);
+		return 1;
+	}
+
+	fprintf(stderr, "OK \"%s\" -> %zu\n", query, n);
+	return 0;
+}
+
+int
+main(void)
+{
+	struct search	*s;
+	const char	*hay = "xxAbAbaBc";
+	int		 ret = 0;
+
+	if (search_mem(hay, strlen(hay), "abc", 3, 1) != hay + 6 ||
+	    search_mem(hay, strlen(hay), "AbA", 3, 0) != hay + 2 ||
+	    search_mem(hay, strlen(hay), "abc", 3, 0) != NULL ||
+	    search_mem(hay, 8, "abc", 3, 1) != NULL) {
+		fprintf(stderr, "FAIL search_mem\n");
+		return 1;
+	}
+
+	srandom(42);
+	build();
+	s = search_new();
+
+	/* growing queries are narrowed, the others scanned again */
+	ret |= check(s, "a");
+	ret |= check(s, "aa");
+	ret |= check(s, "aaa");
+	ret |= check(s, "aaaa");
+	ret |= check(s, "g");
+	ret |= check(s, "ge");
+	ret |= check(s, "geM");
+	ret |= check(s, "gem");
+	ret |= check(s, "gemini");
+	ret |= check(s, "Gopher");
+	ret |= check(s, "über");
+	ret |= check(s, "e t");
+	ret |= check(s, "nothing");
+
+	/* the first match after a position */
+	if (search_set(s, &buffer, "x") == 0 ||
+	    search_nearest(s, buffer.vlines_len, 0, 0) != search_count(s) ||
+	    search_nearest(s, 0, 0, 1) != search_count(s) ||
+	    search_nearest(s, buffer.vlines_len, 0, 1) !=
+	    search_count(s) - 1) {
+		fprintf(stderr, "FAIL search_nearest at the edges\n");
+		ret = 1;
+	}
+
+	search_clear(s);
+	if (search_count(s) != 0 || search_line(s, &lines[1], NULL) != 0) {
+		fprintf(stderr, "FAIL search_clear\n");
+		ret = 1;
+	}
+
+	search_free(s);
+	return ret;
+}
@@ -17,16 +17,41 @@
 #include "compat.h"
 
 #include <limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 
+#include "arena.h"
 #include "fs.h"
+#include "intern.h"
+#include "imsgev.h"
+#include "persist.h"
+#include "telescope.h"
 #include "tofu.h"
 #include "utils.h"
 #include "xwrapper.h"
 
+/*
+ * known_hosts is only appended to and the last line for a host wins
+ * when it's loaded.  Once most of the lines are stale the persist
+ * process rewrites it with the update that triggered the compaction.
+ */
+#define TOFU_COMPACT_MIN	64
+
+static size_t	records;	/* the lines in known_hosts */
+static size_t	stale;		/* those superseded by a later one */
+
+/*
+ * The entries and the hashes are packed in an arena, never freed,
+ * and keyed by the interned domain.  Replaced hashes are reused when
+ * they have the same length, which is the common case.
+ */
+static struct arena	tofu_arena;
+
+/* what fits in an IMSG_TOFU */
+#define TOFU_SHARE_MAX	(MAX_IMSGSIZE - IMSG_HEADER_SIZE)
+
 void
 tofu_init(struct ohash *h, unsigned int sz, ptrdiff_t ko)
 {
@@ -40,126 +65,233 @@ tofu_init(struct ohash *h, unsigned int sz, ptrdiff_t ko)
 	ohash_init(h, sz, &info);
 }
 
+static void
+tofu_domain(char *buf, size_t len, const char *host, const char *port)
+{
+	strlcpy(buf, host, len);
+	if (port != NULL && *port != '\0' && strcmp(port, "1965")) {
+		strlcat(buf, ":", len);
+		strlcat(buf, port, len);
+	}
+}
+
+static inline unsigned int
+tofu_slot(struct ohash *h, const char *domain)
+{
+	return ohash_lookup_memory(h, (const char *)&domain, sizeof(domain),
+	    intern_hash(domain));
+}
+
+static struct tofu_entry *
+tofu_find(struct ohash *h, const char *domain)
+{
+	if ((domain = intern_lookup(domain)) == NULL)
+		return NULL;
+	return ohash_find(h, tofu_slot(h, domain));
+}
+
 struct tofu_entry *
-tofu_lookup(struct ohash *h, const char *domain, const char *port)
+tofu_lookup(struct ohash *h, const char *host, const char *port)
 {
 	char		buf[TOFU_URL_MAX_LEN];
-	unsigned int	slot;
 
-	strlcpy(buf, domain, sizeof(buf));
-	if (port != NULL && *port != '\0' && strcmp(port, "1965")) {
-		strlcat(buf, ":", sizeof(buf));
-		strlcat(buf, port, sizeof(buf));
+	tofu_domain(buf, sizeof(buf), host, port);
+	return tofu_find(h, buf);
+}
+
+/* Set the hash of the interned domain, consuming the reference. */
+static struct tofu_entry *
+tofu_set(struct ohash *h, const char *domain, const char *hash,
+    size_t len, int verified)
+{
+	struct tofu_entry *e;
+	unsigned int	 slot;
+
+	slot = tofu_slot(h, domain);
+	if ((e = ohash_find(h, slot)) == NULL) {
+		e = arena_calloc(&tofu_arena, 1, sizeof(*e));
+		e->domain = domain;
+		ohash_insert(h, slot, e);
+	} else
+		intern_free(domain);
+
+	if (e->hash != NULL && strlen(e->hash) == len)
+		memcpy(e->hash, hash, len);
+	else
+		e->hash = arena_strndup(&tofu_arena, hash, len);
+	e->verified = verified;
+	return e;
+}
+
+static struct tofu_entry *
+tofu_update(struct ohash *h, const char *domain, const char *hash,
+    int verified)
+{
+	return tofu_set(h, intern(domain), hash, strlen(hash), verified);
+}
+
+static size_t
+share_add(char *buf, size_t len, struct tofu_entry *e)
+{
+	size_t	 dlen, hlen;
+
+	dlen = strlen(e->domain) + 1;
+	hlen = strlen(e->hash) + 1;
+	if (dlen + hlen > TOFU_SHARE_MAX)
+		return len;
+
+	if (len + dlen + hlen > TOFU_SHARE_MAX) {
+		ui_send_net(IMSG_TOFU, 0, -1, buf, len);
+		len = 0;
 	}
 
-	slot = ohash_qlookup(h, buf);
-	return ohash_find(h, slot);
+	memcpy(buf + len, e->domain, dlen);
+	memcpy(buf + len + dlen, e->hash, hlen);
+	return len + dlen + hlen;
 }
 
+/* Tell the net process that the certificate of e is accepted. */
+static void
+share(struct tofu_entry *e)
+{
+	char	 buf[TOFU_SHARE_MAX];
+	size_t	 len;
+
+	if ((len = share_add(buf, 0, e)) != 0)
+		ui_send_net(IMSG_TOFU, 0, -1, buf, len);
+}
+
+/*
+ * Send all the known hosts to the net process, which can then go on
+ * with the requests whose certificates match without asking.
+ */
 void
-tofu_add(struct ohash *h, struct tofu_entry *e)
+tofu_share(struct ohash *h)
 {
-	unsigned int	slot;
+	struct tofu_entry *e;
+	unsigned int	 slot;
+	char		*buf;
+	size_t		 len = 0;
 
-	slot = ohash_qlookup(h, e->domain);
-	ohash_insert(h, slot, e);
+	buf = xmalloc(TOFU_SHARE_MAX);
+	for (e = ohash_first(h, &slot); e != NULL; e = ohash_next(h, &slot))
+		len = share_add(buf, len, e);
+	if (len != 0)
+		ui_send_net(IMSG_TOFU, 0, -1, buf, len);
+	free(buf);
 }
 
-int
-tofu_save(struct ohash *h, struct tofu_entry *e)
+/* the memory held by the table; the domains are interned */
+size_t
+tofu_memory(struct ohash *h)
+{
+	return arena_size(&tofu_arena) + hash_memory(h);
+}
+
+/*
+ * Make room for the n lines of a known_hosts of the given size, so
+ * that loading it never grows a table and packs the entries in one
+ * chunk of the arena.  It's only done while the table is empty.
+ */
+void
+tofu_reserve(struct ohash *h, size_t n, size_t size)
 {
-	FILE *fp;
+	struct ohash_info info;
+	unsigned int	 sz = 5;
+
+	if (ohash_entries(h) != 0)
+		return;
+
+	intern_reserve(n);
+
+	/* the hashes are in the file; leave room for the alignment */
+	arena_reserve(&tofu_arena,
+	    size + n * (sizeof(struct tofu_entry) + 32));
 
-	tofu_add(h, e);
+	/* ohash grows past 3/4 */
+	while (sz < 30 && ((size_t)1 << sz) * 3 < n * 4)
+		sz++;
 
-	if ((fp = fopen(known_hosts_file, "a")) == NULL)
-		return -1;
-	fprintf(fp, "%s %s %d\n", e->domain, e->hash, e->verified);
-	fclose(fp);
-	return 0;
+	info = h->info;
+	ohash_delete(h);
+	ohash_init(h, sz, &info);
 }
 
+/*
+ * Add an entry read from known_hosts.  The domain and the hash are
+ * given by their length as they're not NUL-terminated in the file.
+ */
 void
-tofu_update(struct ohash *h, struct tofu_entry *e)
+tofu_load(struct ohash *h, const char *domain, size_t dlen,
+    const char *hash, size_t hlen, int verified)
+{
+	unsigned int	 n;
+
+	n = ohash_entries(h);
+	tofu_set(h, intern_mem(domain, dlen), hash, hlen, verified);
+	records++;
+	if (ohash_entries(h) == n)
+		stale++;
+}
+
+struct tofu_entry *
+tofu_save(struct ohash *h, const char *host, const char *port,
+    const char *hash)
 {
-	struct tofu_entry *t;
+	struct pfile	 pf;
+	struct tofu_entry *e;
+	char		 domain[TOFU_URL_MAX_LEN];
+
+	tofu_domain(domain, sizeof(domain), host, port);
+	e = tofu_update(h, domain, hash, 0);
+	share(e);
+	records++;
 
-	if ((t = tofu_lookup(h, e->domain, NULL)) == NULL)
-		tofu_add(h, e);
-	else {
-		strlcpy(t->hash, e->hash, sizeof(t->hash));
-		t->verified = e->verified;
-		free(e);
+	if (persist_open(&pf, known_hosts_file, NULL, PERSIST_APPEND) != -1) {
+		fprintf(pf.fp, "%s %s %d\n", e->domain, e->hash, e->verified);
+		persist_close(&pf);
 	}
+	return e;
 }
 
 int
-tofu_update_persist(struct ohash *h, struct tofu_entry *e)
-{
-	FILE	*tmp, *fp;
-	char	 sfn[PATH_MAX], *line = NULL;
-	size_t	 l, linesize = 0;
-	ssize_t	 linelen;
-	int	 fd, err;
-
-	tofu_update(h, e);
-
-	strlcpy(sfn, known_hosts_tmp, sizeof(sfn));
-	if ((fd = mkstemp(sfn)) == -1 ||
-	    (tmp = fdopen(fd, "w")) == NULL) {
-		if (fd != -1) {
-			unlink(sfn);
-			close(fd);
-		}
-		return -1;
-	}
+tofu_update_persist(struct ohash *h, const char *host, const char *port,
+    const char *hash)
+{
+	struct pfile	 pf;
+	struct tofu_entry *e;
+	char		 domain[TOFU_URL_MAX_LEN];
+	int		 r, mode = PERSIST_APPEND;
 
-	if ((fp = fopen(known_hosts_file, "r")) == NULL) {
-		unlink(sfn);
-		fclose(tmp);
-		return -1;
-	}
+	tofu_domain(domain, sizeof(domain), host, port);
 
-	l = strlen(e->domain);
-	while ((linelen = getline(&line, &linesize, fp)) != -1) {
-		if (!strncmp(line, e->domain, l))
-			continue;
-		if (linesize > 0 && line[linesize-1] == '\n')
-			line[linesize-1] = '\0';
-		fprintf(tmp, "%s\n", line);
+	records++;
+	if (tofu_find(h, domain) != NULL)
+		stale++;
+
+	if (stale >= TOFU_COMPACT_MIN && stale * 2 >= records) {
+		mode = PERSIST_COMPACT;
+		records -= stale;
+		stale = 0;
 	}
-	fprintf(tmp, "%s %s %d\n", e->domain, e->hash, e->verified);
 
-	free(line);
-	err = ferror(tmp);
-	fclose(tmp);
-	fclose(fp);
+	e = tofu_update(h, domain, hash, 0);
+	share(e);
 
-	if (err) {
-		unlink(sfn);
-		return -1;
+	r = persist_open(&pf, known_hosts_file, known_hosts_tmp, mode);
+	if (r != -1) {
+		fprintf(pf.fp, "%s %s %d\n", e->domain, e->hash, e->verified);
+		r = persist_close(&pf);
 	}
-
-	if (rename(sfn, known_hosts_file) == -1)
-		return -1;
-	return 0;
+	return r;
 }
 
 void
 tofu_temp_trust(struct ohash *h, const char *host, const char *port,
     const char *hash)
 {
-	struct tofu_entry *e;
-
-	e = xcalloc(1, sizeof(*e));
-
-	strlcpy(e->domain, host, sizeof(e->domain));
-	if (*port != '\0' && strcmp(port, "1965")) {
-		strlcat(e->domain, ":", sizeof(e->domain));
-		strlcat(e->domain, port, sizeof(e->domain));
-	}
-	strlcpy(e->hash, hash, sizeof(e->hash));
-	e->verified = -1;
+	char		 domain[TOFU_URL_MAX_LEN];
 
-	tofu_update(h, e);
+	tofu_domain(domain, sizeof(domain), host, port);
+	share(tofu_update(h, domain, hash, -1));
 }
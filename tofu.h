@@ -17,23 +17,22 @@
 #define TOFU_URL_MAX_LEN	(1024 + 1)
 
 struct tofu_entry {
-	char	domain[TOFU_URL_MAX_LEN];
-
-	/*
-	 * enough space for ``PROTO:HASH''.  probably isn't a good
-	 * idea tho.
-	 */
-	char	hash[128+1];
-	int	verified;
+	const char	*domain;	/* interned host[:port] */
+	char		*hash;		/* ``PROTO:HASH'' */
+	int		 verified;
 };
 
 void			 tofu_init(struct ohash *, unsigned int, ptrdiff_t);
 struct tofu_entry	*tofu_lookup(struct ohash *, const char *,
 			    const char *);
-void			 tofu_add(struct ohash *, struct tofu_entry *);
-int			 tofu_save(struct ohash *, struct tofu_entry *);
-void			 tofu_update(struct ohash *, struct tofu_entry *);
-int			 tofu_update_persist(struct ohash *,
-			    struct tofu_entry *);
+void			 tofu_reserve(struct ohash *, size_t, size_t);
+void			 tofu_load(struct ohash *, const char *, size_t,
+			    const char *, size_t, int);
+struct tofu_entry	*tofu_save(struct ohash *, const char *,
+			    const char *, const char *);
+int			 tofu_update_persist(struct ohash *, const char *,
+			    const char *, const char *);
 void			 tofu_temp_trust(struct ohash *, const char *,
 			    const char *, const char *);
+void			 tofu_share(struct ohash *);
+size_t			 tofu_memory(struct ohash *);
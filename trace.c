@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Write the events of a process in the JSON array format of the
+ * Chrome trace viewer, which is also understood by Perfetto.  Both
+ * the ui and the net process write to the same file, opened in append
+ * mode by the ui and passed to the net process, one write(2) per
+ * event so that they don't get mixed.  The closing bracket is
+ * optional in this format and is never written, so the trace is
+ * usable even if telescope didn't exit cleanly.
+ *
+ * The timestamps are those of perf_usec: the monotonic clock is the
+ * same for every process.
+ */
+
+#include "compat.h"
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "perf.h"
+#include "trace.h"
+
+#define TRACE_EVENT_MAX	2048
+
+int		 trace_fd = -1;
+static pid_t	 trace_pid;
+
+/* Open the trace file and write the start of the array. */
+int
+trace_open(const char *path)
+{
+	int		 fd;
+
+	if ((fd = open(path, O_WRONLY|O_CREAT|O_TRUNC|O_APPEND|O_CLOEXEC,
+	    0644)) == -1)
+		return -1;
+	if (write(fd, "[\n", 2) != 2) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+emit(const char *fmt, ...)
+{
+	char		 buf[TRACE_EVENT_MAX];
+	va_list		 ap;
+	int		 r;
+
+	va_start(ap, fmt);
+	r = vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	/* drop the events that don't fit rather than break the JSON */
+	if (r < 0 || (size_t)r >= sizeof(buf))
+		return;
+	if (write(trace_fd, buf, r) != r) {
+		close(trace_fd);
+		trace_fd = -1;
+	}
+}
+
+/* Escape s for a JSON string, cutting it if it doesn't fit. */
+static const char *
+escape(const char *s, char *buf, size_t len)
+{
+	size_t		 i = 0;
+	unsigned char	 c;
+
+	for (; (c = *s) != '\0' && i + 7 < len; ++s) {
+		if (c == '"' || c == '\\') {
+			buf[i++] = '\\';
+			buf[i++] = c;
+		} else if (c < 0x20)
+			i += snprintf(buf + i, len - i, "\\u%04x", c);
+		else
+			buf[i++] = c;
+	}
+	buf[i] = '\0';
+	return buf;
+}
+
+/* Start tracing to fd; name is the one of the process. */
+void
+trace_init(int fd, const char *name)
+{
+	trace_fd = fd;
+	trace_pid = getpid();
+	emit("{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+	    "\"tid\":1,\"args\":{\"name\":\"%s\"}},\n", (int)trace_pid, name);
+}
+
+/*
+ * Something that took from start to end, in perf_usec time, for the
+ * request with the given id, or 0.  arg, if not NULL, is shown along.
+ */
+void
+trace_span(const char *name, uint32_t id, uint64_t start, uint64_t end,
+    const char *arg)
+{
+	char		 esc[1024];
+
+	if (!tracing())
+		return;
+
+	emit("{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":1,"
+	    "\"ts\":%llu,\"dur\":%llu,\"args\":{\"id\":%u,\"arg\":\"%s\"}},\n",
+	    name, (int)trace_pid, (unsigned long long)start,
+	    (unsigned long long)(end - start), id,
+	    arg == NULL ? "" : escape(arg, esc, sizeof(esc)));
+}
+
+void
+trace_instant(const char *name, uint32_t id, const char *arg)
+{
+	char		 esc[1024];
+
+	if (!tracing())
+		return;
+
+	emit("{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":%d,"
+	    "\"tid\":1,\"ts\":%llu,\"args\":{\"id\":%u,\"arg\":\"%s\"}},\n",
+	    name, (int)trace_pid, (unsigned long long)perf_usec(), id,
+	    arg == NULL ? "" : escape(arg, esc, sizeof(esc)));
+}
+
+/*
+ * The start or the end of a request, as an async event so that its
+ * whole life is shown on a row of its own.
+ */
+void
+trace_request(uint32_t id, int begin, const char *url)
+{
+	char		 esc[1024];
+
+	if (!tracing())
+		return;
+
+	emit("{\"name\":\"request\",\"cat\":\"request\",\"ph\":\"%s\","
+	    "\"id\":%u,\"pid\":%d,\"tid\":1,\"ts\":%llu,"
+	    "\"args\":{\"url\":\"%s\"}},\n", begin ? "b" : "e", id,
+	    (int)trace_pid, (unsigned long long)perf_usec(),
+	    url == NULL ? "" : escape(url, esc, sizeof(esc)));
+}
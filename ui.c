@@ -37,25 +37,44 @@
 
 #include <curses.h>
 #include <errno.h>
+#include <limits.h>
 #include <locale.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cmd.h"
 #include "defaults.h"
 #include "ev.h"
 #include "exec.h"
+#include "fs.h"
+#include "headless.h"
 #include "hist.h"
+#include "iri.h"
 #include "keymap.h"
 #include "mailcap.h"
 #include "minibuffer.h"
+#include "perf.h"
+#include "search.h"
 #include "session.h"
 #include "telescope.h"
+#include "trace.h"
 #include "ui.h"
 #include "utf8.h"
+#include "xwrapper.h"
+
+/* what was last painted on a window, row by row */
+struct wincache {
+	struct buffer	 *buffer;
+	struct vline	**rows;
+	int		  cap;
+	int		  off;
+	int		  width;
+	int		  height;
+};
 
 static void		 set_scroll_position(struct tab *, size_t, size_t);
 
@@ -66,11 +85,12 @@ static void		 dispatch_stdio(int, int, void*);
 static void		 handle_signal(int, int, void*);
 static void		 handle_resize_nodelay(int, int, void*);
 static void		 handle_download_refresh(int, int, void *);
+static void		 handle_lazy_wrap(int, int, void *);
 static void		 rearrange_windows(void);
-static void		 line_prefix_and_text(struct vline *, char *, size_t, const char **, const char **, int *);
-static void		 print_vline(int, int, WINDOW*, struct vline*);
+static void		 print_vline(int, int, struct buffer *, WINDOW*, struct vline*);
 static void		 redraw_tabline(void);
-static void		 redraw_window(WINDOW *, int, int, int, int, struct buffer *);
+static void		 paint_rows(WINDOW *, int, int, int, struct buffer *, struct vline **, struct wincache *);
+static void		 redraw_window(WINDOW *, int, int, int, int, struct buffer *, struct wincache *);
 static void		 redraw_download(void);
 static void		 redraw_help(void);
 static void		 redraw_body(struct tab*);
@@ -80,10 +100,43 @@ static void		 do_redraw_echoarea(void);
 static void		 do_redraw_minibuffer(void);
 static void		 do_redraw_minibuffer_compl(void);
 static void		 place_cursor(int);
-static void		 redraw_tab(struct tab*);
+static void		 damage(int);
+static void		 redraw_frame(int, int, void *);
 static void		 update_loading_anim(int, int, void*);
 static void		 stop_loading_anim(struct tab*);
 
+static struct wincache	 bodycache;
+
+/*
+ * A sparse index of the columns of a long vline that's not only
+ * ASCII: where every COLIDX_STEP-th codepoint starts and at which
+ * column, so that the cursor and the horizontal scroll don't walk the
+ * whole text at every redraw.  Only the few most recently used are
+ * kept.
+ */
+#define COLIDX_STEP	64
+#define COLIDX_SLOTS	8
+
+struct colmark {
+	size_t		 off;
+	size_t		 col;
+};
+
+struct colidx {
+	const struct buffer	*buffer;
+	unsigned int		 gen;
+	const struct line	*line;
+	size_t			 from;
+	size_t			 len;
+	size_t			 cplen;
+	unsigned int		 used;
+	size_t			 nmarks;
+	struct colmark		*marks;
+};
+
+static struct colidx	 colidx[COLIDX_SLOTS];
+static unsigned int	 colidx_tick;
+
 static int		 should_rearrange_windows;
 static int		 show_tab_bar;
 static int		 too_small;
@@ -92,12 +145,39 @@ static int		 x_offset;
 struct thiskey	 thiskey;
 struct tab	*current_tab;
 
+/* keys to run at most before a redraw */
+#define TYPEAHEAD_MAX	64
+
 static unsigned int	resize_timer;
 static struct timeval	resize_tv = { 0, 250000 };
 
+/*
+ * The windows that need to be redrawn.  They're all redrawn in one
+ * go at the next tick, but no more often than every FRAME_USEC.
+ */
+#define DIRTY_TABLINE		0x01
+#define DIRTY_BODY		0x02
+#define DIRTY_MODELINE		0x04
+#define DIRTY_MINIBUFFER	0x08
+#define DIRTY_HELP		0x10
+#define DIRTY_DOWNLOAD		0x20
+#define DIRTY_ALL		0x3f
+#define FRAME_USEC		16000
+static int		dirty;
+static unsigned int	redraw_timer;
+static size_t		frame_walked;	/* vlines visited in this frame */
+static struct timespec	last_frame;
+
 static unsigned int	download_timer;
 static struct timeval	download_refresh_timer = { 0, 250000 };
 
+/*
+ * Huge pages are wrapped lazily: only the first WRAP_BATCH lines are
+ * done right away, the rest in batches when the event loop is idle.
+ */
+#define WRAP_BATCH	2000
+static unsigned int	wrap_idle;
+
 static WINDOW	*tabline, *body, *modeline, *echoarea, *minibuffer;
 
 int			 body_lines, body_cols;
@@ -138,13 +218,15 @@ update_x_offset(void)
 static void
 set_scroll_position(struct tab *tab, size_t top, size_t cur)
 {
+	struct buffer *buffer = &tab->buffer;
 	struct line *last;
 	struct vline *vl;
-	size_t i = 0;
+	size_t i = 0, n;
 	int topfound = 0;
 
-	last = TAILQ_FIRST(&tab->buffer.head);
-	TAILQ_FOREACH(vl, &tab->buffer.vhead, vlines) {
+	last = TAILQ_FIRST(&buffer->head);
+	for (n = 0; n < buffer->vlines_len; ++n) {
+		vl = &buffer->vlines[n];
 		if (last != vl->parent) {
 			last = vl->parent;
 			i++;
@@ -153,6 +235,7 @@ set_scroll_position(struct tab *tab, size_t top, size_t cur)
 		if (!topfound && i == top) {
 			topfound = 1;
 			tab->buffer.top_line = vl;
+			buffer->line_off = vline_visible_index(buffer, vl);
 		}
 
 		if (i == cur) {
@@ -161,8 +244,10 @@ set_scroll_position(struct tab *tab, size_t top, size_t cur)
 		}
 	}
 
-	if (!topfound)
-		tab->buffer.top_line = TAILQ_FIRST(&tab->buffer.vhead);
+	if (!topfound) {
+		tab->buffer.top_line = vline_first(buffer);
+		buffer->line_off = 0;
+	}
 
 	tab->buffer.current_line = tab->buffer.top_line;
 }
@@ -214,6 +299,106 @@ restore_excursion(struct excursion *place, struct buffer *buffer)
 	buffer->cpoff = place->cpoff;
 }
 
+static struct colidx *
+colidx_get(struct buffer *buffer, struct vline *vl)
+{
+	struct colidx	*ci, *lru = &colidx[0];
+	char		*text, *s;
+	size_t		 i, n, off, col;
+
+	if (vl->cplen < 2 * COLIDX_STEP || (vl->parent->flags & L_ASCII))
+		return NULL;
+
+	for (i = 0; i < COLIDX_SLOTS; ++i) {
+		ci = &colidx[i];
+		if (ci->line == vl->parent && ci->buffer == buffer &&
+		    ci->gen == buffer->gen && ci->from == vl->from &&
+		    ci->len == vl->len && ci->cplen == vl->cplen) {
+			ci->used = ++colidx_tick;
+			return ci;
+		}
+		if (ci->used < lru->used)
+			lru = ci;
+	}
+
+	ci = lru;
+	n = vl->cplen / COLIDX_STEP + 1;
+	ci->marks = xreallocarray(ci->marks, n, sizeof(*ci->marks));
+
+	text = vl->parent->line + vl->from;
+	off = col = 0;
+	for (i = 0; i < n; ++i) {
+		ci->marks[i].off = off;
+		ci->marks[i].col = col;
+		if (i == n - 1)
+			break;
+		col += utf8_snwidth(text + off, COLIDX_STEP);
+		if ((s = utf8_nth(text + off, COLIDX_STEP)) == NULL)
+			break;
+		off = s - text;
+	}
+
+	ci->nmarks = i + 1;
+	ci->buffer = buffer;
+	ci->gen = buffer->gen;
+	ci->line = vl->parent;
+	ci->from = vl->from;
+	ci->len = vl->len;
+	ci->cplen = vl->cplen;
+	ci->used = ++colidx_tick;
+	return ci;
+}
+
+/* the column where the cpoff-th codepoint of the vline starts */
+static size_t
+vline_cpcol(struct buffer *buffer, struct vline *vl, size_t cpoff)
+{
+	struct colidx	*ci;
+	struct colmark	*m;
+	const char	*text;
+	size_t		 i;
+
+	text = vl->parent->line + vl->from;
+	if ((ci = colidx_get(buffer, vl)) == NULL)
+		return utf8_snwidth(text, cpoff);
+
+	i = MIN(cpoff / COLIDX_STEP, ci->nmarks - 1);
+	m = &ci->marks[i];
+	return m->col + utf8_snwidth(text + m->off, cpoff - i * COLIDX_STEP);
+}
+
+/* like utf8_fit, starting from the closest mark of the vline */
+static const char *
+vline_fit(struct buffer *buffer, struct vline *vl, const char *s,
+    const char *end, size_t *cols)
+{
+	struct colidx	*ci;
+	struct colmark	*m;
+	size_t		 lo, hi, mid, want;
+
+	if ((ci = colidx_get(buffer, vl)) == NULL ||
+	    s != vl->parent->line + vl->from)
+		return utf8_fit(s, end, cols);
+
+	/* the last mark not past the wanted column */
+	want = *cols;
+	lo = 0;
+	hi = ci->nmarks;
+	while (hi - lo > 1) {
+		mid = lo + (hi - lo) / 2;
+		if (ci->marks[mid].col <= want)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	m = &ci->marks[lo];
+
+	*cols = want - m->col;
+	s = utf8_fit(s + m->off, end, cols);
+	*cols += m->col;
+	return s;
+}
+
 static void
 restore_curs_x(struct buffer *buffer)
 {
@@ -230,9 +415,10 @@ restore_curs_x(struct buffer *buffer)
 	else if (vl->parent->data != NULL) {
 		text = vl->parent->data;
 		buffer->curs_x = utf8_snwidth(text + 1, buffer->cpoff) + 1;
-	} else {
-		text = vl->parent->line + vl->from;
-		buffer->curs_x = utf8_snwidth(text, buffer->cpoff);
+	} else if (vl->parent->flags & L_ASCII)
+		buffer->curs_x = buffer->cpoff;
+	else {
+		buffer->curs_x = vline_cpcol(buffer, vl, buffer->cpoff);
 	}
 
 	/* small hack: don't olivetti-mode the download pane */
@@ -242,7 +428,9 @@ restore_curs_x(struct buffer *buffer)
 	if (vl == NULL)
 		return;
 
-	if (vl->parent->data != NULL)
+	if (vl->parent->type == LINE_LINK && vl->parent->data != NULL)
+		buffer->curs_x += vl->parent->emojiwidth;
+	else if (vl->parent->data != NULL)
 		buffer->curs_x += utf8_swidth_between(vl->parent->line,
 		    vl->parent->data);
 	else {
@@ -303,20 +491,14 @@ readkey(void)
 	return 1;
 }
 
+/* run the command bound to the key just read */
 static void
-dispatch_stdio(int fd, int ev, void *d)
+process_key(void)
 {
 	int		 lk;
 	const char	*keyname;
 	char		 tmp[5] = {0};
 
-	/* TODO: schedule a redraw? */
-	if (too_small)
-		return;
-
-	if (!readkey())
-		return;
-
 	if (keybuf[0] != '\0')
 		strlcat(keybuf, " ", sizeof(keybuf));
 	if (thiskey.meta)
@@ -343,12 +525,37 @@ dispatch_stdio(int fd, int ev, void *d)
 		strlcpy(keybuf, "", sizeof(keybuf));
 	}
 
-	if (side_window & SIDE_WINDOW_LEFT)
-		recompute_help();
-
+	/* the next keys may depend on the new layout */
 	if (should_rearrange_windows)
 		rearrange_windows();
-	redraw_tab(current_tab);
+}
+
+/*
+ * Run all the keys already typed before drawing: when a key is held
+ * down redrawing after each one makes the UI lag behind.
+ */
+static void
+dispatch_stdio(int fd, int ev, void *d)
+{
+	int		 n;
+
+	/* TODO: schedule a redraw? */
+	for (n = 0; n < TYPEAHEAD_MAX && !too_small; ++n) {
+		if (!readkey())
+			break;
+		process_key();
+	}
+
+	if (n == 0)
+		return;
+	perf_input();
+
+	if (!in_minibuffer && !in_side_window)
+		preconnect_link();
+
+	if (side_window & SIDE_WINDOW_LEFT)
+		recompute_help();
+	damage(DIRTY_ALL);
 }
 
 static void
@@ -384,11 +591,93 @@ static void
 handle_download_refresh(int s, int v, void *d)
 {
 	if (side_window & SIDE_WINDOW_BOTTOM) {
-		recompute_downloads();
-		redraw_tab(current_tab);
+		refresh_downloads();
+		damage(DIRTY_DOWNLOAD);
 	}
 }
 
+/* a hidden tab needs wrapping only once it's done loading */
+static inline int
+needs_wrap(struct tab *tab)
+{
+	if (tab != current_tab && tab->loading_anim)
+		return 0;
+	return wrap_pending(&tab->buffer);
+}
+
+/*
+ * Wrap a batch of lines, of the completions first, then of the
+ * current tab and then of the hidden ones, and come back later for
+ * the rest.
+ */
+static void
+handle_lazy_wrap(int fd, int ev, void *d)
+{
+	struct buffer	*compl;
+	struct tab	*tab;
+	uint64_t	 t;
+
+	compl = &ministate.compl.buffer;
+	if (in_minibuffer == MB_COMPREAD && wrap_pending(compl)) {
+		wrap_page_tail(compl, compl->wrap_width, WRAP_BATCH);
+		damage(DIRTY_MINIBUFFER);
+		wrap_idle = ev_idle(handle_lazy_wrap, NULL);
+		return;
+	}
+
+	tab = current_tab;
+	if (tab == NULL || !needs_wrap(tab)) {
+		TAILQ_FOREACH(tab, &tabshead, tabs)
+			if (needs_wrap(tab))
+				break;
+	}
+	if (tab == NULL)
+		return;
+
+	t = perf_usec();
+	wrap_page_tail(&tab->buffer, body_cols, WRAP_BATCH);
+	trace_span("wrap", tab->id, t, perf_usec(), NULL);
+	if (tab == current_tab)
+		damage(DIRTY_BODY|DIRTY_MODELINE);
+
+	wrap_idle = ev_idle(handle_lazy_wrap, NULL);
+}
+
+/*
+ * The completions are wrapped lazily too, so that the minibuffer
+ * opens without delay even with a lot of them.  On a resize, the
+ * lines are wrapped until the selected one is found again.  If
+ * rewrap is set, start over from the first; the minibuffer does it
+ * after sorting them.
+ */
+void
+ui_wrap_completions(int rewrap)
+{
+	struct buffer	*b;
+	struct line	*cur = NULL;
+	size_t		 i = 0;
+
+	b = &ministate.compl.buffer;
+	if (rewrap || b->wrap_width != COLS) {
+		if (!rewrap && b->current_line != NULL)
+			cur = b->current_line->parent;
+		empty_vlist(b);
+	}
+
+	do {
+		wrap_page_tail(b, COLS, WRAP_BATCH);
+		for (; cur != NULL && i < b->vlines_len; ++i) {
+			if (b->vlines[i].parent == cur) {
+				b->current_line = &b->vlines[i];
+				cur = NULL;
+			}
+		}
+	} while (cur != NULL && wrap_pending(b));
+
+	if (wrap_pending(b) && !ev_idle_pending(wrap_idle))
+		wrap_idle = ev_idle(handle_lazy_wrap, NULL);
+}
+
 static inline int
 should_show_tab_bar(void)
 {
@@ -400,6 +689,31 @@ should_show_tab_bar(void)
 	return TAILQ_NEXT(TAILQ_FIRST(&tabshead), tabs) != NULL;
 }
 
+/*
+ * Rewrap the hidden tabs in the pool of threads, so that switching
+ * to one after a resize doesn't have to wait for it.  The ones still
+ * loading are wrapped when they're done.
+ */
+static void
+wrap_hidden_tabs(void)
+{
+	struct tab	*tab;
+	struct buffer	*b;
+
+	TAILQ_FOREACH(tab, &tabshead, tabs) {
+		b = &tab->buffer;
+		if (tab == current_tab || tab->loading_anim ||
+		    (tab->flags & TAB_LAZY) || TAILQ_EMPTY(&b->head))
+			continue;
+		if (b->wrap_width == body_cols &&
+		    b->wrap_fill_column == fill_column &&
+		    b->wrap_pre == !dont_wrap_pre && !wrap_pending(b))
+			continue;
+		if (!wrap_page_async(b, body_cols))
+			break;
+	}
+}
+
 static void
 rearrange_windows(void)
 {
@@ -427,7 +741,7 @@ rearrange_windows(void)
 		wresize(minibuffer, minibuffer_lines, COLS);
 		lines -= minibuffer_lines;
 
-		wrap_page(&ministate.compl.buffer, COLS);
+		ui_wrap_completions(0);
 	}
 
 	mvwin(echoarea, --lines, 0);
@@ -473,53 +787,68 @@ rearrange_windows(void)
 		wresize(tabline, 1, COLS);
 
 	wrap_page(&current_tab->buffer, body_cols);
-	redraw_tab(current_tab);
+	if (wrap_threads > 0)
+		wrap_hidden_tabs();
+	damage(DIRTY_ALL);
 }
 
-static void
-line_prefix_and_text(struct vline *vl, char *buf, size_t len,
-    const char **prfx_ret, const char **text_ret, int *text_len)
+/* for the indent of the emojified links and the padding of the rows */
+static const char spaces[] = "                                        ";
+
+void
+line_prefix_and_text(struct vline *vl, const char **prfx_ret, int *prfx_len,
+    const char **text_ret, int *text_len)
 {
 	struct lineprefix *lp = line_prefixes;
+	struct line *l = vl->parent;
 	int type, cont;
-	size_t i, width;
-	char *space, *t;
 
 	if (dont_apply_styling)
 		lp = raw_prefixes;
 
+	cont = vl->flags & L_CONTINUATION;
+	type = l->type;
+	*text_ret = l->line + vl->from;
+	*text_len = MIN(INT_MAX, vl->len);
 	if (vl->len == 0) {
 		*text_ret = "";
 		*text_len = 0;
 	}
 
-	cont = vl->flags & L_CONTINUATION;
-	type = vl->parent->type;
-	if (!cont)
-		*prfx_ret = lp[type].prfx1;
-	else
-		*prfx_ret = lp[type].prfx2;
-
-	space = vl->parent->data;
-	*text_ret = vl->parent->line + vl->from;
-	*text_len = MIN(INT_MAX, vl->len);
-	if (!emojify_link || type != LINE_LINK || space == NULL) {
+	if (!LINE_EMOJIFIED(l)) {
+		*prfx_ret = cont ? lp[type].prfx2 : lp[type].prfx1;
+		*prfx_len = INT_MAX;
 		return;
 	}
 
+	/* the emoji and the space after it are at the start of the line */
 	if (cont) {
-		memset(buf, 0, len);
-		width = utf8_swidth_between(vl->parent->line, space);
-		for (i = 0; i < width + 1 && i < len - 1; ++i)
-			buf[i] = ' ';
+		*prfx_ret = spaces;
+		*prfx_len = MIN(l->emojiwidth + 1, (int)sizeof(spaces) - 1);
 	} else {
-		strlcpy(buf, vl->parent->line, len);
-		if ((t = strchr(buf, ' ')) != NULL)
-			*t = '\0';
-		strlcat(buf, " ", len);
+		*prfx_ret = l->line;
+		*prfx_len = (const char *)l->data + 1 - l->line;
 	}
+}
+
+/*
+ * Print n spaces with the given attributes, a run at a time rather
+ * than a character at a time.
+ */
+static void
+print_spaces(WINDOW *window, attr_t attr, int n)
+{
+	int	 k;
+
+	if (n <= 0)
+		return;
 
-	*prfx_ret = buf;
+	wattr_on(window, attr, NULL);
+	for (; n > 0; n -= k) {
+		k = MIN(n, (int)sizeof(spaces) - 1);
+		waddnstr(window, spaces, k);
+	}
+	wattr_off(window, attr, NULL);
 }
 
 static inline void
@@ -549,12 +878,85 @@ print_vline_descr(int width, WINDOW *window, struct vline *vl)
 	(void)y;
 	getyx(window, y, x);
 
-	if (goal <= x)
-		wprintw(window, " ");
-	for (; goal > x; ++x)
-		wprintw(window, " ");
+	print_spaces(window, 0, goal <= x ? 1 : goal - x);
+	waddstr(window, vl->parent->alt);
+}
 
-	wprintw(window, "%s", vl->parent->alt);
+/*
+ * Print the text of the vline with the isearch matches highlighted.
+ */
+static inline void
+print_vline_text(WINDOW *window, struct vline *vl, attr_t face,
+    const char *text, int textlen)
+{
+	const struct search_match *m, *cur;
+	const char	*line = vl->parent->line;
+	size_t		 i, n, len, pos, start, end, vend;
+	attr_t		 hl;
+
+	n = isearch_line(vl->parent, &m, &cur, &len);
+	if (n == 0 || vl->len == 0) {
+		waddnstr(window, text, textlen);
+		return;
+	}
+
+	pos = text - line;
+	vend = pos + textlen;
+	for (i = 0; i < n && m[i].off < vend; ++i) {
+		start = MAX(m[i].off, pos);
+		end = MIN(m[i].off + len, vend);
+		if (start >= end)
+			continue;
+
+		waddnstr(window, line + pos, start - pos);
+		hl = (&m[i] == cur ? A_REVERSE : A_UNDERLINE) & ~face;
+		wattr_on(window, hl, NULL);
+		waddnstr(window, line + start, end - start);
+		wattr_off(window, hl, NULL);
+		pos = end;
+	}
+	waddnstr(window, line + pos, vend - pos);
+}
+
+/*
+ * Cut the text of an unwrapped vline to the avail columns starting
+ * hscroll columns in.  pad is set to the columns of a wide character
+ * that is only partly visible on the left.
+ */
+static void
+unwrapped_slice(struct buffer *buffer, struct vline *vl, size_t hscroll,
+    int avail, const char **text, int *textlen, int *pad)
+{
+	const char	*end, *s;
+	size_t		 cols, n;
+
+	*pad = 0;
+	if (avail <= 0 || vl->len == 0) {
+		*textlen = 0;
+		return;
+	}
+
+	/* one column per byte */
+	if (vl->parent->flags & L_ASCII) {
+		n = MIN(hscroll, vl->len);
+		*text += n;
+		*textlen = MIN(vl->len - n, (size_t)avail);
+		return;
+	}
+
+	end = *text + vl->len;
+	cols = hscroll;
+	s = vline_fit(buffer, vl, *text, end, &cols);
+	if (cols < hscroll && s < end) {
+		*text = utf8_next_cp(s);
+		cols = utf8_swidth_between(s, *text) - (hscroll - cols);
+		*pad = MIN(cols, (size_t)avail);
+		avail -= *pad;
+	} else
+		*text = s;
+
+	cols = avail;
+	*textlen = utf8_fit(*text, end, &cols) - *text;
 }
 
 /*
@@ -563,19 +965,16 @@ print_vline_descr(int width, WINDOW *window, struct vline *vl)
  * `off' columns (for olivetti-mode), print the correct prefix (which
  * may be the emoji in case of emojified links-lines), printing the
  * text itself, filling until width - off and filling off columns
- * again.
+ * again.  The unwrapped preformatted lines are scrolled by hscroll
+ * columns and cut at width - off.
  */
 static void
-print_vline(int off, int width, WINDOW *window, struct vline *vl)
+print_vline(int off, int width, struct buffer *buffer, WINDOW *window,
+    struct vline *vl)
 {
-	/*
-	 * Believe me or not, I've seen emoji ten code points long!
-	 * That means, to stay large, 4*10 bytes + NUL.
-	 */
-	char emojibuf[41] = {0};
 	const char *text, *prfx;
 	struct line_face *f;
-	int i, left, x, y, textlen;
+	int left, x, y, pad, prfxlen, textlen;
 
 	f = &line_faces[vl->parent->type];
 
@@ -585,21 +984,25 @@ print_vline(int off, int width, WINDOW *window, struct vline *vl)
 	if (vl->parent->type == LINE_FRINGE && fringe_ignore_offset)
 		off = 0;
 
-	line_prefix_and_text(vl, emojibuf, sizeof(emojibuf), &prfx,
-	    &text, &textlen);
+	line_prefix_and_text(vl, &prfx, &prfxlen, &text, &textlen);
 
-	wattr_on(window, body_face.left, NULL);
-	for (i = 0; i < off; i++)
-		waddch(window, ' ');
-	wattr_off(window, body_face.left, NULL);
+	print_spaces(window, body_face.left, off);
 
-	wattr_on(window, f->prefix, NULL);
-	wprintw(window, "%s", prfx);
-	wattr_off(window, f->prefix, NULL);
+	if (prfxlen > 0) {
+		wattr_on(window, f->prefix, NULL);
+		waddnstr(window, prfx, prfxlen);
+		wattr_off(window, f->prefix, NULL);
+	}
 
 	wattr_on(window, f->text, NULL);
+	if (vl->flags & L_UNWRAPPED) {
+		getyx(window, y, x);
+		unwrapped_slice(buffer, vl, buffer->hscroll, width - off - x,
+		    &text, &textlen, &pad);
+		print_spaces(window, 0, pad);
+	}
 	if (text)
-		wprintw(window, "%.*s", textlen, text);
+		print_vline_text(window, vl, f->text, text, textlen);
 	print_vline_descr(width, window, vl);
 	wattr_off(window, f->text, NULL);
 
@@ -607,91 +1010,128 @@ print_vline(int off, int width, WINDOW *window, struct vline *vl)
 
 	left = width - x;
 
-	wattr_on(window, f->trail, NULL);
-	for (i = 0; i < left - off; ++i)
-		waddch(window, ' ');
-	wattr_off(window, f->trail, NULL);
+	print_spaces(window, f->trail, left - off);
+	print_spaces(window, body_face.right, off);
+}
+
+#define TAB_LABEL_COLS	24
+#define TAB_LABEL_MAXSRC	(TAB_LABEL_SIZE - TAB_LABEL_COLS - 8)
+
+/*
+ * The label of a tab: a mark for the urgent ones and the title, or
+ * the URL, cut or padded to TAB_LABEL_COLS columns.  It's kept along
+ * with the bytes of the title it depends on, the NUL included when
+ * it's not cut, and redone only when they change.
+ */
+static const char *
+tab_label(struct tab *tab)
+{
+	const char	*title, *end, *cut;
+	char		*t;
+	size_t		 cols, len, key, pad;
+	int		 urgent;
+
+	if (*(title = tab->buffer.title) == '\0')
+		title = hist_cur(tab->hist);
+	urgent = (tab->flags & TAB_URGENT) != 0;
+
+	if (tab->label_srclen != 0 && tab->label_urgent == urgent &&
+	    !strncmp(title, tab->label_src, tab->label_srclen))
+		return tab->label;
+
+	len = strlen(title);
+	end = title + MIN(len, TAB_LABEL_MAXSRC);
+	cols = TAB_LABEL_COLS - 1;
+	cut = utf8_fit(title, end, &cols);
+	if (cut == title + len) {
+		key = len + 1;
+		pad = TAB_LABEL_COLS - 1 - cols;
+	} else {
+		if (cut == end)
+			key = end - title + 1;
+		else
+			key = utf8_next_cp(cut) - title;
+		cols = TAB_LABEL_COLS - 4;
+		cut = utf8_fit(title, end, &cols);
+		pad = TAB_LABEL_COLS - 4 - cols;
+	}
 
-	wattr_on(window, body_face.right, NULL);
-	for (i = 0; i < off; i++)
-		waddch(window, ' ');
-	wattr_off(window, body_face.right, NULL);
+	t = tab->label;
+	*t++ = urgent ? '!' : ' ';
+	memcpy(t, title, cut - title);
+	t += cut - title;
+	if (cut != title + len) {
+		memcpy(t, "...", 3);
+		t += 3;
+	}
+	memset(t, ' ', pad);
+	t[pad] = '\0';
+
+	tab->label_urgent = urgent;
+	tab->label_srclen = 0;
+	if (key <= sizeof(tab->label_src)) {
+		memcpy(tab->label_src, title, key);
+		tab->label_srclen = key;
+	}
+	return tab->label;
 }
 
 static void
 redraw_tabline(void)
 {
-	struct tab	*tab;
-	size_t		 toskip, ots, tabwidth, space, x;
+	struct tab	*tab, *first, *prev;
+	size_t		 n, shown, tabwidth, space, x;
 	int		 current, y, truncated, pair;
-	const char	*title;
-	char		 buf[25];
 
 	x = 0;
 
 	/* unused, but setted by a getyx */
 	(void)y;
 
-	tabwidth = sizeof(buf)+1;
+	tabwidth = TAB_LABEL_COLS + 2;
 	space = COLS-2;
 
-	toskip = 0;
-	TAILQ_FOREACH(tab, &tabshead, tabs) {
-		toskip++;
-		if (tab == current_tab)
-			break;
+	/*
+	 * Start from the first tab if the current one fits, otherwise
+	 * make the current tab the last that fits.  Either way only
+	 * the tabs that end up on the screen are looked at.
+	 */
+	first = current_tab;
+	prev = NULL;
+	if (first != NULL) {
+		for (n = 1; (prev = TAILQ_PREV(first, tabshead, tabs)) != NULL &&
+		    (n + 1) * tabwidth <= space; n++)
+			first = prev;
 	}
 
-	if (toskip * tabwidth <= space)
-		toskip = 0;
+	if (prev == NULL)
+		first = TAILQ_FIRST(&tabshead);
 	else {
-		ots = toskip;
-		toskip--;
-		while (toskip != 0 &&
-		    (ots - toskip+1) * tabwidth < space)
-			toskip--;
+		for (shown = 1; (shown + 1) * tabwidth < space; shown++)
+			/* nop */ ;
+		for (first = current_tab; shown > 1; shown--)
+			first = TAILQ_PREV(first, tabshead, tabs);
 	}
 
 	werase(tabline);
 	wattr_on(tabline, tab_face.background, NULL);
-	wprintw(tabline, toskip == 0 ? " " : "<");
+	wprintw(tabline, prev == NULL ? " " : "<");
 	wattr_off(tabline, tab_face.background, NULL);
 
 	truncated = 0;
-	TAILQ_FOREACH(tab, &tabshead, tabs) {
+	for (tab = first; tab != NULL; tab = TAILQ_NEXT(tab, tabs)) {
 		if (truncated)
 			break;
-		if (toskip != 0) {
-			toskip--;
-			continue;
-		}
 
 		getyx(tabline, y, x);
-		if (x + sizeof(buf)+2 >= (size_t)COLS)
+		if (x + TAB_LABEL_COLS + 3 >= (size_t)COLS)
 			truncated = 1;
 
 		current = tab == current_tab;
 
-		if (*(title = tab->buffer.title) == '\0')
-			title = hist_cur(tab->hist);
-
-		if (tab->flags & TAB_URGENT)
-			strlcpy(buf, "!", sizeof(buf));
-		else
-			strlcpy(buf, " ", sizeof(buf));
-
-		if (strlcat(buf, title, sizeof(buf)) >= sizeof(buf)) {
-			/* truncation happens */
-			strlcpy(&buf[sizeof(buf)-4], "...", 4);
-		} else {
-			/* pad with spaces */
-			while (strlcat(buf, "    ", sizeof(buf)) < sizeof(buf))
-				/* nop */ ;
-		}
-
 		pair = current ? tab_face.current : tab_face.tab;
 		wattr_on(tabline, pair, NULL);
-		wprintw(tabline, "%s", buf);
+		wprintw(tabline, "%s", tab_label(tab));
 		wattr_off(tabline, pair, NULL);
 
 		wattr_on(tabline, tab_face.background, NULL);
@@ -724,50 +1164,155 @@ adjust_line(struct vline *vl, struct buffer *buffer)
 	if (!(vl->parent->flags & L_HIDDEN))
 		return vl;
 
-	/* search forward */
-	for (t = vl;
-	     t != NULL && t->parent->flags & L_HIDDEN;
-	     t = TAILQ_NEXT(t, vlines))
-		;		/* nop */
-
-	if (t != NULL)
+	if ((t = vline_next_visible(buffer, vl)) != NULL)
 		return t;
+	return vline_prev_visible(buffer, vl);
+}
+
+/*
+ * Paint the visual lines in rows.  When a cache of what is on the
+ * window is given, only the rows that changed are painted and
+ * scrolling is done with wscrl, otherwise the window is repainted
+ * from scratch.  What a vline looks like depends only on itself, off,
+ * width and the hscroll of the buffer, so comparing the pointers is
+ * enough as long as the buffer says otherwise with force_redraw.
+ */
+static void
+paint_rows(WINDOW *win, int off, int height, int width,
+    struct buffer *buffer, struct vline **rows, struct wincache *cache)
+{
+	int		 l, s, shift = 0;
+
+	if (cache == NULL || cache->buffer != buffer ||
+	    buffer->force_redraw || cache->off != off ||
+	    cache->width != width || cache->height != height) {
+		werase(win);
+		for (l = 0; l < height; ++l) {
+			if (rows[l] == NULL)
+				continue;
+			wmove(win, l, 0);
+			print_vline(off, width, buffer, win, rows[l]);
+		}
 
-	/* search backward */
-	for (t = vl;
-	     t != NULL && t->parent->flags & L_HIDDEN;
-	     t = TAILQ_PREV(t, vhead, vlines))
-		;		/* nop */
+		if (cache == NULL)
+			return;
+
+		if (cache->cap < height) {
+			cache->rows = xreallocarray(cache->rows, height,
+			    sizeof(*cache->rows));
+			cache->cap = height;
+		}
+		cache->buffer = buffer;
+		cache->off = off;
+		cache->width = width;
+		cache->height = height;
+		memcpy(cache->rows, rows, height * sizeof(*rows));
+		return;
+	}
+
+	/* look for a scroll by a few lines in either direction */
+	if (rows[0] != cache->rows[0] && rows[0] != NULL) {
+		for (s = 1; s < height / 2; ++s) {
+			if (cache->rows[s] == rows[0]) {
+				shift = s;
+				break;
+			}
+			if (cache->rows[0] == rows[s]) {
+				shift = -s;
+				break;
+			}
+		}
+	}
+
+	if (shift != 0) {
+		scrollok(win, TRUE);
+		wscrl(win, shift);
+		scrollok(win, FALSE);
+
+		if (shift > 0) {
+			memmove(cache->rows, cache->rows + shift,
+			    (height - shift) * sizeof(*cache->rows));
+			for (l = height - shift; l < height; ++l)
+				cache->rows[l] = NULL;
+		} else {
+			memmove(cache->rows - shift, cache->rows,
+			    (height + shift) * sizeof(*cache->rows));
+			for (l = 0; l < -shift; ++l)
+				cache->rows[l] = NULL;
+		}
+	}
 
-	return t;
+	for (l = 0; l < height; ++l) {
+		if (rows[l] == cache->rows[l] && rows[l] != NULL)
+			continue;
+
+		wmove(win, l, 0);
+		if (rows[l] == NULL)
+			wclrtoeol(win);
+		else
+			print_vline(off, width, buffer, win, rows[l]);
+		cache->rows[l] = rows[l];
+	}
+}
+
+/*
+ * Scroll the unwrapped preformatted lines so that the cursor stays
+ * in view when it's on one of them, half a window at a time, and
+ * bring them back otherwise.
+ */
+static void
+adjust_hscroll(struct buffer *buffer, int off, int width)
+{
+	struct lineprefix *lp = line_prefixes;
+	struct vline	*vl = buffer->current_line;
+	size_t		 hscroll = 0, col;
+	int		 start, avail;
+
+	if (dont_apply_styling)
+		lp = raw_prefixes;
+
+	if (vl != NULL && vl->flags & L_UNWRAPPED) {
+		start = off + utf8_swidth(lp[vl->parent->type].prfx1);
+		avail = width - off - start;
+		col = MAX(buffer->curs_x - start, 0);
+		hscroll = buffer->hscroll;
+		if (avail > 0 &&
+		    (col < hscroll || col >= hscroll + (size_t)avail))
+			hscroll = col > (size_t)avail / 2 ? col - avail / 2 : 0;
+	}
+
+	if (buffer->hscroll != hscroll) {
+		buffer->hscroll = hscroll;
+		buffer->force_redraw = 1;
+	}
+	buffer->curs_x -= hscroll;
 }
 
 static void
 redraw_window(WINDOW *win, int off, int height, int width,
-    int show_fringe, struct buffer *buffer)
+    int show_fringe, struct buffer *buffer, struct wincache *cache)
 {
-	struct vline	*vl;
-	int		 onscreen = 0, l = 0;
+	static struct vline	**rows;
+	static int		  rowscap;
+	struct vline		 *vl;
+	int			  onscreen = 0, l = 0;
 
 	restore_curs_x(buffer);
 
-	/*
-	 * TODO: ignoring buffer->force_update and always
-	 * re-rendering.  In theory we can recompute the y position
-	 * without a re-render, and optimize here.  It's not the only
-	 * optimisation possible here, wscrl wolud also be an
-	 * interesting one.
-	 */
+	if (rowscap < height) {
+		rows = xreallocarray(rows, height, sizeof(*rows));
+		rowscap = height;
+	}
 
 again:
-	werase(win);
+	l = 0;
 	buffer->curs_y = 0;
 
 	if (TAILQ_EMPTY(&buffer->head))
 		goto end;
 
 	if (buffer->top_line == NULL)
-		buffer->top_line = TAILQ_FIRST(&buffer->vhead);
+		buffer->top_line = vline_first(buffer);
 
 	buffer->top_line = adjust_line(buffer->top_line, buffer);
 	if (buffer->top_line == NULL)
@@ -775,12 +1320,10 @@ again:
 
 	buffer->current_line = adjust_line(buffer->current_line, buffer);
 
-	for (vl = buffer->top_line; vl != NULL; vl = TAILQ_NEXT(vl, vlines)) {
-		if (vl->parent->flags & L_HIDDEN)
-			continue;
-
-		wmove(win, l, 0);
-		print_vline(off, width, win, vl);
+	for (vl = buffer->top_line; vl != NULL;
+	     vl = vline_next_visible(buffer, vl)) {
+		frame_walked++;
+		rows[l] = vl;
 
 		if (vl == buffer->current_line)
 			onscreen = 1;
@@ -794,13 +1337,13 @@ again:
 	}
 
 	if (!onscreen) {
-		for (; vl != NULL; vl = TAILQ_NEXT(vl, vlines)) {
+		for (; vl != NULL; vl = vline_next_visible(buffer, vl)) {
+			frame_walked++;
 			if (vl == buffer->current_line)
 				break;
-			if (vl->parent->flags & L_HIDDEN)
-				continue;
 			buffer->line_off++;
-			buffer->top_line = TAILQ_NEXT(buffer->top_line, vlines);
+			buffer->top_line = vline_next_visible(buffer,
+			    buffer->top_line);
 		}
 
 		if (vl != NULL)
@@ -808,10 +1351,13 @@ again:
 	}
 
 	buffer->last_line_off = buffer->line_off;
-	buffer->force_redraw = 0;
+	adjust_hscroll(buffer, off, width);
 end:
-	for (; show_fringe && l < height; l++)
-		print_vline(off, width, win, &fringe);
+	for (; l < height; l++)
+		rows[l] = show_fringe ? &fringe : NULL;
+
+	paint_rows(win, off, height, width, buffer, rows, cache);
+	buffer->force_redraw = 0;
 
 	wmove(win, buffer->curs_y, buffer->curs_x);
 }
@@ -819,13 +1365,14 @@ end:
 static void
 redraw_download(void)
 {
-	redraw_window(download, 0, download_lines, COLS, 0, &downloadwin);
+	redraw_window(download, 0, download_lines, COLS, 0, &downloadwin,
+	    NULL);
 }
 
 static void
 redraw_help(void)
 {
-	redraw_window(help, 0, help_lines, help_cols, 1, &helpwin);
+	redraw_window(help, 0, help_lines, help_cols, 1, &helpwin, NULL);
 }
 
 static void
@@ -837,7 +1384,8 @@ redraw_body(struct tab *tab)
 		tab->buffer.force_redraw =1;
 	last_tab = tab;
 
-	redraw_window(body, x_offset, body_lines, body_cols, 1, &tab->buffer);
+	redraw_window(body, x_offset, body_lines, body_cols, 1, &tab->buffer,
+	    &bodycache);
 }
 
 static inline char
@@ -853,6 +1401,33 @@ trust_status_char(enum trust_state ts)
 	}
 }
 
+/*
+ * The URL of the tab as the modeline shows it, with the UTF-8 percent
+ * decoded.  Like the tab label it's redone only when the URL changes.
+ */
+static const char *
+tab_modeline_url(struct tab *tab)
+{
+	static struct iri	 iri;
+	const char		*url;
+	char			 buf[GEMINI_URL_LEN];
+
+	if ((url = hist_cur(tab->hist)) == NULL)
+		return "";
+	if (tab->modeline_src != NULL && !strcmp(tab->modeline_src, url))
+		return tab->modeline_url;
+
+	free(tab->modeline_src);
+	free(tab->modeline_url);
+	tab->modeline_src = xstrdup(url);
+	if (iri_parse(NULL, url, &iri) == -1 ||
+	    iri_human(&iri, buf, sizeof(buf)) == -1)
+		tab->modeline_url = xstrdup(url);
+	else
+		tab->modeline_url = xstrdup(buf);
+	return tab->modeline_url;
+}
+
 static void
 redraw_modeline(struct tab *tab)
 {
@@ -876,6 +1451,11 @@ redraw_modeline(struct tab *tab)
 	    tab->faulty_gemserver ? 'W' : '-',
 	    mode == NULL ? "(none)" : mode);
 
+	/* the host replied 44 earlier: the request is waiting */
+	if (tab->loading_anim && tab->backoff_until > time(NULL))
+		wprintw(modeline, "[slow down %llds] ",
+		    (long long)(tab->backoff_until - time(NULL)));
+
 	pct = (buffer->line_off + buffer->curs_y) * 100.0
 		/ buffer->line_max;
 
@@ -891,7 +1471,7 @@ redraw_modeline(struct tab *tab)
 	wprintw(modeline, "%zu/%zu %s ",
 	    buffer->line_off + buffer->curs_y,
 	    buffer->line_max,
-	    hist_cur(tab->hist));
+	    tab_modeline_url(tab));
 
 	getyx(modeline, y, x);
 	getmaxyx(modeline, max_y, max_x);
@@ -942,12 +1522,11 @@ do_redraw_echoarea(void)
 static void
 do_redraw_minibuffer(void)
 {
-	struct buffer	*cmplbuf, *buffer;
+	struct buffer	*buffer;
 	size_t		 off_y, off_x = 0;
 	const char	*start, *c;
 	char		*line;
 
-	cmplbuf = &ministate.compl.buffer;
 	buffer = &ministate.buffer;
 	(void)off_y;		/* unused, set by getyx */
 
@@ -955,7 +1534,7 @@ do_redraw_minibuffer(void)
 
 	if (in_minibuffer == MB_COMPREAD)
 		wprintw(echoarea, "(%2zu) ",
-		    cmplbuf->line_max);
+		    ministate.compl.nmatches);
 
 	wprintw(echoarea, "%s", ministate.prompt);
 	if (!ministate.editing)
@@ -986,7 +1565,7 @@ static void
 do_redraw_minibuffer_compl(void)
 {
 	redraw_window(minibuffer, 0, 10, COLS, 1,
-	    &ministate.compl.buffer);
+	    &ministate.compl.buffer, NULL);
 }
 
 /*
@@ -1034,27 +1613,96 @@ place_cursor(int soft)
 }
 
 static void
-redraw_tab(struct tab *tab)
+damage(int what)
 {
+	struct timespec	 now, diff;
+	struct timeval	 tv = { 0, 0 };
+	long		 elapsed;
+
+	if (headless)
+		return;
+
+	dirty |= what;
+	if (ev_timer_pending(redraw_timer))
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timespecsub(&now, &last_frame, &diff);
+	if (diff.tv_sec == 0) {
+		elapsed = diff.tv_nsec / 1000;
+		if (elapsed < FRAME_USEC)
+			tv.tv_usec = FRAME_USEC - elapsed;
+	}
+
+	redraw_timer = ev_timer(&tv, redraw_frame, NULL);
+}
+
+/* account the time since *mark to the given part of the frame */
+static inline void
+frame_part(struct perf_frame *f, int part, uint64_t *mark)
+{
+	uint64_t	 now;
+
+	now = perf_usec();
+	f->parts[part] += now - *mark;
+	*mark = now;
+}
+
+static void
+redraw_frame(int fd, int ev, void *d)
+{
+	struct perf_frame f;
+	struct buffer	*buffer;
+	int		 what;
+	uint64_t	 t, mark;
+
+	if (should_rearrange_windows) {
+		rearrange_windows();
+		ev_timer_cancel(redraw_timer);
+	}
+
+	what = dirty;
+	dirty = 0;
+	clock_gettime(CLOCK_MONOTONIC, &last_frame);
+
 	if (too_small)
 		return;
 
-	if (side_window & SIDE_WINDOW_LEFT) {
+	memset(&f, 0, sizeof(f));
+	frame_walked = 0;
+
+	mark = t = perf_usec();
+	perf_count(PERF_REDRAWS, 1);
+
+	if ((what & DIRTY_HELP) && (side_window & SIDE_WINDOW_LEFT)) {
 		redraw_help();
 		wnoutrefresh(help);
+		frame_part(&f, FRAME_HELP, &mark);
 	}
 
-	if (side_window & SIDE_WINDOW_BOTTOM) {
+	if ((what & DIRTY_DOWNLOAD) && (side_window & SIDE_WINDOW_BOTTOM)) {
 		redraw_download();
 		wnoutrefresh(download);
+		frame_part(&f, FRAME_DOWNLOAD, &mark);
 	}
 
-	if (show_tab_bar)
+	if ((what & DIRTY_TABLINE) && show_tab_bar) {
 		redraw_tabline();
+		frame_part(&f, FRAME_TABLINE, &mark);
+	}
 
-	redraw_body(tab);
-	redraw_modeline(tab);
-	redraw_minibuffer();
+	if (what & DIRTY_BODY) {
+		redraw_body(current_tab);
+		frame_part(&f, FRAME_BODY, &mark);
+	}
+	if (what & DIRTY_MODELINE) {
+		redraw_modeline(current_tab);
+		frame_part(&f, FRAME_MODELINE, &mark);
+	}
+	if (what & DIRTY_MINIBUFFER) {
+		redraw_minibuffer();
+		frame_part(&f, FRAME_MINIBUFFER, &mark);
+	}
 
 	wnoutrefresh(tabline);
 	wnoutrefresh(modeline);
@@ -1065,10 +1713,26 @@ redraw_tab(struct tab *tab)
 	place_cursor(1);
 
 	doupdate();
+	perf_paint();
 
 	if (set_title)
 		dprintf(1, "\033]2;%s - Telescope\a",
 		    current_tab->buffer.title);
+	frame_part(&f, FRAME_UPDATE, &mark);
+
+	buffer = &current_tab->buffer;
+	f.when = t;
+	f.usec = mark - t;
+	f.mode = buffer->mode;
+	f.lines = buffer->line_max;
+	f.vlines = buffer->vlines_len;
+	f.walked = frame_walked;
+	f.rows = LINES;
+	f.cols = COLS;
+	perf_frame(&f);
+
+	perf_count(PERF_REDRAW, f.usec);
+	trace_span("redraw", 0, t, mark, NULL);
 }
 
 void
@@ -1089,13 +1753,8 @@ update_loading_anim(int fd, int ev, void *d)
 
 	tab->loading_anim_step = (tab->loading_anim_step+1)%4;
 
-	if (tab == current_tab) {
-		redraw_modeline(tab);
-		wrefresh(modeline);
-		wrefresh(body);
-		if (in_minibuffer)
-			wrefresh(echoarea);
-	}
+	if (tab == current_tab)
+		damage(DIRTY_MODELINE);
 
 	tab->loading_timer = ev_timer(&loading_tv, update_loading_anim, tab);
 }
@@ -1110,15 +1769,8 @@ stop_loading_anim(struct tab *tab)
 	tab->loading_anim = 0;
 	tab->loading_anim_step = 0;
 
-	if (tab != current_tab)
-		return;
-
-	redraw_modeline(tab);
-
-	wrefresh(modeline);
-	wrefresh(body);
-	if (in_minibuffer)
-		wrefresh(echoarea);
+	if (tab == current_tab)
+		damage(DIRTY_MODELINE);
 }
 
 int
@@ -1135,11 +1787,9 @@ ui_init(void)
 
 	/* initialize download window */
 	TAILQ_INIT(&downloadwin.head);
-	TAILQ_INIT(&downloadwin.vhead);
 
 	/* initialize help window */
 	TAILQ_INIT(&helpwin.head);
-	TAILQ_INIT(&helpwin.vhead);
 
 	base_map = &global_map;
 	current_map = &global_map;
@@ -1184,6 +1834,7 @@ ui_init(void)
 
 	keypad(body, TRUE);
 	scrollok(body, FALSE);
+	idlok(body, TRUE);
 
 	/* non-blocking input */
 	wtimeout(body, 0);
@@ -1201,6 +1852,14 @@ ui_main_loop(void)
 	    ev_signal(SIGCHLD, handle_signal, NULL) == -1 ||
 	    ev_add(0, EV_READ, dispatch_stdio, NULL) == -1)
 		err(1, "ev_signal or ev_add failed");
+	ev_input(0);
+
+	ev_name(dispatch_stdio, "dispatch_stdio");
+	ev_name(redraw_frame, "redraw");
+	ev_name(handle_lazy_wrap, "lazy wrap");
+	ev_name(update_loading_anim, "loading animation");
+	ev_name(handle_resize_nodelay, "resize");
+	ev_name(handle_download_refresh, "downloads");
 
 	switch_to_tab(current_tab);
 	rearrange_windows();
@@ -1208,43 +1867,75 @@ ui_main_loop(void)
 	ev_loop();
 }
 
+/*
+ * Draw the current tab right away, without waiting for the event
+ * loop to start.
+ */
+void
+ui_paint(void)
+{
+	rearrange_windows();
+	ev_timer_cancel(redraw_timer);
+	redraw_frame(-1, 0, NULL);
+}
+
 void
 ui_on_tab_loaded(struct tab *tab)
 {
 	size_t line_off, curr_off;
 
 	stop_loading_anim(tab);
+	if (headless) {
+		headless_loaded(tab);
+		return;
+	}
 	message("Loaded %s", hist_cur(tab->hist));
 
 	hist_cur_offs(tab->hist, &line_off, &curr_off);
 	if (curr_off != 0 &&
-	    tab->buffer.current_line == TAILQ_FIRST(&tab->buffer.vhead)) {
+	    tab->buffer.current_line == vline_first(&tab->buffer)) {
+		/* make sure the lines up to there are wrapped */
+		wrap_page_tail(&tab->buffer, body_cols, curr_off + body_lines);
 		set_scroll_position(tab, line_off, curr_off);
-		redraw_tab(tab);
+		damage(DIRTY_ALL);
 		return;
 	}
 
-	if (show_tab_bar)
-		redraw_tabline();
-
-	wrefresh(tabline);
-	place_cursor(0);
+	damage(DIRTY_TABLINE);
 }
 
 void
 ui_on_tab_refresh(struct tab *tab)
 {
-	wrap_page(&tab->buffer, body_cols);
-	if (tab == current_tab)
-		redraw_tab(tab);
-	else
+	uint64_t	 t;
+	int		 more;
+
+	/*
+	 * Hidden tabs are wrapped when they're switched to or, once
+	 * loaded, when there's nothing else to do.
+	 */
+	if (headless)
+		return;
+	if (tab != current_tab) {
 		tab->flags |= TAB_URGENT;
+		if (!ev_idle_pending(wrap_idle))
+			wrap_idle = ev_idle(handle_lazy_wrap, NULL);
+		return;
+	}
+
+	t = perf_usec();
+	more = wrap_page_tail(&tab->buffer, body_cols, WRAP_BATCH);
+	trace_span("wrap", tab->id, t, perf_usec(), NULL);
+	if (more && !ev_idle_pending(wrap_idle))
+		wrap_idle = ev_idle(handle_lazy_wrap, NULL);
+
+	damage(DIRTY_TABLINE|DIRTY_BODY|DIRTY_MODELINE);
 }
 
 void
 ui_on_download_refresh(void)
 {
-	if (ev_timer_pending(download_timer))
+	if (headless || ev_timer_pending(download_timer))
 		return;
 
 	download_timer = ev_timer(&download_refresh_timer,
@@ -1256,7 +1947,9 @@ open_download(int res, void *data)
 {
 	struct download	*d = data;
 	struct mailcap 	*mc = NULL;
+	struct tab	*tab;
 	enum exec_mode	 mode = EXEC_BACKGROUND;
+	int		 fd;
 
 	if (!res)
 		return;
@@ -1264,6 +1957,21 @@ open_download(int res, void *data)
 	if ((mc = mailcap_cmd_from_mimetype(d->mime_type, d->path)) == NULL)
 		return;
 
+	/* show the output in a new tab as it's produced */
+	if (mc->flags & MAILCAP_COPIOUSOUTPUT) {
+		if ((fd = exec_pipe(mc->cmd_argv)) == -1)
+			return;
+		if ((tab = new_tab("about:blank", NULL, current_tab)) == NULL) {
+			close(fd);
+			return;
+		}
+		fs_load_fd(tab, fd);
+		strlcpy(tab->buffer.title, mc->cmd_argv[0],
+		    sizeof(tab->buffer.title));
+		message("Loading %s with %s", d->mime_type, mc->cmd_argv[0]);
+		return;
+	}
+
 	if (mc->flags & MAILCAP_NEEDSTERMINAL)
 		mode = EXEC_FOREGROUND;
 
@@ -1284,6 +1992,12 @@ void
 ui_remotely_open_link(const char *uri)
 {
 	new_tab(uri, NULL, NULL);
+	ui_remotely_opened();
+}
+
+void
+ui_remotely_opened(void)
+{
 	ui_on_tab_refresh(current_tab);
 
 	/* ring the bell */
@@ -1326,10 +2040,15 @@ ui_show_downloads_pane(void)
 		ui_toggle_side_window(SIDE_WINDOW_BOTTOM);
 }
 
+/*
+ * The layout is redone after the keys being handled or, if it's not
+ * done in response to a key, with the next frame.
+ */
 void
 ui_schedule_redraw(void)
 {
 	should_rearrange_windows = 1;
+	damage(DIRTY_ALL);
 }
 
 void
@@ -1341,16 +2060,21 @@ ui_require_input(struct tab *tab, int hide, void (*fn)(const char *))
 		.history = ir_history,
 	};
 
+	if (headless)
+		return;
+
 	/* TODO: hard-switching to another tab is ugly */
 	switch_to_tab(tab);
 
 	enter_minibuffer(&m, "Input required: ");
-	redraw_tab(tab);
+	damage(DIRTY_ALL);
 }
 
 void
 ui_after_message_hook(void)
 {
+	if (headless)
+		return;
 	redraw_minibuffer();
 	place_cursor(0);
 }
@@ -1358,16 +2082,25 @@ ui_after_message_hook(void)
 void
 ui_yornp(const char *prompt, void (*fn)(int, void *), void *data)
 {
+	/* there's no one to ask */
+	if (headless) {
+		fn(0, data);
+		return;
+	}
+
 	yornp(prompt, fn, data);
-	redraw_tab(current_tab);
+	damage(DIRTY_ALL);
 }
 
 void
 ui_read(const char *prompt, void (*fn)(const char*, struct tab *),
     struct tab *data, const char *input)
 {
+	if (headless)
+		return;
+
 	minibuffer_read(prompt, fn, data, input);
-	redraw_tab(current_tab);
+	damage(DIRTY_ALL);
 }
 
 void
@@ -1389,6 +2122,11 @@ ui_other_window(void)
 void
 ui_suspend(void)
 {
+	/* leave the screen up to date */
+	if (ev_timer_pending(redraw_timer)) {
+		ev_timer_cancel(redraw_timer);
+		redraw_frame(-1, EV_TIMEOUT, NULL);
+	}
 	endwin();
 }
 
@@ -138,19 +138,24 @@ void		 restore_excursion(struct excursion *, struct buffer *);
 void		 global_key_unbound(void);
 struct buffer	*current_buffer(void);
 struct vline	*adjust_line(struct vline *, struct buffer *);
+void		 line_prefix_and_text(struct vline *, const char **, int *,
+		    const char **, int *);
 void		 start_loading_anim(struct tab *);
 
 int		 ui_init(void);
+void		 ui_paint(void);
 void		 ui_main_loop(void);
 void		 ui_on_tab_loaded(struct tab *);
 void		 ui_on_tab_refresh(struct tab *);
 void		 ui_on_download_refresh(void);
 void 		 ui_prompt_download_cmd(struct download *);
 void		 ui_remotely_open_link(const char *);
+void		 ui_remotely_opened(void);
 const char	*ui_keyname(int);
 void		 ui_toggle_side_window(int);
 void		 ui_show_downloads_pane(void);
 void		 ui_schedule_redraw(void);
+void		 ui_wrap_completions(int);
 void		 ui_after_message_hook(void);
 void		 ui_require_input(struct tab *, int, void (*)(const char *));
 void		 ui_yornp(const char *, void (*)(int, void *), void *);
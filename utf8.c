@@ -23,10 +23,9 @@
 
 #include "compat.h"
 
-#include <assert.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <wchar.h>
+#include <string.h>
 
 #include "utf8.h"
 
@@ -68,6 +67,20 @@ decode(uint32_t* restrict state, uint32_t* restrict codep, uint8_t byte)
 
 #define ZERO_WIDTH_SPACE 0x200B
 
+/*
+ * Printable ASCII characters are one column wide and don't need
+ * neither to be decoded nor to go through the width table.
+ */
+#define IS_PRINTABLE_ASCII(c)	((c) >= ' ' && (c) < 127)
+
+#define ONES	((unsigned long)-1 / 0xFF)
+#define HIGHS	(ONES * 0x80)
+
+/* true if every byte of the word is printable ASCII */
+#define ALL_PRINTABLE_ASCII(w)						\
+	(!(((w) | ((w) + ONES)) & HIGHS) &&				\
+	    !(((w) - ONES * ' ') & ~(w) & HIGHS))
+
 /* public version of decode */
 uint32_t
 utf8_decode(uint32_t* restrict state, uint32_t* restrict codep, uint8_t byte)
@@ -145,16 +158,13 @@ utf8_ncplen(const char *s, size_t slen)
 	return len;
 }
 
-/* returns only 0, 1, 2 or 8.  assumes sizeof(wchar_t) is 4 */
+/*
+ * returns only 0, 1, 2 or 8.  The width comes from the table generated
+ * by genwidth.sh, so it doesn't depend on the locale or on the libc.
+ */
 size_t
 utf8_chwidth(uint32_t cp)
 {
-	/* XXX: if we're running on a platform where sizeof(wchar_t)
-	 * == 2 what to do?  The manpage for wcwidth and wcs isn't
-	 * clear about the encoding, but if it's 16 bit wide I assume
-	 * it must use UTF-16... right? */
-	assert(sizeof(wchar_t) == 4);
-
 	/*
 	 * quick and dirty fix for the tabs.  In the future we may
 	 * want to expand tabs into N spaces, but for the time being
@@ -163,7 +173,7 @@ utf8_chwidth(uint32_t cp)
 	if (cp == '\t')
 		return 8;
 
-	return wcwidth((wchar_t)cp);
+	return uc_width(cp);
 }
 
 /* NOTE: n is the number of codepoints, NOT the byte length.  In
@@ -175,11 +185,18 @@ utf8_snwidth(const char *s, size_t n)
 	uint32_t cp = 0, state = 0;
 
 	tot = 0;
-	for (i = 0; *s && i < n; ++s)
+	for (i = 0; *s && i < n; ++s) {
+		if (state == UTF8_ACCEPT && IS_PRINTABLE_ASCII(*s)) {
+			i++;
+			tot++;
+			continue;
+		}
+
 		if (!decode(&state, &cp, *s)) {
 			i++;
 			tot += utf8_chwidth(cp);
 		}
+	}
 
 	return tot;
 }
@@ -191,9 +208,15 @@ utf8_swidth(const char *s)
 	uint32_t cp = 0, state = 0;
 
 	tot = 0;
-	for (; *s; ++s)
+	for (; *s; ++s) {
+		if (state == UTF8_ACCEPT && IS_PRINTABLE_ASCII(*s)) {
+			tot++;
+			continue;
+		}
+
 		if (!decode(&state, &cp, *s))
 			tot += utf8_chwidth(cp);
+	}
 
 	return tot;
 }
@@ -203,14 +226,75 @@ utf8_swidth_between(const char *str, const char *end)
 {
 	size_t tot;
 	uint32_t cp = 0, state = 0;
+	unsigned long w;
 
 	tot = 0;
-	for (; *str && str < end; ++str)
+	while (str < end && *str) {
+		if (state == UTF8_ACCEPT) {
+			/* skip runs of ASCII a word at a time */
+			if ((size_t)(end - str) >= sizeof(w)) {
+				memcpy(&w, str, sizeof(w));
+				if (ALL_PRINTABLE_ASCII(w)) {
+					tot += sizeof(w);
+					str += sizeof(w);
+					continue;
+				}
+			}
+
+			if (IS_PRINTABLE_ASCII(*str)) {
+				tot++;
+				str++;
+				continue;
+			}
+		}
+
 		if (!decode(&state, &cp, *str))
 			tot += utf8_chwidth(cp);
+		str++;
+	}
 	return tot;
 }
 
+/*
+ * Return the end of the longest prefix of [s, end) that fits in
+ * *cols columns, and how wide it is in *cols.
+ */
+const char *
+utf8_fit(const char *s, const char *end, size_t *cols)
+{
+	const char	*cpstart = s;
+	size_t		 tot = 0, w;
+	uint32_t	 cp = 0, state = 0;
+
+	while (s < end) {
+		if (state == UTF8_ACCEPT && IS_PRINTABLE_ASCII(*s)) {
+			if (tot == *cols)
+				break;
+			tot++;
+			s++;
+			continue;
+		}
+
+		if (state == UTF8_ACCEPT)
+			cpstart = s;
+		if (!decode(&state, &cp, *s++)) {
+			w = utf8_chwidth(cp);
+			if (tot + w > *cols) {
+				s = cpstart;
+				break;
+			}
+			tot += w;
+		}
+	}
+
+	/* don't split a codepoint cut by end */
+	if (state != UTF8_ACCEPT)
+		s = cpstart;
+
+	*cols = tot;
+	return s;
+}
+
 char *
 utf8_next_cp(const char *s)
 {
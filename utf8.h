@@ -30,11 +30,13 @@ size_t		 utf8_chwidth(uint32_t);
 size_t		 utf8_snwidth(const char*, size_t);
 size_t		 utf8_swidth(const char*);
 size_t		 utf8_swidth_between(const char*, const char*);
+const char	*utf8_fit(const char *, const char *, size_t *);
 char		*utf8_next_cp(const char*);
 char		*utf8_prev_cp(const char*, const char*);
 int		 emojied_line(const char *, const char **);
 
-/* emoji-matcher.c */
+/* width-table.c */
+int		 uc_width(uint32_t);
 int		 is_emoji(uint32_t);
 
 #endif
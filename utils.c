@@ -18,12 +18,27 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "perf.h"
 #include "utils.h"
 #include "xwrapper.h"
 
+uint64_t	 perf_counters[PERF_MAX];
+
+/* a monotonic clock in microseconds, for perf_count */
+uint64_t
+perf_usec(void)
+{
+	struct timespec	 ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+}
+
 int
 mark_nonblock_cloexec(int fd)
 {
@@ -52,6 +67,18 @@ has_suffix(const char *str, const char *sufx)
 	return !strcmp(str + (l - s), sufx);
 }
 
+uint64_t
+fnv1a(uint64_t h, const void *p, size_t len)
+{
+	const unsigned char	*c = p;
+
+	while (len-- > 0) {
+		h ^= *c++;
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
 void *
 hash_alloc(size_t len, void *d)
 {
@@ -71,3 +98,60 @@ hash_free(void *ptr, void *d)
 {
 	free(ptr);
 }
+
+/* the memory of the table, not of its entries */
+size_t
+hash_memory(struct ohash *h)
+{
+	/* struct _ohash_record is private to ohash.c */
+	return h->size * sizeof(struct { uint32_t hv; const char *p; });
+}
+
+/*
+ * Tables of objects by their uint32_t id, found at the given offset
+ * inside them.  The tabs, the downloads and the requests are looked
+ * up this way for every imsg.
+ */
+void
+idmap_init(struct ohash *h, ptrdiff_t ko)
+{
+	struct ohash_info info = {
+		.key_offset = ko,
+		.calloc = hash_calloc,
+		.free = hash_free,
+		.alloc = hash_alloc,
+	};
+
+	ohash_init(h, 5, &info);
+}
+
+static inline unsigned int
+idmap_slot(struct ohash *h, uint32_t id)
+{
+	return ohash_lookup_memory(h, (const char *)&id, sizeof(id),
+	    fnv1a(FNV1A_INIT, &id, sizeof(id)));
+}
+
+/* add p, replacing the object with the same id if any */
+void
+idmap_put(struct ohash *h, uint32_t id, void *p)
+{
+	ohash_insert(h, idmap_slot(h, id), p);
+}
+
+void *
+idmap_get(struct ohash *h, uint32_t id)
+{
+	return ohash_find(h, idmap_slot(h, id));
+}
+
+/* remove p, but not another object that took its id since */
+void
+idmap_del(struct ohash *h, uint32_t id, void *p)
+{
+	unsigned int	 slot;
+
+	slot = idmap_slot(h, id);
+	if (ohash_find(h, slot) == p)
+		ohash_remove(h, slot);
+}
@@ -21,8 +21,18 @@ int		 mark_nonblock_cloexec(int);
 
 int		 has_suffix(const char *, const char *);
 
+#define FNV1A_INIT	0xcbf29ce484222325ULL
+uint64_t	 fnv1a(uint64_t, const void *, size_t);
+
 void		*hash_alloc(size_t, void *);
 void		*hash_calloc(size_t, size_t, void *);
 void		 hash_free(void *, void *);
 
+struct ohash;
+size_t		 hash_memory(struct ohash *);
+void		 idmap_init(struct ohash *, ptrdiff_t);
+void		 idmap_put(struct ohash *, uint32_t, void *);
+void		*idmap_get(struct ohash *, uint32_t);
+void		 idmap_del(struct ohash *, uint32_t, void *);
+
 #endif /* UTILS_H */
@@ -0,0 +1,272 @@
+/*
+ * Copyright (c) 2024 Omar Polo <op@omarpolo.com>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+/*
+ * Reload the local files shown in the tabs in watch mode when they
+ * change.  With inotify the directory of the file is watched, not the
+ * file itself, so that it's noticed when an editor saves a new copy
+ * and renames it over the old one; the reload is delayed a bit so
+ * that the bursts of changes of a save reload the page only once.
+ * Elsewhere the files are stat'ed every second.
+ */
+
+#include "compat.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#if HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ev.h"
+#include "hist.h"
+#include "telescope.h"
+#include "watch.h"
+#include "xwrapper.h"
+
+struct watch {
+	TAILQ_ENTRY(watch)	 watches;
+	struct tab		*tab;
+	char			*path;
+#if HAVE_SYS_INOTIFY_H
+	const char		*name;		/* in path */
+	int			 wd;
+	unsigned int		 timer;
+#else
+	struct stat		 sb;
+#endif
+};
+
+static TAILQ_HEAD(, watch) watches = TAILQ_HEAD_INITIALIZER(watches);
+
+static void
+watch_reload(struct watch *w)
+{
+	struct tab	*tab = w->tab;
+
+	/* this frees w */
+	load_url_in_tab(tab, hist_cur(tab->hist), NULL,
+	    LU_MODE_NOHIST|LU_MODE_NOCACHE);
+}
+
+#if HAVE_SYS_INOTIFY_H
+
+#define WATCH_MASK	(IN_CLOSE_WRITE|IN_MOVED_TO)
+
+static int		 inotify_fd = -1;
+static struct timeval	 settle_tv = { 0, 100000 };
+
+static void
+watch_settled(int fd, int ev, void *d)
+{
+	watch_reload(d);
+}
+
+static void
+watch_changed(struct watch *w)
+{
+	if (!ev_timer_pending(w->timer))
+		w->timer = ev_timer(&settle_tv, watch_settled, w);
+}
+
+static void
+watch_read(int fd, int ev, void *d)
+{
+	struct watch		*w, *tw;
+	struct inotify_event	*e;
+	union {
+		struct inotify_event	 e;
+		char			 buf[4096];
+	} u;
+	char			*buf = u.buf, *p;
+	ssize_t			 r;
+
+	for (;;) {
+		if ((r = read(inotify_fd, buf, sizeof(u))) == -1) {
+			if (errno == EINTR)
+				continue;
+			return;
+		}
+
+		for (p = buf; p < buf + r; p += sizeof(*e) + e->len) {
+			e = (struct inotify_event *)p;
+
+			TAILQ_FOREACH_SAFE(w, &watches, watches, tw) {
+				if (e->mask & IN_Q_OVERFLOW) {
+					watch_changed(w);
+					continue;
+				}
+
+				if (w->wd != e->wd)
+					continue;
+
+				if (e->mask & IN_IGNORED)
+					w->wd = -1;
+				else if (e->len != 0 &&
+				    !strcmp(e->name, w->name))
+					watch_changed(w);
+			}
+		}
+	}
+}
+
+static int
+watch_add(struct watch *w)
+{
+	char		 dir[PATH_MAX];
+	char		*slash;
+
+	if (inotify_fd == -1) {
+		inotify_fd = inotify_init1(IN_NONBLOCK|IN_CLOEXEC);
+		if (inotify_fd == -1)
+			return -1;
+		if (ev_add(inotify_fd, EV_READ, watch_read, NULL) == -1) {
+			close(inotify_fd);
+			inotify_fd = -1;
+			return -1;
+		}
+	}
+
+	if (strlcpy(dir, w->path, sizeof(dir)) >= sizeof(dir) ||
+	    (slash = strrchr(dir, '/')) == NULL)
+		return -1;
+	slash[slash == dir] = '\0';
+	w->name = w->path + (slash - dir) + 1;
+
+	w->wd = inotify_add_watch(inotify_fd, dir, WATCH_MASK);
+	return w->wd == -1 ? -1 : 0;
+}
+
+static void
+watch_del(struct watch *w)
+{
+	struct watch	*o;
+
+	ev_timer_cancel(w->timer);
+
+	if (w->wd == -1)
+		return;
+
+	/* the directory may be watched for another tab */
+	TAILQ_FOREACH(o, &watches, watches)
+		if (o != w && o->wd == w->wd)
+			return;
+
+	inotify_rm_watch(inotify_fd, w->wd);
+}
+
+#else
+
+static unsigned int	 poll_timer;
+static struct timeval	 poll_tv = { 1, 0 };
+
+static int
+same_file(struct stat *a, struct stat *b)
+{
+	return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+	    a->st_size == b->st_size && a->st_mtime == b->st_mtime;
+}
+
+static void
+watch_poll(int fd, int ev, void *d)
+{
+	struct watch	*w, *tw;
+	struct stat	 sb;
+
+	poll_timer = 0;
+
+	TAILQ_FOREACH_SAFE(w, &watches, watches, tw) {
+		if (stat(w->path, &sb) == -1 || same_file(&sb, &w->sb))
+			continue;
+		w->sb = sb;
+		watch_reload(w);
+	}
+
+	if (!TAILQ_EMPTY(&watches))
+		poll_timer = ev_timer(&poll_tv, watch_poll, NULL);
+}
+
+static int
+watch_add(struct watch *w)
+{
+	if (stat(w->path, &w->sb) == -1)
+		return -1;
+
+	if (!ev_timer_pending(poll_timer))
+		poll_timer = ev_timer(&poll_tv, watch_poll, NULL);
+	return 0;
+}
+
+static void
+watch_del(struct watch *w)
+{
+	return;
+}
+
+#endif
+
+/*
+ * Watch the file shown in the tab, if it's a file: URL, and reload
+ * it when it changes until the tab navigates away.
+ */
+int
+watch_tab(struct tab *tab)
+{
+	struct watch	*w;
+	const char	*url;
+
+	unwatch_tab(tab);
+
+	url = hist_cur(tab->hist);
+	if (strncmp(url, "file://", 7) != 0)
+		return -1;
+
+	w = xcalloc(1, sizeof(*w));
+	w->tab = tab;
+	w->path = xstrdup(url + 7);
+	if (watch_add(w) == -1) {
+		free(w->path);
+		free(w);
+		return -1;
+	}
+
+	TAILQ_INSERT_TAIL(&watches, w, watches);
+	return 0;
+}
+
+void
+unwatch_tab(struct tab *tab)
+{
+	struct watch	*w;
+
+	TAILQ_FOREACH(w, &watches, watches) {
+		if (w->tab == tab)
+			break;
+	}
+	if (w == NULL)
+		return;
+
+	TAILQ_REMOVE(&watches, w, watches);
+	watch_del(w);
+	free(w->path);
+	free(w);
+}
@@ -17,89 +17,580 @@
 #include "compat.h"
 
 #include <ctype.h>
+#include <pthread.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <grapheme.h>
 
+#include "arena.h"
 #include "defaults.h"
+#include "perf.h"
 #include "telescope.h"
 #include "utf8.h"
+#include "utils.h"
 #include "xwrapper.h"
 
+/*
+ * With wrap-threads, the hidden tabs are wrapped again after a resize
+ * in a pool of threads.  A job works on a copy of the struct buffer
+ * with its own vlines, and allocates the layouts in its copy of the
+ * arena: until it's joined the lines of the buffer and the globals
+ * that change the wrapping must be left alone.  The functions here
+ * that walk the lines join the job first, swapping in its result.
+ */
+
+#define JOB_QUEUED	0
+#define JOB_RUNNING	1
+#define JOB_DONE	2
+
+struct wrap_job {
+	TAILQ_ENTRY(wrap_job)	 jobs;
+	struct buffer		*buffer;
+	struct buffer		 shadow;
+	int			 width;
+	int			 state;
+	uint64_t		 usec;
+};
+
+static TAILQ_HEAD(, wrap_job)	 wrap_jobs = TAILQ_HEAD_INITIALIZER(wrap_jobs);
+static pthread_mutex_t		 wrap_mtx = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t		 wrap_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t		 wrap_done = PTHREAD_COND_INITIALIZER;
+static int			 wrap_nthreads;
+
+static void	 wrap_lines(struct buffer *, int);
+
 void
 erase_buffer(struct buffer *buffer)
 {
+	wrap_join(buffer);
 	empty_vlist(buffer);
 	empty_linelist(buffer);
 }
 
+/*
+ * Like erase_buffer, but give back the memory instead of keeping it
+ * around for the next page.
+ */
 void
-empty_linelist(struct buffer *buffer)
+release_buffer(struct buffer *buffer)
 {
-	struct line *l, *lt;
+	erase_buffer(buffer);
+	arena_free(&buffer->line_arena);
+	free(buffer->vlines);
+	buffer->vlines = NULL;
+	buffer->vlines_cap = 0;
+	free(buffer->vis);
+	buffer->vis = NULL;
+	buffer->vis_len = 0;
+	buffer->vis_cap = 0;
+	free(buffer->headings.refs);
+	memset(&buffer->headings, 0, sizeof(buffer->headings));
+	free(buffer->links.refs);
+	memset(&buffer->links, 0, sizeof(buffer->links));
+}
 
-	TAILQ_FOREACH_SAFE(l, &buffer->head, lines, lt) {
-		TAILQ_REMOVE(&buffer->head, l, lines);
-		free(l->line);
+/*
+ * The memory held by the buffer, filling m if not NULL.  The lines
+ * aren't walked: it's cheap enough to be called for every tab.
+ */
+size_t
+buffer_memory(struct buffer *buffer, struct bufmem *m)
+{
+	struct bufmem	 mem;
 
-		if (l->type != LINE_COMPL &&
-		    l->type != LINE_COMPL_CURRENT &&
-		    l->type != LINE_HELP)
-			free(l->alt);
+	wrap_join(buffer);
+	mem.arena = arena_size(&buffer->line_arena);
+	mem.vlines = buffer->vlines_cap * sizeof(*buffer->vlines) +
+	    buffer->vis_cap * 2 * sizeof(*buffer->vis);
+	mem.index = buffer->headings.cap * sizeof(*buffer->headings.refs) +
+	    buffer->links.cap * sizeof(*buffer->links.refs);
+	mem.raw = buffer->cap;
+	mem.tot = mem.arena + mem.vlines + mem.index + mem.raw;
+	mem.shared = buffer->shared != NULL ? buffer->shared->len : 0;
+	mem.spilled = arena_spilled(&buffer->line_arena);
 
-		free(l);
-	}
+	if (m != NULL)
+		*m = mem;
+	return mem.tot;
 }
 
+/*
+ * The lines and their text are allocated in the buffer arena, so
+ * there's no need to walk the list.  The text may be shared instead,
+ * see mcache_restore.
+ */
 void
-empty_vlist(struct buffer *buffer)
+empty_linelist(struct buffer *buffer)
 {
-	struct vline *vl, *t;
+	TAILQ_INIT(&buffer->head);
+	arena_reset(&buffer->line_arena);
+	buffer->gen++;
+
+	if (buffer->shared != NULL && --buffer->shared->refs == 0)
+		buffer->shared->drop(buffer->shared);
+	buffer->shared = NULL;
+
+	buffer->headings.len = 0;
+	if (buffer->headings.refs != NULL)
+		buffer->headings.refs[0].line = NULL;
+	buffer->links.len = 0;
+	if (buffer->links.refs != NULL)
+		buffer->links.refs[0].line = NULL;
+	buffer->links_base = NULL;
+}
 
+void
+empty_vlist(struct buffer *buffer)
+{
 	buffer->top_line = NULL;
 	buffer->line_off = 0;
 	buffer->current_line = NULL;
 	buffer->line_max = 0;
+	buffer->last_wrapped = NULL;
+
+	/* keep the array around for the next wrap */
+	buffer->vlines_len = 0;
+	vline_hidden_changed(buffer);
+
+	/* the vlines will be reused for something else */
+	buffer->force_redraw = 1;
+}
+
+/*
+ * Grow the vlines array, taking care of fixing top_line and
+ * current_line which may point inside it.
+ */
+static void
+vlines_grow(struct buffer *buffer)
+{
+	size_t	 top = 0, cur = 0, cap;
+
+	if (buffer->top_line != NULL)
+		top = vline_index(buffer, buffer->top_line);
+	if (buffer->current_line != NULL)
+		cur = vline_index(buffer, buffer->current_line);
+
+	cap = buffer->vlines_cap == 0 ? 64 : buffer->vlines_cap * 2;
+	buffer->vlines = xreallocarray(buffer->vlines, cap,
+	    sizeof(*buffer->vlines));
+	buffer->vlines_cap = cap;
+	buffer->force_redraw = 1;
+
+	if (buffer->top_line != NULL)
+		buffer->top_line = &buffer->vlines[top];
+	if (buffer->current_line != NULL)
+		buffer->current_line = &buffer->vlines[cur];
+}
+
+struct vline *
+vline_at(struct buffer *buffer, size_t n)
+{
+	if (n >= buffer->vlines_len)
+		return NULL;
+	return &buffer->vlines[n];
+}
+
+size_t
+vline_index(struct buffer *buffer, struct vline *vl)
+{
+	return vl - buffer->vlines;
+}
+
+struct vline *
+vline_first(struct buffer *buffer)
+{
+	return vline_at(buffer, 0);
+}
+
+struct vline *
+vline_last(struct buffer *buffer)
+{
+	if (buffer->vlines_len == 0)
+		return NULL;
+	return &buffer->vlines[buffer->vlines_len - 1];
+}
+
+struct vline *
+vline_next(struct buffer *buffer, struct vline *vl)
+{
+	if (vl == NULL || buffer->vlines_len == 0)
+		return NULL;
+	return vline_at(buffer, vline_index(buffer, vl) + 1);
+}
+
+struct vline *
+vline_prev(struct buffer *buffer, struct vline *vl)
+{
+	if (vl == NULL || buffer->vlines_len == 0 || vl == buffer->vlines)
+		return NULL;
+	return vl - 1;
+}
+
+#define VL_HIDDEN(b, i)	((b)->vlines[i].parent->flags & L_HIDDEN)
+
+/*
+ * Lines were hidden or shown: the skip index has to be rebuilt.
+ */
+void
+vline_hidden_changed(struct buffer *buffer)
+{
+	buffer->vis_len = 0;
+	buffer->vis_hidden = 0;
+}
+
+/*
+ * Bring the skip index up to date with the vlines appended since the
+ * last call.  The first half of buffer->vis holds, for every vline,
+ * the index of the first visible one at or after it (vlines_len if
+ * none) and the second half one plus the index of the last visible
+ * one at or before it (0 if none).  As long as nothing is hidden
+ * there's no need to keep the arrays at all.
+ */
+static void
+vis_update(struct buffer *buffer)
+{
+	uint32_t	*next, *prev, last;
+	size_t		 i, from, n;
+
+	n = buffer->vlines_len;
+	if ((from = buffer->vis_len) == n)
+		return;
+
+	if (buffer->vis_hidden == 0) {
+		for (i = from; i < n; ++i)
+			if (VL_HIDDEN(buffer, i))
+				break;
+		if (i == n) {
+			buffer->vis_len = n;
+			return;
+		}
+		from = 0;
+	}
+
+	if (buffer->vis_cap < n) {
+		free(buffer->vis);
+		buffer->vis = xreallocarray(NULL, buffer->vlines_cap,
+		    2 * sizeof(*buffer->vis));
+		buffer->vis_cap = buffer->vlines_cap;
+		from = 0;
+	}
+
+	if (from == 0)
+		buffer->vis_hidden = 0;
+
+	next = buffer->vis;
+	prev = buffer->vis + buffer->vis_cap;
+
+	last = from == 0 ? 0 : prev[from - 1];
+	for (i = from; i < n; ++i) {
+		if (VL_HIDDEN(buffer, i))
+			buffer->vis_hidden++;
+		else
+			last = i + 1;
+		prev[i] = last;
+	}
+
+	/* only the trailing hidden run of the old part needs fixing */
+	last = n;
+	for (i = n; i-- > 0; ) {
+		if (i < from && next[i] != from)
+			break;
+		if (!VL_HIDDEN(buffer, i))
+			last = i;
+		next[i] = last;
+	}
+
+	buffer->vis_len = n;
+}
+
+struct vline *
+vline_next_visible(struct buffer *buffer, struct vline *vl)
+{
+	size_t	 i;
+
+	if (vl == NULL)
+		return NULL;
+
+	vis_update(buffer);
+	if (buffer->vis_hidden == 0)
+		return vline_next(buffer, vl);
+
+	i = vline_index(buffer, vl) + 1;
+	if (i >= buffer->vlines_len)
+		return NULL;
+	return vline_at(buffer, buffer->vis[i]);
+}
+
+struct vline *
+vline_prev_visible(struct buffer *buffer, struct vline *vl)
+{
+	size_t	 i;
+
+	if (vl == NULL)
+		return NULL;
+
+	vis_update(buffer);
+	if (buffer->vis_hidden == 0)
+		return vline_prev(buffer, vl);
+
+	if ((i = vline_index(buffer, vl)) == 0)
+		return NULL;
+	i = buffer->vis[buffer->vis_cap + i - 1];
+	if (i == 0)
+		return NULL;
+	return &buffer->vlines[i - 1];
+}
+
+/*
+ * Return how many visible vlines come before vl, i.e. what line_off
+ * is when vl is the top line.
+ */
+size_t
+vline_visible_index(struct buffer *buffer, struct vline *vl)
+{
+	size_t	 i, n, hidden = 0;
+
+	n = vline_index(buffer, vl);
+
+	vis_update(buffer);
+	if (buffer->vis_hidden == 0)
+		return n;
+
+	for (i = 0; i < n; ++i)
+		if (VL_HIDDEN(buffer, i))
+			hidden++;
+	return n - hidden;
+}
+
+/*
+ * Return the first vline of l, or NULL if it wasn't wrapped yet.
+ * push_line records it in the line, so this doesn't need to walk
+ * the vlines.
+ */
+struct vline *
+line_vline(struct buffer *buffer, struct line *l)
+{
+	struct vline	*vl;
+
+	wrap_join(buffer);
+	if ((vl = vline_at(buffer, l->vline)) == NULL || vl->parent != l)
+		return NULL;
+	return vl;
+}
+
+/* The lines not wrapped yet all come after the wrapped ones. */
+static inline size_t
+lineidx_key(struct buffer *buffer, struct line *l)
+{
+	if (line_vline(buffer, l) == NULL)
+		return SIZE_MAX;
+	return l->vline;
+}
+
+/*
+ * Binary search the index for the first entry whose line starts
+ * after the vline vidx, or at it too unless after is set.
+ */
+static size_t
+lineidx_search(struct buffer *buffer, struct lineidx *idx, size_t vidx,
+    int after)
+{
+	size_t	 lo = 0, hi = idx->len, mid, key;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		key = lineidx_key(buffer, idx->refs[mid].line);
+		if (key < vidx || (after && key == vidx))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Return the first entry of the index whose line starts after the
+ * vline vidx, or the last one starting before it if backward is set.
+ * The line found may be still waiting to be wrapped.
+ */
+struct lineref *
+lineidx_near(struct buffer *buffer, struct lineidx *idx, size_t vidx,
+    int backward)
+{
+	struct lineref	*refs = idx->refs;
+	size_t		 i;
+
+	i = lineidx_search(buffer, idx, vidx, !backward);
+
+	if (!backward) {
+		while (i < idx->len && refs[i].line->flags & L_HIDDEN)
+			i++;
+		return i < idx->len ? &refs[i] : NULL;
+	}
+
+	while (i > 0 && refs[i - 1].line->flags & L_HIDDEN)
+		i--;
+	return i > 0 ? &refs[i - 1] : NULL;
+}
+
+/* Return the entry of l in the index, if it was wrapped already. */
+struct lineref *
+lineidx_find(struct buffer *buffer, struct lineidx *idx, struct line *l)
+{
+	size_t	 i;
+
+	if (line_vline(buffer, l) == NULL)
+		return NULL;
+
+	i = lineidx_search(buffer, idx, l->vline, 0);
+	if (i < idx->len && idx->refs[i].line == l)
+		return &idx->refs[i];
+	return NULL;
+}
 
-	TAILQ_FOREACH_SAFE(vl, &buffer->vhead, vlines, t) {
-		TAILQ_REMOVE(&buffer->vhead, vl, vlines);
-		free(vl);
+/*
+ * The break opportunities of a line, with their display width and
+ * length in codepoints, are computed the first time the line is
+ * wrapped and kept in the buffer arena.  Wrapping it again, e.g.
+ * after a resize, is then just a matter of summing the widths.
+ */
+struct segment {
+	uint32_t	 end;		/* offset past the segment */
+	uint32_t	 cplen;
+	size_t		 width;
+};
+
+struct layout {
+	size_t		 start;		/* offset of the text */
+	size_t		 nsegs;
+	struct segment	 segs[];
+};
+
+static struct layout *
+line_layout(struct buffer *buffer, struct line *l)
+{
+	static _Thread_local struct segment	*segs;
+	static _Thread_local size_t		 cap;
+	GRAPHEME_LINE_BREAK_STATE state;
+	struct layout		*lo;
+	const char		*line;
+	size_t			 n = 0, off, ret, start = 0;
+
+	if (l->layout != NULL)
+		return l->layout;
+
+	line = l->line;
+	if (LINE_EMOJIFIED(l)) {
+		start = (const char *)l->data + 1 - l->line;
+		line += start;
+	}
+
+	grapheme_line_break_init_utf8(&state, line, strlen(line));
+	for (off = 0; (ret = grapheme_next_line_break_state(&state)) != 0;
+	    off += ret) {
+		if (n == cap) {
+			cap = cap == 0 ? 64 : cap * 2;
+			segs = xreallocarray(segs, cap, sizeof(*segs));
+		}
+
+		segs[n].end = off + ret;
+		if (l->flags & L_ASCII) {
+			segs[n].width = ret;
+			segs[n].cplen = ret;
+		} else {
+			segs[n].width = utf8_swidth_between(&line[off],
+			    &line[off + ret]);
+			segs[n].cplen = utf8_ncplen(&line[off], ret);
+		}
+		n++;
 	}
+
+	lo = arena_alloc(&buffer->line_arena,
+	    sizeof(*lo) + n * sizeof(*segs));
+	lo->start = start;
+	lo->nsegs = n;
+	if (n != 0)
+		memcpy(lo->segs, segs, n * sizeof(*segs));
+
+	l->layout = lo;
+	return lo;
 }
 
 static int
-push_line(struct buffer *buffer, struct line *l, const char *buf, size_t len, int flags)
+push_line(struct buffer *buffer, struct line *l, const char *buf, size_t len,
+    int flags, size_t cplen)
 {
 	struct vline *vl;
 	const char *end;
 
-	/* omit trailing spaces */
+	/* omit trailing spaces; they're all one-byte codepoints */
 	if (len != 0) {
 		for (end = buf + len - 1;
 		     end > buf && isspace(*end);
-		     end--, len--)
+		     end--, len--, cplen--)
 			;	/* nop */
 	}
 
 	if (!(l->flags & L_HIDDEN))
 		buffer->line_max++;
 
-	vl = xcalloc(1, sizeof(*vl));
+	if (buffer->vlines_len == buffer->vlines_cap)
+		vlines_grow(buffer);
+	vl = &buffer->vlines[buffer->vlines_len++];
+	memset(vl, 0, sizeof(*vl));
 
 	vl->parent = l;
+	if (!(flags & L_CONTINUATION))
+		l->vline = buffer->vlines_len - 1;
 	if (len != 0) {
 		vl->from = buf - l->line;
 		vl->len = len;
-		vl->cplen = utf8_ncplen(buf, vl->len);
+		vl->cplen = cplen;
 	}
 	vl->flags = flags;
 
-	TAILQ_INSERT_TAIL(&buffer->vhead, vl, vlines);
 	return 1;
 }
 
+/*
+ * The lines longer than long-line-size, like a minified file or a
+ * page without newlines, are cut where the window ends without
+ * looking for the break opportunities: finding and keeping them is
+ * what would take the time and the memory.
+ */
+static int
+wrap_long(struct buffer *buffer, struct line *l, const char *line,
+    size_t avail, int oneline)
+{
+	const char	*end, *s;
+	size_t		 cols;
+	int		 flags = 0;
+
+	end = line + strlen(line);
+	while (line < end) {
+		cols = avail;
+		if (l->flags & L_ASCII)
+			s = line + MIN(avail, (size_t)(end - line));
+		else if ((s = utf8_fit(line, end, &cols)) == line)
+			s = utf8_next_cp(line);	/* too wide, but move on */
+
+		if (!push_line(buffer, l, line, s - line, flags,
+		    l->flags & L_ASCII ? (size_t)(s - line) :
+		    utf8_ncplen(line, s - line)))
+			return 0;
+		if (oneline)
+			return 0;
+
+		flags = L_CONTINUATION;
+		line = s;
+	}
+	return 0;
+}
+
 /*
  * Build a list of visual line by wrapping the given line, assuming
  * that when printed will have a leading prefix prfx.
@@ -108,37 +599,44 @@ int
 wrap_text(struct buffer *buffer, const char *prfx, struct line *l,
     size_t width, int oneline)
 {
-	const char	*line, *space;
-	size_t		 ret, off, start, cur, prfxwidth;
+	struct layout	*lo;
+	const char	*line;
+	size_t		 i, off, start, cur, cplen, prfxwidth;
 	int		 flags;
 
 	if ((line = l->line) == NULL || *line == '\0')
-		return push_line(buffer, l, NULL, 0, 0);
+		return push_line(buffer, l, NULL, 0, 0, 0);
 
-	prfxwidth = utf8_swidth(prfx);
-	cur = prfxwidth;
-	start = 0;
-	flags = 0;
+	prfxwidth = LINE_EMOJIFIED(l) ? (size_t)l->emojiwidth :
+	    utf8_swidth(prfx);
 
-	if (l->type == LINE_LINK && emojify_link &&
-	    emojied_line(l->line, &space)) {
-	    	prfxwidth = utf8_swidth_between(l->line, space);
-		cur = prfxwidth;
-		line = space + 1;
+	/* the short lines have a layout after the first time */
+	if (l->layout == NULL && long_line_size > 0 &&
+	    strnlen(line, long_line_size + 1) > (size_t)long_line_size) {
+		if (LINE_EMOJIFIED(l))
+			line = (const char *)l->data + 1;
+		return wrap_long(buffer, l, line,
+		    width > prfxwidth ? width - prfxwidth : 1, oneline);
 	}
 
-	for (off = 0; line[off] != '\0'; off += ret) {
-		size_t t;
+	lo = line_layout(buffer, l);
+	line += lo->start;
+	cur = prfxwidth;
+	start = 0;
+	cplen = 0;
+	flags = 0;
 
-		ret = grapheme_next_line_break_utf8(&line[off], SIZE_MAX);
-		t = utf8_swidth_between(&line[off], &line[off + ret]);
+	for (i = 0, off = 0; i < lo->nsegs; off = lo->segs[i++].end) {
+		size_t t = lo->segs[i].width;
 
 		if (cur + t <= width) {
 			cur += t;
+			cplen += lo->segs[i].cplen;
 			continue;
 		}
 
-		if (!push_line(buffer, l, &line[start], off - start, flags))
+		if (!push_line(buffer, l, &line[start], off - start, flags,
+		    cplen))
 			return 0;
 
 		if (oneline)
@@ -147,20 +645,106 @@ wrap_text(struct buffer *buffer, const char *prfx, struct line *l,
 		flags = L_CONTINUATION;
 		start = off;
 		cur = t + prfxwidth;
+		cplen = lo->segs[i].cplen;
 	}
 
 	if (off != start)
-		return push_line(buffer, l, &line[start], off - start, flags);
+		return push_line(buffer, l, &line[start], off - start, flags,
+		    cplen);
 	return 0;
 }
 
+/*
+ * With dont-wrap-pre, the preformatted lines are kept on one vline
+ * and cut when printed, so there's no need to find their breaks nor
+ * to know how wide they are.
+ */
+static int
+push_unwrapped(struct buffer *buffer, struct line *l)
+{
+	size_t		 len;
+
+	if (l->line == NULL || *l->line == '\0')
+		return push_line(buffer, l, NULL, 0, L_UNWRAPPED, 0);
+
+	len = strlen(l->line);
+	return push_line(buffer, l, l->line, len, L_UNWRAPPED,
+	    l->flags & L_ASCII ? len : utf8_ncplen(l->line, len));
+}
+
+static void
+wrap_line(struct buffer *buffer, struct line *l, int width)
+{
+	const char	*prfx;
+
+	if (l->type == LINE_PRE_CONTENT && dont_wrap_pre) {
+		push_unwrapped(buffer, l);
+		buffer->last_wrapped = l;
+		return;
+	}
+
+	/* the folded hunks are wrapped once opened */
+	if ((l->flags & L_HIDDEN) && LINE_HUNK_BODY(l->type)) {
+		push_line(buffer, l, NULL, 0, L_FOLDED, 0);
+		buffer->last_wrapped = l;
+		return;
+	}
+
+	prfx = line_prefixes[l->type].prfx1;
+	switch (l->type) {
+	case LINE_TEXT:
+	case LINE_LINK:
+	case LINE_TITLE_1:
+	case LINE_TITLE_2:
+	case LINE_TITLE_3:
+	case LINE_ITEM:
+	case LINE_QUOTE:
+	case LINE_PRE_START:
+	case LINE_PRE_END:
+	case LINE_PRE_CONTENT:
+	case LINE_PATCH:
+	case LINE_PATCH_HDR:
+	case LINE_PATCH_HUNK_HDR:
+	case LINE_PATCH_ADD:
+	case LINE_PATCH_DEL:
+		wrap_text(buffer, prfx, l, MIN(fill_column, width), 0);
+		break;
+	case LINE_COMPL:
+	case LINE_COMPL_CURRENT:
+	case LINE_HELP:
+	case LINE_DOWNLOAD:
+	case LINE_DOWNLOAD_DONE:
+	case LINE_DOWNLOAD_INFO:
+		wrap_text(buffer, prfx, l, width, 1);
+		break;
+	case LINE_FRINGE:
+		/* never, ever wrapped */
+		break;
+	}
+
+	buffer->last_wrapped = l;
+}
+
 int
 wrap_page(struct buffer *buffer, int width)
+{
+	uint64_t	 t;
+
+	wrap_join(buffer);
+
+	t = perf_usec();
+	wrap_lines(buffer, width);
+	perf_count(PERF_WRAP, perf_usec() - t);
+	return 1;
+}
+
+/* the body of wrap_page, safe to call from the pool */
+static void
+wrap_lines(struct buffer *buffer, int width)
 {
 	struct line		*l;
 	const struct line	*top_orig, *orig;
 	struct vline		*vl;
-	const char		*prfx;
 
 	top_orig = buffer->top_line == NULL ? NULL : buffer->top_line->parent;
 	orig = buffer->current_line == NULL ? NULL : buffer->current_line->parent;
@@ -174,47 +758,20 @@ wrap_page(struct buffer *buffer, int width)
 
 	empty_vlist(buffer);
 
+	buffer->wrap_width = width;
+	buffer->wrap_fill_column = fill_column;
+	buffer->wrap_pre = !dont_wrap_pre;
+
 	TAILQ_FOREACH(l, &buffer->head, lines) {
-		prfx = line_prefixes[l->type].prfx1;
-		switch (l->type) {
-		case LINE_TEXT:
-		case LINE_LINK:
-		case LINE_TITLE_1:
-		case LINE_TITLE_2:
-		case LINE_TITLE_3:
-		case LINE_ITEM:
-		case LINE_QUOTE:
-		case LINE_PRE_START:
-		case LINE_PRE_END:
-		case LINE_PRE_CONTENT:
-		case LINE_PATCH:
-		case LINE_PATCH_HDR:
-		case LINE_PATCH_HUNK_HDR:
-		case LINE_PATCH_ADD:
-		case LINE_PATCH_DEL:
-			wrap_text(buffer, prfx, l, MIN(fill_column, width),
-			    0);
-			break;
-		case LINE_COMPL:
-		case LINE_COMPL_CURRENT:
-		case LINE_HELP:
-		case LINE_DOWNLOAD:
-		case LINE_DOWNLOAD_DONE:
-		case LINE_DOWNLOAD_INFO:
-			wrap_text(buffer, prfx, l, width, 1);
-			break;
-		case LINE_FRINGE:
-			/* never, ever wrapped */
-			break;
-		}
+		wrap_line(buffer, l, width);
 
 		if (top_orig == l && buffer->top_line == NULL) {
 			buffer->line_off = buffer->line_max-1;
-			buffer->top_line = TAILQ_LAST(&buffer->vhead, vhead);
+			buffer->top_line = vline_last(buffer);
 
 			while (1) {
-				vl = TAILQ_PREV(buffer->top_line, vhead, vlines);
-				if (vl == NULL || vl->parent != orig)
+				vl = vline_prev(buffer, buffer->top_line);
+				if (vl == NULL || vl->parent != top_orig)
 					break;
 				buffer->top_line = vl;
 				buffer->line_off--;
@@ -222,10 +779,10 @@ wrap_page(struct buffer *buffer, int width)
 		}
 
 		if (orig == l && buffer->current_line == NULL) {
-			buffer->current_line = TAILQ_LAST(&buffer->vhead, vhead);
+			buffer->current_line = vline_last(buffer);
 
 			while (1) {
-				vl = TAILQ_PREV(buffer->current_line, vhead, vlines);
+				vl = vline_prev(buffer, buffer->current_line);
 				if (vl == NULL || vl->parent != orig)
 					break;
 				buffer->current_line = vl;
@@ -234,10 +791,600 @@ wrap_page(struct buffer *buffer, int width)
 	}
 
 	if (buffer->current_line == NULL)
-		buffer->current_line = TAILQ_FIRST(&buffer->vhead);
+		buffer->current_line = vline_first(buffer);
+
+	if (buffer->top_line == NULL)
+		buffer->top_line = buffer->current_line;
+}
+
+/*
+ * Some of the lines from first to last were hidden or shown: wrap
+ * the ones that are shown now but were folded by wrap_line, moving
+ * the vlines after them, and count again the visible rows.  With a
+ * NULL range only the counts are updated.
+ */
+void
+wrap_hidden_changed(struct buffer *buffer, struct line *first,
+    struct line *last)
+{
+	struct vline	*tail = NULL;
+	struct line	*l, *lastw;
+	size_t		 i, v0, v1, end, ntail = 0, top = 0, cur = 0;
+	int		 hastop, hascur;
+
+	wrap_join(buffer);
+
+	/* the range of vlines to redo, if any */
+	v0 = v1 = buffer->vlines_len;
+	for (l = first; l != NULL; l = TAILQ_NEXT(l, lines)) {
+		if (l->vline < buffer->vlines_len &&
+		    buffer->vlines[l->vline].parent == l &&
+		    (buffer->vlines[l->vline].flags & L_FOLDED) &&
+		    !(l->flags & L_HIDDEN) && v0 == buffer->vlines_len)
+			v0 = l->vline;
+		if (l == last)
+			break;
+	}
+	if (v0 != buffer->vlines_len && last != NULL &&
+	    last->vline < buffer->vlines_len &&
+	    buffer->vlines[last->vline].parent == last) {
+		v1 = last->vline + 1;
+		while (v1 < buffer->vlines_len &&
+		    buffer->vlines[v1].parent == last)
+			v1++;
+	} else
+		v0 = v1;
+
+	if (v0 < v1) {
+		hastop = buffer->top_line != NULL;
+		hascur = buffer->current_line != NULL;
+		if (hastop)
+			top = vline_index(buffer, buffer->top_line);
+		if (hascur)
+			cur = vline_index(buffer, buffer->current_line);
+
+		ntail = buffer->vlines_len - v1;
+		if (ntail != 0) {
+			tail = xreallocarray(NULL, ntail, sizeof(*tail));
+			memcpy(tail, &buffer->vlines[v1],
+			    ntail * sizeof(*tail));
+		}
+
+		lastw = buffer->last_wrapped;
+		buffer->top_line = NULL;
+		buffer->current_line = NULL;
+		buffer->vlines_len = v0;
+		for (l = buffer->vlines[v0].parent; l != NULL;
+		    l = TAILQ_NEXT(l, lines)) {
+			wrap_line(buffer, l, buffer->wrap_width);
+			if (l == last)
+				break;
+		}
+		buffer->last_wrapped = lastw;
+
+		end = buffer->vlines_len;
+		for (i = 0; i < ntail; ++i) {
+			if (buffer->vlines_len == buffer->vlines_cap)
+				vlines_grow(buffer);
+			buffer->vlines[buffer->vlines_len] = tail[i];
+			if (!(tail[i].flags & L_CONTINUATION))
+				tail[i].parent->vline = buffer->vlines_len;
+			buffer->vlines_len++;
+		}
+		free(tail);
+
+		/* a cursor in the range goes to its start */
+		if (top >= v1)
+			top = end + top - v1;
+		else if (top > v0)
+			top = v0;
+		if (cur >= v1)
+			cur = end + cur - v1;
+		else if (cur > v0)
+			cur = v0;
+		if (hastop)
+			buffer->top_line = &buffer->vlines[top];
+		if (hascur)
+			buffer->current_line = &buffer->vlines[cur];
+	}
+
+	buffer->line_max = 0;
+	for (i = 0; i < buffer->vlines_len; ++i)
+		if (!(buffer->vlines[i].parent->flags & L_HIDDEN))
+			buffer->line_max++;
+	vline_hidden_changed(buffer);
+	if (buffer->top_line != NULL)
+		buffer->line_off = vline_visible_index(buffer,
+		    buffer->top_line);
+	buffer->force_redraw = 1;
+}
+
+/*
+ * Wrap again a line whose text was changed in place, like the ones
+ * of the downloads pane.  If it was and still is on a single row its
+ * vline is just replaced, otherwise the whole buffer is wrapped.
+ */
+void
+wrap_line_update(struct buffer *buffer, struct line *l)
+{
+	struct vline	*vl, *next;
+	struct line	*last;
+	size_t		 len, max;
+	uint32_t	 idx;
+	int		 single;
+
+	l->layout = NULL;
+
+	if ((vl = line_vline(buffer, l)) == NULL ||
+	    ((next = vline_next(buffer, vl)) != NULL && next->parent == l)) {
+		wrap_page(buffer, buffer->wrap_width);
+		return;
+	}
+
+	idx = l->vline;
+	len = buffer->vlines_len;
+	max = buffer->line_max;
+	last = buffer->last_wrapped;
+
+	wrap_line(buffer, l, buffer->wrap_width);
+	if ((single = buffer->vlines_len == len + 1))
+		buffer->vlines[idx] = buffer->vlines[len];
+
+	buffer->vlines_len = len;
+	buffer->line_max = max;
+	buffer->last_wrapped = last;
+	l->vline = idx;
+
+	if (!single)
+		wrap_page(buffer, buffer->wrap_width);
+}
+
+/*
+ * Wrap at most max of the lines appended to the buffer since the
+ * last call to wrap_page or wrap_page_tail, keeping the current
+ * position.  Falls back to a full wrap_page if the width,
+ * fill-column or dont-wrap-pre changed in the meantime.  Returns 1
+ * if there are still lines left to wrap, 0 otherwise.
+ */
+int
+wrap_page_tail(struct buffer *buffer, int width, size_t max)
+{
+	struct line	*l;
+	uint64_t	 t;
+
+	wrap_join(buffer);
+
+	if (buffer->last_wrapped == NULL) {
+		/* nothing to redo */
+		buffer->wrap_width = width;
+		buffer->wrap_fill_column = fill_column;
+		buffer->wrap_pre = !dont_wrap_pre;
+	} else if (buffer->wrap_width != width ||
+	    buffer->wrap_fill_column != fill_column ||
+	    buffer->wrap_pre != !dont_wrap_pre) {
+		wrap_page(buffer, width);
+		return 0;
+	}
+
+	if (buffer->last_wrapped == NULL)
+		l = TAILQ_FIRST(&buffer->head);
+	else
+		l = TAILQ_NEXT(buffer->last_wrapped, lines);
+
+	t = perf_usec();
+	for (; l != NULL && max > 0; l = TAILQ_NEXT(l, lines), max--)
+		wrap_line(buffer, l, width);
+	perf_count(PERF_WRAP, perf_usec() - t);
+
+	if (buffer->current_line == NULL)
+		buffer->current_line = vline_first(buffer);
 
 	if (buffer->top_line == NULL)
 		buffer->top_line = buffer->current_line;
 
+	return l != NULL;
+}
+
+/*
+ * True if some lines are yet to be wrapped, and not by a job in the
+ * pool.
+ */
+int
+wrap_pending(struct buffer *buffer)
+{
+	if (buffer->wrap_job != NULL)
+		return 0;
+	if (buffer->last_wrapped == NULL)
+		return !TAILQ_EMPTY(&buffer->head);
+	return TAILQ_NEXT(buffer->last_wrapped, lines) != NULL;
+}
+
+/* wrap all the lines left out by wrap_page_tail */
+void
+wrap_page_finish(struct buffer *buffer)
+{
+	if (wrap_pending(buffer))
+		wrap_page_tail(buffer, buffer->wrap_width, SIZE_MAX);
+}
+
+static uint64_t
+line_hash(struct line *l, size_t *len)
+{
+	uint64_t	 h = FNV1A_INIT;
+	size_t		 n;
+
+	h = fnv1a(h, &l->type, sizeof(l->type));
+	*len = 0;
+	if (l->line != NULL) {
+		n = strlen(l->line) + 1;
+		h = fnv1a(h, l->line, n);
+		*len = n;
+	}
+	if (l->alt != NULL)
+		h = fnv1a(h, l->alt, strlen(l->alt) + 1);
+	return h;
+}
+
+/*
+ * Remember how the buffer is wrapped and where it's scrolled to,
+ * before a new version of the page replaces it.
+ */
+void
+relayout_save(struct buffer *buffer, struct relayout *rl)
+{
+	struct line	*l;
+	size_t		 i, n = 0, top, cur;
+
+	memset(rl, 0, sizeof(*rl));
+	wrap_page_finish(buffer);
+	if (buffer->vlines_len == 0)
+		return;
+
+	TAILQ_FOREACH(l, &buffer->head, lines)
+		n++;
+
+	rl->hash = xcalloc(n, sizeof(*rl->hash));
+	rl->len = xcalloc(n, sizeof(*rl->len));
+	rl->first = xcalloc(n + 1, sizeof(*rl->first));
+	rl->vlines = xreallocarray(NULL, buffer->vlines_len,
+	    sizeof(*rl->vlines));
+	memcpy(rl->vlines, buffer->vlines,
+	    buffer->vlines_len * sizeof(*rl->vlines));
+	rl->nlines = n;
+	rl->width = buffer->wrap_width;
+	rl->fill_column = buffer->wrap_fill_column;
+	rl->pre = buffer->wrap_pre;
+	rl->emojify = emojify_link;
+
+	top = buffer->top_line ? vline_index(buffer, buffer->top_line) : 0;
+	cur = buffer->current_line ?
+	    vline_index(buffer, buffer->current_line) : 0;
+
+	/* the vlines are in the same order of the lines */
+	i = 0;
+	n = 0;
+	TAILQ_FOREACH(l, &buffer->head, lines) {
+		rl->hash[n] = line_hash(l, &rl->len[n]);
+		rl->first[n] = i;
+		while (i < buffer->vlines_len && buffer->vlines[i].parent == l)
+			i++;
+		if (top >= rl->first[n] && top < i) {
+			rl->top = n;
+			rl->topdelta = top - rl->first[n];
+		}
+		if (cur >= rl->first[n] && cur < i) {
+			rl->cur = n;
+			rl->curdelta = cur - rl->first[n];
+		}
+		n++;
+	}
+	rl->first[n] = i;
+}
+
+void
+relayout_free(struct relayout *rl)
+{
+	free(rl->hash);
+	free(rl->len);
+	free(rl->first);
+	free(rl->vlines);
+	memset(rl, 0, sizeof(*rl));
+}
+
+/* the new line at i, in a range that matched, was the old line j */
+static size_t
+relayout_map(size_t i, size_t prefix, size_t suffix, size_t n, size_t o)
+{
+	if (i < prefix)
+		return i;
+	if (i >= n - suffix)
+		return i - n + o;
+	return SIZE_MAX;
+}
+
+/*
+ * Whether the old line old ended up in the new line that was the old
+ * j, or SIZE_MAX if it's a new one.
+ */
+static int
+relayout_lands(size_t j, size_t old, size_t prefix, size_t suffix, size_t o)
+{
+	if (j == SIZE_MAX)
+		return old >= prefix && old < o - suffix;
+	return j >= old;
+}
+
+static void
+relayout_move(struct buffer *buffer, struct line **lines, size_t line,
+    size_t delta, struct vline **vl)
+{
+	struct vline	*v;
+	size_t		 i;
+
+	v = line_vline(buffer, lines[line]);
+	for (i = 0; v != NULL && i < delta; ++i) {
+		if (v + 1 >= buffer->vlines + buffer->vlines_len ||
+		    v[1].parent != lines[line])
+			break;
+		v++;
+	}
+	*vl = v;
+}
+
+/*
+ * Wrap the buffer, just filled with a new version of the page saved
+ * in rl, reusing the vlines of the lines that didn't change: only
+ * what's between the common head and tail of the two versions is
+ * wrapped again.  The scroll position follows the line it was on.
+ * Returns 0 if the page was wrapped for other settings than the
+ * current ones, or another width: the saved vlines are stale then,
+ * and the page is wrapped again from scratch.
+ */
+int
+relayout_apply(struct buffer *buffer, struct relayout *rl, int width)
+{
+	struct line	*l, **lines;
+	struct vline	*vl, *ovl;
+	uint64_t	*hash;
+	size_t		*len;
+	size_t		 i, j, k, n = 0, o = rl->nlines, prefix, suffix;
+	uint64_t	 t;
+
+	wrap_join(buffer);
+
+	if (rl->vlines == NULL)
+		return 0;
+
+	if (rl->width != width || rl->fill_column != fill_column ||
+	    rl->pre != !dont_wrap_pre || rl->emojify != emojify_link) {
+		wrap_page(buffer, width);
+		return 0;
+	}
+
+	TAILQ_FOREACH(l, &buffer->head, lines)
+		n++;
+	if (n == 0)
+		return 0;
+
+	t = perf_usec();
+
+	lines = xcalloc(n, sizeof(*lines));
+	hash = xcalloc(n, sizeof(*hash));
+	len = xcalloc(n, sizeof(*len));
+	i = 0;
+	TAILQ_FOREACH(l, &buffer->head, lines) {
+		lines[i] = l;
+		hash[i] = line_hash(l, &len[i]);
+		i++;
+	}
+
+#define SAME(a, b)	(hash[a] == rl->hash[b] && len[a] == rl->len[b])
+	for (prefix = 0; prefix < n && prefix < o; ++prefix)
+		if (!SAME(prefix, prefix))
+			break;
+	for (suffix = 0; suffix < n - prefix && suffix < o - prefix; ++suffix)
+		if (!SAME(n - suffix - 1, o - suffix - 1))
+			break;
+#undef SAME
+
+	buffer->top_line = NULL;
+	buffer->current_line = NULL;
+	buffer->force_redraw = 1;
+	buffer->curs_y = 0;
+	buffer->line_off = 0;
+	empty_vlist(buffer);
+
+	buffer->wrap_width = width;
+	buffer->wrap_fill_column = rl->fill_column;
+	buffer->wrap_pre = rl->pre;
+
+	for (i = 0; i < n; ++i) {
+		l = lines[i];
+		/* a hunk may have been opened or closed meanwhile */
+		j = relayout_map(i, prefix, suffix, n, o);
+		if (j == SIZE_MAX || (rl->first[j] != rl->first[j + 1] &&
+		    !(rl->vlines[rl->first[j]].flags & L_FOLDED) !=
+		    !((l->flags & L_HIDDEN) && LINE_HUNK_BODY(l->type)))) {
+			wrap_line(buffer, l, width);
+			continue;
+		}
+
+		for (k = rl->first[j]; k < rl->first[j + 1]; ++k) {
+			ovl = &rl->vlines[k];
+
+			if (!(l->flags & L_HIDDEN))
+				buffer->line_max++;
+			if (buffer->vlines_len == buffer->vlines_cap)
+				vlines_grow(buffer);
+			vl = &buffer->vlines[buffer->vlines_len++];
+			*vl = *ovl;
+			vl->parent = l;
+			if (!(vl->flags & L_CONTINUATION))
+				l->vline = buffer->vlines_len - 1;
+		}
+		buffer->last_wrapped = l;
+	}
+
+	/* where the old top and current line ended up */
+	for (i = 0; i < n; ++i) {
+		j = relayout_map(i, prefix, suffix, n, o);
+		if (buffer->top_line == NULL &&
+		    relayout_lands(j, rl->top, prefix, suffix, o))
+			relayout_move(buffer, lines, i,
+			    j == rl->top ? rl->topdelta : 0,
+			    &buffer->top_line);
+		if (buffer->current_line == NULL &&
+		    relayout_lands(j, rl->cur, prefix, suffix, o))
+			relayout_move(buffer, lines, i,
+			    j == rl->cur ? rl->curdelta : 0,
+			    &buffer->current_line);
+	}
+
+	if (buffer->current_line == NULL)
+		buffer->current_line = vline_first(buffer);
+	if (buffer->top_line == NULL)
+		buffer->top_line = buffer->current_line;
+	buffer->line_off = vline_visible_index(buffer, buffer->top_line);
+
+	perf_count(PERF_WRAP, perf_usec() - t);
+
+	free(lines);
+	free(hash);
+	free(len);
 	return 1;
 }
+
+static void *
+wrap_worker(void *arg)
+{
+	struct wrap_job	*job;
+	uint64_t	 t;
+
+	pthread_mutex_lock(&wrap_mtx);
+	for (;;) {
+		TAILQ_FOREACH(job, &wrap_jobs, jobs)
+			if (job->state == JOB_QUEUED)
+				break;
+		if (job == NULL) {
+			pthread_cond_wait(&wrap_cond, &wrap_mtx);
+			continue;
+		}
+
+		job->state = JOB_RUNNING;
+		pthread_mutex_unlock(&wrap_mtx);
+
+		t = perf_usec();
+		wrap_lines(&job->shadow, job->width);
+		job->usec = perf_usec() - t;
+
+		pthread_mutex_lock(&wrap_mtx);
+		job->state = JOB_DONE;
+		pthread_cond_broadcast(&wrap_done);
+	}
+
+	return NULL;
+}
+
+/*
+ * Queue the wrapping of a buffer that's not shown in the pool.  The
+ * threads are started on the first call: by then the process is
+ * already sandboxed.  Returns 0 if wrap-threads is off or no thread
+ * could be started, and the buffer is left as it was.
+ */
+int
+wrap_page_async(struct buffer *buffer, int width)
+{
+	struct wrap_job	*job;
+	pthread_t	 t;
+
+	wrap_join(buffer);
+
+	for (; wrap_nthreads < wrap_threads; wrap_nthreads++) {
+		if (pthread_create(&t, NULL, wrap_worker, NULL) != 0)
+			break;
+		pthread_detach(t);
+	}
+	if (wrap_nthreads == 0)
+		return 0;
+
+	job = xcalloc(1, sizeof(*job));
+	job->buffer = buffer;
+	job->width = width;
+	job->state = JOB_QUEUED;
+
+	job->shadow = *buffer;
+	job->shadow.vlines = NULL;
+	job->shadow.vlines_len = 0;
+	job->shadow.vlines_cap = 0;
+	job->shadow.vis = NULL;
+	job->shadow.vis_cap = 0;
+	buffer->wrap_job = job;
+
+	pthread_mutex_lock(&wrap_mtx);
+	TAILQ_INSERT_TAIL(&wrap_jobs, job, jobs);
+	pthread_cond_signal(&wrap_cond);
+	pthread_mutex_unlock(&wrap_mtx);
+
+	return 1;
+}
+
+/*
+ * Wait for the job of the buffer, if any, and swap in the new vlines.
+ * A job that didn't start yet is just dropped: whoever needs the
+ * buffer wraps it by itself.
+ */
+void
+wrap_join(struct buffer *buffer)
+{
+	struct wrap_job	*job;
+	struct buffer	*s;
+
+	if ((job = buffer->wrap_job) == NULL)
+		return;
+	buffer->wrap_job = NULL;
+
+	pthread_mutex_lock(&wrap_mtx);
+	while (job->state == JOB_RUNNING)
+		pthread_cond_wait(&wrap_done, &wrap_mtx);
+	TAILQ_REMOVE(&wrap_jobs, job, jobs);
+	pthread_mutex_unlock(&wrap_mtx);
+
+	if (job->state == JOB_DONE) {
+		s = &job->shadow;
+
+		free(buffer->vlines);
+		free(buffer->vis);
+		buffer->vlines = s->vlines;
+		buffer->vlines_len = s->vlines_len;
+		buffer->vlines_cap = s->vlines_cap;
+		buffer->vis = s->vis;
+		buffer->vis_len = s->vis_len;
+		buffer->vis_cap = s->vis_cap;
+		buffer->vis_hidden = s->vis_hidden;
+
+		buffer->top_line = s->top_line;
+		buffer->current_line = s->current_line;
+		buffer->line_off = s->line_off;
+		buffer->line_max = s->line_max;
+		buffer->curs_y = s->curs_y;
+		buffer->force_redraw = 1;
+
+		buffer->last_wrapped = s->last_wrapped;
+		buffer->wrap_width = s->wrap_width;
+		buffer->wrap_fill_column = s->wrap_fill_column;
+		buffer->wrap_pre = s->wrap_pre;
+		buffer->line_arena = s->line_arena;
+
+		perf_count(PERF_WRAP, job->usec);
+	}
+
+	free(job);
+}
+
+/* join all the jobs, before changing how the pages are wrapped */
+void
+wrap_join_all(void)
+{
+	while (!TAILQ_EMPTY(&wrap_jobs))
+		wrap_join(TAILQ_FIRST(&wrap_jobs)->buffer);
+}